@@ -15,15 +15,31 @@ check_cxx_symbol_exists(CLOCK_MONOTONIC_RAW "time.h" HAVE_CLOCK_MONOTONIC_RAW)
 check_cxx_symbol_exists(CLOCK_MONOTONIC "time.h" HAVE_CLOCK_MONOTONIC)
 check_cxx_symbol_exists(mach_absolute_time "mach/mach.h;mach/mach_time.h" HAVE_MACH_ABSOLUTE_TIME)
 check_cxx_symbol_exists(inotify_init "sys/inotify.h" HAVE_INOTIFY)
+check_cxx_symbol_exists(FAN_REPORT_DFID_NAME "sys/fanotify.h" HAVE_FANOTIFY)
 check_cxx_symbol_exists(kqueue "sys/types.h;sys/event.h" HAVE_KQUEUE)
 check_cxx_symbol_exists(epoll_wait "sys/epoll.h" HAVE_EPOLL)
+check_cxx_symbol_exists(eventfd "sys/eventfd.h" HAVE_EVENTFD)
 check_cxx_symbol_exists(select "sys/select.h" HAVE_SELECT)
 check_cxx_symbol_exists(FD_CLOEXEC "fcntl.h" HAVE_CLOEXEC)
 check_cxx_symbol_exists(SO_NOSIGPIPE "sys/types.h;sys/socket.h" HAVE_NOSIGPIPE)
 check_cxx_symbol_exists(MSG_NOSIGNAL "sys/types.h;sys/socket.h" HAVE_NOSIGNAL)
+check_cxx_symbol_exists(accept4 "sys/types.h;sys/socket.h" HAVE_ACCEPT4)
+check_cxx_symbol_exists(recvmmsg "sys/types.h;sys/socket.h" HAVE_RECVMMSG)
+check_cxx_symbol_exists(sendmmsg "sys/types.h;sys/socket.h" HAVE_SENDMMSG)
+check_cxx_symbol_exists(UDP_GRO "netinet/udp.h" HAVE_UDP_GRO)
+check_cxx_symbol_exists(UDP_SEGMENT "netinet/udp.h" HAVE_UDP_SEGMENT)
+check_cxx_symbol_exists(sendfile "sys/sendfile.h" HAVE_SENDFILE)
+check_cxx_symbol_exists(mallinfo2 "malloc.h" HAVE_MALLINFO2)
 check_cxx_symbol_exists(GetLogicalProcessorInformation "windows.h" HAVE_PROCESSORINFORMATION)
 check_cxx_symbol_exists(SCHED_IDLE "pthread.h" HAVE_SCHEDIDLE)
 check_cxx_symbol_exists(SHM_DEST "sys/types.h;sys/ipc.h;sys/shm.h" HAVE_SHMDEST)
+check_cxx_symbol_exists(SYS_pidfd_open "sys/syscall.h" HAVE_PIDFD)
+check_cxx_symbol_exists(posix_spawn "spawn.h" HAVE_POSIX_SPAWN)
+check_cxx_symbol_exists(posix_spawn_file_actions_addchdir_np "spawn.h" HAVE_POSIX_SPAWN_CHDIR)
+# librt before glibc 2.34
+set(CMAKE_REQUIRED_LIBRARIES rt)
+check_cxx_symbol_exists(mq_open "mqueue.h" HAVE_MQUEUE)
+unset(CMAKE_REQUIRED_LIBRARIES)
 
 if (CYGWIN)
   message("-- Using win32 FileSystemWatcher")
@@ -47,6 +63,23 @@ if (CMAKE_SYSTEM_NAME MATCHES "Darwin")
   endif ()
 endif ()
 
+if (RCT_USE_IO_URING)
+  check_cxx_source_compiles("
+  #include <linux/io_uring.h>
+  #include <sys/syscall.h>
+  #include <unistd.h>
+  int main(int, char**) {
+      io_uring_params params;
+      io_uring_getevents_arg arg;
+      return syscall(__NR_io_uring_setup, 1, &params) + IORING_POLL_ADD_MULTI + IORING_FEAT_EXT_ARG + sizeof(arg);
+  }" HAVE_IO_URING)
+  if (HAVE_IO_URING)
+    message("-- Using io_uring, epoll where the kernel lacks it")
+  endif ()
+else ()
+  unset(HAVE_IO_URING CACHE)
+endif ()
+
 check_cxx_source_compiles("
   #include <sys/types.h>
   #include <sys/stat.h>
@@ -66,6 +99,22 @@ if (ZLIB_FOUND)
 else ()
     message("ZLIB Can't be found. Rct configured without zlib support")
 endif ()
+find_path(LZ4_INCLUDE_DIR lz4frame.h)
+find_library(LZ4_LIBRARY lz4)
+if (LZ4_INCLUDE_DIR AND LZ4_LIBRARY)
+    set(RCT_DEFINITIONS ${RCT_DEFINITIONS} -DRCT_HAVE_LZ4)
+    set(RCT_COMPRESSION_INCLUDE_DIRS ${RCT_COMPRESSION_INCLUDE_DIRS} ${LZ4_INCLUDE_DIR})
+    set(RCT_COMPRESSION_LIBRARIES ${RCT_COMPRESSION_LIBRARIES} ${LZ4_LIBRARY})
+    message("-- Using lz4")
+endif ()
+find_path(ZSTD_INCLUDE_DIR zstd.h)
+find_library(ZSTD_LIBRARY zstd)
+if (ZSTD_INCLUDE_DIR AND ZSTD_LIBRARY)
+    set(RCT_DEFINITIONS ${RCT_DEFINITIONS} -DRCT_HAVE_ZSTD)
+    set(RCT_COMPRESSION_INCLUDE_DIRS ${RCT_COMPRESSION_INCLUDE_DIRS} ${ZSTD_INCLUDE_DIR})
+    set(RCT_COMPRESSION_LIBRARIES ${RCT_COMPRESSION_LIBRARIES} ${ZSTD_LIBRARY})
+    message("-- Using zstd")
+endif ()
 find_package(OpenSSL REQUIRED)
 
 if (RCT_USE_DB)
@@ -103,34 +152,62 @@ int main() {
   endif ()
 endif ()
 
-include_directories(${CMAKE_CURRENT_LIST_DIR} ${RCT_INCLUDE_DIR} ${RCT_INCLUDE_DIR}/.. ${ZLIB_INCLUDE_DIRS} ${OPENSSL_INCLUDE_DIR})
+include_directories(${CMAKE_CURRENT_LIST_DIR} ${RCT_INCLUDE_DIR} ${RCT_INCLUDE_DIR}/.. ${ZLIB_INCLUDE_DIRS} ${RCT_COMPRESSION_INCLUDE_DIRS} ${OPENSSL_INCLUDE_DIR})
 set(RCT_SOURCES
   ${RCT_SOURCES}
   ${CMAKE_CURRENT_LIST_DIR}/rct/AES256CBC.cpp
+  ${CMAKE_CURRENT_LIST_DIR}/rct/AES256GCM.cpp
+  ${CMAKE_CURRENT_LIST_DIR}/rct/AtomicFile.cpp
+  ${CMAKE_CURRENT_LIST_DIR}/rct/BinaryValue.cpp
   ${CMAKE_CURRENT_LIST_DIR}/rct/Buffer.cpp
+  ${CMAKE_CURRENT_LIST_DIR}/rct/BufferPool.cpp
+  ${CMAKE_CURRENT_LIST_DIR}/rct/Channel.cpp
+  ${CMAKE_CURRENT_LIST_DIR}/rct/Compression.cpp
   ${CMAKE_CURRENT_LIST_DIR}/rct/Config.cpp
   ${CMAKE_CURRENT_LIST_DIR}/rct/Connection.cpp
+  ${CMAKE_CURRENT_LIST_DIR}/rct/ConnectionPool.cpp
   ${CMAKE_CURRENT_LIST_DIR}/rct/CpuUsage.cpp
+  ${CMAKE_CURRENT_LIST_DIR}/rct/DataFile.cpp
   ${CMAKE_CURRENT_LIST_DIR}/rct/EventLoop.cpp
+  ${CMAKE_CURRENT_LIST_DIR}/rct/EventLoopGroup.cpp
+  ${CMAKE_CURRENT_LIST_DIR}/rct/FileHashCache.cpp
   ${CMAKE_CURRENT_LIST_DIR}/rct/FileSystemWatcher.cpp
+  ${CMAKE_CURRENT_LIST_DIR}/rct/Future.cpp
+  ${CMAKE_CURRENT_LIST_DIR}/rct/GlobSet.cpp
+  ${CMAKE_CURRENT_LIST_DIR}/rct/HostResolver.cpp
+  ${CMAKE_CURRENT_LIST_DIR}/rct/IoStats.cpp
+  ${CMAKE_CURRENT_LIST_DIR}/rct/JSONParser.cpp
+  ${CMAKE_CURRENT_LIST_DIR}/rct/JSONWriter.cpp
+  ${CMAKE_CURRENT_LIST_DIR}/rct/LightweightSemaphore.cpp
   ${CMAKE_CURRENT_LIST_DIR}/rct/Log.cpp
+  ${CMAKE_CURRENT_LIST_DIR}/rct/MappedFile.cpp
   ${CMAKE_CURRENT_LIST_DIR}/rct/MemoryMonitor.cpp
   ${CMAKE_CURRENT_LIST_DIR}/rct/Message.cpp
   ${CMAKE_CURRENT_LIST_DIR}/rct/MessageQueue.cpp
+  ${CMAKE_CURRENT_LIST_DIR}/rct/Parallel.cpp
   ${CMAKE_CURRENT_LIST_DIR}/rct/Path.cpp
+  ${CMAKE_CURRENT_LIST_DIR}/rct/PathWalker.cpp
   ${CMAKE_CURRENT_LIST_DIR}/rct/Plugin.cpp
   ${CMAKE_CURRENT_LIST_DIR}/rct/Process.cpp
+  ${CMAKE_CURRENT_LIST_DIR}/rct/ProcessPool.cpp
+  ${CMAKE_CURRENT_LIST_DIR}/rct/Profiler.cpp
   ${CMAKE_CURRENT_LIST_DIR}/rct/Rct.cpp
   ${CMAKE_CURRENT_LIST_DIR}/rct/ReadWriteLock.cpp
   ${CMAKE_CURRENT_LIST_DIR}/rct/SHA256.cpp
   ${CMAKE_CURRENT_LIST_DIR}/rct/Semaphore.cpp
   ${CMAKE_CURRENT_LIST_DIR}/rct/SharedMemory.cpp
+  ${CMAKE_CURRENT_LIST_DIR}/rct/SharedRingBuffer.cpp
   ${CMAKE_CURRENT_LIST_DIR}/rct/SocketClient.cpp
   ${CMAKE_CURRENT_LIST_DIR}/rct/SocketServer.cpp
+  ${CMAKE_CURRENT_LIST_DIR}/rct/SpatialIndex.cpp
   ${CMAKE_CURRENT_LIST_DIR}/rct/String.cpp
+  ${CMAKE_CURRENT_LIST_DIR}/rct/StringPool.cpp
   ${CMAKE_CURRENT_LIST_DIR}/rct/Thread.cpp
+  ${CMAKE_CURRENT_LIST_DIR}/rct/ThreadLocal.cpp
   ${CMAKE_CURRENT_LIST_DIR}/rct/ThreadPool.cpp
   ${CMAKE_CURRENT_LIST_DIR}/rct/Timer.cpp
+  ${CMAKE_CURRENT_LIST_DIR}/rct/TlsContext.cpp
+  ${CMAKE_CURRENT_LIST_DIR}/rct/Trace.cpp
   ${CMAKE_CURRENT_LIST_DIR}/rct/Value.cpp
   ${CMAKE_CURRENT_LIST_DIR}/cJSON/cJSON.c)
 
@@ -185,7 +262,7 @@ if (CMAKE_SYSTEM_NAME MATCHES "Darwin")
   find_path(COREFOUNDATION_INCLUDE "CoreFoundation/CoreFoundation.h")
 endif ()
 
-set(RCT_LIBRARIES pthread ${ZLIB_LIBRARIES} ${V8_LIBS} ${DB_LIBS} ${OPENSSL_CRYPTO_LIBRARY})
+set(RCT_LIBRARIES pthread ${ZLIB_LIBRARIES} ${RCT_COMPRESSION_LIBRARIES} ${V8_LIBS} ${DB_LIBS} ${OPENSSL_SSL_LIBRARY} ${OPENSSL_CRYPTO_LIBRARY})
 if (CMAKE_SYSTEM_NAME MATCHES "Linux")
   list(APPEND RCT_LIBRARIES dl rt)
 endif ()
@@ -246,22 +323,48 @@ if (NOT RCT_NO_INSTALL)
   install(FILES
     ${CMAKE_CURRENT_BINARY_DIR}/include/rct/rct-config.h
     rct/AES256CBC.h
+    rct/AES256GCM.h
     rct/Apply.h
+    rct/AtomicFile.h
+    rct/BatchMessage.h
+    rct/BinaryValue.h
     rct/Buffer.h
+    rct/BufferPool.h
+    rct/Channel.h
+    rct/Compression.h
     rct/Config.h
     rct/Connection.h
+    rct/ConnectionPool.h
+    rct/Coroutine.h
     rct/EventLoop.h
+    rct/EventLoopGroup.h
+    rct/FileHashCache.h
     rct/FileSystemWatcher.h
+    rct/FlatHash.h
+    rct/FlatMap.h
+    rct/Future.h
+    rct/GlobSet.h
+    rct/HostResolver.h
+    rct/IoStats.h
+    rct/JSONParser.h
+    rct/JSONWriter.h
+    rct/LightweightSemaphore.h
     rct/List.h
+    rct/LRUCache.h
     rct/Log.h
     rct/Map.h
+    rct/MappedFile.h
     rct/MemoryMonitor.h
     rct/Message.h
     rct/MessageQueue.h
+    rct/Parallel.h
     rct/Path.h
+    rct/PathWalker.h
     rct/Plugin.h
     rct/Point.h
     rct/Process.h
+    rct/ProcessPool.h
+    rct/Profiler.h
     rct/Rct.h
     rct/ReadLocker.h
     rct/ReadWriteLock.h
@@ -272,16 +375,22 @@ if (NOT RCT_NO_INSTALL)
     rct/Serializer.h
     rct/Set.h
     rct/SharedMemory.h
+    rct/SharedRingBuffer.h
     rct/SignalSlot.h
     rct/Size.h
     rct/SocketClient.h
     rct/SocketServer.h
+    rct/SpatialIndex.h
     rct/StopWatch.h
     rct/String.h
+    rct/StringPool.h
+    rct/StringView.h
     rct/Thread.h
     rct/ThreadLocal.h
     rct/ThreadPool.h
     rct/Timer.h
+    rct/TlsContext.h
+    rct/Trace.h
     rct/Value.h
     rct/WriteLocker.h
     DESTINATION include/rct)
@@ -1,6 +1,8 @@
 #include "AES256CBC.h"
+#include "Buffer.h"
 #include "SHA256.h"
 #include <rct/Log.h>
+#include <algorithm>
 #ifdef OS_Darwin
 #include <CommonCrypto/CommonCryptor.h>
 #else
@@ -11,15 +13,15 @@
 class AES256CBCPrivate
 {
 public:
-    AES256CBCPrivate() : inited(false) { }
+    AES256CBCPrivate() : inited(false), current(0) { }
     ~AES256CBCPrivate();
 
     bool inited;
     unsigned char iv[32];
 #ifdef OS_Darwin
-    CCCryptorRef ectx, dctx;
+    CCCryptorRef ectx, dctx, current;
 #else
-    EVP_CIPHER_CTX ectx, dctx;
+    EVP_CIPHER_CTX *ectx, *dctx, *current;
 #endif
 };
 
@@ -31,8 +33,8 @@ AES256CBCPrivate::~AES256CBCPrivate()
     CCCryptorRelease(ectx);
     CCCryptorRelease(dctx);
 #else
-    EVP_CIPHER_CTX_cleanup(&ectx);
-    EVP_CIPHER_CTX_cleanup(&dctx);
+    EVP_CIPHER_CTX_free(ectx);
+    EVP_CIPHER_CTX_free(dctx);
 #endif
 }
 
@@ -72,10 +74,17 @@ AES256CBC::AES256CBC(const String& key, const unsigned char* salt)
     CCCryptorCreate(kCCDecrypt, kCCAlgorithmAES128, kCCOptionPKCS7Padding,
                     outkey, kCCKeySizeAES256, priv->iv, &priv->dctx);
 #else
-    EVP_CIPHER_CTX_init(&priv->ectx);
-    EVP_EncryptInit_ex(&priv->ectx, EVP_aes_256_cbc(), NULL, outkey, priv->iv);
-    EVP_CIPHER_CTX_init(&priv->dctx);
-    EVP_DecryptInit_ex(&priv->dctx, EVP_aes_256_cbc(), NULL, outkey, priv->iv);
+    // allocated once, each message only resets the IV
+    priv->ectx = EVP_CIPHER_CTX_new();
+    priv->dctx = EVP_CIPHER_CTX_new();
+    if (!priv->ectx || !priv->dctx
+        || !EVP_EncryptInit_ex(priv->ectx, EVP_aes_256_cbc(), NULL, outkey, priv->iv)
+        || !EVP_DecryptInit_ex(priv->dctx, EVP_aes_256_cbc(), NULL, outkey, priv->iv)) {
+        error("AES256CBC: couldn't set up the cipher");
+        EVP_CIPHER_CTX_free(priv->ectx);
+        EVP_CIPHER_CTX_free(priv->dctx);
+        return;
+    }
 #endif
 
     priv->inited = true;
@@ -86,48 +95,96 @@ AES256CBC::~AES256CBC()
     delete priv;
 }
 
-String AES256CBC::encrypt(const String& data)
+bool AES256CBC::begin(Direction direction)
 {
     if (!priv->inited)
-        return String();
+        return false;
 #ifdef OS_Darwin
-    size_t flen;
-    String out(data.size() + kCCBlockSizeAES128, '\0');
-    CCCryptorUpdate(priv->ectx, data.constData(), data.size(), out.data(), out.size(), &flen);
-    CCCryptorFinal(priv->ectx, out.data(), flen, &flen);
-    CCCryptorReset(priv->ectx, priv->iv);
-    out.resize(flen);
+    priv->current = direction == Encrypt ? priv->ectx : priv->dctx;
+    if (CCCryptorReset(priv->current, priv->iv) != kCCSuccess) {
+        priv->current = 0;
+        return false;
+    }
 #else
-    int elen = data.size() + AES_BLOCK_SIZE, flen;
-    String out(elen, '\0');
-    EVP_EncryptInit_ex(&priv->ectx, NULL, NULL, NULL, NULL);
-    EVP_EncryptUpdate(&priv->ectx, reinterpret_cast<unsigned char*>(out.data()), &elen,
-                      reinterpret_cast<const unsigned char*>(data.constData()), data.size());
-    EVP_EncryptFinal_ex(&priv->ectx, reinterpret_cast<unsigned char*>(out.data()) + elen, &flen);
-    out.resize(elen + flen);
+    priv->current = direction == Encrypt ? priv->ectx : priv->dctx;
+    if (!EVP_CipherInit_ex(priv->current, NULL, NULL, NULL, priv->iv, direction == Encrypt)) {
+        priv->current = 0;
+        return false;
+    }
 #endif
-    return out;
+    return true;
 }
 
-String AES256CBC::decrypt(const String& data)
+int AES256CBC::update(const char* in, int size, char* out)
 {
-    if (!priv->inited)
-        return String();
+    if (!priv->current)
+        return -1;
 #ifdef OS_Darwin
-    size_t flen;
-    String out(data.size() + kCCBlockSizeAES128, '\0');
-    CCCryptorUpdate(priv->dctx, data.constData(), data.size(), out.data(), out.size(), &flen);
-    CCCryptorFinal(priv->dctx, out.data(), flen, &flen);
-    CCCryptorReset(priv->dctx, priv->iv);
-    out.resize(flen);
+    size_t len;
+    if (CCCryptorUpdate(priv->current, in, size, out, size + BlockSize, &len) != kCCSuccess)
+        return -1;
 #else
-    int dlen = data.size(), flen;
-    String out(dlen + AES_BLOCK_SIZE, '\0');
-    EVP_DecryptInit_ex(&priv->dctx, NULL, NULL, NULL, NULL);
-    EVP_DecryptUpdate(&priv->dctx, reinterpret_cast<unsigned char*>(out.data()), &dlen,
-                      reinterpret_cast<const unsigned char*>(data.constData()), data.size());
-    EVP_DecryptFinal_ex(&priv->dctx, reinterpret_cast<unsigned char*>(out.data()) + dlen, &flen);
-    out.resize(dlen + flen);
+    int len;
+    if (!EVP_CipherUpdate(priv->current, reinterpret_cast<unsigned char*>(out), &len,
+                          reinterpret_cast<const unsigned char*>(in), size))
+        return -1;
 #endif
+    return static_cast<int>(len);
+}
+
+int AES256CBC::final(char* out)
+{
+    if (!priv->current)
+        return -1;
+#ifdef OS_Darwin
+    size_t len;
+    const bool ok = CCCryptorFinal(priv->current, out, BlockSize, &len) == kCCSuccess;
+#else
+    int len;
+    const bool ok = EVP_CipherFinal_ex(priv->current, reinterpret_cast<unsigned char*>(out), &len);
+#endif
+    // a new message needs begin()
+    priv->current = 0;
+    return ok ? static_cast<int>(len) : -1;
+}
+
+bool AES256CBC::update(const char* in, int size, Buffer& out)
+{
+    const unsigned int pos = out.size();
+    out.resize(pos + size + BlockSize);
+    const int len = update(in, size, reinterpret_cast<char*>(out.data()) + pos);
+    out.resize(pos + std::max(len, 0));
+    return len != -1;
+}
+
+bool AES256CBC::final(Buffer& out)
+{
+    const unsigned int pos = out.size();
+    out.resize(pos + BlockSize);
+    const int len = final(reinterpret_cast<char*>(out.data()) + pos);
+    out.resize(pos + std::max(len, 0));
+    return len != -1;
+}
+
+static inline String run(AES256CBC& cipher, AES256CBC::Direction direction, const String& data)
+{
+    if (!cipher.begin(direction))
+        return String();
+    String out(data.size() + AES256CBC::BlockSize, '\0');
+    const int len = cipher.update(data.constData(), data.size(), out.data());
+    const int flen = len == -1 ? -1 : cipher.final(out.data() + len);
+    if (flen == -1)
+        return String();
+    out.resize(len + flen);
     return out;
 }
+
+String AES256CBC::encrypt(const String& data)
+{
+    return run(*this, Encrypt, data);
+}
+
+String AES256CBC::decrypt(const String& data)
+{
+    return run(*this, Decrypt, data);
+}
@@ -4,6 +4,7 @@
 #include <rct/String.h>
 
 class AES256CBCPrivate;
+class Buffer;
 
 class AES256CBC
 {
@@ -11,9 +12,27 @@ public:
     AES256CBC(const String& key, const unsigned char* salt = 0);
     ~AES256CBC();
 
+    AES256CBC(const AES256CBC&) = delete;
+    AES256CBC& operator=(const AES256CBC&) = delete;
+
     String encrypt(const String& data);
     String decrypt(const String& data);
 
+    // One message in pieces through the same context, begin(), update()
+    // with each piece and then final(). update() writes up to size +
+    // BlockSize bytes to out and final() up to BlockSize, both return how
+    // many they wrote or -1. out may be in, with room for the extra block,
+    // when the whole message goes through one update() or it's fed whole
+    // blocks at a time
+    enum { BlockSize = 16 };
+    enum Direction { Encrypt, Decrypt };
+    bool begin(Direction direction);
+    int update(const char* in, int size, char* out);
+    int final(char* out);
+    // these append to out
+    bool update(const char* in, int size, Buffer& out);
+    bool final(Buffer& out);
+
 private:
     AES256CBCPrivate* priv;
 };
@@ -0,0 +1,183 @@
+#include "AES256GCM.h"
+#include "Buffer.h"
+#include <rct/Log.h>
+#include <string.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+
+class AES256GCMPrivate
+{
+public:
+    AES256GCMPrivate()
+        : ectx(0), dctx(0), current(0), counter(0)
+    {}
+    ~AES256GCMPrivate()
+    {
+        EVP_CIPHER_CTX_free(ectx);
+        EVP_CIPHER_CTX_free(dctx);
+    }
+
+    EVP_CIPHER_CTX *ectx, *dctx;
+    // the one a message is going through, 0 between messages
+    EVP_CIPHER_CTX *current;
+    unsigned char prefix[AES256GCM::NonceSize - sizeof(uint64_t)];
+    uint64_t counter;
+};
+
+AES256GCM::AES256GCM(const String& key)
+    : priv(new AES256GCMPrivate)
+{
+    if (key.size() != KeySize) {
+        error("AES256GCM: the key has to be %d bytes, not %d", KeySize, key.size());
+        return;
+    }
+    if (RAND_bytes(priv->prefix, sizeof(priv->prefix)) != 1) {
+        error("AES256GCM: couldn't pick a nonce prefix");
+        return;
+    }
+    const unsigned char* raw = reinterpret_cast<const unsigned char*>(key.constData());
+    priv->ectx = EVP_CIPHER_CTX_new();
+    priv->dctx = EVP_CIPHER_CTX_new();
+    // the default IV length is the NonceSize we use
+    if (!priv->ectx || !priv->dctx
+        || !EVP_EncryptInit_ex(priv->ectx, EVP_aes_256_gcm(), NULL, raw, NULL)
+        || !EVP_DecryptInit_ex(priv->dctx, EVP_aes_256_gcm(), NULL, raw, NULL)) {
+        error("AES256GCM: couldn't set up the cipher");
+        EVP_CIPHER_CTX_free(priv->ectx);
+        EVP_CIPHER_CTX_free(priv->dctx);
+        priv->ectx = priv->dctx = 0;
+    }
+}
+
+AES256GCM::~AES256GCM()
+{
+    delete priv;
+}
+
+bool AES256GCM::isValid() const
+{
+    return priv->ectx != 0;
+}
+
+bool AES256GCM::beginEncrypt(unsigned char* nonce)
+{
+    priv->current = 0;
+    if (!priv->ectx)
+        return false;
+    memcpy(nonce, priv->prefix, sizeof(priv->prefix));
+    const uint64_t counter = priv->counter++;
+    for (size_t i = 0; i < sizeof(counter); ++i)
+        nonce[sizeof(priv->prefix) + i] = static_cast<unsigned char>(counter >> ((sizeof(counter) - 1 - i) * 8));
+    if (!EVP_EncryptInit_ex(priv->ectx, NULL, NULL, NULL, nonce))
+        return false;
+    priv->current = priv->ectx;
+    return true;
+}
+
+bool AES256GCM::beginDecrypt(const unsigned char* nonce)
+{
+    priv->current = 0;
+    if (!priv->dctx || !EVP_DecryptInit_ex(priv->dctx, NULL, NULL, NULL, nonce))
+        return false;
+    priv->current = priv->dctx;
+    return true;
+}
+
+bool AES256GCM::addAuthenticatedData(const char* data, int size)
+{
+    int len;
+    return priv->current && EVP_CipherUpdate(priv->current, NULL, &len, reinterpret_cast<const unsigned char*>(data), size);
+}
+
+bool AES256GCM::update(const char* in, int size, char* out)
+{
+    if (!priv->current)
+        return false;
+    if (!size)
+        return true;
+    int len;
+    return EVP_CipherUpdate(priv->current, reinterpret_cast<unsigned char*>(out), &len,
+                            reinterpret_cast<const unsigned char*>(in), size) && len == size;
+}
+
+bool AES256GCM::finishEncrypt(unsigned char* tag)
+{
+    EVP_CIPHER_CTX* ctx = priv->current;
+    priv->current = 0;
+    int len;
+    // GCM doesn't hold anything back, there's nothing to write
+    return ctx == priv->ectx && ctx
+        && EVP_EncryptFinal_ex(ctx, tag, &len)
+        && EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, TagSize, tag);
+}
+
+bool AES256GCM::finishDecrypt(const unsigned char* tag)
+{
+    EVP_CIPHER_CTX* ctx = priv->current;
+    priv->current = 0;
+    unsigned char final[TagSize];
+    int len;
+    return ctx == priv->dctx && ctx
+        && EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, TagSize, const_cast<unsigned char*>(tag))
+        && EVP_DecryptFinal_ex(ctx, final, &len) > 0;
+}
+
+bool AES256GCM::encrypt(const char* data, int size, Buffer& out)
+{
+    const unsigned int pos = out.size();
+    out.resize(pos + size + Overhead);
+    unsigned char* nonce = out.data() + pos;
+    unsigned char* text = nonce + NonceSize;
+    if (beginEncrypt(nonce)
+        && update(data, size, reinterpret_cast<char*>(text))
+        && finishEncrypt(text + size)) {
+        return true;
+    }
+    out.resize(pos);
+    return false;
+}
+
+bool AES256GCM::decrypt(const char* data, int size, Buffer& out)
+{
+    if (size < Overhead)
+        return false;
+    const unsigned char* sealed = reinterpret_cast<const unsigned char*>(data);
+    const int textSize = size - Overhead;
+    const unsigned int pos = out.size();
+    out.resize(pos + textSize);
+    if (beginDecrypt(sealed)
+        && update(data + NonceSize, textSize, reinterpret_cast<char*>(out.data() + pos))
+        && finishDecrypt(sealed + NonceSize + textSize)) {
+        return true;
+    }
+    out.resize(pos);
+    return false;
+}
+
+String AES256GCM::encrypt(const String& data)
+{
+    String out(data.size() + Overhead, '\0');
+    unsigned char* nonce = reinterpret_cast<unsigned char*>(out.data());
+    unsigned char* text = nonce + NonceSize;
+    if (beginEncrypt(nonce)
+        && update(data.constData(), data.size(), reinterpret_cast<char*>(text))
+        && finishEncrypt(text + data.size())) {
+        return out;
+    }
+    return String();
+}
+
+String AES256GCM::decrypt(const String& data)
+{
+    if (data.size() < Overhead)
+        return String();
+    const unsigned char* sealed = reinterpret_cast<const unsigned char*>(data.constData());
+    const int textSize = data.size() - Overhead;
+    String out(textSize, '\0');
+    if (beginDecrypt(sealed)
+        && update(data.constData() + NonceSize, textSize, out.data())
+        && finishDecrypt(sealed + NonceSize + textSize)) {
+        return out;
+    }
+    return String();
+}
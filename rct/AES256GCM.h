@@ -0,0 +1,64 @@
+#ifndef AES256GCM_H
+#define AES256GCM_H
+
+#include <rct/String.h>
+#include <stdint.h>
+
+class AES256GCMPrivate;
+class Buffer;
+
+// Authenticated encryption with AES-256 in GCM mode, through OpenSSL on
+// every platform, which uses AES-NI and PCLMULQDQ or the ARMv8 crypto
+// extensions when the CPU has them. Unlike CBC, a message comes out the
+// same size as it went in, so it's encrypted in place, and it can't be
+// tampered with without decrypting failing.
+//
+// Each message gets a nonce of its own, a random prefix picked when the
+// object is created followed by a counter, so one object must not
+// encrypt more than 2^64 messages and two objects with the same key
+// mustn't share a prefix, which being random they practically won't. The
+// contexts are set up once with the key and reused for every message.
+class AES256GCM
+{
+public:
+    enum { KeySize = 32, NonceSize = 12, TagSize = 16 };
+
+    // key is KeySize raw bytes, use isValid() to see if it was
+    AES256GCM(const String& key);
+    ~AES256GCM();
+
+    AES256GCM(const AES256GCM&) = delete;
+    AES256GCM& operator=(const AES256GCM&) = delete;
+
+    bool isValid() const;
+
+    // Whole messages, sealed as nonce, ciphertext and tag, Overhead bytes
+    // bigger than they were. decrypt() returns an empty String, or false,
+    // if the message was tampered with or isn't one of these
+    enum { Overhead = NonceSize + TagSize };
+    String encrypt(const String& data);
+    String decrypt(const String& data);
+    // these append to out
+    bool encrypt(const char* data, int size, Buffer& out);
+    bool decrypt(const char* data, int size, Buffer& out);
+
+    // One message in pieces through the same context. beginEncrypt() picks
+    // the nonce and writes it to nonce, beginDecrypt() takes the one the
+    // message was encrypted with. addAuthenticatedData() covers data that
+    // goes along unencrypted, before any update(). update() writes exactly
+    // size bytes to out, which may be in, and returns false on failure.
+    // finishEncrypt() writes the tag, finishDecrypt() checks it and returns
+    // false if the message or the authenticated data were tampered with,
+    // in which case what update() wrote must be thrown away
+    bool beginEncrypt(unsigned char* nonce);
+    bool beginDecrypt(const unsigned char* nonce);
+    bool addAuthenticatedData(const char* data, int size);
+    bool update(const char* in, int size, char* out);
+    bool finishEncrypt(unsigned char* tag);
+    bool finishDecrypt(const unsigned char* tag);
+
+private:
+    AES256GCMPrivate* priv;
+};
+
+#endif
@@ -0,0 +1,226 @@
+#include "AtomicFile.h"
+#include "Rct.h"
+#include "Set.h"
+#include "ThreadPool.h"
+#include <atomic>
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// a name in dir that's unlikely to be taken, hidden so it's ignored if
+// it's left behind
+static Path tempName(const Path &path)
+{
+    static std::atomic<unsigned int> counter(0);
+    Path dir = path.parentDir();
+    int nameLength;
+    const char *name = path.fileName(&nameLength);
+    return dir + '.' + String(name, nameLength) + String::format<64>(".%d.%u.%llx", getpid(), counter++,
+                                                                      static_cast<unsigned long long>(Rct::monoMs()));
+}
+
+static inline Path directoryOf(const Path &path)
+{
+    const Path dir = path.parentDir();
+    return dir.isEmpty() ? Path(".") : dir;
+}
+
+#ifdef O_TMPFILE
+// commit() names an O_TMPFILE through /proc/self/fd, where /proc isn't
+// mounted it's a hidden file like everywhere else
+static bool haveProcFd()
+{
+    static const bool have = !access("/proc/self/fd", X_OK);
+    return have;
+}
+#endif
+
+AtomicFile::AtomicFile(const Path &path, int perm)
+    : mPath(path), mPerm(perm), mFd(-1)
+{
+}
+
+AtomicFile::~AtomicFile()
+{
+    discard();
+}
+
+bool AtomicFile::setError(const char *what)
+{
+    mError = String::format<256>("%s failure for %s %d (%s)", what, mPath.constData(), errno, Rct::strerror().constData());
+    return false;
+}
+
+bool AtomicFile::open()
+{
+    assert(mFd == -1);
+    // a file that's replaced keeps its permissions
+    struct stat st;
+    const bool keep = mPerm == -1 && !stat(mPath.constData(), &st);
+    const mode_t mode = keep ? (st.st_mode & 07777) : mPerm == -1 ? 0666 : static_cast<mode_t>(mPerm);
+#ifdef O_TMPFILE
+    // EOPNOTSUPP, EISDIR and friends where the file system can't
+    if (haveProcFd())
+        eintrwrap(mFd, ::open(directoryOf(mPath).constData(), O_TMPFILE | O_WRONLY | O_CLOEXEC, mode));
+#endif
+    if (mFd == -1) {
+        for (int i=0; i<100 && mFd == -1; ++i) {
+            mTempPath = tempName(mPath);
+            eintrwrap(mFd, ::open(mTempPath.constData(), O_CREAT | O_EXCL | O_WRONLY | O_CLOEXEC, mode));
+            if (mFd == -1 && errno != EEXIST)
+                break;
+        }
+        if (mFd == -1) {
+            mTempPath.clear();
+            return setError("open");
+        }
+    }
+    // the umask doesn't get to take away from what was asked for
+    if (mPerm != -1 || keep)
+        fchmod(mFd, mode);
+    return true;
+}
+
+bool AtomicFile::write(const void *data, size_t size)
+{
+    assert(mFd != -1);
+    const char *bytes = static_cast<const char *>(data);
+    while (size) {
+        ssize_t w;
+        eintrwrap(w, ::write(mFd, bytes, size));
+        if (w == -1)
+            return setError("write");
+        bytes += w;
+        size -= w;
+    }
+    return true;
+}
+
+bool AtomicFile::commit(SyncMode mode)
+{
+    assert(mFd != -1);
+    if (mode == SyncAll && fsync(mFd))
+        return setError("fsync");
+#if defined(OS_Linux)
+    if (mode == SyncData && fdatasync(mFd))
+        return setError("fdatasync");
+#else
+    if (mode == SyncData && fsync(mFd))
+        return setError("fsync");
+#endif
+
+    if (mTempPath.isEmpty()) {
+        char proc[64];
+        snprintf(proc, sizeof(proc), "/proc/self/fd/%d", mFd);
+        if (linkat(AT_FDCWD, proc, AT_FDCWD, mPath.constData(), AT_SYMLINK_FOLLOW)) {
+            if (errno != EEXIST)
+                return setError("linkat");
+            // linkat() won't replace anything, link it next to it and
+            // rename that over it
+            const Path temp = tempName(mPath);
+            if (linkat(AT_FDCWD, proc, AT_FDCWD, temp.constData(), AT_SYMLINK_FOLLOW))
+                return setError("linkat");
+            if (rename(temp.constData(), mPath.constData())) {
+                setError("rename");
+                unlink(temp.constData());
+                return false;
+            }
+        }
+    } else if (rename(mTempPath.constData(), mPath.constData())) {
+        return setError("rename");
+    } else {
+        mTempPath.clear();
+    }
+    ::close(mFd);
+    mFd = -1;
+    if (mode == SyncAll && !syncDirectory(directoryOf(mPath)))
+        return setError("fsync");
+    return true;
+}
+
+void AtomicFile::discard()
+{
+    if (mFd != -1) {
+        ::close(mFd);
+        mFd = -1;
+    }
+    if (!mTempPath.isEmpty()) {
+        unlink(mTempPath.constData());
+        mTempPath.clear();
+    }
+}
+
+bool AtomicFile::syncDirectory(const Path &dir)
+{
+    int fd;
+    eintrwrap(fd, ::open(dir.constData(), O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+    if (fd == -1)
+        return false;
+    const bool ret = !fsync(fd);
+    ::close(fd);
+    return ret;
+}
+
+void FileWriteBatch::add(const Path &path, const String &data, int perm)
+{
+    const File file = { path, data, perm };
+    mFiles.append(file);
+}
+
+void FileWriteBatch::add(const Path &path, String &&data, int perm)
+{
+    mFiles.append(File());
+    File &file = mFiles.back();
+    file.path = path;
+    file.data = std::move(data);
+    file.perm = perm;
+}
+
+List<Path> FileWriteBatch::write(List<File> &files, AtomicFile::SyncMode mode, String *error)
+{
+    List<Path> failed;
+    Set<Path> dirs;
+    // the directories are synced once, below
+    const AtomicFile::SyncMode fileMode = mode == AtomicFile::SyncAll ? AtomicFile::SyncData : mode;
+    for (File &file : files) {
+        AtomicFile atomic(file.path, file.perm);
+        if (!atomic.open() || !atomic.write(file.data) || !atomic.commit(fileMode)) {
+            if (error && error->isEmpty())
+                *error = atomic.error();
+            failed.append(file.path);
+            continue;
+        }
+        if (mode != AtomicFile::NoSync)
+            dirs.insert(directoryOf(file.path));
+        file.data.clear();
+    }
+    for (const Path &dir : dirs) {
+        if (!AtomicFile::syncDirectory(dir)) {
+            if (error && error->isEmpty())
+                *error = String::format<256>("fsync failure for %s %d (%s)", dir.constData(), errno, Rct::strerror().constData());
+            failed.append(dir);
+        }
+    }
+    return failed;
+}
+
+bool FileWriteBatch::commit()
+{
+    mError.clear();
+    mFailed = write(mFiles, mMode, &mError);
+    mFiles.clear();
+    return mFailed.isEmpty();
+}
+
+Future<List<Path> > FileWriteBatch::commitAsync(ThreadPool *pool)
+{
+    if (!pool)
+        pool = ThreadPool::instance();
+    std::shared_ptr<List<File> > files = std::make_shared<List<File> >(std::move(mFiles));
+    mFiles.clear();
+    const AtomicFile::SyncMode mode = mMode;
+    return pool->submit([files, mode]() {
+            return write(*files, mode, 0);
+        });
+}
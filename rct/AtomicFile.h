@@ -0,0 +1,101 @@
+#ifndef AtomicFile_h
+#define AtomicFile_h
+
+#include <rct/Future.h>
+#include <rct/List.h>
+#include <rct/Path.h>
+#include <rct/String.h>
+#include <sys/types.h>
+
+class ThreadPool;
+
+// Writes a file so that readers see the old contents or the new, never
+// part of it. On Linux the data goes to an O_TMPFILE that has no name until
+// commit() links it in, so nothing is left behind if we die half way.
+// Elsewhere, where the file system can't do that or without /proc mounted,
+// it's a hidden file next to the target that's renamed over it.
+class AtomicFile
+{
+public:
+    enum SyncMode {
+        NoSync,
+        // fdatasync() before it's put in place
+        SyncData,
+        // fsync() before and the directory after
+        SyncAll
+    };
+
+    // perm -1 keeps what the file it replaces had, or 0666 less the umask
+    // for a new one
+    AtomicFile(const Path &path, int perm = -1);
+    // discards it unless it was committed
+    ~AtomicFile();
+
+    AtomicFile(const AtomicFile &) = delete;
+    AtomicFile &operator=(const AtomicFile &) = delete;
+
+    bool open();
+    int fd() const { return mFd; }
+    bool write(const void *data, size_t size);
+    bool write(const String &data) { return write(data.constData(), data.size()); }
+    // puts it in place of path
+    bool commit(SyncMode mode = SyncData);
+    void discard();
+
+    const Path &path() const { return mPath; }
+    String error() const { return mError; }
+
+    static bool syncDirectory(const Path &dir);
+private:
+    bool setError(const char *what);
+
+    const Path mPath;
+    const int mPerm;
+    int mFd;
+    // the hidden file when there's no O_TMPFILE
+    Path mTempPath;
+    String mError;
+};
+
+// Many small files written atomically with one fsync() per directory
+// rather than one per file
+class FileWriteBatch
+{
+public:
+    // files are synced as with AtomicFile, with anything but NoSync the
+    // directories they're in are synced once at the end
+    FileWriteBatch(AtomicFile::SyncMode mode = AtomicFile::SyncData)
+        : mMode(mode)
+    {}
+
+    void add(const Path &path, const String &data, int perm = -1);
+    void add(const Path &path, String &&data, int perm = -1);
+    int count() const { return mFiles.size(); }
+    bool isEmpty() const { return mFiles.isEmpty(); }
+
+    // writes them all and empties the batch, false if any failed
+    bool commit();
+    // the same on pool, ThreadPool::instance() by default. The Future has
+    // the files that failed and finishes on the pool, hear about it on an
+    // EventLoop with then(loop, ...)
+    Future<List<Path> > commitAsync(ThreadPool *pool = 0);
+
+    // from the last commit()
+    const List<Path> &failed() const { return mFailed; }
+    String error() const { return mError; }
+private:
+    struct File
+    {
+        Path path;
+        String data;
+        int perm;
+    };
+    static List<Path> write(List<File> &files, AtomicFile::SyncMode mode, String *error);
+
+    const AtomicFile::SyncMode mMode;
+    List<File> mFiles;
+    List<Path> mFailed;
+    String mError;
+};
+
+#endif
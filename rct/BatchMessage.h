@@ -0,0 +1,36 @@
+#ifndef BatchMessage_h
+#define BatchMessage_h
+
+#include <rct/Message.h>
+#include <rct/String.h>
+
+// Complete frames, each with its size in front like on the socket, sent
+// as one. Connection packs small messages into these and takes them apart
+// again before anyone sees them, see Connection::setCoalescing(). It's told
+// apart by Message::BatchFlag rather than an id, it's never registered and
+// the id it goes with means nothing
+class BatchMessage : public Message
+{
+public:
+    BatchMessage(const String &frames = String())
+        : Message(0, BatchFlag), mFrames(frames)
+    {
+    }
+
+    static bool isBatch(const Message &message) { return message.flags() & BatchFlag; }
+
+    const String &frames() const { return mFrames; }
+    String &frames() { return mFrames; }
+
+    virtual int encodedSize() const override { return mFrames.size(); }
+    virtual void encode(Serializer &serializer) const override { serializer.write(mFrames.constData(), mFrames.size()); }
+    virtual void decode(Deserializer &deserializer) override
+    {
+        const int size = deserializer.length() - deserializer.pos();
+        mFrames.assign(deserializer.take(size), size);
+    }
+private:
+    String mFrames;
+};
+
+#endif
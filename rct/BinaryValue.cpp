@@ -0,0 +1,597 @@
+#include "BinaryValue.h"
+#include "FlatHash.h"
+#include <limits.h>
+
+namespace {
+// where Encoder writes, a String or a Serializer. A Serializer gets it in
+// chunks off the stack rather than a write() per byte
+class Output
+{
+public:
+    Output(String &out)
+        : mString(&out), mSerializer(0), mUsed(0)
+    {}
+    Output(Serializer &out)
+        : mString(0), mSerializer(&out), mUsed(0)
+    {}
+    ~Output() { flush(); }
+
+    void append(char ch) { append(&ch, 1); }
+    void append(const char *data, int len)
+    {
+        if (mString) {
+            mString->append(data, len);
+            return;
+        }
+        if (mUsed + len > ChunkSize) {
+            flush();
+            if (len > ChunkSize) {
+                mSerializer->write(data, len);
+                return;
+            }
+        }
+        memcpy(mChunk + mUsed, data, len);
+        mUsed += len;
+    }
+    void flush()
+    {
+        if (mUsed) {
+            mSerializer->write(mChunk, mUsed);
+            mUsed = 0;
+        }
+    }
+private:
+    enum { ChunkSize = 4096 };
+    String *mString;
+    Serializer *mSerializer;
+    int mUsed;
+    char mChunk[ChunkSize];
+};
+}
+
+static inline void writeVarint(Output &out, uint64_t value)
+{
+    char buf[10];
+    int len = 0;
+    while (value >= 0x80) {
+        buf[len++] = static_cast<char>(value | 0x80);
+        value >>= 7;
+    }
+    buf[len++] = static_cast<char>(value);
+    out.append(buf, len);
+}
+
+static inline int varintSize(uint64_t value)
+{
+    int ret = 1;
+    while (value >= 0x80) {
+        value >>= 7;
+        ++ret;
+    }
+    return ret;
+}
+
+static inline bool readVarint(const char *&p, const char *end, uint64_t &value)
+{
+    value = 0;
+    for (int shift = 0; shift < 64 && p < end; shift += 7) {
+        const unsigned char byte = *p++;
+        value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+        if (!(byte & 0x80))
+            return true;
+    }
+    return false;
+}
+
+static inline uint64_t zigzag(int64_t value)
+{
+    return (static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63);
+}
+
+static inline int64_t unzigzag(uint64_t value)
+{
+    return static_cast<int64_t>(value >> 1) ^ -static_cast<int64_t>(value & 1);
+}
+
+// moves p past the value it's on
+static bool skipValue(const char *&p, const char *end)
+{
+    if (p >= end)
+        return false;
+    uint64_t size;
+    switch (*p++) {
+    case BinaryValue::Tag_Invalid:
+    case BinaryValue::Tag_Undefined:
+    case BinaryValue::Tag_False:
+    case BinaryValue::Tag_True:
+        return true;
+    case BinaryValue::Tag_Integer:
+        return readVarint(p, end, size);
+    case BinaryValue::Tag_Double:
+        size = sizeof(double);
+        break;
+    case BinaryValue::Tag_String:
+        if (!readVarint(p, end, size))
+            return false;
+        break;
+    case BinaryValue::Tag_List:
+    case BinaryValue::Tag_Map: {
+        uint64_t count;
+        if (!readVarint(p, end, count) || !readVarint(p, end, size))
+            return false;
+        break; }
+    default:
+        return false;
+    }
+    if (size > static_cast<uint64_t>(end - p))
+        return false;
+    p += size;
+    return true;
+}
+
+static bool readKey(const char *&p, const char *end, const List<StringView> &dictionary, StringView &key)
+{
+    uint64_t code;
+    if (!readVarint(p, end, code))
+        return false;
+    if (code & 1) {
+        if ((code >> 1) >= static_cast<uint64_t>(dictionary.size()))
+            return false;
+        key = dictionary[code >> 1];
+        return true;
+    }
+    const uint64_t size = code >> 1;
+    if (size > static_cast<uint64_t>(end - p))
+        return false;
+    key = StringView(p, size);
+    p += size;
+    return true;
+}
+
+// the same order as String's operator<
+static inline int compare(const StringView &a, const StringView &b)
+{
+    const int size = std::min(a.size(), b.size());
+    const int ret = size ? memcmp(a.constData(), b.constData(), size) : 0;
+    if (ret)
+        return ret;
+    return a.size() < b.size() ? -1 : (a.size() > b.size() ? 1 : 0);
+}
+
+static bool decode(const char *&p, const char *end, const List<StringView> &dictionary, Value &value)
+{
+    if (p >= end)
+        return false;
+    uint64_t num;
+    switch (*p++) {
+    case BinaryValue::Tag_Invalid:
+        value.clear();
+        return true;
+    case BinaryValue::Tag_Undefined:
+        value = Value::undefined();
+        return true;
+    case BinaryValue::Tag_False:
+    case BinaryValue::Tag_True:
+        value = Value(p[-1] == BinaryValue::Tag_True);
+        return true;
+    case BinaryValue::Tag_Integer:
+        if (!readVarint(p, end, num))
+            return false;
+        value = Value(unzigzag(num));
+        return true;
+    case BinaryValue::Tag_Double: {
+        if (end - p < static_cast<int>(sizeof(double)))
+            return false;
+        double d;
+        memcpy(&d, p, sizeof(d));
+        p += sizeof(d);
+        value = Value(d);
+        return true; }
+    case BinaryValue::Tag_String:
+        if (!readVarint(p, end, num) || num > static_cast<uint64_t>(end - p))
+            return false;
+        value = Value(p, static_cast<int>(num));
+        p += num;
+        return true;
+    case BinaryValue::Tag_List: {
+        uint64_t size;
+        if (!readVarint(p, end, num) || !readVarint(p, end, size) || size > static_cast<uint64_t>(end - p))
+            return false;
+        const char *listEnd = p + size;
+        value.clear();
+        List<Value> &list = value.listRef();
+        // every element is at least a byte
+        list.reserve(std::min<uint64_t>(num, size));
+        for (uint64_t i = 0; i < num; ++i) {
+            list.append(Value());
+            if (!decode(p, listEnd, dictionary, list.back()))
+                return false;
+        }
+        return p == listEnd; }
+    case BinaryValue::Tag_Map: {
+        uint64_t size;
+        if (!readVarint(p, end, num) || !readVarint(p, end, size) || size > static_cast<uint64_t>(end - p))
+            return false;
+        const char *mapEnd = p + size;
+        value.clear();
+        Map<String, Value> &map = value.mapRef();
+        StringView key;
+        for (uint64_t i = 0; i < num; ++i) {
+            if (!readKey(p, mapEnd, dictionary, key))
+                return false;
+            // sorted, each one goes at the end
+            auto it = map.emplace_hint(map.end(), key.toString(), Value());
+            if (!decode(p, mapEnd, dictionary, it->second))
+                return false;
+        }
+        return p == mapEnd; }
+    }
+    return false;
+}
+
+namespace {
+class Encoder
+{
+public:
+    Encoder()
+        : mOut(0), mCount(0), mCursor(0)
+    {}
+
+    // works out the dictionary and the sizes, returns how big the whole
+    // thing is going to be
+    uint64_t prepare(const Value &value)
+    {
+        collect(value);
+        // what's used more than once goes in the dictionary in the order
+        // it was first seen, the rest is written where it's used
+        uint32_t count = 0;
+        for (const StringView &key : mOrder) {
+            uint32_t &code = mKeys[key];
+            code = code > 1 ? (count++ << 1) | 1 : 0;
+        }
+        mCount = count;
+        uint64_t size = varintSize(count);
+        for (const StringView &key : mOrder) {
+            if (mKeys[key])
+                size += varintSize(key.size()) + key.size();
+        }
+        return size + measure(value);
+    }
+
+    void encode(Output &out, const Value &value)
+    {
+        mOut = &out;
+        writeVarint(out, mCount);
+        for (const StringView &key : mOrder) {
+            if (mKeys[key]) {
+                writeVarint(out, key.size());
+                out.append(key.constData(), key.size());
+            }
+        }
+        write(value);
+    }
+private:
+    void collect(const Value &value)
+    {
+        if (value.isMap()) {
+            for (const auto &entry : value.mapRef()) {
+                uint32_t &uses = mKeys[entry.first];
+                if (!uses++)
+                    mOrder.append(entry.first);
+                collect(entry.second);
+            }
+        } else if (value.isList()) {
+            for (const Value &v : value.listRef())
+                collect(v);
+        }
+    }
+
+    int keySize(const StringView &key)
+    {
+        const uint32_t code = mKeys[key];
+        if (code)
+            return varintSize(code);
+        return varintSize(static_cast<uint64_t>(key.size()) << 1) + key.size();
+    }
+
+    // the size of value, containers are numbered in the order write()
+    // gets to them and their content sizes recorded in mSizes
+    uint64_t measure(const Value &value)
+    {
+        switch (value.type()) {
+        case Value::Type_Integer:
+            return 1 + varintSize(zigzag(value.toInt64()));
+        case Value::Type_Double:
+            return 1 + sizeof(double);
+        case Value::Type_String: {
+            const int size = value.stringRef().size();
+            return 1 + varintSize(size) + size; }
+        case Value::Type_List:
+        case Value::Type_Map: {
+            const int idx = mSizes.size();
+            mSizes.append(0);
+            uint64_t size = 0;
+            if (value.isList()) {
+                for (const Value &v : value.listRef())
+                    size += measure(v);
+            } else {
+                for (const auto &entry : value.mapRef())
+                    size += keySize(entry.first) + measure(entry.second);
+            }
+            mSizes[idx] = size;
+            return 1 + varintSize(value.count()) + varintSize(size) + size; }
+        default:
+            return 1;
+        }
+    }
+
+    void write(const Value &value)
+    {
+        switch (value.type()) {
+        case Value::Type_Invalid:
+        case Value::Type_Custom:
+            // pointers don't survive the trip
+            mOut->append(static_cast<char>(BinaryValue::Tag_Invalid));
+            break;
+        case Value::Type_Undefined:
+            mOut->append(static_cast<char>(BinaryValue::Tag_Undefined));
+            break;
+        case Value::Type_Boolean:
+            mOut->append(static_cast<char>(value.toBool() ? BinaryValue::Tag_True : BinaryValue::Tag_False));
+            break;
+        case Value::Type_Integer:
+            mOut->append(static_cast<char>(BinaryValue::Tag_Integer));
+            writeVarint(*mOut, zigzag(value.toInt64()));
+            break;
+        case Value::Type_Double: {
+            mOut->append(static_cast<char>(BinaryValue::Tag_Double));
+            const double d = value.toDouble();
+            mOut->append(reinterpret_cast<const char*>(&d), sizeof(d));
+            break; }
+        case Value::Type_String: {
+            const String &string = value.stringRef();
+            mOut->append(static_cast<char>(BinaryValue::Tag_String));
+            writeVarint(*mOut, string.size());
+            mOut->append(string.constData(), string.size());
+            break; }
+        case Value::Type_List:
+            mOut->append(static_cast<char>(BinaryValue::Tag_List));
+            writeVarint(*mOut, value.count());
+            writeVarint(*mOut, mSizes[mCursor++]);
+            for (const Value &v : value.listRef())
+                write(v);
+            break;
+        case Value::Type_Map:
+            mOut->append(static_cast<char>(BinaryValue::Tag_Map));
+            writeVarint(*mOut, value.count());
+            writeVarint(*mOut, mSizes[mCursor++]);
+            for (const auto &entry : value.mapRef()) {
+                const uint32_t code = mKeys[entry.first];
+                if (code) {
+                    writeVarint(*mOut, code);
+                } else {
+                    writeVarint(*mOut, static_cast<uint64_t>(entry.first.size()) << 1);
+                    mOut->append(entry.first.constData(), entry.first.size());
+                }
+                write(entry.second);
+            }
+            break;
+        }
+    }
+
+    Output *mOut;
+    uint32_t mCount;
+    // uses, then the key's code
+    FlatHash<StringView, uint32_t> mKeys;
+    List<StringView> mOrder;
+    List<uint64_t> mSizes;
+    int mCursor;
+};
+}
+
+void Value::toBinary(String &out) const
+{
+    Encoder encoder;
+    encoder.prepare(*this);
+    Output output(out);
+    encoder.encode(output, *this);
+}
+
+void Value::toBinary(Serializer &serializer) const
+{
+    Encoder encoder;
+    const uint64_t size = encoder.prepare(*this);
+    if (size > INT_MAX) {
+        error() << "Value too big to serialize" << size;
+        serializer << static_cast<uint32_t>(0);
+        return;
+    }
+    serializer << static_cast<uint32_t>(size);
+    Output output(serializer);
+    encoder.encode(output, *this);
+}
+
+Value Value::fromBinary(const char *data, int size, bool *ok)
+{
+    return BinaryValue(data, size).toValue(ok);
+}
+
+Value Value::fromBinary(Deserializer &deserializer, bool *ok)
+{
+    uint32_t size;
+    deserializer >> size;
+    if (size > static_cast<uint32_t>(std::max(deserializer.length() - deserializer.pos(), 0))) {
+        if (ok)
+            *ok = false;
+        return Value();
+    }
+    if (deserializer.isFile()) {
+        String data(size, '\0');
+        deserializer.read(data.data(), size);
+        return fromBinary(data.constData(), size, ok);
+    }
+    // decoded where it is
+    return fromBinary(deserializer.take(size), size, ok);
+}
+
+BinaryValue::BinaryValue(const char *data, int size)
+    : mData(0), mEnd(0)
+{
+    const char *p = data;
+    const char *end = data + size;
+    uint64_t count;
+    // each key takes at least a byte
+    if (!readVarint(p, end, count) || count > static_cast<uint64_t>(end - p))
+        return;
+    std::shared_ptr<Dictionary> dictionary(new Dictionary);
+    dictionary->keys.reserve(count);
+    for (uint64_t i = 0; i < count; ++i) {
+        uint64_t len;
+        if (!readVarint(p, end, len) || len > static_cast<uint64_t>(end - p))
+            return;
+        dictionary->keys.append(StringView(p, len));
+        p += len;
+    }
+    if (p == end)
+        return;
+    mData = p;
+    mEnd = end;
+    mDictionary = dictionary;
+}
+
+Value::Type BinaryValue::type() const
+{
+    if (!mData)
+        return Value::Type_Invalid;
+    switch (*mData) {
+    case Tag_Undefined: return Value::Type_Undefined;
+    case Tag_False:
+    case Tag_True: return Value::Type_Boolean;
+    case Tag_Integer: return Value::Type_Integer;
+    case Tag_Double: return Value::Type_Double;
+    case Tag_String: return Value::Type_String;
+    case Tag_List: return Value::Type_List;
+    case Tag_Map: return Value::Type_Map;
+    }
+    return Value::Type_Invalid;
+}
+
+bool BinaryValue::toBool() const
+{
+    if (!mData)
+        return false;
+    switch (*mData) {
+    case Tag_True: return true;
+    case Tag_Integer: return toInt64() != 0;
+    case Tag_Double: return toDouble() != 0;
+    }
+    return false;
+}
+
+int64_t BinaryValue::toInt64() const
+{
+    if (!mData)
+        return 0;
+    switch (*mData) {
+    case Tag_True: return 1;
+    case Tag_Integer: {
+        const char *p = mData + 1;
+        uint64_t value;
+        return readVarint(p, mEnd, value) ? unzigzag(value) : 0; }
+    case Tag_Double: return static_cast<int64_t>(toDouble());
+    }
+    return 0;
+}
+
+double BinaryValue::toDouble() const
+{
+    if (!mData)
+        return 0;
+    switch (*mData) {
+    case Tag_True: return 1;
+    case Tag_Integer: return static_cast<double>(toInt64());
+    case Tag_Double: {
+        double ret = 0;
+        if (mEnd - mData > static_cast<int>(sizeof(double)))
+            memcpy(&ret, mData + 1, sizeof(ret));
+        return ret; }
+    }
+    return 0;
+}
+
+StringView BinaryValue::toStringView() const
+{
+    if (!mData || *mData != Tag_String)
+        return StringView();
+    const char *p = mData + 1;
+    uint64_t size;
+    if (!readVarint(p, mEnd, size) || size > static_cast<uint64_t>(mEnd - p))
+        return StringView();
+    return StringView(p, size);
+}
+
+const char *BinaryValue::entries(uint64_t *count, const char **end) const
+{
+    if (!mData || (*mData != Tag_List && *mData != Tag_Map))
+        return 0;
+    const char *p = mData + 1;
+    uint64_t size;
+    if (!readVarint(p, mEnd, *count) || !readVarint(p, mEnd, size) || size > static_cast<uint64_t>(mEnd - p))
+        return 0;
+    *end = p + size;
+    return p;
+}
+
+int BinaryValue::count() const
+{
+    uint64_t count;
+    const char *end;
+    return entries(&count, &end) ? static_cast<int>(count) : 0;
+}
+
+BinaryValue BinaryValue::operator[](const StringView &key) const
+{
+    uint64_t count;
+    const char *end;
+    const char *p = entries(&count, &end);
+    if (!p || *mData != Tag_Map)
+        return BinaryValue();
+    StringView k;
+    for (uint64_t i = 0; i < count; ++i) {
+        if (!readKey(p, end, mDictionary->keys, k))
+            break;
+        const int cmp = compare(k, key);
+        if (!cmp)
+            return BinaryValue(p, end, mDictionary);
+        // sorted, it's not coming
+        if (cmp > 0 || !skipValue(p, end))
+            break;
+    }
+    return BinaryValue();
+}
+
+BinaryValue BinaryValue::at(int idx) const
+{
+    uint64_t count;
+    const char *end;
+    const char *p = entries(&count, &end);
+    if (!p || *mData != Tag_List || idx < 0 || static_cast<uint64_t>(idx) >= count)
+        return BinaryValue();
+    for (int i = 0; i < idx; ++i) {
+        if (!skipValue(p, end))
+            return BinaryValue();
+    }
+    return BinaryValue(p, end, mDictionary);
+}
+
+Value BinaryValue::toValue(bool *ok) const
+{
+    Value ret;
+    const char *p = mData;
+    const bool success = mData && decode(p, mEnd, mDictionary->keys, ret);
+    if (ok)
+        *ok = success;
+    if (!success)
+        return Value();
+    return ret;
+}
@@ -0,0 +1,95 @@
+#ifndef BinaryValue_h
+#define BinaryValue_h
+
+#include <rct/List.h>
+#include <rct/StringView.h>
+#include <rct/Value.h>
+#include <memory>
+#include <stdint.h>
+
+// The compact binary form of a Value, what Value::toBinary() writes and
+// what a Serializer gets for Value::Binary(value), after a uint32_t size:
+//
+//   varint      number of keys in the dictionary
+//   keys        each a varint length and the bytes
+//   value
+//
+// A value is a tag byte and then for
+//
+//   Integer     a zigzag varint
+//   Double      8 bytes, native byte order like the rest of Serializer
+//   String      a varint length and the bytes
+//   List        varint count, varint size in bytes of the elements, elements
+//   Map         varint count, varint size in bytes of the entries, entries
+//
+// Map entries are sorted by key, each a key and a value. A key is a varint,
+// dictionary index << 1 | 1 or length << 1 followed by the bytes. Keys that
+// are used more than once go in the dictionary.
+//
+// BinaryValue reads this in place. Looking up a path only touches the
+// containers on the way, the byte sizes let it step over everything else.
+// It points into the data it was given and so do the StringViews it hands
+// out.
+class BinaryValue
+{
+public:
+    enum Tag {
+        Tag_Invalid,
+        Tag_Undefined,
+        Tag_False,
+        Tag_True,
+        Tag_Integer,
+        Tag_Double,
+        Tag_String,
+        Tag_List,
+        Tag_Map
+    };
+
+    BinaryValue()
+        : mData(0), mEnd(0)
+    {}
+    // invalid if the header is malformed, the rest is checked as it's read
+    BinaryValue(const char *data, int size);
+    explicit BinaryValue(const StringView &data)
+        : BinaryValue(data.constData(), data.size())
+    {}
+
+    bool isValid() const { return mData != 0; }
+    Value::Type type() const;
+    bool isNull() const { return type() == Value::Type_Invalid; }
+    bool isMap() const { return isValid() && *mData == Tag_Map; }
+    bool isList() const { return isValid() && *mData == Tag_List; }
+
+    bool toBool() const;
+    int64_t toInt64() const;
+    double toDouble() const;
+    // a view of the data, empty for anything but a string
+    StringView toStringView() const;
+    // number of entries in a map or list
+    int count() const;
+
+    // invalid if there's no such key or index
+    BinaryValue operator[](const StringView &key) const;
+    BinaryValue operator[](const char *key) const { return operator[](StringView(key)); }
+    BinaryValue at(int idx) const;
+
+    // decodes this part of the tree
+    Value toValue(bool *ok = 0) const;
+private:
+    struct Dictionary
+    {
+        List<StringView> keys;
+    };
+
+    BinaryValue(const char *data, const char *end, const std::shared_ptr<const Dictionary> &dictionary)
+        : mData(data), mEnd(end), mDictionary(dictionary)
+    {}
+    // where the container's entries start, 0 if this isn't one
+    const char *entries(uint64_t *count, const char **end) const;
+
+    // the value at mData and where it ends
+    const char *mData, *mEnd;
+    std::shared_ptr<const Dictionary> mDictionary;
+};
+
+#endif
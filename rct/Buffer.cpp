@@ -1,5 +1,54 @@
 #include "Buffer.h"
 #include <stdio.h>
+#include <unistd.h>
+#include <algorithm>
+
+unsigned int Buffer::capacityFor(unsigned int sz) const
+{
+    static const unsigned int page = sysconf(_SC_PAGESIZE);
+    switch (growthPolicy()) {
+    case Exact:
+        break;
+    case PageRounded:
+        return (sz + page - 1) / page * page;
+    case Geometric:
+        return std::max(sz, bufferReserved + bufferReserved / 2);
+    case Pooled:
+        return BufferPool::chunkSize(sz);
+    }
+    return sz;
+}
+
+void Buffer::reallocate(unsigned int capacity)
+{
+    if (growthPolicy() != Pooled && !bufferPooled) {
+        bufferData = static_cast<unsigned char*>(realloc(bufferData, capacity));
+        if (!bufferData)
+            abort();
+        MemoryMonitor::add(memoryTag(), static_cast<int64_t>(capacity) - bufferReserved);
+        bufferReserved = capacity;
+        return;
+    }
+
+    // to or from the pool, realloc() can't help
+    const bool pooled = growthPolicy() == Pooled;
+    if (pooled)
+        capacity = BufferPool::chunkSize(capacity);
+    unsigned char* data = static_cast<unsigned char*>(pooled ? BufferPool::acquire(capacity) : malloc(capacity));
+    if (!data)
+        abort();
+    // all of it, like realloc(), readers fill what's reserved before they
+    // resize to what they got
+    const unsigned int size = bufferSize;
+    if (bufferData)
+        memcpy(data, bufferData, std::min(bufferReserved, capacity));
+    release();
+    bufferData = data;
+    bufferSize = size;
+    bufferReserved = capacity;
+    bufferPooled = pooled;
+    MemoryMonitor::add(memoryTag(), capacity);
+}
 
 bool Buffer::load(const String& filename)
 {
@@ -2,14 +2,42 @@
 #define BUFFER_H
 
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
+#include <rct/BufferPool.h>
+#include <rct/MemoryMonitor.h>
 #include <rct/String.h>
 
+// What a Buffer has reserved is counted in MemoryMonitor under its tag. A
+// Buffer that's moved from another takes its tag along, one that's moved to
+// keeps its own and the bytes are counted there from then on.
+//
+// How a Buffer grows is up to its growth policy, which stays with the
+// Buffer when its memory is moved elsewhere. Memory from BufferPool goes
+// back there whichever Buffer ends up with it.
 class Buffer
 {
 public:
+    enum GrowthPolicy {
+        // reserve() and resize() get exactly what they ask for
+        Exact,
+        // rounded up to whole pages
+        PageRounded,
+        // at least half again as much each time, for appending
+        Geometric,
+        // BufferPool's chunks, powers of two that are kept for the next
+        // Buffer rather than freed
+        Pooled
+    };
+
     Buffer()
-        : bufferData(0), bufferSize(0), bufferReserved(0)
+        : bufferData(0), bufferSize(0), bufferReserved(0), bufferTag(MemoryMonitor::Buffers),
+          bufferGrowth(Exact), bufferPooled(false)
+    {
+    }
+    explicit Buffer(MemoryMonitor::Tag tag, GrowthPolicy growth = Exact)
+        : bufferData(0), bufferSize(0), bufferReserved(0), bufferTag(tag),
+          bufferGrowth(growth), bufferPooled(false)
     {
     }
     Buffer(Buffer&& other)
@@ -17,37 +45,55 @@ public:
         bufferData = other.bufferData;
         bufferSize = other.bufferSize;
         bufferReserved = other.bufferReserved;
+        bufferTag = other.bufferTag;
+        bufferGrowth = other.bufferGrowth;
+        bufferPooled = other.bufferPooled;
         other.bufferData = 0;
         other.bufferSize = 0;
         other.bufferReserved = 0;
+        other.bufferPooled = false;
     }
     ~Buffer()
     {
-        if (bufferData)
-            free(bufferData);
+        release();
     }
 
     Buffer& operator=(Buffer&& other)
     {
+        if (this == &other)
+            return *this;
+        release();
         bufferData = other.bufferData;
         bufferSize = other.bufferSize;
         bufferReserved = other.bufferReserved;
+        bufferPooled = other.bufferPooled;
+        MemoryMonitor::move(other.memoryTag(), memoryTag(), bufferReserved);
         other.bufferData = 0;
         other.bufferSize = 0;
         other.bufferReserved = 0;
+        other.bufferPooled = false;
         return *this;
     }
 
+    MemoryMonitor::Tag memoryTag() const { return static_cast<MemoryMonitor::Tag>(bufferTag); }
+    void setMemoryTag(MemoryMonitor::Tag tag)
+    {
+        MemoryMonitor::move(memoryTag(), tag, bufferReserved);
+        bufferTag = tag;
+    }
+
+    GrowthPolicy growthPolicy() const { return static_cast<GrowthPolicy>(bufferGrowth); }
+    void setGrowthPolicy(GrowthPolicy growth) { bufferGrowth = growth; }
+
     bool isEmpty() const { return !bufferSize; }
 
+    // Big ones let go of their memory, pooled ones give it back to the
+    // pool so the next burst doesn't start from malloc
     void clear()
     {
         enum { ClearThreshold = 1024 * 512 };
-        if (bufferSize >= ClearThreshold) {
-            free(bufferData);
-            bufferData = 0;
-            bufferReserved = 0;
-        }
+        if (bufferSize >= ClearThreshold)
+            release();
         bufferSize = 0;
     }
 
@@ -55,10 +101,7 @@ public:
     {
         if (sz <= bufferReserved)
             return;
-        bufferData = static_cast<unsigned char*>(realloc(bufferData, sz));
-        if (!bufferData)
-            abort();
-        bufferReserved = sz;
+        reallocate(capacityFor(sz));
     }
 
     void resize(unsigned int sz)
@@ -67,14 +110,20 @@ public:
             clear();
             return;
         }
-        if (sz >= bufferSize && sz <= bufferReserved) {
+        // only Exact gives memory back when shrinking
+        if (sz <= bufferReserved && (sz >= bufferSize || bufferGrowth != Exact)) {
             bufferSize = sz;
             return;
         }
-        bufferData = static_cast<unsigned char*>(realloc(bufferData, sz));
-        if (!bufferData)
-            abort();
-        bufferSize = bufferReserved = sz;
+        reallocate(sz > bufferReserved ? capacityFor(sz) : sz);
+        bufferSize = sz;
+    }
+
+    void append(const void* data, unsigned int sz)
+    {
+        reserve(bufferSize + sz);
+        memcpy(bufferData + bufferSize, data, sz);
+        bufferSize += sz;
     }
 
     unsigned int size() const { return bufferSize; }
@@ -87,8 +136,29 @@ public:
     bool load(const String& filename);
 
 private:
+    unsigned int capacityFor(unsigned int sz) const;
+    // to capacity bytes, keeping what fits
+    void reallocate(unsigned int capacity);
+    void release()
+    {
+        if (!bufferData)
+            return;
+        if (bufferPooled) {
+            BufferPool::release(bufferData, bufferReserved);
+        } else {
+            free(bufferData);
+        }
+        MemoryMonitor::add(memoryTag(), -static_cast<int64_t>(bufferReserved));
+        bufferData = 0;
+        bufferReserved = 0;
+        bufferPooled = false;
+    }
+
     unsigned char* bufferData;
     unsigned int bufferSize, bufferReserved;
+    uint8_t bufferTag, bufferGrowth;
+    // whether bufferData is a BufferPool chunk
+    bool bufferPooled;
 
 private:
     Buffer(const Buffer& other) = delete;
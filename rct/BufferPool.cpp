@@ -0,0 +1,280 @@
+#include "BufferPool.h"
+#include "MemoryMonitor.h"
+#include "Log.h"
+#include "Rct.h"
+#include "rct-config.h"
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace {
+// MinChunk to MaxPooledChunk
+enum { ClassCount = 11 };
+
+struct FreeChunk
+{
+    void *data;
+    // false once trimming has given its pages back
+    bool resident;
+};
+
+struct SizeClass
+{
+    SizeClass()
+        : lastUsed(0)
+    {}
+
+    std::mutex mutex;
+    std::vector<FreeChunk> chunks;
+    uint64_t lastUsed;
+};
+
+std::atomic<size_t> sMaxFree(64 * 1024 * 1024);
+std::atomic<size_t> sFree(0);
+std::atomic<int> sIdleTrim(10000);
+std::atomic<bool> sHugePages(false);
+std::atomic<uint64_t> sNextSweep(0);
+std::atomic<uint64_t> sAcquired(0), sReused(0), sTrimmed(0);
+}
+
+// never destroyed, Buffers in statics give their chunks back at exit
+static SizeClass *sizeClasses()
+{
+    static SizeClass *classes = new SizeClass[ClassCount];
+    return classes;
+}
+
+static int classFor(size_t chunk)
+{
+    if (chunk < BufferPool::MinChunk || chunk > BufferPool::MaxPooledChunk || chunk & (chunk - 1))
+        return -1;
+    int index = 0;
+    while ((static_cast<size_t>(BufferPool::MinChunk) << index) < chunk)
+        ++index;
+    return index;
+}
+
+static size_t pageSize()
+{
+    static const size_t size = sysconf(_SC_PAGESIZE);
+    return size;
+}
+
+static void *allocate(size_t chunk)
+{
+    if (chunk < BufferPool::MapThreshold) {
+        void *data = malloc(chunk);
+        if (!data)
+            abort();
+        return data;
+    }
+    const bool huge = chunk >= BufferPool::HugePageSize && sHugePages.load(std::memory_order_relaxed);
+    // room to line it up with a huge page
+    const size_t extra = huge ? BufferPool::HugePageSize : 0;
+    void *mapped = mmap(0, chunk + extra, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mapped == MAP_FAILED) {
+        ::error() << "BufferPool: Couldn't map" << chunk << "bytes" << Rct::strerror();
+        abort();
+    }
+    char *data = static_cast<char *>(mapped);
+    if (huge) {
+        const size_t head = (BufferPool::HugePageSize - reinterpret_cast<uintptr_t>(data) % BufferPool::HugePageSize) % BufferPool::HugePageSize;
+        if (head)
+            munmap(data, head);
+        if (extra - head)
+            munmap(data + head + chunk, extra - head);
+        data += head;
+#ifdef MADV_HUGEPAGE
+        madvise(data, chunk, MADV_HUGEPAGE);
+#endif
+    }
+    return data;
+}
+
+static void deallocate(void *data, size_t chunk)
+{
+    if (chunk < BufferPool::MapThreshold) {
+        free(data);
+    } else {
+        munmap(data, chunk);
+    }
+}
+
+// everything in sizeClass goes, or loses its pages if it's mapped
+static void trimClass(SizeClass &sizeClass, size_t chunk)
+{
+    if (chunk < BufferPool::MapThreshold) {
+        for (const FreeChunk &free : sizeClass.chunks)
+            deallocate(free.data, chunk);
+        const size_t bytes = sizeClass.chunks.size() * chunk;
+        sFree.fetch_sub(bytes, std::memory_order_relaxed);
+        MemoryMonitor::add(MemoryMonitor::PooledBuffers, -static_cast<int64_t>(bytes));
+        sTrimmed.fetch_add(bytes, std::memory_order_relaxed);
+        sizeClass.chunks.clear();
+        return;
+    }
+    for (FreeChunk &free : sizeClass.chunks) {
+        if (!free.resident)
+            continue;
+        madvise(free.data, chunk, MADV_DONTNEED);
+        free.resident = false;
+        MemoryMonitor::add(MemoryMonitor::PooledBuffers, -static_cast<int64_t>(chunk));
+        sTrimmed.fetch_add(chunk, std::memory_order_relaxed);
+    }
+}
+
+static void trimIdle(uint64_t now, uint64_t idleNs)
+{
+    SizeClass *classes = sizeClasses();
+    for (int i=0; i<ClassCount; ++i) {
+        std::lock_guard<std::mutex> lock(classes[i].mutex);
+        if (!idleNs || now - classes[i].lastUsed >= idleNs)
+            trimClass(classes[i], static_cast<size_t>(BufferPool::MinChunk) << i);
+    }
+}
+
+// one thread at a time gets to sweep, once per idle period
+static void maybeSweep(uint64_t now)
+{
+    const int idle = sIdleTrim.load(std::memory_order_relaxed);
+    if (!idle)
+        return;
+    uint64_t next = sNextSweep.load(std::memory_order_relaxed);
+    const uint64_t idleNs = static_cast<uint64_t>(idle) * 1000000;
+    if (now < next || !sNextSweep.compare_exchange_strong(next, now + idleNs, std::memory_order_relaxed))
+        return;
+    trimIdle(now, idleNs);
+}
+
+size_t BufferPool::chunkSize(size_t size)
+{
+    if (size <= MinChunk)
+        return MinChunk;
+    if (size <= MaxPooledChunk) {
+        size_t chunk = MinChunk;
+        while (chunk < size)
+            chunk <<= 1;
+        return chunk;
+    }
+    const size_t align = sHugePages.load(std::memory_order_relaxed) ? static_cast<size_t>(HugePageSize) : pageSize();
+    return (size + align - 1) / align * align;
+}
+
+void *BufferPool::acquire(size_t chunk)
+{
+    sAcquired.fetch_add(1, std::memory_order_relaxed);
+    const uint64_t now = Rct::monoNs();
+    const int index = classFor(chunk);
+    if (index != -1) {
+        SizeClass &sizeClass = sizeClasses()[index];
+        FreeChunk free = { 0, false };
+        {
+            std::lock_guard<std::mutex> lock(sizeClass.mutex);
+            sizeClass.lastUsed = now;
+            if (!sizeClass.chunks.empty()) {
+                free = sizeClass.chunks.back();
+                sizeClass.chunks.pop_back();
+            }
+        }
+        if (free.data) {
+            sReused.fetch_add(1, std::memory_order_relaxed);
+            sFree.fetch_sub(chunk, std::memory_order_relaxed);
+            if (free.resident)
+                MemoryMonitor::add(MemoryMonitor::PooledBuffers, -static_cast<int64_t>(chunk));
+            maybeSweep(now);
+            return free.data;
+        }
+    }
+    maybeSweep(now);
+    return allocate(chunk);
+}
+
+void BufferPool::release(void *data, size_t chunk)
+{
+    if (!data)
+        return;
+    const int index = classFor(chunk);
+    if (index == -1) {
+        deallocate(data, chunk);
+        return;
+    }
+    if (sFree.fetch_add(chunk, std::memory_order_relaxed) + chunk > sMaxFree.load(std::memory_order_relaxed)) {
+        sFree.fetch_sub(chunk, std::memory_order_relaxed);
+        deallocate(data, chunk);
+        return;
+    }
+    MemoryMonitor::add(MemoryMonitor::PooledBuffers, chunk);
+    const uint64_t now = Rct::monoNs();
+    SizeClass &sizeClass = sizeClasses()[index];
+    {
+        std::lock_guard<std::mutex> lock(sizeClass.mutex);
+        sizeClass.lastUsed = now;
+        const FreeChunk free = { data, true };
+        sizeClass.chunks.push_back(free);
+    }
+    maybeSweep(now);
+}
+
+void BufferPool::setMaxFree(size_t bytes)
+{
+    sMaxFree.store(bytes);
+    // what's over goes, biggest first
+    SizeClass *classes = sizeClasses();
+    for (int i=ClassCount - 1; i>=0 && sFree.load() > bytes; --i) {
+        const size_t chunk = static_cast<size_t>(MinChunk) << i;
+        std::lock_guard<std::mutex> lock(classes[i].mutex);
+        while (!classes[i].chunks.empty() && sFree.load() > bytes) {
+            const FreeChunk free = classes[i].chunks.back();
+            classes[i].chunks.pop_back();
+            sFree.fetch_sub(chunk);
+            if (free.resident)
+                MemoryMonitor::add(MemoryMonitor::PooledBuffers, -static_cast<int64_t>(chunk));
+            deallocate(free.data, chunk);
+        }
+    }
+}
+
+size_t BufferPool::maxFree()
+{
+    return sMaxFree.load();
+}
+
+void BufferPool::setIdleTrim(int idleMs)
+{
+    sIdleTrim.store(std::max(idleMs, 0));
+}
+
+int BufferPool::idleTrim()
+{
+    return sIdleTrim.load();
+}
+
+void BufferPool::trim(int idleMs)
+{
+    trimIdle(Rct::monoNs(), static_cast<uint64_t>(std::max(idleMs, 0)) * 1000000);
+}
+
+void BufferPool::setHugePages(bool on)
+{
+    sHugePages.store(on);
+}
+
+bool BufferPool::hugePages()
+{
+    return sHugePages.load();
+}
+
+BufferPool::Stats BufferPool::stats()
+{
+    Stats stats;
+    stats.acquired = sAcquired.load(std::memory_order_relaxed);
+    stats.reused = sReused.load(std::memory_order_relaxed);
+    stats.free = sFree.load(std::memory_order_relaxed);
+    stats.resident = std::max<int64_t>(MemoryMonitor::allocated(MemoryMonitor::PooledBuffers), 0);
+    stats.trimmed = sTrimmed.load(std::memory_order_relaxed);
+    return stats;
+}
@@ -0,0 +1,68 @@
+#ifndef BufferPool_h
+#define BufferPool_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Chunks of memory for Buffers that go back here rather than to malloc
+// when the Buffer is done with them, so a socket or connection that takes
+// a burst, drops it and takes another doesn't reallocate every time.
+//
+// Chunks come in size classes, powers of two from MinChunk up to
+// MaxPooledChunk, each with a free list shared by all threads. From
+// MapThreshold up they're mapped rather than malloc'd, so trimming can
+// give their pages back with madvise() and keep the mapping for the next
+// one. Anything over MaxPooledChunk is whole pages and isn't kept.
+//
+// What sits in the free lists is counted in MemoryMonitor::PooledBuffers.
+class BufferPool
+{
+public:
+    enum {
+        MinChunk = 4096,
+        MapThreshold = 64 * 1024,
+        MaxPooledChunk = 4 * 1024 * 1024,
+        HugePageSize = 2 * 1024 * 1024
+    };
+
+    // what a chunk that holds size bytes takes
+    static size_t chunkSize(size_t size);
+    // chunk has to be what chunkSize() said
+    static void *acquire(size_t chunk);
+    static void release(void *data, size_t chunk);
+
+    // how much the free lists may hold all together, a release that
+    // would go over gives its chunk back instead. 64MB unless set
+    static void setMaxFree(size_t bytes);
+    static size_t maxFree();
+
+    // A size class nobody has acquired from or released to for idleMs is
+    // trimmed: mapped chunks keep their mapping but lose their pages, the
+    // rest are freed. This is checked as chunks come and go, every 10
+    // seconds unless set, 0 leaves it to trim()
+    static void setIdleTrim(int idleMs);
+    static int idleTrim();
+    // trims the classes idle for idleMs, all of them with 0
+    static void trim(int idleMs = 0);
+
+    // Chunks from HugePageSize up are aligned to it and asked to be
+    // backed by transparent huge pages, for the big buffers that page
+    // faults and TLB misses cost the most
+    static void setHugePages(bool on);
+    static bool hugePages();
+
+    struct Stats
+    {
+        // acquired is every acquire(), reused the ones a free list had
+        uint64_t acquired, reused;
+        // what's in the free lists, the resident part of it and what
+        // trimming has given back so far
+        uint64_t free, resident, trimmed;
+    };
+    static Stats stats();
+
+private:
+    BufferPool();
+};
+
+#endif
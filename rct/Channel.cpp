@@ -0,0 +1,98 @@
+#include "Channel.h"
+#include "Log.h"
+#include "Rct.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#ifdef HAVE_EVENTFD
+#  include <sys/eventfd.h>
+#endif
+
+ChannelBase::ChannelBase()
+    : mReadFd(-1), mWriteFd(-1), mNotified(false)
+{
+}
+
+ChannelBase::~ChannelBase()
+{
+    unlisten();
+}
+
+bool ChannelBase::listen(std::function<void()> &&drain)
+{
+    unlisten();
+    EventLoop::SharedPtr loop = EventLoop::eventLoop();
+    if (!loop) {
+        error("No event loop!");
+        return false;
+    }
+    int readFd, writeFd;
+#ifdef HAVE_EVENTFD
+    readFd = writeFd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (readFd == -1) {
+        error() << "Couldn't create eventfd for Channel" << Rct::strerror();
+        return false;
+    }
+#else
+    int fds[2];
+    if (::pipe(fds) == -1) {
+        error() << "Couldn't create pipe for Channel" << Rct::strerror();
+        return false;
+    }
+    for (int i = 0; i < 2; ++i) {
+        fcntl(fds[i], F_SETFL, fcntl(fds[i], F_GETFL) | O_NONBLOCK);
+        fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+    }
+    readFd = fds[0];
+    writeFd = fds[1];
+#endif
+    std::shared_ptr<std::function<void()> > d = std::make_shared<std::function<void()> >(std::move(drain));
+    std::atomic<bool> *notified = &mNotified;
+    loop->registerSocket(readFd, EventLoop::SocketRead, [d, notified](int fd, unsigned int) {
+            // before draining, a send after this notifies again
+            notified->store(false);
+            char buf[64];
+            ssize_t r;
+            do {
+                eintrwrap(r, ::read(fd, buf, sizeof(buf)));
+            } while (r == sizeof(buf));
+            (*d)();
+        });
+    mLoop = loop;
+    mReadFd.store(readFd, std::memory_order_release);
+    mWriteFd.store(writeFd, std::memory_order_release);
+    // whatever was sent before
+    mNotified.store(true);
+    writeNotify();
+    return true;
+}
+
+void ChannelBase::unlisten()
+{
+    const int readFd = mReadFd.exchange(-1);
+    if (readFd == -1)
+        return;
+    const int writeFd = mWriteFd.exchange(-1);
+    if (EventLoop::SharedPtr loop = mLoop.lock())
+        loop->unregisterSocket(readFd);
+    mLoop.reset();
+    ::close(readFd);
+    if (writeFd != readFd)
+        ::close(writeFd);
+}
+
+void ChannelBase::writeNotify()
+{
+    const int fd = mWriteFd.load(std::memory_order_acquire);
+    if (fd == -1)
+        return;
+    ssize_t w;
+#ifdef HAVE_EVENTFD
+    const uint64_t one = 1;
+    eintrwrap(w, ::write(fd, &one, sizeof(one)));
+#else
+    const char one = 1;
+    eintrwrap(w, ::write(fd, &one, sizeof(one)));
+#endif
+    (void)w;
+}
@@ -0,0 +1,252 @@
+#ifndef CHANNEL_H
+#define CHANNEL_H
+
+#include <atomic>
+#include <functional>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <rct/EventLoop.h>
+#include <rct/LightweightSemaphore.h>
+
+class ChannelBase
+{
+public:
+    // readable while the channel has something for its receiver, see
+    // Channel::setReceiver(). -1 until there is one
+    int fd() const { return mReadFd.load(std::memory_order_acquire); }
+
+protected:
+    ChannelBase();
+    ~ChannelBase();
+
+    // after an item went in
+    void notify()
+    {
+        if (mWriteFd.load(std::memory_order_acquire) != -1 && !mNotified.exchange(true))
+            writeNotify();
+    }
+    // drain called on the loop of the calling thread whenever notified
+    bool listen(std::function<void()> &&drain);
+    void unlisten();
+
+    static void relax()
+    {
+#if defined(__i386__) || defined(__x86_64__)
+        __builtin_ia32_pause();
+#endif
+    }
+
+private:
+    void writeNotify();
+
+    std::atomic<int> mReadFd, mWriteFd;
+    std::atomic<bool> mNotified;
+    EventLoop::WeakPtr mLoop;
+};
+
+// Bounded multi-producer/multi-consumer queue for handing things between
+// threads, ThreadPool jobs and EventLoops, Vyukov's array of cells with a
+// sequence number each. Nothing is locked, send() blocks while the channel
+// is full and receive() while it's empty, on LightweightSemaphores counting
+// free and filled cells. After close() sends fail and receives get what's
+// left, then fail too.
+template <typename T>
+class Channel : public ChannelBase
+{
+public:
+    // rounded up to a power of two
+    Channel(size_t capacity)
+        : mCapacity(roundUp(capacity)), mMask(mCapacity - 1), mCells(new Cell[mCapacity]),
+          mFree(static_cast<int>(mCapacity)), mFilled(0), mClosed(false), mEnqueuePos(0), mDequeuePos(0)
+    {
+        for (size_t i = 0; i < mCapacity; ++i)
+            mCells[i].sequence.store(i, std::memory_order_relaxed);
+    }
+    ~Channel()
+    {
+        unlisten();
+        T t;
+        while (dequeue(t)) {}
+        delete[] mCells;
+    }
+
+    size_t capacity() const { return mCapacity; }
+    // a snapshot, others may be sending and receiving meanwhile
+    size_t size() const
+    {
+        const size_t dequeued = mDequeuePos.load(std::memory_order_relaxed);
+        const size_t enqueued = mEnqueuePos.load(std::memory_order_relaxed);
+        return enqueued > dequeued ? enqueued - dequeued : 0;
+    }
+
+    bool send(const T &t) { T copy(t); return send(std::move(copy)); }
+    bool send(T &&t)
+    {
+        if (mClosed.load(std::memory_order_acquire))
+            return false;
+        mFree.acquire();
+        return push(std::move(t));
+    }
+    // maxTime in ms, false if still full by then
+    bool send(T &&t, int maxTime)
+    {
+        if (mClosed.load(std::memory_order_acquire) || !mFree.acquire(maxTime))
+            return false;
+        return push(std::move(t));
+    }
+    bool trySend(T &&t)
+    {
+        if (mClosed.load(std::memory_order_acquire) || !mFree.tryAcquire())
+            return false;
+        return push(std::move(t));
+    }
+
+    bool receive(T &t)
+    {
+        mFilled.acquire();
+        return pop(t);
+    }
+    bool receive(T &t, int maxTime)
+    {
+        return mFilled.acquire(maxTime) && pop(t);
+    }
+    bool tryReceive(T &t)
+    {
+        return mFilled.tryAcquire() && pop(t);
+    }
+
+    // Everything sent from now on goes to callback, on the event loop of
+    // the calling thread. Blocking receivers may still take some first
+    bool setReceiver(std::function<void(T &&)> &&callback)
+    {
+        mReceiver = std::move(callback);
+        return listen([this]() {
+                // give the loop back now and then when senders keep up
+                T t;
+                for (size_t i = 0; i < mCapacity; ++i) {
+                    if (!tryReceive(t))
+                        return;
+                    mReceiver(std::move(t));
+                }
+                if (size())
+                    notify();
+            });
+    }
+
+    void close()
+    {
+        if (mClosed.exchange(true))
+            return;
+        // wake everyone blocked, whoever comes after finds the channel
+        // closed, or empty
+        mFilled.release(ClosedCount);
+        mFree.release(ClosedCount);
+        notify();
+    }
+    bool isClosed() const { return mClosed.load(std::memory_order_acquire); }
+
+private:
+    enum { ClosedCount = 1 << 24 };
+
+    static size_t roundUp(size_t capacity)
+    {
+        size_t ret = 2;
+        while (ret < capacity)
+            ret <<= 1;
+        return ret;
+    }
+
+    // With a free cell counted the cell is there, or about to be once the
+    // receiver that had it is done with it, same for filled cells and
+    // senders. After close() the counts don't mean anything anymore
+    bool push(T &&t)
+    {
+        while (!enqueue(t)) {
+            if (mClosed.load(std::memory_order_acquire))
+                return false;
+            relax();
+        }
+        mFilled.release();
+        notify();
+        return true;
+    }
+
+    bool pop(T &t)
+    {
+        while (!dequeue(t)) {
+            if (mClosed.load(std::memory_order_acquire))
+                return false;
+            relax();
+        }
+        mFree.release();
+        return true;
+    }
+
+    bool enqueue(T &t)
+    {
+        size_t pos = mEnqueuePos.load(std::memory_order_relaxed);
+        for (;;) {
+            Cell &cell = mCells[pos & mMask];
+            const size_t seq = cell.sequence.load(std::memory_order_acquire);
+            const intptr_t dif = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+            if (!dif) {
+                if (mEnqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    new (&cell.storage) T(std::move(t));
+                    cell.sequence.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (dif < 0) {
+                return false;
+            } else {
+                pos = mEnqueuePos.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    bool dequeue(T &t)
+    {
+        size_t pos = mDequeuePos.load(std::memory_order_relaxed);
+        for (;;) {
+            Cell &cell = mCells[pos & mMask];
+            const size_t seq = cell.sequence.load(std::memory_order_acquire);
+            const intptr_t dif = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos + 1);
+            if (!dif) {
+                if (mDequeuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    T *value = reinterpret_cast<T *>(&cell.storage);
+                    t = std::move(*value);
+                    value->~T();
+                    cell.sequence.store(pos + mMask + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (dif < 0) {
+                return false;
+            } else {
+                pos = mDequeuePos.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    struct Cell
+    {
+        std::atomic<size_t> sequence;
+        typename std::aligned_storage<sizeof(T), std::alignment_of<T>::value>::type storage;
+    };
+
+    const size_t mCapacity, mMask;
+    Cell *mCells;
+    LightweightSemaphore mFree, mFilled;
+    std::atomic<bool> mClosed;
+    std::function<void(T &&)> mReceiver;
+    // on cache lines of their own, senders and receivers hammer them
+    char mPad0[64];
+    std::atomic<size_t> mEnqueuePos;
+    char mPad1[64 - sizeof(std::atomic<size_t>)];
+    std::atomic<size_t> mDequeuePos;
+    char mPad2[64 - sizeof(std::atomic<size_t>)];
+
+    Channel(const Channel &) = delete;
+    Channel &operator=(const Channel &) = delete;
+};
+
+#endif
@@ -0,0 +1,298 @@
+#include "Compression.h"
+#include <algorithm>
+#include <assert.h>
+#include <string.h>
+#ifdef RCT_HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef RCT_HAVE_LZ4
+#include <lz4frame.h>
+#endif
+#ifdef RCT_HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+enum { ChunkSize = 1024 * 64 };
+
+// makes room for at least size more bytes after used and returns where
+// they start. The string grows geometrically, trim it with resize(used)
+// when done
+static inline char *outputSpace(String &out, size_t used, size_t size)
+{
+    if (used + size > static_cast<size_t>(out.size()))
+        out.resize(std::max(used + size, static_cast<size_t>(out.size()) * 2));
+    return out.data() + used;
+}
+
+unsigned int Compression::supported()
+{
+    unsigned int ret = 1 << None;
+#ifdef RCT_HAVE_ZLIB
+    ret |= 1 << Zlib;
+#endif
+#ifdef RCT_HAVE_LZ4
+    ret |= 1 << LZ4;
+#endif
+#ifdef RCT_HAVE_ZSTD
+    ret |= 1 << Zstd;
+#endif
+    return ret;
+}
+
+Compression::Codec Compression::negotiate(Codec preferred, unsigned int remote)
+{
+    const unsigned int both = supported() & remote;
+    if (both & (1 << preferred))
+        return preferred;
+    if (preferred != None && both & (1 << Zlib))
+        return Zlib;
+    return None;
+}
+
+const char *Compression::codecName(Codec codec)
+{
+    switch (codec) {
+    case None: return "none";
+    case Zlib: return "zlib";
+    case LZ4: return "lz4";
+    case Zstd: return "zstd";
+    }
+    return "unknown";
+}
+
+#ifdef RCT_HAVE_ZLIB
+static bool zlibCompress(const char *data, int size, String &out, int level)
+{
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    if (::deflateInit(&stream, level ? level : Z_BEST_COMPRESSION) != Z_OK)
+        return false;
+
+    stream.next_in = const_cast<Bytef *>(reinterpret_cast<const Bytef *>(data));
+    stream.avail_in = size;
+
+    size_t used = 0;
+    int error;
+    do {
+        stream.next_out = reinterpret_cast<Bytef *>(outputSpace(out, used, ChunkSize));
+        stream.avail_out = out.size() - used;
+        const unsigned int avail = stream.avail_out;
+        error = ::deflate(&stream, Z_FINISH);
+        used += avail - stream.avail_out;
+    } while (error == Z_OK);
+    ::deflateEnd(&stream);
+    out.resize(used);
+    return error == Z_STREAM_END;
+}
+
+static bool zlibUncompress(const char *data, int size, String &out)
+{
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    if (::inflateInit(&stream) != Z_OK)
+        return false;
+
+    stream.next_in = const_cast<Bytef *>(reinterpret_cast<const Bytef *>(data));
+    stream.avail_in = size;
+
+    size_t used = 0;
+    int error;
+    do {
+        stream.next_out = reinterpret_cast<Bytef *>(outputSpace(out, used, std::max<size_t>(ChunkSize, size)));
+        stream.avail_out = out.size() - used;
+        const unsigned int avail = stream.avail_out;
+        error = ::inflate(&stream, Z_NO_FLUSH);
+        used += avail - stream.avail_out;
+    } while (error == Z_OK);
+    ::inflateEnd(&stream);
+    out.resize(used);
+    return error == Z_STREAM_END;
+}
+#endif
+
+#ifdef RCT_HAVE_LZ4
+static bool lz4Compress(const char *data, int size, String &out, int level)
+{
+    LZ4F_cctx *ctx = 0;
+    if (LZ4F_isError(LZ4F_createCompressionContext(&ctx, LZ4F_VERSION)))
+        return false;
+
+    LZ4F_preferences_t prefs;
+    memset(&prefs, 0, sizeof(prefs));
+    prefs.compressionLevel = level;
+    // lets the other side allocate the output once
+    prefs.frameInfo.contentSize = size;
+
+    const size_t bound = LZ4F_compressBound(ChunkSize, &prefs);
+    size_t used = 0;
+    size_t ret = LZ4F_compressBegin(ctx, outputSpace(out, used, LZ4F_HEADER_SIZE_MAX), LZ4F_HEADER_SIZE_MAX, &prefs);
+    int pos = 0;
+    while (!LZ4F_isError(ret)) {
+        used += ret;
+        if (pos == size) {
+            ret = LZ4F_compressEnd(ctx, outputSpace(out, used, bound), bound, 0);
+            if (!LZ4F_isError(ret))
+                used += ret;
+            break;
+        }
+        const int chunk = std::min<int>(ChunkSize, size - pos);
+        ret = LZ4F_compressUpdate(ctx, outputSpace(out, used, bound), bound, data + pos, chunk, 0);
+        pos += chunk;
+    }
+    LZ4F_freeCompressionContext(ctx);
+    out.resize(used);
+    return !LZ4F_isError(ret);
+}
+
+static bool lz4Uncompress(const char *data, int size, String &out)
+{
+    LZ4F_dctx *ctx = 0;
+    if (LZ4F_isError(LZ4F_createDecompressionContext(&ctx, LZ4F_VERSION)))
+        return false;
+
+    size_t hint = ChunkSize;
+    {
+        LZ4F_frameInfo_t info;
+        size_t consumed = size;
+        const size_t ret = LZ4F_getFrameInfo(ctx, &info, data, &consumed);
+        if (LZ4F_isError(ret)) {
+            LZ4F_freeDecompressionContext(ctx);
+            return false;
+        }
+        if (info.contentSize)
+            hint = info.contentSize;
+        data += consumed;
+        size -= consumed;
+    }
+
+    size_t used = 0;
+    size_t ret = 1;
+    while (ret) {
+        size_t outSize = std::max<size_t>(hint, ChunkSize);
+        char *dst = outputSpace(out, used, outSize);
+        outSize = out.size() - used;
+        size_t inSize = size;
+        ret = LZ4F_decompress(ctx, dst, &outSize, data, &inSize, 0);
+        if (LZ4F_isError(ret))
+            break;
+        used += outSize;
+        data += inSize;
+        size -= inSize;
+        if (!outSize && !size) // truncated
+            break;
+        hint = ChunkSize;
+    }
+    LZ4F_freeDecompressionContext(ctx);
+    out.resize(used);
+    // 0 means the frame is complete
+    return !ret;
+}
+#endif
+
+#ifdef RCT_HAVE_ZSTD
+static bool zstdCompress(const char *data, int size, String &out, int level)
+{
+    ZSTD_CCtx *ctx = ZSTD_createCCtx();
+    if (!ctx)
+        return false;
+    if (level)
+        ZSTD_CCtx_setParameter(ctx, ZSTD_c_compressionLevel, level);
+    ZSTD_CCtx_setPledgedSrcSize(ctx, size);
+
+    ZSTD_inBuffer input = { data, static_cast<size_t>(size), 0 };
+    size_t used = 0, ret;
+    do {
+        const size_t chunk = std::max<size_t>(ChunkSize, ZSTD_CStreamOutSize());
+        ZSTD_outBuffer output = { outputSpace(out, used, chunk), chunk, 0 };
+        ret = ZSTD_compressStream2(ctx, &output, &input, ZSTD_e_end);
+        used += output.pos;
+    } while (!ZSTD_isError(ret) && ret);
+    ZSTD_freeCCtx(ctx);
+    out.resize(used);
+    return !ZSTD_isError(ret);
+}
+
+static bool zstdUncompress(const char *data, int size, String &out)
+{
+    ZSTD_DCtx *ctx = ZSTD_createDCtx();
+    if (!ctx)
+        return false;
+
+    size_t hint = ChunkSize;
+    const unsigned long long contentSize = ZSTD_getFrameContentSize(data, size);
+    if (contentSize != ZSTD_CONTENTSIZE_UNKNOWN && contentSize != ZSTD_CONTENTSIZE_ERROR)
+        hint = std::max<size_t>(contentSize, 1);
+
+    ZSTD_inBuffer input = { data, static_cast<size_t>(size), 0 };
+    size_t used = 0, ret = 1;
+    while (ret) {
+        ZSTD_outBuffer output = { outputSpace(out, used, hint), hint, 0 };
+        ret = ZSTD_decompressStream(ctx, &output, &input);
+        if (ZSTD_isError(ret))
+            break;
+        used += output.pos;
+        if (!output.pos && input.pos == input.size) // truncated
+            break;
+        hint = ChunkSize;
+    }
+    ZSTD_freeDCtx(ctx);
+    out.resize(used);
+    // 0 means the frame is complete
+    return !ret;
+}
+#endif
+
+bool Compression::compress(Codec codec, const char *data, int size, String &out, int level)
+{
+    out.clear();
+    if (!size)
+        return true;
+    switch (codec) {
+    case None:
+        out.assign(data, size);
+        return true;
+#ifdef RCT_HAVE_ZLIB
+    case Zlib:
+        return zlibCompress(data, size, out, level);
+#endif
+#ifdef RCT_HAVE_LZ4
+    case LZ4:
+        return lz4Compress(data, size, out, level);
+#endif
+#ifdef RCT_HAVE_ZSTD
+    case Zstd:
+        return zstdCompress(data, size, out, level);
+#endif
+    default:
+        break;
+    }
+    (void)level;
+    return false;
+}
+
+bool Compression::uncompress(Codec codec, const char *data, int size, String &out)
+{
+    out.clear();
+    if (!size)
+        return true;
+    switch (codec) {
+    case None:
+        out.assign(data, size);
+        return true;
+#ifdef RCT_HAVE_ZLIB
+    case Zlib:
+        return zlibUncompress(data, size, out);
+#endif
+#ifdef RCT_HAVE_LZ4
+    case LZ4:
+        return lz4Uncompress(data, size, out);
+#endif
+#ifdef RCT_HAVE_ZSTD
+    case Zstd:
+        return zstdUncompress(data, size, out);
+#endif
+    default:
+        break;
+    }
+    return false;
+}
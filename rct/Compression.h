@@ -0,0 +1,35 @@
+#ifndef COMPRESSION_H
+#define COMPRESSION_H
+
+#include <rct/String.h>
+
+// Codecs for Message::Compressed. Which ones are there depends on what rct
+// was built with, zlib, lz4 (RCT_HAVE_LZ4) and zstd (RCT_HAVE_ZSTD). Both
+// directions stream through the data in chunks straight into the output so
+// only the input and the output are ever in memory.
+class Compression
+{
+public:
+    enum Codec {
+        None,
+        Zlib,
+        LZ4,
+        Zstd
+    };
+
+    // one bit per Codec, None is always there
+    static unsigned int supported();
+    static bool isSupported(Codec codec) { return supported() & (1 << codec); }
+
+    // preferred if both sides support it, otherwise Zlib if both do and
+    // None if not. remote is the other side's supported() mask
+    static Codec negotiate(Codec preferred, unsigned int remote);
+
+    // level 0 picks the codec's default. out is replaced
+    static bool compress(Codec codec, const char *data, int size, String &out, int level = 0);
+    static bool uncompress(Codec codec, const char *data, int size, String &out);
+
+    static const char *codecName(Codec codec);
+};
+
+#endif
@@ -164,6 +164,9 @@ done:
 
     delete[] options;
 
+    for (int i=0; i<sOptions.size(); ++i)
+        sOptions.at(i)->publish();
+
     if (!ok) {
         if (!error.isEmpty()) {
             showHelp(stderr);
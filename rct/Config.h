@@ -7,14 +7,71 @@
 #include <rct/Value.h>
 #include <rct/String.h>
 #include <getopt.h>
+#include <atomic>
+#include <memory>
 
 class Config
 {
 public:
     static bool parse(int argc, char **argv, const List<Path> &rcFiles = List<Path>());
 
+    // What registerOption() returns, the option's value already converted
+    // to T, or the default if it wasn't given. Reading it is an atomic
+    // load, no lookup by name and no conversion, so it suits code that
+    // checks an option per request. parse() publishes a new value, a
+    // reader sees either the old one or the new one, and a reference from
+    // value() stays good as long as the handle is around, clear() too.
+    template <typename T>
+    class Handle
+    {
+    public:
+        Handle() {}
+
+        bool isValid() const { return mSlot != 0; }
+        const T &value() const { return current()->value; }
+        const T &operator*() const { return value(); }
+        const T *operator->() const { return &value(); }
+        // how many times it was given
+        int count() const { return current()->count; }
+        // like Config::isEnabled()
+        int isEnabled() const
+        {
+            const Parsed *parsed = current();
+            return parsed->value ? parsed->count : 0;
+        }
+
+    private:
+        friend class Config;
+
+        struct Parsed
+        {
+            T value;
+            int count;
+        };
+        struct Slot
+        {
+            Slot()
+                : current(0)
+            {}
+
+            void publish(T &&value, int count)
+            {
+                versions.emplace_back(new Parsed { std::move(value), count });
+                current.store(versions.back().get(), std::memory_order_release);
+            }
+
+            std::atomic<const Parsed *> current;
+            // every value it has had, they're few
+            std::vector<std::unique_ptr<Parsed> > versions;
+        };
+
+        const Parsed *current() const { return mSlot->current.load(std::memory_order_acquire); }
+
+        std::shared_ptr<Slot> mSlot;
+    };
+
     template<typename T, int listCount = 0>
-    static void registerListOption(const char *name, const String &description, const char shortOpt = '\0',
+    static Handle<List<T> > registerListOption(const char *name, const String &description, const char shortOpt = '\0',
                                    const List<T> &defaultValue = List<T>(),
                                    const std::function<bool(const List<T>&, String &)> &validator = std::function<bool(const List<T>&, String &)>())
     {
@@ -30,10 +87,14 @@ public:
         option->count = 0;
         option->listCount = listCount;
         sOptions.append(option);
+        Handle<List<T> > handle;
+        handle.mSlot = option->slot;
+        option->publish();
+        return handle;
     }
 
     template <typename T>
-    static void registerOption(const char *name,
+    static Handle<T> registerOption(const char *name,
                                const String &description,
                                const char shortOpt = '\0',
                                const T &defaultValue = T(),
@@ -50,6 +111,10 @@ public:
         option->count = 0;
         option->listCount = 0;
         sOptions.append(option);
+        Handle<T> handle;
+        handle.mSlot = option->slot;
+        option->publish();
+        return handle;
     }
 
     static int isEnabled(const char *name)
@@ -156,9 +221,14 @@ private:
         Value::Type type;
         int count, listCount;
         virtual bool validate(String &err) = 0;
+        // to the handle
+        virtual void publish() = 0;
     };
     template <typename T>
     struct Option : public OptionBase {
+        Option()
+            : slot(std::make_shared<typename Handle<T>::Slot>())
+        {}
         virtual bool validate(String &err) override
         {
             if (validator) {
@@ -170,11 +240,21 @@ private:
             }
             return true;
         }
+        virtual void publish() override
+        {
+            T t;
+            convert(value.isNull() ? defaultValue : value, t);
+            slot->publish(std::move(t), count);
+        }
         std::function<bool(const T &, String &err)> validator;
+        const std::shared_ptr<typename Handle<T>::Slot> slot;
     };
 
     template <typename T>
     struct ListOption : public OptionBase {
+        ListOption()
+            : slot(std::make_shared<typename Handle<List<T> >::Slot>())
+        {}
         virtual bool validate(String &err) override
         {
             if (validator) {
@@ -190,7 +270,14 @@ private:
             }
             return true;
         }
+        virtual void publish() override
+        {
+            List<T> t;
+            convert(value.isNull() ? defaultValue : value, t);
+            slot->publish(std::move(t), count);
+        }
         std::function<bool(const List<T> &, String &err)> validator;
+        const std::shared_ptr<typename Handle<List<T> >::Slot> slot;
     };
 
     static List<OptionBase*> sOptions;
@@ -1,6 +1,7 @@
 #ifndef ConnectMessage_h
 #define ConnectMessage_h
 
+#include <rct/Compression.h>
 #include <rct/Message.h>
 #include <rct/String.h>
 
@@ -9,14 +10,72 @@ class ConnectMessage : public Message
 public:
     enum { MessageId = ConnectMessageId };
 
-    ConnectMessage()
-        : Message(MessageId)
+    // what the sender can receive besides plain frames
+    enum Feature {
+        // BatchMessage, see Connection::setCoalescing()
+        Batches = 0x1
+    };
+
+    // codecs is a Compression::supported() mask. sharedKey, if not -1, is
+    // the SharedMemory key of the ring the sender puts large message bodies
+    // in, see Connection::setSharedMemory(). features is a mask of Feature
+    ConnectMessage(unsigned int codecs = Compression::supported(), int sharedKey = -1, unsigned int sharedSize = 0,
+                   unsigned int features = 0)
+        : Message(MessageId), mCodecs(codecs), mSharedKey(sharedKey), mSharedSize(sharedSize), mFeatures(features)
     {
     }
 
-    virtual int encodedSize() const override { return 0; }
-    virtual void encode(Serializer &) const override {}
-    virtual void decode(Deserializer &) override {}
+    unsigned int codecs() const { return mCodecs; }
+    int sharedKey() const { return mSharedKey; }
+    unsigned int sharedSize() const { return mSharedSize; }
+    unsigned int features() const { return mFeatures; }
+
+    // the ring is written with key -1 if there are features, those that
+    // don't know about them stop reading after it
+    virtual int encodedSize() const override
+    {
+        return sizeof(uint32_t) + (mSharedKey != -1 || mFeatures ? sizeof(int32_t) + sizeof(uint32_t) : 0)
+            + (mFeatures ? sizeof(uint32_t) : 0);
+    }
+    virtual void encode(Serializer &serializer) const override
+    {
+        serializer << static_cast<uint32_t>(mCodecs);
+        if (mSharedKey != -1 || mFeatures)
+            serializer << static_cast<int32_t>(mSharedKey) << static_cast<uint32_t>(mSharedSize);
+        if (mFeatures)
+            serializer << static_cast<uint32_t>(mFeatures);
+    }
+    virtual void decode(Deserializer &deserializer) override
+    {
+        mSharedKey = -1;
+        mSharedSize = 0;
+        mFeatures = 0;
+        if (deserializer.atEnd()) {
+            // from before codecs were negotiated, those only know zlib
+            mCodecs = (1 << Compression::None) | (1 << Compression::Zlib);
+        } else {
+            uint32_t codecs;
+            deserializer >> codecs;
+            mCodecs = codecs;
+            if (!deserializer.atEnd()) {
+                int32_t key;
+                uint32_t size;
+                deserializer >> key >> size;
+                mSharedKey = key;
+                mSharedSize = size;
+                if (!deserializer.atEnd()) {
+                    uint32_t features;
+                    deserializer >> features;
+                    mFeatures = features;
+                }
+            }
+        }
+    }
+private:
+    unsigned int mCodecs;
+    int mSharedKey;
+    unsigned int mSharedSize;
+    unsigned int mFeatures;
 };
 
 #endif
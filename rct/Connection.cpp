@@ -1,16 +1,169 @@
 #include "Connection.h"
 #include "EventLoop.h"
+#include "IoStats.h"
 #include "Serializer.h"
 #include "Message.h"
+#include "SharedMemory.h"
+#include "Rct.h"
 #include "Timer.h"
+#include "Trace.h"
 #include <assert.h>
+#include <atomic>
+#include <chrono>
+#include <fcntl.h>
+#include <limits.h>
+#include <new>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
-#include "Connection.h"
+// The start of a shared memory ring, which is followed by the data. Only
+// the connection that created it writes the data, the other side sets
+// attached once it's in and moves consumed forward as it decodes.
+struct SharedRing
+{
+    enum { Magic = 0x72637472, HeaderSize = 64 };
+
+    uint32_t magic;
+    uint32_t size;
+    std::atomic<uint32_t> attached;
+    std::atomic<uint64_t> consumed;
+
+    char *data() { return reinterpret_cast<char *>(this) + HeaderSize; }
+};
+static_assert(sizeof(SharedRing) <= SharedRing::HeaderSize, "SharedRing header too big");
+
+// encodes straight into a reserved piece of the ring
+class SharedRingWriter : public Serializer::Buffer
+{
+public:
+    SharedRingWriter(char *data, int size)
+        : mData(data), mSize(size), mPos(0)
+    {}
+
+    virtual bool write(const void *data, int len) override
+    {
+        if (mPos + len > mSize)
+            return false;
+        memcpy(mData + mPos, data, len);
+        mPos += len;
+        return true;
+    }
+    virtual int pos() const override { return mPos; }
+private:
+    char *mData;
+    const int mSize;
+    int mPos;
+};
 
 Connection::Connection(int version)
-    : mPendingRead(0), mPendingWrite(0), mTimeoutTimer(0), mFinishStatus(0),
-      mVersion(version), mSilent(false), mIsConnected(false), mWarned(false)
+    : mBuffer(MemoryMonitor::ConnectionBuffers, Buffer::Pooled), mBufferOffset(0), mPendingRead(0), mPendingWrite(0), mTimeoutTimer(0), mFinishStatus(0),
+      mVersion(version), mSilent(false), mIsConnected(false), mWarned(false),
+      mSuspendRead(false), mHighWatermark(0), mLowWatermark(0),
+      mPreferredCodec(Compression::Zlib), mCodec(Compression::Zlib),
+      mRemoteCodecs((1 << Compression::None) | (1 << Compression::Zlib)), mRemoteFeatures(0),
+      mCompressionLevel(0), mCompressionThreshold(DefaultCompressionThreshold),
+      mSharedSize(0), mSharedThreshold(DefaultSharedMemoryThreshold), mSharedWritten(0),
+      mBatchCount(0), mFlushTimer(0), mFlushScheduled(false), mCoalesceBytes(0), mCoalesceLatency(0),
+      mNextStreamId(0), mQueueMessages(false), mMessageWaiter(0), mMessageWaiterData(0)
+{
+}
+
+void Connection::setCoalescing(unsigned int maxBytes, int maxLatency)
+{
+    mCoalesceBytes = maxBytes;
+    mCoalesceLatency = maxLatency;
+    if (!maxBytes)
+        flush();
+}
+
+bool Connection::writeFrame(const String &frame)
+{
+    if (!canBatch(frame.size())) {
+        flush();
+        mPendingWrite += frame.size();
+        return mSocketClient->write(frame);
+    }
+    if (static_cast<unsigned int>(mBatch.size() + frame.size()) > mCoalesceBytes)
+        flush();
+    if (mBatch.isEmpty())
+        mBatch.reserve(mCoalesceBytes);
+    mBatch.append(frame);
+    ++mBatchCount;
+    if (mBatch.size() >= static_cast<int>(mCoalesceBytes))
+        return flush();
+    scheduleFlush();
+    return mSocketClient->isConnected();
+}
+
+void Connection::scheduleFlush()
+{
+    if (mFlushScheduled)
+        return;
+    EventLoop::SharedPtr loop = EventLoop::eventLoop();
+    if (!loop) {
+        flush();
+        return;
+    }
+    // a flush that comes first for other reasons leaves this one with
+    // nothing or a younger batch to send, either is fine
+    mFlushScheduled = true;
+    std::weak_ptr<Connection> weak = shared_from_this();
+    if (mCoalesceLatency > 0) {
+        mFlushTimer = loop->registerTimer([weak](int) {
+                if (auto strong = weak.lock()) {
+                    strong->mFlushTimer = 0;
+                    strong->mFlushScheduled = false;
+                    strong->flush();
+                }
+            }, mCoalesceLatency, Timer::SingleShot);
+    } else {
+        loop->callLater([weak]() {
+                if (auto strong = weak.lock()) {
+                    strong->mFlushScheduled = false;
+                    strong->flush();
+                }
+            });
+    }
+}
+
+bool Connection::flush()
+{
+    if (mBatch.isEmpty())
+        return mSocketClient && mSocketClient->isConnected();
+    String frames;
+    std::swap(frames, mBatch);
+    const int count = mBatchCount;
+    mBatchCount = 0;
+    if (!mSocketClient)
+        return false;
+    mPendingWrite += frames.size();
+    if (count == 1) {
+        // not worth a batch
+        return mSocketClient->write(frames);
+    }
+
+    ++mStats.batchesSent;
+    const BatchMessage batch;
+    String header;
+    {
+        Serializer serializer(header);
+        batch.encodeHeader(serializer, frames.size(), mVersion);
+    }
+    mPendingWrite += header.size();
+    const bool corked = mSocketClient->isCorked();
+    mSocketClient->cork();
+    mSocketClient->write(header);
+    mSocketClient->write(std::make_shared<const String>(std::move(frames)));
+    return corked ? mSocketClient->isConnected() : mSocketClient->uncork();
+}
+
+void Connection::setCompression(Compression::Codec codec, int level, int threshold)
 {
+    mPreferredCodec = codec;
+    mCompressionLevel = level;
+    mCompressionThreshold = threshold;
+    mCodec = Compression::negotiate(mPreferredCodec, mRemoteCodecs);
 }
 
 Connection::~Connection()
@@ -18,6 +171,10 @@ Connection::~Connection()
     if (mTimeoutTimer) {
         EventLoop::eventLoop()->unregisterTimer(mTimeoutTimer);
     }
+    if (mFlushTimer) {
+        if (EventLoop::SharedPtr loop = EventLoop::eventLoop())
+            loop->unregisterTimer(mFlushTimer);
+    }
 }
 
 void Connection::connect(const SocketClient::SharedPtr &client)
@@ -26,11 +183,8 @@ void Connection::connect(const SocketClient::SharedPtr &client)
     mIsConnected = true;
     assert(client->isConnected());
     auto that = shared_from_this();
-    mSocketClient->disconnected().connect(std::bind(&Connection::onClientDisconnected, that, std::placeholders::_1));
-    mSocketClient->readyRead().connect(std::bind(&Connection::onDataAvailable, that, std::placeholders::_1, std::placeholders::_2));
-    mSocketClient->bytesWritten().connect(std::bind(&Connection::onDataWritten, that, std::placeholders::_1, std::placeholders::_2));
-    mSocketClient->error().connect(std::bind(&Connection::onSocketError, that, std::placeholders::_1, std::placeholders::_2));
-    send(ConnectMessage());
+    attachClient();
+    sendConnectMessage();
     std::weak_ptr<Connection> weak = that;
     EventLoop::eventLoop()->callLater([weak]() {
             if (auto strong = weak.lock())
@@ -38,6 +192,147 @@ void Connection::connect(const SocketClient::SharedPtr &client)
         });
 }
 
+void Connection::attachClient()
+{
+    auto that = shared_from_this();
+    mSocketClient->disconnected().connect(std::bind(&Connection::onClientDisconnected, that, std::placeholders::_1));
+    mSocketClient->readyRead().connect(std::bind(&Connection::onDataAvailable, that, std::placeholders::_1, std::placeholders::_2));
+    mSocketClient->bytesWritten().connect(std::bind(&Connection::onDataWritten, that, std::placeholders::_1, std::placeholders::_2));
+    mSocketClient->error().connect(std::bind(&Connection::onSocketError, that, std::placeholders::_1, std::placeholders::_2));
+    mSocketClient->writeBlocked().connect(std::bind(&Connection::onWriteBlocked, that, std::placeholders::_1));
+    mSocketClient->writeUnblocked().connect(std::bind(&Connection::onWriteUnblocked, that, std::placeholders::_1));
+    mSocketClient->setWatermarks(mHighWatermark, mLowWatermark);
+}
+
+void Connection::setWatermarks(unsigned int high, unsigned int low)
+{
+    mHighWatermark = high;
+    mLowWatermark = low;
+    if (mSocketClient)
+        mSocketClient->setWatermarks(high, low);
+}
+
+void Connection::setSuspendReadWhileBlocked(bool on)
+{
+    mSuspendRead = on;
+    if (mSocketClient)
+        mSocketClient->setReadSuspended(on && mSocketClient->isWriteBlocked());
+}
+
+void Connection::onWriteBlocked(const SocketClient::SharedPtr &client)
+{
+    if (mSuspendRead)
+        client->setReadSuspended(true);
+    mWriteBlocked(shared_from_this());
+}
+
+void Connection::onWriteUnblocked(const SocketClient::SharedPtr &client)
+{
+    if (mSuspendRead)
+        client->setReadSuspended(false);
+    mWriteUnblocked(shared_from_this());
+}
+
+void Connection::setSharedMemory(unsigned int size, unsigned int threshold)
+{
+    mSharedSize = size;
+    mSharedThreshold = threshold;
+    mSharedOut.reset();
+    mSharedWritten = 0;
+    // a new ring is offered right away, without one the other side just
+    // stops getting shared frames
+    if (size && mSocketClient && mSocketClient->isConnected() && mSocketClient->state() == SocketClient::Connected)
+        sendConnectMessage();
+}
+
+void Connection::sendConnectMessage()
+{
+    if (mSharedSize && (mSocketClient->mode() & SocketClient::Unix) && createSharedRing()) {
+        send(ConnectMessage(Compression::supported(), mSharedOut->key(), mSharedSize, ConnectMessage::Batches));
+    } else {
+        send(ConnectMessage(Compression::supported(), -1, 0, ConnectMessage::Batches));
+    }
+}
+
+bool Connection::createSharedRing()
+{
+    static std::atomic<unsigned int> counter(0);
+    const int size = SharedRing::HeaderSize + mSharedSize;
+    for (int attempt = 0; attempt < 16; ++attempt) {
+        // any unused key will do, the other side learns it from us
+        const key_t key = static_cast<key_t>((getpid() << 16) ^ (Rct::monoMs() << 4) ^ ++counter) & 0x7fffffff;
+        std::unique_ptr<SharedMemory> shm(new SharedMemory(key, size, SharedMemory::Create));
+        if (!shm->isValid())
+            continue;
+        void *address = shm->attach(SharedMemory::ReadWrite);
+        if (!address)
+            return false;
+        SharedRing *ring = new (address) SharedRing;
+        ring->magic = SharedRing::Magic;
+        ring->size = mSharedSize;
+        ring->attached = 0;
+        ring->consumed = 0;
+        mSharedOut = std::move(shm);
+        mSharedWritten = 0;
+        return true;
+    }
+    ::error("Can't create a shared memory ring of %u bytes", mSharedSize);
+    return false;
+}
+
+void Connection::attachSharedRing(int key, unsigned int size)
+{
+    mSharedIn.reset();
+    if (key == -1)
+        return;
+    std::unique_ptr<SharedMemory> shm(new SharedMemory(key, SharedRing::HeaderSize + size));
+    SharedRing *ring = static_cast<SharedRing *>(shm->isValid() ? shm->attach(SharedMemory::ReadWrite) : 0);
+    if (!ring || ring->magic != SharedRing::Magic || ring->size != size) {
+        // the other side falls back to the socket as long as we don't attach
+        ::warning("Can't attach to shared memory ring %d", key);
+        return;
+    }
+    ring->attached.store(1, std::memory_order_release);
+    mSharedIn = std::move(shm);
+}
+
+// room for size bytes in our ring if the other side is using it and it has
+// space, position is where they go
+char *Connection::reserveShared(uint32_t size, uint64_t &position)
+{
+    if (!mSharedOut || size < mSharedThreshold)
+        return 0;
+    SharedRing *ring = static_cast<SharedRing *>(mSharedOut->address());
+    if (!ring->attached.load(std::memory_order_acquire) || size > ring->size)
+        return 0;
+    // both sides are in, it goes away once both are gone
+    mSharedOut->remove();
+    // bodies are never split, one that doesn't fit at the end goes to the
+    // start of the ring and the end is skipped
+    uint64_t pos = mSharedWritten;
+    uint32_t offset = pos % ring->size;
+    if (size > ring->size - offset) {
+        pos += ring->size - offset;
+        offset = 0;
+    }
+    if (pos + size - ring->consumed.load(std::memory_order_acquire) > ring->size)
+        return 0;
+    mSharedWritten = pos + size;
+    position = pos;
+    return ring->data() + offset;
+}
+
+// sends the descriptor for a body that is in the ring
+bool Connection::sendShared(const Message &message, uint8_t flags, uint64_t position, uint32_t size, uint32_t streamId)
+{
+    String frame;
+    frame.reserve(sizeof(uint32_t) + Message::HeaderExtra + sizeof(streamId) + Message::SharedDescriptorSize);
+    Serializer serializer(frame);
+    message.encodeHeader(serializer, Message::SharedDescriptorSize, mVersion, flags | Message::SharedMemoryFlag, streamId);
+    serializer << position << size;
+    return writeFrame(frame);
+}
+
 void Connection::checkData()
 {
     if (!mSocketClient->buffer().isEmpty())
@@ -56,12 +351,10 @@ bool Connection::connectUnix(const Path &socketFile, int timeout)
         }, timeout, Timer::SingleShot);
     }
     mSocketClient.reset(new SocketClient);
+    mSocketClient->setOptions(mSocketOptions);
     auto that = shared_from_this();
     mSocketClient->connected().connect(std::bind(&Connection::onClientConnected, that, std::placeholders::_1));
-    mSocketClient->disconnected().connect(std::bind(&Connection::onClientDisconnected, that, std::placeholders::_1));
-    mSocketClient->readyRead().connect(std::bind(&Connection::onDataAvailable, that, std::placeholders::_1, std::placeholders::_2));
-    mSocketClient->bytesWritten().connect(std::bind(&Connection::onDataWritten, that, std::placeholders::_1, std::placeholders::_2));
-    mSocketClient->error().connect(std::bind(&Connection::onSocketError, that, std::placeholders::_1, std::placeholders::_2));
+    attachClient();
     if (!mSocketClient->connect(socketFile)) {
         mSocketClient.reset();
         return false;
@@ -81,12 +374,12 @@ bool Connection::connectTcp(const String &host, uint16_t port, int timeout)
         }, timeout, Timer::SingleShot);
     }
     mSocketClient.reset(new SocketClient);
+    mSocketClient->setOptions(mSocketOptions);
+    if (mTlsContext)
+        mSocketClient->startTls(mTlsContext, mTlsServerName.isEmpty() ? host : mTlsServerName);
     auto that = shared_from_this();
     mSocketClient->connected().connect(std::bind(&Connection::onClientConnected, that, std::placeholders::_1));
-    mSocketClient->disconnected().connect(std::bind(&Connection::onClientDisconnected, that, std::placeholders::_1));
-    mSocketClient->readyRead().connect(std::bind(&Connection::onDataAvailable, that, std::placeholders::_1, std::placeholders::_2));
-    mSocketClient->bytesWritten().connect(std::bind(&Connection::onDataWritten, that, std::placeholders::_1, std::placeholders::_2));
-    mSocketClient->error().connect(std::bind(&Connection::onSocketError, that, std::placeholders::_1, std::placeholders::_2));
+    attachClient();
     if (!mSocketClient->connect(host, port)) {
         mSocketClient.reset();
         return false;
@@ -94,101 +387,183 @@ bool Connection::connectTcp(const String &host, uint16_t port, int timeout)
     return true;
 }
 
-int Connection::pendingWrite() const
+void Connection::countSent(uint8_t messageId)
 {
-    return mPendingWrite;
+    ++mStats.messagesSent;
+    ++mStats.messages[messageId].sent;
+    IoStats::add(IoStats::MessagesSent);
+    IoStats::messageSent(messageId);
 }
 
-static inline unsigned int bufferSize(const LinkedList<Buffer>& buffers)
+int Connection::pendingWrite() const
 {
-    unsigned int sz = 0;
-    for (const Buffer& buffer: buffers) {
-        sz += buffer.size();
-    }
-    return sz;
+    return mPendingWrite + mBatch.size();
 }
 
-static inline int bufferRead(LinkedList<Buffer>& buffers, char* out, unsigned int size)
+void Connection::onDataAvailable(const SocketClient::SharedPtr&, Buffer&& buf)
 {
-    if (!size)
-        return 0;
-    unsigned int num = 0, rem = size, cur;
-    LinkedList<Buffer>::iterator it = buffers.begin();
-    while (it != buffers.end()) {
-        cur = std::min(it->size(), rem);
-        memcpy(out + num, it->data(), cur);
-        rem -= cur;
-        num += cur;
-        if (cur == it->size()) {
-            // we've read the entire buffer, remove it
-            it = buffers.erase(it);
+    // mBuffer holds everything received but not decoded yet, starting at
+    // mBufferOffset. Frames are decoded straight out of it.
+    if (!buf.isEmpty()) {
+        if (mBufferOffset == mBuffer.size()) {
+            mBuffer = std::move(buf);
+            mBufferOffset = 0;
         } else {
-            assert(!rem);
-            assert(it->size() > cur);
-            assert(cur > 0);
-            // we need to shrink & memmove the front buffer at this point
-            Buffer& front = *it;
-            memmove(front.data(), front.data() + cur, front.size() - cur);
-            front.resize(front.size() - cur);
-        }
-        if (!rem) {
-            assert(num == size);
-            return size;
+            appendData(buf.data(), buf.size());
+            // the client reads into buf again next time, it has to be
+            // consumed either way
+            buf.clear();
         }
-        assert(rem > 0);
     }
-    return num;
-}
 
-void Connection::onDataAvailable(const SocketClient::SharedPtr&, Buffer&& buf)
-{
     while (true) {
-        if (!buf.isEmpty())
-            mBuffers.push_back(std::move(buf));
-
-        unsigned int available = bufferSize(mBuffers);
-        if (!available)
-            break;
+        const unsigned int available = mBuffer.size() - mBufferOffset;
         if (!mPendingRead) {
-            if (available < static_cast<int>(sizeof(uint32_t)))
+            if (available < sizeof(uint32_t))
                 break;
-            char buf[sizeof(uint32_t)];
-            const int read = bufferRead(mBuffers, buf, 4);
-            assert(read == 4);
-            Deserializer strm(buf, read);
+            Deserializer strm(reinterpret_cast<const char*>(mBuffer.data() + mBufferOffset), sizeof(uint32_t));
             strm >> mPendingRead;
             assert(mPendingRead > 0);
-            available -= 4;
+            mBufferOffset += sizeof(uint32_t);
+            continue;
         }
         assert(mPendingRead >= 0);
-        if (available < static_cast<unsigned int>(mPendingRead))
+        if (available < static_cast<unsigned int>(mPendingRead)) {
+            // a big frame is coming in, make room for all of it once
+            // rather than growing as it arrives
+            reserveData(mPendingRead);
             break;
-        char buf[1024];
-        char *buffer = buf;
-        if (mPendingRead > static_cast<int>(sizeof(buf))) {
-            buffer = new char[mPendingRead];
         }
-        const int read = bufferRead(mBuffers, buffer, mPendingRead);
-        assert(read == mPendingRead);
+        const char* data = reinterpret_cast<const char*>(mBuffer.data() + mBufferOffset);
+        const int read = mPendingRead;
+        mBufferOffset += read;
         mPendingRead = 0;
-        std::shared_ptr<Message> message = Message::create(mVersion, buffer, read);
-        if (message) {
-            auto that = shared_from_this();
-            if (message->messageId() == FinishMessage::MessageId) {
-                mFinishStatus = std::static_pointer_cast<FinishMessage>(message)->status();
-                mFinished(that, mFinishStatus);
-            } else if (message->messageId() == ConnectMessage::MessageId) {
-                mIsConnected = true;
-            } else {
-                newMessage()(message, that);
-            }
+        std::shared_ptr<Message> message = decodeFrame(data, read);
+        if (message && BatchMessage::isBatch(*message)) {
+            ++mStats.batchesReceived;
+            if (!unbatch(std::static_pointer_cast<BatchMessage>(message)->frames()))
+                message.reset();
+        } else if (message) {
+            dispatch(message);
         }
-        if (buffer != buf)
-            delete[] buffer;
         if (!message)
             mSocketClient->close();
     // mClient->dataAvailable().disconnect(this, &Connection::dataAvailable);
     }
+
+    if (mBufferOffset == mBuffer.size()) {
+        mBuffer.clear();
+        mBufferOffset = 0;
+    }
+}
+
+std::shared_ptr<Message> Connection::decodeFrame(const char *data, int size)
+{
+    Message::SharedRegion shared = { 0, 0, 0 };
+    if (mSharedIn) {
+        SharedRing *ring = static_cast<SharedRing *>(mSharedIn->address());
+        shared.data = ring->data();
+        shared.size = ring->size;
+    }
+    const std::chrono::steady_clock::time_point decodeStart = std::chrono::steady_clock::now();
+    std::shared_ptr<Message> message;
+    {
+        TraceScope trace("Connection::decode", "connection");
+        message = Message::create(mVersion, data, size, mSharedIn ? &shared : 0);
+    }
+    const uint64_t decodeTime = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - decodeStart).count();
+    mStats.decodeTime += decodeTime;
+    IoStats::add(IoStats::DecodeTime, decodeTime);
+    if (shared.end) {
+        // decoded, the other side can reuse that part of the ring
+        static_cast<SharedRing *>(mSharedIn->address())->consumed.store(shared.end, std::memory_order_release);
+    }
+    return message;
+}
+
+// the frames of a BatchMessage, one after the other as if they had come
+// alone. Batches don't nest
+bool Connection::unbatch(const String &frames)
+{
+    const char *data = frames.constData();
+    int left = frames.size();
+    while (left) {
+        uint32_t size;
+        if (left < static_cast<int>(sizeof(size))) {
+            ::error("Truncated batch, %d bytes left", left);
+            return false;
+        }
+        memcpy(&size, data, sizeof(size));
+        data += sizeof(size);
+        left -= sizeof(size);
+        if (!size || size > static_cast<uint32_t>(left)) {
+            ::error("Invalid frame of %u bytes in batch, %d bytes left", size, left);
+            return false;
+        }
+        std::shared_ptr<Message> message = decodeFrame(data, size);
+        if (!message || BatchMessage::isBatch(*message))
+            return false;
+        dispatch(message);
+        // the connection may have gone away or been handed off since
+        if (!mSocketClient || !mSocketClient->isConnected())
+            return true;
+        data += size;
+        left -= size;
+    }
+    return true;
+}
+
+void Connection::dispatch(const std::shared_ptr<Message> &message)
+{
+    TraceScope trace("Connection::dispatch", "connection");
+    ++mStats.messagesReceived;
+    ++mStats.messages[message->messageId()].received;
+    IoStats::add(IoStats::MessagesReceived);
+    IoStats::messageReceived(message->messageId());
+    auto that = shared_from_this();
+    if (message->streamId() && dispatchStream(message)) {
+        // went to a request callback
+    } else if (message->messageId() == FinishMessage::MessageId) {
+        mFinishStatus = std::static_pointer_cast<FinishMessage>(message)->status();
+        mFinished(that, mFinishStatus);
+    } else if (message->messageId() == ConnectMessage::MessageId) {
+        mIsConnected = true;
+        const std::shared_ptr<ConnectMessage> connect = std::static_pointer_cast<ConnectMessage>(message);
+        mRemoteCodecs = connect->codecs();
+        mRemoteFeatures = connect->features();
+        mCodec = Compression::negotiate(mPreferredCodec, mRemoteCodecs);
+        if (mSocketClient->mode() & SocketClient::Unix)
+            attachSharedRing(connect->sharedKey(), connect->sharedSize());
+    } else if (mQueueMessages) {
+        mMessages.push_back(message);
+        wakeMessageWaiter();
+    } else {
+        newMessage()(message, that);
+    }
+}
+
+// makes room for size bytes after mBufferOffset
+void Connection::reserveData(unsigned int size)
+{
+    const unsigned int used = mBuffer.size() - mBufferOffset;
+    if (mBufferOffset && mBufferOffset >= used) {
+        // more consumed than left, move what's left to the front
+        memmove(mBuffer.data(), mBuffer.data() + mBufferOffset, used);
+        mBuffer.resize(used);
+        mBufferOffset = 0;
+    }
+    const unsigned int needed = mBufferOffset + std::max(size, used);
+    if (needed > mBuffer.capacity())
+        mBuffer.reserve(std::max(needed, mBuffer.capacity() * 2));
+}
+
+void Connection::appendData(const unsigned char* data, unsigned int size)
+{
+    const unsigned int used = mBuffer.size() - mBufferOffset;
+    reserveData(used + size);
+    const unsigned int old = mBuffer.size();
+    mBuffer.resize(old + size);
+    memcpy(mBuffer.data() + old, data, size);
 }
 
 void Connection::onDataWritten(const SocketClient::SharedPtr&, int bytes)
@@ -196,37 +571,56 @@ void Connection::onDataWritten(const SocketClient::SharedPtr&, int bytes)
     assert(mPendingWrite >= bytes);
     mPendingWrite -= bytes;
     // ::error() << "wrote some bytes" << mPendingWrite << bytes;
-    if (!mPendingWrite) {
+    if (!mPendingWrite && mBatch.isEmpty()) {
         mSendFinished(shared_from_this());
     }
 }
 
-class SocketClientBuffer : public Serializer::Buffer
+uint32_t Connection::request(const Message &message, ResponseCallback &&callback)
 {
-public:
-    SocketClientBuffer(const SocketClient::SharedPtr &client)
-        : mClient(client), mWritten(0)
-    {}
-
-    virtual bool write(const void *data, int len) override
-    {
-        if (mClient->write(data, len)) {
-            mWritten += len;
-            return true;
-        }
-        return false;
+    do {
+        if (!++mNextStreamId)
+            mNextStreamId = 1;
+    } while (mRequests.contains(mNextStreamId));
+    const uint32_t streamId = mNextStreamId;
+    // registered first, a synchronous write can read the reply before
+    // send() returns
+    mRequests[streamId] = std::make_shared<ResponseCallback>(std::move(callback));
+    if (!send(message, streamId)) {
+        mRequests.erase(streamId);
+        return 0;
     }
+    return streamId;
+}
 
-    virtual int pos() const override
-    {
-        return mWritten;
+// returns false for messages that aren't a response to one of our requests
+bool Connection::dispatchStream(const std::shared_ptr<Message> &message)
+{
+    auto it = mRequests.find(message->streamId());
+    if (it == mRequests.end()) {
+        // the end of a cancelled request, or one the other side finished
+        // on a stream it didn't ask for, is not for finished()
+        return message->messageId() == FinishMessage::MessageId;
     }
-private:
-    SocketClient::SharedPtr mClient;
-    int mWritten;
-};
+    // the callback may send, cancel or disconnect
+    const std::shared_ptr<ResponseCallback> callback = it->second;
+    if (message->messageId() == FinishMessage::MessageId)
+        mRequests.erase(it);
+    (*callback)(message);
+    return true;
+}
+
+void Connection::failRequests()
+{
+    if (mRequests.isEmpty())
+        return;
+    Hash<uint32_t, std::shared_ptr<ResponseCallback> > requests;
+    std::swap(requests, mRequests);
+    for (const auto &request : requests)
+        (*request.second)(std::shared_ptr<Message>());
+}
 
-bool Connection::send(const Message &message)
+bool Connection::send(const Message &message, uint32_t streamId)
 {
     // ::error() << getpid() << "sending message" << static_cast<int>(id) << message.size();
     if (!mSocketClient || !mSocketClient->isConnected()) {
@@ -238,21 +632,195 @@ bool Connection::send(const Message &message)
     }
 
     mAboutToSend(shared_from_this(), &message);
+    countSent(message.messageId());
 
     const int size = message.encodedSize();
-    if (size == -1 || message.mFlags & Message::MessageCache) {
-        String header, value;
-        message.prepare(mVersion, header, value);
-        mPendingWrite += header.size() + value.size();
-        assert(size == -1 || size == (header.size() + value.size() - 4));
-        return (mSocketClient->write(header) && (value.isEmpty() || mSocketClient->write(value)));
+    if (size == -1 || message.mFlags & (Message::MessageCache|Message::Compressed)) {
+        std::shared_ptr<const String> header, value;
+        message.prepare(mVersion, mCodec, mCompressionLevel, mCompressionThreshold, header, value);
+        uint64_t position;
+        if (char *shared = reserveShared(value->size(), position)) {
+            memcpy(shared, value->constData(), value->size());
+            return sendShared(message, Message::headerFlags(*header), position, value->size(), streamId);
+        }
+        if (streamId) {
+            String streamHeader;
+            Serializer serializer(streamHeader);
+            message.encodeHeader(serializer, value->size(), mVersion, Message::headerFlags(*header), streamId);
+            header = std::make_shared<const String>(std::move(streamHeader));
+        }
+        if (canBatch(header->size() + value->size()))
+            return writeFrame(*header + *value);
+        flush();
+        mPendingWrite += header->size() + value->size();
+        assert(size == -1 || message.mFlags & Message::Compressed || size == value->size());
+        // both go out in one write, referencing the message's cached copy
+        const bool corked = mSocketClient->isCorked();
+        mSocketClient->cork();
+        mSocketClient->write(header);
+        if (!value->isEmpty())
+            mSocketClient->write(value);
+        return corked ? mSocketClient->isConnected() : mSocketClient->uncork();
     } else {
         assert(size >= 0);
-        mPendingWrite += (size + Message::HeaderExtra) + sizeof(int);
-        Serializer serializer(std::unique_ptr<SocketClientBuffer>(new SocketClientBuffer(mSocketClient)));
-        message.encodeHeader(serializer, size, mVersion);
+        uint64_t position;
+        if (char *shared = reserveShared(size, position)) {
+            Serializer serializer(std::unique_ptr<Serializer::Buffer>(new SharedRingWriter(shared, size)));
+            message.encode(serializer);
+            assert(!serializer.hasError() && serializer.pos() == size);
+            return sendShared(message, message.mFlags, position, size, streamId);
+        }
+        // encode the whole frame up front so it goes out in one write
+        // rather than one per field
+        String frame;
+        frame.reserve((size + Message::HeaderExtra) + sizeof(int) + (streamId ? sizeof(streamId) : 0));
+        Serializer serializer(frame);
+        message.encodeHeader(serializer, size, mVersion, streamId);
         message.encode(serializer);
-        return !serializer.hasError();
+        return writeFrame(frame);
+    }
+}
+
+bool Connection::sendFile(const Message &message, const Path &path, uint64_t offset, int64_t length, uint32_t streamId)
+{
+    const int fd = ::open(path.constData(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        ::error() << "Couldn't open" << path << "to send it" << Rct::strerror();
+        return false;
     }
+    const bool ret = sendFile(message, fd, offset, length, streamId);
+    ::close(fd);
+    return ret;
 }
 
+bool Connection::sendFile(const Message &message, int fd, uint64_t offset, int64_t length, uint32_t streamId)
+{
+    if (!mSocketClient || !mSocketClient->isConnected()) {
+        if (!mWarned) {
+            mWarned = true;
+            ::error("Trying to send message to unconnected client (%d)", message.messageId());
+        }
+        return false;
+    }
+    if (length < 0) {
+        struct stat st;
+        if (fstat(fd, &st) == -1 || static_cast<uint64_t>(st.st_size) < offset) {
+            ::error() << "Can't send file from offset" << offset << Rct::strerror();
+            return false;
+        }
+        length = st.st_size - offset;
+    }
+
+    String body;
+    {
+        Serializer serializer(body);
+        message.encode(serializer);
+    }
+    // the file's String size follows what the message encodes
+    const int64_t size = body.size() + sizeof(uint32_t) + length;
+    if (size > INT_MAX - static_cast<int64_t>(Message::HeaderExtra + sizeof(streamId))) {
+        ::error() << "Too big to send in a message," << size << "bytes";
+        return false;
+    }
+
+    mAboutToSend(shared_from_this(), &message);
+    countSent(message.messageId());
+
+    String frame;
+    frame.reserve(sizeof(uint32_t) + Message::HeaderExtra + sizeof(streamId) + body.size() + sizeof(uint32_t));
+    Serializer serializer(frame);
+    message.encodeHeader(serializer, size, mVersion, message.mFlags & ~Message::Compressed, streamId);
+    serializer.write(body);
+    serializer << static_cast<uint32_t>(length);
+    flush();
+    mPendingWrite += frame.size() + length;
+
+    const bool corked = mSocketClient->isCorked();
+    mSocketClient->cork();
+    mSocketClient->write(frame);
+    if (!mSocketClient->sendFile(fd, offset, length)) {
+        // the other side would take whatever comes next for the file
+        mSocketClient->close();
+        return false;
+    }
+    return corked ? mSocketClient->isConnected() : mSocketClient->uncork();
+}
+
+bool Connection::sendDescriptors(const Message &message, const List<int> &fds, uint32_t streamId)
+{
+    if (!mSocketClient || !mSocketClient->isConnected() || !(mSocketClient->mode() & SocketClient::Unix)) {
+        ::error("Can't pass fds with message (%d), not connected over a UNIX socket", message.messageId());
+        return false;
+    }
+    mAboutToSend(shared_from_this(), &message);
+    countSent(message.messageId());
+
+    String body;
+    {
+        Serializer serializer(body);
+        message.encode(serializer);
+    }
+    String frame;
+    frame.reserve(sizeof(uint32_t) + Message::HeaderExtra + sizeof(streamId) + body.size());
+    Serializer serializer(frame);
+    message.encodeHeader(serializer, body.size(), mVersion, message.mFlags & ~Message::Compressed, streamId);
+    serializer.write(body);
+    flush();
+    mPendingWrite += frame.size();
+    return mSocketClient->writeDescriptors(fds.data(), fds.size(), frame.constData(), frame.size());
+}
+
+Connection::Handoff Connection::detach()
+{
+    Handoff ret;
+    // batched writes are writes pending
+    flush();
+    if (!mSocketClient || !mSocketClient->isConnected() || mSocketClient->isTls() || mSocketClient->pendingWrite()
+        || !mRequests.isEmpty() || mSharedOut || mSharedIn) {
+        ::error() << "Can't hand off this connection";
+        return ret;
+    }
+    ret.mode = mSocketClient->mode() & (SocketClient::Tcp | SocketClient::Unix | SocketClient::IPv6);
+    ret.remoteCodecs = mRemoteCodecs;
+    ret.remoteFeatures = mRemoteFeatures;
+    ret.connected = mIsConnected;
+    // the size of a frame we're in the middle of has been taken out of
+    // the buffer already
+    if (mPendingRead) {
+        Serializer serializer(ret.unread);
+        serializer << static_cast<uint32_t>(mPendingRead);
+    }
+    ret.unread.append(reinterpret_cast<const char *>(mBuffer.data() + mBufferOffset), mBuffer.size() - mBufferOffset);
+    const Buffer &pending = mSocketClient->buffer();
+    ret.unread.append(reinterpret_cast<const char *>(pending.data()), pending.size());
+    mBuffer.clear();
+    mBufferOffset = 0;
+    mPendingRead = 0;
+    mPendingWrite = 0;
+    ret.fd = mSocketClient->takeFD();
+    return ret;
+}
+
+std::shared_ptr<Connection> Connection::adopt(const Handoff &handoff, int version)
+{
+    if (handoff.fd == -1)
+        return std::shared_ptr<Connection>();
+    std::shared_ptr<Connection> ret(new Connection(version));
+    ret->mRemoteCodecs = handoff.remoteCodecs;
+    ret->mRemoteFeatures = handoff.remoteFeatures;
+    ret->mCodec = Compression::negotiate(ret->mPreferredCodec, ret->mRemoteCodecs);
+    ret->mIsConnected = handoff.connected;
+    ret->mSocketClient.reset(new SocketClient(handoff.fd, handoff.mode));
+    ret->attachClient();
+    if (!handoff.unread.isEmpty())
+        ret->appendData(reinterpret_cast<const unsigned char *>(handoff.unread.constData()), handoff.unread.size());
+    // once whoever adopted it has had a chance to connect to newMessage()
+    std::weak_ptr<Connection> weak = ret;
+    EventLoop::eventLoop()->callLater([weak]() {
+            if (auto strong = weak.lock()) {
+                if (strong->mSocketClient)
+                    strong->onDataAvailable(strong->mSocketClient, Buffer());
+            }
+        });
+    return ret;
+}
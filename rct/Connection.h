@@ -1,18 +1,24 @@
 #ifndef CONNECTION_H
 #define CONNECTION_H
 
+#include <rct/BatchMessage.h>
 #include <rct/Buffer.h>
+#include <rct/Compression.h>
 #include <rct/Message.h>
 #include <rct/SocketClient.h>
 #include <rct/String.h>
 #include <rct/LinkedList.h>
+#include <rct/Hash.h>
 #include <rct/Map.h>
 #include <rct/ResponseMessage.h>
 #include <rct/SignalSlot.h>
 #include <rct/ConnectMessage.h>
 #include <rct/FinishMessage.h>
+#include <deque>
 
 class ConnectionPrivate;
+class SharedMemory;
+class TlsContext;
 class SocketClient;
 class Event;
 class Connection : public std::enable_shared_from_this<Connection>
@@ -33,6 +39,41 @@ public:
     void setVersion(int version) { mVersion = version; }
     int version() const { return mVersion; }
 
+    // Codec for messages flagged Message::Compressed. Until the other side's
+    // ConnectMessage has arrived only zlib is used, after that codec if the
+    // other side supports it. Messages that encode to less than threshold
+    // bytes are sent uncompressed.
+    enum { DefaultCompressionThreshold = 1024 };
+    void setCompression(Compression::Codec codec, int level = 0, int threshold = DefaultCompressionThreshold);
+    Compression::Codec compression() const { return mCodec; }
+
+    // Same host transport for Unix socket connections. Message bodies of
+    // threshold bytes or more go through a shared memory ring of size bytes
+    // rather than the socket, which only carries a small descriptor. The
+    // ring is offered to the other side with a ConnectMessage, as soon as
+    // it's connected, and used once the other side has attached to it. If
+    // the ring is full, or the other side doesn't know about rings, messages
+    // go through the socket as usual. Only this side's sends are affected,
+    // size 0 turns it off again.
+    enum { DefaultSharedMemoryThreshold = 64 * 1024 };
+    void setSharedMemory(unsigned int size, unsigned int threshold = DefaultSharedMemoryThreshold);
+
+    // TLS for connectTcp(), see SocketClient::startTls(). serverName is
+    // the host connected to unless given
+    void setTls(const std::shared_ptr<TlsContext> &context, const String &serverName = String())
+    {
+        mTlsContext = context;
+        mTlsServerName = serverName;
+    }
+    // socket options for the connections connectTcp() and connectUnix()
+    // make and the one there is now, see SocketClient::setOptions()
+    void setSocketOptions(const SocketClient::Options &options)
+    {
+        mSocketOptions = options;
+        if (mSocketClient)
+            mSocketClient->setOptions(options);
+    }
+
     void setSilent(bool on) { mSilent = on; }
     bool isSilent() const { return mSilent; }
 
@@ -41,7 +82,136 @@ public:
 
     int pendingWrite() const;
 
-    bool send(const Message &message);
+    // Messages through this connection, the totals of every connection are
+    // in IoStats. For the syscalls see SocketClient::stats()
+    struct MessageCounts
+    {
+        MessageCounts()
+            : sent(0), received(0)
+        {}
+
+        uint64_t sent, received;
+    };
+    struct Stats
+    {
+        Stats()
+            : messagesSent(0), messagesReceived(0), batchesSent(0), batchesReceived(0), decodeTime(0)
+        {}
+
+        uint64_t messagesSent, messagesReceived;
+        // BatchMessage frames, the messages in them are counted as well
+        uint64_t batchesSent, batchesReceived;
+        // nanoseconds spent in Message::create()
+        uint64_t decodeTime;
+        // by message id
+        MessageCounts messages[256];
+    };
+    const Stats &stats() const { return mStats; }
+
+    // Flow control, see SocketClient::setWatermarks(). Applies to the
+    // current client and any connected later, writeBlocked() and
+    // writeUnblocked() are relayed from it and so also follow
+    // SocketClient::setWriteBudget().
+    void setWatermarks(unsigned int high, unsigned int low);
+    bool isWriteBlocked() const { return mSocketClient && mSocketClient->isWriteBlocked(); }
+    // Stop reading from the peer while write blocked, so a peer that keeps
+    // sending without reading what it gets back is held up as well
+    void setSuspendReadWhileBlocked(bool on);
+    bool suspendReadWhileBlocked() const { return mSuspendRead; }
+
+    // streamId 0 sends the message the classic way, anything else tags it
+    // for the stream, see request()
+    bool send(const Message &message, uint32_t streamId = 0);
+    // Sends message with length bytes of the file from offset, or the rest
+    // of it with length -1, after what it encodes, as if it had encoded
+    // them as a String last. The file goes to the socket with
+    // SocketClient::sendFile() instead of being read into memory, the
+    // receiving message type decodes its fields and then the String, or a
+    // StringView with pinsData(). These frames are never compressed or put
+    // in shared memory and have to be under 2GB
+    bool sendFile(const Message &message, const Path &path, uint64_t offset = 0, int64_t length = -1, uint32_t streamId = 0);
+    bool sendFile(const Message &message, int fd, uint64_t offset = 0, int64_t length = -1, uint32_t streamId = 0);
+
+    // UNIX. Sends message with copies of fds passed along, see
+    // SocketClient::writeDescriptors(). The frame goes out whole, never
+    // compressed or through shared memory. On the other side they're
+    // waiting by the time newMessage() is emitted for the message and are
+    // taken with takeDescriptors(), the message has to tell how many
+    bool sendDescriptors(const Message &message, const List<int> &fds, uint32_t streamId = 0);
+    List<int> takeDescriptors(int count = -1) { return mSocketClient ? mSocketClient->takeDescriptors(count) : List<int>(); }
+
+    // Moving a connection to another process, to have a worker serve an
+    // accepted client directly. detach() takes the socket away from this
+    // connection, which is closed after without the peer noticing, along
+    // with everything it has read but not decoded yet and what the
+    // ConnectMessage exchange settled. That can't be done with writes
+    // pending, requests in flight, TLS or shared memory, the Handoff then
+    // has fd -1. Pass the fd on with sendDescriptors() in a message that
+    // carries the rest of the Handoff, it serializes without the fd, and
+    // close it here. The other side puts the fd it takes back in and calls
+    // adopt(), messages already read come out of that connection's
+    // newMessage() from the next loop iteration.
+    struct Handoff
+    {
+        Handoff()
+            : fd(-1), mode(0), remoteCodecs(0), remoteFeatures(0), connected(false)
+        {}
+
+        int fd;
+        // SocketClient::Mode
+        unsigned int mode;
+        unsigned int remoteCodecs, remoteFeatures;
+        bool connected;
+        String unread;
+    };
+    Handoff detach();
+    static std::shared_ptr<Connection> adopt(const Handoff &handoff, int version = 0);
+
+    // Batching. What's sent between cork() and uncork() is queued and goes
+    // out in as few writes as the socket allows once uncorked, so a reply
+    // and the FinishMessage after it don't wait on each other's ACKs.
+    // Corks don't nest, see SocketClient::cork()
+    void cork()
+    {
+        if (mSocketClient)
+            mSocketClient->cork();
+    }
+    bool uncork()
+    {
+        flush();
+        return mSocketClient && mSocketClient->uncork();
+    }
+
+    // Coalescing. With maxBytes, messages whose frame is smaller than that
+    // aren't written one by one but packed into a BatchMessage with what
+    // else is sent in the same loop iteration, or within maxLatency ms if
+    // that's given. The batch goes out when it reaches maxBytes, at
+    // flush() or uncork(), and before anything too big for it so the order
+    // is kept. The other side takes it apart before newMessage() and the
+    // rest, each message is counted and dispatched as if it came alone.
+    // Only used once the other side's ConnectMessage says it knows about
+    // batches, maxBytes 0 turns it off again.
+    enum { DefaultCoalescingBytes = 16 * 1024 };
+    void setCoalescing(unsigned int maxBytes = DefaultCoalescingBytes, int maxLatency = 0);
+    unsigned int coalescing() const { return mCoalesceBytes; }
+    // writes what's batched now
+    bool flush();
+
+    // Multiplexing. request() sends message on a new stream and returns its
+    // id, or 0 if it couldn't be sent. Everything the other side sends back
+    // on that stream goes to callback instead of newMessage(), up to and
+    // including the FinishMessage that closes it, so any number of requests
+    // can be in flight on one connection. If the connection goes away first
+    // callback gets a null message. The other side sees requests through
+    // newMessage() with Message::streamId() set and answers with
+    // send(reply, streamId) and finishStream(). Both sides need to be new
+    // enough to know about stream ids.
+    typedef std::function<void(const std::shared_ptr<Message> &)> ResponseCallback;
+    uint32_t request(const Message &message, ResponseCallback &&callback);
+    // drops the callback, anything still arriving on the stream is ignored
+    void cancel(uint32_t streamId) { mRequests.erase(streamId); }
+    size_t pendingRequests() const { return mRequests.size(); }
+    void finishStream(uint32_t streamId, int status = 0) { send(FinishMessage(status), streamId); }
     template <int StaticBufSize>
     bool write(const char *format, ...)
     {
@@ -64,6 +234,8 @@ public:
     template <int StaticBufSize>
     void finish(const char *format, ...)
     {
+        const bool corked = mSocketClient && mSocketClient->isCorked();
+        cork();
         if (!mSilent) {
             va_list args;
             va_start(args, format);
@@ -72,18 +244,29 @@ public:
             send(ResponseMessage(ret));
         }
         send(FinishMessage(0));
+        if (!corked)
+            uncork();
     }
 
     void finish(const String &msg, int status = 0)
     {
+        const bool corked = mSocketClient && mSocketClient->isCorked();
+        cork();
         if (!mSilent)
             send(ResponseMessage(msg));
         send(FinishMessage(status));
+        if (!corked)
+            uncork();
     }
 
     int finishStatus() const { return mFinishStatus; }
 
-    void close() { assert(mSocketClient); mSocketClient->close(); }
+    void close()
+    {
+        assert(mSocketClient);
+        flush();
+        mSocketClient->close();
+    }
 
     bool isConnected() const { return mSocketClient->isConnected(); }
 
@@ -91,37 +274,157 @@ public:
     Signal<std::function<void(std::shared_ptr<Connection>)> > &connected() { return mConnected; }
     Signal<std::function<void(std::shared_ptr<Connection>)> > &disconnected() { return mDisconnected; }
     Signal<std::function<void(std::shared_ptr<Connection>)> > &error() { return mError; }
+    Signal<std::function<void(std::shared_ptr<Connection>)> > &writeBlocked() { return mWriteBlocked; }
+    Signal<std::function<void(std::shared_ptr<Connection>)> > &writeUnblocked() { return mWriteUnblocked; }
     Signal<std::function<void(std::shared_ptr<Connection>, int)> > &finished() { return mFinished; }
     Signal<std::function<void(std::shared_ptr<Connection>, const Message *)> > &aboutToSend() { return mAboutToSend; }
     Signal<std::function<void(std::shared_ptr<Message>, std::shared_ptr<Connection>)> > &newMessage() { return mNewMessage; }
     SocketClient::SharedPtr client() const { return mSocketClient; }
 
+    // Taking messages rather than having them emitted, see
+    // Rct::nextMessage(). Once queueing is on, what would go to
+    // newMessage() waits here for takeMessage(), so nothing is lost while
+    // the taker is busy elsewhere. One waiter can be woken directly when a
+    // message is queued or the connection goes away, it's cleared before
+    // it's called.
+    void setQueueMessages(bool on) { mQueueMessages = on; }
+    bool hasMessage() const { return !mMessages.empty(); }
+    std::shared_ptr<Message> takeMessage()
+    {
+        std::shared_ptr<Message> message;
+        if (!mMessages.empty()) {
+            message = std::move(mMessages.front());
+            mMessages.pop_front();
+        }
+        return message;
+    }
+    typedef void (*MessageWaiter)(void *userData);
+    void setMessageWaiter(MessageWaiter waiter, void *userData)
+    {
+        mMessageWaiter = waiter;
+        mMessageWaiterData = userData;
+    }
+
 private:
     Connection(int version);
     void connect(const SocketClient::SharedPtr &client);
-    void onClientConnected(const SocketClient::SharedPtr&) { mConnected(shared_from_this()); }
-    void onClientDisconnected(const SocketClient::SharedPtr&) { mDisconnected(shared_from_this()); }
+    void attachClient();
+    void onClientConnected(const SocketClient::SharedPtr&)
+    {
+        // tell the server which codecs we have, older servers ignore it
+        sendConnectMessage();
+        mConnected(shared_from_this());
+    }
+    void onClientDisconnected(const SocketClient::SharedPtr&)
+    {
+        failRequests();
+        mDisconnected(shared_from_this());
+        wakeMessageWaiter();
+    }
     void onDataAvailable(const SocketClient::SharedPtr&, Buffer&& buffer);
     void onDataWritten(const SocketClient::SharedPtr&, int);
+    void onWriteBlocked(const SocketClient::SharedPtr&);
+    void onWriteUnblocked(const SocketClient::SharedPtr&);
     void onSocketError(const SocketClient::SharedPtr&, SocketClient::Error error)
     {
         ::warning() << "Socket error" << error << errno << Rct::strerror();
+        failRequests();
         mError(shared_from_this());
         mDisconnected(shared_from_this());
+        wakeMessageWaiter();
+    }
+    void wakeMessageWaiter()
+    {
+        if (MessageWaiter waiter = mMessageWaiter) {
+            mMessageWaiter = 0;
+            waiter(mMessageWaiterData);
+        }
     }
     void checkData();
+    std::shared_ptr<Message> decodeFrame(const char *data, int size);
+    bool unbatch(const String &frames);
+    void dispatch(const std::shared_ptr<Message> &message);
+    // batches frame if it can, otherwise writes what's batched and then it
+    bool writeFrame(const String &frame);
+    bool canBatch(unsigned int size) const
+    {
+        return size < mCoalesceBytes && mRemoteFeatures & ConnectMessage::Batches;
+    }
+    void scheduleFlush();
+    void sendConnectMessage();
+    bool createSharedRing();
+    void attachSharedRing(int key, unsigned int size);
+    char *reserveShared(uint32_t size, uint64_t &position);
+    bool sendShared(const Message &message, uint8_t flags, uint64_t position, uint32_t size, uint32_t streamId);
+    bool dispatchStream(const std::shared_ptr<Message> &message);
+    void failRequests();
+    void reserveData(unsigned int size);
+    void appendData(const unsigned char* data, unsigned int size);
 
     SocketClient::SharedPtr mSocketClient;
-    LinkedList<Buffer> mBuffers;
+    // received data, mBufferOffset bytes of it are consumed already
+    Buffer mBuffer;
+    unsigned int mBufferOffset;
     int mPendingRead, mPendingWrite, mTimeoutTimer, mFinishStatus, mVersion;
 
-    bool mSilent, mIsConnected, mWarned;
+    bool mSilent, mIsConnected, mWarned, mSuspendRead;
+    unsigned int mHighWatermark, mLowWatermark;
+
+    Compression::Codec mPreferredCodec, mCodec;
+    unsigned int mRemoteCodecs, mRemoteFeatures;
+    int mCompressionLevel, mCompressionThreshold;
+
+    // our ring, written here and read by the other side, and theirs
+    std::unique_ptr<SharedMemory> mSharedOut, mSharedIn;
+    unsigned int mSharedSize, mSharedThreshold;
+    // total bytes ever placed in mSharedOut, the ring offset is this
+    // modulo its size
+    uint64_t mSharedWritten;
+
+    std::shared_ptr<TlsContext> mTlsContext;
+    String mTlsServerName;
+    SocketClient::Options mSocketOptions;
+    Stats mStats;
+    void countSent(uint8_t messageId);
+
+    // frames waiting to go out as a BatchMessage, how many, and whether
+    // there's a flush on the way
+    String mBatch;
+    int mBatchCount, mFlushTimer;
+    bool mFlushScheduled;
+    unsigned int mCoalesceBytes;
+    int mCoalesceLatency;
+
+    // callbacks for the requests in flight, by stream id
+    Hash<uint32_t, std::shared_ptr<ResponseCallback> > mRequests;
+    uint32_t mNextStreamId;
+
+    // for takeMessage()
+    bool mQueueMessages;
+    std::deque<std::shared_ptr<Message> > mMessages;
+    MessageWaiter mMessageWaiter;
+    void *mMessageWaiterData;
 
     Signal<std::function<void(std::shared_ptr<Message>, std::shared_ptr<Connection>)> > mNewMessage;
     Signal<std::function<void(std::shared_ptr<Connection>)> > mConnected, mDisconnected, mError, mSendFinished;
+    Signal<std::function<void(std::shared_ptr<Connection>)> > mWriteBlocked, mWriteUnblocked;
     Signal<std::function<void(std::shared_ptr<Connection>, int)> > mFinished;
     Signal<std::function<void(std::shared_ptr<Connection>, const Message *)> > mAboutToSend;
 
 };
 
+template <>
+inline Serializer &operator<<(Serializer &s, const Connection::Handoff &handoff)
+{
+    s << handoff.mode << handoff.remoteCodecs << handoff.remoteFeatures << handoff.connected << handoff.unread;
+    return s;
+}
+
+template <>
+inline Deserializer &operator>>(Deserializer &s, Connection::Handoff &handoff)
+{
+    s >> handoff.mode >> handoff.remoteCodecs >> handoff.remoteFeatures >> handoff.connected >> handoff.unread;
+    return s;
+}
+
 #endif // CONNECTION_H
@@ -0,0 +1,270 @@
+#include "ConnectionPool.h"
+#include "EventLoop.h"
+#include "Timer.h"
+#include <assert.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+ConnectionPool::ConnectionPool(int version)
+    : mVersion(version), mMaxIdle(DefaultMaxIdle), mMaxConnections(0),
+      mIdleTimeout(DefaultIdleTimeout), mConnectTimeout(0)
+{
+}
+
+ConnectionPool::~ConnectionPool()
+{
+    clear();
+}
+
+void ConnectionPool::acquire(const String &host, uint16_t port, Callback &&callback)
+{
+    const String key = String::format<128>("tcp:%s:%u", host.constData(), port);
+    Endpoint &endpoint = mEndpoints[key];
+    endpoint.host = host;
+    endpoint.port = port;
+    acquire(key, std::move(callback));
+}
+
+void ConnectionPool::acquireUnix(const Path &socketFile, Callback &&callback)
+{
+    const String key = "unix:" + socketFile;
+    Endpoint &endpoint = mEndpoints[key];
+    endpoint.path = socketFile;
+    acquire(key, std::move(callback));
+}
+
+void ConnectionPool::acquire(const String &key, Callback &&callback)
+{
+    Endpoint &endpoint = mEndpoints[key];
+    while (!endpoint.idle.isEmpty()) {
+        const Idle idle = endpoint.idle.takeLast();
+        if (idle.timer)
+            EventLoop::eventLoop()->unregisterTimer(idle.timer);
+        unhook(idle.connection);
+        if (isHealthy(idle.connection)) {
+            lend(key, idle.connection, callback);
+            return;
+        }
+        drop(endpoint, idle.connection);
+    }
+    if (mMaxConnections && endpoint.live >= mMaxConnections) {
+        endpoint.waiting.append(std::move(callback));
+        return;
+    }
+    open(key, std::move(callback));
+}
+
+void ConnectionPool::open(const String &key, Callback &&callback)
+{
+    Endpoint &endpoint = mEndpoints[key];
+    ++endpoint.live;
+    std::shared_ptr<Connection> connection = Connection::create(mVersion);
+    connection->setSocketOptions(mSocketOptions);
+    endpoint.connecting.append(connection);
+
+    const WeakPtr weak = shared_from_this();
+    const std::shared_ptr<Callback> cb = std::make_shared<Callback>(std::move(callback));
+    connection->connected().connect([weak, key, cb](std::shared_ptr<Connection> connection) {
+            if (SharedPtr pool = weak.lock())
+                pool->onConnected(key, connection, cb);
+        });
+    connection->disconnected().connect([weak, key, cb](std::shared_ptr<Connection> connection) {
+            if (SharedPtr pool = weak.lock())
+                pool->onConnectFailed(key, connection, cb);
+        });
+
+    bool ok;
+    if (endpoint.port) {
+        ok = connection->connectTcp(endpoint.host, endpoint.port, mConnectTimeout);
+    } else {
+        ok = connection->connectUnix(endpoint.path, mConnectTimeout);
+    }
+    if (!ok)
+        onConnectFailed(key, connection, cb);
+}
+
+void ConnectionPool::onConnected(const String &key, const std::shared_ptr<Connection> &connection, const std::shared_ptr<Callback> &callback)
+{
+    Endpoint &endpoint = mEndpoints[key];
+    const int idx = endpoint.connecting.indexOf(connection);
+    if (idx == -1)
+        return;
+    endpoint.connecting.removeAt(idx);
+    unhook(connection);
+    lend(key, connection, *callback);
+}
+
+void ConnectionPool::onConnectFailed(const String &key, const std::shared_ptr<Connection> &connection, const std::shared_ptr<Callback> &callback)
+{
+    Endpoint &endpoint = mEndpoints[key];
+    const int idx = endpoint.connecting.indexOf(connection);
+    if (idx == -1)
+        return;
+    endpoint.connecting.removeAt(idx);
+    unhook(connection);
+    --endpoint.live;
+    (*callback)(std::shared_ptr<Connection>());
+    serveWaiting(key);
+}
+
+void ConnectionPool::lend(const String &key, const std::shared_ptr<Connection> &connection, const Callback &callback)
+{
+    mLent[connection.get()] = key;
+    callback(connection);
+}
+
+void ConnectionPool::release(const std::shared_ptr<Connection> &connection)
+{
+    auto it = mLent.find(connection.get());
+    if (it == mLent.end())
+        return;
+    const String key = it->second;
+    mLent.erase(it);
+    Endpoint &endpoint = mEndpoints[key];
+    unhook(connection);
+    if (connection->pendingRequests() || !isHealthy(connection)) {
+        drop(endpoint, connection);
+        serveWaiting(key);
+        return;
+    }
+    if (!endpoint.waiting.isEmpty()) {
+        // straight on to whoever's been waiting for it
+        const Callback callback = endpoint.waiting.takeFirst();
+        lend(key, connection, callback);
+        return;
+    }
+    if (endpoint.idle.size() >= static_cast<int>(mMaxIdle)) {
+        drop(endpoint, connection);
+        return;
+    }
+
+    Idle idle = { connection, 0 };
+    if (mIdleTimeout > 0) {
+        const WeakPtr weak = shared_from_this();
+        Connection *conn = connection.get();
+        idle.timer = EventLoop::eventLoop()->registerTimer([weak, key, conn](int) {
+                if (SharedPtr pool = weak.lock())
+                    pool->expire(key, conn);
+            }, mIdleTimeout, Timer::SingleShot);
+    }
+    endpoint.idle.append(idle);
+    watch(key, connection);
+}
+
+void ConnectionPool::discard(const std::shared_ptr<Connection> &connection)
+{
+    auto it = mLent.find(connection.get());
+    if (it == mLent.end())
+        return;
+    const String key = it->second;
+    mLent.erase(it);
+    drop(mEndpoints[key], connection);
+    serveWaiting(key);
+}
+
+// while idle, the other side going away or sending anything means the
+// connection is no good anymore
+void ConnectionPool::watch(const String &key, const std::shared_ptr<Connection> &connection)
+{
+    const WeakPtr weak = shared_from_this();
+    Connection *conn = connection.get();
+    auto gone = [weak, key, conn](std::shared_ptr<Connection>) {
+        if (SharedPtr pool = weak.lock())
+            pool->expire(key, conn);
+    };
+    connection->disconnected().connect(gone);
+    connection->error().connect(gone);
+    connection->newMessage().connect([weak, key, conn](std::shared_ptr<Message>, std::shared_ptr<Connection>) {
+            if (SharedPtr pool = weak.lock())
+                pool->expire(key, conn);
+        });
+}
+
+void ConnectionPool::expire(const String &key, Connection *connection)
+{
+    auto it = mEndpoints.find(key);
+    if (it == mEndpoints.end())
+        return;
+    Endpoint &endpoint = it->second;
+    for (int i = 0; i < endpoint.idle.size(); ++i) {
+        if (endpoint.idle.at(i).connection.get() == connection) {
+            const Idle idle = endpoint.idle.at(i);
+            endpoint.idle.removeAt(i);
+            // called from the timer this is a no-op
+            if (idle.timer)
+                EventLoop::eventLoop()->unregisterTimer(idle.timer);
+            unhook(idle.connection);
+            drop(endpoint, idle.connection);
+            serveWaiting(key);
+            return;
+        }
+    }
+}
+
+void ConnectionPool::drop(Endpoint &endpoint, const std::shared_ptr<Connection> &connection)
+{
+    assert(endpoint.live);
+    --endpoint.live;
+    if (connection->client())
+        connection->close();
+}
+
+// a connection went away, that makes room for someone waiting for one
+void ConnectionPool::serveWaiting(const String &key)
+{
+    Endpoint &endpoint = mEndpoints[key];
+    while (!endpoint.waiting.isEmpty() && (!mMaxConnections || endpoint.live < mMaxConnections)) {
+        Callback callback = endpoint.waiting.takeFirst();
+        open(key, std::move(callback));
+    }
+}
+
+size_t ConnectionPool::idleCount() const
+{
+    size_t ret = 0;
+    for (const auto &endpoint : mEndpoints)
+        ret += endpoint.second.idle.size();
+    return ret;
+}
+
+void ConnectionPool::clear()
+{
+    EventLoop::SharedPtr loop = EventLoop::eventLoop();
+    for (auto &endpoint : mEndpoints) {
+        for (const Idle &idle : endpoint.second.idle) {
+            if (idle.timer && loop)
+                loop->unregisterTimer(idle.timer);
+            unhook(idle.connection);
+            drop(endpoint.second, idle.connection);
+        }
+        endpoint.second.idle.clear();
+    }
+}
+
+// The socket can be readable on an idle connection for two reasons, the
+// other side hung up or it sent something nobody asked for. Either way it
+// can't be reused, so a peek that would block is what healthy looks like.
+bool ConnectionPool::isHealthy(const std::shared_ptr<Connection> &connection)
+{
+    const SocketClient::SharedPtr client = connection->client();
+    if (!client || !client->isConnected() || client->state() != SocketClient::Connected)
+        return false;
+    char c;
+    const ssize_t r = ::recv(client->socket(), &c, 1, MSG_PEEK | MSG_DONTWAIT);
+    return r == -1 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+// drops whatever the last user, or the pool, had connected
+void ConnectionPool::unhook(const std::shared_ptr<Connection> &connection)
+{
+    connection->newMessage().disconnect();
+    connection->connected().disconnect();
+    connection->disconnected().disconnect();
+    connection->error().disconnect();
+    connection->finished().disconnect();
+    connection->sendFinished().disconnect();
+    connection->aboutToSend().disconnect();
+    connection->writeBlocked().disconnect();
+    connection->writeUnblocked().disconnect();
+}
@@ -0,0 +1,120 @@
+#ifndef CONNECTIONPOOL_H
+#define CONNECTIONPOOL_H
+
+#include <rct/Connection.h>
+#include <rct/Hash.h>
+#include <rct/List.h>
+#include <rct/Path.h>
+#include <rct/String.h>
+#include <functional>
+#include <memory>
+
+// Outbound Connections kept open between uses, by endpoint, so a request
+// doesn't pay for a connect and the ConnectMessage exchange every time.
+// Everything happens on the event loop of the thread using the pool.
+//
+// acquire() hands out an idle connection to the endpoint if there's a
+// healthy one, otherwise it connects a new one. When done with it the
+// connection goes back with release(), which drops every slot connected to
+// its signals, or with discard() if it shouldn't be reused. Idle
+// connections are closed after the idle timeout, if the other side closes
+// them, or if anything arrives on them since nothing was asked for.
+class ConnectionPool : public std::enable_shared_from_this<ConnectionPool>
+{
+public:
+    typedef std::shared_ptr<ConnectionPool> SharedPtr;
+    typedef std::weak_ptr<ConnectionPool> WeakPtr;
+
+    static SharedPtr create(int version = 0)
+    {
+        return SharedPtr(new ConnectionPool(version));
+    }
+    ~ConnectionPool();
+
+    enum {
+        DefaultMaxIdle = 8,
+        DefaultIdleTimeout = 30 * 1000
+    };
+    // idle connections kept per endpoint
+    void setMaxIdle(unsigned int max) { mMaxIdle = max; }
+    unsigned int maxIdle() const { return mMaxIdle; }
+    // connections per endpoint, handed out, idle or connecting. acquire()
+    // waits for one to come back once there are this many, 0 means no limit
+    void setMaxConnections(unsigned int max) { mMaxConnections = max; }
+    unsigned int maxConnections() const { return mMaxConnections; }
+    // in ms, applies to connections released from now on, 0 keeps them
+    // until the other side goes away
+    void setIdleTimeout(int timeout) { mIdleTimeout = timeout; }
+    int idleTimeout() const { return mIdleTimeout; }
+    // passed to Connection::connectTcp() and connectUnix()
+    void setConnectTimeout(int timeout) { mConnectTimeout = timeout; }
+    int connectTimeout() const { return mConnectTimeout; }
+    // passed to Connection::setSocketOptions()
+    void setSocketOptions(const SocketClient::Options &options) { mSocketOptions = options; }
+    const SocketClient::Options &socketOptions() const { return mSocketOptions; }
+
+    // callback gets a connected Connection, or null if connecting failed.
+    // It may be called before acquire() returns
+    typedef std::function<void(const std::shared_ptr<Connection> &)> Callback;
+    void acquire(const String &host, uint16_t port, Callback &&callback);
+    void acquireUnix(const Path &socketFile, Callback &&callback);
+
+    // Connections with requests in flight, or that aren't healthy anymore,
+    // are closed rather than kept
+    void release(const std::shared_ptr<Connection> &connection);
+    void discard(const std::shared_ptr<Connection> &connection);
+
+    size_t idleCount() const;
+    // closes every idle connection
+    void clear();
+
+private:
+    ConnectionPool(int version);
+
+    struct Idle
+    {
+        std::shared_ptr<Connection> connection;
+        int timer;
+    };
+    struct Endpoint
+    {
+        Endpoint()
+            : port(0), live(0)
+        {}
+
+        String host;
+        uint16_t port;
+        Path path;
+        // most recently released last, that's the one handed out next
+        List<Idle> idle;
+        List<std::shared_ptr<Connection> > connecting;
+        List<Callback> waiting;
+        // handed out, idle and connecting
+        unsigned int live;
+    };
+
+    void acquire(const String &key, Callback &&callback);
+    void open(const String &key, Callback &&callback);
+    void onConnected(const String &key, const std::shared_ptr<Connection> &connection, const std::shared_ptr<Callback> &callback);
+    void onConnectFailed(const String &key, const std::shared_ptr<Connection> &connection, const std::shared_ptr<Callback> &callback);
+    void watch(const String &key, const std::shared_ptr<Connection> &connection);
+    void expire(const String &key, Connection *connection);
+    void drop(Endpoint &endpoint, const std::shared_ptr<Connection> &connection);
+    void serveWaiting(const String &key);
+    void lend(const String &key, const std::shared_ptr<Connection> &connection, const Callback &callback);
+
+    static bool isHealthy(const std::shared_ptr<Connection> &connection);
+    static void unhook(const std::shared_ptr<Connection> &connection);
+
+    int mVersion;
+    unsigned int mMaxIdle, mMaxConnections;
+    int mIdleTimeout, mConnectTimeout;
+    SocketClient::Options mSocketOptions;
+
+    // "tcp:host:port" or "unix:socketfile"
+    Hash<String, Endpoint> mEndpoints;
+    // what's handed out, and where to
+    Hash<Connection *, String> mLent;
+};
+
+#endif
@@ -0,0 +1,243 @@
+#ifndef COROUTINE_H
+#define COROUTINE_H
+
+// C++20 coroutine glue for the event loop. The rest of rct is C++11 so all
+// of this is only there when the including translation unit is built with
+// coroutine support, check RCT_HAVE_COROUTINES. Everything resumes on the
+// thread of the event loop that was current when the co_await started.
+
+#if defined(__has_include)
+#  if __has_include(<coroutine>) && defined(__cpp_impl_coroutine)
+#    define RCT_HAVE_COROUTINES
+#  endif
+#endif
+
+#if defined(RCT_HAVE_COROUTINES)
+
+#include <rct/Buffer.h>
+#include <rct/Connection.h>
+#include <rct/EventLoop.h>
+#include <rct/Process.h>
+#include <rct/SocketClient.h>
+#include <rct/Timer.h>
+#include <coroutine>
+#include <exception>
+#include <memory>
+
+namespace Rct {
+
+// A coroutine that starts right away and cleans up after itself when it
+// returns, a Task object is only there to make the function a coroutine.
+//
+//     Rct::Task poll(Connection::SharedPtr conn)
+//     {
+//         while (std::shared_ptr<Message> msg = co_await Rct::nextMessage(conn)) {
+//             ...
+//             co_await Rct::sleep(100);
+//         }
+//     }
+//
+// Whatever is co_await'ed on must outlive the wait.
+class Task
+{
+public:
+    struct promise_type
+    {
+        Task get_return_object() { return Task(); }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() { }
+        void unhandled_exception() { std::terminate(); }
+    };
+};
+
+// co_await Rct::sleep(ms) resumes from the loop's timer dispatch once ms
+// milliseconds have passed
+class SleepAwaiter
+{
+public:
+    SleepAwaiter(int ms, const EventLoop::SharedPtr& l)
+        : timeout(ms), timerId(0), loop(l)
+    {
+    }
+    SleepAwaiter(const SleepAwaiter&) = delete;
+    SleepAwaiter& operator=(const SleepAwaiter&) = delete;
+    ~SleepAwaiter()
+    {
+        // the frame went away while we were waiting
+        if (timerId) {
+            if (EventLoop::SharedPtr l = loop.lock())
+                l->unregisterTimer(timerId);
+        }
+    }
+
+    bool await_ready() const { return timeout < 0; }
+    bool await_suspend(std::coroutine_handle<> handle)
+    {
+        EventLoop::SharedPtr l = loop.lock();
+        if (!l)
+            return false;
+        timerId = l->registerTimer([this, handle](int) {
+                timerId = 0;
+                handle.resume();
+            }, timeout, Timer::SingleShot);
+        return timerId != 0;
+    }
+    void await_resume() const { }
+
+private:
+    int timeout, timerId;
+    EventLoop::WeakPtr loop;
+};
+
+inline SleepAwaiter sleep(int ms, const EventLoop::SharedPtr& loop = EventLoop::eventLoop())
+{
+    return SleepAwaiter(ms, loop);
+}
+
+// co_await Rct::readable(client) gives what the client has read, right
+// away if something is buffered already, or an empty buffer if it
+// disconnected or failed first. The coroutine is the client's read waiter
+// while it waits so readyRead() isn't emitted for that data.
+class ReadableAwaiter
+{
+public:
+    ReadableAwaiter(const SocketClient::SharedPtr& c)
+        : client(c), waiting(false)
+    {
+    }
+    ReadableAwaiter(const ReadableAwaiter&) = delete;
+    ReadableAwaiter& operator=(const ReadableAwaiter&) = delete;
+    ~ReadableAwaiter()
+    {
+        if (waiting)
+            client->setReadWaiter(0, 0);
+    }
+
+    bool await_ready() const
+    {
+        return !client || !client->buffer().isEmpty() || !client->isConnected();
+    }
+    void await_suspend(std::coroutine_handle<> h)
+    {
+        handle = h;
+        waiting = true;
+        client->setReadWaiter(&ReadableAwaiter::wake, this);
+    }
+    Buffer await_resume() { return client ? Buffer(client->takeBuffer()) : Buffer(); }
+
+private:
+    static void wake(void* userData)
+    {
+        ReadableAwaiter* that = static_cast<ReadableAwaiter*>(userData);
+        that->waiting = false;
+        that->handle.resume();
+    }
+
+    SocketClient::SharedPtr client;
+    std::coroutine_handle<> handle;
+    bool waiting;
+};
+
+inline ReadableAwaiter readable(const SocketClient::SharedPtr& client)
+{
+    return ReadableAwaiter(client);
+}
+
+// co_await Rct::nextMessage(connection) gives the next message received on
+// connection, or a null pointer if it disconnected first. The first one
+// turns on the connection's message queue, from then on messages only come
+// out of here, including the ones that arrive while the coroutine waits on
+// something else.
+class MessageAwaiter
+{
+public:
+    MessageAwaiter(const std::shared_ptr<Connection>& c)
+        : connection(c), waiting(false)
+    {
+        if (connection)
+            connection->setQueueMessages(true);
+    }
+    MessageAwaiter(const MessageAwaiter&) = delete;
+    MessageAwaiter& operator=(const MessageAwaiter&) = delete;
+    ~MessageAwaiter()
+    {
+        if (waiting)
+            connection->setMessageWaiter(0, 0);
+    }
+
+    bool await_ready() const
+    {
+        return !connection || connection->hasMessage() || !connection->isConnected();
+    }
+    void await_suspend(std::coroutine_handle<> h)
+    {
+        handle = h;
+        waiting = true;
+        connection->setMessageWaiter(&MessageAwaiter::wake, this);
+    }
+    std::shared_ptr<Message> await_resume() { return connection ? connection->takeMessage() : std::shared_ptr<Message>(); }
+
+private:
+    static void wake(void* userData)
+    {
+        MessageAwaiter* that = static_cast<MessageAwaiter*>(userData);
+        that->waiting = false;
+        that->handle.resume();
+    }
+
+    std::shared_ptr<Connection> connection;
+    std::coroutine_handle<> handle;
+    bool waiting;
+};
+
+inline MessageAwaiter nextMessage(const std::shared_ptr<Connection>& connection)
+{
+    return MessageAwaiter(connection);
+}
+
+// co_await Rct::finished(process) resumes once an asynchronously started
+// process has exited and gives its return code
+class ProcessAwaiter
+{
+public:
+    ProcessAwaiter(Process* p)
+        : process(p), finishedKey(0)
+    {
+    }
+    ProcessAwaiter(const ProcessAwaiter&) = delete;
+    ProcessAwaiter& operator=(const ProcessAwaiter&) = delete;
+    ~ProcessAwaiter()
+    {
+        if (finishedKey)
+            process->finished().disconnect(finishedKey);
+    }
+
+    bool await_ready() const { return process->isFinished(); }
+    void await_suspend(std::coroutine_handle<> h)
+    {
+        handle = h;
+        finishedKey = process->finished().connect([this](Process*) {
+                process->finished().disconnect(finishedKey);
+                finishedKey = 0;
+                handle.resume();
+            });
+    }
+    int await_resume() const { return process->returnCode(); }
+
+private:
+    Process* process;
+    std::coroutine_handle<> handle;
+    unsigned int finishedKey;
+};
+
+inline ProcessAwaiter finished(Process* process)
+{
+    return ProcessAwaiter(process);
+}
+
+}
+
+#endif
+
+#endif
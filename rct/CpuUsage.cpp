@@ -1,9 +1,15 @@
 #include "CpuUsage.h"
+#include "Hash.h"
 #include "Rct.h"
+#include "Thread.h"
+#include <atomic>
 #include <thread>
 #include <mutex>
 #include <unistd.h>
 #include <assert.h>
+#include <dirent.h>
+#include <stdlib.h>
+#include <time.h>
 #ifdef OS_Darwin
 #include <sys/sysctl.h>
 #include <sys/types.h>
@@ -28,9 +34,16 @@ struct CpuData
     float hz;
     uint32_t cores;
 #endif
+
+    // once threads() has been called. Ticks at the last sample and the
+    // share of a core since the one before, by tid
+    std::atomic<bool> trackThreads;
+    Hash<pid_t, uint64_t> threadTicks;
+    Hash<pid_t, float> threadUsage;
 };
 
-static CpuData sData;
+// never destroyed, the collector is still running at exit
+static CpuData &sData = *new CpuData;
 static std::once_flag sFlag;
 
 static int64_t currentUsage()
@@ -68,13 +81,79 @@ static int64_t currentUsage()
 #endif
 }
 
+struct ThreadSample
+{
+    pid_t tid;
+    String name;
+    uint64_t ticks;
+};
+
+// from /proc/self/task/<tid>/stat, "tid (name) state" and then utime and
+// stime in clock ticks as the 14th and 15th fields
+static List<ThreadSample> sampleThreads()
+{
+    List<ThreadSample> ret;
+#if defined(OS_Linux)
+    DIR* dir = opendir("/proc/self/task");
+    if (!dir)
+        return ret;
+    while (dirent* entry = readdir(dir)) {
+        const pid_t tid = atoi(entry->d_name);
+        if (tid <= 0)
+            continue;
+        char path[64];
+        snprintf(path, sizeof(path), "/proc/self/task/%d/stat", tid);
+        FILE* f = fopen(path, "r");
+        if (!f)
+            continue;
+        char buf[1024];
+        const size_t len = fread(buf, 1, sizeof(buf) - 1, f);
+        fclose(f);
+        buf[len] = '\0';
+        // the name may have spaces and parentheses of its own
+        char* open = strchr(buf, '(');
+        char* close = strrchr(buf, ')');
+        if (!open || !close || close < open)
+            continue;
+        unsigned long long utime, stime;
+        if (sscanf(close + 1, " %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu", &utime, &stime) != 2)
+            continue;
+        ThreadSample sample = { tid, String(open + 1, close - open - 1), utime + stime };
+        ret.append(sample);
+    }
+    closedir(dir);
+#endif
+    return ret;
+}
+
+static void collectThreads(const List<ThreadSample>& samples, uint64_t deltaTime)
+{
+    Hash<pid_t, uint64_t> ticks;
+    Hash<pid_t, float> usage;
+    for (const ThreadSample& sample : samples) {
+        ticks[sample.tid] = sample.ticks;
+        const auto last = sData.threadTicks.find(sample.tid);
+        if (deltaTime && last != sData.threadTicks.end() && sample.ticks >= last->second) {
+#if defined(OS_Linux) || defined(OS_Darwin)
+            usage[sample.tid] = (sample.ticks - last->second) / sData.hz / (deltaTime / 1000.);
+#endif
+        }
+    }
+    // threads that went away go with the old maps
+    sData.threadTicks = std::move(ticks);
+    sData.threadUsage = std::move(usage);
+}
+
 static void collectData()
 {
+    Thread::setCurrentName("CpuUsage");
     for (;;) {
         const int64_t usage = currentUsage();
         if (usage == -1)
             break;
         const uint64_t time = Rct::monoMs();
+        // read before locking, it's a file per thread
+        const List<ThreadSample> samples = sData.trackThreads ? sampleThreads() : List<ThreadSample>();
 
         {
             std::lock_guard<std::mutex> locker(sData.mutex);
@@ -92,6 +171,8 @@ static void collectData()
 #endif
                 }
             }
+            if (sData.trackThreads)
+                collectThreads(samples, sData.lastTime ? time - sData.lastTime : 0);
             sData.lastUsage = usage;
             sData.lastTime = time;
         }
@@ -100,20 +181,62 @@ static void collectData()
     }
 }
 
-float CpuUsage::usage()
+static void startCollecting()
 {
     std::call_once(sFlag, []() {
             std::lock_guard<std::mutex> locker(sData.mutex);
             sData.usage = 0;
             sData.lastUsage = 0;
             sData.lastTime = 0;
+            sData.trackThreads = false;
 #if defined(OS_Linux) || defined(OS_Darwin)
             sData.hz = sysconf(_SC_CLK_TCK);
             sData.cores = sysconf(_SC_NPROCESSORS_ONLN);
 #endif
+            // it runs for as long as the process does, a joinable thread
+            // would terminate() the process when it's destroyed on exit
             sData.thread = std::thread(collectData);
+            sData.thread.detach();
         });
+}
 
+float CpuUsage::usage()
+{
+    startCollecting();
     std::lock_guard<std::mutex> locker(sData.mutex);
     return 1. - sData.usage;
 }
+
+List<CpuUsage::ThreadUsage> CpuUsage::threads()
+{
+    startCollecting();
+    const List<ThreadSample> samples = sampleThreads();
+    List<ThreadUsage> ret;
+    ret.reserve(samples.size());
+    std::lock_guard<std::mutex> locker(sData.mutex);
+    sData.trackThreads = true;
+    for (const ThreadSample& sample : samples) {
+        ThreadUsage thread;
+        thread.tid = sample.tid;
+        thread.name = sample.name;
+#if defined(OS_Linux) || defined(OS_Darwin)
+        thread.cpuTimeNs = static_cast<uint64_t>(sample.ticks * (1000000000. / sData.hz));
+#else
+        thread.cpuTimeNs = 0;
+#endif
+        const auto usage = sData.threadUsage.find(sample.tid);
+        thread.usage = usage == sData.threadUsage.end() ? 0 : usage->second;
+        ret.append(thread);
+    }
+    return ret;
+}
+
+uint64_t CpuUsage::threadCpuTimeNs()
+{
+#ifdef CLOCK_THREAD_CPUTIME_ID
+    timespec ts;
+    if (!clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts))
+        return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+#endif
+    return 0;
+}
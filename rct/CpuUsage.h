@@ -1,7 +1,10 @@
 #ifndef CPUUSAGE_H
 #define CPUUSAGE_H
 
+#include <rct/List.h>
+#include <rct/String.h>
 #include <cstdint>
+#include <sys/types.h>
 
 // CPU usage over the last couple of seconds, range from 0 (idle) to 1 (100%)
 
@@ -10,6 +13,21 @@ class CpuUsage
 public:
     static float usage();
 
+    // The threads of this process, what they're called (see
+    // Thread::setName()), the CPU time each has used in all and the share
+    // of one core it used over the last second or so, sampled along with
+    // usage() from the first call on. Linux only, empty elsewhere
+    struct ThreadUsage
+    {
+        pid_t tid;
+        String name;
+        uint64_t cpuTimeNs;
+        float usage;
+    };
+    static List<ThreadUsage> threads();
+    // the CPU time the calling thread has used
+    static uint64_t threadCpuTimeNs();
+
 private:
     CpuUsage() = delete;
     CpuUsage(const CpuUsage&) = delete;
@@ -0,0 +1,421 @@
+#include "DataFile.h"
+#include "Future.h"
+#include "MappedFile.h"
+#include "Rct.h"
+#include "ThreadPool.h"
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+enum { HeaderSize = sizeof(uint32_t) + sizeof(int32_t) + sizeof(uint64_t) + sizeof(uint64_t) };
+
+// collects what's serialized into DataFile::mBlock
+class DataFile::SectionBuffer : public Serializer::Buffer
+{
+public:
+    SectionBuffer(DataFile *file)
+        : mDataFile(file), mSize(0)
+    {}
+
+    virtual bool write(const void *data, int len) override
+    {
+        mSize += len;
+        mDataFile->mBlock.append(static_cast<const char *>(data), len);
+        return mDataFile->mBlock.size() < BlockSize || mDataFile->writeBlock();
+    }
+
+    virtual int pos() const override
+    {
+        return static_cast<int>(mSize);
+    }
+private:
+    DataFile *mDataFile;
+    uint64_t mSize;
+};
+
+// a block on its way to being compressed
+struct DataFile::Block
+{
+    String raw, compressed;
+    Future<void> future;
+};
+
+static bool readAt(int fd, void *data, size_t size, off_t offset)
+{
+    char *out = static_cast<char *>(data);
+    while (size) {
+        const ssize_t r = pread(fd, out, size, offset);
+        if (r == -1 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            return false;
+        out += r;
+        offset += r;
+        size -= r;
+    }
+    return true;
+}
+
+DataFile::DataFile(const Path &path, int version)
+    : mFile(0), mSerializer(0), mCodec(Compression::None), mLevel(0), mSyncMode(AtomicFile::SyncData),
+      mVerifyOnOpen(false), mLegacy(false), mDeserializer(0), mPath(path), mVersion(version)
+{
+}
+
+DataFile::~DataFile()
+{
+    delete mDeserializer;
+    if (mFile)
+        flush();
+}
+
+bool DataFile::open(Mode mode)
+{
+    assert(!mFile);
+    if (mode == Read)
+        return openRead();
+
+    if (!Path::mkdir(mPath.parentDir()))
+        return false;
+    mAtomicFile.reset(new AtomicFile(mPath));
+    if (!mAtomicFile->open()) {
+        mError = mAtomicFile->error();
+        mAtomicFile.reset();
+        return false;
+    }
+    // the AtomicFile keeps its own
+    const int fd = dup(mAtomicFile->fd());
+    mFile = fd == -1 ? 0 : fdopen(fd, "w");
+    if (!mFile) {
+        mError = String::format<128>("fdopen failure %d (%s)", errno, Rct::strerror().constData());
+        if (fd != -1)
+            close(fd);
+        mAtomicFile.reset();
+        return false;
+    }
+    // filled in by flush()
+    const char header[HeaderSize] = { 0 };
+    if (!write(header, sizeof(header))) {
+        fclose(mFile);
+        mFile = 0;
+        mAtomicFile.reset();
+        return false;
+    }
+    return true;
+}
+
+bool DataFile::write(const void *data, size_t size)
+{
+    if (fwrite(data, sizeof(char), size, mFile) == size)
+        return true;
+    if (mError.isEmpty())
+        mError = String::format<128>("write failure %d (%s)", errno, Rct::strerror().constData());
+    return false;
+}
+
+bool DataFile::beginSection(const String &name)
+{
+    assert(mFile);
+    endSection();
+    if (mSections.contains(name)) {
+        if (mError.isEmpty())
+            mError = name.isEmpty() ? String("The unnamed section has ended already") : "Duplicate section " + name;
+        return false;
+    }
+    mSectionName = name;
+    mSection.offset = ftell(mFile);
+    mSection.size = mSection.rawSize = 0;
+    mSection.crc = 0;
+    mSection.codec = mCodec;
+    mBlock.reserve(BlockSize + 64);
+    mSerializer = new Serializer(std::unique_ptr<Serializer::Buffer>(new SectionBuffer(this)));
+    return true;
+}
+
+void DataFile::endSection()
+{
+    if (!mSerializer)
+        return;
+    if (!mBlock.isEmpty())
+        writeBlock();
+    writePending(0);
+    if (mSerializer->hasError() && mError.isEmpty())
+        mError = "write failure";
+    delete mSerializer;
+    mSerializer = 0;
+    mBlock.clear();
+    mSections[mSectionName] = mSection;
+}
+
+bool DataFile::writeBlock()
+{
+    mSection.rawSize += mBlock.size();
+    if (mSection.codec == Compression::None) {
+        mSection.crc = Rct::crc32c(mBlock.constData(), mBlock.size(), mSection.crc);
+        mSection.size += mBlock.size();
+        const bool ok = write(mBlock.constData(), mBlock.size());
+        mBlock.clear();
+        return ok;
+    }
+
+    std::shared_ptr<Block> block = std::make_shared<Block>();
+    std::swap(block->raw, mBlock);
+    mBlock.reserve(BlockSize + 64);
+    const Compression::Codec codec = static_cast<Compression::Codec>(mSection.codec);
+    const int level = mLevel;
+    Block *b = block.get();
+    if (ThreadPool::instance()->isWorkerThread()) {
+        // waiting on the pool from one of its jobs deadlocks once every
+        // worker does it, compress here instead
+        if (!Compression::compress(codec, b->raw.constData(), b->raw.size(), b->compressed, level))
+            b->compressed.clear();
+        mPending.append(block);
+        return writePending(0);
+    }
+    block->future = ThreadPool::instance()->submit([b, codec, level]() {
+            if (!Compression::compress(codec, b->raw.constData(), b->raw.size(), b->compressed, level))
+                b->compressed.clear();
+        });
+    mPending.append(block);
+    // a couple each for the workers, the rest waits here
+    return writePending(ThreadPool::instance()->concurrentJobs() * 2);
+}
+
+bool DataFile::writePending(int max)
+{
+    bool ok = mError.isEmpty();
+    while (mPending.size() > max) {
+        const std::shared_ptr<Block> block = mPending.takeFirst();
+        // without a future it was compressed in writeBlock()
+        if (block->future.isValid()) {
+            block->future.wait();
+            if (block->future.isBroken()) {
+                // dropped by the pool, do it here
+                const Compression::Codec codec = static_cast<Compression::Codec>(mSection.codec);
+                if (!Compression::compress(codec, block->raw.constData(), block->raw.size(), block->compressed, mLevel))
+                    block->compressed.clear();
+            }
+        }
+        // stored as is if it didn't get any smaller
+        const String &data = (block->compressed.isEmpty() || block->compressed.size() >= block->raw.size()
+                              ? block->raw : block->compressed);
+        const uint32_t sizes[] = { static_cast<uint32_t>(data.size()), static_cast<uint32_t>(block->raw.size()) };
+        mSection.crc = Rct::crc32c(sizes, sizeof(sizes), mSection.crc);
+        mSection.crc = Rct::crc32c(data.constData(), data.size(), mSection.crc);
+        mSection.size += sizeof(sizes) + data.size();
+        if (ok)
+            ok = write(sizes, sizeof(sizes)) && write(data.constData(), data.size());
+    }
+    return ok;
+}
+
+bool DataFile::writeIndex()
+{
+    const uint64_t indexOffset = ftell(mFile);
+    Serializer serializer(mFile);
+    serializer << static_cast<uint32_t>(mSections.size());
+    for (const auto &section : mSections) {
+        serializer << section.first << section.second.offset << section.second.size << section.second.rawSize
+                   << section.second.crc << section.second.codec;
+    }
+    const uint64_t size = ftell(mFile);
+    if (serializer.hasError() || fseek(mFile, 0, SEEK_SET))
+        return false;
+    serializer << static_cast<uint32_t>(Magic) << static_cast<int32_t>(mVersion) << indexOffset << size;
+    return !serializer.hasError() && !fflush(mFile);
+}
+
+bool DataFile::flush()
+{
+    assert(mFile);
+    endSection();
+    bool ok = mError.isEmpty() && writeIndex();
+    if (!ok && mError.isEmpty())
+        mError = String::format<128>("write failure %d (%s)", errno, Rct::strerror().constData());
+    fclose(mFile);
+    mFile = 0;
+    if (ok && !mAtomicFile->commit(mSyncMode)) {
+        mError = mAtomicFile->error();
+        ok = false;
+    }
+    // discards it if it wasn't committed
+    mAtomicFile.reset();
+    return ok;
+}
+
+bool DataFile::openRead()
+{
+    int fd;
+    eintrwrap(fd, ::open(mPath.constData(), O_RDONLY | O_CLOEXEC));
+    struct stat st;
+    char header[HeaderSize];
+    if (fd == -1 || fstat(fd, &st) || st.st_size < static_cast<off_t>(sizeof(int32_t) * 2)
+        || !readAt(fd, header, std::min<off_t>(st.st_size, HeaderSize), 0)) {
+        if (fd != -1)
+            ::close(fd);
+        if (mPath.exists())
+            mError = "Read error " + mPath;
+        return false;
+    }
+
+    uint32_t magic;
+    memcpy(&magic, header, sizeof(magic));
+    if (magic != Magic || st.st_size < HeaderSize) {
+        ::close(fd);
+        // version and size, then the data
+        int32_t version, size;
+        memcpy(&version, header, sizeof(version));
+        memcpy(&size, header + sizeof(version), sizeof(size));
+        if (version != mVersion) {
+            mError = String::format<128>("Wrong database version. Expected %d, got %d for %s.",
+                                         mVersion, version, mPath.constData());
+            return false;
+        }
+        if (size != st.st_size) {
+            mError = String::format<128>("%s seems to be corrupted. Size should have been %d but was %d",
+                                         mPath.constData(), static_cast<int>(st.st_size), size);
+            return false;
+        }
+        Section &section = mSections[String()];
+        section.offset = sizeof(version) + sizeof(size);
+        section.size = section.rawSize = size - section.offset;
+        section.crc = 0;
+        section.codec = Compression::None;
+        mLegacy = true;
+    } else {
+        int32_t version;
+        uint64_t indexOffset, size;
+        Deserializer deserializer(header, sizeof(header));
+        deserializer >> magic >> version >> indexOffset >> size;
+        if (version != mVersion) {
+            ::close(fd);
+            mError = String::format<128>("Wrong database version. Expected %d, got %d for %s.",
+                                         mVersion, version, mPath.constData());
+            return false;
+        }
+        String index;
+        if (size != static_cast<uint64_t>(st.st_size) || indexOffset < HeaderSize || indexOffset > size
+            || size - indexOffset < sizeof(uint32_t) || size - indexOffset > INT_MAX) {
+            ::close(fd);
+            mError = String::format<256>("%s seems to be corrupted. Size should have been %llu but was %llu",
+                                         mPath.constData(), static_cast<unsigned long long>(st.st_size),
+                                         static_cast<unsigned long long>(size));
+            return false;
+        }
+        index.resize(size - indexOffset);
+        const bool read = readAt(fd, index.data(), index.size(), indexOffset);
+        ::close(fd);
+        if (!read) {
+            mError = "Read error " + mPath;
+            return false;
+        }
+
+        // strings in the index are length prefixed, check before reading
+        Deserializer reader(index);
+        uint32_t count;
+        reader >> count;
+        for (uint32_t i=0; i<count; ++i) {
+            uint32_t length;
+            if (index.size() - reader.pos() < static_cast<int>(sizeof(length)))
+                break;
+            memcpy(&length, index.constData() + reader.pos(), sizeof(length));
+            const uint32_t fixed = sizeof(length) + sizeof(Section::offset) * 3 + sizeof(Section::crc) + sizeof(Section::codec);
+            if (static_cast<uint32_t>(index.size() - reader.pos()) < fixed || length > index.size() - reader.pos() - fixed)
+                break;
+            String name;
+            Section section;
+            reader >> name >> section.offset >> section.size >> section.rawSize >> section.crc >> section.codec;
+            if (section.offset < HeaderSize || section.offset > indexOffset || section.size > indexOffset - section.offset)
+                break;
+            mSections[name] = section;
+        }
+        if (static_cast<uint32_t>(mSections.size()) != count) {
+            mError = mPath + " has a corrupted index";
+            mSections.clear();
+            return false;
+        }
+    }
+
+    if (mVerifyOnOpen) {
+        for (const auto &section : mSections) {
+            if (!mapSection(section.first, section.second))
+                return false;
+        }
+    }
+
+    if (mSections.contains(String())) {
+        mDeserializer = section(String()).release();
+        if (!mDeserializer)
+            return false;
+        mContents = mDeserializer->storage();
+    }
+    return true;
+}
+
+std::shared_ptr<MappedFile> DataFile::mapSection(const String &name, const Section &section)
+{
+    if (section.size > INT_MAX) {
+        mError = String::format<128>("Section %s is too big", name.constData());
+        return std::shared_ptr<MappedFile>();
+    }
+    const std::shared_ptr<MappedFile> file = std::make_shared<MappedFile>();
+    if (!file->open(mPath, MappedFile::ReadFallback, section.offset, section.size)) {
+        mError = file->error();
+        return std::shared_ptr<MappedFile>();
+    }
+    // files from before sections don't have checksums
+    if (!mLegacy && Rct::crc32c(file->data(), file->size()) != section.crc) {
+        mError = String::format<128>("%s seems to be corrupted. Bad checksum for section %s",
+                                     mPath.constData(), name.constData());
+        return std::shared_ptr<MappedFile>();
+    }
+    return file;
+}
+
+std::unique_ptr<Deserializer> DataFile::section(const String &name)
+{
+    const auto it = mSections.find(name);
+    if (it == mSections.end())
+        return std::unique_ptr<Deserializer>();
+    const Section &section = it->second;
+    const std::shared_ptr<MappedFile> file = mapSection(name, section);
+    if (!file)
+        return std::unique_ptr<Deserializer>();
+    const Compression::Codec codec = static_cast<Compression::Codec>(section.codec);
+    if (codec == Compression::None)
+        return std::unique_ptr<Deserializer>(new Deserializer(file->data(), file->size(), file));
+
+    if (!Compression::isSupported(codec) || section.rawSize > INT_MAX) {
+        mError = String::format<128>("Can't read section %s, it's compressed with %s",
+                                     name.constData(), Compression::codecName(codec));
+        return std::unique_ptr<Deserializer>();
+    }
+    std::shared_ptr<String> contents = std::make_shared<String>();
+    contents->reserve(section.rawSize);
+    String block;
+    const char *data = file->data();
+    const char *end = data + file->size();
+    while (data < end) {
+        uint32_t sizes[2];
+        if (end - data < static_cast<int>(sizeof(sizes)))
+            break;
+        memcpy(sizes, data, sizeof(sizes));
+        data += sizeof(sizes);
+        if (sizes[0] > static_cast<uint32_t>(end - data))
+            break;
+        if (sizes[0] == sizes[1]) {
+            contents->append(data, sizes[0]);
+        } else if (Compression::uncompress(codec, data, sizes[0], block) && static_cast<uint32_t>(block.size()) == sizes[1]) {
+            contents->append(block);
+        } else {
+            break;
+        }
+        data += sizes[0];
+    }
+    if (data != end || static_cast<uint64_t>(contents->size()) != section.rawSize) {
+        mError = String::format<128>("%s seems to be corrupted. Can't uncompress section %s",
+                                     mPath.constData(), name.constData());
+        return std::unique_ptr<Deserializer>();
+    }
+    return std::unique_ptr<Deserializer>(new Deserializer(std::shared_ptr<const String>(contents)));
+}
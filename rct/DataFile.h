@@ -1,115 +1,150 @@
 #ifndef DataFile_h
 #define DataFile_h
 
+#include <rct/AtomicFile.h>
+#include <rct/Compression.h>
+#include <rct/List.h>
+#include <rct/Map.h>
 #include <rct/Serializer.h>
 #include <rct/Path.h>
+#include <memory>
+#include <stdint.h>
 #include <stdio.h>
 
+class MappedFile;
+
+// Data written in named sections, each of them read on its own.
+//
+//   uint32_t    Magic
+//   int32_t     version
+//   uint64_t    offset of the index
+//   uint64_t    size of the file
+//   sections
+//   index       uint32_t count, then for each section its name as a
+//               String, uint64_t offset, uint64_t size, uint64_t size
+//               uncompressed, uint32_t crc32c of what's stored and
+//               uint8_t Compression::Codec
+//
+// A compressed section is a run of blocks, each uint32_t stored size,
+// uint32_t size and the data. Blocks that don't get any smaller are stored
+// as they are, with both sizes the same. Writes collect into blocks of
+// BlockSize and compression happens on ThreadPool workers while the next
+// blocks are filled.
+//
+// Nothing is read when the file is opened except the header and the index.
+// A section is mapped when it's asked for and decoded as the Deserializer
+// goes, a compressed one is uncompressed up front. What's written with
+// operator<<() outside of beginSection() and endSection() goes in the
+// unnamed section, which is what operator>>() reads, so code that treats
+// the file as one stream doesn't change. Sections are stored whole, once
+// the unnamed section has ended it can't be written to again. Doing so, or
+// reading a file without one, sets error() and flush() fails.
+//
+// Files from before sections (the version, the size as an int and the
+// data) are read as if all of it was the unnamed section.
 class DataFile
 {
 public:
-    DataFile(const Path &path, int version)
-        : mFile(0), mSizeOffset(-1), mSerializer(0), mDeserializer(0), mPath(path), mVersion(version)
-    {}
-
-    ~DataFile()
-    {
-        delete mDeserializer;
-        if (mFile)
-            flush();
-    }
+    enum {
+        Magic = 0x32445452, // "RTD2"
+        BlockSize = 1024 * 1024
+    };
 
-    bool flush()
-    {
-        const int size = ftell(mFile);
-        fseek(mFile, mSizeOffset, SEEK_SET);
-        operator<<(size);
+    DataFile(const Path &path, int version);
+    ~DataFile();
 
-        fclose(mFile);
-        mFile = 0;
-        delete mSerializer;
-        mSerializer = 0;
-        if (rename(mTempFilePath.constData(), mPath.constData())) {
-            Path::rm(mTempFilePath);
-            mError = String::format<128>("rename error: %d %s", errno, Rct::strerror().constData());
-            return false;
-        }
-        return true;
-    }
+    DataFile(const DataFile &) = delete;
+    DataFile &operator=(const DataFile &) = delete;
 
     enum Mode {
         Read,
         Write
     };
-    String error() const { return mError; }
-    bool open(Mode mode)
+    bool open(Mode mode);
+
+    // AtomicFile::SyncData by default
+    void setSyncMode(AtomicFile::SyncMode mode) { mSyncMode = mode; }
+    // for the sections begun after this
+    void setCompression(Compression::Codec codec, int level = 0)
     {
-        assert(!mFile);
-        if (mode == Write) {
-            if (!Path::mkdir(mPath.parentDir()))
-                return false;
-            mTempFilePath = mPath + "XXXXXX";
-            const int ret = mkstemp(&mTempFilePath[0]);
-            if (ret == -1) {
-                mError = String::format<128>("mkstemp failure %d (%s)", errno, Rct::strerror().constData());
-                return false;
-            }
-            mFile = fdopen(ret, "w");
-            if (!mFile) {
-                mError = String::format<128>("fdopen failure %d (%s)", errno, Rct::strerror().constData());
-                close(ret);
-                return false;
-            }
-            mSerializer = new Serializer(mFile);
-            operator<<(mVersion);
-            mSizeOffset = ftell(mFile);
-            operator<<(static_cast<int>(0));
-            return true;
-        } else {
-            mContents = mPath.readAll();
-            if (mContents.isEmpty()) {
-                if (mPath.exists())
-                    mError = "Read error " + mPath;
-                return false;
-            }
-            mDeserializer = new Deserializer(mContents);
-            int version;
-            (*mDeserializer) >> version;
-            if (version != mVersion) {
-                mError = String::format<128>("Wrong database version. Expected %d, got %d for %s.",
-                                             mVersion, version, mPath.constData());
-                return false;
-            }
-            int fs;
-            (*mDeserializer) >> fs;
-            if (fs != mContents.size()) {
-                mError = String::format<128>("%s seems to be corrupted. Size should have been %d but was %d",
-                                             mPath.constData(), mContents.size(), fs);
-                return false;
-            }
-            return true;
-        }
+        assert(Compression::isSupported(codec));
+        mCodec = codec;
+        mLevel = level;
     }
+    // check every section's checksum in open(), otherwise a section is
+    // checked when it's read
+    void setVerifyOnOpen(bool verify) { mVerifyOnOpen = verify; }
+    // writes the index and puts the file in place, see AtomicFile
+    bool flush();
+    String error() const { return mError; }
+
+    // everything written until endSection() goes in name. Names are unique
+    bool beginSection(const String &name);
+    void endSection();
+
+    List<String> sections() const { return mSections.keys(); }
+    bool hasSection(const String &name) const { return mSections.contains(name); }
+    // reads just that section, null if there's no such section or it
+    // doesn't match its checksum. The mapping stays around for as long as
+    // the Deserializer or its storage()
+    std::unique_ptr<Deserializer> section(const String &name);
 
     template <typename T> DataFile &operator<<(const T &t)
     {
-        assert(mSerializer);
-        (*mSerializer) << t;
+        if (mSerializer || beginSection(String()))
+            (*mSerializer) << t;
         return *this;
     }
+    // t is left as it is if there's no unnamed section
     template <typename T> DataFile &operator>>(T &t)
     {
-        assert(mDeserializer);
-        (*mDeserializer) >> t;
+        if (mDeserializer) {
+            (*mDeserializer) >> t;
+        } else if (mError.isEmpty()) {
+            mError = "No unnamed section in " + mPath;
+        }
         return *this;
     }
+
+    // what StringViews read from the unnamed section point into, hold on to
+    // it to use them after the DataFile is gone. A MappedFile, or a String
+    // if it was compressed
+    std::shared_ptr<const void> contents() const { return mContents; }
 private:
+    struct Section
+    {
+        uint64_t offset, size, rawSize;
+        uint32_t crc;
+        uint8_t codec;
+    };
+    class SectionBuffer;
+    struct Block;
+
+    bool openRead();
+    // checked against its checksum
+    std::shared_ptr<MappedFile> mapSection(const String &name, const Section &section);
+    // hands off what's in mBlock
+    bool writeBlock();
+    // writes out compressed blocks until there are at most max in flight
+    bool writePending(int max);
+    bool write(const void *data, size_t size);
+    bool writeIndex();
+
     FILE *mFile;
-    int mSizeOffset;
     Serializer *mSerializer;
+    String mSectionName;
+    Section mSection;
+    String mBlock;
+    List<std::shared_ptr<Block> > mPending;
+    Compression::Codec mCodec;
+    int mLevel;
+    AtomicFile::SyncMode mSyncMode;
+    bool mVerifyOnOpen, mLegacy;
     Deserializer *mDeserializer;
-    Path mPath, mTempFilePath;
-    String mContents;
+    Path mPath;
+    std::unique_ptr<AtomicFile> mAtomicFile;
+    std::shared_ptr<const void> mContents;
+    Map<String, Section> mSections;
     String mError;
     const int mVersion;
 };
@@ -1,13 +1,18 @@
 #include "EventLoop.h"
+#include "MemoryMonitor.h"
 #include "SocketClient.h"
 #include "Timer.h"
+#include "Trace.h"
 #include "Rct.h"
 #include <algorithm>
 #include <atomic>
 #include <set>
+#include <unordered_map>
 #include <unistd.h>
 #include <fcntl.h>
 #include <assert.h>
+#include <limits.h>
+#include <new>
 #include <stdio.h>
 #include <string.h>
 #include <time.h>
@@ -17,6 +22,16 @@
 #include <sys/stat.h>
 #include <pthread.h>
 #include <stdlib.h>
+#ifdef HAVE_EVENTFD
+#  include <sys/eventfd.h>
+#endif
+#if defined(HAVE_IO_URING)
+#  include <linux/io_uring.h>
+#  include <poll.h>
+#  include <sys/epoll.h>
+#  include <sys/mman.h>
+#  include <sys/syscall.h>
+#endif
 #ifdef HAVE_MACH_ABSOLUTE_TIME
 #  include <mach/mach.h>
 #  include <mach/mach_time.h>
@@ -52,6 +67,144 @@
 #  endif
 #endif
 
+#if defined(HAVE_IO_URING)
+// We talk to the kernel directly rather than pulling in liburing, all we
+// need is the two rings and a handful of opcodes.
+struct EventLoop::Uring
+{
+    enum { Entries = 256 };
+
+    Uring(int f)
+        : fd(f), sqRing(MAP_FAILED), cqRing(MAP_FAILED), sqes(0),
+          sqRingSize(0), cqRingSize(0), sqesSize(0), nextTag(0)
+    {
+    }
+    ~Uring()
+    {
+        if (sqes)
+            munmap(sqes, sqesSize);
+        if (cqRing != MAP_FAILED && cqRing != sqRing)
+            munmap(cqRing, cqRingSize);
+        if (sqRing != MAP_FAILED)
+            munmap(sqRing, sqRingSize);
+    }
+
+    bool map(const io_uring_params& params)
+    {
+        sqRingSize = params.sq_off.array + (params.sq_entries * sizeof(unsigned));
+        cqRingSize = params.cq_off.cqes + (params.cq_entries * sizeof(io_uring_cqe));
+        const bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+        if (single)
+            sqRingSize = cqRingSize = std::max(sqRingSize, cqRingSize);
+        sqRing = mmap(0, sqRingSize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+        if (sqRing == MAP_FAILED)
+            return false;
+        if (single) {
+            cqRing = sqRing;
+        } else {
+            cqRing = mmap(0, cqRingSize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+            if (cqRing == MAP_FAILED)
+                return false;
+        }
+        sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+        void* entries = mmap(0, sqesSize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQES);
+        if (entries == MAP_FAILED)
+            return false;
+        sqes = static_cast<io_uring_sqe*>(entries);
+
+        char* sq = static_cast<char*>(sqRing);
+        sqHead = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+        sqTail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+        sqArray = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+        sqMask = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+        sqEntries = params.sq_entries;
+
+        char* cq = static_cast<char*>(cqRing);
+        cqHead = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+        cqTail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+        cqMask = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+        cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+        return true;
+    }
+
+    // submits whatever is queued and optionally waits for completions
+    int enter(unsigned int minComplete, unsigned int flags, const void* arg, size_t argSize)
+    {
+        // this has to be exact, the kernel doesn't wait after a short submit
+        const unsigned queued = __atomic_load_n(sqTail, __ATOMIC_ACQUIRE) - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+        int e;
+        eintrwrap(e, static_cast<int>(syscall(__NR_io_uring_enter, fd, queued, minComplete, flags, arg, argSize)));
+        return e;
+    }
+
+    // the next free submission entry, cleared. Needs the EventLoop mutex
+    // and a push() once it's filled in
+    io_uring_sqe* get()
+    {
+        const unsigned tail = *sqTail;
+        if (tail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) == sqEntries) {
+            // full, hand what we have to the kernel right away
+            enter(0, 0, 0, 0);
+            if (tail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) == sqEntries)
+                return 0;
+        }
+        const unsigned idx = tail & sqMask;
+        sqArray[idx] = idx;
+        memset(&sqes[idx], 0, sizeof(io_uring_sqe));
+        return &sqes[idx];
+    }
+    void push()
+    {
+        __atomic_store_n(sqTail, *sqTail + 1, __ATOMIC_RELEASE);
+    }
+
+    int reap(NativeEvent* events, int maxEvents)
+    {
+        unsigned head = *cqHead;
+        const unsigned tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+        int count = 0;
+        while (head != tail && count < maxEvents) {
+            const io_uring_cqe& cqe = cqes[head & cqMask];
+            events[count].userData = cqe.user_data;
+            events[count].res = cqe.res;
+            events[count].flags = cqe.flags;
+            ++count;
+            ++head;
+        }
+        __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+        return count;
+    }
+
+    // user_data for a new poll on fd. The fd is in the low bits, the high
+    // bits tell completions for polls we have since replaced apart
+    uint64_t tag(int pollFd)
+    {
+        if (!++nextTag)
+            ++nextTag;
+        const uint64_t ret = (static_cast<uint64_t>(nextTag) << 32) | static_cast<uint32_t>(pollFd);
+        polls[pollFd] = ret;
+        return ret;
+    }
+
+    const int fd;
+    void* sqRing;
+    void* cqRing;
+    io_uring_sqe* sqes;
+    size_t sqRingSize, cqRingSize, sqesSize;
+    unsigned* sqHead;
+    unsigned* sqTail;
+    unsigned* sqArray;
+    unsigned sqMask, sqEntries;
+    unsigned* cqHead;
+    unsigned* cqTail;
+    unsigned cqMask;
+    io_uring_cqe* cqes;
+    uint32_t nextTag;
+    // fd -> user_data of the poll that is currently armed for it
+    std::unordered_map<int, uint64_t> polls;
+};
+#endif
+
 EventLoop::WeakPtr EventLoop::mainLoop;
 std::mutex EventLoop::mainMutex;
 static std::atomic<int> mainEventPipe;
@@ -82,13 +235,366 @@ static void signalHandler(int /*sig*/)
         eintrwrap(w, ::write(pipe, &b, 1));
 }
 
+// Posted events are usually allocated on one thread and deleted on the
+// loop's thread. Each thread gets a pool with a free list per size class,
+// blocks deleted on some other thread go back to the pool they came from
+// through a lock-free list that the owner reclaims once it runs dry. The
+// pool of a thread that exits is handed to the next new thread.
+struct EventPool
+{
+    enum {
+        Classes = 4, // 64, 128, 256 and 512 byte blocks
+        MinBlockShift = 6,
+        MaxCached = 1024 // per class, the rest goes back to malloc
+    };
+
+    struct Header
+    {
+        EventPool* pool; // 0 for blocks that are too big for us
+        size_t sizeClass; // or the size of those
+    };
+    static inline size_t blockSize(size_t sizeClass) { return 1 << (sizeClass + MinBlockShift); }
+    // lives in the payload of a free block
+    struct FreeBlock
+    {
+        FreeBlock* next;
+    };
+
+    EventPool()
+        : nextOrphan(0)
+    {
+        for (int i = 0; i < Classes; ++i) {
+            local[i] = 0;
+            cached[i] = 0;
+            remote[i] = 0;
+        }
+    }
+
+    static inline FreeBlock* freeBlock(Header* header) { return reinterpret_cast<FreeBlock*>(header + 1); }
+
+    void* allocate(size_t sizeClass)
+    {
+        if (!local[sizeClass])
+            reclaim(sizeClass);
+        Header* header;
+        if (FreeBlock* block = local[sizeClass]) {
+            local[sizeClass] = block->next;
+            --cached[sizeClass];
+            header = reinterpret_cast<Header*>(block) - 1;
+        } else {
+            header = static_cast<Header*>(malloc(blockSize(sizeClass)));
+            if (!header)
+                return 0;
+            header->pool = this;
+            header->sizeClass = sizeClass;
+        }
+        return header + 1;
+    }
+
+    // only called by the thread that owns the pool
+    void release(Header* header)
+    {
+        const size_t sizeClass = header->sizeClass;
+        if (cached[sizeClass] >= MaxCached) {
+            free(header);
+            return;
+        }
+        FreeBlock* block = freeBlock(header);
+        block->next = local[sizeClass];
+        local[sizeClass] = block;
+        ++cached[sizeClass];
+    }
+
+    // called from any other thread
+    void releaseRemote(Header* header)
+    {
+        std::atomic<FreeBlock*>& list = remote[header->sizeClass];
+        FreeBlock* block = freeBlock(header);
+        block->next = list.load(std::memory_order_relaxed);
+        while (!list.compare_exchange_weak(block->next, block, std::memory_order_release, std::memory_order_relaxed)) {
+        }
+    }
+
+    void reclaim(size_t sizeClass)
+    {
+        FreeBlock* block = remote[sizeClass].exchange(0, std::memory_order_acquire);
+        while (block) {
+            FreeBlock* next = block->next;
+            release(reinterpret_cast<Header*>(block) - 1);
+            block = next;
+        }
+    }
+
+    FreeBlock* local[Classes];
+    size_t cached[Classes];
+    EventPool* nextOrphan;
+    // keep the lists other threads hammer on off the owner's cache line
+    char padding[64];
+    std::atomic<FreeBlock*> remote[Classes];
+};
+
+static std::once_flag eventPoolOnce;
+static pthread_key_t eventPoolKey;
+static std::mutex orphanedEventPoolsMutex;
+static EventPool* orphanedEventPools = 0;
+
+// __thread rather than thread_local for the sake of GCC 4.7, the pthread
+// key is only there to get told when the thread exits
+static __thread EventPool* localEventPool = 0;
+// the pool has been handed on, events the exiting thread still allocates
+// come from malloc and the ones it deletes are remote frees
+static __thread bool eventPoolOrphaned = false;
+
+static void orphanEventPool(void* ptr)
+{
+    // this thread lets go of the pool before anyone else can pick it up
+    localEventPool = 0;
+    eventPoolOrphaned = true;
+    EventPool* pool = static_cast<EventPool*>(ptr);
+    std::lock_guard<std::mutex> locker(orphanedEventPoolsMutex);
+    pool->nextOrphan = orphanedEventPools;
+    orphanedEventPools = pool;
+}
+
+static EventPool* createEventPool()
+{
+    std::call_once(eventPoolOnce, []() { pthread_key_create(&eventPoolKey, orphanEventPool); });
+    EventPool* pool;
+    {
+        std::lock_guard<std::mutex> locker(orphanedEventPoolsMutex);
+        if ((pool = orphanedEventPools))
+            orphanedEventPools = pool->nextOrphan;
+    }
+    if (!pool)
+        pool = new EventPool;
+    pool->nextOrphan = 0;
+    pthread_setspecific(eventPoolKey, pool);
+    localEventPool = pool;
+    return pool;
+}
+
+// 0 once the thread's pool is orphaned
+static inline EventPool* currentEventPool()
+{
+    EventPool* pool = localEventPool;
+    if (pool || eventPoolOrphaned)
+        return pool;
+    return createEventPool();
+}
+
+void* Event::operator new(size_t size)
+{
+    size += sizeof(EventPool::Header);
+    size_t sizeClass = 0;
+    while (sizeClass < EventPool::Classes && size > (1u << (sizeClass + EventPool::MinBlockShift)))
+        ++sizeClass;
+    void* ret;
+    EventPool* pool = sizeClass < EventPool::Classes ? currentEventPool() : 0;
+    if (pool) {
+        ret = pool->allocate(sizeClass);
+        size = EventPool::blockSize(sizeClass);
+    } else {
+        EventPool::Header* header = static_cast<EventPool::Header*>(malloc(size));
+        if (header) {
+            header->pool = 0;
+            header->sizeClass = size;
+            ret = header + 1;
+        } else {
+            ret = 0;
+        }
+    }
+    if (!ret)
+        throw std::bad_alloc();
+    MemoryMonitor::add(MemoryMonitor::PostedEvents, size);
+    return ret;
+}
+
+void Event::operator delete(void* ptr)
+{
+    if (!ptr)
+        return;
+    EventPool::Header* header = static_cast<EventPool::Header*>(ptr) - 1;
+    EventPool* pool = header->pool;
+    MemoryMonitor::add(MemoryMonitor::PostedEvents,
+                       -static_cast<int64_t>(pool ? EventPool::blockSize(header->sizeClass) : header->sizeClass));
+    if (!pool) {
+        free(header);
+    } else if (pool == localEventPool) {
+        pool->release(header);
+    } else {
+        pool->releaseRemote(header);
+    }
+}
+
+// microseconds
+static inline uint64_t currentTimeUs()
+{
+#if defined(HAVE_CLOCK_MONOTONIC_RAW) || defined(HAVE_CLOCK_MONOTONIC)
+    timespec now;
+#if defined(HAVE_CLOCK_MONOTONIC_RAW)
+    if (clock_gettime(CLOCK_MONOTONIC_RAW, &now) == -1)
+        return 0;
+#elif defined(HAVE_CLOCK_MONOTONIC)
+    if (clock_gettime(CLOCK_MONOTONIC, &now) == -1)
+        return 0;
+#endif
+    const uint64_t t = (now.tv_sec * 1000000LLU) + (now.tv_nsec / 1000LLU);
+#elif defined(HAVE_MACH_ABSOLUTE_TIME)
+    static mach_timebase_info_data_t info;
+    static bool first = true;
+    uint64_t t = mach_absolute_time();
+    if (first) {
+        first = false;
+        mach_timebase_info(&info);
+    }
+    t = t * info.numer / (info.denom * 1000); // microseconds
+#else
+#error No time getting mechanism
+#endif
+    return t;
+}
+
+// what we hand to the kernel with each registration, see SocketData
+static inline uint64_t socketKey(int fd, uint32_t generation)
+{
+    return (static_cast<uint64_t>(generation) << 32) | static_cast<uint32_t>(fd);
+}
+
+#if defined(HAVE_EPOLL)
+static int epollControl(int pollFd, int op, int fd, unsigned int mode, uint64_t key)
+{
+    epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLRDHUP;
+    if (!(mode & EventLoop::SocketLevelTriggered))
+        ev.events |= EPOLLET;
+    if (mode & EventLoop::SocketRead)
+        ev.events |= EPOLLIN;
+    if (mode & EventLoop::SocketWrite)
+        ev.events |= EPOLLOUT;
+    if (mode & EventLoop::SocketOneShot)
+        ev.events |= EPOLLONESHOT;
+    ev.data.u64 = key;
+    return epoll_ctl(pollFd, op, fd, &ev);
+}
+#endif
+
+// milliseconds
+static inline uint64_t currentTime()
+{
+    return currentTimeUs() / 1000;
+}
+
+// Timer::Coalesce timers get their deadline rounded up to a multiple of a
+// power of two slack of about an eighth of the interval (at most 512ms), so
+// timers with nearby deadlines land in the same wheel slot and fire in one
+// wakeup.
+static inline uint64_t timerDeadline(uint64_t when, int interval, unsigned int flags)
+{
+    if (!(flags & Timer::Coalesce) || interval < 16)
+        return when;
+    uint64_t slack = 1;
+    while (slack < 512 && (slack << 1) <= static_cast<uint64_t>(interval / 8))
+        slack <<= 1;
+    return (when + slack - 1) & ~(slack - 1);
+}
+
+struct AtomicHistogram
+{
+    std::atomic<uint64_t> count, total, max;
+    std::atomic<uint64_t> buckets[EventLoop::Histogram::Buckets];
+
+    void record(uint64_t value)
+    {
+        int bucket = 0;
+        while (bucket < EventLoop::Histogram::Buckets - 1 && value >= (2llu << bucket))
+            ++bucket;
+        count.fetch_add(1, std::memory_order_relaxed);
+        total.fetch_add(value, std::memory_order_relaxed);
+        buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+        uint64_t old = max.load(std::memory_order_relaxed);
+        while (value > old && !max.compare_exchange_weak(old, value, std::memory_order_relaxed)) {
+        }
+    }
+
+    void reset()
+    {
+        count = total = max = 0;
+        for (auto& bucket : buckets)
+            bucket = 0;
+    }
+
+    EventLoop::Histogram load() const
+    {
+        EventLoop::Histogram ret;
+        ret.count = count.load(std::memory_order_relaxed);
+        ret.total = total.load(std::memory_order_relaxed);
+        ret.max = max.load(std::memory_order_relaxed);
+        for (int i = 0; i < EventLoop::Histogram::Buckets; ++i)
+            ret.buckets[i] = buckets[i].load(std::memory_order_relaxed);
+        return ret;
+    }
+};
+
+struct EventLoop::StatsData
+{
+    StatsData()
+        : enabled(false)
+    {
+        reset();
+    }
+
+    void reset()
+    {
+        postedEvents.reset();
+        timers.reset();
+        sockets.reset();
+        timerLateness.reset();
+        iterationLag.reset();
+        iterations = waitTime = postedHighWater = 0;
+    }
+
+    std::atomic<bool> enabled;
+    AtomicHistogram postedEvents, timers, sockets, timerLateness, iterationLag;
+    std::atomic<uint64_t> iterations, waitTime, postedHighWater;
+};
+
+// times the enclosing scope into histogram when stats are enabled, and
+// as a span named name when tracing is
+class CallbackTimer
+{
+public:
+    CallbackTimer(const std::atomic<bool>& enabled, AtomicHistogram& histogram, const char* name)
+        : mHistogram(enabled.load(std::memory_order_relaxed) ? &histogram : 0),
+          mStarted(mHistogram ? currentTimeUs() : 0), mTrace(name, "eventloop")
+    {
+    }
+    ~CallbackTimer()
+    {
+        if (mHistogram)
+            mHistogram->record(currentTimeUs() - mStarted);
+    }
+
+private:
+    AtomicHistogram* mHistogram;
+    const uint64_t mStarted;
+    TraceScope mTrace;
+};
+
 EventLoop::EventLoop()
-    :
-#if defined(HAVE_EPOLL) || defined(HAVE_KQUEUE)
-    pollFd(-1),
+    : postedEvents(0), pendingEvents(0),
+#if defined(HAVE_EVENTFD)
+      eventFd(-1),
+#endif
+#if defined(HAVE_EPOLL) || defined(HAVE_KQUEUE) || defined(HAVE_IO_URING)
+      pollFd(-1),
 #endif
-    nextTimerId(0), stop(false), timeout(false), flgs(0)
+      activeSockets(0), nextTimerId(0), dueTimers(0), wheelTime(0), stop(false), timeout(false),
+      flgs(0), maxPostedEvents(0), maxTimers(0), maxSocketEvents(64),
+      statsData(new StatsData)
 {
+    memset(timerWheel, 0, sizeof(timerWheel));
+    memset(timerWheelUsed, 0, sizeof(timerWheelUsed));
     std::call_once(mainOnce, [](){
             mainEventPipe = -1;
             pthread_key_create(&eventLoopKey, 0);
@@ -107,6 +613,7 @@ void EventLoop::init(unsigned int flags)
     flgs = flags;
 
     threadId = std::this_thread::get_id();
+    wheelTime = currentTime();
     int e = ::pipe(eventPipe);
     if (e == -1) {
         eventPipe[0] = -1;
@@ -118,8 +625,33 @@ void EventLoop::init(unsigned int flags)
         cleanup();
         return;
     }
+#if defined(HAVE_EVENTFD)
+    // posted events wake the loop through an eventfd, the pipe is only
+    // used by the SIGINT handler
+    eventFd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (eventFd == -1) {
+        cleanup();
+        return;
+    }
+#endif
 
-#if defined(HAVE_EPOLL)
+#if defined(HAVE_IO_URING)
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    pollFd = static_cast<int>(syscall(__NR_io_uring_setup, Uring::Entries, &params));
+    if (pollFd != -1) {
+        uring.reset(new Uring(pollFd));
+        // we need the timeout argument to io_uring_enter, 5.11 or later
+        if (!(params.features & IORING_FEAT_EXT_ARG) || !uring->map(params)) {
+            uring.reset();
+            ::close(pollFd);
+            pollFd = -1;
+        }
+    }
+    // too old a kernel, or io_uring is disabled or filtered by seccomp
+    if (!uring)
+        pollFd = epoll_create1(0);
+#elif defined(HAVE_EPOLL)
     pollFd = epoll_create1(0);
 #elif defined(HAVE_KQUEUE)
     pollFd = kqueue();
@@ -128,27 +660,43 @@ void EventLoop::init(unsigned int flags)
 #else
 #error No supported event polling mechanism
 #endif
-#if defined(HAVE_EPOLL) || defined(HAVE_KQUEUE)
+#if defined(HAVE_EPOLL) || defined(HAVE_KQUEUE) || defined(HAVE_IO_URING)
     if (pollFd == -1) {
         cleanup();
         return;
     }
 #endif
 
-#if !defined(HAVE_SELECT)
-    NativeEvent ev;
+#if defined(HAVE_IO_URING)
+    if (uring) {
+        e = armPoll(eventPipe[0], SocketRead) ? 0 : -1;
+#  if defined(HAVE_EVENTFD)
+        if (e != -1)
+            e = armPoll(eventFd, SocketRead) ? 0 : -1;
+#  endif
+    } else
 #endif
 #if defined(HAVE_EPOLL)
-    memset(&ev, 0, sizeof(ev));
-    ev.events = EPOLLIN | EPOLLET;
-    ev.data.fd = eventPipe[0];
-    e = epoll_ctl(pollFd, EPOLL_CTL_ADD, eventPipe[0], &ev);
+    {
+        e = epollControl(pollFd, EPOLL_CTL_ADD, eventPipe[0], SocketRead, socketKey(eventPipe[0], 0));
+#  if defined(HAVE_EVENTFD)
+        if (e != -1)
+            e = epollControl(pollFd, EPOLL_CTL_ADD, eventFd, SocketRead, socketKey(eventFd, 0));
+#  endif
+    }
 #elif defined(HAVE_KQUEUE)
+    struct kevent ev;
     memset(&ev, '\0', sizeof(struct kevent));
     ev.ident = eventPipe[0];
     ev.flags = EV_ADD|EV_ENABLE;
     ev.filter = EVFILT_READ;
     eintrwrap(e, kevent(pollFd, &ev, 1, 0, 0, 0));
+#  if defined(HAVE_EVENTFD)
+    if (e != -1) {
+        ev.ident = eventFd;
+        eintrwrap(e, kevent(pollFd, &ev, 1, 0, 0, 0));
+    }
+#  endif
 #endif
     if (e == -1) {
         cleanup();
@@ -178,25 +726,43 @@ void EventLoop::init(unsigned int flags)
 void EventLoop::cleanup()
 {
     std::lock_guard<std::mutex> locker(mutex);
-    localEventLoop().reset();
-
-    while (!events.empty()) {
-        delete events.front();
-        events.pop();
+    // we may be destroyed on a thread that isn't ours, e.g. by EventLoopGroup
+    if (std::this_thread::get_id() == threadId)
+        localEventLoop().reset();
+
+    Event* lists[] = { postedEvents.exchange(0, std::memory_order_acquire), pendingEvents };
+    pendingEvents = 0;
+    for (Event* event : lists) {
+        while (event) {
+            Event* next = event->next;
+            delete event;
+            event = next;
+        }
     }
 
     for (auto timer : timersById) {
         delete timer;
     }
     timersById.clear();
-    timersByTime.clear();
+    memset(timerWheel, 0, sizeof(timerWheel));
+    memset(timerWheelUsed, 0, sizeof(timerWheelUsed));
+    dueTimers = 0;
     nextTimerId = 0;
 
-#if defined(HAVE_EPOLL) || defined(HAVE_KQUEUE)
+#if defined(HAVE_EPOLL) || defined(HAVE_KQUEUE) || defined(HAVE_IO_URING)
     if (pollFd != -1)
         ::close(pollFd);
 #endif
+#if defined(HAVE_IO_URING)
+    uring.reset();
+#endif
 
+#if defined(HAVE_EVENTFD)
+    if (eventFd != -1) {
+        ::close(eventFd);
+        eventFd = -1;
+    }
+#endif
     if (eventPipe[0] != -1)
         ::close(eventPipe[0]);
     if (eventPipe[1] != -1)
@@ -228,9 +794,15 @@ void EventLoop::error(const char* err)
 
 void EventLoop::post(Event* event)
 {
-    std::lock_guard<std::mutex> locker(mutex);
-    events.push(event);
-    wakeup();
+    Event* head = postedEvents.load(std::memory_order_relaxed);
+    do {
+        event->next = head;
+    } while (!postedEvents.compare_exchange_weak(head, event, std::memory_order_release, std::memory_order_relaxed));
+
+    // only the empty to non-empty transition needs to wake the loop, it
+    // drains everything that was posted in one go
+    if (!head)
+        wakeup();
 }
 
 void EventLoop::wakeup()
@@ -238,9 +810,14 @@ void EventLoop::wakeup()
     if (std::this_thread::get_id() == threadId)
         return;
 
-    char b = 'w';
     int w;
+#if defined(HAVE_EVENTFD)
+    const uint64_t one = 1;
+    eintrwrap(w, ::write(eventFd, &one, sizeof(one)));
+#else
+    char b = 'w';
     eintrwrap(w, ::write(eventPipe[1], &b, 1));
+#endif
 }
 
 void EventLoop::quit()
@@ -250,49 +827,42 @@ void EventLoop::quit()
     wakeup();
 }
 
-inline bool EventLoop::sendPostedEvents()
+// runs up to budget events and takes what it ran off budget
+inline bool EventLoop::sendPostedEvents(unsigned int& budget)
 {
-    std::unique_lock<std::mutex> locker(mutex);
-    if (events.empty())
-        return false;
-    while (!events.empty()) {
-        auto event = events.front();
-        events.pop();
-        locker.unlock();
-        event->exec();
-        delete event;
-        locker.lock();
+    if (!pendingEvents) {
+        Event* event = postedEvents.exchange(0, std::memory_order_acquire);
+        if (!event)
+            return false;
+
+        // the stack hands us the events newest first, reverse to get posting order
+        uint64_t count = 0;
+        while (event) {
+            Event* next = event->next;
+            event->next = pendingEvents;
+            pendingEvents = event;
+            event = next;
+            ++count;
+        }
+        if (statsData->enabled.load(std::memory_order_relaxed)
+            && count > statsData->postedHighWater.load(std::memory_order_relaxed)) {
+            statsData->postedHighWater.store(count, std::memory_order_relaxed);
+        }
     }
-    return true;
-}
 
-// milliseconds
-static inline uint64_t currentTime()
-{
-#if defined(HAVE_CLOCK_MONOTONIC_RAW) || defined(HAVE_CLOCK_MONOTONIC)
-    timespec now;
-#if defined(HAVE_CLOCK_MONOTONIC_RAW)
-    if (clock_gettime(CLOCK_MONOTONIC_RAW, &now) == -1)
-        return 0;
-#elif defined(HAVE_CLOCK_MONOTONIC)
-    if (clock_gettime(CLOCK_MONOTONIC, &now) == -1)
-        return 0;
-#endif
-    const uint64_t t = (now.tv_sec * 1000LLU) + (now.tv_nsec / 1000000LLU);
-#elif defined(HAVE_MACH_ABSOLUTE_TIME)
-    static mach_timebase_info_data_t info;
-    static bool first = true;
-    uint64_t t = mach_absolute_time();
-    if (first) {
-        first = false;
-        mach_timebase_info(&info);
+    // events that don't fit in the budget stay in pendingEvents, ahead
+    // of anything posted since
+    while (pendingEvents && budget) {
+        Event* event = pendingEvents;
+        pendingEvents = event->next;
+        --budget;
+        {
+            CallbackTimer timer(statsData->enabled, statsData->postedEvents, "EventLoop::postedEvent");
+            event->exec();
+        }
+        delete event;
     }
-    t = t * info.numer / (info.denom * 1000); // microseconds
-    t /= 1000; // milliseconds
-#else
-#error No time getting mechanism
-#endif
-    return t;
+    return true;
 }
 
 int EventLoop::registerTimer(std::function<void(int)>&& func, int timeout, unsigned int flags)
@@ -302,108 +872,280 @@ int EventLoop::registerTimer(std::function<void(int)>&& func, int timeout, unsig
         TimerData data;
         do {
             data.id = ++nextTimerId;
-        } while (timersById.count(&data));
+        } while (!data.id || timersById.count(&data));
     }
-    TimerData* timer = new TimerData(currentTime() + timeout, nextTimerId, flags, timeout, std::forward<std::function<void(int)> >(func));
-    timersByTime.insert(timer);
+    TimerData* timer = new TimerData(timerDeadline(currentTime() + timeout, timeout, flags), nextTimerId, flags, timeout, std::forward<std::function<void(int)> >(func));
     timersById.insert(timer);
     assert(timersById.count(timer) == 1);
+    scheduleTimer(timer);
     wakeup();
     return nextTimerId;
 }
 
 void EventLoop::unregisterTimer(int id)
 {
-    // rather slow
     std::lock_guard<std::mutex> locker(mutex);
     clearTimer(id);
 }
 
+bool EventLoop::restartTimer(int id, int timeout, unsigned int flags)
+{
+    std::lock_guard<std::mutex> locker(mutex);
+    TimerData data;
+    data.id = id;
+    const auto timer = timersById.find(&data);
+    if (timer == timersById.end())
+        return false;
+    TimerData* t = *timer;
+    const uint64_t when = timerDeadline(currentTime() + timeout, timeout, flags);
+    if (when == t->when && flags == t->flags && t->list) {
+        // a coalescing timer restarted within its slack, nothing changes
+        t->interval = timeout;
+        return true;
+    }
+    // this also takes it out of a batch that is currently firing
+    if (t->list)
+        unlinkTimer(t);
+    t->when = when;
+    t->interval = timeout;
+    t->flags = flags;
+    scheduleTimer(t);
+    wakeup();
+    return true;
+}
+
 void EventLoop::clearTimer(int id)
 {
-    TimerData* t = 0;
-    {
-        TimerData data;
-        data.id = id;
-        auto timer = timersById.find(&data);
-        if (timer == timersById.end()) {
-            // no such timer
-            return;
+    TimerData data;
+    data.id = id;
+    auto timer = timersById.find(&data);
+    if (timer == timersById.end()) {
+        // no such timer
+        return;
+    }
+    TimerData* t = *timer;
+    timersById.erase(timer);
+    if (t->list)
+        unlinkTimer(t);
+    delete t;
+}
+
+void EventLoop::linkTimer(TimerData* timer, TimerData** list)
+{
+    assert(!timer->list);
+    timer->prev = 0;
+    timer->next = *list;
+    if (*list)
+        (*list)->prev = timer;
+    *list = timer;
+    timer->list = list;
+    if (list >= timerWheel && list < timerWheel + (WheelLevels * WheelSlots)) {
+        const int idx = list - timerWheel;
+        timerWheelUsed[idx / 64] |= (1llu << (idx % 64));
+    }
+}
+
+void EventLoop::unlinkTimer(TimerData* timer)
+{
+    TimerData** list = timer->list;
+    assert(list);
+    if (timer->prev) {
+        timer->prev->next = timer->next;
+    } else {
+        assert(*list == timer);
+        *list = timer->next;
+    }
+    if (timer->next)
+        timer->next->prev = timer->prev;
+    if (!*list && list >= timerWheel && list < timerWheel + (WheelLevels * WheelSlots)) {
+        const int idx = list - timerWheel;
+        timerWheelUsed[idx / 64] &= ~(1llu << (idx % 64));
+    }
+    timer->prev = timer->next = 0;
+    timer->list = 0;
+}
+
+void EventLoop::scheduleTimer(TimerData* timer)
+{
+    if (timer->when <= wheelTime) {
+        linkTimer(timer, &dueTimers);
+        return;
+    }
+    enum { MaxDeltaBits = WheelBits * WheelLevels };
+    uint64_t expires = timer->when;
+    uint64_t delta = expires - wheelTime;
+    if (delta >= (1llu << MaxDeltaBits)) {
+        // too far out, park it in the last slot we can address. It gets
+        // rescheduled when that slot expires
+        delta = (1llu << MaxDeltaBits) - 1;
+        expires = wheelTime + delta;
+    }
+    int level = 0;
+    while (level < WheelLevels - 1 && delta >= (1llu << (WheelBits * (level + 1))))
+        ++level;
+    const int slot = (expires >> (WheelBits * level)) & WheelMask;
+    linkTimer(timer, &timerWheel[(level * WheelSlots) + slot]);
+}
+
+// move the timers of the current slot at level down to the level(s) below,
+// returns the index of that slot
+int EventLoop::cascadeTimers(int level)
+{
+    const int index = (wheelTime >> (WheelBits * level)) & WheelMask;
+    TimerData** slot = &timerWheel[(level * WheelSlots) + index];
+    while (*slot) {
+        TimerData* timer = *slot;
+        unlinkTimer(timer);
+        scheduleTimer(timer);
+    }
+    return index;
+}
+
+void EventLoop::takeDueTimers(TimerData** out)
+{
+    while (dueTimers) {
+        TimerData* timer = dueTimers;
+        unlinkTimer(timer);
+        linkTimer(timer, out);
+    }
+}
+
+int EventLoop::findWheelSlot(int level, int from) const
+{
+    const uint64_t* used = timerWheelUsed + ((level * WheelSlots) / 64);
+    for (int word = from / 64; word < WheelSlots / 64; ++word) {
+        uint64_t bits = used[word];
+        if (word == from / 64)
+            bits &= ~0llu << (from % 64);
+        if (bits)
+            return (word * 64) + __builtin_ctzll(bits);
+    }
+    return -1;
+}
+
+// moves every timer that expires at or before now to out, oldest first
+void EventLoop::expireTimers(uint64_t now, TimerData** out)
+{
+    takeDueTimers(out);
+    while (wheelTime < now) {
+        // jump to the next occupied slot at level 0, or to the end of
+        // this lap if there is none since we need to cascade there
+        const uint64_t index = wheelTime & WheelMask;
+        uint64_t target = (wheelTime | WheelMask) + 1;
+        if (index < WheelMask) {
+            const int next = findWheelSlot(0, index + 1);
+            if (next != -1)
+                target = wheelTime - index + next;
         }
-        t = *timer;
-        assert(timersById.count(t) == 1);
-        timersById.erase(timer);
-        assert(timersById.count(t) == 0);
-    }
-    assert(t);
-    const auto range = timersByTime.equal_range(t);
-    auto timer = range.first;
-    const auto end = range.second;
-    while (timer != end) {
-        if (*timer == t) {
-            // got it
-            timersByTime.erase(timer);
-            delete t;
-            return;
+        if (target > now) {
+            wheelTime = now;
+            break;
+        }
+        wheelTime = target;
+        if (!(wheelTime & WheelMask)) {
+            for (int level = 1; level < WheelLevels; ++level) {
+                if (cascadeTimers(level))
+                    break;
+            }
+        }
+        takeDueTimers(out);
+        TimerData** slot = &timerWheel[wheelTime & WheelMask];
+        while (*slot) {
+            TimerData* timer = *slot;
+            unlinkTimer(timer);
+            if (timer->when > wheelTime) {
+                // was parked, see scheduleTimer
+                scheduleTimer(timer);
+            } else {
+                linkTimer(timer, out);
+            }
         }
-        ++timer;
     }
-    fprintf(stderr, "Found timer %d by id but not by timeout\n", t->id);
-    abort();
+
+    // the list was built back to front
+    TimerData* timer = *out;
+    while (timer) {
+        TimerData* next = timer->next;
+        std::swap(timer->prev, timer->next);
+        if (!next)
+            *out = timer;
+        timer = next;
+    }
+}
+
+// milliseconds until the next timer needs attention, -1 if there are none
+int EventLoop::nextTimerTimeout(uint64_t now) const
+{
+    if (dueTimers)
+        return 0;
+    if (timersById.empty())
+        return -1;
+
+    uint64_t next = UINT64_MAX;
+    const int index = wheelTime & WheelMask;
+    int slot = index < WheelMask ? findWheelSlot(0, index + 1) : -1;
+    if (slot != -1) {
+        next = wheelTime - index + slot;
+    } else if ((slot = findWheelSlot(0, 0)) != -1) {
+        next = wheelTime - index + WheelSlots + slot;
+    }
+    // timers on the higher levels need us to wake up when their slot cascades
+    for (int level = 1; level < WheelLevels; ++level) {
+        const int shift = WheelBits * level;
+        const int idx = (wheelTime >> shift) & WheelMask;
+        int used = idx < WheelMask ? findWheelSlot(level, idx + 1) : -1;
+        if (used == -1)
+            used = findWheelSlot(level, 0);
+        if (used == -1)
+            continue;
+        const int distance = used > idx ? used - idx : (used + WheelSlots - idx);
+        next = std::min(next, ((wheelTime >> shift) + distance) << shift);
+    }
+    if (next == UINT64_MAX)
+        return -1;
+    if (next <= now)
+        return 0;
+    return static_cast<int>(std::min<uint64_t>(next - now, INT_MAX));
 }
 
-inline bool EventLoop::sendTimers()
+// fires up to budget timers and takes what it fired off budget
+inline bool EventLoop::sendTimers(unsigned int& budget)
 {
-    std::set<uint64_t> fired;
     std::unique_lock<std::mutex> locker(mutex);
+    TimerData* firing = 0;
     const uint64_t now = currentTime();
-    for (;;) {
-        auto timer = timersByTime.begin();
-        if (timer == timersByTime.end())
-            return !fired.empty();
-        TimerData* timerData = *timer;
-        int currentId = timerData->id;
-        while (fired.count(currentId)) {
-            // already fired this round, ignore for now
-            ++timer;
-            if (timer == timersByTime.end())
-                return !fired.empty();
-            timerData = *timer;
-            currentId = timerData->id;
-        }
-        if (timerData->when > now)
-            return !fired.empty();
+    expireTimers(now, &firing);
+    if (!firing)
+        return false;
+    const bool stats = statsData->enabled.load(std::memory_order_relaxed);
+    while (firing && budget) {
+        --budget;
+        // callbacks may unregister or restart timers that are still
+        // in firing, that takes them out of the list
+        TimerData* timerData = firing;
+        unlinkTimer(timerData);
+        const int currentId = timerData->id;
+        if (stats)
+            statsData->timerLateness.record((now - std::min(now, timerData->when)) * 1000);
+        CallbackTimer timer(statsData->enabled, statsData->timers, "EventLoop::timer");
         if (timerData->flags & Timer::SingleShot) {
             // remove the timer before firing
             std::function<void(int)> func = std::move(timerData->callback);
-            timersByTime.erase(timer);
             timersById.erase(timerData);
             delete timerData;
-            fired.insert(currentId);
 
             // fire
             locker.unlock();
             CALLBACK(func(currentId));
             locker.lock();
         } else {
-            // silly std::set/multiset doesn't have a way of forcing a resort.
-            // take the item out and reinsert it
-
-            // luckily we have the exact iterator
-            timersByTime.erase(timer);
-
-            // update the fire time
-            const int64_t overtime = now - timerData->when;
-            timerData->when = (now - overtime) + timerData->interval;
-
-            // reinsert with the updated time
-            timersByTime.insert(timerData);
+            timerData->when = timerDeadline(timerData->when + timerData->interval,
+                                            timerData->interval, timerData->flags);
+            scheduleTimer(timerData);
 
             // take a copy of the callback in case the timer gets
             // removed before we get a chance to call it
-            // ### is this heavy?
             std::function<void(int)> cb = timerData->callback;
-            fired.insert(currentId);
 
             // fire
             locker.unlock();
@@ -411,29 +1153,51 @@ inline bool EventLoop::sendTimers()
             locker.lock();
         }
     }
-    return !fired.empty();
+    if (firing) {
+        // over budget, these are due and go first next time. dueTimers
+        // fires head first so link them back to front
+        TimerData* timer = firing;
+        while (timer->next)
+            timer = timer->next;
+        while (timer) {
+            TimerData* prev = timer->prev;
+            unlinkTimer(timer);
+            linkTimer(timer, &dueTimers);
+            timer = prev;
+        }
+    }
+    return true;
 }
 
 bool EventLoop::registerSocket(int fd, unsigned int mode, std::function<void(int, unsigned int)>&& func)
 {
+    if (fd < 0) {
+        fprintf(stderr, "Unable to register socket %d\n", fd);
+        return false;
+    }
     std::lock_guard<std::mutex> locker(mutex);
-    sockets[fd] = std::make_pair(mode, std::forward<std::function<void(int, unsigned int)> >(func));
+    if (static_cast<size_t>(fd) >= sockets.size())
+        sockets.resize(std::max<size_t>(fd + 1, sockets.size() * 2));
+    SocketData& socket = sockets[fd];
+    if (!socket.used) {
+        socket.used = true;
+        ++activeSockets;
+        if (!++socket.generation)
+            ++socket.generation;
+    }
+    socket.mode = mode;
+    socket.callback = std::forward<std::function<void(int, unsigned int)> >(func);
 
     int e;
-#if defined(HAVE_EPOLL)
-    epoll_event ev;
-    memset(&ev, 0, sizeof(ev));
-    ev.events = EPOLLRDHUP;
-    if (!(mode & SocketLevelTriggered))
-        ev.events |= EPOLLET;
-    if (mode & SocketRead)
-        ev.events |= EPOLLIN;
-    if (mode & SocketWrite)
-        ev.events |= EPOLLOUT;
-    if (mode & SocketOneShot)
-        ev.events |= EPOLLONESHOT;
-    ev.data.fd = fd;
-    e = epoll_ctl(pollFd, EPOLL_CTL_ADD, fd, &ev);
+#if defined(HAVE_IO_URING)
+    if (uring) {
+        e = armPoll(fd, mode) ? 0 : -1;
+        wakeup();
+    } else {
+        e = epollControl(pollFd, EPOLL_CTL_ADD, fd, mode, socketKey(fd, socket.generation));
+    }
+#elif defined(HAVE_EPOLL)
+    e = epollControl(pollFd, EPOLL_CTL_ADD, fd, mode, socketKey(fd, socket.generation));
 #elif defined(HAVE_KQUEUE)
     e = 0;
     const struct { int rf; int kf; } flags[] = {
@@ -470,31 +1234,26 @@ bool EventLoop::registerSocket(int fd, unsigned int mode, std::function<void(int
 bool EventLoop::updateSocket(int fd, unsigned int mode)
 {
     std::lock_guard<std::mutex> locker(mutex);
-    auto socket = sockets.find(fd);
-    if (socket == sockets.end()) {
+    SocketData* socket = findSocket(fd);
+    if (!socket) {
         fprintf(stderr, "Unable to find socket to update %d\n", fd);
         return false;
     }
 #if defined(HAVE_KQUEUE)
-    const int oldMode = socket->second.first;
+    const int oldMode = socket->mode;
 #endif
-    socket->second.first = mode;
+    socket->mode = mode;
 
     int e;
-#if defined(HAVE_EPOLL)
-    epoll_event ev;
-    memset(&ev, 0, sizeof(ev));
-    ev.events = EPOLLRDHUP;
-    if (!(mode & SocketLevelTriggered))
-        ev.events |= EPOLLET;
-    if (mode & SocketRead)
-        ev.events |= EPOLLIN;
-    if (mode & SocketWrite)
-        ev.events |= EPOLLOUT;
-    if (mode & SocketOneShot)
-        ev.events |= EPOLLONESHOT;
-    ev.data.fd = fd;
-    e = epoll_ctl(pollFd, EPOLL_CTL_MOD, fd, &ev);
+#if defined(HAVE_IO_URING)
+    if (uring) {
+        e = armPoll(fd, mode) ? 0 : -1;
+        wakeup();
+    } else {
+        e = epollControl(pollFd, EPOLL_CTL_MOD, fd, mode, socketKey(fd, socket->generation));
+    }
+#elif defined(HAVE_EPOLL)
+    e = epollControl(pollFd, EPOLL_CTL_MOD, fd, mode, socketKey(fd, socket->generation));
 #elif defined(HAVE_KQUEUE)
     e = 0;
     const struct { int rf; int kf; } flags[] = {
@@ -536,16 +1295,28 @@ bool EventLoop::updateSocket(int fd, unsigned int mode)
 void EventLoop::unregisterSocket(int fd)
 {
     std::lock_guard<std::mutex> locker(mutex);
-    auto socket = sockets.find(fd);
-    if (socket == sockets.end())
+    SocketData* socket = findSocket(fd);
+    if (!socket)
         return;
 #ifdef HAVE_KQUEUE
-    const int mode = socket->second.first;
+    const int mode = socket->mode;
 #endif
-    sockets.erase(socket);
+    releaseSocket(socket);
 
     int e;
-#if defined(HAVE_EPOLL)
+#if defined(HAVE_IO_URING)
+    if (uring) {
+        // the poll holds a reference to the file, get the removal out
+        // before the fd is closed on us
+        cancelPoll(fd);
+        e = 0;
+        wakeup();
+    } else {
+        epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        e = epoll_ctl(pollFd, EPOLL_CTL_DEL, fd, &ev);
+    }
+#elif defined(HAVE_EPOLL)
     epoll_event ev;
     memset(&ev, 0, sizeof(ev));
     e = epoll_ctl(pollFd, EPOLL_CTL_DEL, fd, &ev);
@@ -578,21 +1349,117 @@ void EventLoop::unregisterSocket(int fd)
     }
 }
 
+#if defined(HAVE_IO_URING)
+// queues a poll for fd, replacing the one it had. Needs the mutex
+bool EventLoop::armPoll(int fd, unsigned int mode)
+{
+    cancelPoll(fd);
+    io_uring_sqe* sqe = uring->get();
+    if (!sqe) {
+        errno = EBUSY;
+        return false;
+    }
+    uint32_t events = POLLRDHUP;
+    if (mode & SocketRead)
+        events |= POLLIN;
+    if (mode & SocketWrite)
+        events |= POLLOUT;
+#  if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    events = (events << 16) | (events >> 16);
+#  endif
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = events;
+    // a multishot poll reports each time the fd becomes ready, that's as
+    // close to EPOLLET as it gets. Level triggered polls are rearmed by
+    // processSocketEvents() and one shots by updateSocket()
+    if (!(mode & (SocketOneShot|SocketLevelTriggered)))
+        sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->user_data = uring->tag(fd);
+    uring->push();
+    return true;
+}
+
+// queues the removal of the poll armed for fd. Needs the mutex
+void EventLoop::cancelPoll(int fd)
+{
+    const auto poll = uring->polls.find(fd);
+    if (poll == uring->polls.end())
+        return;
+    const uint64_t tag = poll->second;
+    uring->polls.erase(poll);
+    if (io_uring_sqe* sqe = uring->get()) {
+        // user_data 0, processSocketEvents() ignores the completion
+        sqe->opcode = IORING_OP_POLL_REMOVE;
+        sqe->fd = -1;
+        sqe->addr = tag;
+        uring->push();
+    }
+}
+
+// submits everything queued since the last time and waits, one syscall
+int EventLoop::waitUring(NativeEvent* events, int maxEvents, int timeout)
+{
+    io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof(arg));
+    __kernel_timespec time;
+    if (timeout != -1) {
+        time.tv_sec = timeout / 1000;
+        time.tv_nsec = (timeout % 1000LLU) * 1000000;
+        arg.ts = reinterpret_cast<uint64_t>(&time);
+    }
+    if (uring->enter(1, IORING_ENTER_GETEVENTS|IORING_ENTER_EXT_ARG, &arg, sizeof(arg)) == -1
+        && errno != ETIME && errno != EBUSY) {
+        return -1;
+    }
+    return uring->reap(events, maxEvents);
+}
+
+// Without a ring. The epoll_events go in the same buffer and are made into
+// completions, the fd and generation in userData and the events in res.
+// An epoll_event is no bigger than a NativeEvent, going backwards each is
+// read before anything is written over it
+int EventLoop::waitEpoll(NativeEvent* events, int maxEvents, int timeout)
+{
+    static_assert(sizeof(epoll_event) <= sizeof(NativeEvent), "epoll_event has to fit");
+    static_assert(EPOLLIN == POLLIN && EPOLLOUT == POLLOUT && EPOLLERR == POLLERR
+                  && EPOLLHUP == POLLHUP && EPOLLRDHUP == POLLRDHUP, "epoll and poll bits differ");
+    char* raw = reinterpret_cast<char*>(events);
+    int count;
+    eintrwrap(count, epoll_wait(pollFd, reinterpret_cast<epoll_event*>(raw), maxEvents, timeout));
+    for (int i = count - 1; i >= 0; --i) {
+        epoll_event ev;
+        memcpy(&ev, raw + i * sizeof(epoll_event), sizeof(ev));
+        events[i].userData = ev.data.u64;
+        events[i].res = static_cast<int32_t>(ev.events);
+        events[i].flags = 0;
+    }
+    return count;
+}
+#endif
+
 unsigned int EventLoop::processSocket(int fd, int timeout)
 {
     int eventCount;
-#if defined(HAVE_EPOLL) || defined(HAVE_KQUEUE)
+#if !defined(HAVE_IO_URING) && (defined(HAVE_EPOLL) || defined(HAVE_KQUEUE))
     enum { MaxEvents = 2 };
     NativeEvent events[MaxEvents];
 #endif
 
-#if defined(HAVE_EPOLL)
+#if defined(HAVE_IO_URING)
+    // not worth a round trip through the ring, or epoll
+    pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = POLLIN|POLLOUT|POLLRDHUP;
+    pfd.revents = 0;
+    eintrwrap(eventCount, ::poll(&pfd, 1, timeout));
+#elif defined(HAVE_EPOLL)
     int processFd = epoll_create1(0);
 
     epoll_event ev;
     memset(&ev, 0, sizeof(ev));
     ev.events = EPOLLET|EPOLLRDHUP|EPOLLIN|EPOLLOUT;
-    ev.data.fd = fd;
+    ev.data.u64 = socketKey(fd, 0);
     epoll_ctl(processFd, EPOLL_CTL_ADD, fd, &ev);
 
     eintrwrap(eventCount, epoll_wait(processFd, events, MaxEvents, timeout));
@@ -638,7 +1505,23 @@ unsigned int EventLoop::processSocket(int fd, int timeout)
     if (eventCount == 0)
         return 0;
 
-#if defined(HAVE_EPOLL) || defined(HAVE_KQUEUE)
+#if defined(HAVE_IO_URING)
+    unsigned int mode = 0;
+    if (pfd.revents & (POLLERR|POLLHUP) && !(pfd.revents & POLLRDHUP)) {
+        struct stat st;
+        if (pfd.revents & POLLERR || (fstat(fd, &st) != -1 && S_ISSOCK(st.st_mode))) {
+            mode |= SocketError;
+        } else {
+            mode |= SocketRead;
+        }
+    } else {
+        if (pfd.revents & (POLLIN|POLLRDHUP))
+            mode |= SocketRead;
+        if (pfd.revents & POLLOUT)
+            mode |= SocketWrite;
+    }
+    return mode ? fireSocket(fd, mode) : 0;
+#elif defined(HAVE_EPOLL) || defined(HAVE_KQUEUE)
     ::close(processFd);
 #elif defined(HAVE_SELECT)
     NativeEvent event;
@@ -646,16 +1529,40 @@ unsigned int EventLoop::processSocket(int fd, int timeout)
     event.wrfd = &wrfd;
     NativeEvent* events = &event;
 #endif
+#if !defined(HAVE_IO_URING)
     return processSocketEvents(events, eventCount);
+#endif
+}
+
+void EventLoop::releaseSocket(SocketData* socket)
+{
+    assert(socket->used);
+    socket->clear();
+    --activeSockets;
 }
 
-unsigned int EventLoop::fireSocket(int fd, unsigned int mode)
+size_t EventLoop::socketCount() const
+{
+    std::lock_guard<std::mutex> locker(mutex);
+    return activeSockets;
+}
+
+EventLoop::SocketData* EventLoop::findSocket(int fd)
+{
+    if (fd < 0 || static_cast<size_t>(fd) >= sockets.size() || !sockets[fd].used)
+        return 0;
+    return &sockets[fd];
+}
+
+// generation 0 matches any socket on fd
+unsigned int EventLoop::fireSocket(int fd, unsigned int mode, uint32_t generation)
 {
     std::unique_lock<std::mutex> locker(mutex);
-    const auto socket = sockets.find(fd);
-    if (socket != sockets.end()) {
-        const auto callback = socket->second.second;
+    const SocketData* socket = findSocket(fd);
+    if (socket && (!generation || socket->generation == generation)) {
+        const auto callback = socket->callback;
         locker.unlock();
+        CallbackTimer timer(statsData->enabled, statsData->sockets, "EventLoop::socket");
         CALLBACK(callback(fd, mode));
         return mode;
     }
@@ -668,11 +1575,14 @@ unsigned int EventLoop::processSocketEvents(NativeEvent* events, int eventCount)
     int e;
 
 #if defined(HAVE_SELECT)
-    std::map<int, std::pair<unsigned int, std::function<void(int, unsigned int)> > > local;
+    std::vector<int> local;
     {
 #warning this is not optimal
         std::lock_guard<std::mutex> locker(mutex);
-        local = sockets;
+        for (size_t fd = 0; fd < sockets.size(); ++fd) {
+            if (sockets[fd].used)
+                local.push_back(fd);
+        }
     }
     auto socket = local.begin();
     if (socket == local.end()) {
@@ -683,15 +1593,102 @@ unsigned int EventLoop::processSocketEvents(NativeEvent* events, int eventCount)
 
     for (int i = 0; i < eventCount; ++i) {
         unsigned int mode = 0;
-#if defined(HAVE_EPOLL)
+        uint32_t generation = 0;
+#if defined(HAVE_IO_URING)
+        const uint64_t tag = events[i].userData;
+        const int fd = static_cast<int>(tag & 0xffffffff);
+        if (!uring) {
+            // epoll, waitEpoll() made completions of its events. The
+            // poll() and epoll bits are the same
+            generation = tag >> 32;
+        } else {
+            std::lock_guard<std::mutex> locker(mutex);
+            const auto poll = uring->polls.find(fd);
+            if (!tag || poll == uring->polls.end() || poll->second != tag) {
+                // removals, cancelled polls and polls we have replaced since
+                continue;
+            }
+            if (!(events[i].flags & IORING_CQE_F_MORE)) {
+                // the poll is done. Rearm level triggered ones and
+                // multishot polls the kernel gave up on
+                uring->polls.erase(poll);
+                if (events[i].res >= 0) {
+                    unsigned int socketMode = SocketRead; // our own wakeup fds
+                    if (const SocketData* socket = findSocket(fd))
+                        socketMode = socket->mode;
+                    if (!(socketMode & SocketOneShot))
+                        armPoll(fd, socketMode);
+                }
+            }
+        }
+        const uint32_t ev = events[i].res < 0 ? POLLERR : events[i].res;
+        if (ev & (POLLERR|POLLHUP) && !(ev & POLLRDHUP)) {
+            // bad, take the fd out
+            {
+                std::lock_guard<std::mutex> locker(mutex);
+                SocketData* socket = findSocket(fd);
+                if (uring) {
+                    cancelPoll(fd);
+                } else if (socket && generation && socket->generation != generation) {
+                    // meant for a socket that was unregistered since
+                    continue;
+                } else {
+                    epoll_event del;
+                    memset(&del, 0, sizeof(del));
+                    epoll_ctl(pollFd, EPOLL_CTL_DEL, fd, &del);
+                }
+                if (socket)
+                    releaseSocket(socket);
+            }
+            if (ev & POLLERR) {
+                int err;
+                socklen_t size = sizeof(err);
+                e = ::getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &size);
+                if (e == -1) {
+                    fprintf(stderr, "Error getting error for fd %d: %d (%s)\n", fd, errno, Rct::strerror().constData());
+                } else {
+                    fprintf(stderr, "Error on socket %d, removing: %d (%s)\n", fd, err, Rct::strerror().constData());
+                }
+                mode |= SocketError;
+            }
+            if (ev & POLLHUP) {
+                // check if our fd is a socket
+                struct stat st;
+                if (fstat(fd, &st) != -1 && S_ISSOCK(st.st_mode)) {
+                    mode |= SocketError;
+                    fprintf(stderr, "HUP on socket %d, removing\n", fd);
+                } else {
+                    mode |= SocketRead;
+                }
+            }
+
+            all |= fireSocket(fd, mode);
+            continue;
+        }
+        if (ev & (POLLIN|POLLRDHUP)) {
+            // read
+            mode |= SocketRead;
+        }
+        if (ev & POLLOUT) {
+            // write
+            mode |= SocketWrite;
+        }
+#elif defined(HAVE_EPOLL)
         const uint32_t ev = events[i].events;
-        const int fd = events[i].data.fd;
+        const int fd = static_cast<int>(events[i].data.u64 & 0xffffffff);
+        generation = events[i].data.u64 >> 32;
         if (ev & (EPOLLERR|EPOLLHUP) && !(ev & EPOLLRDHUP)) {
             // bad, take the fd out
-            epoll_ctl(pollFd, EPOLL_CTL_DEL, fd, &events[i]);
             {
                 std::lock_guard<std::mutex> locker(mutex);
-                sockets.erase(fd);
+                SocketData* socket = findSocket(fd);
+                if (socket && generation && socket->generation != generation) {
+                    // meant for a socket that was unregistered since
+                    continue;
+                }
+                epoll_ctl(pollFd, EPOLL_CTL_DEL, fd, &events[i]);
+                if (socket)
+                    releaseSocket(socket);
             }
             if (ev & EPOLLERR) {
                 int err;
@@ -738,7 +1735,8 @@ unsigned int EventLoop::processSocketEvents(NativeEvent* events, int eventCount)
             kevent(pollFd, &kev, 1, 0, 0, 0);
             {
                 std::lock_guard<std::mutex> locker(mutex);
-                sockets.erase(fd);
+                if (SocketData* socket = findSocket(fd))
+                    releaseSocket(socket);
             }
             fprintf(stderr, "Error on socket %d, removing: %d (%s)\n", fd, err, Rct::strerror().constData());
 
@@ -754,16 +1752,16 @@ unsigned int EventLoop::processSocketEvents(NativeEvent* events, int eventCount)
         int fd = -1;
         //assert(socket != local.end());
         while (socket != local.end()) {
-            if (FD_ISSET(socket->first, events->rdfd)) {
+            if (FD_ISSET(*socket, events->rdfd)) {
                 // go
-                fd = socket->first;
+                fd = *socket;
                 mode |= SocketRead;
                 ++socket;
                 break;
             }
-            if (events->wrfd && FD_ISSET(socket->first, events->wrfd)) {
+            if (events->wrfd && FD_ISSET(*socket, events->wrfd)) {
                 // go
-                fd = socket->first;
+                fd = *socket;
                 mode |= SocketWrite;
                 ++socket;
                 break;
@@ -774,11 +1772,28 @@ unsigned int EventLoop::processSocketEvents(NativeEvent* events, int eventCount)
             if (FD_ISSET(eventPipe[0], events->rdfd)) {
                 fd = eventPipe[0];
                 mode |= SocketRead;
+#  if defined(HAVE_EVENTFD)
+            } else if (FD_ISSET(eventFd, events->rdfd)) {
+                fd = eventFd;
+                mode |= SocketRead;
+#  endif
             }
         }
         //printf("firing %d (%d/%d)\n", fd, i, eventCount);
 #endif
         if (mode) {
+#if defined(HAVE_EVENTFD)
+            if (fd == eventFd) {
+                // reading resets the counter
+                uint64_t count;
+                eintrwrap(e, ::read(eventFd, &count, sizeof(count)));
+                if (e == -1 && errno != EAGAIN && errno != EWOULDBLOCK) {
+                    fprintf(stderr, "Error reading from event fd: %d (%s)\n", errno, Rct::strerror().constData());
+                    return GeneralError;
+                }
+                continue;
+            }
+#endif
             if (fd == eventPipe[0]) {
                 // drain the pipe
                 char q;
@@ -795,7 +1810,7 @@ unsigned int EventLoop::processSocketEvents(NativeEvent* events, int eventCount)
                     return GeneralError;
                 }
             } else {
-                all |= fireSocket(fd, mode);
+                all |= fireSocket(fd, mode, generation);
             }
         }
     }
@@ -810,14 +1825,25 @@ unsigned int EventLoop::exec(int timeoutTime)
 
     unsigned int ret = 0;
 
-#if defined(HAVE_EPOLL) || defined(HAVE_KQUEUE)
-    enum { MaxEvents = 64 };
-    NativeEvent events[MaxEvents];
+    unsigned int postedBudget, timerBudget;
+#if defined(HAVE_EPOLL) || defined(HAVE_KQUEUE) || defined(HAVE_IO_URING)
+    std::vector<NativeEvent> nativeEvents;
 #endif
+    {
+        std::lock_guard<std::mutex> locker(mutex);
+        postedBudget = maxPostedEvents;
+        timerBudget = maxTimers;
+#if defined(HAVE_EPOLL) || defined(HAVE_KQUEUE) || defined(HAVE_IO_URING)
+        nativeEvents.resize(maxSocketEvents);
+#endif
+    }
+    uint64_t wokeUp = 0;
 
     for (;;) {
+        unsigned int postedLeft = postedBudget ? postedBudget : UINT_MAX;
+        unsigned int timersLeft = timerBudget ? timerBudget : UINT_MAX;
         for (;;) {
-            if (!sendPostedEvents() && !sendTimers())
+            if (!(postedLeft && sendPostedEvents(postedLeft)) && !(timersLeft && sendTimers(timersLeft)))
                 break;
         }
         int waitUntil = -1;
@@ -836,14 +1862,37 @@ unsigned int EventLoop::exec(int timeoutTime)
                 break;
             }
 
-            const auto timer = timersByTime.begin();
-            if (timer != timersByTime.end()) {
-                const uint64_t now = currentTime();
-                waitUntil = std::max<int>((*timer)->when - now, 0);
-            }
+            // leftover timers are in dueTimers which makes this 0
+            waitUntil = nextTimerTimeout(currentTime());
+            if (!postedLeft && (pendingEvents || postedEvents.load(std::memory_order_relaxed)))
+                waitUntil = 0;
+
+            postedBudget = maxPostedEvents;
+            timerBudget = maxTimers;
+#if defined(HAVE_EPOLL) || defined(HAVE_KQUEUE) || defined(HAVE_IO_URING)
+            if (nativeEvents.size() != static_cast<size_t>(maxSocketEvents))
+                nativeEvents.resize(maxSocketEvents);
+#endif
+        }
+#if defined(HAVE_EPOLL) || defined(HAVE_KQUEUE) || defined(HAVE_IO_URING)
+        NativeEvent* events = &nativeEvents[0];
+        const int MaxEvents = nativeEvents.size();
+#endif
+        const bool stats = statsData->enabled.load(std::memory_order_relaxed);
+        uint64_t waitStarted = 0;
+        if (stats) {
+            waitStarted = currentTimeUs();
+            if (wokeUp)
+                statsData->iterationLag.record(waitStarted - wokeUp);
         }
         int eventCount;
-#if defined(HAVE_EPOLL)
+#if defined(HAVE_IO_URING)
+        if (uring) {
+            eventCount = waitUring(events, MaxEvents, waitUntil);
+        } else {
+            eventCount = waitEpoll(events, MaxEvents, waitUntil);
+        }
+#elif defined(HAVE_EPOLL)
         eintrwrap(eventCount, epoll_wait(pollFd, events, MaxEvents, waitUntil));
 #elif defined(HAVE_KQUEUE)
         timespec timeout;
@@ -869,26 +1918,37 @@ unsigned int EventLoop::exec(int timeoutTime)
         FD_ZERO(&wrfd);
         int max = eventPipe[0];
         FD_SET(max, &rdfd);
+#  if defined(HAVE_EVENTFD)
+        FD_SET(eventFd, &rdfd);
+        max = std::max(max, eventFd);
+#  endif
         {
             std::lock_guard<std::mutex> locker(mutex);
-            auto s = sockets.begin();
-            const auto e = sockets.end();
-            while (s != e) {
-                if (s->second.first & SocketRead) {
-                    FD_SET(s->first, &rdfd);
+            for (int fd = 0; fd < static_cast<int>(sockets.size()); ++fd) {
+                const SocketData& s = sockets[fd];
+                if (!s.used)
+                    continue;
+                if (s.mode & SocketRead) {
+                    FD_SET(fd, &rdfd);
                 }
-                if (s->second.first & SocketWrite) {
+                if (s.mode & SocketWrite) {
                     if (!wrfdp)
                         wrfdp = &wrfd;
-                    FD_SET(s->first, wrfdp);
+                    FD_SET(fd, wrfdp);
                 }
-                max = std::max(max, s->first);
-                ++s;
+                max = std::max(max, fd);
             }
         }
 
         eintrwrap(eventCount, select(max + 1, &rdfd, wrfdp, 0, timeptr));
 #endif
+        if (stats) {
+            wokeUp = currentTimeUs();
+            statsData->waitTime.fetch_add(wokeUp - waitStarted, std::memory_order_relaxed);
+            statsData->iterations.fetch_add(1, std::memory_order_relaxed);
+        } else {
+            wokeUp = 0;
+        }
         if (eventCount < 0) {
             // bad
             ret = GeneralError;
@@ -910,3 +1970,50 @@ unsigned int EventLoop::exec(int timeoutTime)
         clearTimer(quitTimerId);
     return ret;
 }
+
+void EventLoop::setPostedEventBudget(unsigned int max)
+{
+    std::lock_guard<std::mutex> locker(mutex);
+    maxPostedEvents = max;
+}
+
+void EventLoop::setTimerBudget(unsigned int max)
+{
+    std::lock_guard<std::mutex> locker(mutex);
+    maxTimers = max;
+}
+
+void EventLoop::setMaxSocketEvents(int max)
+{
+    std::lock_guard<std::mutex> locker(mutex);
+    maxSocketEvents = std::max(max, 1);
+}
+
+void EventLoop::setStatsEnabled(bool on)
+{
+    statsData->enabled.store(on, std::memory_order_relaxed);
+}
+
+bool EventLoop::statsEnabled() const
+{
+    return statsData->enabled.load(std::memory_order_relaxed);
+}
+
+EventLoop::Stats EventLoop::stats() const
+{
+    Stats ret;
+    ret.postedEvents = statsData->postedEvents.load();
+    ret.timers = statsData->timers.load();
+    ret.sockets = statsData->sockets.load();
+    ret.timerLateness = statsData->timerLateness.load();
+    ret.iterationLag = statsData->iterationLag.load();
+    ret.iterations = statsData->iterations.load(std::memory_order_relaxed);
+    ret.waitTime = statsData->waitTime.load(std::memory_order_relaxed);
+    ret.postedHighWater = statsData->postedHighWater.load(std::memory_order_relaxed);
+    return ret;
+}
+
+void EventLoop::resetStats()
+{
+    statsData->reset();
+}
@@ -1,6 +1,7 @@
 #ifndef EVENTLOOP_H
 #define EVENTLOOP_H
 
+#include <atomic>
 #include <map>
 #include <memory>
 #include <mutex>
@@ -12,7 +13,9 @@
 #include <vector>
 #include "Apply.h"
 #include "rct-config.h"
-#if defined(HAVE_EPOLL)
+#if defined(HAVE_IO_URING)
+#  include <stdint.h>
+#elif defined(HAVE_EPOLL)
 #  include <sys/epoll.h>
 #elif defined(HAVE_KQUEUE)
 #  include <sys/types.h>
@@ -25,8 +28,19 @@
 class Event
 {
 public:
+    Event() : next(0) { }
     virtual ~Event() { }
     virtual void exec() = 0;
+
+    // events come from small per-thread pools, see EventLoop.cpp
+    static void* operator new(size_t size);
+    static void operator delete(void* ptr);
+
+private:
+    // intrusive link for EventLoop's posted event stack
+    Event* next;
+
+    friend class EventLoop;
 };
 
 template<typename Object, typename... Args>
@@ -90,7 +104,12 @@ public:
     };
     enum PostType {
         Move = 1,
-        Async
+        Async,
+        // Async, but emissions piling up before the loop gets to them are
+        // delivered in one event, one call per emission or, coalesced, one
+        // call with the latest arguments. See Signal::connect()
+        Batched,
+        Coalesced
     };
 
     void init(unsigned int flags = None);
@@ -140,23 +159,71 @@ public:
     bool updateSocket(int fd, unsigned int mode);
     void unregisterSocket(int fd);
     unsigned int processSocket(int fd, int timeout = -1);
+    // number of registered sockets
+    size_t socketCount() const;
 
     // See Timer.h for the flags
     int registerTimer(std::function<void(int)>&& func, int timeout, unsigned int flags = 0);
     void unregisterTimer(int id);
+    // re-arm an existing timer in place, returns false if the timer is gone
+    bool restartTimer(int id, int timeout, unsigned int flags = 0);
 
     enum { Success = 0x100, GeneralError = 0x200, Timeout = 0x400 };
     unsigned int exec(int timeout = -1);
     void quit();
 
+    // Limits on how much work one iteration of exec() does before it polls
+    // the sockets again, so a busy producer can't starve socket I/O. 0, the
+    // default, means no limit. Whatever is left over runs after a poll that
+    // doesn't block.
+    void setPostedEventBudget(unsigned int max);
+    void setTimerBudget(unsigned int max);
+    // how many socket events exec() takes from the kernel per iteration, 64
+    // by default. The select backend always takes all of them
+    void setMaxSocketEvents(int max);
+
     //bool isRunning() const { std::lock_guard<std::mutex> locker(mutex); return !mExecStack.empty(); }
 
     static EventLoop::SharedPtr mainEventLoop() { std::lock_guard<std::mutex> locker(mainMutex); return mainLoop.lock(); }
     static EventLoop::SharedPtr eventLoop();
 
     static bool isMainThread() { return EventLoop::mainEventLoop() && std::this_thread::get_id() == EventLoop::mainEventLoop()->threadId; }
+
+    // Runtime statistics, off by default. All times are in microseconds.
+    struct Histogram
+    {
+        // bucket 0 counts samples in [0, 2), bucket n in [2^n, 2^(n+1)),
+        // the last one is open ended
+        enum { Buckets = 24 };
+        uint64_t count, total, max;
+        uint64_t buckets[Buckets];
+    };
+    struct Stats
+    {
+        // time spent in callbacks
+        Histogram postedEvents, timers, sockets;
+        // how late timers fired compared to when they were due
+        Histogram timerLateness;
+        // time from waking up until going back to wait
+        Histogram iterationLag;
+        uint64_t iterations, waitTime;
+        // largest number of posted events drained in one batch
+        uint64_t postedHighWater;
+    };
+    void setStatsEnabled(bool on);
+    bool statsEnabled() const;
+    Stats stats() const;
+    void resetStats();
 private:
-#if defined(HAVE_EPOLL)
+#if defined(HAVE_IO_URING)
+    // a copy of the io_uring_cqe fields we care about
+    struct NativeEvent
+    {
+        uint64_t userData;
+        int32_t res;
+        uint32_t flags;
+    };
+#elif defined(HAVE_EPOLL)
     typedef epoll_event NativeEvent;
 #elif defined(HAVE_KQUEUE)
     typedef struct kevent NativeEvent;
@@ -168,12 +235,33 @@ private:
     };
 #endif
 
+    class TimerData;
+
     void clearTimer(int id);
-    bool sendPostedEvents();
-    bool sendTimers();
+    void linkTimer(TimerData* timer, TimerData** list);
+    void unlinkTimer(TimerData* timer);
+    void scheduleTimer(TimerData* timer);
+    int cascadeTimers(int level);
+    void takeDueTimers(TimerData** out);
+    void expireTimers(uint64_t now, TimerData** out);
+    int findWheelSlot(int level, int from) const;
+    int nextTimerTimeout(uint64_t now) const;
+    bool sendPostedEvents(unsigned int& budget);
+    bool sendTimers(unsigned int& budget);
     void cleanup();
     unsigned int processSocketEvents(NativeEvent* events, int eventCount);
-    unsigned int fireSocket(int fd, unsigned int mode);
+    struct SocketData;
+    SocketData* findSocket(int fd);
+    void releaseSocket(SocketData* socket);
+    unsigned int fireSocket(int fd, unsigned int mode, uint32_t generation = 0);
+#if defined(HAVE_IO_URING)
+    struct Uring;
+    bool armPoll(int fd, unsigned int mode);
+    void cancelPoll(int fd);
+    int waitUring(NativeEvent* events, int maxEvents, int timeout);
+    // where io_uring_setup() fails
+    int waitEpoll(NativeEvent* events, int maxEvents, int timeout);
+#endif
 
     static void error(const char* err);
 
@@ -182,40 +270,63 @@ private:
     mutable std::mutex mutex;
     std::thread::id threadId;
 
-    std::queue<Event*> events;
+    // lock-free multi-producer/single-consumer stack of posted events,
+    // drained in one batch by sendPostedEvents()
+    std::atomic<Event*> postedEvents;
+    // taken off postedEvents, in posting order, but not run yet. Only
+    // touched by the thread running exec()
+    Event* pendingEvents;
     int eventPipe[2];
-#if defined(HAVE_EPOLL) || defined(HAVE_KQUEUE)
+#if defined(HAVE_EVENTFD)
+    int eventFd;
+#endif
+#if defined(HAVE_EPOLL) || defined(HAVE_KQUEUE) || defined(HAVE_IO_URING)
     int pollFd;
 #endif
+#if defined(HAVE_IO_URING)
+    // submission and completion rings, polls queued by registerSocket()
+    // and friends go out in one batch when exec() goes back to wait. Null
+    // if the kernel wouldn't give us one, pollFd is an epoll fd then
+    std::unique_ptr<Uring> uring;
+#endif
 
-    std::map<int, std::pair<unsigned int, std::function<void(int, unsigned int)> > > sockets;
-
-    class TimerData
+    struct SocketData
     {
-    public:
-        TimerData() { }
-        TimerData(uint64_t w, int i, unsigned int f, int in, std::function<void(int)>&& cb)
-            : when(w), id(i), flags(f), interval(in), callback(std::move(cb))
+        SocketData()
+            : mode(0), generation(0), used(false)
         {
         }
-        TimerData(TimerData&& other)
-            : when(other.when), id(other.id), flags(other.flags),
-              interval(other.interval), callback(std::move(other.callback))
+
+        void clear()
         {
+            mode = 0;
+            used = false;
+            callback = nullptr;
         }
-        TimerData& operator=(TimerData&& other)
+
+        unsigned int mode;
+        // bumped each time the fd gets registered. It goes to the kernel
+        // with the fd so events queued for a socket that has been
+        // unregistered since can't reach a new socket on the same fd
+        uint32_t generation;
+        bool used;
+        std::function<void(int, unsigned int)> callback;
+    };
+    // indexed by fd
+    std::vector<SocketData> sockets;
+    size_t activeSockets;
+
+    class TimerData
+    {
+    public:
+        TimerData()
+            : prev(0), next(0), list(0)
         {
-            when = other.when;
-            id = other.id;
-            flags = other.flags;
-            interval = other.interval;
-            callback = std::move(other.callback);
-            return *this;
         }
-
-        bool operator<(const TimerData& other) const
+        TimerData(uint64_t w, int i, unsigned int f, int in, std::function<void(int)>&& cb)
+            : when(w), id(i), flags(f), interval(in), callback(std::move(cb)),
+              prev(0), next(0), list(0)
         {
-            return when < other.when;
         }
 
         uint64_t when;
@@ -224,33 +335,51 @@ private:
         int interval;
         std::function<void(int)> callback;
 
+        // intrusive links for the wheel slot (or other list) we're in
+        TimerData* prev;
+        TimerData* next;
+        TimerData** list;
+
     private:
         TimerData(const TimerData& other) = delete;
         TimerData& operator=(const TimerData& other) = delete;
     };
 
-    struct TimerDataSet
-    {
-        bool operator()(TimerData* a, TimerData* b) const { return a->when < b->when; }
-    };
     struct TimerDataHash
     {
         // two operators for the price of one!
         size_t operator()(TimerData* a) const { return a->id; }
         bool operator()(TimerData* a, TimerData* b) const { return a->id == b->id; }
     };
-    typedef std::multiset<TimerData*, TimerDataSet> TimersByTime;
     typedef std::unordered_set<TimerData*, TimerDataHash, TimerDataHash> TimersById;
-    TimersByTime timersByTime;
     TimersById timersById;
     uint32_t nextTimerId;
 
+    // hierarchical timing wheel, level n has WheelSlots slots of
+    // 2^(n * WheelBits) milliseconds each. Timers cascade down a level
+    // each time the level below wraps around.
+    enum {
+        WheelBits = 8,
+        WheelSlots = 1 << WheelBits,
+        WheelMask = WheelSlots - 1,
+        WheelLevels = 4
+    };
+    TimerData* timerWheel[WheelLevels * WheelSlots];
+    uint64_t timerWheelUsed[(WheelLevels * WheelSlots) / 64];
+    TimerData* dueTimers;
+    uint64_t wheelTime;
+
     bool stop;
     bool timeout;
 
     static EventLoop::WeakPtr mainLoop;
 
     unsigned int flgs;
+    unsigned int maxPostedEvents, maxTimers;
+    int maxSocketEvents;
+
+    struct StatsData;
+    std::unique_ptr<StatsData> statsData;
 private:
     EventLoop(const EventLoop&) = delete;
     EventLoop& operator=(const EventLoop&) = delete;
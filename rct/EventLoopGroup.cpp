@@ -0,0 +1,122 @@
+#include "EventLoopGroup.h"
+#include "ThreadPool.h"
+#include "Log.h"
+#include "rct-config.h"
+
+EventLoopGroup::EventLoopGroup()
+    : mStarted(0), mNext(0)
+{
+}
+
+EventLoopGroup::~EventLoopGroup()
+{
+    stop();
+}
+
+bool EventLoopGroup::start(int count, unsigned int flags)
+{
+    stop();
+    if (count <= 0)
+        count = std::max(ThreadPool::idealThreadCount(), 1);
+
+    std::unique_lock<std::mutex> lock(mMutex);
+    mPending.resize(count);
+    mStarted = 0;
+    for (int i = 0; i < count; ++i)
+        mThreads.push_back(std::thread(std::bind(&EventLoopGroup::run, this, i, flags)));
+    // the loops have to be initialized on their own threads
+    while (mStarted < count)
+        mCond.wait(lock);
+    std::swap(mLoops, mPending);
+    mPending.clear();
+    for (const auto& loop : mLoops) {
+        if (!loop) {
+            lock.unlock();
+            stop();
+            return false;
+        }
+    }
+    return true;
+}
+
+void EventLoopGroup::run(int idx, unsigned int flags)
+{
+    Thread::setCurrentName(String::format<16>("EventLoop %d", idx));
+    if (flags & PinThreads) {
+        const int cores = std::max(ThreadPool::idealThreadCount(), 1);
+        Thread::setCurrentAffinity(List<int>() << (idx % cores));
+    } else if (flags & PinToNodes) {
+        const List<List<int> > nodes = ThreadPool::numaNodes();
+        Thread::setCurrentAffinity(nodes.at(idx % nodes.size()));
+    }
+
+    EventLoop::SharedPtr loop(new EventLoop);
+    loop->init(EventLoop::None);
+    // init() doesn't fail loudly, but it only becomes our loop if it worked
+    const bool ok = EventLoop::eventLoop() == loop;
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        if (ok)
+            mPending[idx] = loop;
+        ++mStarted;
+    }
+    mCond.notify_all();
+    if (ok)
+        loop->exec();
+}
+
+void EventLoopGroup::stop()
+{
+    std::vector<std::thread> threads;
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        for (const auto& loop : mLoops) {
+            if (loop)
+                loop->quit();
+        }
+        std::swap(threads, mThreads);
+    }
+    for (auto& thread : threads)
+        thread.join();
+
+    std::lock_guard<std::mutex> lock(mMutex);
+    mLoops.clear();
+    mStarted = 0;
+}
+
+int EventLoopGroup::count() const
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mLoops.size();
+}
+
+EventLoop::SharedPtr EventLoopGroup::loop(int idx) const
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    if (idx < 0 || idx >= static_cast<int>(mLoops.size()))
+        return EventLoop::SharedPtr();
+    return mLoops[idx];
+}
+
+EventLoop::SharedPtr EventLoopGroup::nextLoop(Balance balance)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    if (mLoops.empty())
+        return EventLoop::SharedPtr();
+    const size_t start = mNext++ % mLoops.size();
+    if (balance == LeastLoaded) {
+        // start where round robin would so ties, e.g. a burst of accepts
+        // that haven't registered their sockets yet, still get spread out
+        size_t best = start, bestCount = mLoops[start]->socketCount();
+        for (size_t i = 1; i < mLoops.size() && bestCount; ++i) {
+            const size_t idx = (start + i) % mLoops.size();
+            const size_t count = mLoops[idx]->socketCount();
+            if (count < bestCount) {
+                best = idx;
+                bestCount = count;
+            }
+        }
+        return mLoops[best];
+    }
+    return mLoops[start];
+}
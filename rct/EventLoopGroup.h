@@ -0,0 +1,57 @@
+#ifndef EventLoopGroup_h
+#define EventLoopGroup_h
+
+#include "EventLoop.h"
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A set of EventLoops, each running on a thread of its own. Hand work
+// (e.g. accepted connections, see SocketServer::setEventLoopGroup) to the
+// loop returned by nextLoop() to spread it over the cores.
+class EventLoopGroup
+{
+public:
+    typedef std::shared_ptr<EventLoopGroup> SharedPtr;
+    typedef std::weak_ptr<EventLoopGroup> WeakPtr;
+
+    EventLoopGroup();
+    ~EventLoopGroup();
+
+    enum Flag {
+        None = 0x0,
+        PinThreads = 0x1, // pin thread n to core n % cores (Linux only)
+        PinToNodes = 0x2 // pin thread n to the cores of NUMA node n % nodes (Linux only)
+    };
+    // count <= 0 means one loop per core
+    bool start(int count = 0, unsigned int flags = None);
+    // quits the loops and joins their threads
+    void stop();
+
+    int count() const;
+    EventLoop::SharedPtr loop(int idx) const;
+
+    enum Balance {
+        RoundRobin,
+        LeastLoaded // the loop with the fewest registered sockets
+    };
+    EventLoop::SharedPtr nextLoop(Balance balance = RoundRobin);
+
+private:
+    void run(int idx, unsigned int flags);
+
+private:
+    mutable std::mutex mMutex;
+    std::condition_variable mCond;
+    std::vector<EventLoop::SharedPtr> mLoops, mPending;
+    std::vector<std::thread> mThreads;
+    int mStarted;
+    unsigned int mNext;
+
+    EventLoopGroup(const EventLoopGroup&) = delete;
+    EventLoopGroup& operator=(const EventLoopGroup&) = delete;
+};
+
+#endif
@@ -0,0 +1,240 @@
+#include "FileHashCache.h"
+#include "DataFile.h"
+#include "rct-config.h"
+#include "FileSystemWatcher.h"
+#include "Rct.h"
+#include "ThreadPool.h"
+#include <sys/stat.h>
+#include <algorithm>
+
+static inline String fileKey(const struct stat &st)
+{
+    uint64_t key[5] = {
+        static_cast<uint64_t>(st.st_dev),
+        static_cast<uint64_t>(st.st_ino),
+#ifdef HAVE_STATMTIM
+        static_cast<uint64_t>(st.st_mtim.tv_sec),
+        static_cast<uint64_t>(st.st_mtim.tv_nsec),
+#else
+        static_cast<uint64_t>(st.st_mtime),
+        0,
+#endif
+        static_cast<uint64_t>(st.st_size)
+    };
+    return String(reinterpret_cast<const char *>(key), sizeof(key));
+}
+
+static inline String toHex(const String &digest)
+{
+    static const char *const hex = "0123456789abcdef";
+    String ret(digest.size() * 2, '\0');
+    char *out = ret.data();
+    for (int i=0; i<digest.size(); ++i) {
+        const unsigned char ch = digest.at(i);
+        *out++ = hex[ch >> 4];
+        *out++ = hex[ch & 0xf];
+    }
+    return ret;
+}
+
+// the raw digest of what path has now, empty if it couldn't be read or
+// changed while it was being read. key is what it was when it was read
+static String hashContents(const Path &path, String *key)
+{
+    struct stat st;
+    if (stat(path.constData(), &st) || !S_ISREG(st.st_mode))
+        return String();
+    const String digest = SHA256::hashFile(path, SHA256::Raw);
+    if (digest.isEmpty())
+        return String();
+    struct stat after;
+    if (stat(path.constData(), &after))
+        return String();
+    const String before = fileKey(st);
+    if (before != fileKey(after))
+        return String();
+    if (key)
+        *key = before;
+    return digest;
+}
+
+FileHashCache::FileHashCache()
+    : mWatcher(0), mWatcherKey(0)
+{
+}
+
+FileHashCache::~FileHashCache()
+{
+    setWatcher(0);
+}
+
+String FileHashCache::lookup(const Path &path)
+{
+    struct stat st;
+    if (stat(path.constData(), &st) || !S_ISREG(st.st_mode))
+        return String();
+    const String key = fileKey(st);
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        const Hash<String, String>::const_iterator it = mDigests.find(key);
+        if (it != mDigests.end()) {
+            mKeys[path] = key;
+            return it->second;
+        }
+    }
+
+    String readKey;
+    const String digest = hashContents(path, &readKey);
+    if (digest.isEmpty())
+        return String();
+    std::lock_guard<std::mutex> lock(mMutex);
+    String &old = mKeys[path];
+    if (!old.isEmpty() && old != readKey)
+        mDigests.remove(old);
+    old = readKey;
+    mDigests[readKey] = digest;
+    return digest;
+}
+
+String FileHashCache::hash(const Path &path, SHA256::MapType type)
+{
+    const String digest = lookup(path);
+    if (type == SHA256::Hex && !digest.isEmpty())
+        return toHex(digest);
+    return digest;
+}
+
+Future<String> FileHashCache::hashAsync(const Path &path, SHA256::MapType type, ThreadPool *pool)
+{
+    if (!pool)
+        pool = ThreadPool::instance();
+    return pool->submit([this, path, type]() { return hash(path, type); });
+}
+
+Hash<Path, String> FileHashCache::hash(const List<Path> &paths, SHA256::MapType type, ThreadPool *pool)
+{
+    if (!pool)
+        pool = ThreadPool::instance();
+    // a job for a few files each, hashing a small file is less work than
+    // handing it to another thread
+    enum { ChunkSize = 16 };
+    List<Future<void> > futures;
+    List<String> digests(paths.size());
+    for (int i=0; i<paths.size(); i+=ChunkSize) {
+        const int end = std::min<int>(i + ChunkSize, paths.size());
+        futures.append(pool->submit([this, &paths, &digests, type, i, end]() {
+                    for (int j=i; j<end; ++j)
+                        digests[j] = hash(paths.at(j), type);
+                }));
+    }
+    Hash<Path, String> ret;
+    ret.reserve(paths.size());
+    for (int i=0; i<paths.size(); ++i) {
+        if (i % ChunkSize == 0)
+            futures.at(i / ChunkSize).wait();
+        if (!digests.at(i).isEmpty())
+            ret[paths.at(i)] = digests.at(i);
+    }
+    return ret;
+}
+
+void FileHashCache::invalidate(const Path &path)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    if (!path.endsWith('/')) {
+        String key;
+        if (mKeys.remove(path, &key))
+            mDigests.remove(key);
+        return;
+    }
+    Hash<Path, String>::iterator it = mKeys.begin();
+    while (it != mKeys.end()) {
+        if (it->first.startsWith(path)) {
+            mDigests.remove(it->second);
+            it = mKeys.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+void FileHashCache::clear()
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    mDigests.clear();
+    mKeys.clear();
+}
+
+int FileHashCache::count() const
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mDigests.size();
+}
+
+void FileHashCache::setWatcher(FileSystemWatcher *watcher)
+{
+    if (mWatcher)
+        mWatcher->changed().disconnect(mWatcherKey);
+    mWatcher = watcher;
+    mWatcherKey = 0;
+    if (mWatcher) {
+        mWatcherKey = mWatcher->changed().connect([this](const FileSystemWatcher::Changes &changes) {
+                for (const Set<Path> *paths : { &changes.removed, &changes.modified, &changes.added }) {
+                    for (const Path &path : *paths)
+                        invalidate(path);
+                }
+            });
+    }
+}
+
+bool FileHashCache::save(const Path &file) const
+{
+    DataFile data(file, Version);
+    if (!data.open(DataFile::Write)) {
+        error("FileHashCache::save() failed to open %s %s", file.constData(), data.error().constData());
+        return false;
+    }
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        data.beginSection("digests");
+        data << mDigests;
+        data.beginSection("paths");
+        data << mKeys;
+    }
+    if (!data.flush()) {
+        error("FileHashCache::save() %s", data.error().constData());
+        return false;
+    }
+    return true;
+}
+
+bool FileHashCache::load(const Path &file)
+{
+    DataFile data(file, Version);
+    if (!data.open(DataFile::Read)) {
+        error("FileHashCache::load() failed to open %s %s", file.constData(), data.error().constData());
+        return false;
+    }
+    std::unique_ptr<Deserializer> digests = data.section("digests");
+    std::unique_ptr<Deserializer> paths = data.section("paths");
+    if (!digests || !paths) {
+        error("FileHashCache::load() %s is corrupted", file.constData());
+        return false;
+    }
+    Hash<String, String> loadedDigests;
+    Hash<Path, String> loadedKeys;
+    *digests >> loadedDigests;
+    *paths >> loadedKeys;
+    std::lock_guard<std::mutex> lock(mMutex);
+    mDigests.unite(loadedDigests);
+    mKeys.unite(loadedKeys);
+    return true;
+}
+
+String FileHashCache::hashFile(const Path &path, SHA256::MapType type)
+{
+    const String digest = hashContents(path, 0);
+    if (type == SHA256::Hex && !digest.isEmpty())
+        return toHex(digest);
+    return digest;
+}
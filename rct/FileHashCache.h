@@ -0,0 +1,71 @@
+#ifndef FileHashCache_h
+#define FileHashCache_h
+
+#include <rct/Future.h>
+#include <rct/Hash.h>
+#include <rct/List.h>
+#include <rct/Path.h>
+#include <rct/SHA256.h>
+#include <rct/SignalSlot.h>
+#include <rct/String.h>
+#include <mutex>
+
+class FileSystemWatcher;
+class ThreadPool;
+
+// SHA256 digests of files, remembered by the file's device, inode, mtime
+// and size so a file that hasn't changed isn't read again, even if it was
+// renamed. Files are hashed from a mapping a window at a time rather than
+// read into memory. The digests can be saved with save() and picked up by
+// the next process with load().
+//
+// Where mtime only has second resolution a file written twice in the same
+// second with the same size looks unchanged, setWatcher() takes care of
+// that by dropping what the watcher says changed.
+class FileHashCache
+{
+public:
+    enum { Version = 1 };
+
+    FileHashCache();
+    ~FileHashCache();
+
+    FileHashCache(const FileHashCache &) = delete;
+    FileHashCache &operator=(const FileHashCache &) = delete;
+
+    // empty if it can't be read
+    String hash(const Path &path, SHA256::MapType type = SHA256::Hex);
+    // on pool, ThreadPool::instance() by default
+    Future<String> hashAsync(const Path &path, SHA256::MapType type = SHA256::Hex, ThreadPool *pool = 0);
+    // all of them on pool, waits for them
+    Hash<Path, String> hash(const List<Path> &paths, SHA256::MapType type = SHA256::Hex, ThreadPool *pool = 0);
+
+    // a directory, ending with '/', takes everything under it
+    void invalidate(const Path &path);
+    void clear();
+    int count() const;
+
+    // changes watcher reports invalidate what they're about, 0 disconnects.
+    // The watcher has to outlive this or be unset first
+    void setWatcher(FileSystemWatcher *watcher);
+
+    bool save(const Path &file) const;
+    // adds to what's there
+    bool load(const Path &file);
+
+    // without the cache
+    static String hashFile(const Path &path, SHA256::MapType type = SHA256::Hex);
+private:
+    // the raw digest, or empty
+    String lookup(const Path &path);
+
+    mutable std::mutex mMutex;
+    // by device, inode, mtime and size, raw digests
+    Hash<String, String> mDigests;
+    // what each path was last seen as
+    Hash<Path, String> mKeys;
+    FileSystemWatcher *mWatcher;
+    unsigned int mWatcherKey;
+};
+
+#endif
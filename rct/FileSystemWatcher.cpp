@@ -1,7 +1,30 @@
 #include "FileSystemWatcher.h"
+#include "DataFile.h"
+#include "ThreadPool.h"
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <algorithm>
+
+void FileSystemWatcher::invalidateResolved(const Set<Path> &paths)
+{
+    if (!Path::isResolveCacheEnabled())
+        return;
+    for (const Path &path : paths)
+        Path::invalidateResolveCache(path);
+}
 
 void FileSystemWatcher::processChanges(const Changes &changes)
 {
+    if (changes.isEmpty())
+        return;
+
+    // before anyone hears of it and resolves something
+    invalidateResolved(changes.added);
+    invalidateResolved(changes.removed);
+
+    mChanged(changes);
+
     struct {
         Signal<std::function<void(const Path&)> > &signal;
         const Set<Path> &paths;
@@ -13,8 +36,279 @@ void FileSystemWatcher::processChanges(const Changes &changes)
 
     const unsigned int count = sizeof(signals) / sizeof(signals[0]);
     for (unsigned i=0; i<count; ++i) {
+        if (!signals[i].signal.isConnected())
+            continue;
         for (Set<Path>::const_iterator it = signals[i].paths.begin(); it != signals[i].paths.end(); ++it) {
             signals[i].signal(*it);
         }
     }
 }
+
+#if defined(HAVE_FSEVENTS) || defined(HAVE_CHANGENOTIFICATION)
+void FileSystemWatcher::queueChanges(Changes::Type type, const Set<Path> &paths)
+{
+    for (const Path &path : paths)
+        mPending.add(type, path);
+    if (mPendingQueued)
+        return;
+    // the added, removed and modified of one batch are posted one after
+    // the other, this runs after all of them
+    mPendingQueued = true;
+    const std::weak_ptr<bool> alive = mAlive;
+    EventLoop::eventLoop()->callLater([this, alive]() {
+            if (alive.expired())
+                return;
+            mPendingQueued = false;
+            Changes changes;
+            std::swap(changes, mPending);
+            processChanges(changes);
+        });
+}
+#endif
+
+#if defined(HAVE_FSEVENTS) || defined(HAVE_CHANGENOTIFICATION)
+int FileSystemWatcher::watchedCount() const
+{
+    return watchedPaths().size();
+}
+
+void FileSystemWatcher::forEachWatchedPath(const std::function<bool(const Path &)> &func) const
+{
+    for (const Path &path : watchedPaths()) {
+        if (!func(path))
+            break;
+    }
+}
+#else
+Set<Path> FileSystemWatcher::watchedPaths() const
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    Set<Path> ret;
+    for (const auto &it : mWatchedByPath)
+        ret.insert(it.first);
+    return ret;
+}
+
+int FileSystemWatcher::watchedCount() const
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mWatchedByPath.size();
+}
+
+void FileSystemWatcher::forEachWatchedPath(const std::function<bool(const Path &)> &func) const
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    for (const auto &it : mWatchedByPath) {
+        if (!func(it.first))
+            break;
+    }
+}
+#endif
+
+namespace {
+struct Entry
+{
+    uint64_t ino, mtime, size;
+    bool isDir;
+
+    // a directory's mtime changes with what's in it, which is its own
+    // entries' business
+    bool operator!=(const Entry &other) const
+    {
+        if (ino != other.ino || isDir != other.isDir)
+            return true;
+        return !isDir && (mtime != other.mtime || size != other.size);
+    }
+};
+
+// a watched path and, for a directory, what's in it
+struct Scan
+{
+    Path path;
+    bool exists;
+    Entry self;
+    Hash<String, Entry> entries;
+};
+
+inline Serializer &operator<<(Serializer &s, const Entry &entry)
+{
+    s << entry.ino << entry.mtime << entry.size << static_cast<uint8_t>(entry.isDir);
+    return s;
+}
+
+inline Deserializer &operator>>(Deserializer &s, Entry &entry)
+{
+    uint8_t isDir;
+    s >> entry.ino >> entry.mtime >> entry.size >> isDir;
+    entry.isDir = isDir;
+    return s;
+}
+
+inline Serializer &operator<<(Serializer &s, const Scan &scan)
+{
+    s << scan.path << static_cast<uint8_t>(scan.exists) << scan.self << scan.entries;
+    return s;
+}
+
+inline Deserializer &operator>>(Deserializer &s, Scan &scan)
+{
+    uint8_t exists;
+    s >> scan.path >> exists >> scan.self >> scan.entries;
+    scan.exists = exists;
+    return s;
+}
+
+inline Entry toEntry(const struct stat &st)
+{
+    Entry entry;
+    entry.ino = st.st_ino;
+#ifdef HAVE_STATMTIM
+    entry.mtime = st.st_mtim.tv_sec * static_cast<uint64_t>(1000000000) + st.st_mtim.tv_nsec;
+#else
+    entry.mtime = st.st_mtime * static_cast<uint64_t>(1000000000);
+#endif
+    entry.size = st.st_size;
+    entry.isDir = S_ISDIR(st.st_mode);
+    return entry;
+}
+
+void scanPath(Scan &scan)
+{
+    struct stat st;
+    scan.exists = !lstat(scan.path.constData(), &st);
+    if (!scan.exists)
+        return;
+    scan.self = toEntry(st);
+    if (!scan.self.isDir)
+        return;
+    if (!scan.path.endsWith('/'))
+        scan.path.append('/');
+    DIR *dir = opendir(scan.path.constData());
+    if (!dir)
+        return;
+    const int fd = dirfd(dir);
+    while (const dirent *ent = readdir(dir)) {
+        if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, ".."))
+            continue;
+        if (!fstatat(fd, ent->d_name, &st, AT_SYMLINK_NOFOLLOW))
+            scan.entries[ent->d_name] = toEntry(st);
+    }
+    closedir(dir);
+}
+
+// in chunks on the ThreadPool, a directory listing is mostly waiting for
+// the disk
+void scanPaths(List<Scan> &scans)
+{
+    enum { ChunkSize = 32 };
+    List<Future<void> > futures;
+    for (int i=ChunkSize; i<scans.size(); i+=ChunkSize) {
+        const int end = std::min<int>(i + ChunkSize, scans.size());
+        futures.append(ThreadPool::instance()->submit([&scans, i, end]() {
+                    for (int j=i; j<end; ++j)
+                        scanPath(scans[j]);
+                }));
+    }
+    for (int i=0; i<std::min<int>(ChunkSize, scans.size()); ++i)
+        scanPath(scans[i]);
+    for (const Future<void> &future : futures)
+        future.wait();
+}
+
+void compare(const Scan &before, const Scan &now, FileSystemWatcher::Changes &changes)
+{
+    typedef FileSystemWatcher::Changes Changes;
+    if (before.exists != now.exists) {
+        const Changes::Type type = now.exists ? Changes::Add : Changes::Remove;
+        const Scan &scan = now.exists ? now : before;
+        changes.add(type, scan.path);
+        for (const auto &entry : scan.entries)
+            changes.add(type, scan.path + entry.first);
+        return;
+    }
+    if (!now.exists)
+        return;
+    if (!now.self.isDir || !before.self.isDir) {
+        if (before.self != now.self)
+            changes.add(Changes::Modified, now.path);
+        return;
+    }
+    for (const auto &entry : before.entries) {
+        const Hash<String, Entry>::const_iterator it = now.entries.find(entry.first);
+        if (it == now.entries.end()) {
+            changes.add(Changes::Remove, now.path + entry.first);
+        } else if (it->second != entry.second) {
+            changes.add(Changes::Modified, now.path + entry.first);
+        }
+    }
+    for (const auto &entry : now.entries) {
+        if (!before.entries.contains(entry.first))
+            changes.add(Changes::Add, now.path + entry.first);
+    }
+}
+}
+
+bool FileSystemWatcher::saveSnapshot(const Path &file) const
+{
+    List<Scan> scans;
+    forEachWatchedPath([&scans](const Path &path) {
+            scans.append(Scan());
+            scans.back().path = path;
+            return true;
+        });
+    scanPaths(scans);
+
+    DataFile data(file, SnapshotVersion);
+    if (!data.open(DataFile::Write)) {
+        error("FileSystemWatcher::saveSnapshot() failed to open %s %s", file.constData(), data.error().constData());
+        return false;
+    }
+    data.beginSection("paths");
+    data << scans;
+#ifdef HAVE_FSEVENTS
+    data.beginSection("fsevents");
+    data << eventId();
+#endif
+    if (!data.flush()) {
+        error("FileSystemWatcher::saveSnapshot() %s", data.error().constData());
+        return false;
+    }
+    return true;
+}
+
+bool FileSystemWatcher::loadSnapshot(const Path &file, Changes *changes)
+{
+    DataFile data(file, SnapshotVersion);
+    if (!data.open(DataFile::Read)) {
+        error("FileSystemWatcher::loadSnapshot() failed to open %s %s", file.constData(), data.error().constData());
+        return false;
+    }
+#ifdef HAVE_FSEVENTS
+    if (std::unique_ptr<Deserializer> deserializer = data.section("fsevents")) {
+        // the stream replays what happened since
+        uint64_t id;
+        *deserializer >> id;
+        setEventId(id);
+        return true;
+    }
+#endif
+    std::unique_ptr<Deserializer> deserializer = data.section("paths");
+    if (!deserializer) {
+        error("FileSystemWatcher::loadSnapshot() %s is corrupted", file.constData());
+        return false;
+    }
+    List<Scan> before;
+    *deserializer >> before;
+    List<Scan> now(before.size());
+    for (int i=0; i<before.size(); ++i)
+        now[i].path = before.at(i).path;
+    scanPaths(now);
+
+    Changes local;
+    Changes &ret = changes ? *changes : local;
+    for (int i=0; i<before.size(); ++i)
+        compare(before.at(i), now.at(i), ret);
+    if (!changes)
+        processChanges(local);
+    return true;
+}
@@ -3,6 +3,7 @@
 
 #include "rct-config.h"
 #include <rct/Path.h>
+#include <rct/Hash.h>
 #include <rct/Map.h>
 #include <rct/Set.h>
 #include <rct/SignalSlot.h>
@@ -28,20 +29,75 @@ class WatcherData;
 class FileSystemWatcher
 {
 public:
-    FileSystemWatcher();
+    enum Flag {
+        None = 0x0,
+        // Linux, one fanotify mark for each file system instead of a watch
+        // for each directory, so there's no limit on how many are watched.
+        // Needs CAP_SYS_ADMIN, without it or where the file system can't
+        // this falls back to inotify
+        WholeFileSystem = 0x1
+    };
+    FileSystemWatcher(unsigned int flags = None);
     ~FileSystemWatcher();
 
     bool watch(const Path &path);
     bool unwatch(const Path &path);
+
+    // what changed since the last time, deduplicated, so a path created and
+    // removed again in between isn't in it at all
+    struct Changes
+    {
+        enum Type {
+            Add,
+            Remove,
+            Modified
+        };
+        void add(Type type, const Path &path)
+        {
+            switch (type) {
+            case Add:
+                if (!removed.remove(path))
+                    added.insert(path);
+                break;
+            case Remove:
+                if (!added.remove(path))
+                    removed.insert(path);
+                break;
+            case Modified:
+                modified.insert(path);
+                break;
+            }
+        }
+        bool isEmpty() const { return added.isEmpty() && removed.isEmpty() && modified.isEmpty(); }
+        Set<Path> added, removed, modified;
+    };
+    // once for each batch of changes, a checkout touching thousands of
+    // files is one call rather than thousands
+    Signal<std::function<void(const Changes &)> > &changed() { return mChanged; }
+
+    // once for each path, nothing is done for these unless something is
+    // connected
     Signal<std::function<void(const Path &)> > &removed() { return mRemoved; }
     Signal<std::function<void(const Path &)> > &added() { return mAdded; }
     Signal<std::function<void(const Path &)> > &modified() { return mModified; }
     void clear();
-#if defined(HAVE_FSEVENTS) || defined(HAVE_CHANGENOTIFICATION)
+    // a copy, see forEachWatchedPath() for walking a lot of them
     Set<Path> watchedPaths() const;
-#else
-    Set<Path> watchedPaths() const { return mWatchedByPath.keys().toSet(); } // ### slow
-#endif
+    int watchedCount() const;
+    // until func returns false. Don't watch() or unwatch() from it
+    void forEachWatchedPath(const std::function<bool(const Path &)> &func) const;
+
+    // Snapshots let a process that was down find out what changed without
+    // walking everything again. saveSnapshot() writes what's watched and
+    // what's in the watched directories, with inode, mtime and size, to a
+    // DataFile. loadSnapshot() compares that to what's there now, the
+    // directories on ThreadPool workers, and reports the difference with
+    // changed() and the other signals, or in changes if that's given. With
+    // FSEvents the event id is saved as well and loadSnapshot() resumes the
+    // stream from there instead, call it before watch()
+    enum { SnapshotVersion = 1 };
+    bool saveSnapshot(const Path &file) const;
+    bool loadSnapshot(const Path &file, Changes *changes = 0);
 private:
 #if defined(HAVE_FSEVENTS) || defined(HAVE_CHANGENOTIFICATION)
     WatcherData* mWatcher;
@@ -49,18 +105,53 @@ private:
     void pathsAdded(const Set<Path>& paths);
     void pathsRemoved(const Set<Path>& paths);
     void pathsModified(const Set<Path>& paths);
+    // what the paths*() functions got, emitted together once the loop
+    // gets to it
+    void queueChanges(Changes::Type type, const Set<Path> &paths);
+    Changes mPending;
+    bool mPendingQueued;
+    // what's posted to the loop holds on to a weak_ptr to this and does
+    // nothing once we're gone
+    std::shared_ptr<bool> mAlive;
 #if !defined(HAVE_CHANGENOTIFICATION) // only for HAVE_FSEVENTS
     bool isWatching(const Path& path) const;
+    // the last event seen, or the current one if none
+    uint64_t eventId() const;
+    // where the stream starts the next time it's created
+    void setEventId(uint64_t id);
 #endif
 #else
 #if defined(HAVE_INOTIFY)
     Timer mTimer;
 #endif
-    std::mutex mMutex;
+    mutable std::mutex mMutex;
     void notifyReadyRead();
     int mFd;
-    Map<Path, int> mWatchedByPath;
-    Map<int, Path> mWatchedById;
+    // -1 for what's covered by fanotify
+    Hash<Path, int> mWatchedByPath;
+    Hash<int, Path> mWatchedById;
+
+#ifdef HAVE_FANOTIFY
+    bool fanotifyWatch(const Path &path);
+    void fanotifyUnwatch(const Path &path);
+    void fanotifyRead(Changes &changes);
+    // a directory by what events identify it with, its file system id and
+    // file handle
+    static String fanotifyKey(const Path &dir);
+    // directories that are watched or have something watched in them,
+    // refs is how many
+    struct FanotifyDir {
+        Path path;
+        int refs;
+    };
+    int mFanotifyFd;
+    Hash<String, FanotifyDir> mFanotifyDirs;
+    // for each watched path its own key, if it's a directory, and its
+    // parent's
+    Hash<Path, std::pair<String, String> > mFanotifyKeys;
+    // devices with a mark
+    Set<uint64_t> mFanotifyMarked;
+#endif
 
 #ifdef HAVE_KQUEUE
     Map<Path, uint64_t> mTimes;
@@ -71,31 +162,10 @@ private:
 #endif
 #endif
     Signal<std::function<void(const Path&)> > mRemoved, mModified, mAdded;
+    Signal<std::function<void(const Changes &)> > mChanged;
 
-    struct Changes {
-        enum Type {
-            Add,
-            Remove,
-            Modified
-        };
-        void add(Type type, const Path &path)
-        {
-            switch (type) {
-            case Add:
-                if (!removed.remove(path))
-                    added.insert(path);
-                break;
-            case Remove:
-                if (!added.remove(path))
-                    removed.insert(path);
-                break;
-            case Modified:
-                modified.insert(path);
-                break;
-            }
-        }
-        Set<Path> added, removed, modified;
-    };
     void processChanges(const Changes &changes);
+    // drops them from Path's resolve cache
+    static void invalidateResolved(const Set<Path> &paths);
 };
 #endif
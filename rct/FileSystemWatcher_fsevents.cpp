@@ -246,12 +246,16 @@ void WatcherData::notifyCallback(ConstFSEventStreamRef streamRef,
 
     FileSystemWatcher *fsWatcher = watcher->watcher;
     if (changes->added.size() || changes->removed.size() || changes->modified.size()) {
-        EventLoop::eventLoop()->callLater([changes, fsWatcher] { fsWatcher->processChanges(*changes); });
+        const std::weak_ptr<bool> alive = fsWatcher->mAlive;
+        EventLoop::eventLoop()->callLater([changes, fsWatcher, alive] {
+                if (!alive.expired())
+                    fsWatcher->processChanges(*changes);
+            });
     }
 }
 
-FileSystemWatcher::FileSystemWatcher()
-    : mWatcher(new WatcherData(this))
+FileSystemWatcher::FileSystemWatcher(unsigned int)
+    : mWatcher(new WatcherData(this)), mPendingQueued(false), mAlive(std::make_shared<bool>(true))
 {
     mWatcher->waitForStarted();
 }
@@ -321,21 +325,29 @@ bool FileSystemWatcher::unwatch(const Path &p)
 
 void FileSystemWatcher::pathsAdded(const Set<Path>& paths)
 {
-    for (const Path& path : paths) {
-        mAdded(path);
-    }
+    queueChanges(Changes::Add, paths);
 }
 
 void FileSystemWatcher::pathsRemoved(const Set<Path>& paths)
 {
-    for (const Path& path : paths) {
-        mRemoved(path);
-    }
+    queueChanges(Changes::Remove, paths);
 }
 
 void FileSystemWatcher::pathsModified(const Set<Path>& paths)
 {
-    for (const Path& path : paths) {
-        mModified(path);
-    }
+    queueChanges(Changes::Modified, paths);
+}
+
+uint64_t FileSystemWatcher::eventId() const
+{
+    std::lock_guard<std::mutex> lock(mWatcher->mutex);
+    if (mWatcher->since == kFSEventStreamEventIdSinceNow)
+        return FSEventsGetCurrentEventId();
+    return mWatcher->since;
+}
+
+void FileSystemWatcher::setEventId(uint64_t id)
+{
+    std::lock_guard<std::mutex> lock(mWatcher->mutex);
+    mWatcher->since = id;
 }
@@ -6,8 +6,15 @@
 #include <sys/ioctl.h>
 #include "Rct.h"
 #include <errno.h>
+#ifdef HAVE_FANOTIFY
+#include <fcntl.h>
+#include <string.h>
+#include <sys/fanotify.h>
+#include <sys/stat.h>
+#include <sys/statfs.h>
+#endif
 
-FileSystemWatcher::FileSystemWatcher()
+FileSystemWatcher::FileSystemWatcher(unsigned int flags)
 {
     mTimer.timeout().connect([this](Timer *) {
             notifyReadyRead(); });
@@ -15,26 +22,57 @@ FileSystemWatcher::FileSystemWatcher()
     mFd = inotify_init();
     assert(mFd != -1);
     EventLoop::eventLoop()->registerSocket(mFd, EventLoop::SocketRead, [this](int, unsigned int) {
-            mTimer.restart(10, Timer::SingleShot);
+            mTimer.debounce(10);
         });
+#ifdef HAVE_FANOTIFY
+    mFanotifyFd = -1;
+    if (flags & WholeFileSystem) {
+        mFanotifyFd = fanotify_init(FAN_CLASS_NOTIF | FAN_REPORT_DFID_NAME | FAN_UNLIMITED_QUEUE | FAN_CLOEXEC | FAN_NONBLOCK,
+                                    O_RDONLY | O_LARGEFILE);
+        if (mFanotifyFd == -1) {
+            debug("FileSystemWatcher: fanotify_init failed, using inotify (%d) %s",
+                  errno, Rct::strerror().constData());
+        } else {
+            EventLoop::eventLoop()->registerSocket(mFanotifyFd, EventLoop::SocketRead, [this](int, unsigned int) {
+                    mTimer.debounce(10);
+                });
+        }
+    }
+#else
+    (void)flags;
+#endif
 }
 
 FileSystemWatcher::~FileSystemWatcher()
 {
     EventLoop::eventLoop()->unregisterSocket(mFd);
-    for (Map<Path, int>::const_iterator it = mWatchedByPath.begin(); it != mWatchedByPath.end(); ++it) {
-        inotify_rm_watch(mFd, it->second);
+    for (Hash<Path, int>::const_iterator it = mWatchedByPath.begin(); it != mWatchedByPath.end(); ++it) {
+        if (it->second != -1)
+            inotify_rm_watch(mFd, it->second);
     }
     close(mFd);
+#ifdef HAVE_FANOTIFY
+    if (mFanotifyFd != -1) {
+        EventLoop::eventLoop()->unregisterSocket(mFanotifyFd);
+        close(mFanotifyFd);
+    }
+#endif
 }
 
 void FileSystemWatcher::clear()
 {
-    for (Map<Path, int>::const_iterator it = mWatchedByPath.begin(); it != mWatchedByPath.end(); ++it) {
-        inotify_rm_watch(mFd, it->second);
+    std::lock_guard<std::mutex> lock(mMutex);
+    for (Hash<Path, int>::const_iterator it = mWatchedByPath.begin(); it != mWatchedByPath.end(); ++it) {
+        if (it->second != -1)
+            inotify_rm_watch(mFd, it->second);
     }
     mWatchedByPath.clear();
     mWatchedById.clear();
+#ifdef HAVE_FANOTIFY
+    // the marks stay, there's just nothing to match events against
+    mFanotifyDirs.clear();
+    mFanotifyKeys.clear();
+#endif
 }
 
 bool FileSystemWatcher::watch(const Path &p)
@@ -63,6 +101,12 @@ bool FileSystemWatcher::watch(const Path &p)
     if (mWatchedByPath.contains(path)) {
         return false;
     }
+#ifdef HAVE_FANOTIFY
+    if (mFanotifyFd != -1 && fanotifyWatch(path)) {
+        mWatchedByPath[path] = -1;
+        return true;
+    }
+#endif
     const int ret = inotify_add_watch(mFd, path.nullTerminated(), flags);
     if (ret == -1) {
         error("FileSystemWatcher::watch() watch failed for '%s' (%d) %s",
@@ -81,6 +125,12 @@ bool FileSystemWatcher::unwatch(const Path &path)
     int wd = -1;
     if (mWatchedByPath.remove(path, &wd)) {
         debug("FileSystemWatcher::unwatch(\"%s\")", path.constData());
+#ifdef HAVE_FANOTIFY
+        if (wd == -1) {
+            fanotifyUnwatch(path);
+            return true;
+        }
+#endif
         mWatchedById.remove(wd);
         inotify_rm_watch(mFd, wd);
         return true;
@@ -131,43 +181,226 @@ void FileSystemWatcher::notifyReadyRead()
         std::lock_guard<std::mutex> lock(mMutex);
         int s = 0;
         ioctl(mFd, FIONREAD, &s);
-        if (!s)
-            return;
-        enum { StaticBufSize = 4096 };
-        char staticBuf[StaticBufSize];
-        char *buf = s > StaticBufSize ? new char[s] : staticBuf;
-        const int read = ::read(mFd, buf, s);
-        int idx = 0;
-        while (idx < read) {
-            inotify_event *event = reinterpret_cast<inotify_event*>(buf + idx);
-            idx += sizeof(inotify_event) + event->len;
-            Path path = mWatchedById.value(event->wd);
-            // if (event->mask) {
-            //     printf("%s [%s]", path.constData(), event->name);
-            //     dump(event->mask);
-            //     printf("\n");
-            // }
-
-            const bool isDir = path.isDir();
-
-            if (event->mask & (IN_DELETE_SELF|IN_MOVE_SELF|IN_UNMOUNT)) {
-                changes.add(Changes::Remove, path);
-            } else if (event->mask & (IN_CREATE|IN_MOVED_TO)) {
-                if (isDir)
-                    path.append(event->name);
-                changes.add(Changes::Add, path);
-            } else if (event->mask & (IN_DELETE|IN_MOVED_FROM)) {
-                if (isDir)
-                    path.append(event->name);
-                changes.add(Changes::Remove, path);
-            } else if (event->mask & (IN_ATTRIB|IN_CLOSE_WRITE)) {
-                if (isDir)
-                    path.append(event->name);
-                changes.add(Changes::Modified, path);
+        if (s) {
+            enum { StaticBufSize = 4096 };
+            char staticBuf[StaticBufSize];
+            char *buf = s > StaticBufSize ? new char[s] : staticBuf;
+            const int read = ::read(mFd, buf, s);
+            int idx = 0;
+            while (idx < read) {
+                inotify_event *event = reinterpret_cast<inotify_event*>(buf + idx);
+                idx += sizeof(inotify_event) + event->len;
+                Path path = mWatchedById.value(event->wd);
+                // if (event->mask) {
+                //     printf("%s [%s]", path.constData(), event->name);
+                //     dump(event->mask);
+                //     printf("\n");
+                // }
+
+                const bool isDir = path.isDir();
+
+                if (event->mask & (IN_DELETE_SELF|IN_MOVE_SELF|IN_UNMOUNT)) {
+                    changes.add(Changes::Remove, path);
+                } else if (event->mask & (IN_CREATE|IN_MOVED_TO)) {
+                    if (isDir)
+                        path.append(event->name);
+                    changes.add(Changes::Add, path);
+                } else if (event->mask & (IN_DELETE|IN_MOVED_FROM)) {
+                    if (isDir)
+                        path.append(event->name);
+                    changes.add(Changes::Remove, path);
+                } else if (event->mask & (IN_ATTRIB|IN_CLOSE_WRITE)) {
+                    if (isDir)
+                        path.append(event->name);
+                    changes.add(Changes::Modified, path);
+                }
             }
+            if (buf != staticBuf)
+                delete []buf;
         }
-        if (buf != staticBuf)
-            delete []buf;
+#ifdef HAVE_FANOTIFY
+        if (mFanotifyFd != -1)
+            fanotifyRead(changes);
+#endif
     }
     processChanges(changes);
 }
+
+#ifdef HAVE_FANOTIFY
+static inline String handleKey(const void *fsid, int type, const void *handle, unsigned int size)
+{
+    String key(static_cast<const char *>(fsid), sizeof(fsid_t));
+    key.append(reinterpret_cast<const char *>(&type), sizeof(type));
+    key.append(static_cast<const char *>(handle), size);
+    return key;
+}
+
+String FileSystemWatcher::fanotifyKey(const Path &dir)
+{
+    struct statfs fs;
+    if (statfs(dir.constData(), &fs))
+        return String();
+    alignas(file_handle) char buf[sizeof(file_handle) + MAX_HANDLE_SZ];
+    file_handle *handle = reinterpret_cast<file_handle *>(buf);
+    handle->handle_bytes = MAX_HANDLE_SZ;
+    int mountId;
+    if (name_to_handle_at(AT_FDCWD, dir.constData(), handle, &mountId, 0))
+        return String();
+    return handleKey(&fs.f_fsid, handle->handle_type, handle->f_handle, handle->handle_bytes);
+}
+
+bool FileSystemWatcher::fanotifyWatch(const Path &path)
+{
+    struct stat st;
+    if (stat(path.constData(), &st))
+        return false;
+    if (!mFanotifyMarked.contains(st.st_dev)) {
+        const uint64_t mask = (FAN_CREATE | FAN_DELETE | FAN_MOVED_FROM | FAN_MOVED_TO | FAN_DELETE_SELF
+                               | FAN_MOVE_SELF | FAN_ATTRIB | FAN_CLOSE_WRITE | FAN_ONDIR);
+        if (fanotify_mark(mFanotifyFd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM, mask, AT_FDCWD, path.constData())) {
+            debug("FileSystemWatcher::watch() fanotify_mark failed for '%s', using inotify (%d) %s",
+                  path.constData(), errno, Rct::strerror().constData());
+            return false;
+        }
+        mFanotifyMarked.insert(st.st_dev);
+    }
+
+    // changes to what's in a directory come with the directory's handle,
+    // changes to the directory or file itself with its parent's
+    const bool isDir = path.endsWith('/');
+    const Path parent = path.parentDir();
+    std::pair<String, String> keys;
+    if (isDir && (keys.first = fanotifyKey(path)).isEmpty())
+        return false;
+    if (!parent.isEmpty() && (keys.second = fanotifyKey(parent)).isEmpty())
+        return false;
+    if (!isDir && keys.second.isEmpty())
+        return false;
+
+    const std::pair<const String *, const Path *> refs[] = {
+        std::make_pair(&keys.first, &path),
+        std::make_pair(&keys.second, &parent)
+    };
+    for (const auto &ref : refs) {
+        if (ref.first->isEmpty())
+            continue;
+        FanotifyDir &dir = mFanotifyDirs[*ref.first];
+        if (!dir.refs++)
+            dir.path = *ref.second;
+    }
+    mFanotifyKeys[path] = keys;
+    return true;
+}
+
+void FileSystemWatcher::fanotifyUnwatch(const Path &path)
+{
+    std::pair<String, String> keys;
+    if (!mFanotifyKeys.remove(path, &keys))
+        return;
+    for (const String *key : { &keys.first, &keys.second }) {
+        Hash<String, FanotifyDir>::iterator it = mFanotifyDirs.find(*key);
+        if (it != mFanotifyDirs.end() && !--it->second.refs)
+            mFanotifyDirs.erase(it);
+    }
+    // the marks stay until the watcher goes, there may be more later
+}
+
+void FileSystemWatcher::fanotifyRead(Changes &changes)
+{
+    enum { Created = 0x1, Removed = 0x2, Modified = 0x4 };
+    auto report = [&changes](const Path &path, unsigned int what) {
+        if (what & Created)
+            changes.add(Changes::Add, path);
+        if (what & Modified)
+            changes.add(Changes::Modified, path);
+        if (what & Removed)
+            changes.add(Changes::Remove, path);
+    };
+
+    // names aren't padded, so nothing after the first event is aligned
+    // and it's all copied out
+    char buf[8192];
+    while (true) {
+        ssize_t len;
+        eintrwrap(len, ::read(mFanotifyFd, buf, sizeof(buf)));
+        if (len <= 0) // EAGAIN, it's non-blocking
+            break;
+        const char *pos = buf;
+        const char *const bufEnd = buf + len;
+        while (pos + sizeof(fanotify_event_metadata) <= bufEnd) {
+            fanotify_event_metadata event;
+            memcpy(&event, pos, sizeof(event));
+            if (event.vers != FANOTIFY_METADATA_VERSION) {
+                error("FileSystemWatcher: unexpected fanotify version %d", event.vers);
+                return;
+            }
+            if (event.event_len < sizeof(event) || pos + event.event_len > bufEnd)
+                break;
+            const char *info = pos + event.metadata_len;
+            const char *const end = pos + event.event_len;
+            pos = end;
+            if (event.fd >= 0)
+                close(event.fd);
+            if (event.mask & FAN_Q_OVERFLOW) {
+                warning("FileSystemWatcher: fanotify queue overflow, events were lost");
+                continue;
+            }
+
+            unsigned int what = 0;
+            if (event.mask & (FAN_CREATE | FAN_MOVED_TO))
+                what |= Created;
+            if (event.mask & (FAN_DELETE | FAN_MOVED_FROM | FAN_DELETE_SELF | FAN_MOVE_SELF))
+                what |= Removed;
+            if (event.mask & (FAN_ATTRIB | FAN_CLOSE_WRITE))
+                what |= Modified;
+
+            // fanotify_event_info_fid, the fsid and a file_handle
+            const size_t handleOffset = sizeof(fanotify_event_info_header) + sizeof(fsid_t);
+            while (info + handleOffset + sizeof(file_handle) <= end) {
+                fanotify_event_info_header header;
+                memcpy(&header, info, sizeof(header));
+                if (!header.len)
+                    break;
+                const char *record = info;
+                info += header.len;
+                if (header.info_type != FAN_EVENT_INFO_TYPE_DFID_NAME && header.info_type != FAN_EVENT_INFO_TYPE_DFID)
+                    continue;
+                file_handle handle;
+                memcpy(&handle, record + handleOffset, sizeof(handle));
+                const char *handleBytes = record + handleOffset + sizeof(file_handle);
+                if (handleBytes + handle.handle_bytes > info)
+                    continue;
+                const String key = handleKey(record + sizeof(fanotify_event_info_header), handle.handle_type,
+                                             handleBytes, handle.handle_bytes);
+                const Hash<String, FanotifyDir>::const_iterator dir = mFanotifyDirs.find(key);
+                if (dir == mFanotifyDirs.end())
+                    continue; // something nobody watches
+                const Path &dirPath = dir->second.path;
+                const char *name = 0;
+                if (header.info_type == FAN_EVENT_INFO_TYPE_DFID_NAME) {
+                    name = handleBytes + handle.handle_bytes;
+                    if (!strcmp(name, "."))
+                        name = 0;
+                }
+
+                if (!name) {
+                    // the directory itself
+                    if (mWatchedByPath.contains(dirPath))
+                        report(dirPath, what & ~Created);
+                    continue;
+                }
+                const Path path = dirPath + name;
+                // as inotify would say it, the directory's watch for what's
+                // in it and the file's or the directory's own for the rest
+                if (mWatchedByPath.contains(dirPath))
+                    report(path, what);
+                if (mWatchedByPath.contains(path))
+                    report(path, what & ~Created);
+                const Path asDir = path + '/';
+                if (mWatchedByPath.contains(asDir))
+                    report(asDir, what & ~Created);
+            }
+        }
+    }
+}
+#endif
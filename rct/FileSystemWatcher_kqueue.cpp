@@ -10,7 +10,7 @@
 #include <fcntl.h>
 #include <errno.h>
 
-FileSystemWatcher::FileSystemWatcher()
+FileSystemWatcher::FileSystemWatcher(unsigned int)
 {
     mFd = kqueue();
     assert(mFd != -1);
@@ -23,7 +23,7 @@ FileSystemWatcher::~FileSystemWatcher()
     struct timespec nullts = { 0, 0 };
 
     EventLoop::eventLoop()->unregisterSocket(mFd);
-    for (Map<Path, int>::const_iterator it = mWatchedByPath.begin(); it != mWatchedByPath.end(); ++it) {
+    for (Hash<Path, int>::const_iterator it = mWatchedByPath.begin(); it != mWatchedByPath.end(); ++it) {
         EV_SET(&change, it->second, EVFILT_VNODE, EV_DELETE, 0, 0, 0);
         if (::kevent(mFd, &change, 1, 0, 0, &nullts) == -1) {
             // bad stuff
@@ -108,8 +108,8 @@ void FileSystemWatcher::clear()
     changes.resize(mWatchedById.size());
 
     int pos = 0;
-    Map<int, Path>::const_iterator it = mWatchedById.begin();
-    const Map<int, Path>::const_iterator end = mWatchedById.end();
+    Hash<int, Path>::const_iterator it = mWatchedById.begin();
+    const Hash<int, Path>::const_iterator end = mWatchedById.end();
     while (it != end) {
         EV_SET(&changes[pos++], it->first, EVFILT_VNODE, EV_DELETE, 0, 0, 0);
         ::close(it->first);
@@ -285,27 +285,19 @@ void FileSystemWatcher::notifyReadyRead()
                     //printf("after updateFiles, added %d, modified %d, removed %d\n",
                     //       data.added.size(), data.modified.size(), data.all.size());
 
-                    lock.unlock();
-                    struct {
-                        Signal<std::function<void(const Path&)> > &signal;
-                        const Set<Path> &paths;
-                    } signals[] = {
-                        { mModified, data.modified },
-                        { mAdded, data.added }
-                    };
-                    const unsigned int count = sizeof(signals) / sizeof(signals[0]);
-                    for (unsigned i=0; i<count; ++i) {
-                        for (Set<Path>::const_iterator it = signals[i].paths.begin(); it != signals[i].paths.end(); ++it) {
-                            signals[i].signal(*it);
-                        }
-                    }
                 }
 
                 if (lock.owns_lock())
                     lock.unlock();
-                for (Set<Path>::const_iterator it = data.all.begin(); it != data.all.end(); ++it) {
-                    mRemoved(*it);
-                }
+                // like inotify, changed() and then the signals for each path
+                Changes changes;
+                changes.added = std::move(data.added);
+                changes.modified = std::move(data.modified);
+                changes.removed = std::move(data.all);
+                data.added.clear();
+                data.modified.clear();
+                data.all.clear();
+                processChanges(changes);
             }
         }
     }
@@ -278,12 +278,28 @@ void WatcherData::run()
                 }
 
                 //printf("hei, removed %u, added %u, changed %u\n", removed.size(), data.added.size(), data.changed.size());
-                if (!removed.empty())
-                    EventLoop::mainEventLoop()->callLaterMove(std::bind(&FileSystemWatcher::pathsRemoved, watcher, std::placeholders::_1), std::move(removed));
-                if (!data.added.empty())
-                    EventLoop::mainEventLoop()->callLaterMove(std::bind(&FileSystemWatcher::pathsAdded, watcher, std::placeholders::_1), std::move(data.added));
-                if (!data.changed.empty())
-                    EventLoop::mainEventLoop()->callLaterMove(std::bind(&FileSystemWatcher::pathsModified, watcher, std::placeholders::_1), std::move(data.changed));
+                FileSystemWatcher* w = watcher;
+                const std::weak_ptr<bool> alive = w->mAlive;
+                if (!removed.empty()) {
+                    EventLoop::mainEventLoop()->callLater([w, alive, removed]() {
+                            if (!alive.expired())
+                                w->pathsRemoved(removed);
+                        });
+                }
+                if (!data.added.empty()) {
+                    const Set<Path> added = data.added;
+                    EventLoop::mainEventLoop()->callLater([w, alive, added]() {
+                            if (!alive.expired())
+                                w->pathsAdded(added);
+                        });
+                }
+                if (!data.changed.empty()) {
+                    const Set<Path> modified = data.changed;
+                    EventLoop::mainEventLoop()->callLater([w, alive, modified]() {
+                            if (!alive.expired())
+                                w->pathsModified(modified);
+                        });
+                }
 
                 data.added.clear();
                 data.changed.clear();
@@ -317,8 +333,8 @@ void WatcherData::stop()
     changes.clear();
 }
 
-FileSystemWatcher::FileSystemWatcher()
-    : mWatcher(new WatcherData(this))
+FileSystemWatcher::FileSystemWatcher(unsigned int)
+    : mWatcher(new WatcherData(this)), mPendingQueued(false), mAlive(std::make_shared<bool>(true))
 {
     mWatcher->wakeupHandle = CreateEvent(NULL, FALSE, FALSE, NULL);
     mWatcher->thread = std::thread(std::bind(&WatcherData::run, mWatcher));
@@ -368,24 +384,15 @@ bool FileSystemWatcher::unwatch(const Path& p)
 
 void FileSystemWatcher::pathsAdded(const Set<Path>& paths)
 {
-    for (const Path& path : paths) {
-        //printf("really added %s\n", path.constData());
-        mAdded(path);
-    }
+    queueChanges(Changes::Add, paths);
 }
 
 void FileSystemWatcher::pathsRemoved(const Set<Path>& paths)
 {
-    for (const Path& path : paths) {
-        //printf("really removed %s\n", path.constData());
-        mRemoved(path);
-    }
+    queueChanges(Changes::Remove, paths);
 }
 
 void FileSystemWatcher::pathsModified(const Set<Path>& paths)
 {
-    for (const Path& path : paths) {
-        //printf("really modified %s\n", path.constData());
-        mModified(path);
-    }
+    queueChanges(Changes::Modified, paths);
 }
@@ -0,0 +1,865 @@
+#ifndef FlatHash_h
+#define FlatHash_h
+
+#include <rct/List.h>
+#include <rct/Path.h>
+#include <rct/Set.h>
+#include <rct/String.h>
+#include <assert.h>
+#include <functional>
+#include <new>
+#include <string>
+#include <string.h>
+#include <stdint.h>
+#include <utility>
+#if defined(__SSE2__)
+#  include <emmintrin.h>
+#endif
+
+// Open addressing hash tables for when Hash and Set, one heap node per
+// entry, cost too much memory or too many cache misses. Entries are stored
+// inline in one array with a byte of control data each: empty, deleted, or
+// 7 bits of the entry's hash. A lookup compares a whole group of control
+// bytes at once (16 with SSE2, 8 otherwise) and only looks at entries whose
+// bits match.
+//
+// Unlike Hash, inserting may move every entry, so iterators, pointers and
+// references are only good until the next insert. Erasing leaves the rest
+// where they are. The key of a FlatHash entry mustn't be changed through
+// an iterator.
+
+namespace Rct {
+
+inline uint64_t hashMultiply(uint64_t a, uint64_t b)
+{
+#ifdef __SIZEOF_INT128__
+    const __uint128_t r = static_cast<__uint128_t>(a) * b;
+    return static_cast<uint64_t>(r) ^ static_cast<uint64_t>(r >> 64);
+#else
+    const uint64_t ha = a >> 32, hb = b >> 32, la = static_cast<uint32_t>(a), lb = static_cast<uint32_t>(b);
+    const uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb;
+    const uint64_t t = rl + (rm0 << 32);
+    const uint64_t lo = t + (rm1 << 32);
+    const uint64_t hi = rh + (rm0 >> 32) + (rm1 >> 32) + (t < rl) + (lo < t);
+    return lo ^ hi;
+#endif
+}
+
+// spreads integers, pointers and weak hashes over all 64 bits
+inline uint64_t hashMix(uint64_t value)
+{
+    return hashMultiply(value ^ 0x2d358dccaa6c78a5ull, 0x8bb84b93962eacc9ull);
+}
+
+// wyhash
+inline uint64_t hashBytes(const void *data, size_t len, uint64_t seed = 0)
+{
+    static const uint64_t secret[] = { 0x2d358dccaa6c78a5ull, 0x8bb84b93962eacc9ull, 0x4b33a62ed433d4a3ull, 0x4d5a2da51de1aa47ull };
+    struct Read {
+        static uint64_t r8(const unsigned char *p) { uint64_t v; memcpy(&v, p, 8); return v; }
+        static uint64_t r4(const unsigned char *p) { uint32_t v; memcpy(&v, p, 4); return v; }
+    };
+    const unsigned char *p = static_cast<const unsigned char *>(data);
+    seed ^= hashMultiply(seed ^ secret[0], secret[1]);
+    uint64_t a, b;
+    if (len <= 16) {
+        if (len >= 4) {
+            a = (Read::r4(p) << 32) | Read::r4(p + ((len >> 3) << 2));
+            b = (Read::r4(p + len - 4) << 32) | Read::r4(p + len - 4 - ((len >> 3) << 2));
+        } else if (len) {
+            a = (static_cast<uint64_t>(p[0]) << 16) | (static_cast<uint64_t>(p[len >> 1]) << 8) | p[len - 1];
+            b = 0;
+        } else {
+            a = b = 0;
+        }
+    } else {
+        size_t i = len;
+        if (i > 48) {
+            uint64_t seed1 = seed, seed2 = seed;
+            do {
+                seed = hashMultiply(Read::r8(p) ^ secret[1], Read::r8(p + 8) ^ seed);
+                seed1 = hashMultiply(Read::r8(p + 16) ^ secret[2], Read::r8(p + 24) ^ seed1);
+                seed2 = hashMultiply(Read::r8(p + 32) ^ secret[3], Read::r8(p + 40) ^ seed2);
+                p += 48;
+                i -= 48;
+            } while (i > 48);
+            seed ^= seed1 ^ seed2;
+        }
+        while (i > 16) {
+            seed = hashMultiply(Read::r8(p) ^ secret[1], Read::r8(p + 8) ^ seed);
+            i -= 16;
+            p += 16;
+        }
+        a = Read::r8(p + i - 16);
+        b = Read::r8(p + i - 8);
+    }
+    a ^= secret[1];
+    b ^= seed;
+#ifdef __SIZEOF_INT128__
+    const __uint128_t r = static_cast<__uint128_t>(a) * b;
+    a = static_cast<uint64_t>(r);
+    b = static_cast<uint64_t>(r >> 64);
+#else
+    const uint64_t mixed = hashMultiply(a, b);
+    a = mixed;
+    b = mixed * secret[2];
+#endif
+    return hashMultiply(a ^ secret[0] ^ len, b ^ secret[1]);
+}
+
+}
+
+// The hash a FlatHash or FlatSet uses by default, std::hash mixed up for
+// anything without a specialization. A replacement has to spread its
+// values over all the bits of size_t, the low 7 go in the control bytes
+template <typename T>
+struct FlatHashFunction
+{
+    size_t operator()(const T &t) const { return Rct::hashMix(std::hash<T>()(t)); }
+};
+
+template <>
+struct FlatHashFunction<std::string>
+{
+    size_t operator()(const std::string &s) const { return Rct::hashBytes(s.data(), s.size()); }
+};
+
+template <>
+struct FlatHashFunction<String>
+{
+    size_t operator()(const String &s) const { return Rct::hashBytes(s.constData(), s.size()); }
+};
+
+template <>
+struct FlatHashFunction<Path>
+{
+    size_t operator()(const Path &p) const { return Rct::hashBytes(p.constData(), p.size()); }
+};
+
+#if defined(__SSE2__)
+struct FlatHashGroup
+{
+    enum { Width = 16 };
+    typedef uint32_t Mask;
+
+    explicit FlatHashGroup(const int8_t *ctrl)
+        : mCtrl(_mm_loadu_si128(reinterpret_cast<const __m128i *>(ctrl)))
+    {}
+
+    Mask match(int8_t h2) const { return _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_set1_epi8(h2), mCtrl)); }
+    Mask matchEmpty() const { return _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_set1_epi8(-128), mCtrl)); }
+    // empty and deleted are the only ones with the sign bit set
+    Mask matchEmptyOrDeleted() const { return _mm_movemask_epi8(mCtrl); }
+    static size_t index(Mask mask) { return __builtin_ctz(mask); }
+
+private:
+    __m128i mCtrl;
+};
+#else
+// the same, eight bytes at a time in a word. match() can have false
+// positives, they're weeded out by comparing keys
+struct FlatHashGroup
+{
+    enum { Width = 8 };
+    typedef uint64_t Mask;
+
+    explicit FlatHashGroup(const int8_t *ctrl)
+    {
+        memcpy(&mCtrl, ctrl, sizeof(mCtrl));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        mCtrl = __builtin_bswap64(mCtrl);
+#endif
+    }
+
+    Mask match(int8_t h2) const
+    {
+        const uint64_t x = mCtrl ^ (Lsbs * static_cast<uint8_t>(h2));
+        return (x - Lsbs) & ~x & Msbs;
+    }
+    Mask matchEmpty() const { return mCtrl & ~(mCtrl << 6) & Msbs; }
+    Mask matchEmptyOrDeleted() const { return mCtrl & ~(mCtrl << 7) & Msbs; }
+    static size_t index(Mask mask) { return __builtin_ctzll(mask) >> 3; }
+
+private:
+    static const uint64_t Lsbs = 0x0101010101010101ull;
+    static const uint64_t Msbs = 0x8080808080808080ull;
+    uint64_t mCtrl;
+};
+#endif
+
+// What FlatHash and FlatSet have in common. Capacity is a power of two, at
+// least a group, and at most 7/8 of it is used. The first group's control
+// bytes are repeated after the last so a group can be read from anywhere
+template <typename Slot, typename Key, typename KeyOf, typename HashFn>
+class FlatHashTable
+{
+public:
+    typedef Slot value_type;
+    typedef Key key_type;
+
+    template <typename T>
+    class Iterator
+    {
+    public:
+        Iterator()
+            : mCtrl(0), mEnd(0), mSlot(0)
+        {}
+        // iterator to const_iterator
+        template <typename Other>
+        Iterator(const Iterator<Other> &other)
+            : mCtrl(other.mCtrl), mEnd(other.mEnd), mSlot(other.mSlot)
+        {}
+
+        T &operator*() const { return *mSlot; }
+        T *operator->() const { return mSlot; }
+        Iterator &operator++()
+        {
+            ++mCtrl;
+            ++mSlot;
+            skip();
+            return *this;
+        }
+        Iterator operator++(int)
+        {
+            const Iterator ret = *this;
+            ++*this;
+            return ret;
+        }
+        bool operator==(const Iterator &other) const { return mCtrl == other.mCtrl; }
+        bool operator!=(const Iterator &other) const { return mCtrl != other.mCtrl; }
+
+    private:
+        Iterator(const int8_t *ctrl, const int8_t *end, T *slot)
+            : mCtrl(ctrl), mEnd(end), mSlot(slot)
+        {}
+
+        void skip()
+        {
+            while (mCtrl != mEnd && *mCtrl < 0) {
+                ++mCtrl;
+                ++mSlot;
+            }
+        }
+
+        const int8_t *mCtrl, *mEnd;
+        T *mSlot;
+
+        friend class FlatHashTable;
+        template <typename> friend class Iterator;
+    };
+    typedef Iterator<Slot> iterator;
+    typedef Iterator<const Slot> const_iterator;
+
+    FlatHashTable()
+        : mCtrl(0), mSlots(0), mCapacity(0), mSize(0), mGrowthLeft(0)
+    {}
+    FlatHashTable(const FlatHashTable &other)
+        : mCtrl(0), mSlots(0), mCapacity(0), mSize(0), mGrowthLeft(0)
+    {
+        copyFrom(other);
+    }
+    FlatHashTable(FlatHashTable &&other)
+        : mCtrl(other.mCtrl), mSlots(other.mSlots), mCapacity(other.mCapacity),
+          mSize(other.mSize), mGrowthLeft(other.mGrowthLeft)
+    {
+        other.mCtrl = 0;
+        other.mSlots = 0;
+        other.mCapacity = other.mSize = other.mGrowthLeft = 0;
+    }
+    ~FlatHashTable()
+    {
+        destroy();
+    }
+
+    FlatHashTable &operator=(const FlatHashTable &other)
+    {
+        if (this != &other) {
+            destroy();
+            copyFrom(other);
+        }
+        return *this;
+    }
+    FlatHashTable &operator=(FlatHashTable &&other)
+    {
+        if (this != &other) {
+            destroy();
+            std::swap(mCtrl, other.mCtrl);
+            std::swap(mSlots, other.mSlots);
+            std::swap(mCapacity, other.mCapacity);
+            std::swap(mSize, other.mSize);
+            std::swap(mGrowthLeft, other.mGrowthLeft);
+        }
+        return *this;
+    }
+
+    iterator begin()
+    {
+        iterator it(mCtrl, mCtrl + mCapacity, mSlots);
+        it.skip();
+        return it;
+    }
+    iterator end() { return iterator(mCtrl + mCapacity, mCtrl + mCapacity, mSlots + mCapacity); }
+    const_iterator begin() const { return const_cast<FlatHashTable *>(this)->begin(); }
+    const_iterator end() const { return const_cast<FlatHashTable *>(this)->end(); }
+    const_iterator constBegin() const { return begin(); }
+    const_iterator constEnd() const { return end(); }
+
+    int size() const { return mSize; }
+    bool isEmpty() const { return !mSize; }
+    bool empty() const { return !mSize; }
+    size_t capacity() const { return mCapacity; }
+
+    iterator find(const Key &key)
+    {
+        const size_t idx = findIndex(key);
+        if (idx == NotFound)
+            return end();
+        return iterator(mCtrl + idx, mCtrl + mCapacity, mSlots + idx);
+    }
+    const_iterator find(const Key &key) const { return const_cast<FlatHashTable *>(this)->find(key); }
+
+    bool contains(const Key &key) const { return findIndex(key) != NotFound; }
+    size_t count(const Key &key) const { return contains(key); }
+
+    iterator erase(iterator it)
+    {
+        eraseAt(it.mSlot - mSlots);
+        ++it;
+        return it;
+    }
+    size_t erase(const Key &key)
+    {
+        const size_t idx = findIndex(key);
+        if (idx == NotFound)
+            return 0;
+        eraseAt(idx);
+        return 1;
+    }
+
+    void clear()
+    {
+        if (!mCapacity)
+            return;
+        destroySlots();
+        resetCtrl();
+    }
+
+    // room for count entries without growing
+    void reserve(size_t count)
+    {
+        const size_t cap = capacityFor(count);
+        if (cap > mCapacity)
+            rehash(cap);
+    }
+
+protected:
+    enum : size_t { NotFound = static_cast<size_t>(-1) };
+    enum : int8_t { Empty = -128, Deleted = -2 };
+
+    static size_t hash(const Key &key) { return HashFn()(key); }
+
+    size_t findIndex(const Key &key) const
+    {
+        if (!mSize)
+            return NotFound;
+        return findIndex(key, hash(key));
+    }
+
+    size_t findIndex(const Key &key, size_t h) const
+    {
+        const int8_t h2 = h & 0x7f;
+        const size_t mask = mCapacity - 1;
+        size_t pos = (h >> 7) & mask, step = 0;
+        for (;;) {
+            const FlatHashGroup group(mCtrl + pos);
+            for (typename FlatHashGroup::Mask m = group.match(h2); m; m &= m - 1) {
+                const size_t idx = (pos + FlatHashGroup::index(m)) & mask;
+                if (KeyOf::get(mSlots[idx]) == key)
+                    return idx;
+            }
+            if (group.matchEmpty())
+                return NotFound;
+            step += FlatHashGroup::Width;
+            pos = (pos + step) & mask;
+        }
+    }
+
+    // the slot key goes in, constructed, and whether it was there already
+    template <typename... Args>
+    std::pair<size_t, bool> emplace(const Key &key, Args &&... args)
+    {
+        const size_t h = hash(key);
+        if (mSize) {
+            const size_t existing = findIndex(key, h);
+            if (existing != NotFound)
+                return std::make_pair(existing, false);
+        } else if (!mCapacity) {
+            rehash(capacityFor(1));
+        }
+        size_t idx = findFree(h);
+        if (!mGrowthLeft && mCtrl[idx] == Empty) {
+            // lots of tombstones, clean up rather than grow
+            rehash(mSize * 2 < mCapacity * 7 / 8 ? mCapacity : capacityFor(mSize + 1));
+            idx = findFree(h);
+        }
+        new (mSlots + idx) Slot(std::forward<Args>(args)...);
+        if (mCtrl[idx] == Empty)
+            --mGrowthLeft;
+        setCtrl(idx, h & 0x7f);
+        ++mSize;
+        return std::make_pair(idx, true);
+    }
+
+    void eraseAt(size_t idx)
+    {
+        mSlots[idx].~Slot();
+        --mSize;
+        if (!mSize) {
+            resetCtrl();
+        } else {
+            setCtrl(idx, Deleted);
+        }
+    }
+
+    Slot &slotAt(size_t idx) { return mSlots[idx]; }
+    const Slot &slotAt(size_t idx) const { return mSlots[idx]; }
+
+private:
+    static size_t capacityFor(size_t count)
+    {
+        if (!count)
+            return 0;
+        size_t cap = FlatHashGroup::Width;
+        while (cap * 7 / 8 < count)
+            cap *= 2;
+        return cap;
+    }
+
+    size_t findFree(size_t h) const
+    {
+        const size_t mask = mCapacity - 1;
+        size_t pos = (h >> 7) & mask, step = 0;
+        for (;;) {
+            const FlatHashGroup::Mask m = FlatHashGroup(mCtrl + pos).matchEmptyOrDeleted();
+            if (m)
+                return (pos + FlatHashGroup::index(m)) & mask;
+            step += FlatHashGroup::Width;
+            pos = (pos + step) & mask;
+        }
+    }
+
+    void setCtrl(size_t idx, int8_t value)
+    {
+        mCtrl[idx] = value;
+        if (idx < FlatHashGroup::Width)
+            mCtrl[mCapacity + idx] = value;
+    }
+
+    void resetCtrl()
+    {
+        memset(mCtrl, Empty, mCapacity + FlatHashGroup::Width);
+        mSize = 0;
+        mGrowthLeft = mCapacity * 7 / 8;
+    }
+
+    void rehash(size_t capacity)
+    {
+        int8_t *oldCtrl = mCtrl;
+        Slot *oldSlots = mSlots;
+        const size_t oldCapacity = mCapacity;
+        const size_t size = mSize;
+
+        mCapacity = capacity;
+        mCtrl = new int8_t[capacity + FlatHashGroup::Width];
+        mSlots = static_cast<Slot *>(::operator new(capacity * sizeof(Slot)));
+        resetCtrl();
+        for (size_t i = 0; i < oldCapacity; ++i) {
+            if (oldCtrl[i] >= 0) {
+                const size_t h = hash(KeyOf::get(oldSlots[i]));
+                const size_t idx = findFree(h);
+                new (mSlots + idx) Slot(std::move(oldSlots[i]));
+                oldSlots[i].~Slot();
+                setCtrl(idx, h & 0x7f);
+            }
+        }
+        mSize = size;
+        mGrowthLeft -= size;
+        delete[] oldCtrl;
+        ::operator delete(oldSlots);
+    }
+
+    void copyFrom(const FlatHashTable &other)
+    {
+        if (!other.mSize)
+            return;
+        rehash(capacityFor(other.mSize));
+        for (size_t i = 0; i < other.mCapacity; ++i) {
+            if (other.mCtrl[i] >= 0) {
+                const size_t h = hash(KeyOf::get(other.mSlots[i]));
+                const size_t idx = findFree(h);
+                new (mSlots + idx) Slot(other.mSlots[i]);
+                setCtrl(idx, h & 0x7f);
+            }
+        }
+        mSize = other.mSize;
+        mGrowthLeft -= mSize;
+    }
+
+    void destroySlots()
+    {
+        for (size_t i = 0; i < mCapacity; ++i) {
+            if (mCtrl[i] >= 0)
+                mSlots[i].~Slot();
+        }
+    }
+
+    void destroy()
+    {
+        if (!mCapacity)
+            return;
+        destroySlots();
+        delete[] mCtrl;
+        ::operator delete(mSlots);
+        mCtrl = 0;
+        mSlots = 0;
+        mCapacity = mSize = mGrowthLeft = 0;
+    }
+
+    int8_t *mCtrl;
+    Slot *mSlots;
+    size_t mCapacity, mSize, mGrowthLeft;
+};
+
+struct FlatHashPairKey
+{
+    template <typename Pair>
+    static const typename Pair::first_type &get(const Pair &pair) { return pair.first; }
+};
+
+struct FlatHashIdentityKey
+{
+    template <typename T>
+    static const T &get(const T &t) { return t; }
+};
+
+template <typename Key, typename Value, typename HashFn = FlatHashFunction<Key> >
+class FlatHash : public FlatHashTable<std::pair<Key, Value>, Key, FlatHashPairKey, HashFn>
+{
+public:
+    typedef FlatHashTable<std::pair<Key, Value>, Key, FlatHashPairKey, HashFn> Base;
+    typedef Value mapped_type;
+    typedef typename Base::iterator iterator;
+    typedef typename Base::const_iterator const_iterator;
+
+    FlatHash() {}
+
+    Value value(const Key &key, const Value &defaultValue = Value(), bool *ok = 0) const
+    {
+        const size_t idx = Base::findIndex(key);
+        if (idx == Base::NotFound) {
+            if (ok)
+                *ok = false;
+            return defaultValue;
+        }
+        if (ok)
+            *ok = true;
+        return Base::slotAt(idx).second;
+    }
+
+    void deleteAll()
+    {
+        for (auto &entry : *this)
+            delete entry.second;
+        Base::clear();
+    }
+
+    Value take(const Key &key, bool *ok = 0)
+    {
+        Value ret = Value();
+        const bool found = remove(key, &ret);
+        if (ok)
+            *ok = found;
+        return ret;
+    }
+
+    bool remove(const Key &key, Value *value = 0)
+    {
+        const size_t idx = Base::findIndex(key);
+        if (idx == Base::NotFound) {
+            if (value)
+                *value = Value();
+            return false;
+        }
+        if (value)
+            *value = std::move(Base::slotAt(idx).second);
+        Base::eraseAt(idx);
+        return true;
+    }
+
+    int remove(std::function<bool(const Key &key)> match)
+    {
+        int ret = 0;
+        iterator it = Base::begin();
+        while (it != Base::end()) {
+            if (match(it->first)) {
+                it = Base::erase(it);
+                ++ret;
+            } else {
+                ++it;
+            }
+        }
+        return ret;
+    }
+
+    bool insert(const Key &key, const Value &value)
+    {
+        return Base::emplace(key, key, value).second;
+    }
+
+    Value &operator[](const Key &key)
+    {
+        return Base::slotAt(Base::emplace(key, key, Value()).first).second;
+    }
+
+    const Value &operator[](const Key &key) const
+    {
+        const size_t idx = Base::findIndex(key);
+        assert(idx != Base::NotFound);
+        return Base::slotAt(idx).second;
+    }
+
+    FlatHash &unite(const FlatHash &other, int *count = 0)
+    {
+        for (const auto &entry : other) {
+            const std::pair<size_t, bool> slot = Base::emplace(entry.first, entry);
+            Value &val = Base::slotAt(slot.first).second;
+            if (slot.second) {
+                if (count)
+                    ++*count;
+            } else if (val != entry.second) {
+                if (count)
+                    ++*count;
+                val = entry.second;
+            }
+        }
+        return *this;
+    }
+
+    FlatHash &subtract(const FlatHash &other)
+    {
+        for (const auto &entry : other)
+            Base::erase(entry.first);
+        return *this;
+    }
+
+    FlatHash &operator+=(const FlatHash &other) { return unite(other); }
+    FlatHash &operator-=(const FlatHash &other) { return subtract(other); }
+
+    List<Key> keys() const
+    {
+        List<Key> keys;
+        keys.reserve(Base::size());
+        for (const auto &entry : *this)
+            keys.append(entry.first);
+        return keys;
+    }
+
+    Set<Key> keysAsSet() const
+    {
+        Set<Key> keys;
+        for (const auto &entry : *this)
+            keys.insert(entry.first);
+        return keys;
+    }
+
+    List<Value> values() const
+    {
+        List<Value> values;
+        values.reserve(Base::size());
+        for (const auto &entry : *this)
+            values.append(entry.second);
+        return values;
+    }
+};
+
+template <typename T, typename HashFn = FlatHashFunction<T> >
+class FlatSet : public FlatHashTable<T, T, FlatHashIdentityKey, HashFn>
+{
+public:
+    typedef FlatHashTable<T, T, FlatHashIdentityKey, HashFn> Base;
+    typedef typename Base::iterator iterator;
+    typedef typename Base::const_iterator const_iterator;
+
+    FlatSet() {}
+
+    bool insert(const T &t)
+    {
+        return Base::emplace(t, t).second;
+    }
+
+    bool remove(const T &t)
+    {
+        return Base::erase(t);
+    }
+
+    int remove(std::function<bool(const T &t)> match)
+    {
+        int ret = 0;
+        iterator it = Base::begin();
+        while (it != Base::end()) {
+            if (match(*it)) {
+                it = Base::erase(it);
+                ++ret;
+            } else {
+                ++it;
+            }
+        }
+        return ret;
+    }
+
+    void deleteAll()
+    {
+        for (const T &t : *this)
+            delete t;
+        Base::clear();
+    }
+
+    T take(const T &t, bool *ok = 0)
+    {
+        const size_t idx = Base::findIndex(t);
+        if (idx == Base::NotFound) {
+            if (ok)
+                *ok = false;
+            return T();
+        }
+        if (ok)
+            *ok = true;
+        T ret = std::move(Base::slotAt(idx));
+        Base::eraseAt(idx);
+        return ret;
+    }
+
+    List<T> toList() const
+    {
+        List<T> ret;
+        ret.reserve(Base::size());
+        for (const T &t : *this)
+            ret.append(t);
+        return ret;
+    }
+
+    FlatSet &unite(const FlatSet &other, int *count = 0)
+    {
+        int c = 0;
+        for (const T &t : other) {
+            if (insert(t))
+                ++c;
+        }
+        if (count)
+            *count = c;
+        return *this;
+    }
+
+    FlatSet &unite(const List<T> &other, int *count = 0)
+    {
+        int c = 0;
+        for (const T &t : other) {
+            if (insert(t))
+                ++c;
+        }
+        if (count)
+            *count = c;
+        return *this;
+    }
+
+    FlatSet &subtract(const FlatSet &other, int *count = 0)
+    {
+        int c = 0;
+        for (const T &t : other)
+            c += Base::erase(t);
+        if (count)
+            *count = c;
+        return *this;
+    }
+
+    bool intersects(const FlatSet &other) const
+    {
+        for (const T &t : other) {
+            if (Base::contains(t))
+                return true;
+        }
+        return false;
+    }
+
+    FlatSet intersected(const FlatSet &other) const
+    {
+        FlatSet ret;
+        for (const T &t : other) {
+            if (Base::contains(t))
+                ret.insert(t);
+        }
+        return ret;
+    }
+
+    FlatSet &operator+=(const FlatSet &other) { return unite(other); }
+    FlatSet &operator+=(const List<T> &other) { return unite(other); }
+    FlatSet &operator+=(const T &t)
+    {
+        insert(t);
+        return *this;
+    }
+    FlatSet &operator<<(const T &t)
+    {
+        insert(t);
+        return *this;
+    }
+    FlatSet &operator<<(const List<T> &other) { return unite(other); }
+    FlatSet &operator<<(const FlatSet &other) { return unite(other); }
+    FlatSet &operator-=(const FlatSet &other) { return subtract(other); }
+
+    bool operator==(const FlatSet &other) const
+    {
+        if (Base::size() != other.size())
+            return false;
+        for (const T &t : other) {
+            if (!Base::contains(t))
+                return false;
+        }
+        return true;
+    }
+    bool operator!=(const FlatSet &other) const { return !operator==(other); }
+};
+
+template <typename Key, typename Value, typename HashFn>
+inline const FlatHash<Key, Value, HashFn> operator+(const FlatHash<Key, Value, HashFn> &l, const FlatHash<Key, Value, HashFn> &r)
+{
+    FlatHash<Key, Value, HashFn> ret = l;
+    ret += r;
+    return ret;
+}
+
+template <typename Key, typename Value, typename HashFn>
+inline const FlatHash<Key, Value, HashFn> operator-(const FlatHash<Key, Value, HashFn> &l, const FlatHash<Key, Value, HashFn> &r)
+{
+    FlatHash<Key, Value, HashFn> ret = l;
+    ret -= r;
+    return ret;
+}
+
+template <typename T, typename HashFn>
+inline const FlatSet<T, HashFn> operator+(const FlatSet<T, HashFn> &l, const FlatSet<T, HashFn> &r)
+{
+    FlatSet<T, HashFn> ret = l;
+    ret += r;
+    return ret;
+}
+
+template <typename T, typename HashFn>
+inline const FlatSet<T, HashFn> operator-(const FlatSet<T, HashFn> &l, const FlatSet<T, HashFn> &r)
+{
+    FlatSet<T, HashFn> ret = l;
+    ret -= r;
+    return ret;
+}
+
+#endif
@@ -0,0 +1,377 @@
+#ifndef FlatMap_h
+#define FlatMap_h
+
+#include <rct/List.h>
+#include <rct/Set.h>
+#include <algorithm>
+#include <assert.h>
+#include <functional>
+#include <initializer_list>
+#include <utility>
+
+// A Map kept as one sorted array, for small tables and for indexes that
+// are built once and then mostly looked up. Iterating is in key order and
+// it serializes the same way Map does, so either can read what the other
+// wrote.
+//
+// Building it with assign() sorts once, inserting one at a time moves
+// everything after the new entry. Any insert or erase invalidates
+// iterators. Keys mustn't be changed through an iterator.
+//
+// For lookup heavy tables buildIndex() lays out a copy of the keys in
+// Eytzinger (breadth first) order, where consecutive steps of the search
+// are close together in memory. It costs a copy of the keys and is dropped
+// by any change.
+template <typename Key, typename Value, typename Compare = std::less<Key> >
+class FlatMap
+{
+public:
+    typedef Key key_type;
+    typedef Value mapped_type;
+    typedef std::pair<Key, Value> value_type;
+    typedef typename List<value_type>::iterator iterator;
+    typedef typename List<value_type>::const_iterator const_iterator;
+
+    FlatMap() {}
+    FlatMap(std::initializer_list<value_type> init)
+    {
+        assign(List<value_type>(init));
+    }
+
+    FlatMap &operator=(std::initializer_list<value_type> init)
+    {
+        assign(List<value_type>(init));
+        return *this;
+    }
+
+    // replaces everything with entries, in any order. Of the entries with
+    // the same key the last one wins
+    void assign(List<value_type> &&entries)
+    {
+        mEntries = std::move(entries);
+        mIndex.clear();
+        mRanks.clear();
+        const Compare compare;
+        bool sorted = true;
+        for (size_t i = 1; i < count(); ++i) {
+            if (!compare(mEntries[i - 1].first, mEntries[i].first)) {
+                sorted = false;
+                break;
+            }
+        }
+        if (sorted)
+            return;
+        std::stable_sort(mEntries.begin(), mEntries.end(), [&compare](const value_type &l, const value_type &r) {
+                return compare(l.first, r.first);
+            });
+        size_t out = 0;
+        for (size_t i = 0; i < count(); ++i) {
+            if (out && !compare(mEntries[out - 1].first, mEntries[i].first)) {
+                mEntries[out - 1] = std::move(mEntries[i]);
+            } else if (out++ != i) {
+                mEntries[out - 1] = std::move(mEntries[i]);
+            }
+        }
+        mEntries.resize(out);
+    }
+
+    const List<value_type> &entries() const { return mEntries; }
+
+    void buildIndex()
+    {
+        mIndex.resize(count() + 1);
+        mRanks.resize(count() + 1);
+        size_t rank = 0;
+        fillIndex(1, rank);
+    }
+    bool hasIndex() const { return !mIndex.empty(); }
+
+    iterator begin() { return mEntries.begin(); }
+    iterator end() { return mEntries.end(); }
+    const_iterator begin() const { return mEntries.begin(); }
+    const_iterator end() const { return mEntries.end(); }
+    const_iterator constBegin() const { return mEntries.begin(); }
+    const_iterator constEnd() const { return mEntries.end(); }
+
+    int size() const { return mEntries.size(); }
+    size_t count() const { return mEntries.size(); }
+    bool isEmpty() const { return mEntries.empty(); }
+    bool empty() const { return mEntries.empty(); }
+    void reserve(size_t count) { mEntries.reserve(count); }
+    void clear()
+    {
+        mEntries.clear();
+        mIndex.clear();
+        mRanks.clear();
+    }
+
+    iterator lower_bound(const Key &key) { return mEntries.begin() + lowerBound(key); }
+    const_iterator lower_bound(const Key &key) const { return mEntries.begin() + lowerBound(key); }
+    iterator upper_bound(const Key &key)
+    {
+        iterator it = lower_bound(key);
+        if (it != end() && !Compare()(key, it->first))
+            ++it;
+        return it;
+    }
+    const_iterator upper_bound(const Key &key) const { return const_cast<FlatMap *>(this)->upper_bound(key); }
+
+    iterator find(const Key &key)
+    {
+        const size_t idx = findIndex(key);
+        return idx == NotFound ? end() : mEntries.begin() + idx;
+    }
+    const_iterator find(const Key &key) const { return const_cast<FlatMap *>(this)->find(key); }
+
+    bool contains(const Key &key) const { return findIndex(key) != NotFound; }
+
+    Value value(const Key &key, const Value &defaultValue = Value(), bool *ok = 0) const
+    {
+        const size_t idx = findIndex(key);
+        if (idx == NotFound) {
+            if (ok)
+                *ok = false;
+            return defaultValue;
+        }
+        if (ok)
+            *ok = true;
+        return mEntries[idx].second;
+    }
+
+    Value take(const Key &key, bool *ok = 0)
+    {
+        Value ret = Value();
+        const bool found = remove(key, &ret);
+        if (ok)
+            *ok = found;
+        return ret;
+    }
+
+    bool remove(const Key &key, Value *value = 0)
+    {
+        const size_t idx = findIndex(key);
+        if (idx == NotFound) {
+            if (value)
+                *value = Value();
+            return false;
+        }
+        if (value)
+            *value = std::move(mEntries[idx].second);
+        erase(mEntries.begin() + idx);
+        return true;
+    }
+
+    int remove(std::function<bool(const Key &key)> match)
+    {
+        const size_t before = count();
+        mEntries.erase(std::remove_if(mEntries.begin(), mEntries.end(), [&match](const value_type &entry) {
+                    return match(entry.first);
+                }), mEntries.end());
+        const int ret = before - count();
+        if (ret) {
+            mIndex.clear();
+            mRanks.clear();
+        }
+        return ret;
+    }
+
+    iterator erase(iterator it)
+    {
+        mIndex.clear();
+        mRanks.clear();
+        return mEntries.erase(it);
+    }
+    size_t erase(const Key &key) { return remove(key); }
+
+    void deleteAll()
+    {
+        for (value_type &entry : mEntries)
+            delete entry.second;
+        clear();
+    }
+
+    bool insert(const Key &key, const Value &value)
+    {
+        const size_t idx = lowerBound(key);
+        if (idx < count() && !Compare()(key, mEntries[idx].first))
+            return false;
+        mIndex.clear();
+        mRanks.clear();
+        mEntries.insert(mEntries.begin() + idx, value_type(key, value));
+        return true;
+    }
+
+    Value &operator[](const Key &key)
+    {
+        const size_t idx = lowerBound(key);
+        if (idx == count() || Compare()(key, mEntries[idx].first)) {
+            mIndex.clear();
+            mRanks.clear();
+            mEntries.insert(mEntries.begin() + idx, value_type(key, Value()));
+        }
+        return mEntries[idx].second;
+    }
+
+    const Value &operator[](const Key &key) const
+    {
+        const size_t idx = findIndex(key);
+        assert(idx != NotFound);
+        return mEntries[idx].second;
+    }
+
+    // one merge of the two, rather than an insert each
+    FlatMap &unite(const FlatMap &other, int *count = 0)
+    {
+        const Compare compare;
+        List<value_type> merged;
+        merged.reserve(FlatMap::count() + other.count());
+        int c = 0;
+        size_t i = 0, j = 0;
+        const size_t mine = FlatMap::count(), theirs = other.count();
+        while (i < mine || j < theirs) {
+            if (j == theirs || (i < mine && compare(mEntries[i].first, other.mEntries[j].first))) {
+                merged.append(std::move(mEntries[i++]));
+            } else if (i == mine || compare(other.mEntries[j].first, mEntries[i].first)) {
+                merged.append(other.mEntries[j++]);
+                ++c;
+            } else {
+                if (!(mEntries[i].second == other.mEntries[j].second))
+                    ++c;
+                merged.append(other.mEntries[j++]);
+                ++i;
+            }
+        }
+        mEntries = std::move(merged);
+        mIndex.clear();
+        mRanks.clear();
+        if (count)
+            *count += c;
+        return *this;
+    }
+
+    FlatMap &subtract(const FlatMap &other)
+    {
+        const size_t before = count();
+        mEntries.erase(std::remove_if(mEntries.begin(), mEntries.end(), [&other](const value_type &entry) {
+                    return other.contains(entry.first);
+                }), mEntries.end());
+        if (before != count()) {
+            mIndex.clear();
+            mRanks.clear();
+        }
+        return *this;
+    }
+
+    FlatMap &operator+=(const FlatMap &other) { return unite(other); }
+    FlatMap &operator-=(const FlatMap &other) { return subtract(other); }
+
+    bool operator==(const FlatMap &other) const
+    {
+        typedef std::vector<value_type> Entries;
+        return static_cast<const Entries &>(mEntries) == static_cast<const Entries &>(other.mEntries);
+    }
+    bool operator!=(const FlatMap &other) const { return !operator==(other); }
+
+    List<Key> keys() const
+    {
+        List<Key> keys;
+        keys.reserve(count());
+        for (const value_type &entry : mEntries)
+            keys.append(entry.first);
+        return keys;
+    }
+
+    Set<Key> keysAsSet() const
+    {
+        Set<Key> keys;
+        for (const value_type &entry : mEntries)
+            static_cast<std::set<Key> &>(keys).insert(keys.end(), entry.first);
+        return keys;
+    }
+
+    List<Value> values() const
+    {
+        List<Value> values;
+        values.reserve(count());
+        for (const value_type &entry : mEntries)
+            values.append(entry.second);
+        return values;
+    }
+
+private:
+    enum : size_t { NotFound = static_cast<size_t>(-1) };
+
+    size_t lowerBound(const Key &key) const
+    {
+        const Compare compare;
+        size_t count = FlatMap::count();
+        if (!count)
+            return 0;
+        if (!mIndex.empty()) {
+            // the four levels below fit in a cache line or so for small
+            // keys, fetch them while this one is compared
+            enum { Ahead = sizeof(Key) < 64 ? 64 / sizeof(Key) : 1 };
+            const Key *index = mIndex.data();
+            size_t k = 1;
+            while (k <= count) {
+#ifdef __GNUC__
+                __builtin_prefetch(index + k * Ahead);
+#endif
+                k = 2 * k + compare(index[k], key);
+            }
+            // back up to the last step that went left, that's the first
+            // key not less than key. None did if it's 0
+            k >>= __builtin_ctzll(~static_cast<unsigned long long>(k)) + 1;
+            return k ? mRanks[k] : count;
+        }
+        // branch free, the compare decides which half without a jump
+        const value_type *base = mEntries.data();
+        while (count > 1) {
+            const size_t half = count / 2;
+            base = compare(base[half].first, key) ? base + half : base;
+            count -= half;
+        }
+        return (base - mEntries.data()) + compare(base->first, key);
+    }
+
+    size_t findIndex(const Key &key) const
+    {
+        const size_t idx = lowerBound(key);
+        if (idx < count() && !Compare()(key, mEntries[idx].first))
+            return idx;
+        return NotFound;
+    }
+
+    void fillIndex(size_t k, size_t &rank)
+    {
+        if (k < static_cast<size_t>(mIndex.size())) {
+            fillIndex(2 * k, rank);
+            mIndex[k] = mEntries[rank].first;
+            mRanks[k] = rank++;
+            fillIndex(2 * k + 1, rank);
+        }
+    }
+
+    List<value_type> mEntries;
+    // 1 based, mIndex[0] isn't used
+    List<Key> mIndex;
+    List<size_t> mRanks;
+};
+
+template <typename Key, typename Value, typename Compare>
+inline const FlatMap<Key, Value, Compare> operator+(const FlatMap<Key, Value, Compare> &l, const FlatMap<Key, Value, Compare> &r)
+{
+    FlatMap<Key, Value, Compare> ret = l;
+    ret += r;
+    return ret;
+}
+
+template <typename Key, typename Value, typename Compare>
+inline const FlatMap<Key, Value, Compare> operator-(const FlatMap<Key, Value, Compare> &l, const FlatMap<Key, Value, Compare> &r)
+{
+    FlatMap<Key, Value, Compare> ret = l;
+    ret -= r;
+    return ret;
+}
+
+#endif
@@ -0,0 +1,68 @@
+#include "Future.h"
+#include <condition_variable>
+#include <mutex>
+#include <stdint.h>
+
+// Hardly anyone blocks on a Future, so rather than a mutex and condition
+// variable each the states share a few, picked by address
+enum { WaitStripes = 16 };
+static std::mutex waitMutexes[WaitStripes];
+static std::condition_variable waitConditions[WaitStripes];
+
+static inline int waitStripe(const void *state)
+{
+    return (reinterpret_cast<uintptr_t>(state) >> 6) % WaitStripes;
+}
+
+// what mContinuations holds once the state is done
+static FutureStateBase::Continuation *const closed = reinterpret_cast<FutureStateBase::Continuation *>(1);
+
+void FutureStateBase::wait()
+{
+    if (status() != Pending)
+        return;
+    const int stripe = waitStripe(this);
+    std::unique_lock<std::mutex> lock(waitMutexes[stripe]);
+    // both sides seq_cst, either complete() sees us waiting or we see it
+    // done
+    mWaiting.store(true);
+    while (mStatus.load() == Pending)
+        waitConditions[stripe].wait(lock);
+}
+
+void FutureStateBase::complete(Status status)
+{
+    mStatus.store(status);
+    if (mWaiting.load()) {
+        const int stripe = waitStripe(this);
+        std::lock_guard<std::mutex> lock(waitMutexes[stripe]);
+        waitConditions[stripe].notify_all();
+    }
+
+    // pushed newest first, they run in the order they were added
+    Continuation *continuation = mContinuations.exchange(closed, std::memory_order_acq_rel);
+    Continuation *ordered = 0;
+    while (continuation) {
+        Continuation *next = continuation->mNext;
+        continuation->mNext = ordered;
+        ordered = continuation;
+        continuation = next;
+    }
+    while (ordered) {
+        Continuation *next = ordered->mNext;
+        ordered->finished(this);
+        ordered = next;
+    }
+}
+
+void FutureStateBase::addContinuation(Continuation *continuation)
+{
+    Continuation *head = mContinuations.load(std::memory_order_acquire);
+    do {
+        if (head == closed) {
+            continuation->finished(this);
+            return;
+        }
+        continuation->mNext = head;
+    } while (!mContinuations.compare_exchange_weak(head, continuation, std::memory_order_release, std::memory_order_acquire));
+}
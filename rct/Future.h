@@ -0,0 +1,436 @@
+#ifndef Future_h
+#define Future_h
+
+#include "EventLoop.h"
+#include "List.h"
+#include "ThreadPool.h"
+#include <assert.h>
+#include <atomic>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+// What a Future shares with whatever finishes it, a task submitted to a
+// ThreadPool, a then() continuation or whenAll(). Counted by hand rather
+// than with a shared_ptr, a queued task holds a reference of its own.
+class FutureStateBase : public ThreadPool::Task
+{
+public:
+    enum Status {
+        Pending,
+        Finished,
+        // dropped from the pool's backlog before it ran, or what it was
+        // waiting for was
+        Broken
+    };
+
+    // runs once, on the thread finishing the state or right away if it's
+    // done already
+    class Continuation
+    {
+    public:
+        Continuation()
+            : mNext(0)
+        {}
+        virtual ~Continuation() {}
+
+        virtual void finished(FutureStateBase *state) = 0;
+
+    private:
+        Continuation *mNext;
+
+        friend class FutureStateBase;
+    };
+
+    FutureStateBase()
+        : mRefs(1), mStatus(Pending), mWaiting(false), mContinuations(0)
+    {}
+
+    void ref() { mRefs.fetch_add(1, std::memory_order_relaxed); }
+    void deref()
+    {
+        if (mRefs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+            delete this;
+    }
+
+    Status status() const { return static_cast<Status>(mStatus.load(std::memory_order_acquire)); }
+    void wait();
+    void addContinuation(Continuation *continuation);
+
+protected:
+    // wakes whoever waits and runs the continuations
+    void complete(Status status);
+
+    virtual void execute() override {}
+    virtual void drop() override {}
+
+private:
+    std::atomic<int> mRefs, mStatus;
+    std::atomic<bool> mWaiting;
+    std::atomic<Continuation *> mContinuations;
+};
+
+template <typename R>
+class FutureState : public FutureStateBase
+{
+public:
+    typedef const R &Value;
+
+    ~FutureState()
+    {
+        if (status() == Finished)
+            reinterpret_cast<R *>(&mValue)->~R();
+    }
+
+    template <typename... Args>
+    void finish(Args&&... args)
+    {
+        new (&mValue) R(std::forward<Args>(args)...);
+        complete(Finished);
+    }
+    const R &value() const { return *reinterpret_cast<const R *>(&mValue); }
+
+private:
+    typename std::aligned_storage<sizeof(R), std::alignment_of<R>::value>::type mValue;
+};
+
+template <>
+class FutureState<void> : public FutureStateBase
+{
+public:
+    typedef void Value;
+
+    void finish() { complete(Finished); }
+    void value() const {}
+};
+
+// calls f and finishes state with what it returns
+template <typename R>
+struct FutureCall
+{
+    template <typename F, typename... Args>
+    static void run(FutureState<R> *state, F &f, Args&&... args)
+    {
+        state->finish(f(std::forward<Args>(args)...));
+    }
+};
+
+template <>
+struct FutureCall<void>
+{
+    template <typename F, typename... Args>
+    static void run(FutureState<void> *state, F &f, Args&&... args)
+    {
+        f(std::forward<Args>(args)...);
+        state->finish();
+    }
+};
+
+// continuations get the value, or nothing after a Future<void>
+template <typename R>
+struct FutureThen
+{
+    template <typename F>
+    struct Result { typedef typename std::result_of<F(const R &)>::type Type; };
+
+    template <typename R2, typename F>
+    static void run(FutureState<R2> *state, F &f, FutureState<R> *source)
+    {
+        FutureCall<R2>::run(state, f, source->value());
+    }
+};
+
+template <>
+struct FutureThen<void>
+{
+    template <typename F>
+    struct Result { typedef typename std::result_of<F()>::type Type; };
+
+    template <typename R2, typename F>
+    static void run(FutureState<R2> *state, F &f, FutureState<void> *)
+    {
+        FutureCall<R2>::run(state, f);
+    }
+};
+
+// what ThreadPool::submit() queues, the callable lives in here
+template <typename R, typename F>
+class FutureTask : public FutureState<R>
+{
+public:
+    template <typename G>
+    FutureTask(G &&f)
+        : mFunction(std::forward<G>(f))
+    {}
+
+protected:
+    virtual void execute() override
+    {
+        FutureCall<R>::run(this, mFunction);
+        this->deref();
+    }
+    virtual void drop() override
+    {
+        this->complete(FutureStateBase::Broken);
+        this->deref();
+    }
+
+private:
+    F mFunction;
+};
+
+template <typename R2, typename R, typename F>
+class FutureThenState : public FutureState<R2>, public FutureStateBase::Continuation
+{
+public:
+    // with post it goes through loop, and breaks if the loop is gone
+    template <typename G>
+    FutureThenState(G &&f, const EventLoop::SharedPtr &loop, bool post)
+        : mFunction(std::forward<G>(f)), mLoop(loop), mPost(post)
+    {}
+
+    virtual void finished(FutureStateBase *source) override
+    {
+        source->ref();
+        if (!mPost) {
+            run(source);
+        } else if (EventLoop::SharedPtr loop = mLoop.lock()) {
+            loop->callLater([this, source]() { run(source); });
+        } else {
+            source->deref();
+            this->complete(FutureStateBase::Broken);
+            this->deref();
+        }
+    }
+
+private:
+    void run(FutureStateBase *source)
+    {
+        if (source->status() == FutureStateBase::Finished) {
+            FutureThen<R>::run(this, mFunction, static_cast<FutureState<R> *>(source));
+        } else {
+            this->complete(FutureStateBase::Broken);
+        }
+        source->deref();
+        // the reference the continuation held
+        this->deref();
+    }
+
+    F mFunction;
+    EventLoop::WeakPtr mLoop;
+    const bool mPost;
+};
+
+// The result of ThreadPool::submit(), then() or whenAll(). Copies share
+// the state. get() blocks until there's a value, then() doesn't, it's how
+// to hear about it on the pool or back on an EventLoop.
+template <typename R>
+class Future
+{
+public:
+    Future()
+        : mState(0)
+    {}
+    explicit Future(FutureState<R> *state)
+        : mState(state)
+    {
+        if (mState)
+            mState->ref();
+    }
+    Future(const Future &other)
+        : mState(other.mState)
+    {
+        if (mState)
+            mState->ref();
+    }
+    Future(Future &&other)
+        : mState(other.mState)
+    {
+        other.mState = 0;
+    }
+    ~Future()
+    {
+        if (mState)
+            mState->deref();
+    }
+
+    Future &operator=(const Future &other)
+    {
+        Future copy(other);
+        std::swap(mState, copy.mState);
+        return *this;
+    }
+    Future &operator=(Future &&other)
+    {
+        std::swap(mState, other.mState);
+        return *this;
+    }
+
+    bool isValid() const { return mState; }
+    // finished or broken, wait() won't block
+    bool isDone() const { return mState->status() != FutureStateBase::Pending; }
+    bool isBroken() const { return mState->status() == FutureStateBase::Broken; }
+    void wait() const { mState->wait(); }
+    // waits, there has to be a value
+    typename FutureState<R>::Value get() const
+    {
+        mState->wait();
+        assert(mState->status() == FutureStateBase::Finished);
+        return mState->value();
+    }
+
+    // f gets the value, or nothing for Future<void>, on the thread that
+    // finished this one, or right away if it's done. It's not called if
+    // this one breaks, the Future it returns breaks too
+    template <typename F>
+    Future<typename FutureThen<R>::template Result<typename std::decay<F>::type>::Type> then(F &&f) const
+    {
+        return chain(EventLoop::SharedPtr(), false, std::forward<F>(f));
+    }
+    // the same, but f runs on loop's thread
+    template <typename F>
+    Future<typename FutureThen<R>::template Result<typename std::decay<F>::type>::Type> then(const EventLoop::SharedPtr &loop, F &&f) const
+    {
+        return chain(loop, true, std::forward<F>(f));
+    }
+
+    FutureState<R> *state() const { return mState; }
+
+private:
+    template <typename F>
+    Future<typename FutureThen<R>::template Result<typename std::decay<F>::type>::Type> chain(const EventLoop::SharedPtr &loop, bool post, F &&f) const
+    {
+        typedef typename std::decay<F>::type Function;
+        typedef typename FutureThen<R>::template Result<Function>::Type R2;
+        FutureThenState<R2, R, Function> *state = new FutureThenState<R2, R, Function>(std::forward<F>(f), loop, post);
+        Future<R2> ret(state);
+        mState->addContinuation(state);
+        return ret;
+    }
+
+    FutureState<R> *mState;
+};
+
+// finishes with every value, in order, once they're all done. Breaks if
+// any of them does
+template <typename R>
+class FutureAllState : public FutureState<List<R> >
+{
+public:
+    typedef List<R> Result;
+
+    FutureAllState(int count)
+        : mRemaining(count + 1), mBroken(false), mResults(count)
+    {}
+
+    void watch(FutureStateBase *state, int index) { state->addContinuation(new Part(this, index)); }
+    void partFinished(FutureStateBase *source, int index)
+    {
+        if (source->status() == FutureStateBase::Finished) {
+            mResults[index] = static_cast<FutureState<R> *>(source)->value();
+        } else {
+            mBroken = true;
+        }
+        done();
+    }
+    // once for each part, and once when they've all been watched
+    void done()
+    {
+        if (mRemaining.fetch_sub(1, std::memory_order_acq_rel) != 1)
+            return;
+        if (mBroken) {
+            this->complete(FutureStateBase::Broken);
+        } else {
+            this->finish(std::move(mResults));
+        }
+        this->deref();
+    }
+
+private:
+    struct Part : public FutureStateBase::Continuation
+    {
+        Part(FutureAllState *a, int i)
+            : all(a), index(i)
+        {}
+        virtual void finished(FutureStateBase *state) override
+        {
+            all->partFinished(state, index);
+            delete this;
+        }
+
+        FutureAllState *all;
+        const int index;
+    };
+
+    std::atomic<int> mRemaining;
+    std::atomic<bool> mBroken;
+    List<R> mResults;
+};
+
+template <>
+class FutureAllState<void> : public FutureState<void>
+{
+public:
+    typedef void Result;
+
+    FutureAllState(int count)
+        : mRemaining(count + 1), mBroken(false)
+    {}
+
+    void watch(FutureStateBase *state, int) { state->addContinuation(new Part(this)); }
+    void done()
+    {
+        if (mRemaining.fetch_sub(1, std::memory_order_acq_rel) != 1)
+            return;
+        if (mBroken) {
+            complete(Broken);
+        } else {
+            finish();
+        }
+        deref();
+    }
+
+private:
+    struct Part : public FutureStateBase::Continuation
+    {
+        Part(FutureAllState *a)
+            : all(a)
+        {}
+        virtual void finished(FutureStateBase *state) override
+        {
+            if (state->status() != Finished)
+                all->mBroken = true;
+            all->done();
+            delete this;
+        }
+
+        FutureAllState *all;
+    };
+
+    std::atomic<int> mRemaining;
+    std::atomic<bool> mBroken;
+};
+
+template <typename R>
+Future<typename FutureAllState<R>::Result> whenAll(const List<Future<R> > &futures)
+{
+    FutureAllState<R> *state = new FutureAllState<R>(futures.size());
+    Future<typename FutureAllState<R>::Result> ret(state);
+    for (int i = 0; i < futures.size(); ++i)
+        state->watch(futures.at(i).state(), i);
+    state->done();
+    return ret;
+}
+
+template <typename F>
+Future<typename std::result_of<typename std::decay<F>::type()>::type> ThreadPool::submit(F &&f, int priority)
+{
+    typedef typename std::decay<F>::type Function;
+    typedef typename std::result_of<Function()>::type R;
+    FutureTask<R, Function> *task = new FutureTask<R, Function>(std::forward<F>(f));
+    Future<R> ret(task);
+    schedule(task, priority);
+    return ret;
+}
+
+#endif
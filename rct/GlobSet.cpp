@@ -0,0 +1,225 @@
+#include "GlobSet.h"
+#include <algorithm>
+#include <memory>
+#include <string.h>
+
+static inline void setBit(List<uint64_t> &words, int bit)
+{
+    words[bit / 64] |= 1ull << (bit % 64);
+}
+
+static void addLength(List<int> &lengths, int length)
+{
+    if (!lengths.contains(length)) {
+        lengths.append(length);
+        lengths.sort();
+    }
+}
+
+int GlobSet::add(const String &pattern)
+{
+    const int idx = mPatterns.size();
+    // a run of '*' is the same as one
+    String wild;
+    wild.reserve(pattern.size());
+    for (int i=0; i<pattern.size(); ++i) {
+        if (pattern.at(i) != '*' || wild.isEmpty() || wild.last() != '*')
+            wild.append(pattern.at(i));
+    }
+    if (mCaseSensitivity == String::CaseInsensitive)
+        String::toLower(wild.data(), wild.size());
+
+    Pattern p;
+    p.pattern = pattern;
+    p.start = -1;
+    p.minLength = 0;
+    p.star = false;
+    const int star = wild.indexOf('*'), question = wild.indexOf('?');
+    const int first = star == -1 ? question : (question == -1 ? star : std::min(star, question));
+    if (first == -1) {
+        p.kind = Exact;
+        p.literal = wild;
+        mExact[Rct::hashBytes(wild.constData(), wild.size())].append(idx);
+    } else if (!first && question == -1 && wild.lastIndexOf('*') == 0) {
+        p.kind = Suffix;
+        p.literal = wild.mid(1);
+        mSuffixes[Rct::hashBytes(p.literal.constData(), p.literal.size())].append(idx);
+        addLength(mSuffixLengths, p.literal.size());
+    } else if (first == wild.size() - 1 && star == first) {
+        p.kind = Prefix;
+        p.literal = wild.left(first);
+        mPrefixes[Rct::hashBytes(p.literal.constData(), p.literal.size())].append(idx);
+        addLength(mPrefixLengths, p.literal.size());
+    } else {
+        p.kind = Automaton;
+        const int last = std::max(wild.lastIndexOf('*'), wild.lastIndexOf('?'));
+        p.literal = wild.left(first);
+        p.suffix = wild.mid(last + 1);
+        mAutomaton.append(idx);
+
+        auto addState = [this, idx]() {
+            if (!(mStates % 64)) {
+                mAdvance.resize(mAdvance.size() + 256);
+                mLoop.append(0);
+                mAccept.append(0);
+            }
+            mStatePattern.append(idx);
+            return mStates++;
+        };
+        int state = addState();
+        p.start = state;
+        for (int i=0; i<wild.size(); ++i) {
+            const char ch = wild.at(i);
+            if (ch == '*') {
+                setBit(mLoop, state);
+                p.star = true;
+                continue;
+            }
+            state = addState();
+            ++p.minLength;
+            uint64_t *advance = mAdvance.data() + (state / 64) * 256;
+            const uint64_t bit = 1ull << (state % 64);
+            if (ch == '?') {
+                for (int c=0; c<256; ++c)
+                    advance[c] |= bit;
+            } else {
+                advance[static_cast<unsigned char>(ch)] |= bit;
+            }
+        }
+        setBit(mAccept, state);
+    }
+    mPatterns.append(std::move(p));
+    return idx;
+}
+
+void GlobSet::clear()
+{
+    mPatterns.clear();
+    mExact.clear();
+    mPrefixes.clear();
+    mSuffixes.clear();
+    mPrefixLengths.clear();
+    mSuffixLengths.clear();
+    mAutomaton.clear();
+    mStates = 0;
+    mAdvance.clear();
+    mLoop.clear();
+    mAccept.clear();
+    mStatePattern.clear();
+}
+
+bool GlobSet::matches(const char *string, int size) const
+{
+    List<int> ret;
+    match(string, size, true, &ret);
+    return !ret.isEmpty();
+}
+
+List<int> GlobSet::matching(const char *string, int size) const
+{
+    List<int> ret;
+    match(string, size, false, &ret);
+    std::sort(ret.begin(), ret.end());
+    return ret;
+}
+
+void GlobSet::lookup(const FlatHash<uint64_t, List<int> > &hash, const char *data, int size, List<int> *ret) const
+{
+    const auto it = hash.find(Rct::hashBytes(data, size));
+    if (it == hash.end())
+        return;
+    for (int idx : it->second) {
+        const String &literal = mPatterns.at(idx).literal;
+        if (literal.size() == size && !memcmp(literal.constData(), data, size))
+            ret->append(idx);
+    }
+}
+
+void GlobSet::match(const char *string, int size, bool any, List<int> *ret) const
+{
+    // folded once for everything, patterns were folded as they came
+    char buffer[256];
+    String folded;
+    if (mCaseSensitivity == String::CaseInsensitive) {
+        char *data = buffer;
+        if (size > static_cast<int>(sizeof(buffer))) {
+            folded.resize(size);
+            data = folded.data();
+        }
+        memcpy(data, string, size);
+        String::toLower(data, size);
+        string = data;
+    }
+
+    if (!mExact.isEmpty()) {
+        lookup(mExact, string, size, ret);
+        if (any && !ret->isEmpty())
+            return;
+    }
+    for (int length : mPrefixLengths) {
+        if (length > size)
+            break;
+        lookup(mPrefixes, string, length, ret);
+        if (any && !ret->isEmpty())
+            return;
+    }
+    for (int length : mSuffixLengths) {
+        if (length > size)
+            break;
+        lookup(mSuffixes, string + size - length, length, ret);
+        if (any && !ret->isEmpty())
+            return;
+    }
+    if (mAutomaton.isEmpty())
+        return;
+
+    const int words = (mStates + 63) / 64;
+    uint64_t stackStates[16];
+    std::unique_ptr<uint64_t[]> heapStates;
+    uint64_t *states = stackStates;
+    if (words > 16) {
+        heapStates.reset(new uint64_t[words]);
+        states = heapStates.get();
+    }
+    memset(states, 0, words * sizeof(uint64_t));
+
+    bool alive = false;
+    for (int idx : mAutomaton) {
+        const Pattern &p = mPatterns.at(idx);
+        if (size < p.minLength || (!p.star && size != p.minLength))
+            continue;
+        if (memcmp(string, p.literal.constData(), p.literal.size())
+            || memcmp(string + size - p.suffix.size(), p.suffix.constData(), p.suffix.size())) {
+            continue;
+        }
+        states[p.start / 64] |= 1ull << (p.start % 64);
+        alive = true;
+    }
+
+    // every state moves on if the character lets it, and stays if it's
+    // after a '*'. What moves on from a pattern's last state lands on the
+    // next one's first, which no character lets in
+    for (int i=0; i<size && alive; ++i) {
+        const uint64_t *advance = mAdvance.data() + static_cast<unsigned char>(string[i]);
+        uint64_t carry = 0, live = 0;
+        for (int w=0; w<words; ++w) {
+            const uint64_t s = states[w];
+            states[w] = (((s << 1) | carry) & advance[w * 256]) | (s & mLoop[w]);
+            carry = s >> 63;
+            live |= states[w];
+        }
+        alive = live;
+    }
+    if (!alive)
+        return;
+
+    for (int w=0; w<words; ++w) {
+        uint64_t accepted = states[w] & mAccept[w];
+        while (accepted) {
+            ret->append(mStatePattern[w * 64 + __builtin_ctzll(accepted)]);
+            if (any)
+                return;
+            accepted &= accepted - 1;
+        }
+    }
+}
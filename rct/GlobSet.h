@@ -0,0 +1,95 @@
+#ifndef GlobSet_h
+#define GlobSet_h
+
+#include <rct/FlatHash.h>
+#include <rct/List.h>
+#include <rct/String.h>
+#include <stdint.h>
+
+// Many Rct::wildCmp() patterns matched together, '*' for any number of
+// characters and '?' for one, against the whole string. Case insensitive
+// means ASCII letters only, like String.
+//
+// Patterns are sorted by shape as they're added. Plain strings, "*suffix"
+// such as "*.o" and "prefix*" are looked up in hashes by what they have to
+// be, one lookup for each length there is of them. The rest share one
+// automaton that follows every pattern at once, a bit per position in a
+// pattern, so a string is read once however many there are. It only
+// starts the ones whose literal prefix, suffix and length fit.
+//
+// add() isn't thread safe, matching is.
+class GlobSet
+{
+public:
+    GlobSet(String::CaseSensitivity cs = String::CaseSensitive)
+        : mCaseSensitivity(cs), mStates(0)
+    {}
+    GlobSet(const List<String> &patterns, String::CaseSensitivity cs = String::CaseSensitive)
+        : mCaseSensitivity(cs), mStates(0)
+    {
+        for (const String &pattern : patterns)
+            add(pattern);
+    }
+
+    String::CaseSensitivity caseSensitivity() const { return mCaseSensitivity; }
+
+    // its index, they're counted from 0 in the order they're added
+    int add(const String &pattern);
+    void clear();
+
+    bool isEmpty() const { return mPatterns.isEmpty(); }
+    int count() const { return mPatterns.size(); }
+    const String &pattern(int idx) const { return mPatterns.at(idx).pattern; }
+
+    bool matches(const char *string, int size) const;
+    bool matches(const String &string) const { return matches(string.constData(), string.size()); }
+    // the indexes of those that match, in order
+    List<int> matching(const char *string, int size) const;
+    List<int> matching(const String &string) const { return matching(string.constData(), string.size()); }
+
+private:
+    // with any, returns as soon as there's one
+    void match(const char *string, int size, bool any, List<int> *ret) const;
+    void lookup(const FlatHash<uint64_t, List<int> > &hash, const char *data, int size, List<int> *ret) const;
+
+    enum Kind {
+        Exact,
+        Prefix,
+        Suffix,
+        Automaton
+    };
+
+    struct Pattern
+    {
+        String pattern;
+        Kind kind;
+        // the part that has to be there as it is, case folded. For
+        // Automaton, what it starts and ends with
+        String literal, suffix;
+        // for Automaton, its first state. It needs at least minLength
+        // characters, exactly that many without a '*'
+        int start, minLength;
+        bool star;
+    };
+
+    const String::CaseSensitivity mCaseSensitivity;
+    List<Pattern> mPatterns;
+
+    // by a hash of their literal, with the lengths there are of them
+    FlatHash<uint64_t, List<int> > mExact, mPrefixes, mSuffixes;
+    List<int> mPrefixLengths, mSuffixLengths;
+
+    // Automaton patterns, by index
+    List<int> mAutomaton;
+    // A pattern of n characters other than '*' has states 0 to n, how
+    // many of them have matched so far. The states are bits in words of
+    // 64. mAdvance has 256 words for each of those, what each character
+    // lets move on from the state before, mLoop the states after a '*'
+    // that any character keeps and mAccept the last states
+    int mStates;
+    List<uint64_t> mAdvance, mLoop, mAccept;
+    // which pattern each state belongs to
+    List<int> mStatePattern;
+};
+
+#endif
@@ -0,0 +1,265 @@
+#include "HostResolver.h"
+#include "EventLoop.h"
+#include "Hash.h"
+#include "Rct.h"
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <string.h>
+#include <sys/types.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/in.h>
+
+namespace {
+
+// runs lookups, starting another thread as long as all of them are busy
+// and there are fewer than MaxThreads so one slow name can't hold up the
+// rest. The threads live as long as the process
+class ResolverThreads
+{
+public:
+    ResolverThreads()
+        : mThreads(0), mIdle(0)
+    {}
+
+    void post(std::function<void()> &&job)
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mJobs.push_back(std::move(job));
+        if (!mIdle && mThreads < MaxThreads) {
+            ++mThreads;
+            std::thread(&ResolverThreads::run, this).detach();
+        } else {
+            mCond.notify_one();
+        }
+    }
+
+private:
+    enum { MaxThreads = 4 };
+
+    void run()
+    {
+        std::unique_lock<std::mutex> lock(mMutex);
+        for (;;) {
+            while (mJobs.empty()) {
+                ++mIdle;
+                mCond.wait(lock);
+                --mIdle;
+            }
+            std::function<void()> job = std::move(mJobs.front());
+            mJobs.pop_front();
+            lock.unlock();
+            job();
+            lock.lock();
+        }
+    }
+
+    std::mutex mMutex;
+    std::condition_variable mCond;
+    std::deque<std::function<void()> > mJobs;
+    int mThreads, mIdle;
+};
+
+struct Waiter
+{
+    EventLoop::WeakPtr loop;
+    std::shared_ptr<HostResolver::Callback> callback;
+};
+
+struct CacheEntry
+{
+    List<HostResolver::Address> addresses;
+    uint64_t expires;
+};
+
+struct ResolverState
+{
+    ResolverState()
+        : positiveTtl(HostResolver::DefaultPositiveTtl), negativeTtl(HostResolver::DefaultNegativeTtl)
+    {}
+
+    std::mutex mutex;
+    Hash<String, CacheEntry> cache;
+    // lookups in progress, everyone asking for the same name meanwhile
+    // waits for the same answer
+    Hash<String, List<Waiter> > pending;
+    int positiveTtl, negativeTtl;
+    ResolverThreads threads;
+};
+
+// never destroyed, the lookup threads may still be using it at exit
+static ResolverState &state()
+{
+    static ResolverState *s = new ResolverState;
+    return *s;
+}
+
+static List<HostResolver::Address> resolve(const String &host)
+{
+    List<HostResolver::Address> ret;
+    addrinfo hints, *res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_ADDRCONFIG;
+    if (getaddrinfo(host.constData(), NULL, &hints, &res) != 0)
+        return ret;
+    for (addrinfo *p = res; p; p = p->ai_next) {
+        if ((p->ai_family != AF_INET && p->ai_family != AF_INET6) || p->ai_addrlen > sizeof(sockaddr_storage))
+            continue;
+        HostResolver::Address address;
+        memset(&address.address, 0, sizeof(address.address));
+        memcpy(&address.address, p->ai_addr, p->ai_addrlen);
+        address.size = p->ai_addrlen;
+        ret.append(address);
+    }
+    freeaddrinfo(res);
+    return ret;
+}
+
+// needs the mutex
+static void store(ResolverState &s, const String &host, const List<HostResolver::Address> &addresses)
+{
+    const int ttl = addresses.isEmpty() ? s.negativeTtl : s.positiveTtl;
+    if (ttl > 0) {
+        CacheEntry &entry = s.cache[host];
+        entry.addresses = addresses;
+        entry.expires = Rct::monoMs() + ttl;
+    }
+}
+
+}
+
+String HostResolver::Address::toString() const
+{
+    char buf[INET6_ADDRSTRLEN];
+    const void *addr;
+    if (family() == AF_INET6) {
+        addr = &reinterpret_cast<const sockaddr_in6 *>(&address)->sin6_addr;
+    } else {
+        addr = &reinterpret_cast<const sockaddr_in *>(&address)->sin_addr;
+    }
+    if (!inet_ntop(family(), addr, buf, sizeof(buf)))
+        return String();
+    return buf;
+}
+
+uint16_t HostResolver::Address::port() const
+{
+    if (family() == AF_INET6)
+        return ntohs(reinterpret_cast<const sockaddr_in6 *>(&address)->sin6_port);
+    return ntohs(reinterpret_cast<const sockaddr_in *>(&address)->sin_port);
+}
+
+void HostResolver::Address::setPort(uint16_t port)
+{
+    if (family() == AF_INET6) {
+        reinterpret_cast<sockaddr_in6 *>(&address)->sin6_port = htons(port);
+    } else {
+        reinterpret_cast<sockaddr_in *>(&address)->sin_port = htons(port);
+    }
+}
+
+bool HostResolver::cached(const String &host, List<Address> &addresses)
+{
+    ResolverState &s = state();
+    std::lock_guard<std::mutex> lock(s.mutex);
+    auto it = s.cache.find(host);
+    if (it == s.cache.end())
+        return false;
+    if (it->second.expires <= Rct::monoMs()) {
+        s.cache.erase(it);
+        return false;
+    }
+    addresses = it->second.addresses;
+    return true;
+}
+
+List<HostResolver::Address> HostResolver::lookupBlocking(const String &host)
+{
+    List<Address> addresses;
+    if (cached(host, addresses))
+        return addresses;
+    addresses = resolve(host);
+    ResolverState &s = state();
+    std::lock_guard<std::mutex> lock(s.mutex);
+    store(s, host, addresses);
+    return addresses;
+}
+
+void HostResolver::lookup(const String &host, Callback &&callback)
+{
+    List<Address> addresses;
+    if (cached(host, addresses)) {
+        callback(addresses);
+        return;
+    }
+    EventLoop::SharedPtr loop = EventLoop::eventLoop();
+    if (!loop) {
+        callback(lookupBlocking(host));
+        return;
+    }
+
+    ResolverState &s = state();
+    {
+        std::lock_guard<std::mutex> lock(s.mutex);
+        List<Waiter> &waiters = s.pending[host];
+        Waiter waiter = { loop, std::make_shared<Callback>(std::move(callback)) };
+        waiters.append(waiter);
+        if (waiters.size() > 1)
+            return;
+    }
+    s.threads.post([host]() {
+            const List<Address> addresses = resolve(host);
+            ResolverState &s = state();
+            List<Waiter> waiters;
+            {
+                std::lock_guard<std::mutex> lock(s.mutex);
+                store(s, host, addresses);
+                auto it = s.pending.find(host);
+                std::swap(waiters, it->second);
+                s.pending.erase(it);
+            }
+            for (const Waiter &waiter : waiters) {
+                if (EventLoop::SharedPtr loop = waiter.loop.lock()) {
+                    const std::shared_ptr<Callback> callback = waiter.callback;
+                    loop->callLater([callback, addresses]() { (*callback)(addresses); });
+                }
+            }
+        });
+}
+
+void HostResolver::reverseLookup(const String &addr, std::function<void(const String &)> &&callback)
+{
+    EventLoop::SharedPtr loop = EventLoop::eventLoop();
+    if (!loop) {
+        callback(Rct::addrLookup(addr));
+        return;
+    }
+    const std::shared_ptr<std::function<void(const String &)> > cb =
+        std::make_shared<std::function<void(const String &)> >(std::move(callback));
+    const EventLoop::WeakPtr weak = loop;
+    state().threads.post([addr, cb, weak]() {
+            const String name = Rct::addrLookup(addr);
+            if (EventLoop::SharedPtr loop = weak.lock())
+                loop->callLater([cb, name]() { (*cb)(name); });
+        });
+}
+
+void HostResolver::setCacheTtl(int positive, int negative)
+{
+    ResolverState &s = state();
+    std::lock_guard<std::mutex> lock(s.mutex);
+    s.positiveTtl = positive;
+    s.negativeTtl = negative;
+}
+
+void HostResolver::clearCache()
+{
+    ResolverState &s = state();
+    std::lock_guard<std::mutex> lock(s.mutex);
+    s.cache.clear();
+}
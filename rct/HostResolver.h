@@ -0,0 +1,52 @@
+#ifndef HOSTRESOLVER_H
+#define HOSTRESOLVER_H
+
+#include <rct/List.h>
+#include <rct/String.h>
+#include <functional>
+#include <sys/socket.h>
+
+// Host name lookups that don't block the event loop. getaddrinfo() and
+// getnameinfo() run on a few helper threads and the answers are delivered
+// on the event loop of the thread that asked. Answers are cached, for a
+// while if something was found and a shorter while if not, the system
+// resolver doesn't tell us the real TTLs.
+class HostResolver
+{
+public:
+    struct Address
+    {
+        sockaddr_storage address;
+        socklen_t size;
+
+        int family() const { return address.ss_family; }
+        // the numeric address
+        String toString() const;
+        uint16_t port() const;
+        void setPort(uint16_t port);
+    };
+    typedef std::function<void(const List<Address> &)> Callback;
+
+    // callback gets every address found for host, nothing if the lookup
+    // failed. A cached answer is given before this returns, as is any
+    // answer when there's no event loop to deliver it on later.
+    static void lookup(const String &host, Callback &&callback);
+    // the same, blocking, for when there's no way around it. Shares the
+    // cache with lookup()
+    static List<Address> lookupBlocking(const String &host);
+    // the name of a numeric address, or addr itself if it has none
+    static void reverseLookup(const String &addr, std::function<void(const String &)> &&callback);
+
+    // false if there's nothing, or nothing current, cached for host
+    static bool cached(const String &host, List<Address> &addresses);
+
+    enum {
+        DefaultPositiveTtl = 60 * 1000,
+        DefaultNegativeTtl = 5 * 1000
+    };
+    // in milliseconds, 0 stops caching that kind of answer
+    static void setCacheTtl(int positive, int negative);
+    static void clearCache();
+};
+
+#endif
@@ -0,0 +1,50 @@
+#include "IoStats.h"
+
+std::atomic<uint64_t> IoStats::sCounters[IoStats::CounterCount];
+std::atomic<uint64_t> IoStats::sSent[256];
+std::atomic<uint64_t> IoStats::sReceived[256];
+
+const char *IoStats::name(Counter counter)
+{
+    switch (counter) {
+    case BytesRead: return "bytesRead";
+    case BytesWritten: return "bytesWritten";
+    case Reads: return "reads";
+    case Writes: return "writes";
+    case ReadsWouldBlock: return "readsWouldBlock";
+    case WritesWouldBlock: return "writesWouldBlock";
+    case PartialWrites: return "partialWrites";
+    case MessagesSent: return "messagesSent";
+    case MessagesReceived: return "messagesReceived";
+    case DecodeTime: return "decodeTimeNs";
+    case CounterCount: break;
+    }
+    return "";
+}
+
+String IoStats::dump()
+{
+    String ret;
+    for (int i = 0; i < CounterCount; ++i) {
+        const Counter counter = static_cast<Counter>(i);
+        ret += String::format<64>("%s: %llu\n", name(counter), static_cast<unsigned long long>(value(counter)));
+    }
+    for (int id = 0; id < 256; ++id) {
+        const uint64_t s = sent(id), r = received(id);
+        if (s || r) {
+            ret += String::format<64>("message %d: sent %llu received %llu\n", id,
+                                      static_cast<unsigned long long>(s), static_cast<unsigned long long>(r));
+        }
+    }
+    return ret;
+}
+
+void IoStats::reset()
+{
+    for (int i = 0; i < CounterCount; ++i)
+        sCounters[i].store(0, std::memory_order_relaxed);
+    for (int id = 0; id < 256; ++id) {
+        sSent[id].store(0, std::memory_order_relaxed);
+        sReceived[id].store(0, std::memory_order_relaxed);
+    }
+}
@@ -0,0 +1,57 @@
+#ifndef IOSTATS_H
+#define IOSTATS_H
+
+#include <rct/String.h>
+#include <atomic>
+#include <stdint.h>
+
+// Process wide totals of what SocketClient::stats() and Connection::stats()
+// count per socket and connection, for finding out where the syscalls come
+// from. The counters are relaxed atomics so adding to them never locks, a
+// dump() taken while sockets are busy is only roughly consistent.
+class IoStats
+{
+public:
+    enum Counter {
+        BytesRead,
+        BytesWritten,
+        // syscalls
+        Reads,
+        Writes,
+        // reads and writes that got EAGAIN
+        ReadsWouldBlock,
+        WritesWouldBlock,
+        // writes the socket only took part of
+        PartialWrites,
+        MessagesSent,
+        MessagesReceived,
+        // nanoseconds spent in Message::create()
+        DecodeTime,
+        CounterCount
+    };
+
+    static void add(Counter counter, uint64_t value = 1)
+    {
+        sCounters[counter].fetch_add(value, std::memory_order_relaxed);
+    }
+    static uint64_t value(Counter counter) { return sCounters[counter].load(std::memory_order_relaxed); }
+    static const char *name(Counter counter);
+
+    // by message id
+    static void messageSent(uint8_t id) { sSent[id].fetch_add(1, std::memory_order_relaxed); }
+    static void messageReceived(uint8_t id) { sReceived[id].fetch_add(1, std::memory_order_relaxed); }
+    static uint64_t sent(uint8_t id) { return sSent[id].load(std::memory_order_relaxed); }
+    static uint64_t received(uint8_t id) { return sReceived[id].load(std::memory_order_relaxed); }
+
+    // a line per counter, then one per message id that has been seen
+    static String dump();
+    static void reset();
+
+private:
+    IoStats();
+
+    static std::atomic<uint64_t> sCounters[CounterCount];
+    static std::atomic<uint64_t> sSent[256], sReceived[256];
+};
+
+#endif
@@ -0,0 +1,432 @@
+#include "JSONParser.h"
+#include <rct/List.h>
+#include <stdlib.h>
+#if defined(__SSE2__)
+#  include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#  include <arm_neon.h>
+#endif
+
+// first byte from p on that ends the plain part of a string, a quote, a
+// backslash, a control character or the start of a multibyte character
+static inline const char *findSpecial(const char *p, const char *end)
+{
+#if defined(__SSE2__)
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    // as signed bytes anything from 0x80 up is below 0x20 as well
+    const __m128i space = _mm_set1_epi8(0x20);
+    while (end - p >= 16) {
+        const __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+        const int mask = _mm_movemask_epi8(_mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(x, quote), _mm_cmpeq_epi8(x, backslash)),
+                                                        _mm_cmplt_epi8(x, space)));
+        if (mask)
+            return p + __builtin_ctz(mask);
+        p += 16;
+    }
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+    const uint8x16_t quote = vdupq_n_u8('"');
+    const uint8x16_t backslash = vdupq_n_u8('\\');
+    const int8x16_t space = vdupq_n_s8(0x20);
+    while (end - p >= 16) {
+        const uint8x16_t x = vld1q_u8(reinterpret_cast<const uint8_t *>(p));
+        const uint8x16_t hit = vorrq_u8(vorrq_u8(vceqq_u8(x, quote), vceqq_u8(x, backslash)),
+                                        vcltq_s8(vreinterpretq_s8_u8(x), space));
+        // four bits per byte
+        const uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(hit), 4)), 0);
+        if (mask)
+            return p + (__builtin_ctzll(mask) >> 2);
+        p += 16;
+    }
+#endif
+    while (p < end) {
+        const unsigned char ch = *p;
+        if (ch == '"' || ch == '\\' || ch < 0x20 || ch >= 0x80)
+            break;
+        ++p;
+    }
+    return p;
+}
+
+// length of the well formed UTF-8 sequence at p, 0 if it isn't one
+static inline int utf8Length(const unsigned char *p, const unsigned char *end)
+{
+    const unsigned char ch = *p;
+    int len;
+    unsigned char min = 0x80, max = 0xbf;
+    if (ch < 0xc2) {
+        return 0;
+    } else if (ch < 0xe0) {
+        len = 2;
+    } else if (ch < 0xf0) {
+        len = 3;
+        if (ch == 0xe0) {
+            min = 0xa0; // overlong
+        } else if (ch == 0xed) {
+            max = 0x9f; // surrogates
+        }
+    } else if (ch < 0xf5) {
+        len = 4;
+        if (ch == 0xf0) {
+            min = 0x90; // overlong
+        } else if (ch == 0xf4) {
+            max = 0x8f; // above U+10FFFF
+        }
+    } else {
+        return 0;
+    }
+    if (end - p < len || p[1] < min || p[1] > max)
+        return 0;
+    for (int i = 2; i < len; ++i) {
+        if ((p[i] & 0xc0) != 0x80)
+            return 0;
+    }
+    return len;
+}
+
+static inline void appendUtf8(String &out, uint32_t code)
+{
+    char buf[4];
+    int len;
+    if (code < 0x80) {
+        buf[0] = static_cast<char>(code);
+        len = 1;
+    } else if (code < 0x800) {
+        buf[0] = static_cast<char>(0xc0 | (code >> 6));
+        buf[1] = static_cast<char>(0x80 | (code & 0x3f));
+        len = 2;
+    } else if (code < 0x10000) {
+        buf[0] = static_cast<char>(0xe0 | (code >> 12));
+        buf[1] = static_cast<char>(0x80 | ((code >> 6) & 0x3f));
+        buf[2] = static_cast<char>(0x80 | (code & 0x3f));
+        len = 3;
+    } else {
+        buf[0] = static_cast<char>(0xf0 | (code >> 18));
+        buf[1] = static_cast<char>(0x80 | ((code >> 12) & 0x3f));
+        buf[2] = static_cast<char>(0x80 | ((code >> 6) & 0x3f));
+        buf[3] = static_cast<char>(0x80 | (code & 0x3f));
+        len = 4;
+    }
+    out.append(buf, len);
+}
+
+static inline int hexValue(char ch)
+{
+    if (ch >= '0' && ch <= '9')
+        return ch - '0';
+    if (ch >= 'a' && ch <= 'f')
+        return ch - 'a' + 10;
+    if (ch >= 'A' && ch <= 'F')
+        return ch - 'A' + 10;
+    return -1;
+}
+
+namespace {
+class Parser
+{
+public:
+    Parser(const char *json, int size, JSONParser::Handler *handler)
+        : mPos(json), mEnd(json + size), mHandler(handler)
+    {}
+
+    JSONParser::Result parse();
+
+    const char *mPos;
+private:
+    enum State {
+        ExpectValue,
+        ExpectKey,
+        AfterValue
+    };
+
+    void skipWhitespace()
+    {
+        while (mPos < mEnd && (*mPos == ' ' || *mPos == '\n' || *mPos == '\r' || *mPos == '\t'))
+            ++mPos;
+    }
+    bool literal(const char *word, int size)
+    {
+        if (mEnd - mPos < size || memcmp(mPos, word, size))
+            return false;
+        mPos += size;
+        return true;
+    }
+    JSONParser::Result parseString(StringView &string);
+    JSONParser::Result parseNumber();
+    bool parseEscape();
+
+    const char *const mEnd;
+    JSONParser::Handler *const mHandler;
+    String mScratch;
+    // '{' and '[' of the containers we're in
+    List<char> mStack;
+};
+}
+
+bool Parser::parseEscape()
+{
+    // mPos is past the backslash
+    if (mPos == mEnd)
+        return false;
+    char ch = *mPos++;
+    switch (ch) {
+    case '"': case '\\': case '/': break;
+    case 'b': ch = '\b'; break;
+    case 'f': ch = '\f'; break;
+    case 'n': ch = '\n'; break;
+    case 'r': ch = '\r'; break;
+    case 't': ch = '\t'; break;
+    case 'u': {
+        uint32_t code = 0;
+        if (mEnd - mPos < 4)
+            return false;
+        for (int i = 0; i < 4; ++i) {
+            const int v = hexValue(mPos[i]);
+            if (v == -1)
+                return false;
+            code = (code << 4) | v;
+        }
+        mPos += 4;
+        if (code >= 0xd800 && code < 0xdc00 && mEnd - mPos >= 6 && mPos[0] == '\\' && mPos[1] == 'u') {
+            uint32_t low = 0;
+            int i;
+            for (i = 2; i < 6; ++i) {
+                const int v = hexValue(mPos[i]);
+                if (v == -1)
+                    break;
+                low = (low << 4) | v;
+            }
+            if (i == 6 && low >= 0xdc00 && low < 0xe000) {
+                code = 0x10000 + ((code - 0xd800) << 10) + (low - 0xdc00);
+                mPos += 6;
+            }
+        }
+        // a lone surrogate is passed on as is
+        appendUtf8(mScratch, code);
+        return true; }
+    default:
+        return false;
+    }
+    mScratch.append(ch);
+    return true;
+}
+
+JSONParser::Result Parser::parseString(StringView &string)
+{
+    // mPos is on the opening quote. Until there's an escape the string is
+    // a view of the input, after that it's decoded into mScratch
+    const char *start = ++mPos;
+    bool copied = false;
+    while (true) {
+        mPos = findSpecial(mPos, mEnd);
+        if (mPos == mEnd)
+            return JSONParser::SyntaxError;
+        const unsigned char ch = *mPos;
+        if (ch == '"') {
+            if (copied) {
+                mScratch.append(start, mPos - start);
+                string = mScratch;
+            } else {
+                string = StringView(start, mPos - start);
+            }
+            ++mPos;
+            return JSONParser::Success;
+        } else if (ch == '\\') {
+            if (!copied) {
+                mScratch.clear();
+                copied = true;
+            }
+            mScratch.append(start, mPos - start);
+            ++mPos;
+            if (!parseEscape())
+                return JSONParser::SyntaxError;
+            start = mPos;
+        } else if (ch < 0x20) {
+            return JSONParser::SyntaxError;
+        } else {
+            const int len = utf8Length(reinterpret_cast<const unsigned char *>(mPos),
+                                       reinterpret_cast<const unsigned char *>(mEnd));
+            if (!len)
+                return JSONParser::InvalidUtf8;
+            mPos += len;
+        }
+    }
+}
+
+JSONParser::Result Parser::parseNumber()
+{
+    const char *start = mPos;
+    const bool negative = *mPos == '-';
+    if (negative)
+        ++mPos;
+    if (mPos == mEnd)
+        return JSONParser::SyntaxError;
+    uint64_t value = 0;
+    int digits = 0;
+    if (*mPos == '0') {
+        ++mPos;
+    } else if (*mPos >= '1' && *mPos <= '9') {
+        while (mPos < mEnd && *mPos >= '0' && *mPos <= '9') {
+            value = value * 10 + (*mPos++ - '0');
+            ++digits;
+        }
+    } else {
+        return JSONParser::SyntaxError;
+    }
+    bool integer = true;
+    if (mPos < mEnd && *mPos == '.') {
+        ++mPos;
+        if (mPos == mEnd || *mPos < '0' || *mPos > '9')
+            return JSONParser::SyntaxError;
+        while (mPos < mEnd && *mPos >= '0' && *mPos <= '9')
+            ++mPos;
+        integer = false;
+    }
+    if (mPos < mEnd && (*mPos == 'e' || *mPos == 'E')) {
+        ++mPos;
+        if (mPos < mEnd && (*mPos == '+' || *mPos == '-'))
+            ++mPos;
+        if (mPos == mEnd || *mPos < '0' || *mPos > '9')
+            return JSONParser::SyntaxError;
+        while (mPos < mEnd && *mPos >= '0' && *mPos <= '9')
+            ++mPos;
+        integer = false;
+    }
+
+    // 19 digits can't have wrapped
+    if (integer && digits <= 19) {
+        if (!negative && value <= static_cast<uint64_t>(INT64_MAX))
+            return mHandler->onInteger(static_cast<int64_t>(value)) ? JSONParser::Success : JSONParser::Stopped;
+        if (negative && value <= static_cast<uint64_t>(INT64_MAX) + 1)
+            return mHandler->onInteger(static_cast<int64_t>(0 - value)) ? JSONParser::Success : JSONParser::Stopped;
+    }
+
+    // the input doesn't have to be terminated, strtod() needs it to be
+    char buf[64];
+    const int len = mPos - start;
+    double d;
+    if (len < static_cast<int>(sizeof(buf))) {
+        memcpy(buf, start, len);
+        buf[len] = '\0';
+        d = strtod(buf, 0);
+    } else {
+        d = strtod(String(start, len).constData(), 0);
+    }
+    return mHandler->onDouble(d) ? JSONParser::Success : JSONParser::Stopped;
+}
+
+JSONParser::Result Parser::parse()
+{
+#define CALL(call)                              \
+    if (!mHandler->call)                        \
+        return JSONParser::Stopped;
+    State state = ExpectValue;
+    StringView string;
+    while (true) {
+        skipWhitespace();
+        if (mPos == mEnd) {
+            if (state == AfterValue && mStack.isEmpty())
+                return JSONParser::Success;
+            return JSONParser::SyntaxError;
+        }
+        switch (state) {
+        case ExpectValue:
+            state = AfterValue;
+            switch (*mPos) {
+            case '{':
+                CALL(onObjectStart());
+                ++mPos;
+                skipWhitespace();
+                if (mPos < mEnd && *mPos == '}') {
+                    ++mPos;
+                    CALL(onObjectEnd());
+                } else {
+                    mStack.append('{');
+                    state = ExpectKey;
+                }
+                break;
+            case '[':
+                CALL(onArrayStart());
+                ++mPos;
+                skipWhitespace();
+                if (mPos < mEnd && *mPos == ']') {
+                    ++mPos;
+                    CALL(onArrayEnd());
+                } else {
+                    mStack.append('[');
+                    state = ExpectValue;
+                }
+                break;
+            case '"': {
+                const JSONParser::Result result = parseString(string);
+                if (result != JSONParser::Success)
+                    return result;
+                CALL(onString(string));
+                break; }
+            case 't':
+                if (!literal("true", 4))
+                    return JSONParser::SyntaxError;
+                CALL(onBoolean(true));
+                break;
+            case 'f':
+                if (!literal("false", 5))
+                    return JSONParser::SyntaxError;
+                CALL(onBoolean(false));
+                break;
+            case 'n':
+                if (!literal("null", 4))
+                    return JSONParser::SyntaxError;
+                CALL(onNull());
+                break;
+            default: {
+                const JSONParser::Result result = parseNumber();
+                if (result != JSONParser::Success)
+                    return result;
+                break; }
+            }
+            break;
+        case ExpectKey: {
+            if (*mPos != '"')
+                return JSONParser::SyntaxError;
+            const JSONParser::Result result = parseString(string);
+            if (result != JSONParser::Success)
+                return result;
+            CALL(onKey(string));
+            skipWhitespace();
+            if (mPos == mEnd || *mPos != ':')
+                return JSONParser::SyntaxError;
+            ++mPos;
+            state = ExpectValue;
+            break; }
+        case AfterValue:
+            if (mStack.isEmpty())
+                return JSONParser::SyntaxError;
+            if (*mPos == ',') {
+                ++mPos;
+                state = mStack.back() == '{' ? ExpectKey : ExpectValue;
+            } else if (*mPos == '}' && mStack.back() == '{') {
+                ++mPos;
+                mStack.pop_back();
+                CALL(onObjectEnd());
+            } else if (*mPos == ']' && mStack.back() == '[') {
+                ++mPos;
+                mStack.pop_back();
+                CALL(onArrayEnd());
+            } else {
+                return JSONParser::SyntaxError;
+            }
+            break;
+        }
+    }
+#undef CALL
+}
+
+JSONParser::Result JSONParser::parse(const char *json, int size, Handler *handler, int *offset)
+{
+    assert(handler);
+    Parser parser(json, size, handler);
+    const Result ret = parser.parse();
+    if (offset)
+        *offset = parser.mPos - json;
+    return ret;
+}
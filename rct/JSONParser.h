@@ -0,0 +1,54 @@
+#ifndef JSONParser_h
+#define JSONParser_h
+
+#include <rct/String.h>
+#include <rct/StringView.h>
+#include <stdint.h>
+
+// Event driven JSON parser, straight from the text to a Handler with no
+// tree in between. Value::fromJSON() is a Handler that builds the Value,
+// anything else can look at each element as it goes by, a huge array of
+// records never has to exist in memory at once. Nesting is tracked in a
+// list, not on the stack, so deep documents can't overflow it.
+class JSONParser
+{
+public:
+    // Every callback returns false to stop the parse. The views are only
+    // valid during the call, strings that had escapes are decoded into a
+    // scratch buffer
+    class Handler
+    {
+    public:
+        virtual ~Handler() {}
+
+        virtual bool onNull() { return true; }
+        virtual bool onBoolean(bool) { return true; }
+        // numbers without fraction or exponent that fit in 64 bits
+        virtual bool onInteger(int64_t) { return true; }
+        virtual bool onDouble(double) { return true; }
+        virtual bool onString(const StringView &) { return true; }
+
+        virtual bool onObjectStart() { return true; }
+        virtual bool onKey(const StringView &) { return true; }
+        virtual bool onObjectEnd() { return true; }
+        virtual bool onArrayStart() { return true; }
+        virtual bool onArrayEnd() { return true; }
+    };
+
+    enum Result {
+        Success,
+        Stopped, // a handler returned false
+        SyntaxError,
+        InvalidUtf8
+    };
+
+    // One complete JSON text. Whitespace may follow it, nothing else.
+    // offset gets where it stopped
+    static Result parse(const char *json, int size, Handler *handler, int *offset = 0);
+    static Result parse(const StringView &json, Handler *handler, int *offset = 0)
+    {
+        return parse(json.constData(), json.size(), handler, offset);
+    }
+};
+
+#endif
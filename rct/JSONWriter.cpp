@@ -0,0 +1,271 @@
+#include "JSONWriter.h"
+#include "Buffer.h"
+#include "Value.h"
+#include <cmath>
+#include <stdio.h>
+#include <stdlib.h>
+#if defined(__SSE2__)
+#  include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#  include <arm_neon.h>
+#endif
+
+// first byte from p on that has to be escaped
+static inline const char *findEscape(const char *p, const char *end)
+{
+#if defined(__SSE2__)
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    // control characters are the ones below 0x20 after flipping the sign
+    // bit, everything from 0x80 up ends up above
+    const __m128i flip = _mm_set1_epi8(static_cast<char>(0x80));
+    const __m128i space = _mm_set1_epi8(static_cast<char>(0x20 ^ 0x80));
+    while (end - p >= 16) {
+        const __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+        const int mask = _mm_movemask_epi8(_mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(x, quote), _mm_cmpeq_epi8(x, backslash)),
+                                                        _mm_cmplt_epi8(_mm_xor_si128(x, flip), space)));
+        if (mask)
+            return p + __builtin_ctz(mask);
+        p += 16;
+    }
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+    const uint8x16_t quote = vdupq_n_u8('"');
+    const uint8x16_t backslash = vdupq_n_u8('\\');
+    const uint8x16_t space = vdupq_n_u8(0x20);
+    while (end - p >= 16) {
+        const uint8x16_t x = vld1q_u8(reinterpret_cast<const uint8_t *>(p));
+        const uint8x16_t hit = vorrq_u8(vorrq_u8(vceqq_u8(x, quote), vceqq_u8(x, backslash)), vcltq_u8(x, space));
+        // four bits per byte
+        const uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(hit), 4)), 0);
+        if (mask)
+            return p + (__builtin_ctzll(mask) >> 2);
+        p += 16;
+    }
+#endif
+    while (p < end) {
+        const unsigned char ch = *p;
+        if (ch == '"' || ch == '\\' || ch < 0x20)
+            break;
+        ++p;
+    }
+    return p;
+}
+
+JSONWriter::JSONWriter(String &out, unsigned int flags)
+    : mFlags(flags), mOut(&out), mBuffer(0), mSink(0), mError(false), mAfterKey(false)
+{
+}
+
+JSONWriter::JSONWriter(Buffer &out, unsigned int flags)
+    : mFlags(flags), mOut(&mChunk), mBuffer(&out), mSink(0), mError(false), mAfterKey(false)
+{
+    mChunk.reserve(ChunkSize + 64);
+}
+
+JSONWriter::JSONWriter(Serializer::Buffer *out, unsigned int flags)
+    : mFlags(flags), mOut(&mChunk), mBuffer(0), mSink(out), mError(false), mAfterKey(false)
+{
+    assert(out);
+    mChunk.reserve(ChunkSize + 64);
+}
+
+bool JSONWriter::flush()
+{
+    if (mOut != &mChunk || mChunk.isEmpty())
+        return !mError;
+    if (mBuffer) {
+        const unsigned int size = mBuffer->size();
+        if (size + mChunk.size() > mBuffer->capacity())
+            mBuffer->reserve(std::max<unsigned int>(mBuffer->capacity() * 2, size + mChunk.size()));
+        mBuffer->resize(size + mChunk.size());
+        memcpy(mBuffer->data() + size, mChunk.constData(), mChunk.size());
+    } else if (!mError && !mSink->write(mChunk.constData(), mChunk.size())) {
+        mError = true;
+    }
+    mChunk.clear();
+    return !mError;
+}
+
+void JSONWriter::newLine(int depth)
+{
+    append('\n');
+    for (int i = 0; i < depth; ++i)
+        append('\t');
+}
+
+void JSONWriter::beforeValue()
+{
+    if (mAfterKey) {
+        mAfterKey = false;
+        return;
+    }
+    if (mStack.isEmpty())
+        return;
+    if (mStack.back())
+        append(',');
+    mStack.back() = true;
+    if (mFlags & Pretty)
+        newLine(mStack.size());
+}
+
+void JSONWriter::end(char ch)
+{
+    assert(!mStack.isEmpty() && !mAfterKey);
+    const bool empty = !mStack.back();
+    mStack.pop_back();
+    if (!empty && mFlags & Pretty)
+        newLine(mStack.size());
+    append(ch);
+}
+
+void JSONWriter::beginObject()
+{
+    beforeValue();
+    append('{');
+    mStack.append(false);
+}
+
+void JSONWriter::endObject()
+{
+    end('}');
+}
+
+void JSONWriter::beginArray()
+{
+    beforeValue();
+    append('[');
+    mStack.append(false);
+}
+
+void JSONWriter::endArray()
+{
+    end(']');
+}
+
+void JSONWriter::key(const StringView &key)
+{
+    assert(!mStack.isEmpty() && !mAfterKey);
+    writeString(key);
+    if (mFlags & Pretty) {
+        append(":\t", 2);
+    } else {
+        append(':');
+    }
+    mAfterKey = true;
+}
+
+void JSONWriter::writeNull()
+{
+    beforeValue();
+    append("null", 4);
+}
+
+void JSONWriter::writeBoolean(bool value)
+{
+    beforeValue();
+    if (value) {
+        append("true", 4);
+    } else {
+        append("false", 5);
+    }
+}
+
+void JSONWriter::writeInteger(int64_t value)
+{
+    beforeValue();
+    char buf[24];
+    append(buf, String::toChars(buf, value));
+}
+
+void JSONWriter::writeDouble(double value)
+{
+    if (!std::isfinite(value)) {
+        writeNull();
+        return;
+    }
+    beforeValue();
+    // the shortest of these that reads back the same
+    char buf[32];
+    int len = snprintf(buf, sizeof(buf), "%.15g", value);
+    if (strtod(buf, 0) != value)
+        len = snprintf(buf, sizeof(buf), "%.17g", value);
+    append(buf, len);
+}
+
+void JSONWriter::writeString(const StringView &value)
+{
+    beforeValue();
+    static const char hex[] = "0123456789abcdef";
+    append('"');
+    const char *p = value.constData();
+    const char *end = p + value.size();
+    while (true) {
+        const char *special = findEscape(p, end);
+        if (special > p)
+            append(p, special - p);
+        if (special == end)
+            break;
+        char escaped[6] = { '\\', 0, 0, 0, 0, 0 };
+        int len = 2;
+        switch (*special) {
+        case '"': escaped[1] = '"'; break;
+        case '\\': escaped[1] = '\\'; break;
+        case '\b': escaped[1] = 'b'; break;
+        case '\f': escaped[1] = 'f'; break;
+        case '\n': escaped[1] = 'n'; break;
+        case '\r': escaped[1] = 'r'; break;
+        case '\t': escaped[1] = 't'; break;
+        default:
+            escaped[1] = 'u';
+            escaped[2] = escaped[3] = '0';
+            escaped[4] = hex[(*special >> 4) & 0xf];
+            escaped[5] = hex[*special & 0xf];
+            len = 6;
+            break;
+        }
+        append(escaped, len);
+        p = special + 1;
+    }
+    append('"');
+}
+
+void JSONWriter::writeRaw(const StringView &json)
+{
+    beforeValue();
+    append(json.constData(), json.size());
+}
+
+void JSONWriter::write(const Value &value)
+{
+    switch (value.type()) {
+    case Value::Type_Boolean: writeBoolean(value.toBool()); break;
+    case Value::Type_Integer: writeInteger(value.toInt64()); break;
+    case Value::Type_Double: writeDouble(value.toDouble()); break;
+    case Value::Type_String: writeString(value.stringRef()); break;
+    case Value::Type_List:
+        beginArray();
+        for (const Value &v : value.listRef())
+            write(v);
+        endArray();
+        break;
+    case Value::Type_Map:
+        beginObject();
+        for (const auto &v : value.mapRef()) {
+            key(v.first);
+            write(v.second);
+        }
+        endObject();
+        break;
+    case Value::Type_Custom:
+        if (std::shared_ptr<Value::Custom> custom = value.toCustom()) {
+            writeRaw(custom->toString());
+            break;
+        }
+        writeNull();
+        break;
+    case Value::Type_Invalid:
+    case Value::Type_Undefined:
+        writeNull();
+        break;
+    }
+}
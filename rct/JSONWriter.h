@@ -0,0 +1,84 @@
+#ifndef JSONWriter_h
+#define JSONWriter_h
+
+#include <rct/Serializer.h>
+#include <rct/String.h>
+#include <rct/StringView.h>
+#include <stdint.h>
+
+class Buffer;
+class Value;
+
+// Writes JSON as it's produced, into a String, a Buffer or a
+// Serializer::Buffer. The String and the Buffer are appended to, so one
+// can be reused for many documents. A Serializer::Buffer gets the text in
+// chunks of ChunkSize, which keeps memory bounded however big the document
+// is, a socket's write queue or a file can be behind it.
+//
+// The calls have to make a well formed document, key() before each value
+// in an object, that's only asserted.
+class JSONWriter
+{
+public:
+    enum Flag {
+        None = 0x0,
+        Pretty = 0x1
+    };
+    enum { ChunkSize = 16 * 1024 };
+
+    JSONWriter(String &out, unsigned int flags = None);
+    JSONWriter(Buffer &out, unsigned int flags = None);
+    JSONWriter(Serializer::Buffer *out, unsigned int flags = None);
+    ~JSONWriter() { flush(); }
+
+    void beginObject();
+    void endObject();
+    void beginArray();
+    void endArray();
+    void key(const StringView &key);
+
+    void writeNull();
+    void writeBoolean(bool value);
+    void writeInteger(int64_t value);
+    // nan and infinity are written as null
+    void writeDouble(double value);
+    void writeString(const StringView &value);
+    // as is, no quotes or escaping
+    void writeRaw(const StringView &json);
+    void write(const Value &value);
+
+    // Hands what's pending to the Serializer::Buffer or Buffer, false
+    // if it refused it then or earlier
+    bool flush();
+    bool hasError() const { return mError; }
+private:
+    JSONWriter(const JSONWriter &) = delete;
+    JSONWriter &operator=(const JSONWriter &) = delete;
+
+    void beforeValue();
+    void newLine(int depth);
+    void append(const char *data, int size)
+    {
+        mOut->append(data, size);
+        if (mOut == &mChunk && mChunk.size() >= ChunkSize)
+            flush();
+    }
+    void append(char ch)
+    {
+        mOut->append(ch);
+        if (mOut == &mChunk && mChunk.size() >= ChunkSize)
+            flush();
+    }
+    void end(char ch);
+
+    const unsigned int mFlags;
+    String *mOut;
+    String mChunk;
+    Buffer *mBuffer;
+    Serializer::Buffer *mSink;
+    bool mError, mAfterKey;
+    // per open container, whether anything has been written to it
+    List<bool> mStack;
+};
+
+#endif
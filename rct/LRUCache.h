@@ -0,0 +1,271 @@
+#ifndef LRUCache_h
+#define LRUCache_h
+
+#include <rct/Rct.h>
+#include <assert.h>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stdint.h>
+#include <tuple>
+#include <unordered_map>
+#include <utility>
+
+// A cache that drops what was used least recently once what it holds costs
+// more than maxCost, cost being whatever insert() is told, bytes or just 1
+// per entry. The recency list goes through the hash table's own entries,
+// so an entry is one allocation and touching or evicting one is O(1).
+//
+// With shards it can be shared by threads, keys are spread over that many
+// tables each with a mutex and an equal part of maxCost, and lookups hand
+// out copies. Without, it takes no locks and find() can hand out pointers.
+template <typename Key, typename Value, typename HashFn = std::hash<Key> >
+class LRUCache
+{
+public:
+    LRUCache(size_t maxCost, int shards = 0)
+        : mShardCount(shards > 0 ? shards : 1), mLocking(shards > 0),
+          mShards(new Shard[mShardCount]), mMaxCost(0), mHits(0), mMisses(0), mEvictions(0)
+    {
+        setMaxCost(maxCost);
+    }
+
+    LRUCache(const LRUCache &) = delete;
+    LRUCache &operator=(const LRUCache &) = delete;
+
+    // evicts right away if it's less than what's held
+    void setMaxCost(size_t maxCost)
+    {
+        mMaxCost = maxCost;
+        for (int i=0; i<mShardCount; ++i) {
+            Shard &shard = mShards[i];
+            std::unique_lock<std::mutex> lock = locker(shard);
+            shard.maxCost = maxCost / mShardCount;
+            evict(shard);
+        }
+    }
+    size_t maxCost() const { return mMaxCost; }
+
+    // replaces what was there for key. Something that costs more than a
+    // shard can hold isn't kept
+    template <typename V>
+    void insert(const Key &key, V &&value, size_t cost = 1)
+    {
+        Shard &shard = shardFor(key);
+        std::unique_lock<std::mutex> lock = locker(shard);
+        if (cost > shard.maxCost) {
+            // it would push out everything else and go too
+            auto it = shard.entries.find(key);
+            if (it != shard.entries.end())
+                erase(shard, it);
+            mEvictions.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        auto inserted = shard.entries.emplace(std::piecewise_construct, std::forward_as_tuple(key), std::forward_as_tuple());
+        Entry &entry = inserted.first->second;
+        if (inserted.second) {
+            entry.key = &inserted.first->first;
+            Rct::LinkedList::insert(&entry, shard.first, shard.last);
+        } else {
+            shard.cost -= entry.cost;
+            Rct::LinkedList::moveToFront(&entry, shard.first, shard.last);
+        }
+        entry.value = std::forward<V>(value);
+        entry.cost = cost;
+        shard.cost += cost;
+        evict(shard);
+    }
+
+    // a copy of what's cached for key, which is now the most recently used
+    bool get(const Key &key, Value &value)
+    {
+        Shard &shard = shardFor(key);
+        std::unique_lock<std::mutex> lock = locker(shard);
+        Entry *entry = lookup(shard, key);
+        if (!entry)
+            return false;
+        value = entry->value;
+        return true;
+    }
+    Value value(const Key &key, const Value &defaultValue = Value(), bool *ok = 0)
+    {
+        Value ret;
+        const bool found = get(key, ret);
+        if (ok)
+            *ok = found;
+        return found ? ret : defaultValue;
+    }
+    // Without shards only, good until the entry is removed or evicted
+    Value *find(const Key &key)
+    {
+        assert(!mLocking);
+        Entry *entry = lookup(mShards[0], key);
+        return entry ? &entry->value : 0;
+    }
+    // doesn't count as a use
+    bool contains(const Key &key) const
+    {
+        const Shard &shard = shardFor(key);
+        std::unique_lock<std::mutex> lock = locker(shard);
+        return shard.entries.count(key);
+    }
+
+    bool remove(const Key &key)
+    {
+        Shard &shard = shardFor(key);
+        std::unique_lock<std::mutex> lock = locker(shard);
+        auto it = shard.entries.find(key);
+        if (it == shard.entries.end())
+            return false;
+        erase(shard, it);
+        return true;
+    }
+    // removes what match returns true for, returns how many
+    int remove(const std::function<bool(const Key &key, const Value &value)> &match)
+    {
+        int count = 0;
+        for (int i=0; i<mShardCount; ++i) {
+            Shard &shard = mShards[i];
+            std::unique_lock<std::mutex> lock = locker(shard);
+            auto it = shard.entries.begin();
+            while (it != shard.entries.end()) {
+                if (match(it->first, it->second.value)) {
+                    it = erase(shard, it);
+                    ++count;
+                } else {
+                    ++it;
+                }
+            }
+        }
+        return count;
+    }
+    void clear()
+    {
+        for (int i=0; i<mShardCount; ++i) {
+            Shard &shard = mShards[i];
+            std::unique_lock<std::mutex> lock = locker(shard);
+            shard.entries.clear();
+            shard.first = shard.last = 0;
+            shard.cost = 0;
+        }
+    }
+
+    int size() const
+    {
+        int count = 0;
+        for (int i=0; i<mShardCount; ++i) {
+            std::unique_lock<std::mutex> lock = locker(mShards[i]);
+            count += mShards[i].entries.size();
+        }
+        return count;
+    }
+    bool isEmpty() const { return !size(); }
+    size_t cost() const
+    {
+        size_t cost = 0;
+        for (int i=0; i<mShardCount; ++i) {
+            std::unique_lock<std::mutex> lock = locker(mShards[i]);
+            cost += mShards[i].cost;
+        }
+        return cost;
+    }
+
+    struct Stats
+    {
+        uint64_t hits, misses, evictions;
+        double hitRatio() const { return hits + misses ? static_cast<double>(hits) / (hits + misses) : 0.; }
+    };
+    Stats stats() const
+    {
+        const Stats stats = {
+            mHits.load(std::memory_order_relaxed),
+            mMisses.load(std::memory_order_relaxed),
+            mEvictions.load(std::memory_order_relaxed)
+        };
+        return stats;
+    }
+    void resetStats()
+    {
+        mHits.store(0, std::memory_order_relaxed);
+        mMisses.store(0, std::memory_order_relaxed);
+        mEvictions.store(0, std::memory_order_relaxed);
+    }
+
+private:
+    struct Entry
+    {
+        Entry()
+            : key(0), cost(0), prev(0), next(0)
+        {}
+
+        const Key *key;
+        Value value;
+        size_t cost;
+        // first is the most recently used
+        Entry *prev, *next;
+    };
+    typedef std::unordered_map<Key, Entry, HashFn> Entries;
+
+    struct Shard
+    {
+        Shard()
+            : first(0), last(0), cost(0), maxCost(0)
+        {}
+
+        mutable std::mutex mutex;
+        Entries entries;
+        Entry *first, *last;
+        size_t cost, maxCost;
+    };
+
+    std::unique_lock<std::mutex> locker(const Shard &shard) const
+    {
+        return mLocking ? std::unique_lock<std::mutex>(shard.mutex) : std::unique_lock<std::mutex>();
+    }
+
+    Shard &shardFor(const Key &key) const
+    {
+        if (mShardCount == 1)
+            return mShards[0];
+        // the table uses the low bits
+        const uint64_t hash = static_cast<uint64_t>(HashFn()(key)) * 0x9e3779b97f4a7c15ull;
+        return mShards[(hash >> 32) % mShardCount];
+    }
+
+    Entry *lookup(Shard &shard, const Key &key)
+    {
+        auto it = shard.entries.find(key);
+        if (it == shard.entries.end()) {
+            mMisses.fetch_add(1, std::memory_order_relaxed);
+            return 0;
+        }
+        mHits.fetch_add(1, std::memory_order_relaxed);
+        Entry *entry = &it->second;
+        Rct::LinkedList::moveToFront(entry, shard.first, shard.last);
+        return entry;
+    }
+
+    typename Entries::iterator erase(Shard &shard, typename Entries::iterator it)
+    {
+        Rct::LinkedList::remove(&it->second, shard.first, shard.last);
+        shard.cost -= it->second.cost;
+        return shard.entries.erase(it);
+    }
+
+    void evict(Shard &shard)
+    {
+        while (shard.cost > shard.maxCost && shard.last) {
+            erase(shard, shard.entries.find(*shard.last->key));
+            mEvictions.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    const int mShardCount;
+    const bool mLocking;
+    std::unique_ptr<Shard[]> mShards;
+    size_t mMaxCost;
+    std::atomic<uint64_t> mHits, mMisses, mEvictions;
+};
+
+#endif
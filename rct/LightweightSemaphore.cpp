@@ -0,0 +1,102 @@
+#include "LightweightSemaphore.h"
+#include "Rct.h"
+#include <algorithm>
+#ifdef OS_Linux
+#  include <linux/futex.h>
+#  include <sys/syscall.h>
+#  include <time.h>
+#  include <unistd.h>
+#endif
+
+enum { SpinCount = 100 };
+
+static inline void relax()
+{
+#if defined(__i386__) || defined(__x86_64__)
+    __builtin_ia32_pause();
+#endif
+}
+
+LightweightSemaphore::LightweightSemaphore(int count)
+    : mCount(count), mWakeups(0)
+{
+}
+
+void LightweightSemaphore::release(int count)
+{
+    const int old = mCount.fetch_add(count, std::memory_order_release);
+    const int waiters = std::min(-old, count);
+    if (waiters <= 0)
+        return;
+    mWakeups.fetch_add(waiters, std::memory_order_release);
+#ifdef OS_Linux
+    syscall(SYS_futex, reinterpret_cast<int *>(&mWakeups), FUTEX_WAKE_PRIVATE, waiters, 0, 0, 0);
+#else
+    std::lock_guard<std::mutex> lock(mMutex);
+    if (waiters == 1) {
+        mCond.notify_one();
+    } else {
+        mCond.notify_all();
+    }
+#endif
+}
+
+bool LightweightSemaphore::wait(int maxTime)
+{
+    // a release() is often only a moment away when producers and
+    // consumers are busy, cheaper than a trip to the kernel and back
+    for (int i = 0; i < SpinCount; ++i) {
+        if (tryAcquire())
+            return true;
+        relax();
+    }
+    if (mCount.fetch_sub(1, std::memory_order_acquire) > 0)
+        return true;
+    if (takeWakeup(maxTime))
+        return true;
+    // timed out, take back our claim unless a release() already counted
+    // on us, then that wakeup is ours
+    int count = mCount.load(std::memory_order_relaxed);
+    while (count < 0) {
+        if (mCount.compare_exchange_weak(count, count + 1, std::memory_order_relaxed))
+            return false;
+    }
+    takeWakeup(-1);
+    return true;
+}
+
+bool LightweightSemaphore::takeWakeup(int maxTime)
+{
+    const uint64_t deadline = maxTime > 0 ? Rct::monoMs() + maxTime : 0;
+#ifndef OS_Linux
+    std::unique_lock<std::mutex> lock(mMutex);
+#endif
+    for (;;) {
+        int wakeups = mWakeups.load(std::memory_order_relaxed);
+        while (wakeups > 0) {
+            if (mWakeups.compare_exchange_weak(wakeups, wakeups - 1, std::memory_order_acquire, std::memory_order_relaxed))
+                return true;
+        }
+        int remaining = -1;
+        if (maxTime >= 0) {
+            const uint64_t now = Rct::monoMs();
+            if (!maxTime || now >= deadline)
+                return false;
+            remaining = static_cast<int>(deadline - now);
+        }
+#ifdef OS_Linux
+        timespec ts;
+        if (remaining >= 0) {
+            ts.tv_sec = remaining / 1000;
+            ts.tv_nsec = (remaining % 1000) * 1000000;
+        }
+        syscall(SYS_futex, reinterpret_cast<int *>(&mWakeups), FUTEX_WAIT_PRIVATE, 0, remaining >= 0 ? &ts : 0, 0, 0);
+#else
+        if (remaining >= 0) {
+            mCond.wait_for(lock, std::chrono::milliseconds(remaining));
+        } else {
+            mCond.wait(lock);
+        }
+#endif
+    }
+}
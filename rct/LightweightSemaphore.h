@@ -0,0 +1,61 @@
+#ifndef LIGHTWEIGHTSEMAPHORE_H
+#define LIGHTWEIGHTSEMAPHORE_H
+
+#include <atomic>
+#include "rct-config.h"
+#ifndef OS_Linux
+#  include <condition_variable>
+#  include <mutex>
+#endif
+
+// Counting semaphore between the threads of this process, unlike Semaphore
+// which is System V and between processes. Taking a count that's there and
+// release() with nobody waiting are one atomic operation each. acquire()
+// spins for a bit before going to sleep on a futex, a mutex and condition
+// variable where there are no futexes.
+class LightweightSemaphore
+{
+public:
+    LightweightSemaphore(int count = 0);
+
+    bool tryAcquire()
+    {
+        int count = mCount.load(std::memory_order_relaxed);
+        while (count > 0) {
+            if (mCount.compare_exchange_weak(count, count - 1, std::memory_order_acquire, std::memory_order_relaxed))
+                return true;
+        }
+        return false;
+    }
+    void acquire() { if (!tryAcquire()) wait(-1); }
+    // maxTime in ms, false if it timed out
+    bool acquire(int maxTime) { return tryAcquire() || wait(maxTime); }
+
+    void release(int count = 1);
+
+    // what could be taken right now
+    int available() const
+    {
+        const int count = mCount.load(std::memory_order_relaxed);
+        return count > 0 ? count : 0;
+    }
+
+private:
+    bool wait(int maxTime);
+    bool takeWakeup(int maxTime);
+
+    // negative while threads are waiting, how many
+    std::atomic<int> mCount;
+    // release()s handed to waiters that haven't woken up for them yet, the
+    // futex word
+    std::atomic<int> mWakeups;
+#ifndef OS_Linux
+    std::mutex mMutex;
+    std::condition_variable mCond;
+#endif
+
+    LightweightSemaphore(const LightweightSemaphore &) = delete;
+    LightweightSemaphore &operator=(const LightweightSemaphore &) = delete;
+};
+
+#endif
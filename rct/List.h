@@ -50,6 +50,11 @@ public:
         Base::push_back(t);
     }
 
+    void append(T &&t)
+    {
+        Base::push_back(std::move(t));
+    }
+
     void prepend(const T &t)
     {
         Base::insert(Base::begin(), t);
@@ -1,16 +1,29 @@
 #include "Log.h"
 #include "Path.h"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <mutex>
+#include <thread>
+#include <vector>
 #include <stdio.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
 #include "StopWatch.h"
+#include "Thread.h"
 #include <stdarg.h>
+#include <sys/uio.h>
 #include <syslog.h>
+#include <unistd.h>
 
 static unsigned int sFlags = 0;
 static StopWatch sStart;
 static Set<std::shared_ptr<LogOutput> > sOutputs;
 static std::mutex sOutputsMutex;
+// sOutputs.size(), so logging with only Log::Async outputs doesn't lock
+static std::atomic<int> sOutputCount(0);
 static int sLevel = 0;
 static const bool sTimedLogs = getenv("RCT_LOG_TIME");
 
@@ -73,6 +86,762 @@ public:
     }
 };
 
+// Log::Async. Records in a thread's ring are 8 byte aligned and never wrap,
+// one that doesn't fit at the end goes to the start, and a Padding record
+// takes up the end when there's room for one. Only the thread holding
+// AsyncLog::drainMutex reads them
+struct LogRecord
+{
+    enum { Padding = 0xffffffff };
+
+    uint32_t size;
+    int32_t level;
+    // the order they were logged in, across threads
+    uint64_t seq;
+    int64_t time;
+    // the LogSite of a binary one, whose arguments the data is
+    uint32_t site;
+    uint32_t unused;
+
+    const char *data() const { return reinterpret_cast<const char *>(this + 1); }
+    uint32_t span() const { return (sizeof(LogRecord) + size + 7) & ~7u; }
+};
+
+struct LogRing
+{
+    enum { Size = Log::AsyncRingSize, Mask = Size - 1, MaxRecord = Size / 2 };
+
+    LogRing()
+        : head(0), tail(0), dropped(0), orphaned(false)
+    {}
+
+    bool push(int level, unsigned int site, const char *msg, int len, uint32_t span);
+    // the first record from pos on, 0 if there isn't one. pos moves past
+    // padding
+    const LogRecord *peek(uint64_t &pos) const;
+
+    // written by the thread that owns it
+    std::atomic<uint64_t> head;
+    char headPadding[64 - sizeof(std::atomic<uint64_t>)];
+    // written by whoever drains it
+    std::atomic<uint64_t> tail;
+    char tailPadding[64 - sizeof(std::atomic<uint64_t>)];
+    std::atomic<unsigned int> dropped;
+    // its thread has exited, it's deleted once it's empty
+    std::atomic<bool> orphaned;
+    alignas(8) char data[Size];
+};
+static_assert(!(LogRing::Size & LogRing::Mask), "Log::AsyncRingSize has to be a power of two");
+
+static std::atomic<uint64_t> sSequence(0);
+
+bool LogRing::push(int level, unsigned int site, const char *msg, int len, uint32_t span)
+{
+    const uint64_t pos = head.load(std::memory_order_relaxed);
+    const uint32_t toEnd = Size - (pos & Mask);
+    const uint32_t skip = toEnd < span ? toEnd : 0;
+    if (pos + skip + span - tail.load(std::memory_order_acquire) > Size)
+        return false;
+    if (skip >= sizeof(LogRecord))
+        reinterpret_cast<LogRecord *>(data + (pos & Mask))->size = LogRecord::Padding;
+    LogRecord *record = reinterpret_cast<LogRecord *>(data + ((pos + skip) & Mask));
+    record->size = len;
+    record->level = level;
+    record->time = time(0);
+    record->site = site;
+    record->seq = sSequence.fetch_add(1, std::memory_order_relaxed);
+    memcpy(record + 1, msg, len);
+    head.store(pos + skip + span, std::memory_order_release);
+    return true;
+}
+
+const LogRecord *LogRing::peek(uint64_t &pos) const
+{
+    const uint64_t end = head.load(std::memory_order_acquire);
+    while (pos != end) {
+        const uint32_t toEnd = Size - (pos & Mask);
+        if (toEnd >= sizeof(LogRecord)) {
+            const LogRecord *record = reinterpret_cast<const LogRecord *>(data + (pos & Mask));
+            if (record->size != LogRecord::Padding)
+                return record;
+        }
+        pos += toEnd;
+    }
+    return 0;
+}
+
+// Binary logging. A record's data is its arguments, a count and then each
+// one's LogArg::Type and value, 8 bytes for numbers and pointers, a 32 bit
+// size and the bytes for strings
+std::atomic<unsigned int> LogSite::sGeneration(1);
+static std::mutex sSitesMutex;
+// by id - 1
+static List<LogSite *> sSites;
+
+// a Log::Binary file is BinaryMagic, then frames of a type and a size,
+// BinarySite ones with a site's id, level, line, file and format and
+// BinaryRecord ones with a LogRecord
+static const char BinaryMagic[8] = { 'R', 'C', 'T', 'B', 'L', 'O', 'G', '1' };
+enum { BinarySite = 1, BinaryRecord = 2 };
+
+void LogSite::invalidateAll()
+{
+    sGeneration.fetch_add(1, std::memory_order_release);
+}
+
+bool LogSite::refresh()
+{
+    const unsigned int generation = sGeneration.load(std::memory_order_acquire);
+    const bool enabled = testLog(mLevel);
+    mState.store(generation << 1 | enabled, std::memory_order_relaxed);
+    return enabled;
+}
+
+unsigned int LogSite::registerSite()
+{
+    std::lock_guard<std::mutex> lock(sSitesMutex);
+    unsigned int id = mId.load(std::memory_order_relaxed);
+    if (!id) {
+        sSites.append(this);
+        id = sSites.size();
+        mId.store(id, std::memory_order_release);
+    }
+    return id;
+}
+
+static String encodeLogArgs(std::initializer_list<LogArg> args)
+{
+    int size = 1;
+    for (const LogArg &arg : args)
+        size += 1 + (arg.type == LogArg::Chars ? sizeof(uint32_t) + arg.chars.size : sizeof(uint64_t));
+    String ret(size, '\0');
+    char *out = ret.data();
+    *out++ = static_cast<char>(std::min<size_t>(args.size(), 255));
+    int count = 0;
+    for (const LogArg &arg : args) {
+        if (++count > 255)
+            break;
+        *out++ = static_cast<char>(arg.type);
+        if (arg.type == LogArg::Chars) {
+            memcpy(out, &arg.chars.size, sizeof(uint32_t));
+            memcpy(out + sizeof(uint32_t), arg.chars.data, arg.chars.size);
+            out += sizeof(uint32_t) + arg.chars.size;
+        } else {
+            // the union's 8 bytes, whichever member it is
+            memcpy(out, &arg.u, sizeof(uint64_t));
+            out += sizeof(uint64_t);
+        }
+    }
+    return ret;
+}
+
+// Walks the format like printf() would, each conversion formatted with
+// snprintf() from the next argument, converted to what the conversion
+// wants. Length modifiers are dropped, the arguments are all as wide as
+// they get. Missing arguments come out as <?>
+static void formatLogArgs(String &out, const char *format, const char *args, int size)
+{
+    const char *const end = args + size;
+    int remaining = size ? static_cast<unsigned char>(*args++) : 0;
+    auto next = [&](LogArg::Type &type, uint64_t &value, const char *&chars, uint32_t &length) {
+        if (!remaining || args >= end)
+            return false;
+        --remaining;
+        type = static_cast<LogArg::Type>(*args++);
+        if (type == LogArg::Chars) {
+            if (end - args < static_cast<int>(sizeof(uint32_t)))
+                return false;
+            memcpy(&length, args, sizeof(uint32_t));
+            chars = args + sizeof(uint32_t);
+            args += sizeof(uint32_t) + length;
+            return args <= end;
+        }
+        if (end - args < static_cast<int>(sizeof(uint64_t)))
+            return false;
+        memcpy(&value, args, sizeof(uint64_t));
+        args += sizeof(uint64_t);
+        return true;
+    };
+    auto integer = [](LogArg::Type type, uint64_t value) -> int64_t {
+        if (type == LogArg::Double) {
+            double d;
+            memcpy(&d, &value, sizeof(d));
+            return static_cast<int64_t>(d);
+        }
+        return static_cast<int64_t>(value);
+    };
+
+    const char *literal = format;
+    while (*format) {
+        if (*format != '%') {
+            ++format;
+            continue;
+        }
+        out.append(literal, format - literal);
+        const char *spec = format++;
+        if (*format == '%') {
+            out.append('%');
+            literal = ++format;
+            continue;
+        }
+        // flags, width and precision are kept, a * takes an argument
+        String conversion(spec, 1);
+        LogArg::Type type;
+        uint64_t value = 0;
+        const char *chars = 0;
+        uint32_t length = 0;
+        bool ok = true;
+        while (*format && strchr("-+ #0123456789.*", *format)) {
+            if (*format == '*') {
+                if (next(type, value, chars, length) && type != LogArg::Chars) {
+                    conversion += String::number(integer(type, value));
+                } else {
+                    ok = false;
+                }
+            } else {
+                conversion.append(*format);
+            }
+            ++format;
+        }
+        while (*format && strchr("hlLqjzt", *format))
+            ++format;
+        const char c = *format;
+        if (c)
+            ++format;
+        literal = format;
+        if (!c || c == 'n')
+            continue;
+        if (!ok || !next(type, value, chars, length)) {
+            out += "<?>";
+            continue;
+        }
+        char buf[512];
+        int w = -1;
+        switch (c) {
+        case 'd': case 'i':
+            if (type == LogArg::Chars)
+                break;
+            conversion += "lld";
+            w = snprintf(buf, sizeof(buf), conversion.constData(), static_cast<long long>(integer(type, value)));
+            break;
+        case 'u': case 'o': case 'x': case 'X':
+            if (type == LogArg::Chars)
+                break;
+            conversion += "ll";
+            conversion.append(c);
+            w = snprintf(buf, sizeof(buf), conversion.constData(), static_cast<unsigned long long>(integer(type, value)));
+            break;
+        case 'c':
+            if (type == LogArg::Chars)
+                break;
+            conversion.append(c);
+            w = snprintf(buf, sizeof(buf), conversion.constData(), static_cast<int>(integer(type, value)));
+            break;
+        case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A': {
+            if (type == LogArg::Chars)
+                break;
+            double d;
+            if (type == LogArg::Double) {
+                memcpy(&d, &value, sizeof(d));
+            } else if (type == LogArg::Signed) {
+                d = static_cast<int64_t>(value);
+            } else {
+                d = value;
+            }
+            conversion.append(c);
+            w = snprintf(buf, sizeof(buf), conversion.constData(), d);
+            break; }
+        case 'p':
+            conversion.append(c);
+            w = snprintf(buf, sizeof(buf), conversion.constData(), reinterpret_cast<void *>(static_cast<uintptr_t>(value)));
+            break;
+        case 's':
+            if (type != LogArg::Chars)
+                break;
+            if (conversion.size() == 1) {
+                // the common case, and strings longer than buf
+                out.append(chars, length);
+                w = 0;
+            } else {
+                // the precision, if any, is applied to the string's own length
+                const int precision = conversion.indexOf('.');
+                int max = length;
+                if (precision != -1) {
+                    max = std::min<int>(length, atoi(conversion.constData() + precision + 1));
+                    conversion.truncate(precision);
+                }
+                conversion += ".*s";
+                w = snprintf(buf, sizeof(buf), conversion.constData(), max, chars);
+            }
+            break;
+        default:
+            break;
+        }
+        if (w == -1) {
+            out += "<?>";
+        } else if (w > 0) {
+            out.append(buf, std::min<int>(w, sizeof(buf) - 1));
+        }
+    }
+    out.append(literal, format - literal);
+}
+
+static void formatLogRecord(String &out, unsigned int site, const char *data, int size)
+{
+    const char *format;
+    {
+        std::lock_guard<std::mutex> lock(sSitesMutex);
+        format = site && static_cast<int>(site) <= sSites.size() ? sSites[site - 1]->format() : 0;
+    }
+    if (format)
+        formatLogArgs(out, format, data, size);
+}
+
+// a BinarySite frame
+static String siteDefinition(unsigned int id)
+{
+    const LogSite *site;
+    {
+        std::lock_guard<std::mutex> lock(sSitesMutex);
+        site = sSites[id - 1];
+    }
+    const int fileSize = strlen(site->file()) + 1, formatSize = strlen(site->format()) + 1;
+    const uint32_t header[] = { BinarySite, static_cast<uint32_t>(3 * sizeof(uint32_t) + fileSize + formatSize),
+                                id, static_cast<uint32_t>(site->level()), static_cast<uint32_t>(site->line()) };
+    String ret(reinterpret_cast<const char *>(header), sizeof(header));
+    ret.append(site->file(), fileSize);
+    ret.append(site->format(), formatSize);
+    return ret;
+}
+
+class AsyncLog;
+static LogRing *createRing(AsyncLog *async);
+static void orphanRing(void *ptr);
+
+class AsyncLog
+{
+public:
+    enum { MaxBatch = 256 };
+
+    struct Sink
+    {
+        // -1 for syslog
+        int fd;
+        int level;
+        bool owned;
+        // records as they are, Log::Binary
+        bool binary;
+    };
+
+    AsyncLog(const List<Sink> &sinks, bool block);
+    ~AsyncLog();
+
+    // site is 0 for text and a LogSite::id() for the arguments of one
+    void log(int level, unsigned int site, const char *data, int len);
+    bool testLog(int level) const { return level >= 0 && level <= mLevel; }
+    // everything up to what has been logged by now
+    void flush();
+
+private:
+    LogRing *localRing();
+    void run();
+    // writes a batch, true if there was anything to write. The caller
+    // holds mDrainMutex
+    bool drain();
+    bool pending();
+    void write(const LogRecord *const *records, int count);
+    void writeBinary(const Sink &sink, const LogRecord *const *records, int count);
+    void wake();
+
+    const List<Sink> mSinks;
+    const bool mBlock;
+    int mLevel;
+    const unsigned int mGeneration;
+    // those draining take a copy
+    List<LogRing *> mRings;
+    List<LogRing *> mSnapshot;
+    uint64_t mWritten;
+    // the sites the binary sink has had
+    List<bool> mSitesWritten;
+
+    std::timed_mutex mDrainMutex;
+    std::mutex mMutex;
+    std::condition_variable mCondition;
+    std::atomic<bool> mSleeping, mStop;
+    std::thread mThread;
+
+    friend LogRing *createRing(AsyncLog *async);
+    friend void orphanRing(void *ptr);
+};
+
+static std::atomic<AsyncLog *> sAsync(0);
+// guards AsyncLog::mRings, and AsyncLog going away
+static std::mutex sRingsMutex;
+static unsigned int sAsyncGeneration = 0;
+
+// what the thread logs into, and for which AsyncLog. Owned by the thread,
+// the pthread key is there to get told when it exits
+struct LocalRing
+{
+    LogRing *ring;
+    unsigned int generation;
+};
+static __thread LocalRing *sLocalRing = 0;
+static std::once_flag sRingKeyOnce;
+static pthread_key_t sRingKey;
+
+static void orphanRing(void *ptr)
+{
+    LocalRing *local = static_cast<LocalRing *>(ptr);
+    {
+        std::lock_guard<std::mutex> lock(sRingsMutex);
+        AsyncLog *async = sAsync.load();
+        if (async && local->generation == async->mGeneration)
+            local->ring->orphaned.store(true, std::memory_order_release);
+    }
+    sLocalRing = 0;
+    delete local;
+}
+
+static LogRing *createRing(AsyncLog *async)
+{
+    std::call_once(sRingKeyOnce, []() { pthread_key_create(&sRingKey, orphanRing); });
+    LogRing *ring = new LogRing;
+    {
+        std::lock_guard<std::mutex> lock(sRingsMutex);
+        async->mRings.append(ring);
+    }
+    LocalRing *local = sLocalRing;
+    if (!local) {
+        local = new LocalRing;
+        pthread_setspecific(sRingKey, local);
+        sLocalRing = local;
+    }
+    local->ring = ring;
+    local->generation = async->mGeneration;
+    return ring;
+}
+
+inline LogRing *AsyncLog::localRing()
+{
+    const LocalRing *local = sLocalRing;
+    return local && local->generation == mGeneration ? local->ring : createRing(this);
+}
+
+AsyncLog::AsyncLog(const List<Sink> &sinks, bool block)
+    : mSinks(sinks), mBlock(block), mLevel(-1), mGeneration(++sAsyncGeneration), mWritten(0),
+      mSleeping(false), mStop(false)
+{
+    for (const Sink &sink : mSinks)
+        mLevel = std::max(mLevel, sink.level);
+    mThread = std::thread([this]() {
+            Thread::setCurrentName("AsyncLog");
+            run();
+        });
+}
+
+AsyncLog::~AsyncLog()
+{
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mStop.store(true);
+        mCondition.notify_one();
+    }
+    mThread.join();
+    flush();
+    std::lock_guard<std::mutex> lock(sRingsMutex);
+    for (LogRing *ring : mRings)
+        delete ring;
+    for (const Sink &sink : mSinks) {
+        if (sink.fd == -1) {
+            ::closelog();
+        } else if (sink.owned) {
+            ::close(sink.fd);
+        }
+    }
+}
+
+void AsyncLog::log(int level, unsigned int site, const char *msg, int len)
+{
+    if (!testLog(level))
+        return;
+    LogRing *ring = localRing();
+    const uint32_t span = (sizeof(LogRecord) + len + 7) & ~7u;
+    if (span > LogRing::MaxRecord) {
+        // too big for a ring, written right away after what's there
+        std::vector<uint64_t> buffer((sizeof(LogRecord) + len + 7) / 8);
+        LogRecord *record = reinterpret_cast<LogRecord *>(buffer.data());
+        record->size = len;
+        record->level = level;
+        record->time = time(0);
+        record->site = site;
+        memcpy(record + 1, msg, len);
+        std::lock_guard<std::timed_mutex> lock(mDrainMutex);
+        while (drain()) {}
+        record->seq = sSequence.fetch_add(1, std::memory_order_relaxed);
+        const LogRecord *records[] = { record };
+        write(records, 1);
+        return;
+    }
+    while (!ring->push(level, site, msg, len, span)) {
+        if (!mBlock) {
+            ring->dropped.fetch_add(1, std::memory_order_relaxed);
+            break;
+        }
+        wake();
+        std::this_thread::sleep_for(std::chrono::microseconds(100));
+    }
+    wake();
+}
+
+inline void AsyncLog::wake()
+{
+    // against the writer's store to mSleeping and its look at the rings
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (mSleeping.load(std::memory_order_relaxed)) {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mCondition.notify_one();
+    }
+}
+
+void AsyncLog::run()
+{
+    while (!mStop.load()) {
+        bool wrote;
+        {
+            std::lock_guard<std::timed_mutex> lock(mDrainMutex);
+            wrote = drain();
+        }
+        if (wrote)
+            continue;
+        std::unique_lock<std::mutex> lock(mMutex);
+        mSleeping.store(true, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        // the timeout is for deleting the rings of threads that are gone
+        if (!mStop.load() && !pending())
+            mCondition.wait_for(lock, std::chrono::seconds(1));
+        mSleeping.store(false, std::memory_order_relaxed);
+    }
+}
+
+bool AsyncLog::pending()
+{
+    std::lock_guard<std::mutex> lock(sRingsMutex);
+    for (const LogRing *ring : mRings) {
+        if (ring->head.load(std::memory_order_relaxed) != ring->tail.load(std::memory_order_relaxed)
+            || ring->dropped.load(std::memory_order_relaxed)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool AsyncLog::drain()
+{
+    {
+        std::lock_guard<std::mutex> lock(sRingsMutex);
+        for (int i = 0; i < mRings.size(); ) {
+            LogRing *ring = mRings[i];
+            if (ring->orphaned.load(std::memory_order_acquire)
+                && ring->head.load(std::memory_order_relaxed) == ring->tail.load(std::memory_order_relaxed)
+                && !ring->dropped.load(std::memory_order_relaxed)) {
+                mRings.removeAt(i);
+                delete ring;
+            } else {
+                ++i;
+            }
+        }
+        mSnapshot = mRings;
+    }
+
+    struct Cursor
+    {
+        LogRing *ring;
+        uint64_t pos;
+        const LogRecord *record;
+    };
+    Cursor cursors[64];
+    const LogRecord *batch[MaxBatch];
+    int count = 0;
+    unsigned int dropped = 0;
+    // a round of up to 64 rings at a time, there aren't usually that many
+    for (int first = 0; first < mSnapshot.size(); first += 64) {
+        int rings = 0;
+        for (int i = first; i < mSnapshot.size() && rings < 64; ++i) {
+            Cursor &cursor = cursors[rings++];
+            cursor.ring = mSnapshot[i];
+            cursor.pos = cursor.ring->tail.load(std::memory_order_relaxed);
+            cursor.record = cursor.ring->peek(cursor.pos);
+            dropped += cursor.ring->dropped.exchange(0, std::memory_order_relaxed);
+        }
+        while (count < MaxBatch) {
+            Cursor *next = 0;
+            for (int i = 0; i < rings; ++i) {
+                if (cursors[i].record && (!next || cursors[i].record->seq < next->record->seq))
+                    next = cursors + i;
+            }
+            if (!next)
+                break;
+            batch[count++] = next->record;
+            next->pos += next->record->span();
+            next->record = next->ring->peek(next->pos);
+        }
+        if (count) {
+            write(batch, count);
+            mWritten = batch[count - 1]->seq;
+            for (int i = 0; i < rings; ++i)
+                cursors[i].ring->tail.store(cursors[i].pos, std::memory_order_release);
+        }
+        if (count == MaxBatch)
+            break;
+    }
+    if (dropped) {
+        const String msg = String::format<64>("Dropped %u log messages, the log couldn't keep up", dropped);
+        std::vector<uint64_t> buffer((sizeof(LogRecord) + msg.size() + 7) / 8);
+        LogRecord *record = reinterpret_cast<LogRecord *>(buffer.data());
+        record->size = msg.size();
+        record->level = Error;
+        record->time = time(0);
+        memcpy(record + 1, msg.constData(), msg.size());
+        const LogRecord *records[] = { record };
+        write(records, 1);
+    }
+    return count || dropped;
+}
+
+static void writeAll(int fd, iovec *iov, int count)
+{
+    while (count) {
+        ssize_t w;
+        eintrwrap(w, ::writev(fd, iov, std::min(count, IOV_MAX)));
+        if (w < 0)
+            return;
+        while (count && static_cast<size_t>(w) >= iov->iov_len) {
+            w -= iov->iov_len;
+            ++iov;
+            --count;
+        }
+        if (count) {
+            iov->iov_base = static_cast<char *>(iov->iov_base) + w;
+            iov->iov_len -= w;
+        }
+    }
+}
+
+void AsyncLog::write(const LogRecord *const *records, int count)
+{
+    // binary ones are formatted here, unless every sink takes them as
+    // they are
+    String formatted[MaxBatch];
+    bool text = false;
+    for (const Sink &sink : mSinks)
+        text = text || !sink.binary;
+    if (text) {
+        for (int i = 0; i < count; ++i) {
+            if (records[i]->site)
+                formatLogRecord(formatted[i], records[i]->site, records[i]->data(), records[i]->size);
+        }
+    }
+    // one strftime() per second rather than per line
+    String stamps[MaxBatch];
+    int stampIndex[MaxBatch];
+    int stampCount = 0;
+    if (sTimedLogs) {
+        int64_t last = -1;
+        for (int i = 0; i < count; ++i) {
+            if (records[i]->time != last) {
+                last = records[i]->time;
+                stamps[stampCount++] = String::formatTime(last, String::Time) + ' ';
+            }
+            stampIndex[i] = stampCount - 1;
+        }
+    }
+    static char newline = '\n';
+    iovec iov[MaxBatch * 3];
+    for (const Sink &sink : mSinks) {
+        if (sink.binary) {
+            writeBinary(sink, records, count);
+            continue;
+        }
+        if (sink.fd == -1) {
+            for (int i = 0; i < count; ++i) {
+                const LogRecord *record = records[i];
+                if (record->level > sink.level)
+                    continue;
+                if (record->site) {
+                    ::syslog(LOG_NOTICE, "%s", formatted[i].constData());
+                } else {
+                    ::syslog(LOG_NOTICE, "%.*s", static_cast<int>(record->size), record->data());
+                }
+            }
+            continue;
+        }
+        int n = 0;
+        for (int i = 0; i < count; ++i) {
+            const LogRecord *record = records[i];
+            if (record->level > sink.level)
+                continue;
+            if (sTimedLogs) {
+                const String &stamp = stamps[stampIndex[i]];
+                iov[n].iov_base = const_cast<char *>(stamp.constData());
+                iov[n++].iov_len = stamp.size();
+            }
+            if (record->site) {
+                iov[n].iov_base = const_cast<char *>(formatted[i].constData());
+                iov[n++].iov_len = formatted[i].size();
+            } else {
+                iov[n].iov_base = const_cast<char *>(record->data());
+                iov[n++].iov_len = record->size;
+            }
+            iov[n].iov_base = &newline;
+            iov[n++].iov_len = 1;
+        }
+        if (n)
+            writeAll(sink.fd, iov, n);
+    }
+}
+
+void AsyncLog::writeBinary(const Sink &sink, const LogRecord *const *records, int count)
+{
+    // a site's definition goes before its first record
+    String definitions[MaxBatch];
+    uint32_t frames[MaxBatch][2];
+    iovec iov[MaxBatch * 3];
+    int n = 0;
+    for (int i = 0; i < count; ++i) {
+        const LogRecord *record = records[i];
+        if (record->level > sink.level)
+            continue;
+        if (record->site) {
+            if (mSitesWritten.size() <= static_cast<int>(record->site))
+                mSitesWritten.resize(record->site + 1, false);
+            if (!mSitesWritten[record->site]) {
+                mSitesWritten[record->site] = true;
+                definitions[i] = siteDefinition(record->site);
+                iov[n].iov_base = const_cast<char *>(definitions[i].constData());
+                iov[n++].iov_len = definitions[i].size();
+            }
+        }
+        frames[i][0] = BinaryRecord;
+        frames[i][1] = sizeof(LogRecord) + record->size;
+        iov[n].iov_base = frames[i];
+        iov[n++].iov_len = sizeof(frames[i]);
+        iov[n].iov_base = const_cast<LogRecord *>(record);
+        iov[n++].iov_len = sizeof(LogRecord) + record->size;
+    }
+    if (n)
+        writeAll(sink.fd, iov, n);
+}
+
+void AsyncLog::flush()
+{
+    const uint64_t end = sSequence.load();
+    std::unique_lock<std::timed_mutex> lock(mDrainMutex, std::defer_lock);
+    // the writer may be stuck, or be what crashed
+    lock.try_lock_for(std::chrono::seconds(1));
+    while (drain() && mWritten + 1 < end) {}
+}
+
 void restartTime()
 {
     sStart.restart();
@@ -126,14 +895,19 @@ static void log(int level, const char *format, va_list v)
     va_end(v2);
 }
 
-void logDirect(int level, const char *msg, int len)
+// the LogOutputs, with async those added by hand, if any
+static void logOutputs(int level, const char *msg, int len, const AsyncLog *async)
 {
+    if (async && !sOutputCount.load(std::memory_order_relaxed))
+        return;
     Set<std::shared_ptr<LogOutput> > logs;
     {
         std::lock_guard<std::mutex> lock(sOutputsMutex);
         logs = sOutputs;
     }
     if (logs.isEmpty()) {
+        if (async)
+            return;
         printf("%s\n", msg);
     } else {
         for (const auto &output : logs) {
@@ -144,6 +918,35 @@ void logDirect(int level, const char *msg, int len)
     }
 }
 
+void logDirect(int level, const char *msg, int len)
+{
+    AsyncLog *async = sAsync.load(std::memory_order_acquire);
+    if (async)
+        async->log(level, 0, msg, len);
+    logOutputs(level, msg, len, async);
+}
+
+void logBinary(LogSite &site, std::initializer_list<LogArg> args)
+{
+    const unsigned int id = site.id() ? site.id() : site.registerSite();
+    const String data = encodeLogArgs(args);
+    AsyncLog *async = sAsync.load(std::memory_order_acquire);
+    String text;
+    if (async) {
+        if (sizeof(LogRecord) + data.size() <= LogRing::MaxRecord) {
+            async->log(site.level(), id, data.constData(), data.size());
+        } else {
+            formatLogArgs(text, site.format(), data.constData(), data.size());
+            async->log(site.level(), 0, text.constData(), text.size());
+        }
+        if (!sOutputCount.load(std::memory_order_relaxed))
+            return;
+    }
+    if (text.isEmpty())
+        formatLogArgs(text, site.format(), data.constData(), data.size());
+    logOutputs(site.level(), text.constData(), text.size(), async);
+}
+
 void log(const std::function<void(const std::shared_ptr<LogOutput> &)> &func)
 {
     Set<std::shared_ptr<LogOutput> > logs;
@@ -198,9 +1001,12 @@ void error(const char *format, ...)
 
 bool testLog(int level)
 {
+    const AsyncLog *async = sAsync.load(std::memory_order_acquire);
+    if (async && async->testLog(level))
+        return true;
     std::lock_guard<std::mutex> lock(sOutputsMutex);
     if (sOutputs.isEmpty())
-        return true;
+        return !async;
     for (const auto &output : sOutputs) {
         if (output->testLog(level))
             return true;
@@ -213,11 +1019,56 @@ int logLevel()
     return sLevel;
 }
 
+static void rotateLogFile(const Path &file, unsigned int flags)
+{
+    if (!(flags & (Log::Append|Log::DontRotate)) && file.exists()) {
+        int i = 0;
+        while (true) {
+            const Path rotated = String::format<64>("%s.%d", file.constData(), ++i);
+            if (!rotated.exists()) {
+                if (rename(file.constData(), rotated.constData())) {
+                    error() << "Couldn't rotate log file" << file << "to" << rotated << Rct::strerror();
+                }
+                break;
+            }
+        }
+    }
+}
+
 bool initLogging(const char* ident, int mode, int level, const Path &file, unsigned int flags)
 {
     sStart.start();
     sFlags = flags;
     sLevel = level;
+    if (flags & Log::Async) {
+        List<AsyncLog::Sink> sinks;
+        if (mode & LogStderr)
+            sinks.append({ STDERR_FILENO, level, false, false });
+        if (mode & LogSyslog) {
+            ::openlog(ident, LOG_CONS | LOG_NOWAIT | LOG_PID, LOG_USER);
+            sinks.append({ -1, level, false, false });
+        }
+        if (!file.isEmpty()) {
+            rotateLogFile(file, flags);
+            int fd;
+            eintrwrap(fd, ::open(file.constData(), O_WRONLY | O_CREAT | O_CLOEXEC | (flags & Log::Append ? O_APPEND : O_TRUNC), 0666));
+            if (fd == -1) {
+                if (mode & LogSyslog)
+                    ::closelog();
+                return false;
+            }
+            const bool binary = flags & Log::Binary;
+            if (binary && !lseek(fd, 0, SEEK_END)) {
+                ssize_t w;
+                eintrwrap(w, ::write(fd, BinaryMagic, sizeof(BinaryMagic)));
+                (void)w;
+            }
+            sinks.append({ fd, INT_MAX, true, binary });
+        }
+        delete sAsync.exchange(new AsyncLog(sinks, flags & Log::AsyncBlock));
+        LogSite::invalidateAll();
+        return true;
+    }
     if (mode & LogStderr) {
         std::shared_ptr<StderrOutput> out(new StderrOutput(level));
         out->add();
@@ -227,18 +1078,7 @@ bool initLogging(const char* ident, int mode, int level, const Path &file, unsig
         out->add();
     }
     if (!file.isEmpty()) {
-        if (!(flags & (Log::Append|Log::DontRotate)) && file.exists()) {
-            int i = 0;
-            while (true) {
-                const Path rotated = String::format<64>("%s.%d", file.constData(), ++i);
-                if (!rotated.exists()) {
-                    if (rename(file.constData(), rotated.constData())) {
-                        error() << "Couldn't rotate log file" << file << "to" << rotated << Rct::strerror();
-                    }
-                    break;
-                }
-            }
-        }
+        rotateLogFile(file, flags);
         FILE *f = fopen(file.constData(), flags & Log::Append ? "a" : "w");
         if (!f)
             return false;
@@ -248,10 +1088,65 @@ bool initLogging(const char* ident, int mode, int level, const Path &file, unsig
     return true;
 }
 
+void flushLogging()
+{
+    if (AsyncLog *async = sAsync.load(std::memory_order_acquire))
+        async->flush();
+    fflush(stderr);
+}
+
+// threads mustn't be logging while this runs, the rings go away
 void cleanupLogging()
 {
+    delete sAsync.exchange(0);
     std::lock_guard<std::mutex> lock(sOutputsMutex);
     sOutputs.clear();
+    sOutputCount.store(0);
+    LogSite::invalidateAll();
+}
+
+bool decodeBinaryLog(const Path &file, const std::function<void(int level, time_t time, const String &line)> &func)
+{
+    const String contents = file.readAll();
+    if (contents.size() < static_cast<int>(sizeof(BinaryMagic)) || memcmp(contents.constData(), BinaryMagic, sizeof(BinaryMagic)))
+        return false;
+    // level and format by id
+    Hash<uint32_t, std::pair<int, String> > sites;
+    const char *pos = contents.constData() + sizeof(BinaryMagic);
+    const char *const end = contents.constData() + contents.size();
+    uint32_t frame[2];
+    while (end - pos >= static_cast<int>(sizeof(frame))) {
+        memcpy(frame, pos, sizeof(frame));
+        pos += sizeof(frame);
+        if (frame[1] > static_cast<size_t>(end - pos))
+            break;
+        const char *body = pos;
+        pos += frame[1];
+        if (frame[0] == BinarySite && frame[1] >= 3 * sizeof(uint32_t)) {
+            uint32_t site[3];
+            memcpy(site, body, sizeof(site));
+            const char *fileName = body + sizeof(site);
+            const char *format = fileName + strnlen(fileName, pos - fileName) + 1;
+            if (format < pos)
+                sites[site[0]] = std::make_pair(static_cast<int>(site[1]), String(format, strnlen(format, pos - format)));
+        } else if (frame[0] == BinaryRecord && frame[1] >= sizeof(LogRecord)) {
+            LogRecord record;
+            memcpy(&record, body, sizeof(record));
+            const char *data = body + sizeof(record);
+            const int size = std::min<int>(record.size, frame[1] - sizeof(record));
+            String line;
+            if (!record.site) {
+                line.assign(data, size);
+            } else {
+                const auto it = sites.find(record.site);
+                if (it == sites.end())
+                    continue;
+                formatLogArgs(line, it->second.second.constData(), data, size);
+            }
+            func(record.level, record.time, line);
+        }
+    }
+    return true;
 }
 
 Log::Log(String *out)
@@ -290,10 +1185,14 @@ void LogOutput::add()
 {
     std::lock_guard<std::mutex> lock(sOutputsMutex);
     sOutputs.insert(shared_from_this());
+    sOutputCount.store(sOutputs.size());
+    LogSite::invalidateAll();
 }
 
 void LogOutput::remove()
 {
     std::lock_guard<std::mutex> lock(sOutputsMutex);
     sOutputs.remove(shared_from_this());
+    sOutputCount.store(sOutputs.size());
+    LogSite::invalidateAll();
 }
@@ -7,8 +7,11 @@
 #include <rct/Hash.h>
 #include <rct/Path.h>
 #include <rct/Set.h>
+#include <algorithm>
 #include <assert.h>
+#include <atomic>
 #include <cxxabi.h>
+#include <initializer_list>
 #include <sstream>
 #include <memory>
 
@@ -75,38 +78,168 @@ void log(const std::function<void(const std::shared_ptr<LogOutput> &)> &func);
 bool testLog(int level);
 enum { LogStderr = 0x1, LogSyslog = 0x2 };
 bool initLogging(const char* ident, int mode = LogStderr, int logLevel = Error, const Path &logFile = Path(), unsigned int flags = 0);
+// with Log::Async, writes out everything logged so far before returning.
+// Fine to call when crashing, it gives up on the writer thread after a
+// second and writes what's left itself
+void flushLogging();
 void cleanupLogging();
 int logLevel();
 void restartTime();
+// A binary log call site, see binaryLog(). It remembers whether its level
+// is logged until the outputs change, LogOutput::add() and remove() and
+// initLogging() make every site look again
+class LogSite
+{
+public:
+    LogSite(int level, const char *format, const char *file, int line)
+        : mLevel(level), mLine(line), mId(0), mState(0), mFormat(format), mFile(file)
+    {}
+
+    bool isEnabled()
+    {
+        const unsigned int state = mState.load(std::memory_order_relaxed);
+        if ((state >> 1) == sGeneration.load(std::memory_order_relaxed))
+            return state & 1;
+        return refresh();
+    }
+
+    int level() const { return mLevel; }
+    int line() const { return mLine; }
+    const char *format() const { return mFormat; }
+    const char *file() const { return mFile; }
+    // once it has logged something, 0 before that
+    unsigned int id() const { return mId.load(std::memory_order_acquire); }
+    unsigned int registerSite();
+
+    static void invalidateAll();
+
+private:
+    bool refresh();
+
+    const int mLevel, mLine;
+    std::atomic<unsigned int> mId;
+    // the generation it looked in, and whether it's enabled in the low bit
+    std::atomic<unsigned int> mState;
+    const char *const mFormat, *const mFile;
+
+    static std::atomic<unsigned int> sGeneration;
+
+    LogSite(const LogSite &) = delete;
+    LogSite &operator=(const LogSite &) = delete;
+};
+
+// an argument to a binaryLog(), kept as it is until it's formatted
+struct LogArg
+{
+    enum Type { Signed, Unsigned, Double, Pointer, Chars };
+
+    LogArg(bool value) : type(Signed) { i = value; }
+    LogArg(char value) : type(Signed) { i = value; }
+    LogArg(signed char value) : type(Signed) { i = value; }
+    LogArg(short value) : type(Signed) { i = value; }
+    LogArg(int value) : type(Signed) { i = value; }
+    LogArg(long value) : type(Signed) { i = value; }
+    LogArg(long long value) : type(Signed) { i = value; }
+    LogArg(unsigned char value) : type(Unsigned) { u = value; }
+    LogArg(unsigned short value) : type(Unsigned) { u = value; }
+    LogArg(unsigned int value) : type(Unsigned) { u = value; }
+    LogArg(unsigned long value) : type(Unsigned) { u = value; }
+    LogArg(unsigned long long value) : type(Unsigned) { u = value; }
+    LogArg(float value) : type(Double) { d = value; }
+    LogArg(double value) : type(Double) { d = value; }
+    LogArg(const char *value) : type(Chars) { chars.data = value ? value : "(null)"; chars.size = strlen(chars.data); }
+    LogArg(char *value) : LogArg(const_cast<const char *>(value)) {}
+    LogArg(const String &value) : type(Chars) { chars.data = value.constData(); chars.size = value.size(); }
+    template <typename T> LogArg(T *value) : type(Pointer) { p = value; }
+
+    Type type;
+    union {
+        int64_t i;
+        uint64_t u;
+        double d;
+        const void *p;
+        struct {
+            const char *data;
+            uint32_t size;
+        } chars;
+    };
+};
+
+// Formats nothing at the call site. The site and the arguments go to the
+// writer thread with Log::Async, which formats them there, or to the log
+// file as they are with Log::Binary. Otherwise, and for LogOutputs of
+// one's own, they're formatted right away. Through binaryLog() and
+// friends, where a level that isn't logged costs one branch:
+//
+//   binaryDebug("%d jobs took %lld ms on %s", count, elapsed, host);
+//
+// The format is printf()'s, the arguments integers, floating point,
+// pointers, const char * and String, and they're formatted as the format
+// says whatever they were given as
+void logBinary(LogSite &site, std::initializer_list<LogArg> args);
+template <typename... Args>
+inline void logBinary(LogSite &site, const Args &...args)
+{
+    logBinary(site, { LogArg(args)... });
+}
+
+#define binaryLog(level, format, ...)                                   \
+    do {                                                                \
+        static LogSite logSite(level, format, __FILE__, __LINE__);      \
+        if (__builtin_expect(logSite.isEnabled(), 0))                   \
+            logBinary(logSite, ##__VA_ARGS__);                          \
+    } while (0)
+#define binaryError(format, ...) binaryLog(Error, format, ##__VA_ARGS__)
+#define binaryWarning(format, ...) binaryLog(Warning, format, ##__VA_ARGS__)
+#define binaryDebug(format, ...) binaryLog(Debug, format, ##__VA_ARGS__)
+#define binaryVerboseDebug(format, ...) binaryLog(VerboseDebug, format, ##__VA_ARGS__)
+
+// Formats the records in a Log::Binary file, in the order they were
+// logged, and the plain lines in it. false if it isn't one
+bool decodeBinaryLog(const Path &file, const std::function<void(int level, time_t time, const String &line)> &func);
+
 class Log
 {
 public:
+    // Async: the outputs initLogging() sets up are written by a thread of
+    // their own. Each thread logs into a ring of its own, AsyncRingSize
+    // bytes, without locking, and the writer takes them in the order they
+    // were logged and writes them in batches with writev(). What doesn't
+    // fit in a full ring is dropped, and the number dropped logged
+    // later, unless it's AsyncBlock, which waits for room. LogOutputs added
+    // otherwise are still called right away
+    // Binary: with Async, the log file gets logBinary() records as they
+    // are, see decodeBinaryLog()
     enum Flag {
         Append = 0x1,
-        DontRotate = 0x2
+        DontRotate = 0x2,
+        Async = 0x4,
+        AsyncBlock = 0x8,
+        Binary = 0x10
     };
+    enum { AsyncRingSize = 256 * 1024 };
 
     Log(String *out);
     Log(int level = 0);
     Log(const Log &other);
     Log &operator=(const Log &other);
 #ifdef OS_Darwin
-    Log operator<<(long number) { return addStringStream(number); }
-    Log operator<<(size_t number) { return addStringStream(number); }
+    Log operator<<(long number) { return addInteger(number); }
+    Log operator<<(size_t number) { return addUnsigned(number); }
 #elif (ULONG_MAX) != (UINT_MAX)
-    Log operator<<(uint64_t number) { return addStringStream(number); }
-    Log operator<<(int64_t number) { return addStringStream(number); }
+    Log operator<<(uint64_t number) { return addUnsigned(number); }
+    Log operator<<(int64_t number) { return addInteger(number); }
 #endif
-    Log operator<<(unsigned long long number) { return addStringStream(number); }
-    Log operator<<(long long number) { return addStringStream(number); }
-    Log operator<<(uint32_t number) { return addStringStream(number); }
-    Log operator<<(int32_t number) { return addStringStream(number); }
-    Log operator<<(uint16_t number) { return addStringStream(number); }
-    Log operator<<(int16_t number) { return addStringStream(number); }
-    Log operator<<(uint8_t number) { return addStringStream<uint16_t>(number); }
+    Log operator<<(unsigned long long number) { return addUnsigned(number); }
+    Log operator<<(long long number) { return addInteger(number); }
+    Log operator<<(uint32_t number) { return addUnsigned(number); }
+    Log operator<<(int32_t number) { return addInteger(number); }
+    Log operator<<(uint16_t number) { return addUnsigned(number); }
+    Log operator<<(int16_t number) { return addInteger(number); }
+    Log operator<<(uint8_t number) { return addUnsigned(number); }
     Log operator<<(int8_t number) { return addStringStream(number); }
-    Log operator<<(float number) { return addStringStream(number); }
-    Log operator<<(double number) { return addStringStream(number); }
+    Log operator<<(float number) { return addFloat(number); }
+    Log operator<<(double number) { return addFloat(number); }
     Log operator<<(long double number) { return addStringStream(number); }
     Log operator<<(char ch) { return write(&ch, 1); }
     Log operator<<(bool boolean) { return write(boolean ? "true" : "false"); }
@@ -172,6 +305,32 @@ public:
         return ret;
     }
 private:
+    Log addInteger(int64_t number)
+    {
+        if (mData) {
+            char buf[24];
+            return write(buf, String::toChars(buf, number));
+        }
+        return *this;
+    }
+    Log addUnsigned(uint64_t number)
+    {
+        if (mData) {
+            char buf[24];
+            return write(buf, String::toChars(buf, number));
+        }
+        return *this;
+    }
+    // what an ostream writes by default
+    Log addFloat(double number)
+    {
+        if (mData) {
+            char buf[32];
+            const int w = snprintf(buf, sizeof(buf), "%g", number);
+            return write(buf, std::min<int>(w, sizeof(buf) - 1));
+        }
+        return *this;
+    }
     template <typename T> Log addStringStream(T t)
     {
         if (mData) {
@@ -15,12 +15,28 @@ public:
     {
     }
 
+    Map(const Map<Key, Value, Compare> &other)
+        : std::map<Key, Value, Compare>(other)
+    {
+    }
+
+    Map(Map<Key, Value, Compare> &&other)
+        : std::map<Key, Value, Compare>(std::move(other))
+    {
+    }
+
     Map<Key, Value, Compare>& operator=(const Map<Key, Value, Compare>& other)
     {
         std::map<Key, Value, Compare>::operator=(other);
         return *this;
     }
 
+    Map<Key, Value, Compare>& operator=(Map<Key, Value, Compare>&& other)
+    {
+        std::map<Key, Value, Compare>::operator=(std::move(other));
+        return *this;
+    }
+
     Map<Key, Value, Compare>& operator=(std::initializer_list<typename std::map<Key, Value>::value_type> init)
     {
         std::map<Key, Value, Compare>::operator=(init);
@@ -67,7 +83,7 @@ public:
         typename std::map<Key, Value, Compare>::iterator it = std::map<Key, Value, Compare>::find(t);
         if (it != std::map<Key, Value, Compare>::end()) {
             if (value)
-                *value = it->second;
+                *value = std::move(it->second);
             std::map<Key, Value, Compare>::erase(it);
             return true;
         }
@@ -0,0 +1,133 @@
+#include "MappedFile.h"
+#include "Rct.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+MappedFile::MappedFile()
+    : mData(0), mSize(0), mMap(0), mMapSize(0), mMapped(false), mOpen(false)
+{
+}
+
+MappedFile::MappedFile(const Path &path, unsigned int flags)
+    : mData(0), mSize(0), mMap(0), mMapSize(0), mMapped(false), mOpen(false)
+{
+    open(path, flags);
+}
+
+MappedFile::~MappedFile()
+{
+    close();
+}
+
+bool MappedFile::open(const Path &path, unsigned int flags)
+{
+    return open(path, flags, 0, -1);
+}
+
+bool MappedFile::open(const Path &path, unsigned int flags, int64_t offset, int length)
+{
+    close();
+    mPath = path;
+    int fd;
+    eintrwrap(fd, ::open(path.constData(), O_RDONLY | O_CLOEXEC));
+    if (fd == -1) {
+        mError = String::format<128>("open failure %d (%s)", errno, Rct::strerror().constData());
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode) || offset < 0 || offset > st.st_size
+        || (length == -1 ? st.st_size - offset > INT_MAX : offset + length > st.st_size)) {
+        mError = "Can't map " + path;
+        ::close(fd);
+        return false;
+    }
+    mSize = length == -1 ? static_cast<int>(st.st_size - offset) : length;
+    if (!mSize) {
+        // mmap() won't do an empty one
+        ::close(fd);
+        mOpen = true;
+        return true;
+    }
+
+    static const long pageSize = sysconf(_SC_PAGESIZE);
+    const int64_t aligned = offset - (offset % pageSize);
+    mMapSize = mSize + (offset - aligned);
+    int mapFlags = MAP_SHARED;
+#ifdef MAP_POPULATE
+    if (flags & Populate)
+        mapFlags |= MAP_POPULATE;
+#endif
+    mMap = mmap(0, mMapSize, PROT_READ, mapFlags, fd, aligned);
+    const int err = errno;
+    if (mMap == MAP_FAILED) {
+        mMap = 0;
+        mMapSize = 0;
+        mError = String::format<128>("mmap failure %d (%s)", err, Rct::strerror(err).constData());
+        if (flags & ReadFallback) {
+            mContents.resize(mSize);
+            int64_t read = 0;
+            while (read < mSize) {
+                const ssize_t r = pread(fd, mContents.data() + read, mSize - read, offset + read);
+                if (r <= 0 && errno != EINTR)
+                    break;
+                if (r > 0)
+                    read += r;
+            }
+            if (read == mSize) {
+                ::close(fd);
+                mData = mContents.constData();
+                mOpen = true;
+                mError.clear();
+                return true;
+            }
+            mContents.clear();
+        }
+        ::close(fd);
+        mSize = 0;
+        return false;
+    }
+    ::close(fd);
+    mData = static_cast<const char *>(mMap) + (offset - aligned);
+    mMapped = mOpen = true;
+    advise(flags);
+#if defined(MADV_HUGEPAGE)
+    if (flags & HugePages)
+        madvise(mMap, mMapSize, MADV_HUGEPAGE);
+#endif
+    return true;
+}
+
+void MappedFile::close()
+{
+    if (mMap)
+        munmap(mMap, mMapSize);
+    mMap = 0;
+    mMapSize = 0;
+    mData = 0;
+    mSize = 0;
+    mMapped = mOpen = false;
+    mContents.clear();
+    mError.clear();
+}
+
+void MappedFile::advise(unsigned int flags, int offset, int length)
+{
+    if (!mMapped || offset >= mSize)
+        return;
+    if (length == -1 || offset + length > mSize)
+        length = mSize - offset;
+    // madvise() wants the start page aligned
+    static const long pageSize = sysconf(_SC_PAGESIZE);
+    const size_t start = (mData - static_cast<const char *>(mMap)) + offset;
+    const size_t aligned = start - (start % pageSize);
+    char *address = static_cast<char *>(mMap) + aligned;
+    const size_t size = length + (start - aligned);
+    if (flags & Sequential)
+        madvise(address, size, MADV_SEQUENTIAL);
+    if (flags & Random)
+        madvise(address, size, MADV_RANDOM);
+    if (flags & WillNeed)
+        madvise(address, size, MADV_WILLNEED);
+}
@@ -0,0 +1,77 @@
+#ifndef MappedFile_h
+#define MappedFile_h
+
+#include <rct/Path.h>
+#include <rct/String.h>
+#include <rct/StringView.h>
+#include <memory>
+#include <stdint.h>
+
+// A file's contents mapped read only. Pages come from the page cache, so
+// nothing is copied and processes mapping the same file share the memory.
+// See Path::map() for one that falls back to reading the file when it
+// can't be mapped.
+//
+// Keep the MappedFile around for as long as anything points into it, a
+// Deserializer can hold on to it:
+//
+//   std::shared_ptr<MappedFile> file = path.map();
+//   Deserializer deserializer(file->data(), file->size(), file);
+class MappedFile
+{
+public:
+    enum Flag {
+        None = 0x00,
+        // fault everything in up front, MAP_POPULATE
+        Populate = 0x01,
+        // read ahead aggressively and drop pages behind
+        Sequential = 0x02,
+        // don't read ahead
+        Random = 0x04,
+        // start reading it in now, without waiting for it
+        WillNeed = 0x08,
+        // ask for transparent huge pages, only some file systems do them
+        HugePages = 0x10,
+        // with Path::map(), read it into memory if mapping fails
+        ReadFallback = 0x20
+    };
+
+    MappedFile();
+    MappedFile(const Path &path, unsigned int flags = None);
+    ~MappedFile();
+
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    bool open(const Path &path, unsigned int flags = None);
+    // length bytes from offset on, which needn't be page aligned. This is
+    // how files bigger than an int are read
+    bool open(const Path &path, unsigned int flags, int64_t offset, int length);
+    void close();
+
+    bool isOpen() const { return mOpen; }
+    // false if it was read rather than mapped
+    bool isMapped() const { return mMapped; }
+    const Path &path() const { return mPath; }
+    String error() const { return mError; }
+
+    const char *data() const { return mData; }
+    int size() const { return mSize; }
+    StringView view() const { return StringView(mData, mSize); }
+
+    // madvise() hints for part of it, Sequential, Random and WillNeed
+    void advise(unsigned int flags, int offset = 0, int length = -1);
+private:
+    const char *mData;
+    int mSize;
+    // mData is somewhere in it when the offset isn't page aligned
+    void *mMap;
+    size_t mMapSize;
+    bool mMapped, mOpen;
+    Path mPath;
+    String mError;
+    // when it couldn't be mapped
+    String mContents;
+};
+
+#endif
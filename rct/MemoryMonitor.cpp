@@ -2,13 +2,18 @@
 #include "String.h"
 #include "List.h"
 #include "Log.h"
+#include "rct-config.h"
+#include <mutex>
+#include <new>
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <errno.h>
 #include <assert.h>
+#ifdef HAVE_MALLINFO2
+# include <malloc.h>
+#endif
 #ifdef OS_Darwin
-# include <mutex>
 # include <mach/mach_traps.h>
 # include <mach/mach_init.h>
 # include <mach/mach_port.h>
@@ -47,10 +52,13 @@ static bool lineVisitor(char* line, void* userData)
     return true;
 }
 
-static inline uint64_t usageLinux()
+static inline uint64_t usageLinux(pid_t pid)
 {
-    const pid_t pid = getpid();
-    FILE* file = fopen(("/proc/" + String::number(pid) + "/smaps").constData(), "r");
+    // smaps_rollup has the sums already, much less to read than smaps
+    const String proc = "/proc/" + String::number(pid);
+    FILE* file = fopen((proc + "/smaps_rollup").constData(), "r");
+    if (!file)
+        file = fopen((proc + "/smaps").constData(), "r");
     if (!file)
         return 0;
 
@@ -111,7 +119,7 @@ static inline uint64_t usageOSX()
 uint64_t MemoryMonitor::usage()
 {
 #if defined(OS_Linux) || defined(__CYGWIN__)
-    return usageLinux();
+    return usageLinux(getpid());
 #elif defined(OS_FreeBSD)
     return usageFreeBSD();
 #elif defined(OS_Darwin)
@@ -120,3 +128,236 @@ uint64_t MemoryMonitor::usage()
 #error "MemoryMonitor does not support this system"
 #endif
 }
+
+uint64_t MemoryMonitor::usage(pid_t pid)
+{
+#if defined(OS_Linux) || defined(__CYGWIN__)
+    return usageLinux(pid);
+#else
+    // another task's regions aren't ours to look at here
+    return pid == getpid() ? usage() : 0;
+#endif
+}
+
+MemoryMonitor::Counter MemoryMonitor::sCounters[MemoryMonitor::TagCount];
+__thread MemoryMonitor::ThreadCounters *MemoryMonitor::sLocal = 0;
+
+struct MemoryMonitor::Threads
+{
+    std::mutex mutex;
+    List<ThreadCounters *> counters;
+};
+
+// never freed, threads may exit after static destructors have run
+MemoryMonitor::Threads &MemoryMonitor::threads()
+{
+    static Threads *ret = new Threads;
+    return *ret;
+}
+
+static std::once_flag threadKeyOnce;
+static pthread_key_t threadKey;
+static __thread bool threadGone = false;
+
+void MemoryMonitor::flush(Tag tag, int64_t bytes)
+{
+    Counter &counter = sCounters[tag];
+    const int64_t now = counter.allocated.fetch_add(bytes, std::memory_order_relaxed) + bytes;
+    if (bytes > 0) {
+        if (now > counter.peak.load(std::memory_order_relaxed))
+            raisePeak(counter, now);
+        const int64_t budget = counter.budget.load(std::memory_order_relaxed);
+        if (budget && now > budget && now - bytes <= budget)
+            overBudget(tag, now);
+    }
+}
+
+MemoryMonitor::ThreadCounters *MemoryMonitor::localCounters()
+{
+    if (threadGone)
+        return 0;
+    std::call_once(threadKeyOnce, []() {
+            pthread_key_create(&threadKey, [](void *ptr) {
+                    // what's left goes to the shared counters, adds after
+                    // this go straight there
+                    ThreadCounters *local = static_cast<ThreadCounters *>(ptr);
+                    sLocal = 0;
+                    threadGone = true;
+                    {
+                        Threads &all = threads();
+                        std::lock_guard<std::mutex> lock(all.mutex);
+                        all.counters.remove(local);
+                    }
+                    for (int i = 0; i < TagCount; ++i) {
+                        if (const int64_t bytes = local->pending[i].load(std::memory_order_relaxed))
+                            flush(static_cast<Tag>(i), bytes);
+                    }
+                    local->~ThreadCounters();
+                    free(local);
+                });
+        });
+    // plain new doesn't have to honour the alignas before C++17
+    void *mem;
+    if (posix_memalign(&mem, alignof(ThreadCounters), sizeof(ThreadCounters)))
+        return 0;
+    ThreadCounters *local = new (mem) ThreadCounters;
+    for (int i = 0; i < TagCount; ++i)
+        local->pending[i].store(0, std::memory_order_relaxed);
+    {
+        Threads &all = threads();
+        std::lock_guard<std::mutex> lock(all.mutex);
+        all.counters.append(local);
+    }
+    pthread_setspecific(threadKey, local);
+    sLocal = local;
+    return local;
+}
+
+int64_t MemoryMonitor::allocated(Tag tag)
+{
+    int64_t ret = sCounters[tag].allocated.load(std::memory_order_relaxed);
+    Threads &all = threads();
+    std::lock_guard<std::mutex> lock(all.mutex);
+    for (const ThreadCounters *local : all.counters)
+        ret += local->pending[tag].load(std::memory_order_relaxed);
+    return ret;
+}
+
+static std::mutex alarmsMutex;
+static std::function<void(MemoryMonitor::Tag, int64_t)> alarms[MemoryMonitor::TagCount];
+
+const char *MemoryMonitor::name(Tag tag)
+{
+    switch (tag) {
+    case Buffers: return "buffers";
+    case SocketReadBuffers: return "socketReadBuffers";
+    case SocketWriteQueues: return "socketWriteQueues";
+    case ConnectionBuffers: return "connectionBuffers";
+    case MessageCache: return "messageCache";
+    case PostedEvents: return "postedEvents";
+    case PooledBuffers: return "pooledBuffers";
+    case TagCount: break;
+    }
+    return "";
+}
+
+void MemoryMonitor::raisePeak(Counter &counter, int64_t now)
+{
+    int64_t peak = counter.peak.load(std::memory_order_relaxed);
+    while (now > peak && !counter.peak.compare_exchange_weak(peak, now, std::memory_order_relaxed)) {
+    }
+}
+
+void MemoryMonitor::resetPeaks()
+{
+    for (int i = 0; i < TagCount; ++i)
+        sCounters[i].peak.store(allocated(static_cast<Tag>(i)), std::memory_order_relaxed);
+}
+
+void MemoryMonitor::overBudget(Tag tag, int64_t now)
+{
+    std::function<void(Tag, int64_t)> alarm;
+    {
+        std::lock_guard<std::mutex> lock(alarmsMutex);
+        alarm = alarms[tag];
+    }
+    if (alarm) {
+        alarm(tag, now);
+    } else {
+        warning("%s is over its budget of %lld bytes at %lld", name(tag),
+                static_cast<long long>(budget(tag)), static_cast<long long>(now));
+    }
+}
+
+void MemoryMonitor::setBudget(Tag tag, int64_t bytes, std::function<void(Tag, int64_t)> &&alarm)
+{
+    std::lock_guard<std::mutex> lock(alarmsMutex);
+    alarms[tag] = bytes ? std::move(alarm) : std::function<void(Tag, int64_t)>();
+    sCounters[tag].budget.store(bytes, std::memory_order_relaxed);
+}
+
+#if defined(OS_Linux) || defined(OS_FreeBSD)
+// jemalloc's and tcmalloc's, if the process is linked with one of them
+extern "C" int mallctl(const char *name, void *oldp, size_t *oldlenp, void *newp, size_t newlen) __attribute__((weak));
+extern "C" int MallocExtension_GetNumericProperty(const char *property, size_t *value) __attribute__((weak));
+#endif
+
+MemoryMonitor::AllocatorStats MemoryMonitor::allocatorStats()
+{
+    AllocatorStats ret;
+#if defined(OS_Linux) || defined(OS_FreeBSD)
+    if (mallctl) {
+        // the stats are cached until the epoch moves on
+        uint64_t epoch = 1;
+        size_t len = sizeof(epoch);
+        mallctl("epoch", &epoch, &len, &epoch, len);
+        size_t allocated, resident;
+        len = sizeof(size_t);
+        if (!mallctl("stats.allocated", &allocated, &len, 0, 0) && !mallctl("stats.resident", &resident, &len, 0, 0)) {
+            ret.name = "jemalloc";
+            ret.allocated = allocated;
+            ret.resident = resident;
+            return ret;
+        }
+    }
+    if (MallocExtension_GetNumericProperty) {
+        size_t allocated, heap, unmapped = 0;
+        if (MallocExtension_GetNumericProperty("generic.current_allocated_bytes", &allocated)
+            && MallocExtension_GetNumericProperty("generic.heap_size", &heap)) {
+            MallocExtension_GetNumericProperty("tcmalloc.pageheap_unmapped_bytes", &unmapped);
+            ret.name = "tcmalloc";
+            ret.allocated = allocated;
+            ret.resident = heap - unmapped;
+            return ret;
+        }
+    }
+#endif
+#ifdef HAVE_MALLINFO2
+    const struct mallinfo2 info = mallinfo2();
+    ret.name = "glibc";
+    ret.allocated = info.uordblks + info.hblkhd;
+    ret.resident = info.arena + info.hblkhd;
+#endif
+    return ret;
+}
+
+MemoryMonitor::Snapshot MemoryMonitor::snapshot(bool withUsage)
+{
+    Snapshot ret;
+    ret.usage = withUsage ? usage() : 0;
+    for (int i = 0; i < TagCount; ++i) {
+        ret.allocated[i] = sCounters[i].allocated.load(std::memory_order_relaxed);
+        ret.peak[i] = sCounters[i].peak.load(std::memory_order_relaxed);
+        ret.budget[i] = sCounters[i].budget.load(std::memory_order_relaxed);
+    }
+    {
+        Threads &all = threads();
+        std::lock_guard<std::mutex> lock(all.mutex);
+        for (const ThreadCounters *local : all.counters) {
+            for (int i = 0; i < TagCount; ++i)
+                ret.allocated[i] += local->pending[i].load(std::memory_order_relaxed);
+        }
+    }
+    ret.allocator = allocatorStats();
+    return ret;
+}
+
+String MemoryMonitor::dump()
+{
+    const Snapshot snap = snapshot(true);
+    String ret;
+    for (int i = 0; i < TagCount; ++i) {
+        ret += String::format<128>("%s: %lld peak %lld", name(static_cast<Tag>(i)),
+                                   static_cast<long long>(snap.allocated[i]), static_cast<long long>(snap.peak[i]));
+        if (snap.budget[i])
+            ret += String::format<64>(" budget %lld", static_cast<long long>(snap.budget[i]));
+        ret += '\n';
+    }
+    if (*snap.allocator.name) {
+        ret += String::format<128>("%s: allocated %llu resident %llu\n", snap.allocator.name,
+                                   static_cast<unsigned long long>(snap.allocator.allocated),
+                                   static_cast<unsigned long long>(snap.allocator.resident));
+    }
+    ret += String::format<64>("usage: %llu\n", static_cast<unsigned long long>(snap.usage));
+    return ret;
+}
@@ -1,15 +1,139 @@
 #ifndef MEMORYMONITOR_H
 #define MEMORYMONITOR_H
 
+#include <rct/String.h>
+#include <atomic>
+#include <functional>
 #include <stdint.h>
+#include <sys/types.h>
 
 class MemoryMonitor
 {
 public:
     static uint64_t usage();
+    // of another process, 0 where that can't be had
+    static uint64_t usage(pid_t pid);
+
+    // What usage() can't tell apart, the bytes held by rct's own buffers
+    // and caches by what holds them. Each thread counts on its own and
+    // moves what it has into the shared counters once it's FlushBytes
+    // either way, that's when peaks and budgets are looked at. allocated()
+    // and snapshot() add up every thread's.
+    enum Tag {
+        // Buffers nobody tagged as anything else
+        Buffers,
+        // SocketClient's read buffers and queued writes
+        SocketReadBuffers,
+        SocketWriteQueues,
+        // what a Connection received but hasn't decoded yet
+        ConnectionBuffers,
+        // frames encoded by Message::prepare() and kept by the message, a
+        // frame queued on a socket counts there too
+        MessageCache,
+        // events posted to an EventLoop that haven't run yet
+        PostedEvents,
+        // chunks in BufferPool's free lists that still have their pages
+        PooledBuffers,
+        TagCount
+    };
+
+    enum { FlushBytes = 64 * 1024 };
+
+    static void add(Tag tag, int64_t bytes)
+    {
+        ThreadCounters *local = sLocal;
+        if (!local && !(local = localCounters())) {
+            // the thread is exiting, or there was no memory for them
+            flush(tag, bytes);
+            return;
+        }
+        // only this thread writes it, others just read
+        std::atomic<int64_t> &pending = local->pending[tag];
+        const int64_t now = pending.load(std::memory_order_relaxed) + bytes;
+        if (now < FlushBytes && now > -FlushBytes) {
+            pending.store(now, std::memory_order_relaxed);
+        } else {
+            flush(tag, now);
+            pending.store(0, std::memory_order_relaxed);
+        }
+    }
+    static void move(Tag from, Tag to, int64_t bytes)
+    {
+        if (from != to && bytes) {
+            add(from, -bytes);
+            add(to, bytes);
+        }
+    }
+    static int64_t allocated(Tag tag);
+    // to within FlushBytes for each thread
+    static int64_t peak(Tag tag) { return sCounters[tag].peak.load(std::memory_order_relaxed); }
+    static const char *name(Tag tag);
+    // the peaks start over from what's allocated now
+    static void resetPeaks();
+
+    // alarm is called when tag goes over bytes, on the thread that made it
+    // go over and possibly with locks held, so it should hand off to a loop
+    // rather than do much. It's called again once it has come back under
+    // and goes over again. 0 bytes removes the budget. Like the peaks it's
+    // checked at FlushBytes granularity
+    static void setBudget(Tag tag, int64_t bytes, std::function<void(Tag tag, int64_t allocated)> &&alarm = std::function<void(Tag, int64_t)>());
+    static int64_t budget(Tag tag) { return sCounters[tag].budget.load(std::memory_order_relaxed); }
+
+    // What malloc says it has, from jemalloc or tcmalloc when the process
+    // is linked with one, glibc's mallinfo2() otherwise. allocated is what
+    // the application has, resident what the allocator has mapped and
+    // touched, name is empty if there was nothing to ask
+    struct AllocatorStats
+    {
+        AllocatorStats()
+            : name(""), allocated(0), resident(0)
+        {}
+
+        const char *name;
+        uint64_t allocated, resident;
+    };
+    static AllocatorStats allocatorStats();
+
+    struct Snapshot
+    {
+        // 0 unless snapshot() was asked for it, it reads /proc
+        uint64_t usage;
+        int64_t allocated[TagCount], peak[TagCount], budget[TagCount];
+        AllocatorStats allocator;
+    };
+    static Snapshot snapshot(bool withUsage = false);
+    // a line per tag, then the allocator and usage()
+    static String dump();
 
 private:
     MemoryMonitor();
+
+    struct alignas(64) Counter
+    {
+        std::atomic<int64_t> allocated, peak, budget;
+    };
+
+    // what a thread has added that isn't in sCounters yet
+    struct alignas(64) ThreadCounters
+    {
+        std::atomic<int64_t> pending[TagCount];
+    };
+
+    // every thread's, for allocated() and snapshot() to add up
+    struct Threads;
+    static Threads &threads();
+
+    // moves bytes into the shared counter and checks the peak and budget
+    static void flush(Tag tag, int64_t bytes);
+    // registers this thread's, null once the thread has started exiting or
+    // if they couldn't be allocated
+    static ThreadCounters *localCounters();
+    static void raisePeak(Counter &counter, int64_t now);
+    static void overBudget(Tag tag, int64_t now);
+
+    static Counter sCounters[TagCount];
+    // __thread rather than thread_local, see EventLoop's event pools
+    static __thread ThreadCounters *sLocal;
 };
 
 #endif
@@ -1,4 +1,5 @@
 #include "Message.h"
+#include "BatchMessage.h"
 #include "ResponseMessage.h"
 #include "FinishMessage.h"
 #include "ConnectMessage.h"
@@ -6,33 +7,92 @@
 #include "QuitMessage.h"
 #include <assert.h>
 #include <cstdlib>
+#include <string.h>
 
-std::mutex Message::sMutex;
-Map<uint8_t, Message::MessageCreatorBase *> Message::sFactory;
+std::atomic<Message::MessageCreatorBase *> Message::sFactory[256];
 
-void Message::prepare(int version, String &header, String &value) const
+void *Message::MessagePool::allocate(size_t size)
 {
-    if (mHeader.isEmpty() || version != mVersion) {
-        if (version != mVersion) {
-            mHeader.clear();
-            mValue.clear();
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        if (!mFree.empty() && size == mBlockSize) {
+            void *block = mFree.back();
+            mFree.pop_back();
+            return block;
         }
+    }
+    return ::operator new(size);
+}
+
+void Message::MessagePool::deallocate(void *block, size_t size)
+{
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        if (!mBlockSize)
+            mBlockSize = size;
+        if (size == mBlockSize && mFree.size() < mMax) {
+            mFree.push_back(block);
+            return;
+        }
+    }
+    ::operator delete(block);
+}
+
+bool Message::registerCreator(uint8_t id, MessageCreatorBase *creator)
+{
+    MessageCreatorBase *expected = 0;
+    return sFactory[id].compare_exchange_strong(expected, creator, std::memory_order_acq_rel);
+}
+
+void Message::registerBuiltinMessages()
+{
+    static std::once_flag builtinOnce;
+    std::call_once(builtinOnce, []() {
+        registerMessage<ResponseMessage>();
+        registerMessage<FinishMessage>();
+        registerMessage<ConnectMessage>();
+        registerMessage<QuitMessage>();
+    });
+}
+
+void Message::prepare(int version, Compression::Codec codec, int level, int threshold,
+                      std::shared_ptr<const String> &header, std::shared_ptr<const String> &value) const
+{
+    if (!(mFlags & Compressed))
+        codec = Compression::None;
+    if (!mHeader || version != mVersion || codec != mCodec) {
+        std::shared_ptr<String> encoded = std::make_shared<String>();
         {
-            Serializer s(mValue);
+            Serializer s(*encoded);
             encode(s);
         }
-        if (mFlags & Compressed) {
-            mValue = mValue.compress();
+        uint8_t flags = mFlags & ~(Compressed | CodecMask);
+        if (codec != Compression::None && encoded->size() >= threshold) {
+            std::shared_ptr<String> compressed = std::make_shared<String>();
+            if (Compression::compress(codec, encoded->constData(), encoded->size(), *compressed, level)) {
+                encoded = compressed;
+                flags |= Compressed | ((codec - Compression::Zlib) << CodecShift);
+            } else {
+                error("Failed to compress message id: %d with %s, sending it uncompressed",
+                      mMessageId, Compression::codecName(codec));
+            }
         }
-        Serializer s(mHeader);
-        encodeHeader(s, mValue.size(), version);
+        std::shared_ptr<String> encodedHeader = std::make_shared<String>();
+        Serializer s(*encodedHeader);
+        encodeHeader(s, encoded->size(), version, flags);
+        if (mValue)
+            MemoryMonitor::add(MemoryMonitor::MessageCache, -cachedSize());
+        mHeader = encodedHeader;
+        mValue = encoded;
+        MemoryMonitor::add(MemoryMonitor::MessageCache, cachedSize());
         mVersion = version;
+        mCodec = codec;
     }
     value = mValue;
     header = mHeader;
 }
 
-std::shared_ptr<Message> Message::create(int version, const char *data, int size)
+std::shared_ptr<Message> Message::create(int version, const char *data, int size, SharedRegion *shared)
 {
     if (!size || !data) {
         error("Can't create message from empty data");
@@ -65,37 +125,65 @@ std::shared_ptr<Message> Message::create(int version, const char *data, int size
     ds >> flags;
     data += sizeof(flags);
     size -= sizeof(flags);
+    uint32_t streamId = 0;
+    if (flags & StreamIdFlag) {
+        if (size < static_cast<int>(sizeof(streamId))) {
+            error("Truncated stream id for message id: %d", id);
+            return std::shared_ptr<Message>();
+        }
+        memcpy(&streamId, data, sizeof(streamId));
+        data += sizeof(streamId);
+        size -= sizeof(streamId);
+    }
+    if (flags & SharedMemoryFlag) {
+        uint64_t position;
+        uint32_t length;
+        if (!shared || size != SharedDescriptorSize) {
+            error("Unexpected shared memory frame for message id: %d", id);
+            return std::shared_ptr<Message>();
+        }
+        memcpy(&position, data, sizeof(position));
+        memcpy(&length, data + sizeof(position), sizeof(length));
+        const uint32_t offset = position % shared->size;
+        if (length > shared->size - offset) {
+            error("Invalid shared memory frame for message id: %d, %u bytes at %u", id, length, offset);
+            return std::shared_ptr<Message>();
+        }
+        data = shared->data + offset;
+        size = length;
+        shared->end = position + length;
+    }
     String uncompressed;
     if (flags & Compressed) {
-        uncompressed = String::uncompress(data, size);
+        const Compression::Codec codec = static_cast<Compression::Codec>(Compression::Zlib + ((flags & CodecMask) >> CodecShift));
+        if (!Compression::uncompress(codec, data, size, uncompressed)) {
+            error("Can't uncompress message id: %d, data: %d bytes, codec %s", id, size, Compression::codecName(codec));
+            return std::shared_ptr<Message>();
+        }
         data = uncompressed.constData();
         size = uncompressed.size();
     }
-    std::lock_guard<std::mutex> lock(sMutex);
-    if (!sFactory.contains(ResponseMessage::MessageId)) {
-        atexit(Message::cleanup);
-        sFactory[ResponseMessage::MessageId] = new MessageCreator<ResponseMessage>();
-        sFactory[FinishMessage::MessageId] = new MessageCreator<FinishMessage>();
-        sFactory[ConnectMessage::MessageId] = new MessageCreator<ConnectMessage>();
-        sFactory[QuitMessage::MessageId] = new MessageCreator<QuitMessage>();
+    if (flags & BatchFlag) {
+        // not in sFactory, the id is the application's
+        std::shared_ptr<Message> batch = std::make_shared<BatchMessage>((flags & Compressed) ? std::move(uncompressed) : String(data, size));
+        batch->mStreamId = streamId;
+        return batch;
+    }
+    MessageCreatorBase *base = sFactory[id].load(std::memory_order_acquire);
+    if (!base) {
+        // the built in messages register on first use
+        registerBuiltinMessages();
+        base = sFactory[id].load(std::memory_order_acquire);
     }
-
-    MessageCreatorBase *base = sFactory.value(id);
     if (!base) {
-        error("Invalid message id %d, data: %d bytes, factory %p", id, size, &sFactory);
+        error("Invalid message id %d, data: %d bytes", id, size);
         return std::shared_ptr<Message>();
     }
-    std::shared_ptr<Message> message(base->create(data, size));
+    std::shared_ptr<Message> message = base->create(data, size, (flags & Compressed) ? &uncompressed : 0);
     if (!message) {
         error("Can't create message from data id: %d, data: %d bytes", id, size);
+    } else {
+        message->mStreamId = streamId;
     }
     return message;
 }
-
-void Message::cleanup()
-{
-    std::lock_guard<std::mutex> lock(sMutex);
-    for (Map<uint8_t, MessageCreatorBase *>::const_iterator it = sFactory.begin(); it != sFactory.end(); ++it)
-        delete it->second;
-    sFactory.clear();
-}
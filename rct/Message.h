@@ -1,8 +1,13 @@
 #ifndef MESSAGE_H
 #define MESSAGE_H
 
+#include <rct/Compression.h>
+#include <rct/MemoryMonitor.h>
 #include <rct/Serializer.h>
+#include <atomic>
+#include <memory>
 #include <mutex>
+#include <vector>
 class Message
 {
 public:
@@ -14,10 +19,31 @@ public:
     };
 
     Message(uint8_t id, uint8_t flags = None)
-        : mMessageId(id), mFlags(flags), mVersion(0)
+        : mMessageId(id), mFlags(flags), mStreamId(0), mVersion(0), mCodec(Compression::None)
     {}
-    virtual ~Message()
+    // a copy encodes itself again, it's likely to be changed
+    Message(const Message &other)
+        : mMessageId(other.mMessageId), mFlags(other.mFlags), mStreamId(other.mStreamId), mVersion(0), mCodec(Compression::None)
     {}
+    Message &operator=(const Message &other)
+    {
+        if (this != &other) {
+            mMessageId = other.mMessageId;
+            mFlags = other.mFlags;
+            mStreamId = other.mStreamId;
+            if (mValue) {
+                MemoryMonitor::add(MemoryMonitor::MessageCache, -cachedSize());
+                mHeader.reset();
+                mValue.reset();
+            }
+        }
+        return *this;
+    }
+    virtual ~Message()
+    {
+        if (mValue)
+            MemoryMonitor::add(MemoryMonitor::MessageCache, -cachedSize());
+    }
 
     enum Flag {
         None = 0x0,
@@ -27,59 +53,197 @@ public:
 
     uint8_t flags() const { return mFlags; }
     uint8_t messageId() const { return mMessageId; }
+    // the stream a received message came in on, 0 when it wasn't sent with
+    // one. See Connection::request()
+    uint32_t streamId() const { return mStreamId; }
 
     virtual void encode(Serializer &/* serializer */) const = 0;
     virtual void decode(Deserializer &/* deserializer */) = 0;
 
     virtual int encodedSize() const { return -1; }
-    static std::shared_ptr<Message> create(int version, const char *data, int size);
-    template<typename T> static void registerMessage()
+    // return true to have decode() read from a copy of the frame pinned by
+    // Deserializer::storage(), so StringViews into it stay valid for as
+    // long as the message keeps the storage
+    virtual bool pinsData() const { return false; }
+    // the peer's shared memory ring, where frames flagged SharedMemoryFlag
+    // have their body. See Connection::setSharedMemory()
+    struct SharedRegion
     {
-        const uint8_t id = T::MessageId;
-        std::lock_guard<std::mutex> lock(sMutex);
-        MessageCreatorBase *&base = sFactory[id];
-        if (!base) {
-            base = new MessageCreator<T>();
-        }
+        const char *data;
+        uint32_t size;
+        // set to where the body taken from it ends, to release up to there
+        uint64_t end;
+    };
+    static std::shared_ptr<Message> create(int version, const char *data, int size, SharedRegion *shared = 0);
+    // poolSize > 0 keeps up to that many freed messages of this type around
+    // for reuse. Registering an id that is already registered does nothing.
+    // Creators are never freed, create() reads them without a lock from
+    // any thread right up until exit
+    template<typename T> static void registerMessage(size_t poolSize = 0)
+    {
+        MessageCreatorBase *creator = new MessageCreator<T>(poolSize);
+        if (!registerCreator(T::MessageId, creator))
+            delete creator;
     }
-    static void cleanup();
 private:
     class MessageCreatorBase
     {
     public:
         virtual ~MessageCreatorBase() {}
-        virtual Message *create(const char *data, int size) = 0;
+        // uncompressed, if not null, holds data and may be taken
+        virtual std::shared_ptr<Message> create(const char *data, int size, String *uncompressed) = 0;
+    };
+
+    // recycles the single allocation holding a message and its shared_ptr
+    // control block
+    class MessagePool
+    {
+    public:
+        MessagePool(size_t max)
+            : mMax(max), mBlockSize(0)
+        {}
+
+        void *allocate(size_t size);
+        void deallocate(void *block, size_t size);
+
+    private:
+        std::mutex mMutex;
+        std::vector<void *> mFree;
+        const size_t mMax;
+        size_t mBlockSize;
+    };
+
+    template <typename U>
+    class PoolAllocator
+    {
+    public:
+        typedef U value_type;
+        template <typename V> struct rebind { typedef PoolAllocator<V> other; };
+
+        PoolAllocator(MessagePool *pool)
+            : mPool(pool)
+        {}
+        template <typename V>
+        PoolAllocator(const PoolAllocator<V> &other)
+            : mPool(other.mPool)
+        {}
+
+        U *allocate(size_t count)
+        {
+            if (count != 1)
+                return static_cast<U *>(::operator new(count * sizeof(U)));
+            return static_cast<U *>(mPool->allocate(sizeof(U)));
+        }
+        void deallocate(U *block, size_t count)
+        {
+            if (count != 1) {
+                ::operator delete(block);
+            } else {
+                mPool->deallocate(block, sizeof(U));
+            }
+        }
+
+        template <typename V> bool operator==(const PoolAllocator<V> &other) const { return mPool == other.mPool; }
+        template <typename V> bool operator!=(const PoolAllocator<V> &other) const { return mPool != other.mPool; }
+
+        MessagePool *mPool;
     };
 
     template <typename T>
     class MessageCreator : public MessageCreatorBase
     {
     public:
-        virtual Message *create(const char *data, int size) override
+        // the pool is never freed, like the creator
+        MessageCreator(size_t poolSize)
+            : mPool(poolSize ? new MessagePool(poolSize) : 0)
+        {}
+
+        virtual std::shared_ptr<Message> create(const char *data, int size, String *uncompressed) override
         {
-            T *t = new T;
-            Deserializer deserializer(data, size);
-            t->decode(deserializer);
+            std::shared_ptr<T> t;
+            if (mPool) {
+                t = std::allocate_shared<T>(PoolAllocator<T>(mPool));
+            } else {
+                t = std::make_shared<T>();
+            }
+            if (t->pinsData()) {
+                // the frame lives in the connection's read buffer, one copy
+                // of it instead of one per string
+                std::shared_ptr<const String> storage;
+                if (uncompressed) {
+                    storage = std::make_shared<const String>(std::move(*uncompressed));
+                } else {
+                    storage = std::make_shared<const String>(data, size);
+                }
+                Deserializer deserializer(storage);
+                t->decode(deserializer);
+            } else {
+                Deserializer deserializer(data, size);
+                t->decode(deserializer);
+            }
             return t;
         }
+
+    private:
+        MessagePool *mPool;
     };
 
-    void prepare(int version, String &header, String &value) const;
+    static bool registerCreator(uint8_t id, MessageCreatorBase *creator);
+    static void registerBuiltinMessages();
+
+    // the encoded frame is cached and shared with the caller so it can be
+    // queued on any number of connections without copying. A Compressed
+    // message is compressed with codec unless it encodes to less than
+    // threshold bytes. The cache is per version and codec, a cached
+    // message keeps the level and threshold it was first prepared with.
+    void prepare(int version, Compression::Codec codec, int level, int threshold,
+                 std::shared_ptr<const String> &header, std::shared_ptr<const String> &value) const;
     enum { HeaderExtra = sizeof(int) + sizeof(uint8_t) + sizeof(uint8_t) };
-    inline void encodeHeader(Serializer &serializer, uint32_t size, int version) const
+    // the codec of a Compressed frame is in these bits of its flags, less
+    // Zlib so frames from before there was a choice read as zlib
+    enum { CodecShift = 4, CodecMask = 0x30 };
+    // Only ever on the wire, never in mFlags. StreamIdFlag frames have a
+    // uint32_t stream id after the header, the body of SharedMemoryFlag
+    // frames is a uint64_t position and a uint32_t size in the sender's
+    // ring instead of the message itself.
+    enum { StreamIdFlag = 0x40, SharedMemoryFlag = 0x80 };
+    // A BatchMessage, whatever the id, so it doesn't take one from the
+    // application. The one flag that's in mFlags as well, BatchMessage's
+    enum { BatchFlag = 0x8 };
+    enum { SharedDescriptorSize = sizeof(uint64_t) + sizeof(uint32_t) };
+    inline void encodeHeader(Serializer &serializer, uint32_t size, int version, uint32_t streamId = 0) const
+    {
+        encodeHeader(serializer, size, version, mFlags, streamId);
+    }
+    inline void encodeHeader(Serializer &serializer, uint32_t size, int version, uint8_t flags, uint32_t streamId = 0) const
+    {
+        if (streamId) {
+            serializer << static_cast<uint32_t>(size + HeaderExtra + sizeof(streamId)) << version
+                       << static_cast<uint8_t>(mMessageId) << static_cast<uint8_t>(flags | StreamIdFlag) << streamId;
+        } else {
+            serializer << static_cast<uint32_t>(size + HeaderExtra) << version << static_cast<uint8_t>(mMessageId) << flags;
+        }
+    }
+    // the flags of a header from prepare(), to encode it again with a
+    // stream id or for shared memory
+    static uint8_t headerFlags(const String &header)
     {
-        serializer << (size + HeaderExtra) << version << static_cast<uint8_t>(mMessageId) << mFlags;
+        assert(header.size() == sizeof(uint32_t) + HeaderExtra);
+        return header.at(sizeof(uint32_t) + sizeof(int) + sizeof(uint8_t));
     }
+    int64_t cachedSize() const { return mHeader->size() + mValue->size(); }
     friend class Connection;
+    friend class BatchMessage;
 
     uint8_t mMessageId;
     uint8_t mFlags;
+    uint32_t mStreamId;
     mutable int mVersion;
-    mutable String mHeader;
-    mutable String mValue;
+    mutable Compression::Codec mCodec;
+    mutable std::shared_ptr<const String> mHeader, mValue;
 
-    static Map<uint8_t, MessageCreatorBase *> sFactory;
-    static std::mutex sMutex;
+    // indexed by message id, written once per id and read without locking
+    static std::atomic<MessageCreatorBase *> sFactory[256];
 
 };
 
@@ -1,7 +1,9 @@
 #include "MessageQueue.h"
+#include "rct-config.h"
 #include "Thread.h"
 #include "EventLoop.h"
 #include "Log.h"
+#include "Rct.h"
 #include <signal.h>
 #include <unistd.h>
 #include <errno.h>
@@ -10,7 +12,13 @@
 #include <sys/ipc.h>
 #include <sys/msg.h>
 #include <pthread.h>
+#include <poll.h>
+#include <fcntl.h>
 #include <mutex>
+#if defined(HAVE_MQUEUE) && defined(OS_Linux)
+#include <mqueue.h>
+#define HAVE_POLLABLE_MQUEUE
+#endif
 
 class MessageThread : public Thread, public std::enable_shared_from_this<MessageThread>
 {
@@ -18,6 +26,7 @@ public:
     MessageThread(int q, MessageQueue* mq)
         : queueId(q), queue(mq), stopped(false), loop(EventLoop::eventLoop())
     {
+        setName("MessageQueue");
     }
 
     void stop();
@@ -106,6 +115,7 @@ static void msgInit()
 }
 
 MessageQueue::MessageQueue(int key, CreateFlag flag)
+    : posix(false), messageSize(0)
 {
     pthread_once(&msgInitOnce, msgInit);
     const int flg = (flag == Create) ? (IPC_CREAT | IPC_EXCL) : 0;
@@ -116,7 +126,7 @@ MessageQueue::MessageQueue(int key, CreateFlag flag)
 }
 
 MessageQueue::MessageQueue(const Path& path, CreateFlag flag)
-    : queue(-1), owner(false)
+    : queue(-1), owner(false), posix(false), messageSize(0)
 {
     pthread_once(&msgInitOnce, msgInit);
     const key_t key = ftok(path.nullTerminated(), PROJID);
@@ -129,6 +139,46 @@ MessageQueue::MessageQueue(const Path& path, CreateFlag flag)
     thread->start();
 }
 
+MessageQueue::MessageQueue(const String& n, Type, CreateFlag flag, Mode mode, long maxMessages, long size)
+    : queue(-1), owner(false), posix(true), name(n), messageSize(0)
+{
+#ifdef HAVE_POLLABLE_MQUEUE
+    int oflag = O_RDWR | O_NONBLOCK | O_CLOEXEC;
+    if (flag == Create)
+        oflag |= O_CREAT | O_EXCL;
+    mq_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.mq_maxmsg = maxMessages;
+    attr.mq_msgsize = size;
+    const mqd_t q = mq_open(name.constData(), oflag, 0600, (flag == Create && maxMessages && size) ? &attr : 0);
+    if (q == static_cast<mqd_t>(-1)) {
+        error("MessageQueue: mq_open %s failed %s", name.constData(), Rct::strerror().constData());
+        return;
+    }
+    if (mq_getattr(q, &attr) == -1) {
+        mq_close(q);
+        return;
+    }
+    queue = q;
+    owner = flag == Create;
+    messageSize = attr.mq_msgsize;
+    // the descriptor is an fd on Linux, it's polled like any other. Level
+    // triggered, readPosix() stops at MaxBatch and what's left has to wake
+    // the loop again
+    if (mode == Receive) {
+        if (EventLoop::SharedPtr loop = EventLoop::eventLoop())
+            loop->registerSocket(queue, EventLoop::SocketRead | EventLoop::SocketLevelTriggered,
+                                 std::bind(&MessageQueue::readPosix, this));
+    }
+#else
+    (void)flag;
+    (void)mode;
+    (void)maxMessages;
+    (void)size;
+    error("MessageQueue: no POSIX message queues here");
+#endif
+}
+
 MessageQueue::~MessageQueue()
 {
     if (thread) {
@@ -136,22 +186,97 @@ MessageQueue::~MessageQueue()
         thread->join();
         thread.reset();
     }
+#ifdef HAVE_POLLABLE_MQUEUE
+    if (posix) {
+        if (queue != -1) {
+            if (EventLoop::SharedPtr loop = EventLoop::eventLoop())
+                loop->unregisterSocket(queue);
+            mq_close(queue);
+            if (owner)
+                mq_unlink(name.constData());
+        }
+        return;
+    }
+#endif
     if (queue != -1 && owner) {
         msgctl(queue, IPC_RMID, 0);
     }
 }
 
+#ifdef HAVE_POLLABLE_MQUEUE
+void MessageQueue::readPosix()
+{
+    for (int i=0; i<MaxBatch && queue != -1; ++i) {
+        // clear() keeps what's reserved, the one buffer does for the batch
+        // and the next
+        readBuffer.clear();
+        readBuffer.reserve(messageSize);
+        ssize_t r;
+        eintrwrap(r, mq_receive(queue, reinterpret_cast<char*>(readBuffer.data()), messageSize, 0));
+        if (r == -1) {
+            if (errno != EAGAIN)
+                error("MessageQueue: mq_receive %s failed %s", name.constData(), Rct::strerror().constData());
+            return;
+        }
+        readBuffer.resize(r);
+        signalDataAvailable(readBuffer);
+    }
+}
+
+bool MessageQueue::sendPosix(const char* data, size_t size)
+{
+    for (;;) {
+        int ret;
+        eintrwrap(ret, mq_send(queue, data, size, 0));
+        if (ret == 0)
+            return true;
+        if (errno != EAGAIN)
+            return false;
+        // full, wait for room like msgsnd() would
+        pollfd pfd = { queue, POLLOUT, 0 };
+        eintrwrap(ret, ::poll(&pfd, 1, -1));
+        if (ret == -1)
+            return false;
+    }
+}
+#else
+void MessageQueue::readPosix()
+{
+}
+
+bool MessageQueue::sendPosix(const char*, size_t)
+{
+    return false;
+}
+#endif
+
+int MessageQueue::send(const List<String>& data)
+{
+    int sent = 0;
+    for (const String& message : data) {
+        if (!send(message.constData(), message.size()))
+            break;
+        ++sent;
+    }
+    return sent;
+}
+
 bool MessageQueue::send(const char* data, size_t size)
 {
     if (queue == -1)
         return false;
-    struct {
-        long mtype;
-        const char* data;
-    } msgbuf = { 1, data };
+    if (posix)
+        return sendPosix(data, size);
+    // msgsnd() wants the text right after the type
+    enum { StackSize = 4096 };
+    char stackBuf[sizeof(long) + StackSize];
+    char* msgbuf = size <= StackSize ? stackBuf : static_cast<char*>(malloc(sizeof(long) + size));
+    const long type = 1;
+    memcpy(msgbuf, &type, sizeof(long));
+    memcpy(msgbuf + sizeof(long), data, size);
     int ret;
     for (;;) {
-        ret = msgsnd(queue, &msgbuf, size, 0);
+        ret = msgsnd(queue, msgbuf, size, 0);
         if (ret == -1) {
             if (errno == EINTR)
                 continue;
@@ -163,9 +288,11 @@ bool MessageQueue::send(const char* data, size_t size)
                 }
                 queue = -1;
             }
-            return false;
+            break;
         }
         break;
     }
-    return true;
+    if (msgbuf != stackBuf)
+        free(msgbuf);
+    return ret != -1;
 }
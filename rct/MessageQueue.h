@@ -3,6 +3,7 @@
 
 #include "Path.h"
 #include "String.h"
+#include "List.h"
 #include "SignalSlot.h"
 #include "Buffer.h"
 #include <memory>
@@ -14,19 +15,47 @@ class MessageQueue
 public:
     enum CreateFlag { None, Create };
 
+    // System V queues, read by a thread of their own
     MessageQueue(int key, CreateFlag = None);
     MessageQueue(const Path& path, CreateFlag flag = None);
+
+    // Linux. A POSIX queue, name is "/something", read on the EventLoop of
+    // the thread that opened it without a thread of its own, unless it's
+    // SendOnly. Each wakeup reads what's waiting, up to MaxBatch messages,
+    // into one buffer that dataAvailable() gets for each of them in turn,
+    // the rest on the next iteration of the loop.
+    // maxMessages and messageSize are for a queue that's created, 0 takes
+    // the system's defaults
+    enum Type { Posix };
+    enum Mode { Receive, SendOnly };
+    enum { MaxBatch = 64 };
+    MessageQueue(const String& name, Type type, CreateFlag flag = None, Mode mode = Receive,
+                 long maxMessages = 0, long messageSize = 0);
     ~MessageQueue();
 
+    bool isValid() const { return queue != -1; }
+
+    // the buffer is only good until the slot returns
     Signal<std::function<void(const Buffer&)> >& dataAvailable() { return signalDataAvailable; }
 
     bool send(const String& data) { return send(data.nullTerminated(), data.size()); }
     bool send(const Buffer& data) { return send(reinterpret_cast<const char*>(data.data()), data.size()); }
     bool send(const char* data, size_t size);
+    // in order, stops at the first that can't be sent and returns how many
+    // were
+    int send(const List<String>& data);
 
 private:
+    bool sendPosix(const char* data, size_t size);
+    void readPosix();
+
     int queue;
     bool owner;
+    bool posix;
+    // the POSIX queue's name, and the longest message it takes
+    String name;
+    long messageSize;
+    Buffer readBuffer;
     Signal<std::function<void(const Buffer&)> > signalDataAvailable;
     std::shared_ptr<MessageThread> thread;
 
@@ -0,0 +1,90 @@
+#include "Parallel.h"
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+
+namespace {
+
+// Shared with the helpers, which may only get to run after the caller is
+// gone. By then there's nothing left to claim so they never touch body
+struct ParallelState
+{
+    ParallelState(size_t c, size_t g, int s, const std::function<void(size_t, size_t, int)> *b)
+        : count(c), grain(g), slots(s), body(b), next(0), done(0), nextSlot(1)
+    {}
+
+    const size_t count, grain;
+    const int slots;
+    const std::function<void(size_t, size_t, int)> *body;
+    std::atomic<size_t> next, done;
+    std::atomic<int> nextSlot;
+    std::mutex mutex;
+    std::condition_variable cond;
+};
+
+}
+
+static void participate(ParallelState &state, int slot)
+{
+    for (;;) {
+        // half of what's left per thread, but at least grain
+        size_t begin = state.next.load(std::memory_order_relaxed);
+        size_t size;
+        do {
+            if (begin >= state.count)
+                return;
+            size = std::max(state.grain, (state.count - begin) / (state.slots * 2));
+            size = std::min(size, state.count - begin);
+        } while (!state.next.compare_exchange_weak(begin, begin + size, std::memory_order_relaxed));
+
+        (*state.body)(begin, begin + size, slot);
+        if (state.done.fetch_add(size, std::memory_order_acq_rel) + size == state.count) {
+            std::lock_guard<std::mutex> lock(state.mutex);
+            state.cond.notify_all();
+        }
+    }
+}
+
+int Rct::parallelSlots(size_t count, size_t grain, ThreadPool *pool)
+{
+    if (!pool)
+        pool = ThreadPool::instance();
+    if (!grain)
+        grain = 1;
+    const size_t chunks = (count + grain - 1) / grain;
+    const size_t threads = std::max(pool->concurrentJobs(), 1);
+    return static_cast<int>(std::max<size_t>(std::min(chunks, threads), 1));
+}
+
+void Rct::parallelRun(size_t count, size_t grain, int slots,
+                      const std::function<void(size_t begin, size_t end, int slot)> &body,
+                      ThreadPool *pool)
+{
+    if (!count)
+        return;
+    if (slots <= 1) {
+        body(0, count, 0);
+        return;
+    }
+    if (!pool)
+        pool = ThreadPool::instance();
+    if (!grain)
+        grain = std::max<size_t>(count / (slots * 32), 1);
+
+    const std::shared_ptr<ParallelState> state = std::make_shared<ParallelState>(count, grain, slots, &body);
+    for (int i = 1; i < slots; ++i) {
+        pool->submit([state]() {
+                const int slot = state->nextSlot.fetch_add(1, std::memory_order_relaxed);
+                participate(*state, slot);
+            });
+    }
+    participate(*state, 0);
+
+    // the last chunks may still be running elsewhere
+    if (state->done.load(std::memory_order_acquire) != count) {
+        std::unique_lock<std::mutex> lock(state->mutex);
+        while (state->done.load(std::memory_order_acquire) != count)
+            state->cond.wait(lock);
+    }
+}
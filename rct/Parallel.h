@@ -0,0 +1,161 @@
+#ifndef Parallel_h
+#define Parallel_h
+
+#include <rct/Hash.h>
+#include <rct/List.h>
+#include <rct/ThreadPool.h>
+#include <algorithm>
+#include <functional>
+#include <iterator>
+#include <type_traits>
+
+// Data parallel loops over a ThreadPool, ThreadPool::instance() unless
+// told otherwise. The calling thread works through the range along with
+// the pool and returns once all of it is done, so these are fine to use
+// from inside a job too. Chunks start out big and shrink towards grain as
+// the range runs out, grain 0 picks one from the size of the range.
+namespace Rct {
+
+// How many threads, the caller included, a range of count would be split
+// over, and so how many slots body gets to see
+int parallelSlots(size_t count, size_t grain = 0, ThreadPool *pool = 0);
+// Calls body(begin, end, slot) for chunks covering [0, count). Chunks with
+// the same slot never run at the same time, slot < slots
+void parallelRun(size_t count, size_t grain, int slots,
+                 const std::function<void(size_t begin, size_t end, int slot)> &body,
+                 ThreadPool *pool = 0);
+
+template <typename F>
+inline void parallelFor(size_t count, F &&f, size_t grain = 0, ThreadPool *pool = 0)
+{
+    parallelRun(count, grain, parallelSlots(count, grain, pool), [&f](size_t begin, size_t end, int) {
+            for (size_t i = begin; i < end; ++i)
+                f(i);
+        }, pool);
+}
+
+template <typename T, typename F>
+inline void parallelFor(List<T> &list, F &&f, size_t grain = 0, ThreadPool *pool = 0)
+{
+    parallelFor(list.size(), [&list, &f](size_t i) { f(list[i]); }, grain, pool);
+}
+
+template <typename T, typename F>
+inline void parallelFor(const List<T> &list, F &&f, size_t grain = 0, ThreadPool *pool = 0)
+{
+    parallelFor(list.size(), [&list, &f](size_t i) { f(list[i]); }, grain, pool);
+}
+
+// f(key, value), with the entries collected in a List first since a Hash
+// can't be split up as it is
+template <typename Key, typename Value, typename F>
+inline void parallelFor(Hash<Key, Value> &hash, F &&f, size_t grain = 0, ThreadPool *pool = 0)
+{
+    List<typename Hash<Key, Value>::value_type *> entries;
+    entries.reserve(hash.size());
+    for (auto &entry : hash)
+        entries.append(&entry);
+    parallelFor(entries.size(), [&entries, &f](size_t i) { f(entries[i]->first, entries[i]->second); }, grain, pool);
+}
+
+template <typename Key, typename Value, typename F>
+inline void parallelFor(const Hash<Key, Value> &hash, F &&f, size_t grain = 0, ThreadPool *pool = 0)
+{
+    List<const typename Hash<Key, Value>::value_type *> entries;
+    entries.reserve(hash.size());
+    for (const auto &entry : hash)
+        entries.append(&entry);
+    parallelFor(entries.size(), [&entries, &f](size_t i) { f(entries[i]->first, entries[i]->second); }, grain, pool);
+}
+
+// f(value) for each one, in the same order
+template <typename T, typename F>
+inline List<typename std::result_of<F(const T &)>::type> parallelMap(const List<T> &list, F &&f, size_t grain = 0, ThreadPool *pool = 0)
+{
+    List<typename std::result_of<F(const T &)>::type> ret(list.size());
+    parallelFor(list.size(), [&ret, &list, &f](size_t i) { ret[i] = f(list[i]); }, grain, pool);
+    return ret;
+}
+
+// f(key, value) for each entry, in the order the Hash iterates in
+template <typename Key, typename Value, typename F>
+inline List<typename std::result_of<F(const Key &, const Value &)>::type> parallelMap(const Hash<Key, Value> &hash, F &&f, size_t grain = 0, ThreadPool *pool = 0)
+{
+    List<typename std::result_of<F(const Key &, const Value &)>::type> ret(hash.size());
+    List<const typename Hash<Key, Value>::value_type *> entries;
+    entries.reserve(hash.size());
+    for (const auto &entry : hash)
+        entries.append(&entry);
+    parallelFor(entries.size(), [&ret, &entries, &f](size_t i) { ret[i] = f(entries[i]->first, entries[i]->second); }, grain, pool);
+    return ret;
+}
+
+// f(result, value) folds a chunk into a result that starts out as
+// identity, combine(result, other) folds those together. In no particular
+// order, so both have to be associative and combine commutative
+template <typename T, typename R, typename F, typename C>
+inline R parallelReduce(const List<T> &list, const R &identity, F &&f, C &&combine, size_t grain = 0, ThreadPool *pool = 0)
+{
+    const int slots = parallelSlots(list.size(), grain, pool);
+    List<R> partials(slots, identity);
+    parallelRun(list.size(), grain, slots, [&](size_t begin, size_t end, int slot) {
+            // a chunk at a time so the slots next to each other aren't
+            // written all along
+            R result = identity;
+            for (size_t i = begin; i < end; ++i)
+                f(result, list[i]);
+            combine(partials[slot], result);
+        }, pool);
+    R ret = identity;
+    for (const R &partial : partials)
+        combine(ret, partial);
+    return ret;
+}
+
+// Sorts pieces of the list in parallel, then merges them pairwise, a round
+// at a time, through a buffer the size of the list. Not stable
+template <typename T, typename Compare>
+inline void parallelSort(List<T> &list, Compare less, ThreadPool *pool = 0)
+{
+    enum { SerialSize = 8192 };
+    const size_t size = list.size();
+    const int slots = parallelSlots(size, SerialSize, pool);
+    if (slots <= 1) {
+        std::sort(list.begin(), list.end(), less);
+        return;
+    }
+    size_t pieces = 1;
+    while (pieces < static_cast<size_t>(slots))
+        pieces *= 2;
+    auto bound = [size, pieces](size_t piece) { return size * piece / pieces; };
+
+    parallelFor(pieces, [&](size_t piece) {
+            std::sort(list.begin() + bound(piece), list.begin() + bound(piece + 1), less);
+        }, 1, pool);
+
+    List<T> buffer(size);
+    List<T> *from = &list, *to = &buffer;
+    for (size_t width = 1; width < pieces; width *= 2) {
+        parallelFor(pieces / (width * 2), [&](size_t merge) {
+                const size_t first = bound(merge * width * 2);
+                const size_t middle = bound(merge * width * 2 + width);
+                const size_t last = bound(merge * width * 2 + width * 2);
+                std::merge(std::make_move_iterator(from->begin() + first), std::make_move_iterator(from->begin() + middle),
+                           std::make_move_iterator(from->begin() + middle), std::make_move_iterator(from->begin() + last),
+                           to->begin() + first, less);
+            }, 1, pool);
+        std::swap(from, to);
+    }
+    if (from != &list)
+        list.swap(buffer);
+}
+
+template <typename T>
+inline void parallelSort(List<T> &list, ThreadPool *pool = 0)
+{
+    parallelSort(list, std::less<T>(), pool);
+}
+
+}
+
+#endif
@@ -1,5 +1,8 @@
 #include "Path.h"
+#include "Hash.h"
 #include "Log.h"
+#include "MappedFile.h"
+#include "PathWalker.h"
 #include "Rct.h"
 #include "rct-config.h"
 #include <stdio.h>
@@ -9,6 +12,8 @@
 #include <dirent.h>
 #include <fts.h>
 #include <wordexp.h>
+#include <atomic>
+#include <mutex>
 
 // this doesn't check if *this actually is a real file
 Path Path::parentDir() const
@@ -171,6 +176,64 @@ Path Path::resolved(ResolveMode mode, const Path &cwd, bool *ok) const
     return ret;
 }
 
+namespace {
+struct ResolveCacheShard
+{
+    std::mutex mutex;
+    // cwd '\0' path
+    Hash<String, Path> paths;
+};
+enum {
+    ResolveCacheShards = 16,
+    // a shard that gets this big starts over
+    ResolveCacheShardSize = 8192
+};
+}
+
+static std::atomic<bool> sResolveCacheEnabled(false);
+static ResolveCacheShard sResolveCache[ResolveCacheShards];
+
+static inline ResolveCacheShard &resolveCacheShard(const String &key)
+{
+    return sResolveCache[std::hash<String>()(key) % ResolveCacheShards];
+}
+
+// path is dir or something in it
+static inline bool isUnder(const char *path, int size, const Path &dir)
+{
+    int len = dir.size();
+    while (len > 1 && dir.at(len - 1) == '/')
+        --len;
+    return size >= len && !strncmp(path, dir.constData(), len) && (size == len || path[len] == '/' || len == 1);
+}
+
+static bool realPath(Path &path, const Path &cwd, bool *changed)
+{
+    if (!cwd.isEmpty() && !path.isAbsolute()) {
+        Path copy = cwd + '/' + path;
+        if (realPath(copy, Path(), changed)) {
+            path = copy;
+            return true;
+        }
+    }
+
+    char buffer[PATH_MAX + 2];
+    if (realpath(path.constData(), buffer)) {
+        if (path.isDir()) {
+            const int len = strlen(buffer);
+            assert(buffer[len] != '/');
+            buffer[len] = '/';
+            buffer[len + 1] = '\0';
+        }
+        if (changed && strcmp(buffer, path.constData()))
+            *changed = true;
+        path = buffer;
+        return true;
+    }
+
+    return false;
+}
+
 bool Path::resolve(ResolveMode mode, const Path &cwd, bool *changed)
 {
     if (changed)
@@ -194,31 +257,118 @@ bool Path::resolve(ResolveMode mode, const Path &cwd, bool *changed)
         return false;
     }
 
-    if (!cwd.isEmpty() && !isAbsolute()) {
-        Path copy = cwd + '/' + *this;
-        if (copy.resolve(RealPath, Path(), changed)) {
-            operator=(copy);
+    // a relative path without a cwd depends on the process' working
+    // directory, which can change under us, so it isn't cached
+    if (!sResolveCacheEnabled.load(std::memory_order_relaxed) || (cwd.isEmpty() && !isAbsolute()))
+        return realPath(*this, cwd, changed);
+
+    String key;
+    key.reserve(cwd.size() + size() + 1);
+    key = cwd;
+    key.append('\0');
+    key.append(*this);
+    ResolveCacheShard &shard = resolveCacheShard(key);
+    {
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        const auto it = shard.paths.find(key);
+        if (it != shard.paths.end()) {
+            if (changed && it->second != *this)
+                *changed = true;
+            operator=(it->second);
             return true;
         }
     }
 
-    {
-        char buffer[PATH_MAX + 2];
-        if (realpath(constData(), buffer)) {
-            if (isDir()) {
-                const int len = strlen(buffer);
-                assert(buffer[len] != '/');
-                buffer[len] = '/';
-                buffer[len + 1] = '\0';
+    // failures aren't cached, nothing would tell us when they stop failing
+    if (!realPath(*this, cwd, changed))
+        return false;
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    if (shard.paths.size() >= ResolveCacheShardSize)
+        shard.paths.clear();
+    shard.paths[key] = *this;
+    return true;
+}
+
+void Path::setResolveCacheEnabled(bool enabled)
+{
+    sResolveCacheEnabled.store(enabled);
+    if (!enabled)
+        invalidateResolveCache();
+}
+
+bool Path::isResolveCacheEnabled()
+{
+    return sResolveCacheEnabled.load();
+}
+
+void Path::invalidateResolveCache(const Path &path)
+{
+    for (ResolveCacheShard &shard : sResolveCache) {
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        if (path.isEmpty()) {
+            shard.paths.clear();
+            continue;
+        }
+        auto it = shard.paths.begin();
+        while (it != shard.paths.end()) {
+            const String &key = it->first;
+            const int sep = key.indexOf('\0');
+            const char *input = key.constData() + sep + 1;
+            const int inputSize = key.size() - sep - 1;
+            bool drop = isUnder(it->second.constData(), it->second.size(), path);
+            if (!drop) {
+                if (*input == '/') {
+                    drop = isUnder(input, inputSize, path);
+                } else {
+                    // only cached with a cwd
+                    const String absolute = key.left(sep) + '/' + String(input, inputSize);
+                    drop = isUnder(absolute.constData(), absolute.size(), path);
+                }
+            }
+            if (drop) {
+                it = shard.paths.erase(it);
+            } else {
+                ++it;
             }
-            if (changed && strcmp(buffer, constData()))
-                *changed = true;
-            String::operator=(buffer);
-            return true;
         }
     }
+}
 
-    return false;
+bool Path::isSameFile(const Path &other, CompareMode mode) const
+{
+    if (mode == CompareLexical)
+        return normalized().String::operator==(other.normalized());
+    return Path::resolved(*this).String::operator==(Path::resolved(other));
+}
+
+Path Path::normalized() const
+{
+    if (isEmpty())
+        return *this;
+    const bool absolute = isAbsolute();
+    List<String> components;
+    for (const String &component : split('/')) {
+        if (component.isEmpty() || component == ".")
+            continue;
+        if (component == "..") {
+            if (!components.isEmpty() && components.back() != "..") {
+                components.pop_back();
+                continue;
+            }
+            // /.. is /
+            if (absolute)
+                continue;
+        }
+        components.append(component);
+    }
+    Path ret;
+    ret.reserve(size());
+    if (absolute)
+        ret.append('/');
+    ret.append(String::join(components, '/'));
+    if (ret.isEmpty())
+        ret = ".";
+    return ret;
 }
 
 const char * Path::fileName(int *len) const
@@ -410,63 +560,14 @@ bool Path::rmdir(const Path& dir)
     return !::rmdir(dir.constData());
 }
 
-static void visitorWrapper(Path path, Path::VisitCallback callback, Set<Path> &seen, void *userData)
-{
-    if (!seen.insert(path.resolved())) {
-        return;
-    }
-    DIR *d = opendir(path.constData());
-    if (!d)
-        return;
-
-    char buf[PATH_MAX + sizeof(dirent) + 1];
-    dirent *dbuf = reinterpret_cast<dirent*>(buf);
-
-    dirent *p;
-    if (!path.endsWith('/'))
-        path.append('/');
-    const int s = path.size();
-    path.reserve(s + 128);
-    List<String> recurseDirs;
-    while (!readdir_r(d, dbuf, &p) && p) {
-        if (!strcmp(p->d_name, ".") || !strcmp(p->d_name, ".."))
-            continue;
-        path.truncate(s);
-        path.append(p->d_name);
-#if defined(_DIRENT_HAVE_D_TYPE) && defined(_BSD_SOURCE)
-        if (p->d_type == DT_DIR)
-            path.append('/');
-#else
-        if (path.isDir())
-            path.append('/');
-#endif
-        switch (callback(path, userData)) {
-        case Path::Abort:
-            p = 0;
-            break;
-        case Path::Recurse:
-            if (path.isDir())
-                recurseDirs.append(p->d_name);
-            break;
-        case Path::Continue:
-            break;
-        }
-    }
-    closedir(d);
-    const int count = recurseDirs.size();
-    for (int i=0; i<count; ++i) {
-        path.truncate(s);
-        path.append(recurseDirs.at(i));
-        visitorWrapper(path, callback, seen, userData);
-    }
-}
-
 void Path::visit(VisitCallback callback, void *userData) const
 {
     if (!callback || !isDir())
         return;
-    Set<Path> seenDirs;
-    visitorWrapper(*this, callback, seenDirs, userData);
+    PathWalker walker(*this, PathWalker::FollowSymLinks);
+    walker.walk([callback, userData](const PathWalker::Entry &entry) {
+            return callback(entry.path, userData);
+        });
 }
 
 Path Path::followLink(bool *ok) const
@@ -522,6 +623,14 @@ String Path::readAll(int max) const
     return ret;
 }
 
+std::shared_ptr<MappedFile> Path::map(unsigned int flags) const
+{
+    std::shared_ptr<MappedFile> file = std::make_shared<MappedFile>();
+    if (!file->open(*this, flags | MappedFile::ReadFallback))
+        return std::shared_ptr<MappedFile>();
+    return file;
+}
+
 bool Path::write(const Path& path, const String& data, WriteMode mode)
 {
     FILE* f = fopen(path.constData(), mode == Overwrite ? "w" : "a");
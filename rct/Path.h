@@ -8,11 +8,17 @@
 #include <unistd.h>
 #include <rct/Set.h>
 #include <rct/String.h>
+#include <memory>
 #include <string>
 
+class MappedFile;
+
 class Path : public String
 {
 public:
+    // interned as parent and name, see StringPool.h
+    class Atom;
+
     Path(const Path &other)
         : String(other)
     {}
@@ -43,10 +49,13 @@ public:
         return *this;
     }
 
-    bool isSameFile(const Path &other) const
-    {
-        return Path::resolved(*this).String::operator==(Path::resolved(other));
-    }
+    enum CompareMode {
+        // resolved through the file system, symlinks and all
+        CompareResolved,
+        // normalized() without touching the file system
+        CompareLexical
+    };
+    bool isSameFile(const Path &other, CompareMode mode = CompareResolved) const;
 
     enum Type {
         Invalid = 0x00,
@@ -111,6 +120,20 @@ public:
     int canonicalize();
     Path canonicalized() const;
     static Path canonicalized(const Path &path);
+    // drops ., .. and repeated and trailing slashes, without looking at
+    // the file system so a .. after a symlink may not end up where
+    // realpath() would
+    Path normalized() const;
+
+    // RealPath resolution through a process wide cache keyed on the path
+    // and cwd, off by default. FileSystemWatcher invalidates what its
+    // changes touch, anything that isn't watched stays until it's
+    // invalidated here. Relative paths without a cwd aren't cached
+    static void setResolveCacheEnabled(bool enabled);
+    static bool isResolveCacheEnabled();
+    // drops what's at or under path, or resolved to there. Everything for
+    // an empty path
+    static void invalidateResolveCache(const Path &path = Path());
     time_t lastModified() const; // returns time_t ... no shit
     time_t lastAccess() const;
     bool setLastModified(time_t lastModified) const;
@@ -122,6 +145,9 @@ public:
     static Path pwd();
     int readAll(char *&, int max = -1) const;
     String readAll(int max = -1) const;
+    // the contents without copying them, read if it can't be mapped. Null
+    // if it can't be read at all. Flags are MappedFile::Flag
+    std::shared_ptr<MappedFile> map(unsigned int flags = 0) const;
 
     bool touch() const
     {
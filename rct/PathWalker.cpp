@@ -0,0 +1,459 @@
+#include "PathWalker.h"
+#include "Rct.h"
+#include "Set.h"
+#include "ThreadPool.h"
+#include <condition_variable>
+#include <dirent.h>
+#include <fcntl.h>
+#include <memory>
+#include <mutex>
+#include <sys/stat.h>
+#include <unistd.h>
+#if defined(OS_Linux)
+#  include <sys/syscall.h>
+#endif
+
+enum { ReadBufferSize = 32 * 1024 };
+
+static inline Path::Type typeFromMode(mode_t mode)
+{
+    switch (mode & S_IFMT) {
+    case S_IFREG: return Path::File;
+    case S_IFDIR: return Path::Directory;
+    case S_IFCHR: return Path::CharacterDevice;
+    case S_IFBLK: return Path::BlockDevice;
+    case S_IFIFO: return Path::NamedPipe;
+    case S_IFSOCK: return Path::Socket;
+    }
+    return Path::Invalid;
+}
+
+static inline Path::Type typeFromDirent(unsigned char type)
+{
+    switch (type) {
+    case DT_REG: return Path::File;
+    case DT_DIR: return Path::Directory;
+    case DT_CHR: return Path::CharacterDevice;
+    case DT_BLK: return Path::BlockDevice;
+    case DT_FIFO: return Path::NamedPipe;
+    case DT_SOCK: return Path::Socket;
+    }
+    return Path::Invalid;
+}
+
+// f(name, d_type) for everything in the directory, buf is ReadBufferSize
+template <typename F>
+static bool readEntries(int fd, char *buf, F &&f)
+{
+#if defined(OS_Linux) && defined(SYS_getdents64)
+    struct LinuxDirent64
+    {
+        uint64_t d_ino;
+        int64_t d_off;
+        unsigned short d_reclen;
+        unsigned char d_type;
+        char d_name[1];
+    };
+    while (true) {
+        const long read = syscall(SYS_getdents64, fd, buf, ReadBufferSize);
+        if (read < 0)
+            return false;
+        if (!read)
+            return true;
+        for (long pos = 0; pos < read; ) {
+            const LinuxDirent64 *entry = reinterpret_cast<const LinuxDirent64 *>(buf + pos);
+            f(entry->d_name, entry->d_type);
+            pos += entry->d_reclen;
+        }
+    }
+#else
+    (void)buf;
+    const int copy = dup(fd);
+    if (copy == -1)
+        return false;
+    DIR *dir = fdopendir(copy);
+    if (!dir) {
+        ::close(copy);
+        return false;
+    }
+    while (const dirent *entry = readdir(dir)) {
+#ifdef _DIRENT_HAVE_D_TYPE
+        f(entry->d_name, entry->d_type);
+#else
+        f(entry->d_name, DT_UNKNOWN);
+#endif
+    }
+    closedir(dir);
+    return true;
+#endif
+}
+
+namespace {
+
+struct Dir
+{
+    Dir(Dir *p, const Path &pa, int d)
+        : parent(p), path(pa), depth(d), state(Pending), released(false), cancelled(false)
+    {}
+
+    Dir *const parent;
+    // ends with a '/'
+    const Path path;
+    const int depth;
+
+    // what's found, and which of it is to be walked, by index in entries
+    List<PathWalker::Entry> entries;
+    List<int> subdirs;
+
+    // the rest is under WalkState::mutex. Released is when the caller
+    // wants it, it's delivered once it's also been Listed
+    enum { Pending, Taken, Listed } state;
+    bool released, cancelled;
+    List<Dir*> children;
+};
+
+// Shared with the workers, which may only get to run after the walk is
+// over. By then there's nothing pending that they'd read
+struct WalkState
+{
+    WalkState(unsigned int f, int m, const GlobSet &e, const GlobSet &i, const PathWalker::Filter &fi)
+        : flags(f), maxDepth(m), excludes(e), includes(i), filter(fi), pool(0), workers(0), maxWorkers(0), stopped(false)
+    {}
+    ~WalkState()
+    {
+        for (Dir *dir : dirs)
+            delete dir;
+    }
+
+    const unsigned int flags;
+    const int maxDepth;
+    const GlobSet excludes, includes;
+    const PathWalker::Filter filter;
+    ThreadPool *pool;
+
+    std::mutex mutex;
+    std::condition_variable cond;
+    // owns them all
+    List<Dir*> dirs;
+    // to be read, the newest last
+    List<Dir*> pending;
+    // unordered, released and listed
+    List<Dir*> ready;
+    int workers, maxWorkers;
+    bool stopped;
+    // directories seen with FollowSymLinks
+    Set<std::pair<dev_t, ino_t> > seen;
+};
+
+}
+
+static bool excluded(const WalkState &state, const Path &path, Path::Type type)
+{
+    if (state.excludes.matches(path))
+        return true;
+    return state.filter && !state.filter(path, type);
+}
+
+static bool included(const WalkState &state, const Path &path)
+{
+    return state.includes.isEmpty() || state.includes.matches(path);
+}
+
+// the first time this directory is seen, when following symlinks
+static bool firstVisit(WalkState &state, int fd)
+{
+    if (!(state.flags & PathWalker::FollowSymLinks))
+        return true;
+    struct stat st;
+    if (fstat(fd, &st) == -1)
+        return false;
+    std::lock_guard<std::mutex> lock(state.mutex);
+    return state.seen.insert(std::make_pair(st.st_dev, st.st_ino));
+}
+
+// fills in entries and subdirs
+static void readDir(WalkState &state, Dir &dir, int fd, char *buf)
+{
+    if (!firstVisit(state, fd))
+        return;
+    const bool canRecurse = state.maxDepth < 0 || dir.depth < state.maxDepth;
+    readEntries(fd, buf, [&](const char *name, unsigned char dtype) {
+            if (name[0] == '.' && (!name[1] || (name[1] == '.' && !name[2])))
+                return;
+            if (state.flags & PathWalker::SkipHidden && name[0] == '.')
+                return;
+            PathWalker::Entry entry;
+            entry.symLink = false;
+            entry.depth = dir.depth;
+            entry.type = typeFromDirent(dtype);
+            struct stat st;
+            if (dtype == DT_UNKNOWN) {
+                if (fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW) == -1)
+                    return;
+                if (S_ISLNK(st.st_mode)) {
+                    dtype = DT_LNK;
+                } else {
+                    entry.type = typeFromMode(st.st_mode);
+                }
+            }
+            if (dtype == DT_LNK) {
+                entry.symLink = true;
+                entry.type = fstatat(fd, name, &st, 0) == -1 ? Path::Invalid : typeFromMode(st.st_mode);
+            }
+
+            const int nameLength = strlen(name);
+            entry.path.reserve(dir.path.size() + nameLength + 1);
+            entry.path = dir.path;
+            entry.path.append(name, nameLength);
+            if (entry.type == Path::Directory)
+                entry.path.append('/');
+
+            if (excluded(state, entry.path, entry.type))
+                return;
+            const bool recurse = (entry.type == Path::Directory && canRecurse
+                                  && (!entry.symLink || state.flags & PathWalker::FollowSymLinks));
+            if (entry.type != Path::Directory && !included(state, entry.path))
+                return;
+            if (recurse)
+                dir.subdirs.append(dir.entries.size());
+            dir.entries.append(std::move(entry));
+        });
+}
+
+static inline int openFlags(const WalkState &state)
+{
+    return O_RDONLY | O_DIRECTORY | O_CLOEXEC | (state.flags & PathWalker::FollowSymLinks ? 0 : O_NOFOLLOW);
+}
+
+// depth first, each directory opened relative to its parent
+static bool walkSerial(WalkState &state, Dir &dir, int fd, char *buf, const PathWalker::Callback &callback)
+{
+    readDir(state, dir, fd, buf);
+    List<Path> recurse;
+    int sub = 0;
+    for (int i = 0; i < dir.entries.size(); ++i) {
+        const Path::VisitResult result = callback(dir.entries.at(i));
+        if (result == Path::Abort)
+            return false;
+        if (sub < dir.subdirs.size() && dir.subdirs.at(sub) == i) {
+            ++sub;
+            if (result == Path::Recurse)
+                recurse.append(dir.entries.at(i).path);
+        }
+    }
+    dir.entries.clear();
+    dir.subdirs.clear();
+
+    for (const Path &path : recurse) {
+        // the name, without the trailing '/'
+        const String name = path.mid(dir.path.size(), path.size() - dir.path.size() - 1);
+        const int child = openat(fd, name.constData(), openFlags(state));
+        if (child == -1)
+            continue;
+        Dir sub(&dir, path, dir.depth + 1);
+        const bool ok = walkSerial(state, sub, child, buf, callback);
+        ::close(child);
+        if (!ok)
+            return false;
+    }
+    return true;
+}
+
+static void work(const std::shared_ptr<WalkState> &state);
+
+// needs the mutex
+static void spawnWorkers(const std::shared_ptr<WalkState> &state)
+{
+    while (state->workers < state->maxWorkers && state->workers < state->pending.size()) {
+        ++state->workers;
+        state->pool->submit([state]() { work(state); });
+    }
+}
+
+// needs the mutex, a pending directory that's still wanted
+static Dir *takePending(WalkState &state)
+{
+    while (!state.pending.isEmpty()) {
+        Dir *dir = state.pending.back();
+        state.pending.pop_back();
+        if (dir->state != Dir::Pending)
+            continue;
+        bool cancelled = false;
+        for (Dir *d = dir; d && !cancelled; d = d->parent)
+            cancelled = d->cancelled;
+        // nobody will ask for it, there are no children to find
+        dir->state = cancelled ? Dir::Listed : Dir::Taken;
+        if (!cancelled)
+            return dir;
+    }
+    return 0;
+}
+
+// without the mutex, dir is Taken
+static void listDir(WalkState &state, Dir &dir, char *buf)
+{
+    const int fd = open(dir.path.constData(), openFlags(state));
+    if (fd != -1) {
+        readDir(state, dir, fd, buf);
+        ::close(fd);
+    }
+}
+
+// needs the mutex
+static void finishDir(const std::shared_ptr<WalkState> &state, Dir *dir)
+{
+    dir->state = Dir::Listed;
+    for (int idx : dir->subdirs) {
+        Dir *child = new Dir(dir, dir->entries.at(idx).path, dir->depth + 1);
+        state->dirs.append(child);
+        dir->children.append(child);
+    }
+    // last in, first out, so the first child is read first
+    for (int i = dir->children.size() - 1; i >= 0; --i)
+        state->pending.append(dir->children.at(i));
+    if (dir->released && !(state->flags & PathWalker::Ordered))
+        state->ready.append(dir);
+    state->cond.notify_all();
+    spawnWorkers(state);
+}
+
+static void work(const std::shared_ptr<WalkState> &state)
+{
+    std::unique_ptr<char[]> buf(new char[ReadBufferSize]);
+    std::unique_lock<std::mutex> lock(state->mutex);
+    while (!state->stopped) {
+        Dir *dir = takePending(*state);
+        if (!dir)
+            break;
+        lock.unlock();
+        listDir(*state, *dir, buf.get());
+        lock.lock();
+        finishDir(state, dir);
+    }
+    --state->workers;
+}
+
+// needs the lock, reads a pending directory or waits for a worker to
+// finish one
+static void helpOrWait(const std::shared_ptr<WalkState> &state, std::unique_lock<std::mutex> &lock, char *buf)
+{
+    if (Dir *dir = takePending(*state)) {
+        lock.unlock();
+        listDir(*state, *dir, buf);
+        lock.lock();
+        finishDir(state, dir);
+    } else {
+        state->cond.wait(lock);
+    }
+}
+
+// delivers what's in dir, the children that are to be walked go in
+// recurse and the others are cancelled. Unordered, children that are
+// listed already are queued here and the rest by finishDir(), both decide
+// under the mutex so each one is queued once
+static bool deliver(const std::shared_ptr<WalkState> &state, Dir *dir, const PathWalker::Callback &callback, List<Dir*> &recurse)
+{
+    List<Path::VisitResult> results(dir->subdirs.size(), Path::Continue);
+    int sub = 0;
+    for (int i = 0; i < dir->entries.size(); ++i) {
+        const Path::VisitResult result = callback(dir->entries.at(i));
+        if (result == Path::Abort)
+            return false;
+        if (sub < dir->subdirs.size() && dir->subdirs.at(sub) == i)
+            results[sub++] = result;
+    }
+    dir->entries.clear();
+
+    std::lock_guard<std::mutex> lock(state->mutex);
+    for (int i = 0; i < dir->children.size(); ++i) {
+        Dir *child = dir->children.at(i);
+        if (results.at(i) == Path::Recurse) {
+            child->released = true;
+            recurse.append(child);
+            if (child->state == Dir::Listed && !(state->flags & PathWalker::Ordered))
+                state->ready.append(child);
+        } else {
+            child->cancelled = true;
+        }
+    }
+    return true;
+}
+
+static bool walkParallel(const std::shared_ptr<WalkState> &state, Dir *root, const PathWalker::Callback &callback)
+{
+    std::unique_ptr<char[]> buf(new char[ReadBufferSize]);
+    std::unique_lock<std::mutex> lock(state->mutex);
+    root->released = true;
+    state->pending.append(root);
+    bool ret = true;
+    List<Dir*> recurse;
+    if (state->flags & PathWalker::Ordered) {
+        List<Dir*> stack;
+        stack.append(root);
+        while (ret && !stack.isEmpty()) {
+            Dir *dir = stack.back();
+            stack.pop_back();
+            while (dir->state != Dir::Listed) {
+                if (dir->state == Dir::Pending) {
+                    // it's next, don't wait for a worker to get to it
+                    dir->state = Dir::Taken;
+                    lock.unlock();
+                    listDir(*state, *dir, buf.get());
+                    lock.lock();
+                    finishDir(state, dir);
+                } else {
+                    helpOrWait(state, lock, buf.get());
+                }
+            }
+            lock.unlock();
+            recurse.clear();
+            ret = deliver(state, dir, callback, recurse);
+            lock.lock();
+            for (int i = recurse.size() - 1; i >= 0; --i)
+                stack.append(recurse.at(i));
+        }
+    } else {
+        // released and not delivered yet
+        int outstanding = 1;
+        while (ret && outstanding) {
+            while (state->ready.isEmpty())
+                helpOrWait(state, lock, buf.get());
+            Dir *dir = state->ready.back();
+            state->ready.pop_back();
+            lock.unlock();
+            recurse.clear();
+            ret = deliver(state, dir, callback, recurse);
+            lock.lock();
+            outstanding += recurse.size() - 1;
+        }
+    }
+    state->stopped = true;
+    return ret;
+}
+
+PathWalker::PathWalker(const Path &root, unsigned int flags)
+    : mRoot(root.ensureTrailingSlash()), mFlags(flags), mPool(0), mMaxDepth(-1)
+{
+}
+
+bool PathWalker::walk(const Callback &callback)
+{
+    assert(callback);
+    const std::shared_ptr<WalkState> state = std::make_shared<WalkState>(mFlags, mMaxDepth, mExcludes, mIncludes, mFilter);
+    if (mFlags & Parallel) {
+        state->pool = mPool ? mPool : ThreadPool::instance();
+        state->maxWorkers = state->pool->concurrentJobs();
+        Dir *root = new Dir(0, mRoot, 0);
+        state->dirs.append(root);
+        return walkParallel(state, root, callback);
+    }
+
+    const int fd = open(mRoot.constData(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1)
+        return false;
+    std::unique_ptr<char[]> buf(new char[ReadBufferSize]);
+    Dir root(0, mRoot, 0);
+    const bool ret = walkSerial(*state, root, fd, buf.get(), callback);
+    ::close(fd);
+    return ret;
+}
@@ -0,0 +1,82 @@
+#ifndef PathWalker_h
+#define PathWalker_h
+
+#include <rct/GlobSet.h>
+#include <rct/List.h>
+#include <rct/Path.h>
+#include <rct/String.h>
+#include <functional>
+
+class ThreadPool;
+
+// Walks a directory tree. Entries are read with getdents64() on Linux,
+// readdir() elsewhere, and their type comes from d_type, only symlinks and
+// file systems that don't fill it in cost an fstatat(). Everything is
+// opened relative to the directory it's in.
+//
+// Excludes and the filter are applied before a directory is opened, what
+// they turn down is never read. With Parallel, directories are read on
+// ThreadPool workers while the calling thread delivers what they found,
+// helping out with the reading whenever it would otherwise wait. The
+// callback is only ever called on the calling thread.
+class PathWalker
+{
+public:
+    struct Entry
+    {
+        // directories end with a '/'
+        Path path;
+        // of what a symlink points to, Invalid if it's dangling
+        Path::Type type;
+        bool symLink;
+        // 0 for what's in the root
+        int depth;
+    };
+
+    enum Flag {
+        None = 0x0,
+        // read directories on ThreadPool workers
+        Parallel = 0x1,
+        // with Parallel, deliver in the order a serial walk would
+        Ordered = 0x2,
+        // go into symlinked directories, each directory once
+        FollowSymLinks = 0x4,
+        // leave out names starting with a '.'
+        SkipHidden = 0x8
+    };
+
+    // Abort stops the walk. For a directory Recurse goes into it and
+    // Continue doesn't, with Parallel it may have been read already but
+    // none of it is delivered
+    typedef std::function<Path::VisitResult(const Entry &entry)> Callback;
+    // false to leave the entry out, and not go into it. With Parallel it's
+    // called on the workers
+    typedef std::function<bool(const Path &path, Path::Type type)> Filter;
+
+    PathWalker(const Path &root, unsigned int flags = None);
+
+    // ThreadPool::instance() by default
+    void setThreadPool(ThreadPool *pool) { mPool = pool; }
+    // -1 for no limit, 0 is only what's in the root
+    void setMaxDepth(int depth) { mMaxDepth = depth; }
+    // Rct::wildCmp() patterns matched against the whole path, all at once
+    // with a GlobSet. Excluded entries are left out, excluded directories
+    // aren't read
+    void addExclude(const String &pattern) { mExcludes.add(pattern); }
+    // if there are any, only what matches one of them is delivered.
+    // Directories are always delivered and walked
+    void addInclude(const String &pattern) { mIncludes.add(pattern); }
+    void setFilter(const Filter &filter) { mFilter = filter; }
+
+    // false if it was aborted or the root couldn't be read
+    bool walk(const Callback &callback);
+private:
+    const Path mRoot;
+    const unsigned int mFlags;
+    ThreadPool *mPool;
+    int mMaxDepth;
+    GlobSet mExcludes, mIncludes;
+    Filter mFilter;
+};
+
+#endif
@@ -6,25 +6,84 @@
 #include "SocketClient.h"
 #include "StopWatch.h"
 #include "Thread.h"
+#include "Trace.h"
 #include <map>
 #include <unordered_map>
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <unistd.h>
+#ifdef HAVE_PIDFD
+#include <sys/syscall.h>
+#endif
+#ifdef HAVE_POSIX_SPAWN
+#include <spawn.h>
+#endif
 #ifdef OS_Darwin
 #include <crt_externs.h>
 #endif
 
 static std::once_flag sProcessHandler;
 
+static inline int pidFdOpen(pid_t pid)
+{
+#ifdef HAVE_PIDFD
+    return ::syscall(SYS_pidfd_open, pid, 0);
+#else
+    (void)pid;
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+// With pidfds each child's exit is an event on its own fd, polled in exec()
+// and on the EventLoop for start(), and nobody calls waitpid() for children
+// that aren't theirs. Without, a SIGCHLD handler wakes up ProcessThread which
+// reaps them all. It's one or the other for the whole process, the thread's
+// waitpid() would take children from under the pidfds. The exception is
+// start() on a thread without an EventLoop, nothing would poll the pidfd so
+// ProcessThread is started anyway and waits for just those pids
+static bool usePidFd()
+{
+    static const bool use = []() {
+        const int fd = pidFdOpen(getpid());
+        if (fd == -1)
+            return false;
+        ::close(fd);
+        return true;
+    }();
+    return use;
+}
+
+// the child's end of the pipe becomes a copy of target, there's nothing for
+// us to read
+static inline void redirectOutput(int pipe[2], int target)
+{
+    if (target == -1)
+        return;
+    int err;
+    eintrwrap(err, ::close(pipe[0]));
+    eintrwrap(err, ::close(pipe[1]));
+    pipe[0] = -1;
+    // past stderr, the child dup2()s it there
+    eintrwrap(pipe[1], ::fcntl(target, F_DUPFD_CLOEXEC, STDERR_FILENO + 1));
+}
+
+static inline int exitCode(int status)
+{
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1; // Process::ReturnCrashed
+}
+
 class ProcessThread : public Thread
 {
 public:
     static void installProcessHandler();
     static void addPid(pid_t pid, Process* process, bool async);
+    // with pidfds, for a child nothing polls the pidfd of
+    static void watchPid(pid_t pid, Process* process);
     static void shutdown();
     static void setPending(int pending);
 
@@ -74,6 +133,7 @@ public:
 
 ProcessThread::ProcessThread()
 {
+    setName("ProcessReaper");
     ::signal(SIGCHLD, ProcessThread::processSignalHandler);
 
     int flg;
@@ -119,6 +179,17 @@ void ProcessThread::addPid(pid_t pid, Process* process, bool async)
         sPendingPids.clear();
 }
 
+void ProcessThread::watchPid(pid_t pid, Process* process)
+{
+    std::call_once(sProcessHandler, ProcessThread::installProcessHandler);
+    {
+        std::lock_guard<std::mutex> lock(sProcessMutex);
+        sProcesses[pid] = { process, EventLoop::SharedPtr() };
+    }
+    // it may have exited before there was a handler
+    wakeup(Child);
+}
+
 void ProcessThread::run()
 {
     ssize_t r;
@@ -128,6 +199,26 @@ void ProcessThread::run()
         if (r == 1) {
             if (ch == 's') {
                 break;
+            } else if (usePidFd()) {
+                // only the ones we were given, the rest are polled
+                std::unique_lock<std::mutex> lock(sProcessMutex);
+                auto proc = sProcesses.begin();
+                while (proc != sProcesses.end()) {
+                    int ret;
+                    pid_t p;
+                    eintrwrap(p, ::waitpid(proc->first, &ret, WNOHANG));
+                    if (!p) {
+                        ++proc;
+                        continue;
+                    }
+                    ret = p == -1 ? -1 : exitCode(ret); // Process::ReturnCrashed
+                    Process *process = proc->second.proc;
+                    sProcesses.erase(proc);
+                    lock.unlock();
+                    process->finish(ret);
+                    lock.lock();
+                    proc = sProcesses.begin();
+                }
             } else {
                 int ret;
                 pid_t p;
@@ -150,11 +241,7 @@ void ProcessThread::run()
                         break;
                     default:
                         //printf("successfully waited for pid (got %d)\n", p);
-                        if (WIFEXITED(ret)) {
-                            ret = WEXITSTATUS(ret);
-                        } else {
-                            ret = Process::ReturnCrashed;
-                        }
+                        ret = exitCode(ret);
                         auto proc = sProcesses.find(p);
                         if (proc != sProcesses.end()) {
                             Process *process = proc->second.proc;
@@ -220,10 +307,12 @@ void ProcessThread::installProcessHandler()
 }
 
 Process::Process()
-    : mPid(-1), mReturn(ReturnUnset), mStdInIndex(0), mStdOutIndex(0), mStdErrIndex(0),
-      mWantStdInClosed(false), mMode(Sync)
+    : mPid(-1), mPidFd(-1), mReturn(ReturnUnset), mStdOutTarget(-1), mStdErrTarget(-1), mOutputLimit(0),
+      mStdOutReading(false), mStdErrReading(false), mOutputSuspended(false), mStdInIndex(0), mStdOutIndex(0),
+      mStdErrIndex(0), mWantStdInClosed(false), mMode(Sync)
 {
-    std::call_once(sProcessHandler, ProcessThread::installProcessHandler);
+    if (!usePidFd())
+        std::call_once(sProcessHandler, ProcessThread::installProcessHandler);
 
     mStdIn[0] = mStdIn[1] = -1;
     mStdOut[0] = mStdOut[1] = -1;
@@ -246,6 +335,7 @@ Process::~Process()
     closeStdIn(CloseForce);
     closeStdOut();
     closeStdErr();
+    closePidFd();
 
     int w;
     if (mSync[0] != -1)
@@ -341,6 +431,8 @@ Process::ExecState Process::startInternal(const Path &command, const List<String
     eintrwrap(err, ::pipe(mStdIn));
     eintrwrap(err, ::pipe(mStdOut));
     eintrwrap(err, ::pipe(mStdErr));
+    redirectOutput(mStdOut, mStdOutTarget);
+    redirectOutput(mStdErr, mStdErrTarget);
     if (mMode == Sync)
         eintrwrap(err, ::pipe(mSync));
 
@@ -370,14 +462,53 @@ Process::ExecState Process::startInternal(const Path &command, const List<String
         }
     }
 
-    ProcessThread::setPending(1);
+    const bool pidFd = usePidFd();
+    if (!pidFd)
+        ProcessThread::setPending(1);
+
+    bool spawned = false;
+#ifdef HAVE_POSIX_SPAWN
+    // posix_spawn() doesn't copy the page tables, which with a big parent
+    // is most of what starting a process costs, and can't fail for
+    // overcommit. chroot() needs fork()
+    if (mChRoot.isEmpty()
+#ifndef HAVE_POSIX_SPAWN_CHDIR
+        && mCwd.isEmpty()
+#endif
+        && mStdIn[0] > STDERR_FILENO && mStdOut[1] > STDERR_FILENO && mStdErr[1] > STDERR_FILENO) {
+        const int spawnError = spawn(cmd, args, hasEnviron ? env : 0, closePipe[0]);
+        if (spawnError) {
+            if (!pidFd)
+                ProcessThread::setPending(-1);
 
-    mPid = ::fork();
+            eintrwrap(err, ::close(mStdIn[1]));
+            eintrwrap(err, ::close(mStdIn[0]));
+            eintrwrap(err, ::close(mStdOut[1]));
+            eintrwrap(err, ::close(mStdOut[0]));
+            eintrwrap(err, ::close(mStdErr[1]));
+            eintrwrap(err, ::close(mStdErr[0]));
+            eintrwrap(err, ::close(closePipe[1]));
+            eintrwrap(err, ::close(closePipe[0]));
+            mStdIn[0] = mStdIn[1] = mStdOut[0] = mStdOut[1] = mStdErr[0] = mStdErr[1] = -1;
+            mErrorString = "Process failed to start: " + Rct::strerror(spawnError);
+            mPid = -1;
+            delete[] env;
+            delete[] args;
+            return Error;
+        }
+        // the child closed its end of closePipe when it exec'd, the read
+        // below gets EOF like it does after fork()
+        spawned = true;
+    }
+#endif
+    if (!spawned)
+        mPid = ::fork();
     if (mPid == -1) {
         //printf("fork, something horrible has happened %d\n", errno);
         // bail out
 
-        ProcessThread::setPending(-1);
+        if (!pidFd)
+            ProcessThread::setPending(-1);
 
         eintrwrap(err, ::close(mStdIn[1]));
         eintrwrap(err, ::close(mStdIn[0]));
@@ -461,7 +592,8 @@ Process::ExecState Process::startInternal(const Path &command, const List<String
                 eintrwrap(err, ::close(closePipe[0]));
                 mErrorString = "Failed to read from closePipe during process start";
                 mPid = -1;
-                ProcessThread::setPending(-1);
+                if (!pidFd)
+                    ProcessThread::setPending(-1);
                 return Error;
             } else if (err == 0) {
                 // process has started successfully
@@ -470,72 +602,103 @@ Process::ExecState Process::startInternal(const Path &command, const List<String
                 // process start failed
                 eintrwrap(err, ::close(closePipe[0]));
                 mErrorString = "Process failed to start";
+                if (pidFd) {
+                    int status;
+                    eintrwrap(err, ::waitpid(mPid, &status, 0));
+                } else {
+                    ProcessThread::setPending(-1);
+                }
                 mPid = -1;
-                ProcessThread::setPending(-1);
                 return Error;
             }
         }
 
-        ProcessThread::addPid(mPid, this, (mMode == Async));
+        if (pidFd) {
+            mPidFd = pidFdOpen(mPid);
+            if (mPidFd == -1) {
+                // nothing would ever reap it
+                mErrorString = "pidfd_open failed: ";
+                mErrorString += Rct::strerror();
+                ::kill(mPid, SIGKILL);
+                int status;
+                eintrwrap(err, ::waitpid(mPid, &status, 0));
+                mPid = -1;
+                closeStdIn(CloseForce);
+                closeStdOut();
+                closeStdErr();
+                return Error;
+            }
+            if (mMode == Async) {
+                if (EventLoop::SharedPtr loop = EventLoop::eventLoop()) {
+                    loop->registerSocket(mPidFd, EventLoop::SocketRead, [this](int, unsigned int) { reap(); });
+                } else {
+                    ProcessThread::watchPid(mPid, this);
+                }
+            }
+        } else {
+            ProcessThread::addPid(mPid, this, (mMode == Async));
+        }
+
+        // ends in finish(), on whichever thread reaps it
+        Trace::asyncBegin("Process", "process", mPid);
 
         //printf("fork, about to add fds: stdin=%d, stdout=%d, stderr=%d\n", mStdIn[1], mStdOut[0], mStdErr[0]);
         if (mMode == Async) {
-            if (EventLoop::SharedPtr loop = EventLoop::eventLoop()) {
-                loop->registerSocket(mStdOut[0], EventLoop::SocketRead, std::bind(&Process::processCallback, this, std::placeholders::_1, std::placeholders::_2));
-                loop->registerSocket(mStdErr[0], EventLoop::SocketRead, std::bind(&Process::processCallback, this, std::placeholders::_1, std::placeholders::_2));
-            }
+            updateOutput();
         } else {
-            // select and stuff
-            timeval started, now, *selecttime = 0;
-            if (timeout > 0) {
-                Rct::gettime(&started);
-                now = started;
-                selecttime = &now;
-                Rct::timevalAdd(selecttime, timeout);
-            }
+            const uint64_t deadline = timeout > 0 ? Rct::monoMs() + timeout : 0;
             if (!(execFlags & NoCloseStdIn)) {
                 closeStdIn(CloseForce);
                 mWantStdInClosed = false;
             }
+            enum { StdOut, StdErr, Sync, PidFd, StdIn, FdCount };
+            pollfd fds[FdCount];
             for (;;) {
-                // set up all the select crap
-                fd_set rfds, wfds;
-                FD_ZERO(&rfds);
-                FD_ZERO(&wfds);
-                int max = 0;
-                FD_SET(mStdOut[0], &rfds);
-                max = std::max(max, mStdOut[0]);
-                FD_SET(mStdErr[0], &rfds);
-                max = std::max(max, mStdErr[0]);
-                FD_SET(mSync[0], &rfds);
-                max = std::max(max, mSync[0]);
-                if (mStdIn[1] != -1) {
-                    FD_SET(mStdIn[1], &wfds);
-                    max = std::max(max, mStdIn[1]);
+                // poll() doesn't care how big the fds are, select() can't
+                // go past FD_SETSIZE
+                fds[StdOut].fd = mStdOut[0];
+                fds[StdErr].fd = mStdErr[0];
+                fds[Sync].fd = mSync[0];
+                fds[PidFd].fd = mPidFd; // ignored when it's -1
+                fds[StdIn].fd = mStdIn[1];
+                for (int i=0; i<FdCount; ++i) {
+                    fds[i].events = i == StdIn ? POLLOUT : POLLIN;
+                    fds[i].revents = 0;
+                }
+                int wait = -1;
+                if (deadline) {
+                    const uint64_t now = Rct::monoMs();
+                    wait = now >= deadline ? 0 : static_cast<int>(deadline - now);
                 }
                 int ret;
-                eintrwrap(ret, ::select(max + 1, &rfds, &wfds, 0, selecttime));
+                eintrwrap(ret, ::poll(fds, FdCount, wait));
                 if (ret == -1) { // ow
-                    mErrorString = "Sync select failed: ";
+                    mErrorString = "Sync poll failed: ";
                     mErrorString += Rct::strerror();
                     return Error;
                 }
-                // check fds and stuff
-                if (FD_ISSET(mStdOut[0], &rfds))
-                    handleOutput(mStdOut[0], mStdOutBuffer, mStdOutIndex, mReadyReadStdOut);
-                if (FD_ISSET(mStdErr[0], &rfds))
-                    handleOutput(mStdErr[0], mStdErrBuffer, mStdErrIndex, mReadyReadStdErr);
-                if (mStdIn[1] != -1 && FD_ISSET(mStdIn[1], &wfds))
+                // POLLHUP for a closed pipe, the read finds out
+                const short readable = POLLIN | POLLHUP | POLLERR;
+                if (fds[StdOut].revents & readable)
+                    handleOutput(mStdOut[0], mStdOutBuffer, mStdOutIndex, mStdOutHandler, mReadyReadStdOut);
+                if (fds[StdErr].revents & readable)
+                    handleOutput(mStdErr[0], mStdErrBuffer, mStdErrIndex, mStdErrHandler, mReadyReadStdErr);
+                if (mStdIn[1] != -1 && fds[StdIn].revents & (POLLOUT | POLLERR))
                     handleInput(mStdIn[1]);
-                if (FD_ISSET(mSync[0], &rfds)) {
+                if (fds[PidFd].revents & readable) {
+                    // finish() tells mSync
+                    reap();
+                    continue;
+                }
+                if (fds[Sync].revents & readable) {
                     // we're done
                     {
                         std::lock_guard<std::mutex> lock(mMutex);
                         assert(mSync[1] == -1);
 
                         // try to read all remaining data on stdout and stderr
-                        handleOutput(mStdOut[0], mStdOutBuffer, mStdOutIndex, mReadyReadStdOut);
-                        handleOutput(mStdErr[0], mStdErrBuffer, mStdErrIndex, mReadyReadStdErr);
+                        handleOutput(mStdOut[0], mStdOutBuffer, mStdOutIndex, mStdOutHandler, mReadyReadStdOut);
+                        handleOutput(mStdErr[0], mStdErrBuffer, mStdErrIndex, mStdErrHandler, mReadyReadStdErr);
 
                         closeStdOut();
                         closeStdErr();
@@ -547,18 +710,20 @@ Process::ExecState Process::startInternal(const Path &command, const List<String
                     mFinished(this);
                     return Done;
                 }
-                if (timeout) {
-                    assert(selecttime);
-                    Rct::gettime(selecttime);
-                    const int lasted = Rct::timevalDiff(selecttime, &started);
-                    if (lasted >= timeout) {
-                        // timeout, we're done
-                        kill(); // attempt to kill
-                        mErrorString = "Timed out";
-                        return TimedOut;
+                if (deadline && Rct::monoMs() >= deadline) {
+                    // timeout, we're done
+                    kill(); // attempt to kill
+                    if (mPidFd != -1) {
+                        // it's ours to reap, give it a moment to go
+                        // quietly
+                        pollfd pfd = { mPidFd, POLLIN, 0 };
+                        eintrwrap(ret, ::poll(&pfd, 1, 1000));
+                        if (ret != 1)
+                            ::kill(mPid, SIGKILL);
+                        reap(true);
                     }
-                    *selecttime = started;
-                    Rct::timevalAdd(selecttime, timeout);
+                    mErrorString = "Timed out";
+                    return TimedOut;
                 }
             }
         }
@@ -620,6 +785,7 @@ void Process::closeStdOut()
     int err;
     eintrwrap(err, ::close(mStdOut[0]));
     mStdOut[0] = -1;
+    mStdOutReading = false;
 }
 
 void Process::closeStdErr()
@@ -632,6 +798,7 @@ void Process::closeStdErr()
     int err;
     eintrwrap(err, ::close(mStdErr[0]));
     mStdErr[0] = -1;
+    mStdErrReading = false;
 }
 
 String Process::readAllStdOut()
@@ -639,6 +806,8 @@ String Process::readAllStdOut()
     String out;
     std::swap(mStdOutBuffer, out);
     mStdOutIndex = 0;
+    if (mOutputLimit && mMode == Async)
+        updateOutput();
     return out;
 }
 
@@ -647,9 +816,47 @@ String Process::readAllStdErr()
     String out;
     std::swap(mStdErrBuffer, out);
     mStdErrIndex = 0;
+    if (mOutputLimit && mMode == Async)
+        updateOutput();
     return out;
 }
 
+void Process::suspendOutput()
+{
+    mOutputSuspended = true;
+    if (mMode == Async)
+        updateOutput();
+}
+
+void Process::resumeOutput()
+{
+    mOutputSuspended = false;
+    if (mMode == Async)
+        updateOutput();
+}
+
+void Process::updateOutput()
+{
+    EventLoop::SharedPtr loop = EventLoop::eventLoop();
+    if (!loop)
+        return;
+    // once the child is gone finish() reads what's left regardless
+    const bool hold = mOutputSuspended && mReturn == ReturnUnset;
+    auto update = [&](int fd, const String &buffer, const OutputHandler &handler, bool &reading) {
+        const bool read = fd != -1 && !hold && (handler || !mOutputLimit || buffer.size() < static_cast<int>(mOutputLimit));
+        if (read == reading)
+            return;
+        reading = read;
+        if (read) {
+            loop->registerSocket(fd, EventLoop::SocketRead, std::bind(&Process::processCallback, this, std::placeholders::_1, std::placeholders::_2));
+        } else {
+            loop->unregisterSocket(fd);
+        }
+    };
+    update(mStdOut[0], mStdOutBuffer, mStdOutHandler, mStdOutReading);
+    update(mStdErr[0], mStdErrBuffer, mStdErrHandler, mStdErrReading);
+}
+
 void Process::processCallback(int fd, int mode)
 {
     if (mode == EventLoop::SocketError) {
@@ -659,9 +866,9 @@ void Process::processCallback(int fd, int mode)
     if (fd == mStdIn[1])
         handleInput(fd);
     else if (fd == mStdOut[0])
-        handleOutput(fd, mStdOutBuffer, mStdOutIndex, mReadyReadStdOut);
+        handleOutput(fd, mStdOutBuffer, mStdOutIndex, mStdOutHandler, mReadyReadStdOut);
     else if (fd == mStdErr[0])
-        handleOutput(fd, mStdErrBuffer, mStdErrIndex, mReadyReadStdErr);
+        handleOutput(fd, mStdErrBuffer, mStdErrIndex, mStdErrHandler, mReadyReadStdErr);
 }
 
 void Process::finish(int returnCode)
@@ -676,8 +883,8 @@ void Process::finish(int returnCode)
 
         if (mMode == Async) {
             // try to read all remaining data on stdout and stderr
-            handleOutput(mStdOut[0], mStdOutBuffer, mStdOutIndex, mReadyReadStdOut);
-            handleOutput(mStdErr[0], mStdErrBuffer, mStdErrIndex, mReadyReadStdErr);
+            handleOutput(mStdOut[0], mStdOutBuffer, mStdOutIndex, mStdOutHandler, mReadyReadStdOut);
+            handleOutput(mStdErr[0], mStdErrBuffer, mStdErrIndex, mStdErrHandler, mReadyReadStdErr);
 
             closeStdOut();
             closeStdErr();
@@ -689,6 +896,7 @@ void Process::finish(int returnCode)
             mSync[1] = -1;
         }
 
+        Trace::asyncEnd("Process", "process", mPid);
         mPid = -1;
     }
 
@@ -696,6 +904,69 @@ void Process::finish(int returnCode)
         mFinished(this);
 }
 
+#ifdef HAVE_POSIX_SPAWN
+int Process::spawn(const Path &cmd, const char **args, const char **env, int closeFd)
+{
+    posix_spawn_file_actions_t actions;
+    int ret = posix_spawn_file_actions_init(&actions);
+    if (ret)
+        return ret;
+    // what the child does after fork(), the parent's ends of the pipes go
+    // and the child's become stdin, stdout and stderr
+    const int parentEnds[] = { closeFd, mStdIn[1], mStdOut[0], mStdErr[0], mSync[0], mSync[1] };
+    for (const int fd : parentEnds) {
+        if (fd != -1 && !ret)
+            ret = posix_spawn_file_actions_addclose(&actions, fd);
+    }
+    const int childEnds[] = { mStdIn[0], mStdOut[1], mStdErr[1] };
+    for (int i=0; i<3 && !ret; ++i)
+        ret = posix_spawn_file_actions_adddup2(&actions, childEnds[i], i);
+    for (int i=0; i<3 && !ret; ++i)
+        ret = posix_spawn_file_actions_addclose(&actions, childEnds[i]);
+#ifdef HAVE_POSIX_SPAWN_CHDIR
+    if (!ret && !mCwd.isEmpty())
+        ret = posix_spawn_file_actions_addchdir_np(&actions, mCwd.constData());
+#endif
+    if (!ret) {
+#ifdef OS_Darwin
+        char **parentEnv = *_NSGetEnviron();
+#else
+        extern char **environ;
+        char **parentEnv = environ;
+#endif
+        ret = ::posix_spawn(&mPid, cmd.constData(), &actions, 0, const_cast<char* const*>(args),
+                            env ? const_cast<char* const*>(env) : parentEnv);
+    }
+    posix_spawn_file_actions_destroy(&actions);
+    return ret;
+}
+#endif
+
+void Process::reap(bool block)
+{
+    if (mPidFd == -1)
+        return;
+    int status, ret;
+    eintrwrap(ret, ::waitpid(mPid, &status, block ? 0 : WNOHANG));
+    if (ret == 0)
+        return;
+    closePidFd();
+    finish(ret == -1 ? ReturnCrashed : exitCode(status));
+}
+
+void Process::closePidFd()
+{
+    if (mPidFd == -1)
+        return;
+    if (mMode == Async) {
+        if (EventLoop::SharedPtr loop = EventLoop::eventLoop())
+            loop->unregisterSocket(mPidFd);
+    }
+    int err;
+    eintrwrap(err, ::close(mPidFd));
+    mPidFd = -1;
+}
+
 void Process::handleInput(int fd)
 {
     assert(EventLoop::eventLoop());
@@ -735,21 +1006,46 @@ void Process::handleInput(int fd)
     }
 }
 
-void Process::handleOutput(int fd, String &buffer, int &index, Signal<std::function<void(Process*)> > &signal)
+void Process::handleOutput(int fd, String &buffer, int &index, const OutputHandler &handler,
+                           Signal<std::function<void(Process*)> > &signal)
 {
     //printf("Process::handleOutput %d\n", fd);
-    enum { BufSize = 1024, MaxSize = (1024 * 1024 * 16) };
+    if (fd == -1)
+        return;
+    enum { BufSize = 16 * 1024, MaxSize = (1024 * 1024 * 16) };
+    // the limit and suspendOutput() only hold up a child that's running
+    const bool running = mMode == Async && mReturn == ReturnUnset;
     char buf[BufSize];
     int total = 0;
     for (;;) {
+        if (running && mOutputSuspended)
+            break;
         int r;
-        eintrwrap(r, ::read(fd, buf, BufSize));
+        if (handler) {
+            // read into the same scratch every time, the handler gets a
+            // Buffer just big enough for what was read
+            if (!mChunk)
+                mChunk.reset(new char[ChunkSize]);
+            eintrwrap(r, ::read(fd, mChunk.get(), ChunkSize));
+            if (r > 0) {
+                Buffer chunk;
+                chunk.append(mChunk.get(), r);
+                handler(this, std::move(chunk));
+                continue;
+            }
+        } else {
+            eintrwrap(r, ::read(fd, buf, BufSize));
+        }
         if (r == -1) {
             //printf("Process::handleOutput %d returning -1, errno %d %s\n", fd, errno, Rct::strerror().constData());
             break;
         } else if (r == 0) { // file descriptor closed, remove it
             //printf("Process::handleOutput %d returning 0\n", fd);
-            EventLoop::eventLoop()->unregisterSocket(fd);
+            if (fd == mStdOut[0]) {
+                closeStdOut();
+            } else if (fd == mStdErr[0]) {
+                closeStdErr();
+            }
             break;
         } else {
             //printf("Process::handleOutput in loop %d\n", fd);
@@ -771,11 +1067,15 @@ void Process::handleOutput(int fd, String &buffer, int &index, Signal<std::funct
             memcpy(buffer.data() + sz, buf, r);
 
             total += r;
+            if (running && mOutputLimit && buffer.size() >= static_cast<int>(mOutputLimit))
+                break;
         }
     }
 
     //printf("total data '%s'\n", buffer.nullTerminated());
 
+    if (running)
+        updateOutput();
     if (total)
         signal(this);
 }
@@ -786,6 +1086,11 @@ void Process::kill(int sig)
         return;
 
     mReturn = ReturnKilled;
+#ifdef HAVE_PIDFD
+    // can't hit some other process that got the pid after it was reaped
+    if (mPidFd != -1 && !::syscall(SYS_pidfd_send_signal, mPidFd, sig, 0, 0))
+        return;
+#endif
     ::kill(mPid, sig);
 }
 
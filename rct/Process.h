@@ -1,12 +1,14 @@
 #ifndef PROCESS_H
 #define PROCESS_H
 
+#include <rct/Buffer.h>
 #include <rct/String.h>
 #include <rct/Path.h>
 #include <rct/List.h>
 #include <rct/SignalSlot.h>
 #include <signal.h>
 #include <deque>
+#include <memory>
 #include <mutex>
 
 class Process
@@ -18,6 +20,31 @@ public:
     void setCwd(const Path &cwd);
     void setChRoot(const Path &path);
 
+    // Streaming. Output is handed to handler as it's read, moved out in
+    // Buffers of up to ChunkSize bytes, instead of being kept for
+    // readAllStdOut() and readAllStdErr() and announced with readyReadStdOut()
+    // and readyReadStdErr(). It's called on the EventLoop of the thread that
+    // called start(), or from inside exec()
+    enum { ChunkSize = 64 * 1024 };
+    typedef std::function<void(Process*, Buffer &&)> OutputHandler;
+    void setStdOutHandler(OutputHandler &&handler) { mStdOutHandler = std::move(handler); }
+    void setStdErrHandler(OutputHandler &&handler) { mStdErrHandler = std::move(handler); }
+    // the child writes straight to fd, a file, pipe or socket, rather than
+    // to us. It's dup'ed when the process is started, -1 goes back to a
+    // pipe of our own
+    void setStdOutFd(int fd) { mStdOutTarget = fd; }
+    void setStdErrFd(int fd) { mStdErrTarget = fd; }
+    // For start(). Reading from the child stops while readAllStdOut(), or
+    // readAllStdErr(), has limit bytes waiting and goes on once it's been
+    // called, the child blocks on a full pipe meanwhile. 0 reads on and
+    // drops what's buffered past 16MB
+    void setOutputLimit(unsigned int limit) { mOutputLimit = limit; }
+    unsigned int outputLimit() const { return mOutputLimit; }
+    // For start(), to hold the child up while whoever gets the output with
+    // a handler catches up
+    void suspendOutput();
+    void resumeOutput();
+
     bool start(const Path &command,
                const List<String> &arguments = List<String>(),
                const List<String> &environ = List<String>());
@@ -63,12 +90,20 @@ public:
 private:
     void finish(int returnCode);
     void processCallback(int fd, int mode);
+    // waitpid() once mPidFd says it's gone
+    void reap(bool block = false);
+    void closePidFd();
+    // posix_spawn() with the pipes set up, an errno
+    int spawn(const Path &cmd, const char **args, const char **env, int closeFd);
 
     void closeStdOut();
     void closeStdErr();
 
     void handleInput(int fd);
-    void handleOutput(int fd, String &buffer, int &index, Signal<std::function<void(Process*)> > &signal);
+    void handleOutput(int fd, String &buffer, int &index, const OutputHandler &handler,
+                      Signal<std::function<void(Process*)> > &signal);
+    // reads the pipes or not, for the limit and suspendOutput()
+    void updateOutput();
 
     ExecState startInternal(const Path &command, const List<String> &arguments,
                             const List<String> &environ, int timeout = 0, unsigned int flags = 0);
@@ -82,11 +117,20 @@ private:
 
     mutable std::mutex mMutex;
     pid_t mPid;
+    // readable once the child exits, -1 where there are no pidfds
+    int mPidFd;
     enum { ReturnCrashed = -1, ReturnUnset = -2, ReturnKilled = -3 };
     int mReturn;
 
     std::deque<String> mStdInBuffer;
     String mStdOutBuffer, mStdErrBuffer;
+    OutputHandler mStdOutHandler, mStdErrHandler;
+    // what the handlers' chunks are read into, ChunkSize
+    std::unique_ptr<char[]> mChunk;
+    int mStdOutTarget, mStdErrTarget;
+    unsigned int mOutputLimit;
+    // registered with the EventLoop
+    bool mStdOutReading, mStdErrReading, mOutputSuspended;
     int mStdInIndex, mStdOutIndex, mStdErrIndex;
     bool mWantStdInClosed;
 
@@ -0,0 +1,412 @@
+#include "ProcessPool.h"
+#include "EventLoop.h"
+#include "Log.h"
+#include "MemoryMonitor.h"
+#include "Process.h"
+#include "SocketServer.h"
+#include "Timer.h"
+#include <stdlib.h>
+#include <unistd.h>
+
+// how a worker finds the pool, and who it says it is when it gets there
+static const char *const SocketVariable = "RCT_PROCESS_POOL_SOCKET";
+static const char *const WorkerVariable = "RCT_PROCESS_POOL_WORKER";
+
+static inline String workerToken(unsigned int id)
+{
+    return String::format<64>("%d.%u", getpid(), id);
+}
+
+ProcessPool::ProcessPool(const Path &command, const List<String> &arguments, int version)
+    : mCommand(command), mArguments(arguments), mVersion(version), mSize(DefaultSize), mMaxJobs(0),
+      mMaxMemory(0), mStartTimeout(DefaultStartTimeout), mStopTimeout(DefaultStopTimeout), mNextId(0),
+      mSpawnTimer(0)
+{
+}
+
+ProcessPool::~ProcessPool()
+{
+    // mThis has expired, stop() doesn't set up kill timers now and
+    // nobody's left to kill them later
+    stop();
+    EventLoop::SharedPtr loop = EventLoop::eventLoop();
+    for (const auto &it : mWorkers) {
+        Worker &worker = *it.second;
+        if (worker.timer && loop)
+            loop->unregisterTimer(worker.timer);
+        if (worker.process)
+            worker.process->kill(SIGKILL);
+    }
+}
+
+void ProcessPool::setSize(unsigned int size)
+{
+    mSize = size;
+    if (!isRunning())
+        return;
+    // the idle ones go first
+    while (workerCount() > mSize && !mIdle.isEmpty())
+        retire(*mWorkers.value(mIdle.takeFirst()), false);
+    fill();
+}
+
+bool ProcessPool::start()
+{
+    if (isRunning())
+        return true;
+    const char *tmp = getenv("TMPDIR");
+    String dir = String(tmp && *tmp ? tmp : "/tmp") + "/rct-pool-XXXXXX";
+    if (!mkdtemp(dir.data())) {
+        error("ProcessPool::start() mkdtemp failed %s", Rct::strerror().constData());
+        return false;
+    }
+    mDir = dir;
+    mThis = shared_from_this();
+    std::shared_ptr<SocketServer> server = std::make_shared<SocketServer>();
+    if (!server->listen(mDir + "/socket")) {
+        error("ProcessPool::start() couldn't listen on %s/socket", mDir.constData());
+        Path::rmdir(mDir);
+        mDir.clear();
+        return false;
+    }
+    const WeakPtr weak = mThis;
+    server->newConnection().connect([weak](SocketServer *server) {
+            SharedPtr pool = weak.lock();
+            while (SocketClient::SharedPtr client = server->nextConnection()) {
+                if (pool)
+                    pool->onAccepted(client);
+            }
+        });
+    mServer = server;
+    fill();
+    return true;
+}
+
+void ProcessPool::stop()
+{
+    if (!isRunning())
+        return;
+    mServer->close();
+    mServer.reset();
+    Path::rm(mDir + "/socket");
+    Path::rmdir(mDir);
+    mDir.clear();
+    if (mSpawnTimer) {
+        if (EventLoop::SharedPtr loop = EventLoop::eventLoop())
+            loop->unregisterTimer(mSpawnTimer);
+        mSpawnTimer = 0;
+    }
+    for (const std::shared_ptr<Connection> &connection : mAccepted) {
+        connection->newMessage().disconnect();
+        connection->disconnected().disconnect();
+        if (connection->client())
+            connection->close();
+    }
+    mAccepted.clear();
+    mIdle.clear();
+
+    List<std::shared_ptr<Worker> > workers;
+    for (const auto &it : mWorkers)
+        workers.append(it.second);
+    for (const std::shared_ptr<Worker> &worker : workers)
+        retire(*worker, false);
+
+    const List<Job> queue = std::move(mQueue);
+    mQueue.clear();
+    for (const Job &job : queue)
+        (*job.callback)(std::shared_ptr<Message>());
+}
+
+void ProcessPool::submit(const std::shared_ptr<Message> &job, Callback &&callback)
+{
+    const Job queued = { job, std::make_shared<Callback>(std::move(callback)) };
+    if (!isRunning()) {
+        (*queued.callback)(std::shared_ptr<Message>());
+        return;
+    }
+    mQueue.append(queued);
+    dispatch();
+}
+
+unsigned int ProcessPool::workerCount() const
+{
+    unsigned int ret = 0;
+    for (const auto &it : mWorkers) {
+        if (!it.second->leaving)
+            ++ret;
+    }
+    return ret;
+}
+
+void ProcessPool::fill()
+{
+    if (!isRunning())
+        return;
+    for (unsigned int count = workerCount(); count < mSize; ++count)
+        spawn();
+}
+
+// a worker that died before it connected is likely to do it again, no
+// point trying again straight away
+void ProcessPool::scheduleSpawn()
+{
+    if (mSpawnTimer || !isRunning())
+        return;
+    const WeakPtr weak = mThis;
+    mSpawnTimer = EventLoop::eventLoop()->registerTimer([weak](int) {
+            if (SharedPtr pool = weak.lock()) {
+                pool->mSpawnTimer = 0;
+                pool->fill();
+            }
+        }, RestartDelay, Timer::SingleShot);
+}
+
+void ProcessPool::spawn()
+{
+    std::shared_ptr<Worker> worker = std::make_shared<Worker>();
+    const unsigned int id = ++mNextId;
+    worker->id = id;
+    worker->process = new Process;
+    if (!mCwd.isEmpty())
+        worker->process->setCwd(mCwd);
+    worker->process->setStdOutHandler([](Process *, Buffer &&) {});
+    worker->process->readyReadStdErr().connect([](Process *process) {
+            String err = process->readAllStdErr();
+            if (err.endsWith('\n'))
+                err.chop(1);
+            if (!err.isEmpty())
+                error("ProcessPool worker %d: %s", process->pid(), err.constData());
+        });
+    const WeakPtr weak = mThis;
+    worker->process->finished().connect([weak, id](Process *process) {
+            EventLoop::deleteLater(process);
+            if (SharedPtr pool = weak.lock())
+                pool->onFinished(id);
+        });
+
+    List<String> environ = mEnviron.isEmpty() ? Process::environment() : mEnviron;
+    environ.append(String(SocketVariable) + '=' + mDir + "/socket");
+    environ.append(String(WorkerVariable) + '=' + workerToken(id));
+    mWorkers[id] = worker;
+    if (!worker->process->start(mCommand, mArguments, environ)) {
+        error("ProcessPool::spawn() failed to start %s: %s", mCommand.constData(),
+              worker->process->errorString().constData());
+        delete worker->process;
+        mWorkers.remove(id);
+        scheduleSpawn();
+        return;
+    }
+    if (mStartTimeout > 0) {
+        worker->timer = EventLoop::eventLoop()->registerTimer([weak, id](int) {
+                SharedPtr pool = weak.lock();
+                if (!pool)
+                    return;
+                if (std::shared_ptr<Worker> worker = pool->mWorkers.value(id)) {
+                    worker->timer = 0;
+                    error("ProcessPool worker %d didn't connect in %dms", worker->process ? worker->process->pid() : -1,
+                          pool->mStartTimeout);
+                    pool->retire(*worker, true);
+                }
+            }, mStartTimeout, Timer::SingleShot);
+    }
+}
+
+void ProcessPool::onAccepted(const SocketClient::SharedPtr &client)
+{
+    std::shared_ptr<Connection> connection = Connection::create(client, mVersion);
+    mAccepted.append(connection);
+    const WeakPtr weak = mThis;
+    // the first thing a worker says is who it is
+    connection->newMessage().connect([weak](std::shared_ptr<Message> message, std::shared_ptr<Connection> connection) {
+            if (SharedPtr pool = weak.lock()) {
+                const String token = (message->messageId() == ResponseMessage::MessageId
+                                      ? static_cast<const ResponseMessage *>(message.get())->data() : String());
+                pool->onHello(connection, token);
+            }
+        });
+    connection->disconnected().connect([weak](std::shared_ptr<Connection> connection) {
+            if (SharedPtr pool = weak.lock())
+                pool->mAccepted.remove(connection);
+        });
+}
+
+void ProcessPool::onHello(const std::shared_ptr<Connection> &connection, const String &token)
+{
+    const int idx = mAccepted.indexOf(connection);
+    if (idx == -1)
+        return;
+    mAccepted.removeAt(idx);
+    connection->newMessage().disconnect();
+    connection->disconnected().disconnect();
+
+    const int dot = token.indexOf('.');
+    const unsigned int id = dot == -1 ? 0 : static_cast<unsigned int>(strtoul(token.constData() + dot + 1, 0, 10));
+    std::shared_ptr<Worker> worker = mWorkers.value(id);
+    if (!worker || worker->connected || worker->leaving || token != workerToken(id)) {
+        warning("ProcessPool: unexpected connection %s", token.constData());
+        if (connection->client())
+            connection->close();
+        return;
+    }
+    cancelTimer(*worker);
+    worker->connection = connection;
+    worker->connected = true;
+
+    const WeakPtr weak = mThis;
+    auto gone = [weak, id](std::shared_ptr<Connection>) {
+        if (SharedPtr pool = weak.lock()) {
+            if (std::shared_ptr<Worker> worker = pool->mWorkers.value(id))
+                pool->retire(*worker, true);
+        }
+    };
+    connection->disconnected().connect(gone);
+    connection->error().connect(gone);
+    mIdle.append(id);
+    dispatch();
+}
+
+void ProcessPool::dispatch()
+{
+    while (!mIdle.isEmpty() && !mQueue.isEmpty()) {
+        // the one that was busy last is the most likely to still be warm
+        const unsigned int id = mIdle.takeLast();
+        std::shared_ptr<Worker> worker = mWorkers.value(id);
+        if (!worker || worker->leaving)
+            continue;
+        const Job job = mQueue.takeFirst();
+        worker->callback = job.callback;
+        ++worker->jobs;
+        const WeakPtr weak = mThis;
+        const uint32_t streamId = worker->connection->request(*job.message, [weak, id](const std::shared_ptr<Message> &message) {
+                if (SharedPtr pool = weak.lock())
+                    pool->onResponse(id, message);
+            });
+        if (!streamId) {
+            // not the job's fault, someone else gets it
+            worker->callback.reset();
+            mQueue.prepend(job);
+            retire(*worker, true);
+        }
+    }
+}
+
+void ProcessPool::onResponse(unsigned int id, const std::shared_ptr<Message> &message)
+{
+    std::shared_ptr<Worker> worker = mWorkers.value(id);
+    if (!worker || !worker->callback)
+        return;
+    const std::shared_ptr<Callback> callback = worker->callback;
+    const bool done = !message || message->messageId() == FinishMessage::MessageId;
+    if (done) {
+        worker->callback.reset();
+        if (!message || shouldRecycle(*worker)) {
+            retire(*worker, true);
+        } else {
+            mIdle.append(id);
+        }
+    }
+    (*callback)(message);
+    if (done)
+        dispatch();
+}
+
+void ProcessPool::onFinished(unsigned int id)
+{
+    std::shared_ptr<Worker> worker = mWorkers.value(id);
+    if (!worker)
+        return;
+    Process *process = worker->process;
+    worker->process = 0;
+    if (!worker->leaving) {
+        error("ProcessPool worker %d exited with %d", process->pid(), process->returnCode());
+        retire(*worker, true);
+    }
+    cancelTimer(*worker);
+    mWorkers.remove(id);
+}
+
+bool ProcessPool::shouldRecycle(const Worker &worker) const
+{
+    if (mMaxJobs && worker.jobs >= mMaxJobs)
+        return true;
+    return mMaxMemory && worker.process && MemoryMonitor::usage(worker.process->pid()) > mMaxMemory;
+}
+
+// asks it to go, kills it if it doesn't and fails the job it had
+void ProcessPool::retire(Worker &worker, bool replace)
+{
+    if (worker.leaving)
+        return;
+    worker.leaving = true;
+    mIdle.remove(worker.id);
+    cancelTimer(worker);
+    const bool connected = worker.connected;
+    if (worker.connection) {
+        worker.connection->disconnected().disconnect();
+        worker.connection->error().disconnect();
+        if (worker.connection->client())
+            worker.connection->close();
+    }
+    if (worker.process) {
+        // one that never connected isn't listening
+        if (!connected)
+            worker.process->kill();
+        if (mStopTimeout > 0 && !mThis.expired()) {
+            const WeakPtr weak = mThis;
+            const unsigned int id = worker.id;
+            worker.timer = EventLoop::eventLoop()->registerTimer([weak, id](int) {
+                    SharedPtr pool = weak.lock();
+                    if (!pool)
+                        return;
+                    if (std::shared_ptr<Worker> worker = pool->mWorkers.value(id)) {
+                        worker->timer = 0;
+                        if (worker->process)
+                            worker->process->kill(SIGKILL);
+                    }
+                }, mStopTimeout, Timer::SingleShot);
+        }
+    }
+    const std::shared_ptr<Callback> callback = std::move(worker.callback);
+    worker.callback.reset();
+    if (replace) {
+        if (connected) {
+            fill();
+        } else {
+            scheduleSpawn();
+        }
+    }
+    if (callback)
+        (*callback)(std::shared_ptr<Message>());
+}
+
+void ProcessPool::cancelTimer(Worker &worker)
+{
+    if (worker.timer) {
+        if (EventLoop::SharedPtr loop = EventLoop::eventLoop())
+            loop->unregisterTimer(worker.timer);
+        worker.timer = 0;
+    }
+}
+
+std::shared_ptr<Connection> ProcessPool::connectToPool(int version)
+{
+    const char *socket = getenv(SocketVariable);
+    const char *token = getenv(WorkerVariable);
+    if (!socket || !token)
+        return std::shared_ptr<Connection>();
+    std::shared_ptr<Connection> connection = Connection::create(version);
+    const String hello = token;
+    connection->connected().connect([hello](std::shared_ptr<Connection> connection) {
+            connection->send(ResponseMessage(hello));
+        });
+    if (!connection->connectUnix(socket)) {
+        error("ProcessPool::connectToPool() couldn't connect to %s", socket);
+        return std::shared_ptr<Connection>();
+    }
+    return connection;
+}
+
+bool ProcessPool::isWorker()
+{
+    return getenv(SocketVariable) && getenv(WorkerVariable);
+}
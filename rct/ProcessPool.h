@@ -0,0 +1,157 @@
+#ifndef ProcessPool_h
+#define ProcessPool_h
+
+#include <rct/Connection.h>
+#include <rct/Hash.h>
+#include <rct/List.h>
+#include <rct/Path.h>
+#include <rct/String.h>
+#include <functional>
+#include <memory>
+
+class Process;
+class SocketServer;
+
+// Long lived worker processes for jobs that would otherwise each pay for
+// starting a Process. Workers are started with Process and connect back
+// to the pool over a Unix socket with connectToPool(), jobs are Messages
+// sent to an idle worker with Connection::request() and the worker answers
+// on the job's stream, ending with Connection::finishStream(). A worker
+// does one job at a time, jobs wait in order for one to become idle.
+//
+// Workers are replaced after maxJobs() jobs or once they use more than
+// maxMemory(), as MemoryMonitor::usage() sees it. One that crashes or
+// hangs up is replaced as well, the job it had gets a null message and
+// isn't tried again. A worker is asked to go by closing its connection, it
+// should exit when it sees that and is killed if it doesn't.
+//
+// Everything happens on the event loop of the thread using the pool, the
+// workers' stdout is dropped and their stderr goes to the log.
+class ProcessPool : public std::enable_shared_from_this<ProcessPool>
+{
+public:
+    typedef std::shared_ptr<ProcessPool> SharedPtr;
+    typedef std::weak_ptr<ProcessPool> WeakPtr;
+
+    static SharedPtr create(const Path &command, const List<String> &arguments = List<String>(), int version = 0)
+    {
+        return SharedPtr(new ProcessPool(command, arguments, version));
+    }
+    ~ProcessPool();
+
+    enum {
+        DefaultSize = 4,
+        DefaultStartTimeout = 10 * 1000,
+        DefaultStopTimeout = 5 * 1000,
+        // before replacing a worker that never connected
+        RestartDelay = 1000
+    };
+    // workers kept running, applies right away when started
+    void setSize(unsigned int size);
+    unsigned int size() const { return mSize; }
+    // jobs a worker does before it's replaced, 0 means no limit
+    void setMaxJobs(unsigned int max) { mMaxJobs = max; }
+    unsigned int maxJobs() const { return mMaxJobs; }
+    // bytes, checked after each job, 0 means no limit
+    void setMaxMemory(uint64_t max) { mMaxMemory = max; }
+    uint64_t maxMemory() const { return mMaxMemory; }
+    // ms a worker has to connect after it's started
+    void setStartTimeout(int timeout) { mStartTimeout = timeout; }
+    int startTimeout() const { return mStartTimeout; }
+    // ms a worker has to exit once asked to before it's killed
+    void setStopTimeout(int timeout) { mStopTimeout = timeout; }
+    int stopTimeout() const { return mStopTimeout; }
+    // for workers started from now on, Process::environment() by default
+    void setEnvironment(const List<String> &environ) { mEnviron = environ; }
+    void setCwd(const Path &cwd) { mCwd = cwd; }
+
+    bool start();
+    // queued jobs get a null message, workers are asked to go
+    void stop();
+    bool isRunning() const { return mServer.get() != 0; }
+
+    // Everything the worker sends back on the job's stream goes to
+    // callback, up to and including the FinishMessage, or a null message if
+    // the worker went away first or the pool was stopped. It may be called
+    // before submit() returns
+    typedef Connection::ResponseCallback Callback;
+    void submit(const std::shared_ptr<Message> &job, Callback &&callback);
+
+    size_t pendingJobs() const { return mQueue.size(); }
+    unsigned int workerCount() const;
+    unsigned int idleCount() const { return mIdle.size(); }
+
+    // In the worker, a connection to the pool that started this process,
+    // null if it wasn't started by one. Jobs arrive through its
+    // newMessage() with Message::streamId() set
+    static std::shared_ptr<Connection> connectToPool(int version = 0);
+    static bool isWorker();
+
+private:
+    ProcessPool(const Path &command, const List<String> &arguments, int version);
+
+    struct Job
+    {
+        std::shared_ptr<Message> message;
+        std::shared_ptr<Callback> callback;
+    };
+    struct Worker
+    {
+        Worker()
+            : id(0), process(0), jobs(0), timer(0), connected(false), leaving(false)
+        {}
+
+        unsigned int id;
+        // deletes itself once the process has exited
+        Process *process;
+        std::shared_ptr<Connection> connection;
+        // the job in flight
+        std::shared_ptr<Callback> callback;
+        unsigned int jobs;
+        // the start timeout, or the stop timeout once it's leaving
+        int timer;
+        bool connected;
+        // asked to go, or gone, and replaced already
+        bool leaving;
+    };
+
+    void spawn();
+    void scheduleSpawn();
+    void fill();
+    void onAccepted(const SocketClient::SharedPtr &client);
+    void onHello(const std::shared_ptr<Connection> &connection, const String &token);
+    void onResponse(unsigned int id, const std::shared_ptr<Message> &message);
+    void onFinished(unsigned int id);
+    void dispatch();
+    void retire(Worker &worker, bool replace);
+    void cancelTimer(Worker &worker);
+    bool shouldRecycle(const Worker &worker) const;
+
+    // for callbacks, set by start(). Never shared_from_this(), stop() runs
+    // from the destructor
+    WeakPtr mThis;
+
+    const Path mCommand;
+    const List<String> mArguments;
+    const int mVersion;
+    unsigned int mSize, mMaxJobs;
+    uint64_t mMaxMemory;
+    int mStartTimeout, mStopTimeout;
+    List<String> mEnviron;
+    Path mCwd;
+
+    // a private directory for the socket
+    Path mDir;
+    std::shared_ptr<SocketServer> mServer;
+    unsigned int mNextId;
+    // the replacement timer, 0 when there isn't one
+    int mSpawnTimer;
+    Hash<unsigned int, std::shared_ptr<Worker> > mWorkers;
+    // connected but not said who they are yet
+    List<std::shared_ptr<Connection> > mAccepted;
+    // most recently idle last
+    List<unsigned int> mIdle;
+    List<Job> mQueue;
+};
+
+#endif
@@ -0,0 +1,563 @@
+#include "Profiler.h"
+#include "rct-config.h"
+#include "Config.h"
+#include "FlatHash.h"
+#include "Log.h"
+#include "Map.h"
+#include "Rct.h"
+#include "Thread.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+#ifdef HAVE_BACKTRACE
+#  include <cxxabi.h>
+#  include <dlfcn.h>
+#  include <execinfo.h>
+#endif
+#if defined(OS_Linux) && defined(SIGEV_THREAD_ID)
+#  define PROFILER_THREAD_TIMERS
+#  include <dirent.h>
+#  include <sys/syscall.h>
+#  include <time.h>
+#  ifndef sigev_notify_thread_id
+#    define sigev_notify_thread_id _sigev_un._tid
+#  endif
+#endif
+
+namespace {
+// A slot in a bounded queue that signal handlers on any thread push to
+// and the collector pops from. A slot is free to push to when its
+// sequence is the position being pushed, and has a sample in it when
+// it's one more
+struct Sample
+{
+    std::atomic<size_t> sequence;
+    int depth;
+    void *frames[Profiler::MaxFrames];
+};
+
+struct State
+{
+    State()
+        : thread(0), stopping(false), frequency(Profiler::DefaultFrequency), dequeue(0),
+          startTime(0), startNs(0), durationNs(0)
+    {}
+
+    // start() and stop() one at a time
+    std::mutex control;
+    // the rest is under mutex
+    std::mutex mutex;
+    std::condition_variable cond;
+    std::thread *thread;
+    bool stopping;
+    int frequency;
+    size_t dequeue;
+    // in ms since the epoch, and how long it ran for
+    uint64_t startTime, startNs, durationNs;
+    // how many times each stack was seen, by its addresses innermost
+    // first. All but the innermost are a byte into the call they return
+    // from so they look up to the right function
+    FlatHash<std::string, uint64_t> stacks;
+    FlatHash<uint64_t, String> symbols;
+#ifdef PROFILER_THREAD_TIMERS
+    Map<pid_t, timer_t> timers;
+    pid_t collector;
+#endif
+};
+
+// never destroyed, the collector may still be running at exit
+State &sState = *new State;
+// BufferSamples of them, made by the first start() and kept since a
+// handler may still be running when it's stopped
+Sample *sSamples = 0;
+std::atomic<size_t> sEnqueue(0);
+std::atomic<bool> sRunning(false);
+std::atomic<uint64_t> sSampleCount(0), sDropped(0);
+
+Config::Handle<String> sOutputOption;
+Config::Handle<int> sFrequencyOption;
+// what applyConfig() started it for
+String sOutput;
+}
+
+#ifdef HAVE_BACKTRACE
+static void onSignal(int, siginfo_t *, void *)
+{
+    if (!sRunning.load(std::memory_order_relaxed))
+        return;
+    const int savedErrno = errno;
+    // the handler and the signal trampoline first
+    enum { Skip = 2 };
+    void *frames[Profiler::MaxFrames + Skip];
+    const int count = ::backtrace(frames, Profiler::MaxFrames + Skip);
+    size_t pos = sEnqueue.load(std::memory_order_relaxed);
+    while (true) {
+        Sample &sample = sSamples[pos % Profiler::BufferSamples];
+        const size_t sequence = sample.sequence.load(std::memory_order_acquire);
+        const intptr_t diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos);
+        if (!diff) {
+            if (sEnqueue.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                sample.depth = std::max(count - Skip, 0);
+                if (sample.depth)
+                    memcpy(sample.frames, frames + Skip, sample.depth * sizeof(void *));
+                sample.sequence.store(pos + 1, std::memory_order_release);
+                sSampleCount.fetch_add(1, std::memory_order_relaxed);
+                break;
+            }
+        } else if (diff < 0) {
+            // full, the collector hasn't got to them yet
+            sDropped.fetch_add(1, std::memory_order_relaxed);
+            break;
+        } else {
+            pos = sEnqueue.load(std::memory_order_relaxed);
+        }
+    }
+    errno = savedErrno;
+}
+
+static String symbolName(uint64_t address)
+{
+    Dl_info info;
+    if (dladdr(reinterpret_cast<void *>(static_cast<uintptr_t>(address)), &info)) {
+        if (info.dli_sname) {
+            int status;
+            char *demangled = abi::__cxa_demangle(info.dli_sname, 0, 0, &status);
+            const String ret = demangled && !status ? String(demangled) : String(info.dli_sname);
+            free(demangled);
+            return ret;
+        }
+        if (info.dli_fname) {
+            return String::format<256>("%s+0x%llx", Path(info.dli_fname).fileName(),
+                                       static_cast<unsigned long long>(address - reinterpret_cast<uintptr_t>(info.dli_fbase)));
+        }
+    }
+    return String::format<32>("0x%llx", static_cast<unsigned long long>(address));
+}
+#endif
+
+// under sState.mutex
+static void drain()
+{
+    if (!sSamples)
+        return;
+    uint64_t frames[Profiler::MaxFrames];
+    while (true) {
+        Sample &sample = sSamples[sState.dequeue % Profiler::BufferSamples];
+        if (sample.sequence.load(std::memory_order_acquire) != sState.dequeue + 1)
+            break;
+        const int depth = sample.depth;
+        for (int i=0; i<depth; ++i)
+            frames[i] = reinterpret_cast<uintptr_t>(sample.frames[i]) - (i ? 1 : 0);
+        sample.sequence.store(sState.dequeue + Profiler::BufferSamples, std::memory_order_release);
+        ++sState.dequeue;
+        if (!depth)
+            continue;
+
+        uint64_t &count = sState.stacks[std::string(reinterpret_cast<const char *>(frames), depth * sizeof(uint64_t))];
+        if (!count++) {
+#ifdef HAVE_BACKTRACE
+            for (int i=0; i<depth; ++i) {
+                if (!sState.symbols.contains(frames[i]))
+                    sState.symbols[frames[i]] = symbolName(frames[i]);
+            }
+#endif
+        }
+    }
+}
+
+static inline void stackFrames(const std::string &stack, std::vector<uint64_t> &frames)
+{
+    frames.resize(stack.size() / sizeof(uint64_t));
+    memcpy(frames.data(), stack.data(), stack.size());
+}
+
+#ifdef PROFILER_THREAD_TIMERS
+static bool armTimer(pid_t tid, timer_t *timer)
+{
+    sigevent event;
+    memset(&event, 0, sizeof(event));
+    event.sigev_notify = SIGEV_THREAD_ID;
+    event.sigev_signo = SIGPROF;
+    event.sigev_notify_thread_id = tid;
+    // the thread's CPU clock, what pthread_getcpuclockid() makes for a
+    // pthread_t, but any thread can be asked for by its tid
+    const clockid_t clock = static_cast<clockid_t>((~static_cast<unsigned int>(tid) << 3) | 6);
+    if (timer_create(clock, &event, timer) == -1)
+        return false;
+    const long interval = 1000000000L / sState.frequency;
+    itimerspec spec;
+    spec.it_interval.tv_sec = spec.it_value.tv_sec = interval / 1000000000L;
+    spec.it_interval.tv_nsec = spec.it_value.tv_nsec = interval % 1000000000L;
+    if (timer_settime(*timer, 0, &spec, 0) == -1) {
+        timer_delete(*timer);
+        return false;
+    }
+    return true;
+}
+
+// under sState.mutex, a timer for each thread there is but the collector
+static void scanThreads()
+{
+    DIR *dir = opendir("/proc/self/task");
+    if (!dir)
+        return;
+    std::vector<pid_t> tids;
+    while (dirent *entry = readdir(dir)) {
+        if (entry->d_name[0] != '.')
+            tids.push_back(atoi(entry->d_name));
+    }
+    closedir(dir);
+    std::sort(tids.begin(), tids.end());
+
+    auto it = sState.timers.begin();
+    while (it != sState.timers.end()) {
+        if (!std::binary_search(tids.begin(), tids.end(), it->first)) {
+            timer_delete(it->second);
+            sState.timers.erase(it++);
+        } else {
+            ++it;
+        }
+    }
+    for (pid_t tid : tids) {
+        if (tid == sState.collector || sState.timers.contains(tid))
+            continue;
+        // it may have exited since
+        timer_t timer;
+        if (armTimer(tid, &timer))
+            sState.timers[tid] = timer;
+    }
+}
+#endif
+
+static void collect()
+{
+    Thread::setCurrentName("Profiler");
+    std::unique_lock<std::mutex> lock(sState.mutex);
+#ifdef PROFILER_THREAD_TIMERS
+    sState.collector = syscall(SYS_gettid);
+    uint64_t lastScan = 0;
+#endif
+    while (!sState.stopping) {
+        drain();
+#ifdef PROFILER_THREAD_TIMERS
+        const uint64_t now = Rct::monoMs();
+        if (!lastScan || now - lastScan >= 1000) {
+            scanThreads();
+            lastScan = now;
+        }
+#endif
+        sState.cond.wait_for(lock, std::chrono::milliseconds(100));
+    }
+}
+
+bool Profiler::start(int frequency)
+{
+#ifndef HAVE_BACKTRACE
+    (void)frequency;
+    error("Profiler: There's no backtrace() here");
+    return false;
+#else
+    if (frequency <= 0 || frequency > 10000) {
+        error("Profiler: %d samples a second won't do", frequency);
+        return false;
+    }
+    std::lock_guard<std::mutex> control(sState.control);
+    if (sRunning.load())
+        return false;
+    if (!sSamples) {
+        sSamples = new Sample[BufferSamples];
+        for (size_t i=0; i<BufferSamples; ++i)
+            sSamples[i].sequence.store(i, std::memory_order_relaxed);
+    }
+    {
+        std::lock_guard<std::mutex> lock(sState.mutex);
+        // anything that came in late last time goes too
+        drain();
+        sState.stacks.clear();
+        sState.frequency = frequency;
+        sState.stopping = false;
+        sState.startTime = Rct::currentTimeMs();
+        sState.startNs = Rct::monoNs();
+        sState.durationNs = 0;
+        sSampleCount.store(0);
+        sDropped.store(0);
+    }
+
+    // backtrace() may load libgcc and allocate the first time, not in the
+    // handler please
+    void *frames[2];
+    ::backtrace(frames, 2);
+    // it's left installed when stopping, a SIGPROF that was already on its
+    // way would kill the process otherwise
+    static std::once_flag once;
+    std::call_once(once, []() {
+            struct sigaction action;
+            memset(&action, 0, sizeof(action));
+            action.sa_sigaction = onSignal;
+            action.sa_flags = SA_SIGINFO | SA_RESTART;
+            sigemptyset(&action.sa_mask);
+            sigaction(SIGPROF, &action, 0);
+        });
+    sRunning.store(true);
+
+#ifndef PROFILER_THREAD_TIMERS
+    const long interval = 1000000L / frequency;
+    itimerval timer;
+    timer.it_interval.tv_sec = timer.it_value.tv_sec = interval / 1000000L;
+    timer.it_interval.tv_usec = timer.it_value.tv_usec = interval % 1000000L;
+    setitimer(ITIMER_PROF, &timer, 0);
+#endif
+    // which starts the threads' timers
+    sState.thread = new std::thread(collect);
+    return true;
+#endif
+}
+
+void Profiler::stop()
+{
+    std::lock_guard<std::mutex> control(sState.control);
+    if (!sRunning.load())
+        return;
+    sRunning.store(false);
+#ifndef PROFILER_THREAD_TIMERS
+    itimerval timer;
+    memset(&timer, 0, sizeof(timer));
+    setitimer(ITIMER_PROF, &timer, 0);
+#endif
+    {
+        std::lock_guard<std::mutex> lock(sState.mutex);
+        sState.stopping = true;
+    }
+    sState.cond.notify_one();
+    sState.thread->join();
+    delete sState.thread;
+    sState.thread = 0;
+
+    std::lock_guard<std::mutex> lock(sState.mutex);
+#ifdef PROFILER_THREAD_TIMERS
+    for (const auto &timer : sState.timers)
+        timer_delete(timer.second);
+    sState.timers.clear();
+#endif
+    drain();
+    sState.durationNs = Rct::monoNs() - sState.startNs;
+}
+
+bool Profiler::isRunning()
+{
+    return sRunning.load();
+}
+
+void Profiler::clear()
+{
+    std::lock_guard<std::mutex> lock(sState.mutex);
+    drain();
+    sState.stacks.clear();
+    sSampleCount.store(0);
+    sDropped.store(0);
+}
+
+Profiler::Stats Profiler::stats()
+{
+    Stats stats;
+    stats.samples = sSampleCount.load(std::memory_order_relaxed);
+    stats.dropped = sDropped.load(std::memory_order_relaxed);
+    return stats;
+}
+
+String Profiler::folded()
+{
+    // stacks that differ only in where in a function they were are one
+    FlatHash<String, uint64_t> lines;
+    std::vector<uint64_t> frames;
+    {
+        std::lock_guard<std::mutex> lock(sState.mutex);
+        drain();
+        String line;
+        for (const auto &stack : sState.stacks) {
+            stackFrames(stack.first, frames);
+            line.clear();
+            for (size_t i=frames.size(); i>0; --i) {
+                String name = sState.symbols.value(frames[i - 1]);
+                // the separator
+                name.replace(";", ":");
+                line += name;
+                if (i > 1)
+                    line += ';';
+            }
+            lines[line] += stack.second;
+        }
+    }
+    String ret;
+    for (const auto &line : lines) {
+        ret += line.first;
+        ret += ' ';
+        ret += String::number(line.second);
+        ret += '\n';
+    }
+    return ret;
+}
+
+namespace {
+// just what profile.proto needs
+struct ProtoWriter
+{
+    void varint(uint64_t value)
+    {
+        while (value >= 0x80) {
+            data += static_cast<char>(value | 0x80);
+            value >>= 7;
+        }
+        data += static_cast<char>(value);
+    }
+    void integer(int field, uint64_t value)
+    {
+        varint(field << 3);
+        varint(value);
+    }
+    void bytes(int field, const String &value)
+    {
+        varint((field << 3) | 2);
+        varint(value.size());
+        data += value;
+    }
+    void packed(int field, const std::vector<uint64_t> &values)
+    {
+        ProtoWriter writer;
+        for (uint64_t value : values)
+            writer.varint(value);
+        bytes(field, writer.data);
+    }
+
+    String data;
+};
+
+struct StringTable
+{
+    StringTable()
+    {
+        index("");
+    }
+    int index(const String &string)
+    {
+        const auto it = indexes.find(string);
+        if (it != indexes.end())
+            return it->second;
+        indexes[string] = strings.size();
+        strings.append(string);
+        return strings.size() - 1;
+    }
+
+    FlatHash<String, int> indexes;
+    List<String> strings;
+};
+}
+
+static String valueType(StringTable &strings, const char *type, const char *unit)
+{
+    ProtoWriter writer;
+    writer.integer(1, strings.index(type));
+    writer.integer(2, strings.index(unit));
+    return writer.data;
+}
+
+String Profiler::pprof()
+{
+    ProtoWriter profile;
+    StringTable strings;
+    std::lock_guard<std::mutex> lock(sState.mutex);
+    drain();
+    const uint64_t period = 1000000000ull / sState.frequency;
+
+    profile.bytes(1, valueType(strings, "samples", "count"));
+    profile.bytes(1, valueType(strings, "cpu", "nanoseconds"));
+
+    // a location for each address and a function for each name, both
+    // counted from 1
+    FlatHash<uint64_t, uint64_t> locations;
+    FlatHash<String, uint64_t> functions;
+    ProtoWriter tables;
+    std::vector<uint64_t> frames, ids;
+    for (const auto &stack : sState.stacks) {
+        stackFrames(stack.first, frames);
+        ids.clear();
+        for (uint64_t address : frames) {
+            uint64_t &location = locations[address];
+            if (!location) {
+                location = locations.size();
+                const String name = sState.symbols.value(address);
+                uint64_t &function = functions[name];
+                if (!function) {
+                    function = functions.size();
+                    ProtoWriter writer;
+                    writer.integer(1, function);
+                    writer.integer(2, strings.index(name));
+                    writer.integer(3, strings.index(name));
+                    tables.bytes(5, writer.data);
+                }
+                ProtoWriter line;
+                line.integer(1, function);
+                ProtoWriter writer;
+                writer.integer(1, location);
+                writer.integer(3, address);
+                writer.bytes(4, line.data);
+                tables.bytes(4, writer.data);
+            }
+            ids.push_back(location);
+        }
+        ProtoWriter sample;
+        sample.packed(1, ids);
+        sample.packed(2, { stack.second, stack.second * period });
+        profile.bytes(2, sample.data);
+    }
+    profile.data += tables.data;
+
+    const String periodType = valueType(strings, "cpu", "nanoseconds");
+    for (const String &string : strings.strings)
+        profile.bytes(6, string);
+    profile.integer(9, sState.startTime * 1000000);
+    profile.integer(10, sRunning.load() ? Rct::monoNs() - sState.startNs : sState.durationNs);
+    profile.bytes(11, periodType);
+    profile.integer(12, period);
+    return profile.data;
+}
+
+bool Profiler::write(const Path &path, Format format)
+{
+    if (format == Auto)
+        format = path.endsWith(".pb") || path.endsWith(".pprof") ? Pprof : Folded;
+    return Path::write(path, format == Pprof ? pprof() : folded());
+}
+
+void Profiler::registerOptions()
+{
+    sOutputOption = Config::registerOption<String>("profile", "Profile the CPU and write it to <arg> when this is unset, pprof if it ends with .pb, folded stacks otherwise");
+    sFrequencyOption = Config::registerOption<int>("profile-frequency", "Samples a second of CPU a thread uses when profiling", '\0', DefaultFrequency);
+}
+
+void Profiler::applyConfig()
+{
+    if (!sOutputOption.isValid())
+        return;
+    const String output = *sOutputOption;
+    if (output == sOutput)
+        return;
+    if (!sOutput.isEmpty()) {
+        stop();
+        if (!write(sOutput))
+            error() << "Profiler: Couldn't write to" << sOutput;
+    }
+    sOutput = output;
+    if (!sOutput.isEmpty() && !start(*sFrequencyOption))
+        sOutput.clear();
+}
@@ -0,0 +1,73 @@
+#ifndef Profiler_h
+#define Profiler_h
+
+#include <rct/Path.h>
+#include <rct/String.h>
+#include <stdint.h>
+
+// A sampling CPU profiler. While it runs, every thread is interrupted with
+// SIGPROF frequency times per second of CPU it uses, and the signal
+// handler copies the thread's stack, just the return addresses, into a
+// buffer of BufferSamples set aside at start(). It takes no locks and
+// doesn't allocate, when the buffer is full samples are dropped.
+//
+// A thread of the profiler's own empties the buffer ten times a second,
+// counts each distinct stack and looks up the names of the addresses it
+// hasn't seen before. On Linux it also looks for new threads, each has a
+// timer on its own CPU clock. Elsewhere there's one timer for the process
+// and the signal goes to whichever thread is running.
+//
+// Names come from dladdr(), an executable has to be linked with -rdynamic
+// for its own functions to have them. Those that don't are written as the
+// module and offset.
+//
+// Config can turn it on and off, see registerOptions().
+class Profiler
+{
+public:
+    enum {
+        DefaultFrequency = 99,
+        BufferSamples = 8192,
+        MaxFrames = 64
+    };
+
+    // false if it's running already or it can't be done here
+    static bool start(int frequency = DefaultFrequency);
+    // what was collected stays until clear() or the next start()
+    static void stop();
+    static bool isRunning();
+    static void clear();
+
+    // For flamegraph.pl and the like, a line per stack from the outermost
+    // frame in, separated by ';', and how many times it was seen
+    static String folded();
+    // pprof's profile.proto, not compressed
+    static String pprof();
+    enum Format {
+        // pprof for .pb and .pprof, otherwise folded
+        Auto,
+        Folded,
+        Pprof
+    };
+    static bool write(const Path &path, Format format = Auto);
+
+    struct Stats
+    {
+        // what made it into the buffer and what didn't
+        uint64_t samples, dropped;
+    };
+    static Stats stats();
+
+    // Registers --profile <path> and --profile-frequency <hz> with Config,
+    // before Config::parse(). After each parse applyConfig() starts it if
+    // there's a path, or stops it and writes to the path it had if there
+    // isn't anymore, so a daemon that parses its rc files again on SIGHUP
+    // can be profiled without a restart
+    static void registerOptions();
+    static void applyConfig();
+
+private:
+    Profiler();
+};
+
+#endif
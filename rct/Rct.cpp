@@ -1,4 +1,5 @@
 #include "Rct.h"
+#include "HostResolver.h"
 #include "Log.h"
 #include "rct-config.h"
 #include <sys/time.h>
@@ -10,6 +11,12 @@
 #include <sys/socket.h>
 #include <netdb.h>
 #include <arpa/inet.h>
+#include <mutex>
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <nmmintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
 #ifdef OS_Darwin
 # include <mach-o/dyld.h>
 #elif OS_FreeBSD
@@ -392,6 +399,26 @@ uint64_t monoMs()
     return 0;
 }
 
+uint64_t monoNs()
+{
+#if defined(HAVE_MACH_ABSOLUTE_TIME)
+    static mach_timebase_info_data_t info;
+    if (!info.denom)
+        mach_timebase_info(&info);
+    return mach_absolute_time() * info.numer / info.denom;
+#else
+    timespec spec;
+#if defined(HAVE_CLOCK_MONOTONIC_RAW)
+    const clockid_t cid = CLOCK_MONOTONIC_RAW;
+#else
+    const clockid_t cid = CLOCK_MONOTONIC;
+#endif
+    if (::clock_gettime(cid, &spec) == -1)
+        return 0;
+    return spec.tv_sec * static_cast<uint64_t>(1000000000) + spec.tv_nsec;
+#endif
+}
+
 uint64_t currentTimeMs()
 {
     timeval time;
@@ -399,6 +426,72 @@ uint64_t currentTimeMs()
     return (time.tv_sec * static_cast<uint64_t>(1000)) + (time.tv_usec / static_cast<uint64_t>(1000));
 }
 
+static uint32_t crc32cSoftware(const unsigned char *bytes, size_t size, uint32_t crc)
+{
+    static uint32_t table[256];
+    static std::once_flag once;
+    std::call_once(once, []() {
+            for (uint32_t i=0; i<256; ++i) {
+                uint32_t c = i;
+                for (int j=0; j<8; ++j)
+                    c = c & 1 ? 0x82f63b78 ^ (c >> 1) : c >> 1;
+                table[i] = c;
+            }
+        });
+    for (size_t i=0; i<size; ++i)
+        crc = table[(crc ^ bytes[i]) & 0xff] ^ (crc >> 8);
+    return crc;
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+__attribute__((target("sse4.2")))
+static uint32_t crc32cHardware(const unsigned char *bytes, size_t size, uint32_t crc)
+{
+    uint64_t c = crc;
+    while (size >= 8) {
+        uint64_t word;
+        memcpy(&word, bytes, sizeof(word));
+        c = _mm_crc32_u64(c, word);
+        bytes += 8;
+        size -= 8;
+    }
+    crc = static_cast<uint32_t>(c);
+    while (size--)
+        crc = _mm_crc32_u8(crc, *bytes++);
+    return crc;
+}
+static bool hasHardwareCrc32c()
+{
+    static const bool has = (__builtin_cpu_init(), __builtin_cpu_supports("sse4.2"));
+    return has;
+}
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+static uint32_t crc32cHardware(const unsigned char *bytes, size_t size, uint32_t crc)
+{
+    while (size >= 8) {
+        uint64_t word;
+        memcpy(&word, bytes, sizeof(word));
+        crc = __crc32cd(crc, word);
+        bytes += 8;
+        size -= 8;
+    }
+    while (size--)
+        crc = __crc32cb(crc, *bytes++);
+    return crc;
+}
+static inline bool hasHardwareCrc32c() { return true; }
+#endif
+
+uint32_t crc32c(const void *data, size_t size, uint32_t crc)
+{
+    const unsigned char *bytes = static_cast<const unsigned char *>(data);
+#if (defined(__x86_64__) && defined(__GNUC__)) || (defined(__aarch64__) && defined(__ARM_FEATURE_CRC32))
+    if (hasHardwareCrc32c())
+        return ~crc32cHardware(bytes, size, ~crc);
+#endif
+    return ~crc32cSoftware(bytes, size, ~crc);
+}
+
 String hostName()
 {
     String host(HOST_NAME_MAX, '\0');
@@ -517,49 +610,21 @@ String addrLookup(const String& addr, LookupMode mode, bool *ok)
 
 String nameLookup(const String& name, LookupMode mode, bool *ok)
 {
-    assert(mode == Auto);
-    String out(INET6_ADDRSTRLEN, '\0');
-    addrinfo hints, *p, *res;
-
-    memset(&hints, 0, sizeof(hints));
-    hints.ai_family = (mode == IPv6) ? AF_INET6 : AF_INET;
-    hints.ai_socktype = SOCK_STREAM;
-
-    if (getaddrinfo(name.constData(), NULL, &hints, &res) != 0) {
-        if (ok)
-            *ok = false;
-        // bad
-        return name;
-    }
-
-    bool found = false;
-    for (p = res; p; p = p->ai_next) {
-        if (mode == IPv4 && p->ai_family == AF_INET) {
-            sockaddr_in* addr = reinterpret_cast<sockaddr_in*>(p->ai_addr);
-            inet_ntop(AF_INET, &addr->sin_addr, out.data(), out.size());
-            out.resize(strlen(out.constData()));
-            found = true;
-            break;
-        } else if (mode == IPv6 && p->ai_family == AF_INET6) {
-            sockaddr_in6* addr = reinterpret_cast<sockaddr_in6*>(p->ai_addr);
-            inet_ntop(AF_INET6, &addr->sin6_addr, out.data(), out.size());
-            out.resize(strlen(out.constData()));
-            found = true;
-            break;
+    // goes through the HostResolver cache, Auto takes the first address of
+    // either family
+    const List<HostResolver::Address> addresses = HostResolver::lookupBlocking(name);
+    for (const HostResolver::Address& address : addresses) {
+        if (mode == Auto
+            || (mode == IPv4 && address.family() == AF_INET)
+            || (mode == IPv6 && address.family() == AF_INET6)) {
+            if (ok)
+                *ok = true;
+            return address.toString();
         }
     }
-
-    freeaddrinfo(res);
-
-    if (!found) {
-        if (ok)
-            *ok = false;
-        return name;
-    }
     if (ok)
-        *ok = true;
-
-    return out;
+        *ok = false;
+    return name;
 }
 
 String strerror(int error)
@@ -72,7 +72,12 @@ Path executablePath();
 String backtrace(int maxFrames = -1);
 bool gettime(timeval* time);
 uint64_t monoMs();
+// the same clock in nanoseconds, for timing things shorter than a millisecond
+uint64_t monoNs();
 uint64_t currentTimeMs();
+// CRC-32C (Castagnoli), with SSE 4.2 or the ARMv8 CRC instructions when
+// the CPU has them. Pass the previous result to continue
+uint32_t crc32c(const void *data, size_t size, uint32_t crc = 0);
 String hostName();
 
 enum AnsiColor {
@@ -238,6 +243,7 @@ static inline bool wildCmp(const char *wild, const char *string, String::CaseSen
 {
     // Written by Jack Handy - Found here: http://www.codeproject.com/Articles/1088/Wildcard-string-compare-globbing
     const char *cp = 0, *mp = 0;
+    const char *end = 0;
 
     while (*string && *wild != '*') {
         if (*wild != '?' && *wild != *string && (cs == String::CaseSensitive || tolower(*wild) != tolower(*string))) {
@@ -260,6 +266,17 @@ static inline bool wildCmp(const char *wild, const char *string, String::CaseSen
         } else {
             wild = mp;
             string = cp++;
+            // what follows the '*' starts with a character that has to be
+            // there, no need to try every position before it
+            if (*mp != '?' && *mp != '*') {
+                if (!end)
+                    end = string + strlen(string);
+                const int idx = String::find(string, end - string, *mp, cs);
+                if (idx == -1)
+                    return false;
+                string += idx;
+                cp = string + 1;
+            }
         }
     }
 
@@ -2,74 +2,234 @@
 #include <assert.h>
 #include <chrono>
 
-ReadWriteLock::ReadWriteLock()
-    : mCount(0), mWrite(false)
+ReadWriteLock::ReadWriteLock(Mode mode)
+    : mMode(mode), mCount(0), mWrite(false), mUpgradeHeld(false), mStripes(0),
+      mWriter(NoWriter), mUpgradeFlag(false)
 {
+    if (mMode == Striped) {
+        mStripes = new Stripe[StripeCount];
+        for (int i = 0; i < StripeCount; ++i)
+            mStripes[i].readers.store(0, std::memory_order_relaxed);
+    }
+}
+
+ReadWriteLock::~ReadWriteLock()
+{
+    delete[] mStripes;
+}
+
+bool ReadWriteLock::wait(std::unique_lock<std::mutex> &locker, const Deadline *deadline)
+{
+    if (!deadline) {
+        mCond.wait(locker);
+        return true;
+    }
+    return mCond.wait_until(locker, *deadline) != std::cv_status::timeout;
+}
+
+bool ReadWriteLock::isUpgrader() const
+{
+    return mUpgradeHeld && mUpgrader == std::this_thread::get_id();
+}
+
+// threads are dealt stripes in turn the first time they read, the same
+// one for every lock
+static std::atomic<unsigned int> nextStripe(0);
+static __thread int threadStripe = -1;
+
+std::atomic<int> &ReadWriteLock::readers()
+{
+    if (threadStripe == -1)
+        threadStripe = nextStripe.fetch_add(1, std::memory_order_relaxed) % StripeCount;
+    return mStripes[threadStripe].readers;
+}
+
+bool ReadWriteLock::hasReaders() const
+{
+    for (int i = 0; i < StripeCount; ++i) {
+        if (mStripes[i].readers.load())
+            return true;
+    }
+    return false;
 }
 
 bool ReadWriteLock::lock(LockType type, int maxTime)
+{
+    Deadline deadline;
+    if (maxTime > 0)
+        deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(maxTime);
+    const Deadline *d = maxTime > 0 ? &deadline : 0;
+    if (mMode == Striped)
+        return lockStriped(type, d, true);
+    return lockSimple(type, d, true);
+}
+
+bool ReadWriteLock::tryLock(LockType type)
+{
+    if (mMode == Striped)
+        return lockStriped(type, 0, false);
+    return lockSimple(type, 0, false);
+}
+
+bool ReadWriteLock::lockSimple(LockType type, const Deadline *deadline, bool block)
 {
     std::unique_lock<std::mutex> locker(mMutex);
-    bool ok;
-    if (type == Read) {
+    switch (type) {
+    case Read:
         while (mWrite) {
-            if (maxTime > 0) {
-                ok = mCond.wait_for(locker, std::chrono::milliseconds(maxTime)) != std::cv_status::timeout;
-            } else {
-                mCond.wait(locker);
-                ok = true;
-            }
-            if (!ok)
+            if (!block || !wait(locker, deadline))
                 return false;
         }
         ++mCount;
-    } else {
+        break;
+    case Upgrade:
+        while (mWrite || mUpgradeHeld) {
+            if (!block || !wait(locker, deadline))
+                return false;
+        }
+        ++mCount;
+        mUpgradeHeld = true;
+        mUpgrader = std::this_thread::get_id();
+        break;
+    case Write:
         while (mCount) {
-            if (maxTime > 0) {
-                ok = mCond.wait_for(locker, std::chrono::milliseconds(maxTime)) != std::cv_status::timeout;
-            } else {
-                mCond.wait(locker);
-                ok = true;
-            }
-            if (!ok)
+            if (!block || !wait(locker, deadline))
                 return false;
         }
         assert(!mWrite);
         mCount = 1;
         mWrite = true;
+        break;
+    }
+    return true;
+}
+
+// Readers and writers announce themselves first and look at the other
+// second, both seq_cst, so at least one of them sees the other. Readers
+// back off while there's a writer, waiting or holding the lock, and a
+// writer waits on the condition for the readers to leave, woken by the
+// last one on each stripe
+bool ReadWriteLock::lockStriped(LockType type, const Deadline *deadline, bool block)
+{
+    if (type == Read) {
+        std::atomic<int> &count = readers();
+        for (;;) {
+            count.fetch_add(1);
+            if (mWriter.load() == NoWriter)
+                return true;
+            count.fetch_sub(1);
+            std::unique_lock<std::mutex> locker(mMutex);
+            // the writer may have been waiting for us
+            mCond.notify_all();
+            while (mWriter.load() != NoWriter) {
+                if (!block || !wait(locker, deadline))
+                    return false;
+            }
+        }
+    }
+
+    std::unique_lock<std::mutex> locker(mMutex);
+    while (mWriter.load() != NoWriter || mUpgradeHeld) {
+        if (!block || !wait(locker, deadline))
+            return false;
+    }
+    if (type == Upgrade) {
+        mUpgradeHeld = true;
+        mUpgrader = std::this_thread::get_id();
+        mUpgradeFlag.store(true);
+        return true;
+    }
+    mWriter.store(WriterWaiting);
+    while (hasReaders()) {
+        if (!block || !wait(locker, deadline)) {
+            mWriter.store(NoWriter);
+            mCond.notify_all();
+            return false;
+        }
+    }
+    mWriter.store(WriterHolding);
+    return true;
+}
+
+bool ReadWriteLock::upgrade(int maxTime)
+{
+    Deadline deadline;
+    if (maxTime > 0)
+        deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(maxTime);
+    const Deadline *d = maxTime > 0 ? &deadline : 0;
+
+    std::unique_lock<std::mutex> locker(mMutex);
+    assert(isUpgrader());
+    if (mMode == Simple) {
+        // our own read is the one left
+        while (mCount > 1) {
+            if (!wait(locker, d))
+                return false;
+        }
+        mWrite = true;
+        return true;
     }
+    // writers wait for the upgrader, so there's none ahead of us
+    assert(mWriter.load() == NoWriter);
+    mWriter.store(WriterWaiting);
+    while (hasReaders()) {
+        if (!wait(locker, d)) {
+            mWriter.store(NoWriter);
+            mCond.notify_all();
+            return false;
+        }
+    }
+    mWriter.store(WriterHolding);
     return true;
 }
 
 void ReadWriteLock::unlock()
 {
+    if (mMode == Striped) {
+        // a write lock, readers can't be in while one is held
+        if (mWriter.load(std::memory_order_relaxed) == WriterHolding) {
+            std::lock_guard<std::mutex> locker(mMutex);
+            mWriter.store(NoWriter);
+            mUpgradeHeld = false;
+            mUpgradeFlag.store(false);
+            mCond.notify_all();
+            return;
+        }
+        if (mUpgradeFlag.load()) {
+            std::lock_guard<std::mutex> locker(mMutex);
+            if (isUpgrader()) {
+                mUpgradeHeld = false;
+                mUpgradeFlag.store(false);
+                mCond.notify_all();
+                return;
+            }
+        }
+        if (readers().fetch_sub(1) == 1 && mWriter.load() != NoWriter) {
+            std::lock_guard<std::mutex> locker(mMutex);
+            mCond.notify_all();
+        }
+        return;
+    }
+
     std::lock_guard<std::mutex> locker(mMutex);
     assert(mCount > 0);
+    if (!mWrite && isUpgrader()) {
+        --mCount;
+        mUpgradeHeld = false;
+        mCond.notify_all();
+        return;
+    }
     if (mCount > 1) {
         --mCount;
         assert(!mWrite);
+        // an upgrade may be waiting for the last of us
+        if (mUpgradeHeld && mCount == 1)
+            mCond.notify_all();
         return;
     }
     --mCount;
     assert(!mCount);
     mWrite = false;
+    mUpgradeHeld = false;
     mCond.notify_all();
 }
-
-bool ReadWriteLock::tryLock(LockType type)
-{
-    std::lock_guard<std::mutex> locker(mMutex);
-    if (type == Read) {
-        if (mWrite)
-            return false;
-        ++mCount;
-        return true;
-    } else {
-        if (mCount > 0)
-            return false;
-        assert(!mWrite && !mCount);
-        mCount = 1;
-        mWrite = true;
-        return true;
-    }
-}
@@ -1,34 +1,92 @@
 #ifndef READWRITELOCK_H
 #define READWRITELOCK_H
 
+#include <atomic>
+#include <chrono>
 #include <mutex>
 #include <condition_variable>
+#include <thread>
 
 class ReadWriteLock
 {
 public:
-    ReadWriteLock();
+    // Simple: everything goes through one mutex, readers and writers get
+    // in in whatever order they get to it. Striped: readers count
+    // themselves on one of a few cache lines, picked by thread, and only
+    // touch the mutex while a writer is around. A waiting writer keeps new
+    // readers out so writers don't starve. For many threads reading at
+    // once, writing costs a little more
+    enum Mode {
+        Simple,
+        Striped
+    };
+    ReadWriteLock(Mode mode = Simple);
+    ~ReadWriteLock();
+
+    Mode mode() const { return mMode; }
 
     enum LockType {
         Read,
-        Write
+        Write,
+        // a read lock that can turn into a write lock with upgrade(), one
+        // thread at a time gets one
+        Upgrade
     };
 
     bool lockForRead(int maxTime = 0) { return lock(Read, maxTime); }
     bool lockForWrite(int maxTime = 0) { return lock(Write, maxTime); }
+    bool lockForUpgrade(int maxTime = 0) { return lock(Upgrade, maxTime); }
     bool lock(LockType type, int maxTime = 0);
 
     bool tryLockForRead() { return tryLock(Read); }
     bool tryLockForWrite() { return tryLock(Write); }
+    bool tryLockForUpgrade() { return tryLock(Upgrade); }
     bool tryLock(LockType type);
 
+    // holding Upgrade, waits for the readers to leave. Still holding
+    // Upgrade if it times out
+    bool upgrade(int maxTime = 0);
+
     void unlock();
 
 private:
+    typedef std::chrono::steady_clock::time_point Deadline;
+    bool wait(std::unique_lock<std::mutex> &locker, const Deadline *deadline);
+    bool lockSimple(LockType type, const Deadline *deadline, bool block);
+    bool lockStriped(LockType type, const Deadline *deadline, bool block);
+    bool isUpgrader() const;
+    std::atomic<int> &readers();
+    bool hasReaders() const;
+
+    const Mode mMode;
     std::mutex mMutex;
     std::condition_variable mCond;
+    // Simple
     int mCount;
     bool mWrite;
+    // Upgrade, under mMutex
+    bool mUpgradeHeld;
+    std::thread::id mUpgrader;
+
+    // Striped
+    struct Stripe
+    {
+        std::atomic<int> readers;
+        char padding[64 - sizeof(std::atomic<int>)];
+    };
+    enum { StripeCount = 16 };
+    Stripe *mStripes;
+    enum WriterState {
+        NoWriter,
+        WriterWaiting,
+        WriterHolding
+    };
+    std::atomic<int> mWriter;
+    // lets readers unlock without the mutex unless there's an upgrader
+    std::atomic<bool> mUpgradeFlag;
+
+    ReadWriteLock(const ReadWriteLock &) = delete;
+    ReadWriteLock &operator=(const ReadWriteLock &) = delete;
 };
 
 #endif
@@ -1,20 +1,88 @@
 #include "SHA256.h"
+#include "MappedFile.h"
+#include "Parallel.h"
+#include "Path.h"
+#include <algorithm>
+#include <atomic>
+#include <memory>
 #include <stdio.h>
+#include <sys/stat.h>
+#include <vector>
 #ifdef OS_Darwin
 #include "CommonCrypto/CommonDigest.h"
-#define SHA256_Update        CC_SHA256_Update
-#define SHA256_Init          CC_SHA256_Init
-#define SHA256_Final         CC_SHA256_Final
-#define SHA256_CTX           CC_SHA256_CTX
 #define SHA256_DIGEST_LENGTH CC_SHA256_DIGEST_LENGTH
 #else
+#include <openssl/evp.h>
 #include <openssl/sha.h>
 #endif
 
+// Through EVP, where OpenSSL picks SHA-NI or the ARMv8 crypto extensions
+// when the CPU has them. The context is allocated once and reused
+class SHA256Digest
+{
+public:
+#ifdef OS_Darwin
+    SHA256Digest() { reset(); }
+    void reset() { CC_SHA256_Init(&mCtx); }
+    void update(const void* data, size_t size)
+    {
+        // CC_LONG is 32 bits
+        const char* bytes = static_cast<const char*>(data);
+        while (size) {
+            const CC_LONG len = static_cast<CC_LONG>(std::min<size_t>(size, 1u << 30));
+            CC_SHA256_Update(&mCtx, bytes, len);
+            bytes += len;
+            size -= len;
+        }
+    }
+    void final(unsigned char* out) { CC_SHA256_Final(out, &mCtx); }
+private:
+    CC_SHA256_CTX mCtx;
+#else
+    SHA256Digest()
+# if OPENSSL_VERSION_NUMBER < 0x10100000L
+        : mCtx(EVP_MD_CTX_create())
+# else
+        : mCtx(EVP_MD_CTX_new())
+# endif
+    {
+        reset();
+    }
+    ~SHA256Digest()
+    {
+# if OPENSSL_VERSION_NUMBER < 0x10100000L
+        EVP_MD_CTX_destroy(mCtx);
+# else
+        EVP_MD_CTX_free(mCtx);
+# endif
+    }
+    void reset() { EVP_DigestInit_ex(mCtx, md(), 0); }
+    void update(const void* data, size_t size) { EVP_DigestUpdate(mCtx, data, size); }
+    void final(unsigned char* out) { EVP_DigestFinal_ex(mCtx, out, 0); }
+private:
+    static const EVP_MD* md()
+    {
+# if OPENSSL_VERSION_NUMBER >= 0x30000000L
+        // fetched once, EVP_sha256() looks it up in the providers each time
+        static EVP_MD* sha256 = EVP_MD_fetch(0, "SHA256", 0);
+        if (sha256)
+            return sha256;
+# endif
+        return EVP_sha256();
+    }
+
+    EVP_MD_CTX* mCtx;
+#endif
+
+public:
+    SHA256Digest(const SHA256Digest&) = delete;
+    SHA256Digest& operator=(const SHA256Digest&) = delete;
+};
+
 class SHA256Private
 {
 public:
-    SHA256_CTX ctx;
+    SHA256Digest digest;
     unsigned char hash[SHA256_DIGEST_LENGTH];
     bool finalized;
 };
@@ -22,7 +90,7 @@ public:
 SHA256::SHA256()
     : priv(new SHA256Private)
 {
-    reset();
+    priv->finalized = false;
 }
 
 SHA256::~SHA256()
@@ -36,7 +104,7 @@ void SHA256::update(const char *data, unsigned int size)
         return;
     if (priv->finalized)
         priv->finalized = false;
-    SHA256_Update(&priv->ctx, data, size);
+    priv->digest.update(data, size);
 }
 
 void SHA256::update(const String &data)
@@ -45,21 +113,21 @@ void SHA256::update(const String &data)
         return;
     if (priv->finalized)
         priv->finalized = false;
-    SHA256_Update(&priv->ctx, data.constData(), data.size());
+    priv->digest.update(data.constData(), data.size());
 }
 
 void SHA256::reset()
 {
     priv->finalized = false;
-    SHA256_Init(&priv->ctx);
+    priv->digest.reset();
 }
 
 static const char* const hexLookup = "0123456789abcdef";
 
-static inline String hashToHex(SHA256Private* priv)
+static inline String hashToHex(const unsigned char* hash)
 {
     String out(SHA256_DIGEST_LENGTH * 2, '\0');
-    const unsigned char* get = priv->hash;
+    const unsigned char* get = hash;
     char* put = out.data();
     const char* const end = out.data() + out.size();
     for (; put != end; ++get) {
@@ -69,16 +137,21 @@ static inline String hashToHex(SHA256Private* priv)
     return out;
 }
 
+static inline String toString(const unsigned char* hash, SHA256::MapType type)
+{
+    if (type == SHA256::Hex)
+        return hashToHex(hash);
+    return String(reinterpret_cast<const char*>(hash), SHA256_DIGEST_LENGTH);
+}
+
 String SHA256::hash(MapType type) const
 {
     if (!priv->finalized) {
-        SHA256_Final(priv->hash, &priv->ctx);
-        SHA256_Init(&priv->ctx);
+        priv->digest.final(priv->hash);
+        priv->digest.reset();
         priv->finalized = true;
     }
-    if (type == Hex)
-        return hashToHex(priv);
-    return String(reinterpret_cast<char*>(priv->hash), SHA256_DIGEST_LENGTH);
+    return toString(priv->hash, type);
 }
 
 String SHA256::hash(const String& data, MapType type)
@@ -88,11 +161,138 @@ String SHA256::hash(const String& data, MapType type)
 
 String SHA256::hash(const char* data, unsigned int size, MapType type)
 {
-    SHA256Private priv;
-    SHA256_Init(&priv.ctx);
-    SHA256_Update(&priv.ctx, data, size);
-    SHA256_Final(priv.hash, &priv.ctx);
-    if (type == Hex)
-        return hashToHex(&priv);
-    return String(reinterpret_cast<char*>(priv.hash), SHA256_DIGEST_LENGTH);
+    SHA256Digest digest;
+    digest.update(data, size);
+    unsigned char out[SHA256_DIGEST_LENGTH];
+    digest.final(out);
+    return toString(out, type);
+}
+
+List<String> SHA256::hash(const List<String>& data, MapType type, ThreadPool* pool)
+{
+    List<String> ret(data.size());
+    size_t total = 0;
+    for (const String& input : data)
+        total += input.size();
+    const int slots = total > ParallelSize ? Rct::parallelSlots(data.size(), 0, pool) : 1;
+    std::vector<std::unique_ptr<SHA256Digest> > digests(slots);
+    Rct::parallelRun(data.size(), 0, slots, [&](size_t begin, size_t end, int slot) {
+            std::unique_ptr<SHA256Digest>& digest = digests[slot];
+            if (!digest)
+                digest.reset(new SHA256Digest);
+            unsigned char out[SHA256_DIGEST_LENGTH];
+            for (size_t i = begin; i < end; ++i) {
+                digest->reset();
+                digest->update(data[i].constData(), data[i].size());
+                digest->final(out);
+                ret[i] = toString(out, type);
+            }
+        }, pool);
+    return ret;
+}
+
+// hashed a window at a time, a file bigger than an int can't be mapped in
+// one go and this keeps the address space use down
+enum { WindowSize = 64 * 1024 * 1024 };
+
+String SHA256::hashFile(const Path& path, MapType type)
+{
+    struct stat st;
+    if (stat(path.constData(), &st) || !S_ISREG(st.st_mode))
+        return String();
+    SHA256Digest digest;
+    MappedFile file;
+    for (int64_t offset = 0; offset < st.st_size; offset += WindowSize) {
+        const int length = static_cast<int>(std::min<int64_t>(WindowSize, st.st_size - offset));
+        if (!file.open(path, MappedFile::Sequential | MappedFile::ReadFallback, offset, length))
+            return String();
+        digest.update(file.data(), file.size());
+    }
+    unsigned char out[SHA256_DIGEST_LENGTH];
+    digest.final(out);
+    return toString(out, type);
+}
+
+// the leaves are tagged 0 and the root 1 so that neither can pass for the
+// other
+static String treeRoot(const List<String>& leaves, uint64_t size, unsigned int chunkSize, SHA256::MapType type)
+{
+    SHA256Digest digest;
+    const unsigned char tag = 1;
+    digest.update(&tag, sizeof(tag));
+    unsigned char sizes[12];
+    for (int i = 0; i < 8; ++i)
+        sizes[i] = static_cast<unsigned char>(size >> (i * 8));
+    for (int i = 0; i < 4; ++i)
+        sizes[8 + i] = static_cast<unsigned char>(chunkSize >> (i * 8));
+    digest.update(sizes, sizeof(sizes));
+    for (const String& leaf : leaves)
+        digest.update(leaf.constData(), leaf.size());
+    unsigned char out[SHA256_DIGEST_LENGTH];
+    digest.final(out);
+    return toString(out, type);
+}
+
+static inline String treeLeaf(SHA256Digest& digest, const char* data, size_t size)
+{
+    const unsigned char tag = 0;
+    digest.reset();
+    digest.update(&tag, sizeof(tag));
+    digest.update(data, size);
+    unsigned char out[SHA256_DIGEST_LENGTH];
+    digest.final(out);
+    return toString(out, SHA256::Raw);
+}
+
+String SHA256::treeHash(const char* data, size_t size, MapType type, unsigned int chunkSize, ThreadPool* pool)
+{
+    if (!chunkSize)
+        chunkSize = DefaultChunkSize;
+    const size_t chunks = (size + chunkSize - 1) / chunkSize;
+    List<String> leaves(chunks);
+    const int slots = Rct::parallelSlots(chunks, 1, pool);
+    std::vector<std::unique_ptr<SHA256Digest> > digests(slots);
+    Rct::parallelRun(chunks, 1, slots, [&](size_t begin, size_t end, int slot) {
+            std::unique_ptr<SHA256Digest>& digest = digests[slot];
+            if (!digest)
+                digest.reset(new SHA256Digest);
+            for (size_t i = begin; i < end; ++i) {
+                const size_t offset = i * chunkSize;
+                leaves[i] = treeLeaf(*digest, data + offset, std::min<size_t>(chunkSize, size - offset));
+            }
+        }, pool);
+    return treeRoot(leaves, size, chunkSize, type);
+}
+
+String SHA256::treeHashFile(const Path& path, MapType type, unsigned int chunkSize, ThreadPool* pool)
+{
+    struct stat st;
+    if (stat(path.constData(), &st) || !S_ISREG(st.st_mode))
+        return String();
+    if (!chunkSize)
+        chunkSize = DefaultChunkSize;
+    const uint64_t size = st.st_size;
+    const size_t chunks = (size + chunkSize - 1) / chunkSize;
+    List<String> leaves(chunks);
+    const int slots = Rct::parallelSlots(chunks, 1, pool);
+    std::vector<std::unique_ptr<SHA256Digest> > digests(slots);
+    std::atomic<bool> failed(false);
+    Rct::parallelRun(chunks, 1, slots, [&](size_t begin, size_t end, int slot) {
+            std::unique_ptr<SHA256Digest>& digest = digests[slot];
+            if (!digest)
+                digest.reset(new SHA256Digest);
+            MappedFile file;
+            for (size_t i = begin; i < end && !failed.load(std::memory_order_relaxed); ++i) {
+                const uint64_t offset = static_cast<uint64_t>(i) * chunkSize;
+                const int length = static_cast<int>(std::min<uint64_t>(chunkSize, size - offset));
+                if (!file.open(path, MappedFile::Sequential | MappedFile::ReadFallback, offset, length)) {
+                    failed.store(true, std::memory_order_relaxed);
+                    return;
+                }
+                leaves[i] = treeLeaf(*digest, file.data(), file.size());
+            }
+        }, pool);
+    if (failed.load())
+        return String();
+    return treeRoot(leaves, size, chunkSize, type);
 }
@@ -1,9 +1,13 @@
 #ifndef SHA256_H
 #define SHA256_H
 
+#include <rct/List.h>
 #include <rct/String.h>
+#include <stddef.h>
 
+class Path;
 class SHA256Private;
+class ThreadPool;
 
 class SHA256
 {
@@ -22,6 +26,25 @@ public:
 
     static String hash(const String& data, MapType type = Hex);
     static String hash(const char* data, unsigned int size, MapType type = Hex);
+    // One digest for each, in the same order. Batches of more than
+    // ParallelSize bytes are spread over pool, ThreadPool::instance() unless
+    // told otherwise, with one context per thread reused for every input
+    enum { ParallelSize = 1024 * 1024 };
+    static List<String> hash(const List<String>& data, MapType type = Hex, ThreadPool* pool = 0);
+    // the file's contents, mapped a window at a time rather than read. Empty
+    // if it can't be read
+    static String hashFile(const Path& path, MapType type = Hex);
+
+    // Tree hashes, for data too big to hash on one thread. Chunks of
+    // chunkSize are hashed in parallel on pool and the digest is the SHA256
+    // of the size, the chunk size and the chunks' digests. That is not the
+    // SHA256 of the data, and the same data with a different chunk size
+    // hashes differently, so these only compare with each other
+    enum { DefaultChunkSize = 4 * 1024 * 1024 };
+    static String treeHash(const char* data, size_t size, MapType type = Hex,
+                           unsigned int chunkSize = DefaultChunkSize, ThreadPool* pool = 0);
+    static String treeHashFile(const Path& path, MapType type = Hex,
+                               unsigned int chunkSize = DefaultChunkSize, ThreadPool* pool = 0);
 
 private:
     SHA256Private* priv;
@@ -1,7 +1,14 @@
 #include "ScriptEngine.h"
 
 #include <v8.h>
+#include <rct/Buffer.h>
+#include <rct/DataFile.h>
 #include <rct/EventLoop.h>
+#include <rct/Rct.h>
+#include <rct/Set.h>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
 
 static String toString(v8::Handle<v8::Value> value);
 static v8::Handle<v8::Value> toV8(v8::Isolate* isolate, const Value& value);
@@ -13,17 +20,58 @@ enum CustomType {
     CustomType_Object,
     CustomType_Function,
     CustomType_AdoptedFunction,
-    CustomType_ClassObject
+    CustomType_ClassObject,
+    CustomType_Buffer,
+    CustomType_Lazy
+};
+
+struct ObjectData;
+
+// one of the isolates call() uses on other threads
+struct PooledIsolate
+{
+    v8::Isolate *isolate;
+    v8::Persistent<v8::Context> context;
+    // what its bindings point to
+    List<ObjectData*> bindings;
 };
 
 struct ScriptEnginePrivate
 {
+    ScriptEnginePrivate()
+        : isolate(0), thread(std::this_thread::get_id())
+    {
+    }
+
+    PooledIsolate *acquire();
+    void release(PooledIsolate *pooled);
+
     v8::Persistent<v8::Context> context;
     v8::Isolate *isolate;
 
+    // pooled isolates compile too
+    std::mutex codeCacheMutex;
+    Hash<uint64_t, String> codeCache;
+
+    // what evaluate() ran, for the pooled isolates
+    List<std::pair<String, Path> > scripts;
+
+    const std::thread::id thread;
+    std::mutex poolMutex;
+    std::condition_variable poolCondition;
+    List<PooledIsolate*> pool, idle;
+
     static ScriptEnginePrivate *get(ScriptEngine *engine) { return engine->mPrivate; }
 };
 
+// objects and functions that come from the pooled isolates don't outlive
+// the call, they become data
+static inline bool isMainIsolate(v8::Isolate *isolate)
+{
+    ScriptEngine *engine = ScriptEngine::instance();
+    return engine && ScriptEnginePrivate::get(engine)->isolate == isolate;
+}
+
 struct ScriptEngineCustom : public Value::Custom
 {
     ScriptEngineCustom(int type, v8::Isolate *isolate, const v8::Handle<v8::Object> &obj,
@@ -56,6 +104,99 @@ struct ScriptEngineCustom : public Value::Custom
     ScriptEngine::Object::SharedPtr scriptObject;
 };
 
+// the bytes behind the ArrayBuffers fromBuffer() values become
+struct ScriptEngineBuffer : public Value::Custom
+{
+    ScriptEngineBuffer(Buffer &&b)
+        : Value::Custom(CustomType_Buffer), buffer(std::move(b))
+    {
+        data = buffer.data();
+        size = buffer.size();
+    }
+    ScriptEngineBuffer(String &&s)
+        : Value::Custom(CustomType_Buffer), string(std::move(s))
+    {
+        data = reinterpret_cast<unsigned char*>(string.data());
+        size = string.size();
+    }
+
+    virtual String toString() const override
+    {
+        return String::format<64>("\"[ArrayBuffer %zu]\"", size);
+    }
+
+    Buffer buffer;
+    String string;
+    unsigned char *data;
+    size_t size;
+};
+
+struct ScriptEngineLazy : public Value::Custom
+{
+    ScriptEngineLazy(Value &&v)
+        : Value::Custom(CustomType_Lazy), value(std::make_shared<const Value>(std::move(v)))
+    {
+    }
+
+    virtual String toString() const override { return value->toJSON(); }
+
+    std::shared_ptr<const Value> value;
+};
+
+// an ArrayBuffer over a ScriptEngineBuffer, until it's collected
+struct BufferHandle
+{
+    std::shared_ptr<ScriptEngineBuffer> buffer;
+    v8::Persistent<v8::ArrayBuffer> arrayBuffer;
+};
+
+// an object reading value, root keeps it alive
+struct LazyHandle
+{
+    std::shared_ptr<const Value> root;
+    const Value *value;
+    v8::Persistent<v8::Object> object;
+};
+
+// per isolate, in its data slot 0
+struct IsolateData
+{
+    v8::Persistent<v8::ObjectTemplate> lazyTemplate;
+    // the handles that haven't been collected, a disposed isolate doesn't
+    // collect anything
+    Set<BufferHandle*> buffers;
+    Set<LazyHandle*> lazies;
+};
+
+static inline IsolateData *isolateData(v8::Isolate *iso)
+{
+    IsolateData *data = static_cast<IsolateData*>(iso->GetData(0));
+    if (!data) {
+        data = new IsolateData;
+        iso->SetData(0, data);
+    }
+    return data;
+}
+
+// with the isolate entered, before it's disposed
+static void disposeIsolateData(v8::Isolate *iso)
+{
+    IsolateData *data = static_cast<IsolateData*>(iso->GetData(0));
+    if (!data)
+        return;
+    for (BufferHandle *handle : data->buffers) {
+        handle->arrayBuffer.Reset();
+        delete handle;
+    }
+    for (LazyHandle *handle : data->lazies) {
+        handle->object.Reset();
+        delete handle;
+    }
+    data->lazyTemplate.Reset();
+    delete data;
+    iso->SetData(0, 0);
+}
+
 class ObjectPrivate
 {
 public:
@@ -352,6 +493,7 @@ ScriptEngine::ScriptEngine()
 ScriptEngine::~ScriptEngine()
 {
     assert(sInstance == this);
+    setIsolateCount(0);
     sInstance = 0;
 }
 
@@ -387,58 +529,98 @@ static inline v8::Handle<v8::Value> findFunction(v8::Isolate* isolate, const v8:
     return val;
 }
 
-Value ScriptEngine::call(const String &function, String* error)
+static Value callFunction(v8::Isolate *iso, const v8::Persistent<v8::Context> &context, const String &function,
+                          const Value *arguments, size_t count, String *error)
 {
-    const v8::Isolate::Scope isolateScope(mPrivate->isolate);
-    v8::HandleScope handleScope(mPrivate->isolate);
-    v8::Local<v8::Context> ctx = v8::Local<v8::Context>::New(mPrivate->isolate, mPrivate->context);
+    v8::HandleScope handleScope(iso);
+    v8::Local<v8::Context> ctx = v8::Local<v8::Context>::New(iso, context);
     v8::Context::Scope contextScope(ctx);
 
     // find the function object
     v8::Handle<v8::Value> that, val;
-    val = findFunction(mPrivate->isolate, ctx, function, &that);
+    val = findFunction(iso, ctx, function, &that);
     if (val.IsEmpty() || !val->IsFunction())
         return Value();
     assert(!that.IsEmpty() && that->IsObject());
     v8::Handle<v8::Function> func = v8::Handle<v8::Function>::Cast(val);
 
+    List<v8::Handle<v8::Value> > v8args;
+    v8args.reserve(count);
+    for (size_t i = 0; i < count; ++i)
+        v8args.append(toV8(iso, arguments[i]));
+
     v8::TryCatch tryCatch;
-    val = func->Call(that, 0, 0);
+    val = func->Call(that, count, v8args.data());
     if (catchError(tryCatch, "Call error", error))
         return Value();
-    return fromV8(mPrivate->isolate, val);
+    return fromV8(iso, val);
+}
+
+Value ScriptEngine::call(const String &function, String* error)
+{
+    return callInternal(function, 0, 0, error);
 }
 
 Value ScriptEngine::call(const String &function, std::initializer_list<Value> arguments, String* error)
 {
+    return callInternal(function, arguments.begin(), arguments.size(), error);
+}
+
+Value ScriptEngine::callInternal(const String &function, const Value *arguments, size_t count, String *error)
+{
+    if (std::this_thread::get_id() != mPrivate->thread) {
+        if (PooledIsolate *pooled = mPrivate->acquire()) {
+            Value ret;
+            {
+                v8::Locker locker(pooled->isolate);
+                const v8::Isolate::Scope isolateScope(pooled->isolate);
+                ret = callFunction(pooled->isolate, pooled->context, function, arguments, count, error);
+            }
+            mPrivate->release(pooled);
+            return ret;
+        }
+    }
     const v8::Isolate::Scope isolateScope(mPrivate->isolate);
-    v8::HandleScope handleScope(mPrivate->isolate);
-    v8::Local<v8::Context> ctx = v8::Local<v8::Context>::New(mPrivate->isolate, mPrivate->context);
-    v8::Context::Scope contextScope(ctx);
+    return callFunction(mPrivate->isolate, mPrivate->context, function, arguments, count, error);
+}
 
-    // find the function object
-    v8::Handle<v8::Value> that, val;
-    val = findFunction(mPrivate->isolate, ctx, function, &that);
-    if (val.IsEmpty() || !val->IsFunction())
-        return Value();
-    assert(!that.IsEmpty() && that->IsObject());
-    v8::Handle<v8::Function> func = v8::Handle<v8::Function>::Cast(val);
+// the size and a crc32c, V8 checks the source against what it's given too
+static inline uint64_t sourceKey(const String &source)
+{
+    return (static_cast<uint64_t>(source.size()) << 32) | Rct::crc32c(source.constData(), source.size());
+}
 
-    const auto sz = arguments.size();
-    List<v8::Handle<v8::Value> > v8args;
-    v8args.reserve(sz);
-    const Value* arg = arguments.begin();
-    const Value* end = arguments.end();
-    while (arg != end) {
-        v8args.append(toV8(mPrivate->isolate, *arg));
-        ++arg;
+// with the code cache's code for source if it has any, adding it if it
+// doesn't. Errors are left for the caller's TryCatch
+static v8::Handle<v8::Script> compile(ScriptEnginePrivate *engine, v8::Isolate *iso, const String &source, const Path &path)
+{
+    v8::Handle<v8::String> src = v8::String::NewFromUtf8(iso, source.constData(), v8::String::kNormalString, source.size());
+    v8::ScriptOrigin origin(v8::String::NewFromUtf8(iso, path.constData()));
+    const uint64_t key = sourceKey(source);
+    String code;
+    {
+        std::lock_guard<std::mutex> lock(engine->codeCacheMutex);
+        code = engine->codeCache.value(key);
     }
-
-    v8::TryCatch tryCatch;
-    val = func->Call(that, sz, v8args.data());
-    if (catchError(tryCatch, "Call error", error))
-        return Value();
-    return fromV8(mPrivate->isolate, val);
+    if (!code.isEmpty()) {
+        // source owns the CachedData, code the bytes
+        v8::ScriptCompiler::Source cached(src, origin,
+                                          new v8::ScriptCompiler::CachedData(reinterpret_cast<const uint8_t*>(code.constData()), code.size()));
+        v8::Handle<v8::Script> script = v8::ScriptCompiler::Compile(iso, &cached, v8::ScriptCompiler::kConsumeCodeCache);
+        if (script.IsEmpty() || !cached.GetCachedData()->rejected)
+            return script;
+        // it compiled from scratch, make new code for next time
+        std::lock_guard<std::mutex> lock(engine->codeCacheMutex);
+        engine->codeCache.remove(key);
+    }
+    v8::ScriptCompiler::Source uncached(src, origin);
+    v8::Handle<v8::Script> script = v8::ScriptCompiler::Compile(iso, &uncached, v8::ScriptCompiler::kProduceCodeCache);
+    const v8::ScriptCompiler::CachedData *data = uncached.GetCachedData();
+    if (!script.IsEmpty() && data && data->length > 0) {
+        std::lock_guard<std::mutex> lock(engine->codeCacheMutex);
+        engine->codeCache[key] = String(reinterpret_cast<const char*>(data->data), data->length);
+    }
+    return script;
 }
 
 Value ScriptEngine::evaluate(const String &source, const Path &path, String *error)
@@ -447,19 +629,221 @@ Value ScriptEngine::evaluate(const String &source, const Path &path, String *err
     v8::HandleScope handleScope(mPrivate->isolate);
     v8::Local<v8::Context> ctx = v8::Local<v8::Context>::New(mPrivate->isolate, mPrivate->context);
     v8::Context::Scope contextScope(ctx);
-    v8::Handle<v8::String> src = v8::String::NewFromUtf8(mPrivate->isolate, source.constData(), v8::String::kNormalString, source.size());
-    v8::Handle<v8::String> fn = v8::String::NewFromUtf8(mPrivate->isolate, path.constData());
 
     v8::TryCatch tryCatch;
-    v8::Handle<v8::Script> script = v8::Script::Compile(src, fn);
+    v8::Handle<v8::Script> script = compile(mPrivate, mPrivate->isolate, source, path);
     if (catchError(tryCatch, "Compile error", error) || script.IsEmpty())
         return Value();
     v8::Handle<v8::Value> val = script->Run();
     if (catchError(tryCatch, "Evaluate error", error))
         return Value();
+    mPrivate->scripts.append(std::make_pair(source, path));
     return fromV8(mPrivate->isolate, val);
 }
 
+enum { CodeCacheVersion = 1 };
+
+bool ScriptEngine::loadCodeCache(const Path &file)
+{
+    DataFile data(file, CodeCacheVersion);
+    if (!data.open(DataFile::Read)) {
+        error("ScriptEngine::loadCodeCache() failed to open %s %s", file.constData(), data.error().constData());
+        return false;
+    }
+    std::unique_ptr<Deserializer> version = data.section("v8");
+    std::unique_ptr<Deserializer> code = data.section("code");
+    if (!version || !code) {
+        error("ScriptEngine::loadCodeCache() %s is corrupted", file.constData());
+        return false;
+    }
+    String v8Version;
+    *version >> v8Version;
+    if (v8Version != v8::V8::GetVersion()) {
+        warning("ScriptEngine::loadCodeCache() %s is from V8 %s, this is %s",
+                file.constData(), v8Version.constData(), v8::V8::GetVersion());
+        return false;
+    }
+    Hash<uint64_t, String> loaded;
+    *code >> loaded;
+    std::lock_guard<std::mutex> lock(mPrivate->codeCacheMutex);
+    mPrivate->codeCache.unite(loaded);
+    return true;
+}
+
+bool ScriptEngine::saveCodeCache(const Path &file) const
+{
+    DataFile data(file, CodeCacheVersion);
+    if (!data.open(DataFile::Write)) {
+        error("ScriptEngine::saveCodeCache() failed to open %s %s", file.constData(), data.error().constData());
+        return false;
+    }
+    data.beginSection("v8");
+    data << String(v8::V8::GetVersion());
+    {
+        std::lock_guard<std::mutex> lock(mPrivate->codeCacheMutex);
+        data.beginSection("code");
+        data << mPrivate->codeCache;
+    }
+    if (!data.flush()) {
+        error("ScriptEngine::saveCodeCache() %s", data.error().constData());
+        return false;
+    }
+    return true;
+}
+
+PooledIsolate *ScriptEnginePrivate::acquire()
+{
+    std::unique_lock<std::mutex> lock(poolMutex);
+    if (pool.isEmpty())
+        return 0;
+    while (idle.isEmpty())
+        poolCondition.wait(lock);
+    PooledIsolate *pooled = idle.back();
+    idle.pop_back();
+    return pooled;
+}
+
+void ScriptEnginePrivate::release(PooledIsolate *pooled)
+{
+    {
+        std::lock_guard<std::mutex> lock(poolMutex);
+        idle.append(pooled);
+    }
+    poolCondition.notify_one();
+}
+
+static void PooledGetterCallback(v8::Local<v8::String>, const v8::PropertyCallbackInfo<v8::Value>& info)
+{
+    v8::Isolate* iso = info.GetIsolate();
+    v8::HandleScope handleScope(iso);
+
+    ObjectData *data = static_cast<ObjectData*>(v8::Local<v8::External>::Cast(info.Data())->Value());
+    ScriptEngine::Object::SharedPtr obj = data->weak.lock();
+    if (!obj)
+        return;
+
+    ObjectPrivate* priv = ObjectPrivate::objectPrivate(obj.get());
+    auto it = priv->properties.find(data->name);
+    if (it == priv->properties.end())
+        return;
+
+    info.GetReturnValue().Set(toV8(iso, it->second.getter(obj)));
+}
+
+static void PooledSetterCallback(v8::Local<v8::String>, v8::Local<v8::Value> value, const v8::PropertyCallbackInfo<void>& info)
+{
+    v8::Isolate* iso = info.GetIsolate();
+    v8::HandleScope handleScope(iso);
+
+    ObjectData *data = static_cast<ObjectData*>(v8::Local<v8::External>::Cast(info.Data())->Value());
+    ScriptEngine::Object::SharedPtr obj = data->weak.lock();
+    if (!obj)
+        return;
+
+    ObjectPrivate* priv = ObjectPrivate::objectPrivate(obj.get());
+    auto it = priv->properties.find(data->name);
+    if (it == priv->properties.end() || !it->second.setter)
+        return;
+
+    it->second.setter(obj, fromV8(iso, value));
+}
+
+// binds object's properties, functions and children onto target in a
+// pooled isolate. They call the same C++ functions as the engine's own do
+static void bindObject(PooledIsolate *pooled, v8::Local<v8::Object> target, const ScriptEngine::Object::SharedPtr &object)
+{
+    v8::Isolate *iso = pooled->isolate;
+    ObjectPrivate *priv = ObjectPrivate::objectPrivate(object.get());
+    for (const auto &property : priv->properties) {
+        ObjectData *data = new ObjectData({ property.first, object });
+        pooled->bindings.append(data);
+        target->SetAccessor(v8::String::NewFromUtf8(iso, property.first.constData()),
+                            PooledGetterCallback,
+                            property.second.setter ? PooledSetterCallback : 0,
+                            v8::External::New(iso, data));
+    }
+
+    v8::Local<v8::ObjectTemplate> templ = v8::ObjectTemplate::New(iso);
+    templ->SetInternalFieldCount(1);
+    for (const auto &child : priv->children) {
+        ObjectData *data = new ObjectData({ child.first, child.second, object });
+        pooled->bindings.append(data);
+        v8::Local<v8::Object> sub = templ->NewInstance();
+        sub->SetInternalField(0, v8::External::New(iso, data));
+        v8::Local<v8::String> name = v8::String::NewFromUtf8(iso, child.first.constData());
+        if (ObjectPrivate::objectPrivate(child.second.get())->customType == CustomType_Function) {
+            // functionCallback finds the function through the data
+            target->Set(name, v8::Function::New(iso, functionCallback, sub));
+        } else {
+            bindObject(pooled, sub, child.second);
+            target->Set(name, sub);
+        }
+    }
+}
+
+void ScriptEngine::setIsolateCount(int count)
+{
+    assert(std::this_thread::get_id() == mPrivate->thread);
+    List<PooledIsolate*> pool;
+    {
+        std::lock_guard<std::mutex> lock(mPrivate->poolMutex);
+        assert(mPrivate->idle.size() == mPrivate->pool.size());
+        std::swap(pool, mPrivate->pool);
+        mPrivate->idle.clear();
+    }
+    for (PooledIsolate *pooled : pool) {
+        {
+            v8::Locker locker(pooled->isolate);
+            const v8::Isolate::Scope isolateScope(pooled->isolate);
+            pooled->context.Reset();
+            disposeIsolateData(pooled->isolate);
+        }
+        pooled->isolate->Dispose();
+        pooled->bindings.deleteAll();
+        delete pooled;
+    }
+
+    pool.clear();
+    for (int i=0; i<count; ++i) {
+        PooledIsolate *pooled = new PooledIsolate;
+        pooled->isolate = v8::Isolate::New();
+        v8::Isolate *iso = pooled->isolate;
+        {
+            v8::Locker locker(iso);
+            const v8::Isolate::Scope isolateScope(iso);
+            v8::HandleScope handleScope(iso);
+            v8::Handle<v8::Context> ctx = v8::Context::New(iso, 0, v8::ObjectTemplate::New(iso));
+            v8::Context::Scope contextScope(ctx);
+            v8::Local<v8::Object> global = ctx->Global();
+            global->Set(v8::String::NewFromUtf8(iso, "global"), global);
+            bindObject(pooled, global, mGlobalObject);
+
+            for (const auto &script : mPrivate->scripts) {
+                v8::TryCatch tryCatch;
+                String err;
+                v8::Handle<v8::Script> compiled = compile(mPrivate, iso, script.first, script.second);
+                if (!catchError(tryCatch, "Compile error", &err) && !compiled.IsEmpty()) {
+                    compiled->Run();
+                    catchError(tryCatch, "Evaluate error", &err);
+                }
+                if (!err.isEmpty())
+                    error() << "ScriptEngine::setIsolateCount()" << err;
+            }
+            pooled->context.Reset(iso, ctx);
+        }
+        pool.append(pooled);
+    }
+    std::lock_guard<std::mutex> lock(mPrivate->poolMutex);
+    mPrivate->pool = pool;
+    mPrivate->idle = pool;
+}
+
+int ScriptEngine::isolateCount() const
+{
+    std::lock_guard<std::mutex> lock(mPrivate->poolMutex);
+    return mPrivate->pool.size();
+}
+
 void ScriptEngine::throwExceptionInternal(const Value& exception)
 {
     v8::Isolate* iso = mPrivate->isolate;
@@ -618,9 +1002,36 @@ Value ScriptEngine::fromObject(const Object::SharedPtr& object)
     return Value(std::make_shared<ScriptEngineCustom>(priv->customType, iso, obj, object));
 }
 
+Value ScriptEngine::fromBuffer(Buffer &&buffer)
+{
+    return Value(std::make_shared<ScriptEngineBuffer>(std::move(buffer)));
+}
+
+Value ScriptEngine::fromBuffer(String &&data)
+{
+    return Value(std::make_shared<ScriptEngineBuffer>(std::move(data)));
+}
+
+StringView ScriptEngine::bufferData(const Value &value) const
+{
+    const std::shared_ptr<Value::Custom> custom = value.toCustom();
+    if (!custom || custom->type != CustomType_Buffer)
+        return StringView();
+    const ScriptEngineBuffer *buffer = static_cast<const ScriptEngineBuffer*>(custom.get());
+    return StringView(reinterpret_cast<const char*>(buffer->data), buffer->size);
+}
+
+Value ScriptEngine::lazyValue(Value &&value)
+{
+    return Value(std::make_shared<ScriptEngineLazy>(std::move(value)));
+}
+
 ScriptEngine::Object::SharedPtr ScriptEngine::toObject(const Value &value) const
 {
-    const std::shared_ptr<ScriptEngineCustom> &custom = std::static_pointer_cast<ScriptEngineCustom>(value.toCustom());
+    const std::shared_ptr<Value::Custom> other = value.toCustom();
+    if (!other || other->type == CustomType_Buffer || other->type == CustomType_Lazy)
+        return ScriptEngine::Object::SharedPtr();
+    const std::shared_ptr<ScriptEngineCustom> &custom = std::static_pointer_cast<ScriptEngineCustom>(other);
     if (!custom || custom->object.IsEmpty()) {
         return ScriptEngine::Object::SharedPtr();
     }
@@ -636,10 +1047,39 @@ static String toString(v8::Handle<v8::Value> value)
     return String();
 }
 
+// ours come back as they went, others are copied
+static Value fromV8Buffer(v8::Isolate *isolate, v8::Handle<v8::Value> value)
+{
+    v8::Handle<v8::ArrayBuffer> arrayBuffer;
+    size_t offset = 0, length;
+    if (value->IsArrayBufferView()) {
+        v8::Handle<v8::ArrayBufferView> view = v8::Handle<v8::ArrayBufferView>::Cast(value);
+        arrayBuffer = view->Buffer();
+        offset = view->ByteOffset();
+        length = view->ByteLength();
+    } else {
+        arrayBuffer = v8::Handle<v8::ArrayBuffer>::Cast(value);
+        length = arrayBuffer->ByteLength();
+    }
+    v8::Handle<v8::Value> rct = arrayBuffer->GetHiddenValue(v8::String::NewFromUtf8(isolate, "rctBuffer"));
+    if (!rct.IsEmpty() && rct->IsExternal()) {
+        BufferHandle *handle = static_cast<BufferHandle*>(v8::Handle<v8::External>::Cast(rct)->Value());
+        if (!offset && length == handle->buffer->size)
+            return Value(std::static_pointer_cast<Value::Custom>(handle->buffer));
+    }
+    Buffer copy;
+    copy.resize(length);
+    if (length)
+        memcpy(copy.data(), static_cast<const unsigned char*>(arrayBuffer->GetContents().Data()) + offset, length);
+    return Value(std::make_shared<ScriptEngineBuffer>(std::move(copy)));
+}
+
 static Value fromV8(v8::Isolate *isolate, v8::Handle<v8::Value> value)
 {
     if (value->IsString()) {
         return toString(value);
+    } else if (value->IsArrayBufferView() || value->IsArrayBuffer()) {
+        return fromV8Buffer(isolate, value);
     } else if (value->IsArray()) {
         v8::Handle<v8::Array> array = v8::Handle<v8::Array>::Cast(value);
         List<Value> result(array->Length());
@@ -648,13 +1088,20 @@ static Value fromV8(v8::Isolate *isolate, v8::Handle<v8::Value> value)
         return result;
     } else if (value->IsObject()) {
         v8::Handle<v8::Object> object = v8::Handle<v8::Object>::Cast(value);
-        v8::Handle<v8::Value> rct = object->GetHiddenValue(v8::String::NewFromUtf8(isolate, "rct"));
-        if (!rct.IsEmpty() && rct->IsInt32()) {
-            return Value(std::make_shared<ScriptEngineCustom>(rct->ToInt32()->Value(), isolate,
-                                                              object, objectFromV8Object(object)));
+        v8::Handle<v8::Value> lazy = object->GetHiddenValue(v8::String::NewFromUtf8(isolate, "rctLazy"));
+        if (!lazy.IsEmpty() && lazy->IsExternal())
+            return *static_cast<LazyHandle*>(v8::Handle<v8::External>::Cast(lazy)->Value())->value;
+        if (isMainIsolate(isolate)) {
+            v8::Handle<v8::Value> rct = object->GetHiddenValue(v8::String::NewFromUtf8(isolate, "rct"));
+            if (!rct.IsEmpty() && rct->IsInt32()) {
+                return Value(std::make_shared<ScriptEngineCustom>(rct->ToInt32()->Value(), isolate,
+                                                                  object, objectFromV8Object(object)));
+            } else if (object->IsFunction()) {
+                return Value(std::make_shared<ScriptEngineCustom>(CustomType_AdoptedFunction, isolate, object,
+                                                                  adoptFunction(v8::Handle<v8::Function>::Cast(object))));
+            }
         } else if (object->IsFunction()) {
-            return Value(std::make_shared<ScriptEngineCustom>(CustomType_AdoptedFunction, isolate, object,
-                                                              adoptFunction(v8::Handle<v8::Function>::Cast(object))));
+            return Value::undefined();
         }
         Value result;
         v8::Local<v8::Array> properties = object->GetOwnPropertyNames();
@@ -677,6 +1124,143 @@ static Value fromV8(v8::Isolate *isolate, v8::Handle<v8::Value> value)
     return Value();
 }
 
+static void BufferWeak(const v8::WeakCallbackData<v8::ArrayBuffer, BufferHandle>& data)
+{
+    BufferHandle *handle = data.GetParameter();
+    v8::Isolate *iso = data.GetIsolate();
+    iso->AdjustAmountOfExternalAllocatedMemory(-static_cast<int64_t>(handle->buffer->size));
+    isolateData(iso)->buffers.remove(handle);
+    handle->arrayBuffer.Reset();
+    delete handle;
+}
+
+static v8::Local<v8::Value> wrapBuffer(v8::Isolate *iso, const std::shared_ptr<ScriptEngineBuffer> &buffer)
+{
+    BufferHandle *handle = new BufferHandle;
+    handle->buffer = buffer;
+    v8::Local<v8::ArrayBuffer> arrayBuffer = v8::ArrayBuffer::New(iso, buffer->data, buffer->size);
+    arrayBuffer->SetHiddenValue(v8::String::NewFromUtf8(iso, "rctBuffer"), v8::External::New(iso, handle));
+    handle->arrayBuffer.Reset(iso, arrayBuffer);
+    handle->arrayBuffer.SetWeak(handle, BufferWeak);
+    isolateData(iso)->buffers.insert(handle);
+    iso->AdjustAmountOfExternalAllocatedMemory(buffer->size);
+    return v8::Uint8Array::New(arrayBuffer, 0, buffer->size);
+}
+
+static inline LazyHandle *lazyHandle(const v8::Local<v8::Object> &holder)
+{
+    return static_cast<LazyHandle*>(v8::Handle<v8::External>::Cast(holder->GetInternalField(0))->Value());
+}
+
+static v8::Local<v8::Value> wrapLazy(v8::Isolate *iso, const std::shared_ptr<const Value> &root, const Value *value);
+
+// what's in a Map or a List, left to V8 if there's no such thing
+static inline v8::Local<v8::Value> lazyMember(v8::Isolate *iso, LazyHandle *handle, const Value *member)
+{
+    if (member->type() == Value::Type_Map || member->type() == Value::Type_List)
+        return wrapLazy(iso, handle->root, member);
+    return toV8(iso, *member);
+}
+
+static void LazyNamedGetter(v8::Local<v8::String> property, const v8::PropertyCallbackInfo<v8::Value>& info)
+{
+    v8::Isolate* iso = info.GetIsolate();
+    v8::HandleScope handleScope(iso);
+    LazyHandle *handle = lazyHandle(info.Holder());
+    const String name = toString(property);
+    if (handle->value->type() == Value::Type_Map) {
+        const Map<String, Value> &map = handle->value->mapRef();
+        auto it = map.find(name);
+        if (it != map.end())
+            info.GetReturnValue().Set(lazyMember(iso, handle, &it->second));
+    } else if (name == "length") {
+        info.GetReturnValue().Set(v8::Integer::New(iso, handle->value->count()));
+    }
+}
+
+static void LazyNamedQuery(v8::Local<v8::String> property, const v8::PropertyCallbackInfo<v8::Integer>& info)
+{
+    v8::Isolate* iso = info.GetIsolate();
+    LazyHandle *handle = lazyHandle(info.Holder());
+    if (handle->value->type() == Value::Type_Map && handle->value->mapRef().contains(toString(property)))
+        info.GetReturnValue().Set(v8::Integer::New(iso, v8::ReadOnly | v8::DontDelete));
+}
+
+static void LazyNamedEnumerator(const v8::PropertyCallbackInfo<v8::Array>& info)
+{
+    v8::Isolate* iso = info.GetIsolate();
+    LazyHandle *handle = lazyHandle(info.Holder());
+    if (handle->value->type() != Value::Type_Map)
+        return;
+    const Map<String, Value> &map = handle->value->mapRef();
+    v8::Local<v8::Array> array = v8::Array::New(iso, map.size());
+    uint32_t idx = 0;
+    for (const auto &it : map)
+        array->Set(idx++, v8::String::NewFromUtf8(iso, it.first.constData(), v8::String::kNormalString, it.first.size()));
+    info.GetReturnValue().Set(array);
+}
+
+static void LazyIndexedGetter(uint32_t index, const v8::PropertyCallbackInfo<v8::Value>& info)
+{
+    v8::Isolate* iso = info.GetIsolate();
+    v8::HandleScope handleScope(iso);
+    LazyHandle *handle = lazyHandle(info.Holder());
+    if (handle->value->type() == Value::Type_List && index < static_cast<uint32_t>(handle->value->count()))
+        info.GetReturnValue().Set(lazyMember(iso, handle, &handle->value->listRef().at(index)));
+}
+
+static void LazyIndexedQuery(uint32_t index, const v8::PropertyCallbackInfo<v8::Integer>& info)
+{
+    v8::Isolate* iso = info.GetIsolate();
+    LazyHandle *handle = lazyHandle(info.Holder());
+    if (handle->value->type() == Value::Type_List && index < static_cast<uint32_t>(handle->value->count()))
+        info.GetReturnValue().Set(v8::Integer::New(iso, v8::ReadOnly | v8::DontDelete));
+}
+
+static void LazyIndexedEnumerator(const v8::PropertyCallbackInfo<v8::Array>& info)
+{
+    v8::Isolate* iso = info.GetIsolate();
+    LazyHandle *handle = lazyHandle(info.Holder());
+    if (handle->value->type() != Value::Type_List)
+        return;
+    const int count = handle->value->count();
+    v8::Local<v8::Array> array = v8::Array::New(iso, count);
+    for (int i=0; i<count; ++i)
+        array->Set(i, v8::Integer::New(iso, i));
+    info.GetReturnValue().Set(array);
+}
+
+static void LazyWeak(const v8::WeakCallbackData<v8::Object, LazyHandle>& data)
+{
+    LazyHandle *handle = data.GetParameter();
+    isolateData(data.GetIsolate())->lazies.remove(handle);
+    handle->object.Reset();
+    delete handle;
+}
+
+static v8::Local<v8::Value> wrapLazy(v8::Isolate *iso, const std::shared_ptr<const Value> &root, const Value *value)
+{
+    v8::EscapableHandleScope handleScope(iso);
+    IsolateData *data = isolateData(iso);
+    if (data->lazyTemplate.IsEmpty()) {
+        v8::Local<v8::ObjectTemplate> templ = v8::ObjectTemplate::New(iso);
+        templ->SetInternalFieldCount(1);
+        templ->SetNamedPropertyHandler(LazyNamedGetter, 0, LazyNamedQuery, 0, LazyNamedEnumerator);
+        templ->SetIndexedPropertyHandler(LazyIndexedGetter, 0, LazyIndexedQuery, 0, LazyIndexedEnumerator);
+        data->lazyTemplate.Reset(iso, templ);
+    }
+    LazyHandle *handle = new LazyHandle;
+    handle->root = root;
+    handle->value = value;
+    v8::Local<v8::Object> object = v8::Local<v8::ObjectTemplate>::New(iso, data->lazyTemplate)->NewInstance();
+    object->SetInternalField(0, v8::External::New(iso, handle));
+    object->SetHiddenValue(v8::String::NewFromUtf8(iso, "rctLazy"), v8::External::New(iso, handle));
+    handle->object.Reset(iso, object);
+    handle->object.SetWeak(handle, LazyWeak);
+    data->lazies.insert(handle);
+    return handleScope.Escape(object);
+}
+
 static inline v8::Local<v8::Value> toV8_helper(v8::Isolate* isolate, const Value &value)
 {
     v8::Local<v8::Value> result;
@@ -702,8 +1286,17 @@ static inline v8::Local<v8::Value> toV8_helper(v8::Isolate* isolate, const Value
         result = object;
         break; }
     case Value::Type_Custom: {
-        const std::shared_ptr<ScriptEngineCustom> &custom = std::static_pointer_cast<ScriptEngineCustom>(value.toCustom());
-        if (!custom || custom->object.IsEmpty()) {
+        const std::shared_ptr<Value::Custom> other = value.toCustom();
+        if (other && other->type == CustomType_Buffer) {
+            result = wrapBuffer(isolate, std::static_pointer_cast<ScriptEngineBuffer>(other));
+            break;
+        } else if (other && other->type == CustomType_Lazy) {
+            const std::shared_ptr<const Value> &lazy = std::static_pointer_cast<ScriptEngineLazy>(other)->value;
+            result = wrapLazy(isolate, lazy, lazy.get());
+            break;
+        }
+        const std::shared_ptr<ScriptEngineCustom> &custom = std::static_pointer_cast<ScriptEngineCustom>(other);
+        if (!custom || custom->object.IsEmpty() || !isMainIsolate(isolate)) {
             result = v8::Undefined(isolate);
         } else {
             result = v8::Local<v8::Object>::New(isolate, custom->object);
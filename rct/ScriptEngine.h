@@ -6,10 +6,12 @@
 #ifdef HAVE_SCRIPTENGINE
 #include <rct/Log.h>
 #include <rct/String.h>
+#include <rct/StringView.h>
 #include <rct/Value.h>
 #include <rct/Hash.h>
 #include <memory>
 
+class Buffer;
 class ObjectPrivate;
 class ClassPrivate;
 struct ScriptEnginePrivate;
@@ -25,6 +27,26 @@ public:
     Value call(const String &function, String *error = 0);
     Value call(const String &function, std::initializer_list<Value> arguments, String *error = 0);
 
+    // Code compiled for what evaluate() runs, by a hash of the source, so
+    // the next process doesn't compile the same scripts again. V8 checks
+    // what it's given and compiles from scratch if it doesn't fit, a cache
+    // from another V8 version isn't loaded at all
+    bool loadCodeCache(const Path &file);
+    bool saveCodeCache(const Path &file) const;
+
+    // Isolates of their own for call() from threads other than the one
+    // that created the engine, so ThreadPool workers can call scripts at
+    // the same time. Each gets the Objects registered under the global
+    // object and the scripts evaluate() has run, as they are when this is
+    // called, compiled from the code cache. A call takes an isolate that's
+    // free or waits for one. Registered functions run on the calling
+    // thread so they have to be thread safe, Class bindings aren't there,
+    // and what such a call returns is plain data, functions come back
+    // undefined. 0, the default, sends every call() to the engine's own
+    // isolate. Not to be called while calls are running
+    void setIsolateCount(int count);
+    int isolateCount() const;
+
     template<typename RetVal>
     RetVal throwException(const Value& exception) {
         throwExceptionInternal(exception);
@@ -161,10 +183,26 @@ public:
     };
 
     Value fromObject(const Object::SharedPtr& object);
+
+    // Bytes that scripts get as a Uint8Array over the Buffer's or the
+    // String's own memory rather than a copy. The value keeps them alive
+    // and so does every array a script makes from it, V8 counts them as
+    // external memory. An array a script hands back comes back as the
+    // same value, other ArrayBuffers and typed arrays are copied once
+    Value fromBuffer(Buffer &&buffer);
+    Value fromBuffer(String &&data);
+    // the bytes of such a value, empty for anything else
+    StringView bufferData(const Value &value) const;
+    // A Map or a List that scripts read through an object converting
+    // only what they touch, the Maps and Lists in it the same way. It's
+    // read only, and a copy of the part a script hands back comes back
+    Value lazyValue(Value &&value);
+
     Object::SharedPtr toObject(const Value &value) const;
     bool isFunction(const Value &value) const;
     Object::SharedPtr globalObject() const { return mGlobalObject; }
 private:
+    Value callInternal(const String &function, const Value *arguments, size_t count, String *error);
     void throwExceptionInternal(const Value &exception);
     static ScriptEngine *sInstance;
     ScriptEnginePrivate *mPrivate;
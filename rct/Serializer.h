@@ -5,11 +5,15 @@
 #include <rct/List.h>
 #include <rct/Log.h>
 #include <rct/Map.h>
+#include <rct/FlatHash.h>
+#include <rct/FlatMap.h>
 #include <rct/Hash.h>
 #include <rct/Path.h>
 #include <rct/Set.h>
 #include <rct/Rct.h>
+#include <rct/StringView.h>
 #include <assert.h>
+#include <memory>
 #include <stdint.h>
 
 class Serializer
@@ -64,6 +68,12 @@ public:
     }
 
     bool hasError() const { return mError; }
+
+    // String::Atoms and Path::Atoms written so far by the index they went
+    // out as. Each one is written in full once, after that as its index,
+    // see StringPool.h
+    enum AtomTable { StringAtoms, PathAtoms };
+    FlatHash<uint32_t, uint32_t> &atoms(AtomTable table) { return mAtoms[table]; }
 private:
     class StringBuffer : public Buffer
     {
@@ -110,6 +120,7 @@ private:
 
     bool mError;
     std::unique_ptr<Buffer> mBuffer;
+    FlatHash<uint32_t, uint32_t> mAtoms[2];
 };
 
 class Deserializer
@@ -123,6 +134,17 @@ public:
         : mData(string.constData()), mLength(string.size()), mPos(0), mFile(0), mKey(key)
     {}
 
+    // keeps storage alive for as long as anyone holds on to storage(), so
+    // StringViews read from it can outlive the deserializer
+    Deserializer(const std::shared_ptr<const String> &storage, const char *key = "")
+        : mData(storage->constData()), mLength(storage->size()), mPos(0), mFile(0), mKey(key), mStorage(storage)
+    {}
+
+    // the same for anything else that owns data, like a MappedFile
+    Deserializer(const char *data, int length, const std::shared_ptr<const void> &storage, const char *key = "")
+        : mData(data), mLength(length), mPos(0), mFile(0), mKey(key), mStorage(storage)
+    {}
+
     Deserializer(FILE *file, const char *key = "")
         : mData(0), mLength(0), mFile(file), mKey(key)
     {
@@ -170,16 +192,43 @@ public:
         return 0;
     }
 
+    // skips len bytes and returns where they are in the input, without
+    // copying. Returns 0 when reading from a FILE
+    const char *take(int len)
+    {
+        if (!mData) {
+            error() << "Can't take" << len << "bytes from a FILE deserializer";
+            return 0;
+        }
+        if (mPos + len > mLength) {
+            error() << "About to die" << mPos << len << mLength << '\n' << Rct::backtrace();
+        }
+        assert(mPos + len <= mLength);
+        const char *ret = mData + mPos;
+        mPos += len;
+        return ret;
+    }
+
     bool atEnd() const { return mPos == mLength; }
+    // reading from a FILE, there's nothing to take()
+    bool isFile() const { return mFile != 0; }
 
     int pos() const { return mFile ? ftell(mFile) : mPos; }
     int length() const { return mFile ? Rct::fileSize(mFile) : mLength; }
+
+    // what StringViews read from here point into, if it was pinned
+    const std::shared_ptr<const void> &storage() const { return mStorage; }
+
+    // atom ids by the index the Serializer wrote them as
+    List<uint32_t> &atoms(Serializer::AtomTable table) { return mAtoms[table]; }
 private:
     const char *mData;
     const int mLength;
     int mPos;
     FILE *mFile;
     const char *mKey;
+    std::shared_ptr<const void> mStorage;
+    List<uint32_t> mAtoms[2];
 };
 
 template <typename T>
@@ -241,6 +290,50 @@ DECLARE_NATIVE_TYPE(time_t);
 DECLARE_NATIVE_TYPE(unsigned long long);
 #endif
 
+// a pair without padding is laid out exactly like its serialized form,
+// first then second, so lists of them can be copied as one block
+template <typename First, typename Second>
+struct FixedSize<std::pair<First, Second> >
+{
+    static constexpr size_t value = (FixedSize<First>::value && FixedSize<Second>::value
+                                     && sizeof(std::pair<First, Second>) == FixedSize<First>::value + FixedSize<Second>::value)
+        ? sizeof(std::pair<First, Second>) : 0;
+};
+
+// Collects fixed size values and hands them to the Serializer a block at a
+// time instead of one Buffer::write() each. Values are copied in native
+// byte order, the same as the per value operators do.
+class SerializerBlock
+{
+public:
+    SerializerBlock(Serializer &serializer)
+        : mSerializer(serializer), mUsed(0)
+    {}
+    ~SerializerBlock() { flush(); }
+
+    template <typename T>
+    void append(const T &t)
+    {
+        if (mUsed + sizeof(T) > sizeof(mBlock))
+            flush();
+        memcpy(mBlock + mUsed, &t, sizeof(T));
+        mUsed += sizeof(T);
+    }
+
+    void flush()
+    {
+        if (mUsed) {
+            mSerializer.write(mBlock, mUsed);
+            mUsed = 0;
+        }
+    }
+
+private:
+    Serializer &mSerializer;
+    size_t mUsed;
+    char mBlock[4096];
+};
+
 template <>
 inline Serializer &operator<<(Serializer &s, const String &string)
 {
@@ -251,6 +344,17 @@ inline Serializer &operator<<(Serializer &s, const String &string)
     return s;
 }
 
+// same format as String so either can be read back as the other
+template <>
+inline Serializer &operator<<(Serializer &s, const StringView &string)
+{
+    const uint32_t size = string.size();
+    s << size;
+    if (size)
+        s.write(string.constData(), size);
+    return s;
+}
+
 template <>
 inline Serializer &operator<<(Serializer &s, const Path &path)
 {
@@ -285,8 +389,35 @@ Serializer &operator<<(Serializer &s, const Map<Key, Value> &map)
 {
     const uint32_t size = map.size();
     s << size;
-    for (typename Map<Key, Value>::const_iterator it = map.begin(); it != map.end(); ++it) {
-        s << it->first << it->second;
+    if (FixedSize<Key>::value && FixedSize<Value>::value) {
+        SerializerBlock block(s);
+        for (typename Map<Key, Value>::const_iterator it = map.begin(); it != map.end(); ++it) {
+            block.append(it->first);
+            block.append(it->second);
+        }
+    } else {
+        for (typename Map<Key, Value>::const_iterator it = map.begin(); it != map.end(); ++it) {
+            s << it->first << it->second;
+        }
+    }
+    return s;
+}
+
+template <typename Key, typename Value, typename Compare>
+Serializer &operator<<(Serializer &s, const FlatMap<Key, Value, Compare> &map)
+{
+    const uint32_t size = map.size();
+    s << size;
+    if (FixedSize<Key>::value && FixedSize<Value>::value) {
+        SerializerBlock block(s);
+        for (const auto &entry : map) {
+            block.append(entry.first);
+            block.append(entry.second);
+        }
+    } else {
+        for (const auto &entry : map) {
+            s << entry.first << entry.second;
+        }
     }
     return s;
 }
@@ -307,8 +438,35 @@ Serializer &operator<<(Serializer &s, const Hash<Key, Value> &map)
 {
     const uint32_t size = map.size();
     s << size;
-    for (typename Hash<Key, Value>::const_iterator it = map.begin(); it != map.end(); ++it) {
-        s << it->first << it->second;
+    if (FixedSize<Key>::value && FixedSize<Value>::value) {
+        SerializerBlock block(s);
+        for (typename Hash<Key, Value>::const_iterator it = map.begin(); it != map.end(); ++it) {
+            block.append(it->first);
+            block.append(it->second);
+        }
+    } else {
+        for (typename Hash<Key, Value>::const_iterator it = map.begin(); it != map.end(); ++it) {
+            s << it->first << it->second;
+        }
+    }
+    return s;
+}
+
+template <typename Key, typename Value, typename HashFn>
+Serializer &operator<<(Serializer &s, const FlatHash<Key, Value, HashFn> &map)
+{
+    const uint32_t size = map.size();
+    s << size;
+    if (FixedSize<Key>::value && FixedSize<Value>::value) {
+        SerializerBlock block(s);
+        for (const auto &entry : map) {
+            block.append(entry.first);
+            block.append(entry.second);
+        }
+    } else {
+        for (const auto &entry : map) {
+            s << entry.first << entry.second;
+        }
     }
     return s;
 }
@@ -326,8 +484,33 @@ Serializer &operator<<(Serializer &s, const Set<T> &set)
 {
     const uint32_t size = set.size();
     s << size;
-    for (typename Set<T>::const_iterator it = set.begin(); it != set.end(); ++it) {
-        s << *it;
+    if (FixedSize<T>::value) {
+        SerializerBlock block(s);
+        for (typename Set<T>::const_iterator it = set.begin(); it != set.end(); ++it) {
+            block.append(*it);
+        }
+    } else {
+        for (typename Set<T>::const_iterator it = set.begin(); it != set.end(); ++it) {
+            s << *it;
+        }
+    }
+    return s;
+}
+
+template <typename T, typename HashFn>
+Serializer &operator<<(Serializer &s, const FlatSet<T, HashFn> &set)
+{
+    const uint32_t size = set.size();
+    s << size;
+    if (FixedSize<T>::value) {
+        SerializerBlock block(s);
+        for (const T &t : set) {
+            block.append(t);
+        }
+    } else {
+        for (const T &t : set) {
+            s << t;
+        }
     }
     return s;
 }
@@ -341,14 +524,36 @@ Deserializer &operator>>(Deserializer &s, Map<Key, Value> &map)
     if (size) {
         Key key;
         Value value;
+        // written in order, so each one goes at the end
         for (uint32_t i=0; i<size; ++i) {
             s >> key >> value;
-            map[key] = std::move(value);
+            static_cast<std::map<Key, Value> &>(map).insert(map.end(), std::make_pair(key, std::move(value)));
         }
     }
     return s;
 }
 
+// written in order, so they go straight into the array without sorting
+template <typename Key, typename Value, typename Compare>
+Deserializer &operator>>(Deserializer &s, FlatMap<Key, Value, Compare> &map)
+{
+    uint32_t size;
+    s >> size;
+    // a corrupt count doesn't get to reserve more than the input could
+    // hold, every entry takes at least a byte
+    const size_t entrySize = std::max<size_t>(FixedSize<Key>::value + FixedSize<Value>::value, 1);
+    const size_t left = std::max(s.length() - s.pos(), 0);
+    List<std::pair<Key, Value> > entries;
+    entries.reserve(std::min<size_t>(size, left / entrySize));
+    std::pair<Key, Value> entry;
+    for (uint32_t i=0; i<size; ++i) {
+        s >> entry.first >> entry.second;
+        entries.append(std::move(entry));
+    }
+    map.assign(std::move(entries));
+    return s;
+}
+
 template <typename Key, typename Value>
 Deserializer &operator>>(Deserializer &s, std::multimap<Key, Value> &map)
 {
@@ -359,7 +564,7 @@ Deserializer &operator>>(Deserializer &s, std::multimap<Key, Value> &map)
         std::pair<Key, Value> pair;
         for (uint32_t i=0; i<size; ++i) {
             s >> pair.first >> pair.second;
-            map.insert(pair);
+            map.insert(map.end(), pair);
         }
     }
     return s;
@@ -372,11 +577,30 @@ Deserializer &operator>>(Deserializer &s, Hash<Key, Value> &map)
     s >> size;
     map.clear();
     if (size) {
+        map.reserve(size);
+        Key key;
+        Value value;
+        for (uint32_t i=0; i<size; ++i) {
+            s >> key >> value;
+            map[key] = std::move(value);
+        }
+    }
+    return s;
+}
+
+template <typename Key, typename Value, typename HashFn>
+Deserializer &operator>>(Deserializer &s, FlatHash<Key, Value, HashFn> &map)
+{
+    uint32_t size;
+    s >> size;
+    map.clear();
+    if (size) {
+        map.reserve(size);
         Key key;
         Value value;
         for (uint32_t i=0; i<size; ++i) {
             s >> key >> value;
-            map[key] = value;
+            map[key] = std::move(value);
         }
     }
     return s;
@@ -408,6 +632,24 @@ Deserializer &operator>>(Deserializer &s, Set<T> &set)
     uint32_t size;
     s >> size;
     if (size) {
+        T t;
+        // written in order, so each one goes at the end
+        for (uint32_t i=0; i<size; ++i) {
+            s >> t;
+            static_cast<std::set<T> &>(set).insert(set.end(), std::move(t));
+        }
+    }
+    return s;
+}
+
+template <typename T, typename HashFn>
+Deserializer &operator>>(Deserializer &s, FlatSet<T, HashFn> &set)
+{
+    set.clear();
+    uint32_t size;
+    s >> size;
+    if (size) {
+        set.reserve(size);
         T t;
         for (uint32_t i=0; i<size; ++i) {
             s >> t;
@@ -429,6 +671,18 @@ inline Deserializer &operator>>(Deserializer &s, String &string)
     return s;
 }
 
+// points into the deserializer's input rather than copying, the input has
+// to stay around for as long as the view is used. See Deserializer::storage()
+template <>
+inline Deserializer &operator>>(Deserializer &s, StringView &string)
+{
+    uint32_t size;
+    s >> size;
+    const char *data = size ? s.take(size) : 0;
+    string = data ? StringView(data, size) : StringView();
+    return s;
+}
+
 template <typename First, typename Second>
 Deserializer &operator>>(Deserializer &s, std::pair<First, Second> &pair)
 {
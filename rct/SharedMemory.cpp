@@ -95,3 +95,11 @@ void SharedMemory::cleanup()
     if (mShm != -1 && mOwner)
         shmctl(mShm, IPC_RMID, 0);
 }
+
+void SharedMemory::remove()
+{
+    if (mShm != -1 && mOwner) {
+        shmctl(mShm, IPC_RMID, 0);
+        mOwner = false;
+    }
+}
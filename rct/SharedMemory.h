@@ -23,6 +23,10 @@ public:
     int size() const { return mSize; }
 
     void cleanup();
+    // Marks a segment we created for removal once every process has
+    // detached, it can't be attached to anymore after this. Keeps it from
+    // outliving us if we never get to cleanup()
+    void remove();
 private:
     bool init(key_t key, int size, CreateMode mode);
 
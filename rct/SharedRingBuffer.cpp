@@ -0,0 +1,339 @@
+#include "SharedRingBuffer.h"
+#include "rct-config.h"
+#include "Log.h"
+#include "Rct.h"
+#include <atomic>
+#include <climits>
+#include <errno.h>
+#include <new>
+#include <signal.h>
+#include <string.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <unistd.h>
+#ifdef OS_Linux
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <time.h>
+#endif
+#ifdef HAVE_EVENTFD
+#include <sys/eventfd.h>
+#endif
+
+// at the start of the segment, the records follow at HeaderSize
+struct SharedRingBuffer::Header
+{
+    enum { Magic = 0x72637262 };
+
+    uint32_t magic;
+    uint32_t capacity;
+    uint32_t mode;
+    int32_t owner;
+    // producers reserve from here
+    alignas(64) std::atomic<uint64_t> head;
+    // everything before this has been read
+    alignas(64) std::atomic<uint64_t> tail;
+    // the consumer found it empty, the next write wakes it
+    alignas(64) std::atomic<uint32_t> waiting;
+    // the futex, bumped for each wakeup
+    std::atomic<uint32_t> wakeups;
+};
+
+// Records are 8 byte aligned and never wrap, one that doesn't fit at the
+// end goes to the start and a padding record takes up the end. The space
+// is zeroed as it's read so a reserved record reads as incomplete until its
+// producer marks it Complete.
+struct SharedRingBuffer::Record
+{
+    enum { Complete = 0x1, Padding = 0x2 };
+
+    std::atomic<uint32_t> state;
+    // of the data, or of the whole record for padding
+    uint32_t size;
+
+    char *data() { return reinterpret_cast<char *>(this + 1); }
+};
+
+static inline uint32_t recordSpan(uint32_t size)
+{
+    return (sizeof(uint64_t) + size + 7) & ~7u;
+}
+
+static inline uint32_t roundUp(uint32_t capacity)
+{
+    uint32_t ret = 64;
+    while (ret < capacity)
+        ret <<= 1;
+    return ret;
+}
+
+static inline bool isAlive(pid_t pid)
+{
+    return pid > 0 && (!kill(pid, 0) || errno != ESRCH);
+}
+
+#ifdef OS_Linux
+static inline void futexWait(std::atomic<uint32_t> *word, uint32_t value, int timeout)
+{
+    timespec ts;
+    if (timeout >= 0) {
+        ts.tv_sec = timeout / 1000;
+        ts.tv_nsec = (timeout % 1000) * 1000000;
+    }
+    // not FUTEX_PRIVATE_FLAG, the other side is in another process
+    ::syscall(SYS_futex, reinterpret_cast<uint32_t *>(word), FUTEX_WAIT, value, timeout >= 0 ? &ts : 0, 0, 0);
+}
+
+static inline void futexWake(std::atomic<uint32_t> *word)
+{
+    ::syscall(SYS_futex, reinterpret_cast<uint32_t *>(word), FUTEX_WAKE, INT_MAX, 0, 0, 0);
+}
+#endif
+
+SharedRingBuffer::SharedRingBuffer(key_t key, unsigned int capacity, Mode mode)
+    : mHeader(0), mData(0), mMask(0), mMode(mode), mNotifyFd(-1)
+{
+    const uint32_t size = roundUp(capacity);
+    mShm.reset(new SharedMemory(key, HeaderSize + size, SharedMemory::Create));
+    if (!mShm->isValid() && cleanup(key))
+        mShm.reset(new SharedMemory(key, HeaderSize + size, SharedMemory::Create));
+    void *address = mShm->isValid() ? mShm->attach(SharedMemory::ReadWrite) : 0;
+    if (!address) {
+        error("SharedRingBuffer: can't create a ring of %u bytes for %d", size, key);
+        return;
+    }
+    // a new segment is all zeroes
+    Header *header = new (address) Header;
+    header->capacity = size;
+    header->mode = mode;
+    header->owner = getpid();
+    header->head.store(0, std::memory_order_relaxed);
+    header->tail.store(0, std::memory_order_relaxed);
+    header->waiting.store(0, std::memory_order_relaxed);
+    header->wakeups.store(0, std::memory_order_relaxed);
+    // last, those who attach check it
+    std::atomic_thread_fence(std::memory_order_release);
+    header->magic = Header::Magic;
+    init();
+}
+
+SharedRingBuffer::SharedRingBuffer(key_t key)
+    : mHeader(0), mData(0), mMask(0), mMode(SingleProducer), mNotifyFd(-1)
+{
+    mShm.reset(new SharedMemory(key, HeaderSize));
+    if (!mShm->isValid() || !mShm->attach(SharedMemory::ReadWrite) || !init())
+        error("SharedRingBuffer: can't attach to %d", key);
+}
+
+SharedRingBuffer::~SharedRingBuffer()
+{
+    if (mNotifyFd != -1)
+        ::close(mNotifyFd);
+}
+
+bool SharedRingBuffer::init()
+{
+    static_assert(sizeof(Header) <= HeaderSize, "SharedRingBuffer header too big");
+    Header *header = static_cast<Header *>(mShm->address());
+    if (header->magic != Header::Magic)
+        return false;
+    std::atomic_thread_fence(std::memory_order_acquire);
+    shmid_ds ds;
+    const int id = shmget(mShm->key(), 0, 0);
+    if (id == -1 || shmctl(id, IPC_STAT, &ds) || ds.shm_segsz < HeaderSize + static_cast<size_t>(header->capacity)) {
+        error("SharedRingBuffer: %d is too small for its ring", mShm->key());
+        return false;
+    }
+    mHeader = header;
+    mData = static_cast<char *>(mShm->address()) + HeaderSize;
+    mMask = header->capacity - 1;
+    mMode = static_cast<Mode>(header->mode);
+    return true;
+}
+
+uint32_t SharedRingBuffer::maxRecordSize() const
+{
+    // so that padding to get to the start and the record itself always fit
+    // once the ring is empty, wherever the head is
+    return mHeader ? (mMask + 1) / 2 - sizeof(Record) : 0;
+}
+
+SharedRingBuffer::Record *SharedRingBuffer::recordAt(uint64_t pos) const
+{
+    return reinterpret_cast<Record *>(mData + (pos & mMask));
+}
+
+bool SharedRingBuffer::write(const void *data, uint32_t size)
+{
+    if (!mHeader || size > maxRecordSize())
+        return false;
+    const uint32_t capacity = mMask + 1;
+    const uint32_t span = recordSpan(size);
+    uint64_t pos = mHeader->head.load(std::memory_order_relaxed);
+    uint32_t padding;
+    for (;;) {
+        const uint32_t offset = pos & mMask;
+        padding = capacity - offset < span ? capacity - offset : 0;
+        if (pos + padding + span - mHeader->tail.load(std::memory_order_acquire) > capacity)
+            return false;
+        if (mMode == SingleProducer) {
+            mHeader->head.store(pos + padding + span, std::memory_order_relaxed);
+            break;
+        }
+        if (mHeader->head.compare_exchange_weak(pos, pos + padding + span, std::memory_order_relaxed))
+            break;
+    }
+    if (padding) {
+        Record *record = recordAt(pos);
+        record->size = padding;
+        record->state.store(Record::Complete | Record::Padding, std::memory_order_release);
+    }
+    Record *record = recordAt(pos + padding);
+    record->size = size;
+    memcpy(record->data(), data, size);
+    record->state.store(Record::Complete, std::memory_order_release);
+    wake();
+    return true;
+}
+
+void SharedRingBuffer::wake()
+{
+    // against the consumer's store to waiting and load of the state
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (!mHeader->waiting.load(std::memory_order_relaxed) || !mHeader->waiting.exchange(0))
+        return;
+    mHeader->wakeups.fetch_add(1, std::memory_order_release);
+#ifdef OS_Linux
+    futexWake(&mHeader->wakeups);
+#endif
+    if (mNotifyFd != -1) {
+#ifdef HAVE_EVENTFD
+        const uint64_t one = 1;
+        ssize_t w;
+        eintrwrap(w, ::write(mNotifyFd, &one, sizeof(one)));
+        (void)w;
+#endif
+    }
+}
+
+bool SharedRingBuffer::isEmpty() const
+{
+    if (!mHeader)
+        return true;
+    const uint64_t pos = mHeader->tail.load(std::memory_order_relaxed);
+    return !(recordAt(pos)->state.load(std::memory_order_acquire) & Record::Complete);
+}
+
+int SharedRingBuffer::read(const Reader &reader, int max)
+{
+    if (!mHeader)
+        return 0;
+    if (mNotifyFd != -1) {
+        uint64_t count;
+        ssize_t r;
+        eintrwrap(r, ::read(mNotifyFd, &count, sizeof(count)));
+        (void)r;
+    }
+    uint64_t pos = mHeader->tail.load(std::memory_order_relaxed);
+    int ret = 0;
+    while (max == -1 || ret < max) {
+        Record *record = recordAt(pos);
+        const uint32_t state = record->state.load(std::memory_order_acquire);
+        if (!(state & Record::Complete)) {
+            // empty, or the next one isn't done yet. Say so and look
+            // again, a producer that missed it will see it
+            mHeader->waiting.store(1, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (!(record->state.load(std::memory_order_acquire) & Record::Complete))
+                break;
+            mHeader->waiting.store(0, std::memory_order_relaxed);
+            continue;
+        }
+        const uint32_t span = state & Record::Padding ? record->size : recordSpan(record->size);
+        if (!(state & Record::Padding)) {
+            reader(record->data(), record->size);
+            ++ret;
+        }
+        memset(record->data(), 0, span - sizeof(Record));
+        record->size = 0;
+        record->state.store(0, std::memory_order_relaxed);
+        pos += span;
+        mHeader->tail.store(pos, std::memory_order_release);
+    }
+    return ret;
+}
+
+bool SharedRingBuffer::read(String &data)
+{
+    return read([&data](const char *record, uint32_t size) { data.assign(record, size); }, 1) == 1;
+}
+
+bool SharedRingBuffer::wait(int timeout)
+{
+    if (!mHeader)
+        return false;
+    const uint64_t deadline = timeout > 0 ? Rct::monoMs() + timeout : 0;
+    for (;;) {
+        const uint32_t wakeups = mHeader->wakeups.load(std::memory_order_acquire);
+        mHeader->waiting.store(1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (!isEmpty())
+            return true;
+        int left = -1;
+        if (timeout == 0) {
+            return false;
+        } else if (deadline) {
+            const uint64_t now = Rct::monoMs();
+            if (now >= deadline)
+                return false;
+            left = static_cast<int>(deadline - now);
+        }
+#ifdef OS_Linux
+        futexWait(&mHeader->wakeups, wakeups, left);
+#else
+        (void)wakeups;
+        (void)left;
+        usleep(1000);
+#endif
+    }
+}
+
+int SharedRingBuffer::notifyFd()
+{
+#ifdef HAVE_EVENTFD
+    if (mNotifyFd == -1 && mHeader) {
+        mNotifyFd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (mNotifyFd == -1) {
+            error() << "Couldn't create eventfd for SharedRingBuffer" << Rct::strerror();
+            return -1;
+        }
+        // whatever's there already
+        mHeader->waiting.store(1);
+        if (!isEmpty())
+            wake();
+    }
+#endif
+    return mNotifyFd;
+}
+
+void SharedRingBuffer::setNotifyFd(int fd)
+{
+    if (mNotifyFd != -1)
+        ::close(mNotifyFd);
+    mNotifyFd = fd;
+}
+
+bool SharedRingBuffer::cleanup(key_t key)
+{
+    const int id = shmget(key, 0, 0);
+    if (id == -1)
+        return false;
+    void *address = shmat(id, 0, SHM_RDONLY);
+    if (address == reinterpret_cast<void *>(-1))
+        return false;
+    const Header *header = static_cast<const Header *>(address);
+    // not one of ours, or one that's still being set up
+    const bool stale = header->magic == Header::Magic && !isAlive(header->owner);
+    shmdt(address);
+    return stale && !shmctl(id, IPC_RMID, 0);
+}
@@ -0,0 +1,90 @@
+#ifndef SharedRingBuffer_h
+#define SharedRingBuffer_h
+
+#include <rct/SharedMemory.h>
+#include <rct/String.h>
+#include <functional>
+#include <memory>
+#include <stdint.h>
+#include <sys/types.h>
+
+// Variable length records from one process, or many, to another through a
+// SharedMemory ring, without locks or syscalls while the consumer keeps up.
+// The head producers reserve at and the tail the consumer frees up to are
+// on cache lines of their own. There's one consumer, and one producer too
+// unless the ring is MultiProducer, where producers reserve their space
+// with a compare and swap and each record says when it's complete.
+//
+// The consumer waits with wait(), on a futex in the ring, or from an
+// EventLoop with notifyFd(). Producers only make a syscall to wake it
+// when it has said it's waiting, which it does once it has found the ring
+// empty.
+//
+// The process that creates a ring removes it when it's done. One left
+// behind by a process that died is taken care of by cleanup(), which the
+// constructor that creates rings calls when the key is taken.
+class SharedRingBuffer
+{
+public:
+    enum Mode { SingleProducer, MultiProducer };
+    enum { HeaderSize = 256 };
+
+    // a new ring of capacity bytes, rounded up to a power of two
+    SharedRingBuffer(key_t key, unsigned int capacity, Mode mode = SingleProducer);
+    // an existing ring
+    SharedRingBuffer(key_t key);
+    ~SharedRingBuffer();
+
+    SharedRingBuffer(const SharedRingBuffer &) = delete;
+    SharedRingBuffer &operator=(const SharedRingBuffer &) = delete;
+
+    bool isValid() const { return mHeader != 0; }
+    key_t key() const { return mShm ? mShm->key() : -1; }
+    unsigned int capacity() const { return mMask + 1; }
+    Mode mode() const { return mMode; }
+    // the biggest record there's always room for once the ring is empty
+    uint32_t maxRecordSize() const;
+
+    // Producers. false if there isn't room for it right now, or if it's
+    // bigger than maxRecordSize()
+    bool write(const void *data, uint32_t size);
+    bool write(const String &data) { return write(data.constData(), data.size()); }
+
+    // The consumer. reader gets up to max records in turn, -1 for all there
+    // are, each only good until it returns. Returns how many it got
+    typedef std::function<void(const char *data, uint32_t size)> Reader;
+    int read(const Reader &reader, int max = -1);
+    bool read(String &data);
+    bool isEmpty() const;
+    // until there's something to read, timeout in ms, -1 waits for ever.
+    // false if there still isn't anything
+    bool wait(int timeout = -1);
+    // Linux. An eventfd that's readable while there's something to read,
+    // for EventLoop::registerSocket(), read() resets it. Producers in this
+    // process get a dup() of it with setNotifyFd(), others with
+    // Connection::sendDescriptors()
+    int notifyFd();
+    // producers, takes fd
+    void setNotifyFd(int fd);
+
+    // Removes the ring under key if the process that created it is gone,
+    // true if it did. Those still attached keep it until they detach
+    static bool cleanup(key_t key);
+
+private:
+    struct Header;
+    struct Record;
+
+    bool init();
+    Record *recordAt(uint64_t pos) const;
+    void wake();
+
+    std::unique_ptr<SharedMemory> mShm;
+    Header *mHeader;
+    char *mData;
+    uint32_t mMask;
+    Mode mMode;
+    int mNotifyFd;
+};
+
+#endif
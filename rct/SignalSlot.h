@@ -1,8 +1,10 @@
 #ifndef SIGNALSLOT_H
 #define SIGNALSLOT_H
 
-#include <map>
+#include <atomic>
+#include <memory>
 #include <mutex>
+#include <vector>
 #include <assert.h>
 #include "EventLoop.h"
 
@@ -12,23 +14,19 @@ class Signal
 public:
     typedef unsigned int Key;
 
-    Signal() : id(0) { }
+    Signal() : id(0), count(0) { }
     ~Signal() { }
 
     template<typename Call>
     Key connect(Call&& call)
     {
-        std::lock_guard<std::mutex> locker(mutex);
-        connections.insert(std::make_pair(++id, std::forward<Call>(call)));
-        return id;
+        return add(Signature(std::forward<Call>(call)));
     }
 
     template<size_t Value, typename Call, typename std::enable_if<Value == EventLoop::Async, int>::type = 0>
     Key connect(Call&& call)
     {
-        std::lock_guard<std::mutex> locker(mutex);
-        connections.insert(std::make_pair(++id, SignatureWrapper(std::forward<Call>(call))));
-        return id;
+        return add(SignatureWrapper(std::forward<Call>(call)));
     }
 
     // this connection type will std::move all the call arguments so if this type is used
@@ -36,36 +34,61 @@ public:
     template<size_t Value, typename Call, typename std::enable_if<Value == EventLoop::Move, int>::type = 0>
     Key connect(Call&& call)
     {
-        std::lock_guard<std::mutex> locker(mutex);
-        assert(connections.empty());
-        connections.insert(std::make_pair(++id, SignatureMoveWrapper(std::forward<Call>(call))));
-        return id;
+        assert(!count.load());
+        return add(SignatureMoveWrapper(std::forward<Call>(call)));
+    }
+
+    // Batched and Coalesced keep the arguments of each emission by value
+    // and post at most one event until the loop has run it, so a thread
+    // emitting in a loop costs the receiving loop one wakeup instead of one
+    // per emission
+    template<size_t Value, typename Call, typename std::enable_if<Value == EventLoop::Batched || Value == EventLoop::Coalesced, int>::type = 0>
+    Key connect(Call&& call)
+    {
+        return add(SignatureQueueWrapper(std::forward<Call>(call), Value == EventLoop::Coalesced));
     }
 
     bool disconnect(Key key)
     {
         std::lock_guard<std::mutex> locker(mutex);
-        return connections.erase(key) == 1;
+        if (!connections)
+            return false;
+        for (size_t i = 0; i < connections->size(); ++i) {
+            if ((*connections)[i].first == key) {
+                std::shared_ptr<Connections> conn = std::make_shared<Connections>();
+                conn->reserve(connections->size() - 1);
+                conn->insert(conn->end(), connections->begin(), connections->begin() + i);
+                conn->insert(conn->end(), connections->begin() + i + 1, connections->end());
+                replace(conn);
+                return true;
+            }
+        }
+        return false;
     }
 
     int disconnect()
     {
         std::lock_guard<std::mutex> locker(mutex);
-        const int ret = connections.size();
-        connections.clear();
+        const int ret = count.load();
+        replace(std::shared_ptr<Connections>());
         return ret;
     }
 
+    // doesn't take the lock
+    bool isConnected() const { return count.load(std::memory_order_acquire) > 0; }
+
     // ignore result_type for now
     template<typename... Args>
     void operator()(Args&&... args)
     {
-        std::map<Key, Signature> conn;
-        {
-            std::lock_guard<std::mutex> locker(mutex);
-            conn = connections;
+        std::shared_ptr<const Connections> conn;
+        if (!snapshot(conn))
+            return;
+        if (conn->size() == 1) {
+            conn->front().second(std::forward<Args>(args)...);
+            return;
         }
-        for (auto& connection : conn) {
+        for (const auto& connection : *conn) {
             connection.second(std::forward<Args>(args)...);
         }
     }
@@ -73,12 +96,14 @@ public:
     template<typename... Args>
     void operator()(const Args&... args)
     {
-        std::map<Key, Signature> conn;
-        {
-            std::lock_guard<std::mutex> locker(mutex);
-            conn = connections;
+        std::shared_ptr<const Connections> conn;
+        if (!snapshot(conn))
+            return;
+        if (conn->size() == 1) {
+            conn->front().second(args...);
+            return;
         }
-        for (auto& connection : conn) {
+        for (const auto& connection : *conn) {
             connection.second(std::forward<const Args &>(args)...);
         }
     }
@@ -86,17 +111,55 @@ public:
     template<typename... Args>
     void operator()()
     {
-        std::map<Key, Signature> conn;
-        {
-            std::lock_guard<std::mutex> locker(mutex);
-            conn = connections;
-        }
-        for (auto& connection : conn) {
+        std::shared_ptr<const Connections> conn;
+        if (!snapshot(conn))
+            return;
+        for (const auto& connection : *conn) {
             connection.second();
         }
     }
 
 private:
+    // Never modified once published, connect() and disconnect() swap in a
+    // new list. Emitting only takes a reference to the current one so it
+    // doesn't copy any slots, and slots may connect and disconnect, even
+    // themselves, while being called
+    typedef std::vector<std::pair<Key, Signature> > Connections;
+
+    Key add(Signature&& call)
+    {
+        std::lock_guard<std::mutex> locker(mutex);
+        std::shared_ptr<Connections> conn = std::make_shared<Connections>();
+        if (connections) {
+            conn->reserve(connections->size() + 1);
+            *conn = *connections;
+        }
+        conn->push_back(std::make_pair(++id, std::move(call)));
+        replace(conn);
+        return id;
+    }
+
+    // needs the mutex
+    void replace(const std::shared_ptr<Connections>& conn)
+    {
+        if (conn && conn->empty()) {
+            connections.reset();
+        } else {
+            connections = conn;
+        }
+        count.store(connections ? connections->size() : 0, std::memory_order_release);
+    }
+
+    // nothing connected, the common case for most signals, doesn't take the lock
+    bool snapshot(std::shared_ptr<const Connections>& conn)
+    {
+        if (!count.load(std::memory_order_acquire))
+            return false;
+        std::lock_guard<std::mutex> locker(mutex);
+        conn = connections;
+        return conn.get() != 0;
+    }
+
     class SignatureWrapper
     {
     public:
@@ -139,10 +202,82 @@ private:
         Signature call;
     };
 
+    template<typename T>
+    struct Arguments;
+    template<typename R, typename... Args>
+    struct Arguments<std::function<R(Args...)> >
+    {
+        typedef std::tuple<typename std::decay<Args>::type...> Tuple;
+    };
+
+    class SignatureQueueWrapper
+    {
+    public:
+        typedef typename Arguments<Signature>::Tuple Tuple;
+
+        SignatureQueueWrapper(Signature&& signature, bool coalesce)
+            : loop(EventLoop::eventLoop()), queue(std::make_shared<Queue>(std::move(signature), coalesce))
+        {
+        }
+
+        template<typename... Args>
+        void operator()(Args&&... args)
+        {
+            EventLoop::SharedPtr l;
+            if (!(l = loop.lock()))
+                return;
+            {
+                std::lock_guard<std::mutex> locker(queue->mutex);
+                if (queue->coalesce)
+                    queue->pending.clear();
+                queue->pending.emplace_back(std::forward<Args>(args)...);
+                if (queue->posted)
+                    return;
+                queue->posted = true;
+            }
+            const std::shared_ptr<Queue> q = queue;
+            l->callLater([q]() { q->deliver(); });
+        }
+
+    private:
+        struct Queue
+        {
+            Queue(Signature&& c, bool co)
+                : call(std::move(c)), coalesce(co), posted(false)
+            {
+            }
+
+            // on the loop. The two lists trade places so neither has to
+            // allocate once they've grown
+            void deliver()
+            {
+                {
+                    std::lock_guard<std::mutex> locker(mutex);
+                    std::swap(pending, delivering);
+                    posted = false;
+                }
+                for (Tuple& args : delivering) {
+                    applyMove(call, args);
+                }
+                delivering.clear();
+            }
+
+            Signature call;
+            const bool coalesce;
+            std::mutex mutex;
+            bool posted;
+            std::vector<Tuple> pending, delivering;
+        };
+
+        EventLoop::WeakPtr loop;
+        std::shared_ptr<Queue> queue;
+    };
+
 private:
     Key id;
     std::mutex mutex;
-    std::map<Key, Signature> connections;
+    std::shared_ptr<const Connections> connections;
+    std::atomic<int> count;
 };
 
 #endif
@@ -1,7 +1,11 @@
 #include "SocketClient.h"
 #include "Rct.h"
 #include "EventLoop.h"
+#include "HostResolver.h"
+#include "IoStats.h"
 #include "Log.h"
+#include "Timer.h"
+#include "TlsContext.h"
 #include <assert.h>
 #include <unistd.h>
 #include <fcntl.h>
@@ -9,26 +13,213 @@
 #include <stdio.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 #include <sys/un.h>
 #include <sys/select.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <netdb.h>
+#include <openssl/err.h>
+#include <openssl/ssl.h>
 #include <rct-config.h>
+#if defined(HAVE_UDP_GRO) || defined(HAVE_UDP_SEGMENT)
+#include <netinet/udp.h>
+#endif
+#ifdef HAVE_SENDFILE
+#include <sys/sendfile.h>
+#endif
+#include <algorithm>
+#include <atomic>
+#include <vector>
 
 #define eintrwrap(VAR, BLOCK)                   \
     do {                                        \
         VAR = BLOCK;                            \
     } while (VAR == -1 && errno == EINTR)
 
+// bytes queued by all clients, for the write budget
+static std::atomic<size_t> totalQueued(0);
+static std::atomic<size_t> writeBudgetLimit(0);
+
+// a connect() to a host name, in progress
+struct SocketClient::Connector
+{
+    Connector()
+        : next(0), timer(-1)
+    {}
+
+    struct Attempt
+    {
+        int fd;
+        int family;
+    };
+
+    uint16_t port;
+    // alternating between the families, next is the one to try after the
+    // attempts running now
+    List<HostResolver::Address> addresses;
+    int next;
+    List<Attempt> attempts;
+    int timer;
+};
+
+#ifndef HAVE_RECVMMSG
+// what recvmmsg() and sendmmsg() take, we go one message at a time
+// without them
+struct mmsghdr
+{
+    msghdr msg_hdr;
+    unsigned int msg_len;
+};
+#endif
+
+// receive side of setReadBatch(), one slot per datagram
+struct SocketClient::ReadBatch
+{
+    unsigned int count, datagramSize;
+    bool gro;
+    std::vector<unsigned char> slab;
+    std::vector<mmsghdr> headers;
+    std::vector<iovec> iovecs;
+    std::vector<HostResolver::Address> addresses;
+    // cmsg space per slot, for the GRO segment size
+    std::vector<char> control;
+    size_t controlSize;
+    // what's emitted, more than count when GRO coalesced some
+    std::vector<Datagram> datagrams;
+};
+
+static int receiveMessages(int fd, mmsghdr* messages, unsigned int count)
+{
+    int e;
+#ifdef HAVE_RECVMMSG
+    eintrwrap(e, ::recvmmsg(fd, messages, count, 0, 0));
+    return e;
+#else
+    unsigned int i;
+    for (i = 0; i < count; ++i) {
+        eintrwrap(e, ::recvmsg(fd, &messages[i].msg_hdr, 0));
+        if (e == -1) {
+            if (i)
+                break;
+            return -1;
+        }
+        messages[i].msg_len = e;
+    }
+    return i;
+#endif
+}
+
+static int sendMessages(int fd, mmsghdr* messages, unsigned int count)
+{
+#ifdef HAVE_NOSIGNAL
+    const int sendFlags = MSG_NOSIGNAL;
+#else
+    const int sendFlags = 0;
+#endif
+    int e;
+#ifdef HAVE_SENDMMSG
+    eintrwrap(e, ::sendmmsg(fd, messages, count, sendFlags));
+    return e;
+#else
+    unsigned int i;
+    for (i = 0; i < count; ++i) {
+        eintrwrap(e, ::sendmsg(fd, &messages[i].msg_hdr, sendFlags));
+        if (e == -1) {
+            if (i)
+                break;
+            return -1;
+        }
+        messages[i].msg_len = e;
+    }
+    return i;
+#endif
+}
+
+// sendfile() where there is one, -1 with ENOSYS where not
+static int sendFileData(int fd, int file, uint64_t offset, unsigned int size)
+{
+#ifdef HAVE_SENDFILE
+    off_t off = offset;
+    int e;
+    eintrwrap(e, ::sendfile(fd, file, &off, size));
+    return e;
+#else
+    (void)fd;
+    (void)file;
+    (void)offset;
+    (void)size;
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+// the TLS connection of a socket, see startTls()
+struct SocketClient::Tls
+{
+    Tls()
+        : ssl(0), kernelSend(false), readWantsWrite(false)
+    {}
+    ~Tls()
+    {
+        if (ssl)
+            SSL_free(ssl);
+    }
+
+    std::shared_ptr<TlsContext> context;
+    String serverName;
+    // what the client's sessions are stored by
+    String sessionKey;
+    SSL* ssl;
+    // kTLS is doing the encryption for writes
+    bool kernelSend;
+    // SSL_read() has to write before it can go on, a key update or
+    // renegotiation. Reading resumes once the socket is writable
+    bool readWantsWrite;
+};
+
+// an open file being sent, see sendFile()
+struct SocketClient::FileSource
+{
+    FileSource(int f)
+        : fd(f)
+    {}
+    ~FileSource()
+    {
+        ::close(fd);
+    }
+
+    const int fd;
+};
+
+// our copies of the fds being passed, see writeDescriptors()
+struct SocketClient::Descriptors
+{
+    ~Descriptors()
+    {
+        for (int f : fds)
+            ::close(f);
+    }
+
+    std::vector<int> fds;
+};
+
 SocketClient::SocketClient(unsigned int mode)
-    : fd(-1), socketPort(0), socketState(Disconnected), socketMode(None), wMode(Asynchronous), writeWait(false)
+    : fd(-1), socketPort(0), socketState(Disconnected), socketMode(None), wMode(Asynchronous), writeWait(false), corked(false),
+      readSuspended(false), writeIsBlocked(false), highMark(0), lowMark(0), queuedBytes(0), queuedMemory(0),
+      readChunk(MinReadChunk), maxRead(DefaultReadBudget), readBuffer(MemoryMonitor::SocketReadBuffers, Buffer::Pooled),
+      readWaiter(0), readWaiterData(0), handshaking(false)
 {
     blocking = (mode & Blocking);
 }
 
 SocketClient::SocketClient(int f, unsigned int mode)
-    : fd(f), socketPort(0), socketState(Connected), socketMode(mode), wMode(Asynchronous), writeWait(false)
+    : fd(f), socketPort(0), socketState(Connected), socketMode(mode), wMode(Asynchronous), writeWait(false), corked(false),
+      readSuspended(false), writeIsBlocked(false), highMark(0), lowMark(0), queuedBytes(0), queuedMemory(0),
+      readChunk(MinReadChunk), maxRead(DefaultReadBudget), readBuffer(MemoryMonitor::SocketReadBuffers, Buffer::Pooled),
+      readWaiter(0), readWaiterData(0), handshaking(false)
 {
     assert(fd >= 0);
 #ifdef HAVE_NOSIGPIPE
@@ -36,7 +227,8 @@ SocketClient::SocketClient(int f, unsigned int mode)
     ::setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, (void *)&flags, sizeof(int));
 #endif
 #ifdef HAVE_CLOEXEC
-    setFlags(fd, FD_CLOEXEC, F_GETFD, F_SETFD);
+    if (!(mode & FlagsSet))
+        setFlags(fd, FD_CLOEXEC, F_GETFD, F_SETFD);
 #endif
     blocking = (mode & Blocking);
 
@@ -44,7 +236,7 @@ SocketClient::SocketClient(int f, unsigned int mode)
         if (EventLoop::SharedPtr loop = EventLoop::eventLoop()) {
             loop->registerSocket(fd, EventLoop::SocketRead,
                                  std::bind(&SocketClient::socketCallback, this, std::placeholders::_1, std::placeholders::_2));
-            if (!setFlags(fd, O_NONBLOCK, F_GETFL, F_SETFL)) {
+            if (!(mode & FlagsSet) && !setFlags(fd, O_NONBLOCK, F_GETFL, F_SETFL)) {
                 signalError(shared_from_this(), InitializeError);
                 close();
                 return;
@@ -60,166 +252,488 @@ SocketClient::~SocketClient()
 
 void SocketClient::close()
 {
-    if (fd == -1)
+    reset(true);
+}
+
+int SocketClient::takeFD()
+{
+    const int f = fd;
+    reset(false);
+    return f;
+}
+
+void SocketClient::reset(bool closeSocket)
+{
+    if (fd == -1 && !connector)
         return;
     socketState = Disconnected;
-    if (!blocking) {
-        if (EventLoop::SharedPtr loop = EventLoop::eventLoop())
-            loop->unregisterSocket(fd);
+    if (connector) {
+        // still resolving or connecting
+        if (EventLoop::SharedPtr loop = EventLoop::eventLoop()) {
+            for (const Connector::Attempt& attempt : connector->attempts) {
+                loop->unregisterSocket(attempt.fd);
+                ::close(attempt.fd);
+            }
+            if (connector->timer != -1)
+                loop->unregisterTimer(connector->timer);
+        }
+        connector.reset();
+    }
+    if (tls && tls->ssl) {
+        // the configuration stays for the next connect()
+        if (!handshaking && closeSocket)
+            SSL_shutdown(tls->ssl);
+        SSL_free(tls->ssl);
+        tls->ssl = 0;
+        tls->kernelSend = false;
+    }
+    handshaking = false;
+    if (fd != -1) {
+        if (!blocking) {
+            if (EventLoop::SharedPtr loop = EventLoop::eventLoop())
+                loop->unregisterSocket(fd);
+        }
+        if (closeSocket)
+            ::close(fd);
     }
-    ::close(fd);
+    for (int received : receivedFds)
+        ::close(received);
+    receivedFds.clear();
+    writeQueue.clear();
+    queuedMemoryChanged(-queuedMemory);
+    totalQueued -= queuedBytes;
+    queuedBytes = 0;
+    writeIsBlocked = false;
+    writeWait = false;
+    readBatch.reset();
     socketPort = 0;
     address.clear();
     fd = -1;
+    wakeReadWaiter();
 }
 
-class Resolver
+void SocketClient::deliverRead(const SocketClient::SharedPtr& socketPtr)
 {
-public:
-    Resolver();
-    Resolver(const String& host, uint16_t port, const SocketClient::SharedPtr& socket);
-    ~Resolver();
+    if (!readWaiter) {
+        signalReadyRead(socketPtr, std::move(readBuffer));
+    } else if (!readBuffer.isEmpty()) {
+        wakeReadWaiter();
+    }
+}
 
-    void resolve(const String& host, uint16_t port, const SocketClient::SharedPtr& socket);
+void SocketClient::wakeReadWaiter()
+{
+    if (ReadWaiter waiter = readWaiter) {
+        readWaiter = 0;
+        waiter(readWaiterData);
+    }
+}
 
-    addrinfo* res;
-    sockaddr* addr;
-    size_t size;
-};
+// fills in address if host is a numeric IPv4 or IPv6 address
+static bool parseAddress(const String& host, HostResolver::Address& address)
+{
+    memset(&address.address, '\0', sizeof(address.address));
+    sockaddr_in* addr4 = reinterpret_cast<sockaddr_in*>(&address.address);
+    if (inet_pton(AF_INET, host.constData(), &addr4->sin_addr) == 1) {
+        addr4->sin_family = AF_INET;
+        address.size = sizeof(sockaddr_in);
+        return true;
+    }
+    sockaddr_in6* addr6 = reinterpret_cast<sockaddr_in6*>(&address.address);
+    if (inet_pton(AF_INET6, host.constData(), &addr6->sin6_addr) == 1) {
+        addr6->sin6_family = AF_INET6;
+        address.size = sizeof(sockaddr_in6);
+        return true;
+    }
+    return false;
+}
 
-Resolver::Resolver()
-    : res(0), addr(0), size(0)
+// host as an address for writeTo(), preferring the family the socket has.
+// Names are looked up through the HostResolver cache, blocking on a miss
+static bool resolveAddress(const String& host, uint16_t port, bool IPv6, HostResolver::Address& address)
 {
+    if (!parseAddress(host, address)) {
+        const List<HostResolver::Address> addresses = HostResolver::lookupBlocking(host);
+        if (addresses.isEmpty())
+            return false;
+        const int family = IPv6 ? AF_INET6 : AF_INET;
+        address = addresses.first();
+        for (const HostResolver::Address& candidate : addresses) {
+            if (candidate.family() == family) {
+                address = candidate;
+                break;
+            }
+        }
+    }
+    address.setPort(port);
+    return true;
 }
 
-Resolver::Resolver(const String& host, uint16_t port, const SocketClient::SharedPtr& socket)
-    : res(0), addr(0), size(0)
+// the addresses to try in order, the first family getaddrinfo() prefers
+// and the other one taking turns
+static List<HostResolver::Address> interleave(const List<HostResolver::Address>& addresses)
 {
-    resolve(host, port, socket);
+    if (addresses.isEmpty())
+        return addresses;
+    List<HostResolver::Address> preferred, other;
+    const int family = addresses.first().family();
+    for (const HostResolver::Address& address : addresses)
+        (address.family() == family ? preferred : other).append(address);
+    List<HostResolver::Address> ret;
+    ret.reserve(addresses.size());
+    for (int i = 0; i < std::max(preferred.size(), other.size()); ++i) {
+        if (i < preferred.size())
+            ret.append(preferred.at(i));
+        if (i < other.size())
+            ret.append(other.at(i));
+    }
+    return ret;
 }
 
-void Resolver::resolve(const String& host, uint16_t port, const SocketClient::SharedPtr& socket)
+bool SocketClient::connect(const String& host, uint16_t port)
 {
-    // first, see if this parses as an IP address
+    SocketClient::SharedPtr tcpSocket = shared_from_this();
+    List<HostResolver::Address> addresses;
     {
-        struct in_addr inaddr4;
-        struct in6_addr inaddr6;
-        struct { int af; void* dst; } addrs[2] = {
-            { AF_INET, &inaddr4 },
-            { AF_INET6, &inaddr6 }
-        };
-        for (int i = 0; i < 2; ++i) {
-            if (inet_pton(addrs[i].af, host.constData(), addrs[i].dst) == 1) {
-                // yes, use that
-                if (addrs[i].af == AF_INET) {
-                    sockaddr_in* newaddr = new sockaddr_in;
-                    memset(newaddr, '\0', sizeof(sockaddr_in));
-                    memcpy(&newaddr->sin_addr, &inaddr4, sizeof(struct in_addr));
-                    newaddr->sin_family = AF_INET;
-                    newaddr->sin_port = htons(port);
-                    addr = reinterpret_cast<sockaddr*>(newaddr);
-                    size = sizeof(sockaddr_in);
-                } else {
-                    assert(addrs[i].af == AF_INET6);
-                    sockaddr_in6* newaddr = new sockaddr_in6;
-                    memset(newaddr, '\0', sizeof(sockaddr_in6));
-                    memcpy(&newaddr->sin6_addr, &inaddr6, sizeof(struct in6_addr));
-                    newaddr->sin6_family = AF_INET6;
-                    newaddr->sin6_port = htons(port);
-                    addr = reinterpret_cast<sockaddr*>(newaddr);
-                    size = sizeof(sockaddr_in6);
-                }
-                return;
+        HostResolver::Address literal;
+        if (parseAddress(host, literal)) {
+            addresses.append(literal);
+        } else if (!blocking && EventLoop::eventLoop()) {
+            // resolved off the loop, the connect happens once the answer
+            // is in. Anything written meanwhile is queued
+            connector.reset(new Connector);
+            connector->port = port;
+            socketPort = port;
+            address = host;
+            socketState = Connecting;
+            const WeakPtr weak = tcpSocket;
+            const std::weak_ptr<Connector> weakConnector = connector;
+            HostResolver::lookup(host, [weak, weakConnector](const List<HostResolver::Address>& addresses) {
+                    SocketClient::SharedPtr socket = weak.lock();
+                    if (!socket || socket->connector != weakConnector.lock())
+                        return;
+                    if (addresses.isEmpty()) {
+                        socket->signalError(socket, DnsError);
+                        socket->close();
+                        return;
+                    }
+                    socket->connector->addresses = interleave(addresses);
+                    socket->connectNext();
+                });
+            return isConnected();
+        } else {
+            addresses = interleave(HostResolver::lookupBlocking(host));
+            if (addresses.isEmpty()) {
+                signalError(tcpSocket, DnsError);
+                close();
+                return false;
             }
         }
     }
 
-    // not an ip address, try to resolve it
-    addrinfo hints, *p;
+    // one address after the other, the first one that connects or is
+    // connecting wins
+    for (int i = 0; i < addresses.size(); ++i) {
+        HostResolver::Address& addr = addresses[i];
+        addr.setPort(port);
+        if (!init(addr.family() == AF_INET6 ? Tcp|IPv6 : Tcp))
+            return false;
 
-    memset(&hints, 0, sizeof(hints));
-    hints.ai_family = AF_UNSPEC; // AF_INET or AF_INET6 to force version
-    hints.ai_socktype = SOCK_STREAM;
+        int e;
+        eintrwrap(e, ::connect(fd, reinterpret_cast<const sockaddr*>(&addr.address), addr.size));
+        if (e == -1 && errno != EINPROGRESS) {
+            if (i + 1 < addresses.size()) {
+                close();
+                continue;
+            }
+            // bad
+            signalError(tcpSocket, ConnectError);
+            close();
+            return false;
+        }
+        socketPort = port;
+        address = host;
+        if (e == 0) { // we're done
+            established();
+        } else {
+            if (EventLoop::SharedPtr loop = EventLoop::eventLoop()) {
+                loop->updateSocket(fd, EventLoop::SocketRead|EventLoop::SocketWrite|EventLoop::SocketOneShot);
+                writeWait = true;
+            }
+            socketState = Connecting;
+        }
+        return true;
+    }
+    return false;
+}
 
-    if (getaddrinfo(host.constData(), NULL, &hints, &res) != 0) {
-        // bad
-        socket->signalError(socket, SocketClient::DnsError);
-        socket->close();
+// Starts connecting to the next address. Unless that fails right away the
+// one after it is started too if nothing has connected within
+// AttemptDelay, so an address that doesn't answer doesn't have to time
+// out before the others get a chance
+void SocketClient::connectNext()
+{
+    EventLoop::SharedPtr loop = EventLoop::eventLoop();
+    assert(loop && connector);
+    const WeakPtr weak = shared_from_this();
+    while (connector->next < connector->addresses.size()) {
+        HostResolver::Address addr = connector->addresses.at(connector->next++);
+        addr.setPort(connector->port);
+        const int f = ::socket(addr.family(), SOCK_STREAM, 0);
+        if (f == -1)
+            continue;
+#ifdef HAVE_NOSIGPIPE
+        int flags = 1;
+        ::setsockopt(f, SOL_SOCKET, SO_NOSIGPIPE, (void *)&flags, sizeof(int));
+#endif
+#ifdef HAVE_CLOEXEC
+        setFlags(f, FD_CLOEXEC, F_GETFD, F_SETFD);
+#endif
+        if (!setFlags(f, O_NONBLOCK, F_GETFL, F_SETFL)) {
+            ::close(f);
+            continue;
+        }
+        applyOptions(f, socketOptions, true);
+        int e;
+        eintrwrap(e, ::connect(f, reinterpret_cast<const sockaddr*>(&addr.address), addr.size));
+        if (e == 0) {
+            connectedTo(f, addr.family());
+            return;
+        } else if (errno != EINPROGRESS) {
+            ::close(f);
+            continue;
+        }
+        const Connector::Attempt attempt = { f, addr.family() };
+        connector->attempts.append(attempt);
+        loop->registerSocket(f, EventLoop::SocketWrite|EventLoop::SocketOneShot, [weak](int f, unsigned int mode) {
+                if (SocketClient::SharedPtr socket = weak.lock())
+                    socket->attemptCallback(f, mode);
+            });
+        if (connector->next < connector->addresses.size()) {
+            if (connector->timer != -1)
+                loop->unregisterTimer(connector->timer);
+            connector->timer = loop->registerTimer([weak](int) {
+                    if (SocketClient::SharedPtr socket = weak.lock()) {
+                        if (socket->connector) {
+                            socket->connector->timer = -1;
+                            socket->connectNext();
+                        }
+                    }
+                }, AttemptDelay, Timer::SingleShot);
+        }
         return;
     }
+    if (connector->attempts.isEmpty()) {
+        // bad
+        SocketClient::SharedPtr tcpSocket = shared_from_this();
+        signalError(tcpSocket, ConnectError);
+        close();
+    }
+}
 
-    for (p = res; p; p = p->ai_next) {
-        if (p->ai_family == AF_INET) {
-            addr = p->ai_addr;
-            reinterpret_cast<sockaddr_in*>(addr)->sin_port = htons(port);
-            size = sizeof(sockaddr_in);
-            break;
-        } else if (p->ai_family == AF_INET6) {
-            addr = p->ai_addr;
-            reinterpret_cast<sockaddr_in6*>(addr)->sin6_port = htons(port);
-            size = sizeof(sockaddr_in6);
+void SocketClient::attemptCallback(int f, unsigned int mode)
+{
+    if (!connector)
+        return;
+    int err = 0;
+    socklen_t size = sizeof(err);
+    if (mode & EventLoop::SocketError || ::getsockopt(f, SOL_SOCKET, SO_ERROR, &err, &size) == -1)
+        err = -1;
+    int family = 0;
+    for (int i = 0; i < connector->attempts.size(); ++i) {
+        if (connector->attempts.at(i).fd == f) {
+            family = connector->attempts.at(i).family;
+            connector->attempts.removeAt(i);
             break;
         }
     }
-
-    if (!addr) {
-        socket->signalError(socket, SocketClient::DnsError);
-        socket->close();
-        freeaddrinfo(res);
-        res = 0;
+    if (!err) {
+        connectedTo(f, family);
         return;
     }
+    if (EventLoop::SharedPtr loop = EventLoop::eventLoop())
+        loop->unregisterSocket(f);
+    ::close(f);
+    // no point waiting for the timer if we know this one failed
+    if (connector->timer != -1) {
+        EventLoop::eventLoop()->unregisterTimer(connector->timer);
+        connector->timer = -1;
+    }
+    connectNext();
 }
 
-Resolver::~Resolver()
+// f won, drop the other attempts and carry on with f as our socket
+void SocketClient::connectedTo(int f, int family)
 {
-    if (res)
-        freeaddrinfo(res); // free the linked list
-    else if (addr) {
-        if (size == sizeof(sockaddr_in))
-            delete reinterpret_cast<sockaddr_in*>(addr);
-        else
-            delete reinterpret_cast<sockaddr_in6*>(addr);
+    EventLoop::SharedPtr loop = EventLoop::eventLoop();
+    for (const Connector::Attempt& attempt : connector->attempts) {
+        loop->unregisterSocket(attempt.fd);
+        ::close(attempt.fd);
     }
+    if (connector->timer != -1)
+        loop->unregisterTimer(connector->timer);
+    connector.reset();
+
+    loop->unregisterSocket(f);
+    fd = f;
+    socketMode = Tcp;
+    if (family == AF_INET6)
+        socketMode |= IPv6;
+    loop->registerSocket(fd, EventLoop::SocketRead,
+                         std::bind(&SocketClient::socketCallback, this, std::placeholders::_1, std::placeholders::_2));
+    established();
 }
 
-bool SocketClient::connect(const String& host, uint16_t port)
+// the socket is connected, with TLS that's where the handshake starts
+void SocketClient::established()
 {
-    SocketClient::SharedPtr tcpSocket = shared_from_this();
-    Resolver resolver(host, port, tcpSocket);
-    if (!resolver.addr)
-        return false;
-
-    unsigned int mode = Tcp;
-    if (resolver.size == sizeof(sockaddr_in6))
-        mode |= IPv6;
+    socketState = Connected;
+    if (tls) {
+        handshaking = true;
+        tlsHandshake();
+        return;
+    }
+    SocketClient::SharedPtr socketPtr = shared_from_this();
+    signalConnected(socketPtr);
+    // what was written while we were connecting
+    if (fd != -1 && !corked && !writeWait && !writeQueue.empty()) {
+        flushWriteQueue(0, 0, 0, 0);
+        checkWatermarks();
+    }
+}
 
-    if (!init(mode))
+bool SocketClient::startTls(const std::shared_ptr<TlsContext>& context, const String& serverName)
+{
+    if (!context || socketMode & (Udp|Unix))
         return false;
+    tls.reset(new Tls);
+    tls->context = context;
+    tls->serverName = serverName;
+    if (fd != -1 && socketState == Connected) {
+        handshaking = true;
+        return tlsHandshake();
+    }
+    return true;
+}
 
-    int e;
-    eintrwrap(e, ::connect(fd, resolver.addr, resolver.size));
-    socketPort = port;
-    address = host;
-    if (e == 0) { // we're done
-        socketState = Connected;
+bool SocketClient::isKernelTls() const
+{
+    return tls && tls->kernelSend;
+}
 
-        signalConnected(tcpSocket);
-    } else {
-        if (errno != EINPROGRESS) {
-            // bad
-            signalError(tcpSocket, ConnectError);
+bool SocketClient::isTlsResumed() const
+{
+    return tls && tls->ssl && SSL_session_reused(tls->ssl);
+}
+
+// drives the handshake, false if it failed and we're closed
+bool SocketClient::tlsHandshake()
+{
+    SocketClient::SharedPtr socketPtr = shared_from_this();
+    if (!tls->ssl) {
+        const String* sessionKey = 0;
+        if (tls->context->mode() == TlsContext::Client) {
+            const String& host = tls->serverName.isEmpty() ? address : tls->serverName;
+            tls->sessionKey = String::format<128>("%s:%u", host.constData(), socketPort);
+            sessionKey = &tls->sessionKey;
+        }
+        tls->ssl = tls->context->createConnection(fd, tls->serverName, sessionKey);
+        if (!tls->ssl) {
+            signalError(socketPtr, TlsError);
             close();
             return false;
         }
-        if (EventLoop::SharedPtr loop = EventLoop::eventLoop()) {
-            loop->updateSocket(fd, EventLoop::SocketRead|EventLoop::SocketWrite|EventLoop::SocketOneShot);
-            writeWait = true;
+    }
+
+    ERR_clear_error();
+    const int e = SSL_do_handshake(tls->ssl);
+    if (e == 1) {
+        handshaking = false;
+#ifndef OPENSSL_NO_KTLS
+        tls->kernelSend = BIO_get_ktls_send(SSL_get_wbio(tls->ssl));
+#endif
+        signalConnected(socketPtr);
+        // what was written while we were connecting
+        if (fd != -1 && !corked && !writeWait && !writeQueue.empty()) {
+            flushWriteQueue(0, 0, 0, 0);
+            checkWatermarks();
         }
-        socketState = Connecting;
+        return fd != -1;
     }
+    switch (SSL_get_error(tls->ssl, e)) {
+    case SSL_ERROR_WANT_READ:
+        // we're always reading
+        return true;
+    case SSL_ERROR_WANT_WRITE:
+        if (!writeWait) {
+            if (EventLoop::SharedPtr loop = EventLoop::eventLoop()) {
+                writeWait = true;
+                loop->updateSocket(fd, eventMode());
+            }
+        }
+        return true;
+    default:
+        break;
+    }
+    // bad
+    ::error() << "TLS handshake failed" << TlsContext::lastError();
+    signalError(socketPtr, TlsError);
+    close();
+    return false;
+}
 
-    return true;
+// like read(), -1 with EAGAIN if there's no whole record yet
+int SocketClient::tlsRead(void* data, int size)
+{
+    ERR_clear_error();
+    const int e = SSL_read(tls->ssl, data, size);
+    if (e > 0)
+        return e;
+    switch (SSL_get_error(tls->ssl, e)) {
+    case SSL_ERROR_WANT_READ:
+        errno = EAGAIN;
+        return -1;
+    case SSL_ERROR_WANT_WRITE:
+        tls->readWantsWrite = true;
+        if (!writeWait) {
+            if (EventLoop::SharedPtr loop = EventLoop::eventLoop()) {
+                writeWait = true;
+                loop->updateSocket(fd, eventMode());
+            }
+        }
+        errno = EAGAIN;
+        return -1;
+    case SSL_ERROR_ZERO_RETURN:
+        return 0;
+    case SSL_ERROR_SYSCALL:
+        // no close_notify, the other side just hung up
+        if (!errno)
+            return 0;
+        return -1;
+    default:
+        errno = EPROTO;
+        return -1;
+    }
+}
+
+// like write(), -1 with EAGAIN if it has to be retried with the same data
+int SocketClient::tlsWrite(const void* data, int size)
+{
+    ERR_clear_error();
+    const int e = SSL_write(tls->ssl, data, size);
+    if (e > 0)
+        return e;
+    switch (SSL_get_error(tls->ssl, e)) {
+    case SSL_ERROR_WANT_READ:
+    case SSL_ERROR_WANT_WRITE:
+        errno = EAGAIN;
+        return -1;
+    case SSL_ERROR_SYSCALL:
+        return -1;
+    default:
+        errno = EPROTO;
+        return -1;
+    }
 }
 
 bool SocketClient::connect(const String& path)
@@ -238,9 +752,7 @@ bool SocketClient::connect(const String& path)
     eintrwrap(e, ::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(sockaddr_un)));
     address = path;
     if (e == 0) { // we're done
-        socketState = Connected;
-
-        signalConnected(unixSocket);
+        established();
     } else {
         if (errno != EINPROGRESS) {
             // bad
@@ -301,6 +813,241 @@ bool SocketClient::bind(uint16_t port)
     return false;
 }
 
+bool SocketClient::setReadBatch(unsigned int count, unsigned int datagramSize, bool gro)
+{
+    if (!(socketMode & Udp) || fd == -1)
+        return false;
+    if (!count || !datagramSize) {
+        readBatch.reset();
+        return true;
+    }
+#ifdef HAVE_UDP_GRO
+    int enable = gro ? 1 : 0;
+    if (::setsockopt(fd, IPPROTO_UDP, UDP_GRO, &enable, sizeof(enable)) == -1)
+        gro = false;
+#else
+    gro = false;
+#endif
+
+    readBatch.reset(new ReadBatch);
+    ReadBatch& batch = *readBatch;
+    batch.count = count;
+    batch.datagramSize = datagramSize;
+    batch.gro = gro;
+    batch.slab.resize(static_cast<size_t>(count) * datagramSize);
+    batch.headers.resize(count);
+    batch.iovecs.resize(count);
+    batch.addresses.resize(count);
+    batch.controlSize = gro ? CMSG_SPACE(sizeof(int)) : 0;
+    batch.control.resize(count * batch.controlSize);
+    batch.datagrams.reserve(count);
+    memset(&batch.headers[0], 0, sizeof(mmsghdr) * count);
+    for (unsigned int i = 0; i < count; ++i) {
+        batch.iovecs[i].iov_base = &batch.slab[static_cast<size_t>(i) * datagramSize];
+        batch.iovecs[i].iov_len = datagramSize;
+        msghdr& header = batch.headers[i].msg_hdr;
+        header.msg_name = &batch.addresses[i].address;
+        header.msg_iov = &batch.iovecs[i];
+        header.msg_iovlen = 1;
+        if (gro)
+            header.msg_control = &batch.control[i * batch.controlSize];
+    }
+    return true;
+}
+
+unsigned int SocketClient::readBatchSize() const
+{
+    return readBatch ? readBatch->count : 0;
+}
+
+// the read side of socketCallback() with a read batch, false if the socket
+// was closed
+bool SocketClient::readDatagrams()
+{
+    SocketClient::SharedPtr socketPtr = shared_from_this();
+    ReadBatch& batch = *readBatch;
+    unsigned int total = 0;
+    for (;;) {
+        for (unsigned int i = 0; i < batch.count; ++i) {
+            msghdr& header = batch.headers[i].msg_hdr;
+            header.msg_namelen = sizeof(sockaddr_storage);
+            header.msg_controllen = batch.controlSize;
+            header.msg_flags = 0;
+        }
+        const int e = receiveMessages(fd, &batch.headers[0], batch.count);
+        if (e == -1) {
+            countRead(-1);
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return true;
+            // bad
+            signalError(socketPtr, ReadError);
+            close();
+            return false;
+        }
+
+        batch.datagrams.clear();
+        for (int i = 0; i < e; ++i) {
+            const mmsghdr& message = batch.headers[i];
+            HostResolver::Address& from = batch.addresses[i];
+            from.size = message.msg_hdr.msg_namelen;
+            const unsigned char* data = static_cast<const unsigned char*>(batch.iovecs[i].iov_base);
+            const bool truncated = message.msg_hdr.msg_flags & MSG_TRUNC;
+            unsigned int size = std::min(message.msg_len, batch.datagramSize);
+            total += size;
+            unsigned int segment = size;
+#ifdef HAVE_UDP_GRO
+            if (batch.gro) {
+                for (cmsghdr* cmsg = CMSG_FIRSTHDR(&message.msg_hdr); cmsg;
+                     cmsg = CMSG_NXTHDR(const_cast<msghdr*>(&message.msg_hdr), cmsg)) {
+                    if (cmsg->cmsg_level == IPPROTO_UDP && cmsg->cmsg_type == UDP_GRO) {
+                        int gso;
+                        memcpy(&gso, CMSG_DATA(cmsg), sizeof(gso));
+                        if (gso > 0)
+                            segment = gso;
+                        break;
+                    }
+                }
+            }
+#endif
+            // coalesced datagrams are all segment bytes but the last
+            do {
+                const Datagram datagram = { data, std::min(size, segment), &from, truncated && size <= segment };
+                batch.datagrams.push_back(datagram);
+                data += datagram.size;
+                size -= datagram.size;
+            } while (size);
+        }
+        unsigned int bytes = 0;
+        for (int i = 0; i < e; ++i)
+            bytes += std::min(batch.headers[i].msg_len, batch.datagramSize);
+        countRead(bytes);
+        if (!batch.datagrams.empty())
+            signalReadyReadBatch(socketPtr, &batch.datagrams[0], batch.datagrams.size());
+        if (fd == -1)
+            return false;
+        if (readBatch.get() != &batch) {
+            // turned off or redone from the slot
+            return true;
+        }
+
+        if (maxRead && total >= maxRead) {
+            // more next time around, see the stream side
+            if (EventLoop::SharedPtr loop = EventLoop::eventLoop())
+                loop->updateSocket(fd, eventMode());
+            return true;
+        }
+    }
+}
+
+int SocketClient::writeTo(const Datagram* datagrams, int count)
+{
+    if (fd == -1 || !(socketMode & Udp))
+        return -1;
+    enum { MaxBatch = 64 };
+    mmsghdr messages[MaxBatch];
+    iovec iovecs[MaxBatch];
+    int sent = 0;
+    while (sent < count) {
+        const int batch = std::min<int>(count - sent, MaxBatch);
+        memset(messages, 0, sizeof(mmsghdr) * batch);
+        for (int i = 0; i < batch; ++i) {
+            const Datagram& datagram = datagrams[sent + i];
+            iovecs[i].iov_base = const_cast<unsigned char*>(datagram.data);
+            iovecs[i].iov_len = datagram.size;
+            msghdr& header = messages[i].msg_hdr;
+            if (datagram.address) {
+                header.msg_name = const_cast<sockaddr_storage*>(&datagram.address->address);
+                header.msg_namelen = datagram.address->size;
+            }
+            header.msg_iov = &iovecs[i];
+            header.msg_iovlen = 1;
+        }
+        const int e = sendMessages(fd, messages, batch);
+        size_t wanted = 0, bytes = 0;
+        for (int i = 0; i < batch; ++i) {
+            wanted += iovecs[i].iov_len;
+            if (i < e)
+                bytes += messages[i].msg_len;
+        }
+        countWrite(e == -1 ? -1 : bytes, wanted);
+        if (e == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            // bad
+            SocketClient::SharedPtr socketPtr = shared_from_this();
+            signalError(socketPtr, WriteError);
+            close();
+            return -1;
+        }
+        sent += e;
+        if (e < batch)
+            break;
+    }
+    return sent;
+}
+
+bool SocketClient::writeSegmented(const HostResolver::Address& address, const unsigned char* data, unsigned int size, unsigned int segmentSize)
+{
+    if (fd == -1 || !(socketMode & Udp) || !segmentSize)
+        return false;
+#ifdef HAVE_UDP_SEGMENT
+    // what the kernel takes in one go, UDP_MAX_SEGMENTS and a 64k datagram
+    enum { MaxSegments = 64, MaxSize = 65507 };
+    const unsigned int perSend = std::min<unsigned int>(MaxSegments, MaxSize / segmentSize) * segmentSize;
+    while (size > segmentSize && perSend) {
+        const unsigned int chunk = std::min(size, perSend);
+        iovec iov = { const_cast<unsigned char*>(data), chunk };
+        char control[CMSG_SPACE(sizeof(uint16_t))];
+        memset(control, 0, sizeof(control));
+        msghdr header;
+        memset(&header, 0, sizeof(header));
+        header.msg_name = const_cast<sockaddr_storage*>(&address.address);
+        header.msg_namelen = address.size;
+        header.msg_iov = &iov;
+        header.msg_iovlen = 1;
+        header.msg_control = control;
+        header.msg_controllen = sizeof(control);
+        cmsghdr* cmsg = CMSG_FIRSTHDR(&header);
+        cmsg->cmsg_level = IPPROTO_UDP;
+        cmsg->cmsg_type = UDP_SEGMENT;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+        const uint16_t gso = segmentSize;
+        memcpy(CMSG_DATA(cmsg), &gso, sizeof(gso));
+        int e;
+        eintrwrap(e, ::sendmsg(fd, &header, 0));
+        countWrite(e, chunk);
+        if (e == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return false;
+            // no GSO here after all, the batch below does the rest
+            break;
+        }
+        data += chunk;
+        size -= chunk;
+    }
+#endif
+    enum { MaxBatch = 64 };
+    Datagram datagrams[MaxBatch];
+    while (size) {
+        int count = 0;
+        unsigned int offset = 0;
+        while (count < MaxBatch && offset < size) {
+            Datagram& datagram = datagrams[count++];
+            datagram.data = data + offset;
+            datagram.size = std::min(segmentSize, size - offset);
+            datagram.address = &address;
+            datagram.truncated = false;
+            offset += datagram.size;
+        }
+        const int sent = writeTo(datagrams, count);
+        if (sent != count)
+            return false;
+        data += offset;
+        size -= offset;
+    }
+    return true;
+}
+
 bool SocketClient::addMembership(const String& ip)
 {
     struct ip_mreq mreq;
@@ -376,138 +1123,550 @@ bool SocketClient::writeTo(const String& host, uint16_t port, const unsigned cha
     assert((!size) == (!data));
     SocketClient::SharedPtr socketPtr = shared_from_this();
 
-    Resolver resolver;
-    if (port != 0)
-        resolver.resolve(host, port, socketPtr);
+    HostResolver::Address addr;
+    if (port != 0 && !resolveAddress(host, port, socketMode & IPv6, addr)) {
+        signalError(socketPtr, DnsError);
+        close();
+        return false;
+    }
+
+    if (fd == -1 && !connector)
+        return false;
+    if (writeWait || connector || handshaking) {
+        // socketCallback() flushes once the socket is writable again
+        if (size)
+            queueData(data, size);
+        checkWatermarks();
+        return true;
+    }
+    const bool ret = flushWriteQueue(port ? &addr.address : 0, port ? addr.size : 0, data, size);
+    checkWatermarks();
+    return ret;
+}
 
-    int e;
-    unsigned int total = 0;
+void SocketClient::enqueued(unsigned int size)
+{
+    queuedBytes += size;
+    totalQueued += size;
+    if (queuedBytes > ioStats.peakPendingWrite)
+        ioStats.peakPendingWrite = queuedBytes;
+}
+
+void SocketClient::countRead(int e)
+{
+    ++ioStats.reads;
+    IoStats::add(IoStats::Reads);
+    if (e > 0) {
+        ioStats.bytesRead += e;
+        IoStats::add(IoStats::BytesRead, e);
+    } else if (e == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        ++ioStats.readsWouldBlock;
+        IoStats::add(IoStats::ReadsWouldBlock);
+    }
+}
+
+void SocketClient::countWrite(int e, size_t wanted)
+{
+    ++ioStats.writes;
+    IoStats::add(IoStats::Writes);
+    if (e > 0) {
+        ioStats.bytesWritten += e;
+        IoStats::add(IoStats::BytesWritten, e);
+        if (static_cast<size_t>(e) < wanted) {
+            ++ioStats.partialWrites;
+            IoStats::add(IoStats::PartialWrites);
+        }
+    } else if (e == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        ++ioStats.writesWouldBlock;
+        IoStats::add(IoStats::WritesWouldBlock);
+    }
+}
+
+void SocketClient::dequeued(unsigned int size)
+{
+    assert(queuedBytes >= size);
+    queuedBytes -= size;
+    totalQueued -= size;
+}
+
+// emits writeBlocked() or writeUnblocked() if the queue went past a
+// watermark or the budget. Only called once a write is done with the queue
+// so the slots are free to write again
+void SocketClient::checkWatermarks()
+{
+    if (fd == -1)
+        return;
+    const size_t budget = writeBudgetLimit.load(std::memory_order_relaxed);
+    const bool overBudget = budget && queuedBytes && totalQueued.load(std::memory_order_relaxed) >= budget;
+    if (!writeIsBlocked) {
+        if ((highMark && queuedBytes >= highMark) || overBudget) {
+            writeIsBlocked = true;
+            signalWriteBlocked(shared_from_this());
+        }
+    } else if (!queuedBytes || (queuedBytes <= lowMark && !overBudget)) {
+        writeIsBlocked = false;
+        signalWriteUnblocked(shared_from_this());
+    }
+}
+
+void SocketClient::setWatermarks(unsigned int high, unsigned int low)
+{
+    assert(!high || low <= high);
+    highMark = high;
+    lowMark = low;
+    checkWatermarks();
+}
+
+void SocketClient::setWriteBudget(size_t bytes)
+{
+    writeBudgetLimit.store(bytes, std::memory_order_relaxed);
+}
+
+size_t SocketClient::writeBudget()
+{
+    return writeBudgetLimit.load(std::memory_order_relaxed);
+}
+
+size_t SocketClient::totalPendingWrite()
+{
+    return totalQueued.load(std::memory_order_relaxed);
+}
+
+// what to wait for on the socket in the current state
+unsigned int SocketClient::eventMode() const
+{
+    unsigned int mode = readSuspended ? 0 : EventLoop::SocketRead;
+    if (writeWait)
+        mode |= EventLoop::SocketWrite|EventLoop::SocketOneShot;
+    return mode;
+}
+
+bool SocketClient::setOptions(const Options& options)
+{
+    if (options.noDelay != Options::Unset)
+        socketOptions.noDelay = options.noDelay;
+    if (options.quickAck != Options::Unset)
+        socketOptions.quickAck = options.quickAck;
+    if (options.sendBuffer != Options::Unset)
+        socketOptions.sendBuffer = options.sendBuffer;
+    if (options.receiveBuffer != Options::Unset)
+        socketOptions.receiveBuffer = options.receiveBuffer;
+    if (options.busyPoll != Options::Unset)
+        socketOptions.busyPoll = options.busyPoll;
+    if (fd == -1)
+        return true;
+    return applyOptions(fd, options, socketMode & Tcp);
+}
+
+static bool setOption(int f, int level, int name, int value, const char* what)
+{
+    if (value == SocketClient::Options::Unset)
+        return true;
+    if (::setsockopt(f, level, name, &value, sizeof(value)) == -1) {
+        ::warning() << "Couldn't set" << what << "to" << value << Rct::strerror();
+        return false;
+    }
+    return true;
+}
+
+bool SocketClient::applyOptions(int f, const Options& options, bool tcp)
+{
+    bool ok = true;
+    if (tcp) {
+        ok = setOption(f, IPPROTO_TCP, TCP_NODELAY, options.noDelay, "TCP_NODELAY") && ok;
+#ifdef TCP_QUICKACK
+        ok = setOption(f, IPPROTO_TCP, TCP_QUICKACK, options.quickAck, "TCP_QUICKACK") && ok;
+#endif
+    }
+    ok = setOption(f, SOL_SOCKET, SO_SNDBUF, options.sendBuffer, "SO_SNDBUF") && ok;
+    ok = setOption(f, SOL_SOCKET, SO_RCVBUF, options.receiveBuffer, "SO_RCVBUF") && ok;
+#ifdef SO_BUSY_POLL
+    ok = setOption(f, SOL_SOCKET, SO_BUSY_POLL, options.busyPoll, "SO_BUSY_POLL") && ok;
+#endif
+    return ok;
+}
+
+void SocketClient::setReadSuspended(bool suspended)
+{
+    if (suspended == readSuspended)
+        return;
+    readSuspended = suspended;
+    if (fd != -1 && !blocking) {
+        // re-arming reports whatever arrived while suspended
+        if (EventLoop::SharedPtr loop = EventLoop::eventLoop())
+            loop->updateSocket(fd, eventMode());
+    }
+}
+
+void SocketClient::queueData(const unsigned char* data, unsigned int size)
+{
+    enum { MaxOwnedSegment = 64 * 1024 };
+    enqueued(size);
+    // small writes share a segment, datagrams each need their own
+    if (!(socketMode & Udp) && !writeQueue.empty()) {
+        WriteSegment& back = writeQueue.back();
+        if (!back.shared && !back.file && back.owned.size() + size <= MaxOwnedSegment) {
+            back.owned.append(data, size);
+            return;
+        }
+    }
+    writeQueue.push_back(WriteSegment());
+    writeQueue.back().owned.append(data, size);
+}
+
+// writes out the queue followed by data, whatever doesn't fit gets queued
+bool SocketClient::flushWriteQueue(const void* addr, size_t addrSize, const unsigned char* data, unsigned int size)
+{
+    SocketClient::SharedPtr socketPtr = shared_from_this();
 
 #ifdef HAVE_NOSIGNAL
     const int sendFlags = MSG_NOSIGNAL;
 #else
     const int sendFlags = 0;
 #endif
+    enum { MaxSegments = 64 };
+    // a datagram per call
+    const size_t maxSegments = (socketMode & Udp) ? 1 : MaxSegments;
 
-    if (!writeWait) {
-        if (!writeBuffer.isEmpty()) {
-            while (total < writeBuffer.size()) {
-                assert(writeBuffer.size() > total);
-                if (resolver.addr) {
-                    eintrwrap(e, ::sendto(fd, writeBuffer.data() + total, writeBuffer.size() - total,
-                                          sendFlags, resolver.addr, resolver.size));
-                } else {
-                    eintrwrap(e, ::write(fd, writeBuffer.data() + total, writeBuffer.size() - total));
+    // sendfile() would skip OpenSSL
+    const bool sendsFiles = !tls || tls->kernelSend;
+
+    iovec iov[MaxSegments + 1];
+    int e;
+    while (fd != -1) {
+        if (!sendsFiles && !writeQueue.empty() && writeQueue.front().file && !readFileChunk()) {
+            signalError(socketPtr, WriteError);
+            close();
+            return false;
+        }
+        size_t count = 0;
+        for (auto it = writeQueue.begin(); it != writeQueue.end() && count < maxSegments; ++it) {
+            // files go on their own, fds have to go with the start of a
+            // write
+            if (it->file || (count && it->descriptors))
+                break;
+            iov[count].iov_base = const_cast<char*>(it->data());
+            iov[count].iov_len = it->size();
+            ++count;
+        }
+        const bool withData = size && count == writeQueue.size() && count < maxSegments;
+        if (withData) {
+            iov[count].iov_base = const_cast<unsigned char*>(data);
+            iov[count].iov_len = size;
+            ++count;
+        }
+        if (!count && writeQueue.empty())
+            return true;
+
+        if (!count) {
+            // a file segment
+            const WriteSegment& front = writeQueue.front();
+            e = sendFileData(fd, front.file->fd, front.fileOffset + front.offset, front.size());
+            if (e != -1 || errno != ENOSYS)
+                countWrite(e, front.size());
+            if (e == -1 && (errno == EINVAL || errno == ENOSYS)) {
+                // not a file sendfile() can do, this part goes through
+                // memory instead
+                if (!readFileChunk()) {
+                    signalError(socketPtr, WriteError);
+                    close();
+                    return false;
                 }
-                if (e == -1) {
-                    if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                        if (wMode == Synchronous) {
-                            if (EventLoop::SharedPtr loop = EventLoop::eventLoop()) {
-                                if (total) {
-                                    if (total < writeBuffer.size()) {
-                                        memmove(writeBuffer.data(), writeBuffer.data() + total, writeBuffer.size() - total);
-                                    }
-                                    writeBuffer.resize(writeBuffer.size() - total);
-                                    total = 0;
-                                }
-                                if (loop->processSocket(fd) & EventLoop::SocketWrite)
-                                    break;
-                                if (fd == -1)
-                                    return false;
-                            }
-                        }
-                        assert(!writeWait);
-                        if (EventLoop::SharedPtr loop = EventLoop::eventLoop()) {
-                            loop->updateSocket(fd, EventLoop::SocketRead|EventLoop::SocketWrite|EventLoop::SocketOneShot);
-                            writeWait = true;
-                        }
-                        break;
-                    } else {
-                        // bad
-                        signalError(shared_from_this(), WriteError);
-                        close();
-                        return false;
+                continue;
+            }
+            if (!e) {
+                ::error() << "File being sent ended early";
+                signalError(socketPtr, WriteError);
+                close();
+                return false;
+            }
+        } else if (tls && !tls->kernelSend) {
+            // OpenSSL takes one buffer at a time
+            e = tlsWrite(iov[0].iov_base, iov[0].iov_len);
+            countWrite(e, iov[0].iov_len);
+        } else {
+            msghdr msg;
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_name = const_cast<void*>(addr);
+            msg.msg_namelen = addrSize;
+            msg.msg_iov = iov;
+            msg.msg_iovlen = count;
+            char control[CMSG_SPACE(sizeof(int) * MaxDescriptors)];
+            if (count && !writeQueue.empty() && writeQueue.front().descriptors) {
+                const std::vector<int>& fds = writeQueue.front().descriptors->fds;
+                memset(control, 0, sizeof(control));
+                msg.msg_control = control;
+                msg.msg_controllen = CMSG_SPACE(sizeof(int) * fds.size());
+                cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+                cmsg->cmsg_level = SOL_SOCKET;
+                cmsg->cmsg_type = SCM_RIGHTS;
+                cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fds.size());
+                memcpy(CMSG_DATA(cmsg), &fds[0], sizeof(int) * fds.size());
+            }
+            eintrwrap(e, ::sendmsg(fd, &msg, sendFlags));
+            if (e == -1 && errno == ENOTSOCK && !addr)
+                eintrwrap(e, ::writev(fd, iov, count));
+            size_t wanted = 0;
+            for (size_t i = 0; i < count; ++i)
+                wanted += iov[i].iov_len;
+            countWrite(e, wanted);
+        }
+        if (e == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                if (size)
+                    queueData(data, size);
+                if (EventLoop::SharedPtr loop = EventLoop::eventLoop()) {
+                    if (wMode == Synchronous) {
+                        // the write side of socketCallback() flushes the rest
+                        (void)loop->processSocket(fd);
+                        return isConnected();
                     }
+                    assert(!writeWait);
+                    writeWait = true;
+                    loop->updateSocket(fd, eventMode());
                 }
-                signalBytesWritten(socketPtr, e);
-                total += e;
+                return true;
             }
-            if (total) {
-                assert(total <= writeBuffer.size());
-                if (total < writeBuffer.size()) {
-                    memmove(writeBuffer.data(), writeBuffer.data() + total, writeBuffer.size() - total);
-                }
-                writeBuffer.resize(writeBuffer.size() - total);
+            // bad
+            signalError(socketPtr, WriteError);
+            close();
+            return false;
+        }
+        // the fds went with the first byte, our copies can go
+        if (!writeQueue.empty() && writeQueue.front().descriptors && count)
+            writeQueue.front().descriptors.reset();
+        signalBytesWritten(socketPtr, e);
+
+        unsigned int written = e;
+        while (written && !writeQueue.empty()) {
+            WriteSegment& front = writeQueue.front();
+            const unsigned int segment = front.size();
+            if (written < segment) {
+                front.offset += written;
+                written = 0;
+                break;
             }
+            written -= segment;
+            queuedMemoryChanged(-static_cast<int64_t>(front.memory()));
+            writeQueue.pop_front();
+        }
+        // what's left of written came out of data
+        dequeued(e - written);
+        if (withData) {
+            assert(written <= size);
+            data += written;
+            size -= written;
         }
+    }
+    return false;
+}
+
+bool SocketClient::write(const void *data, unsigned int size)
+{
+    if (corked && size) {
+        if (fd == -1 && !connector)
+            return false;
+        queueData(static_cast<const unsigned char*>(data), size);
+        return true;
+    }
+    return writeTo(String(), 0, reinterpret_cast<const unsigned char*>(data), size);
+}
+
+bool SocketClient::write(const std::shared_ptr<const String> &data)
+{
+    if (fd == -1 && !connector)
+        return false;
+    if (data && !data->isEmpty()) {
+        writeQueue.push_back(WriteSegment());
+        writeQueue.back().shared = data;
+        enqueued(data->size());
+        queuedMemoryChanged(data->size());
+    }
+    // the watermarks are checked on uncork() so a corked batch isn't
+    // interrupted
+    if (corked)
+        return true;
+    if (writeWait || connector || handshaking) {
+        checkWatermarks();
+        return true;
+    }
+    const bool ret = flushWriteQueue(0, 0, 0, 0);
+    checkWatermarks();
+    return ret;
+}
 
-        if (fd == -1 || !data) {
-            return fd != -1;
+bool SocketClient::sendFile(const Path& path, uint64_t offset, int64_t length)
+{
+    if ((fd == -1 && !connector) || socketMode & Udp)
+        return false;
+    int file;
+    eintrwrap(file, ::open(path.constData(), O_RDONLY | O_CLOEXEC));
+    if (file == -1) {
+        ::error() << "Couldn't open" << path << "to send it" << Rct::strerror();
+        return false;
+    }
+    const bool ret = sendFile(file, offset, length);
+    ::close(file);
+    return ret;
+}
+
+bool SocketClient::sendFile(int file, uint64_t offset, int64_t length)
+{
+    if ((fd == -1 && !connector) || socketMode & Udp)
+        return false;
+    const int dup = ::fcntl(file, F_DUPFD_CLOEXEC, 0);
+    if (dup == -1) {
+        ::error() << "Couldn't dup file to send" << Rct::strerror();
+        return false;
+    }
+    if (!queueFile(dup, offset, length))
+        return false;
+    if (corked)
+        return true;
+    if (writeWait || connector || handshaking) {
+        checkWatermarks();
+        return true;
+    }
+    const bool ret = flushWriteQueue(0, 0, 0, 0);
+    checkWatermarks();
+    return ret;
+}
+
+bool SocketClient::writeDescriptors(const int* fds, int count, const void* data, unsigned int size)
+{
+    if (fd == -1 || !(socketMode & Unix) || !size || count <= 0 || count > MaxDescriptors)
+        return false;
+    std::shared_ptr<Descriptors> descriptors = std::make_shared<Descriptors>();
+    for (int i = 0; i < count; ++i) {
+        const int dup = ::fcntl(fds[i], F_DUPFD_CLOEXEC, 0);
+        if (dup == -1) {
+            ::error() << "Couldn't dup fd to pass" << fds[i] << Rct::strerror();
+            return false;
         }
-        total = 0;
+        descriptors->fds.push_back(dup);
+    }
+    writeQueue.push_back(WriteSegment());
+    writeQueue.back().owned.append(data, size);
+    writeQueue.back().descriptors = descriptors;
+    enqueued(size);
+    if (corked)
+        return true;
+    if (writeWait || handshaking) {
+        checkWatermarks();
+        return true;
+    }
+    const bool ret = flushWriteQueue(0, 0, 0, 0);
+    checkWatermarks();
+    return ret;
+}
 
-        assert(data != 0 && size > 0);
+List<int> SocketClient::takeDescriptors(int count)
+{
+    if (count < 0 || count >= receivedFds.size()) {
+        List<int> ret;
+        std::swap(ret, receivedFds);
+        return ret;
+    }
+    const List<int> ret = receivedFds.mid(0, count);
+    receivedFds.remove(0, count);
+    return ret;
+}
 
-        if (writeBuffer.isEmpty()) {
-            for (;;) {
-                assert(size > total);
-                if (resolver.addr) {
-                    eintrwrap(e, ::sendto(fd, data + total, size - total,
-                                          sendFlags, resolver.addr, resolver.size));
-                } else {
-                    eintrwrap(e, ::write(fd, data + total, size - total));
-                }
-                if (e == -1) {
-                    if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                        if (wMode == Synchronous) {
-                            if (EventLoop::SharedPtr loop = EventLoop::eventLoop()) {
-                                // store the rest
-                                const unsigned int rem = size - total;
-                                writeBuffer.reserve(writeBuffer.size() + rem);
-                                memcpy(writeBuffer.end(), data + total, rem);
-                                writeBuffer.resize(writeBuffer.size() + rem);
-
-                                (void)loop->processSocket(fd);
-                                return isConnected();
-                            }
-                        }
-                        assert(!writeWait);
-                        if (EventLoop::SharedPtr loop = EventLoop::eventLoop()) {
-                            loop->updateSocket(fd, EventLoop::SocketRead|EventLoop::SocketWrite|EventLoop::SocketOneShot);
-                            writeWait = true;
-                        }
-                        break;
-                    } else {
-                        // bad
-                        signalError(shared_from_this(), WriteError);
-                        close();
-                        return false;
-                    }
-                }
-                signalBytesWritten(socketPtr, e);
-                total += e;
-                assert(total <= size);
-                if (total == size) {
-                    // we're done
-                    return true;
-                }
-            }
+// picks the fds passed to us out of what recvmsg() got
+void SocketClient::receiveDescriptors(const msghdr& msg)
+{
+    if (msg.msg_flags & MSG_CTRUNC)
+        ::warning() << "More fds were passed than there was room for, some are lost";
+    for (cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(const_cast<msghdr*>(&msg), cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+            continue;
+        const int count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        const unsigned char* data = CMSG_DATA(cmsg);
+        for (int i = 0; i < count; ++i) {
+            int f;
+            memcpy(&f, data + i * sizeof(int), sizeof(int));
+#ifndef MSG_CMSG_CLOEXEC
+            setFlags(f, FD_CLOEXEC, F_GETFD, F_SETFD);
+#endif
+            receivedFds.append(f);
         }
     }
+}
 
-    if (total < size) {
-        // store the rest
-        const unsigned int rem = size - total;
-        writeBuffer.reserve(writeBuffer.size() + rem);
-        memcpy(writeBuffer.end(), data + total, rem);
-        writeBuffer.resize(writeBuffer.size() + rem);
+// takes file, as file segments of at most a gigabyte each
+bool SocketClient::queueFile(int file, uint64_t offset, int64_t length)
+{
+    const std::shared_ptr<FileSource> source = std::make_shared<FileSource>(file);
+    if (length < 0) {
+        struct stat st;
+        if (::fstat(file, &st) == -1) {
+            ::error() << "Couldn't stat file to send" << Rct::strerror();
+            return false;
+        }
+        if (static_cast<uint64_t>(st.st_size) < offset) {
+            ::error() << "Offset" << offset << "is past the end of the file to send";
+            return false;
+        }
+        length = st.st_size - offset;
+    }
+    enum { MaxFileSegment = 1024 * 1024 * 1024 };
+    while (length > 0) {
+        const unsigned int size = std::min<int64_t>(length, MaxFileSegment);
+        writeQueue.push_back(WriteSegment());
+        WriteSegment& segment = writeQueue.back();
+        segment.file = source;
+        segment.fileOffset = offset;
+        segment.fileSize = size;
+        enqueued(size);
+        offset += size;
+        length -= size;
     }
     return true;
 }
 
-bool SocketClient::write(const void *data, unsigned int size)
+// Reads the start of the file segment at the front into a segment of its
+// own ahead of it, for when the kernel can't send the file for us. A chunk
+// at a time so a big file isn't all in memory.
+bool SocketClient::readFileChunk()
 {
-    return writeTo(String(), 0, reinterpret_cast<const unsigned char*>(data), size);
+    enum { FileChunk = 64 * 1024 };
+    WriteSegment& front = writeQueue.front();
+    assert(front.file);
+    Buffer chunk(MemoryMonitor::SocketWriteQueues, Buffer::Pooled);
+    chunk.resize(std::min<unsigned int>(front.size(), FileChunk));
+    ssize_t r;
+    eintrwrap(r, ::pread(front.file->fd, chunk.data(), chunk.size(), front.fileOffset + front.offset));
+    if (r <= 0) {
+        if (r) {
+            ::error() << "Couldn't read file to send" << Rct::strerror();
+        } else {
+            ::error() << "File being sent ended early";
+        }
+        return false;
+    }
+    chunk.resize(r);
+    front.offset += r;
+    if (!front.size())
+        writeQueue.pop_front();
+    writeQueue.push_front(WriteSegment());
+    writeQueue.front().owned = std::move(chunk);
+    return true;
+}
+
+bool SocketClient::uncork()
+{
+    if (!corked)
+        return isConnected();
+    corked = false;
+    // if we're waiting for the socket to become writable the queued data
+    // goes out from socketCallback()
+    if (fd == -1 || writeWait || handshaking) {
+        checkWatermarks();
+        return isConnected();
+    }
+    const bool ret = flushWriteQueue(0, 0, 0, 0);
+    checkWatermarks();
+    return ret;
 }
 
 static String addrToString(const sockaddr* addr, bool IPv6)
@@ -546,33 +1705,54 @@ void SocketClient::socketCallback(int f, int mode)
 
     if (writeWait && (mode & EventLoop::SocketWrite)) {
         if (EventLoop::SharedPtr loop = EventLoop::eventLoop()) {
-            loop->updateSocket(fd, EventLoop::SocketRead);
             writeWait = false;
+            loop->updateSocket(fd, eventMode());
         }
     }
 
+    if (handshaking && socketState == Connected) {
+        // whatever the handshake wants, once it's done anything that came
+        // with it is read below
+        if (!tlsHandshake() || handshaking)
+            return;
+    }
+
     sockaddr_in fromAddr4;
     sockaddr_in6 fromAddr6;
     sockaddr* fromAddr = 0;
     socklen_t fromLen = 0;
     const bool isIPv6 = socketMode & IPv6;
 
-    if (mode & EventLoop::SocketRead) {
+    if (tls && tls->readWantsWrite && mode & EventLoop::SocketWrite) {
+        // what SSL_read() was waiting for, try it again
+        tls->readWantsWrite = false;
+        mode |= EventLoop::SocketRead;
+    }
+
+    // a suspended socket can still report a hangup, that's picked up again
+    // once reading resumes
+    if (mode & EventLoop::SocketRead && !readSuspended && readBatch && socketMode & Udp) {
+        if (!readDatagrams())
+            return;
+    } else if (mode & EventLoop::SocketRead && !readSuspended) {
 
         enum { BlockSize = 1024, AllocateAt = 512 };
+        // reads that don't fit what's reserved in readBuffer spill over
+        // into this, so a big burst takes one syscall without every small
+        // read paying for a big reservation
+        enum { SpillSize = 64 * 1024 };
+        char spill[SpillSize];
         int e;
 
         unsigned int total = 0;
+        bool budgetLeft = true;
         for(;;) {
-            unsigned int rem = readBuffer.capacity() - readBuffer.size();
-            // printf("reading, remaining size %u\n", rem);
-            if (rem <= AllocateAt) {
-                // printf("allocating more\n");
-                readBuffer.reserve(readBuffer.size() + BlockSize);
-                rem = readBuffer.capacity() - readBuffer.size();
-                // printf("Rem is now %d\n", rem);
-            }
             if (socketMode & Udp) {
+                unsigned int rem = readBuffer.capacity() - readBuffer.size();
+                if (rem <= AllocateAt) {
+                    readBuffer.reserve(readBuffer.size() + BlockSize);
+                    rem = readBuffer.capacity() - readBuffer.size();
+                }
                 if (isIPv6) {
                     fromLen = sizeof(fromAddr6);
                     fromAddr = reinterpret_cast<sockaddr*>(&fromAddr6);
@@ -582,8 +1762,69 @@ void SocketClient::socketCallback(int f, int mode)
                     fromAddr = reinterpret_cast<sockaddr*>(&fromAddr4);
                     eintrwrap(e, ::recvfrom(fd, readBuffer.end(), rem, 0, fromAddr, &fromLen));
                 }
+                countRead(e);
+                if (e > 0) {
+                    readBuffer.resize(e);
+                    signalReadyReadFrom(socketPtr, addrToString(fromAddr, isIPv6), addrToPort(fromAddr, isIPv6), std::move(readBuffer));
+                    readBuffer.clear();
+                    continue;
+                }
             } else {
-                eintrwrap(e, ::read(fd, readBuffer.end(), rem));
+                unsigned int rem = readBuffer.capacity() - readBuffer.size();
+                if (rem < readChunk / 2) {
+                    readBuffer.reserve(readBuffer.size() + readChunk);
+                    rem = readBuffer.capacity() - readBuffer.size();
+                }
+                iovec iov[2];
+                iov[0].iov_base = readBuffer.end();
+                iov[0].iov_len = rem;
+                iov[1].iov_base = spill;
+                iov[1].iov_len = SpillSize;
+                if (tls) {
+                    e = tlsRead(iov[0].iov_base, iov[0].iov_len);
+                } else if (socketMode & Unix) {
+                    // there may be fds coming with it
+                    char control[CMSG_SPACE(sizeof(int) * MaxDescriptors)];
+                    msghdr msg;
+                    memset(&msg, 0, sizeof(msg));
+                    msg.msg_iov = iov;
+                    msg.msg_iovlen = 2;
+                    msg.msg_control = control;
+                    msg.msg_controllen = sizeof(control);
+#ifdef MSG_CMSG_CLOEXEC
+                    eintrwrap(e, ::recvmsg(fd, &msg, MSG_CMSG_CLOEXEC));
+#else
+                    eintrwrap(e, ::recvmsg(fd, &msg, 0));
+#endif
+                    if (e > 0 && msg.msg_controllen)
+                        receiveDescriptors(msg);
+                } else {
+                    eintrwrap(e, ::readv(fd, iov, 2));
+                }
+                countRead(e);
+                if (e > 0) {
+                    const unsigned int size = readBuffer.size();
+                    const unsigned int got = e;
+                    if (got <= rem) {
+                        readBuffer.resize(size + got);
+                    } else {
+                        readBuffer.reserve(size + got);
+                        readBuffer.resize(size + got);
+                        memcpy(readBuffer.data() + size + rem, spill, got - rem);
+                        // spilling means the reads come in bigger than we
+                        // reserve for
+                        if (readChunk < MaxReadChunk)
+                            readChunk *= 2;
+                    }
+                    total += got;
+                    if (maxRead && total >= maxRead) {
+                        budgetLeft = false;
+                        break;
+                    }
+                    // even after a short read, a hangup that came with the
+                    // data is only seen by reading on
+                    continue;
+                }
             }
             if (e == -1) {
                 if (errno == EAGAIN || errno == EWOULDBLOCK) {
@@ -594,31 +1835,46 @@ void SocketClient::socketCallback(int f, int mode)
                     close();
                     return;
                 }
-            } else if (e == 0) {
+            } else {
+                assert(e == 0);
                 // socket closed
                 if (total) {
                     if (!fromLen)
-                        signalReadyRead(socketPtr, std::move(readBuffer));
+                        deliverRead(socketPtr);
                 }
                 signalDisconnected(socketPtr);
                 close();
                 return;
-            } else if (fromLen) {
-                readBuffer.resize(e);
-                signalReadyReadFrom(socketPtr, addrToString(fromAddr, isIPv6), addrToPort(fromAddr, isIPv6), std::move(readBuffer));
-                readBuffer.clear();
-            } else {
-                total += e;
-                readBuffer.resize(total);
             }
         }
-        assert(total <= readBuffer.capacity());
+        // wakeups that only see a little make the next reservation smaller
+        if (!fromLen && total < readChunk / 4 && readChunk > MinReadChunk)
+            readChunk /= 2;
+#ifdef TCP_QUICKACK
+        if (total && socketOptions.quickAck == 1 && socketMode & Tcp) {
+            const int on = 1;
+            ::setsockopt(fd, IPPROTO_TCP, TCP_QUICKACK, &on, sizeof(on));
+        }
+#endif
         if (!fromLen)
-            signalReadyRead(socketPtr, std::move(readBuffer));
+            deliverRead(socketPtr);
 
-        if (writeWait) {
+        // with the budget spent there's more to read, arming the socket
+        // again gets us back here after everyone else has had a go
+        if (fd != -1 && (writeWait || !budgetLeft)) {
             if (EventLoop::SharedPtr loop = EventLoop::eventLoop()) {
-                loop->updateSocket(fd, EventLoop::SocketRead|EventLoop::SocketWrite|EventLoop::SocketOneShot);
+                loop->updateSocket(fd, eventMode());
+                // unless it's decrypted already, then the socket may have
+                // nothing left to tell us about
+                if (!budgetLeft && tls && SSL_pending(tls->ssl) > 0) {
+                    const WeakPtr weak = socketPtr;
+                    loop->callLater([weak]() {
+                        if (SocketClient::SharedPtr socket = weak.lock()) {
+                            if (socket->fd != -1)
+                                socket->socketCallback(socket->fd, EventLoop::SocketRead);
+                        }
+                    });
+                }
             }
         }
     }
@@ -635,8 +1891,9 @@ void SocketClient::socketCallback(int f, int mode)
             }
             if (!err) {
                 // connected
-                socketState = Connected;
-                signalConnected(socketPtr);
+                established();
+                if (fd == -1)
+                    return;
             } else {
                 // failed to connect
                 signalError(socketPtr, ConnectError);
@@ -679,6 +1936,7 @@ bool SocketClient::init(unsigned int mode)
 #ifdef HAVE_CLOEXEC
     setFlags(fd, FD_CLOEXEC, F_GETFD, F_SETFD);
 #endif
+    applyOptions(fd, socketOptions, mode & Tcp);
     if (!blocking) {
         if (EventLoop::SharedPtr loop = EventLoop::eventLoop()) {
             loop->registerSocket(fd, EventLoop::SocketRead,
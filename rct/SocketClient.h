@@ -3,9 +3,16 @@
 
 #include "SignalSlot.h"
 #include "Buffer.h"
+#include "HostResolver.h"
+#include "List.h"
+#include "Path.h"
 #include "String.h"
+#include <deque>
 #include <memory>
 
+class TlsContext;
+struct msghdr;
+
 class SocketClient : public std::enable_shared_from_this<SocketClient>
 {
 public:
@@ -18,28 +25,52 @@ public:
         Udp = 0x2,
         Unix = 0x4,
         IPv6 = 0x8,
-        Blocking = 0x10
+        Blocking = 0x10,
+        // the fd is non-blocking and close-on-exec already, as accept4()
+        // leaves them, so the flags don't have to be set again
+        FlagsSet = 0x20
     };
 
     SocketClient(unsigned int mode = 0);
     SocketClient(int fd, unsigned int mode);
     ~SocketClient();
 
-    int takeFD() { const int f = fd; fd = -1; return f; }
+    // gives up the socket without closing it, it's not watched anymore and
+    // whatever is queued for it is dropped
+    int takeFD();
 
     enum State { Disconnected, Connecting, Connected };
     State state() const { return socketState; }
     unsigned int mode() const { return socketMode; }
 
     bool connect(const String& path); // UNIX
-    bool connect(const String& host, uint16_t port); // TCP
+    // TCP. A host name is looked up through HostResolver without blocking
+    // the event loop and its addresses are tried as in RFC 8305, the next
+    // one started if the last hasn't connected within AttemptDelay ms. The
+    // first to connect is kept. Writes are queued until then.
+    enum { AttemptDelay = 250 };
+    bool connect(const String& host, uint16_t port);
     bool bind(uint16_t port); // UDP
 
+    // TLS 1.3 on a TCP socket, with context's certificates and sessions.
+    // Can be called right after connect(), the handshake starts once the
+    // socket is connected and connected() is only emitted when it's done,
+    // anything written before that is queued. Clients send serverName as
+    // SNI, check the certificate against it and resume sessions by it and
+    // the port. A server context takes the server side, see
+    // SocketServer::setTls(). With kTLS the kernel encrypts what's written
+    // and writes take the plain socket path again
+    bool startTls(const std::shared_ptr<TlsContext>& context, const String& serverName = String());
+    bool isTls() const { return tls.get() != 0; }
+    bool isKernelTls() const;
+    // the handshake resumed an earlier session
+    bool isTlsResumed() const;
+
     String hostName() const { return (socketMode & Tcp ? address : String()); }
     String path() const { return (socketMode & Unix ? address : String()); }
     uint16_t port() const { return socketPort; }
 
-    bool isConnected() const { return fd != -1; }
+    bool isConnected() const { return fd != -1 || connector; }
     int socket() const { return fd; }
 
     enum WriteMode {
@@ -53,7 +84,116 @@ public:
 
     // TCP/UNIX
     bool write(const void *data, unsigned int num);
+
+    // While corked, write() only queues the data. uncork() sends everything
+    // queued since cork() in as few writes as the socket allows.
+    void cork() { corked = true; }
+    bool uncork();
+    bool isCorked() const { return corked; }
     bool write(const String &data) { return write(&data[0], data.size()); }
+    // queues data by reference, it's kept alive until it has been written
+    bool write(const std::shared_ptr<const String> &data);
+
+    // TCP/UNIX. Queues length bytes of the file from offset, or the rest
+    // of it with length -1, to go out in order with everything else
+    // written. They're copied to the socket by the kernel with sendfile()
+    // rather than read into memory, that includes kTLS sockets, with TLS
+    // otherwise the file is read in chunks as the socket takes them. The
+    // file is kept open until it's been sent, an fd passed in is dup()ed.
+    // The file shouldn't shrink meanwhile, running out of it early is a
+    // WriteError
+    bool sendFile(const Path& path, uint64_t offset = 0, int64_t length = -1);
+    bool sendFile(int fd, uint64_t offset, int64_t length);
+
+    // UNIX. Passes copies of fds to the other process with SCM_RIGHTS,
+    // along with data, which can't be empty. They go out in order with
+    // everything else written and turn up at the other end with the first
+    // byte of data, so they're there by the time data has been read. What
+    // comes in is kept, close-on-exec, until taken with takeDescriptors(),
+    // and closed with the socket if it isn't.
+    enum { MaxDescriptors = 64 };
+    bool writeDescriptors(const int* fds, int count, const void* data, unsigned int size);
+    // count -1 takes them all, oldest first
+    List<int> takeDescriptors(int count = -1);
+    int descriptorCount() const { return receivedFds.size(); }
+
+    // bytes queued but not written yet
+    unsigned int pendingWrite() const { return queuedBytes; }
+
+    // What this socket has done since it was created, a datagram batch
+    // counts as one syscall. The totals of every socket are in IoStats
+    struct Stats
+    {
+        Stats()
+            : bytesRead(0), bytesWritten(0), reads(0), writes(0), readsWouldBlock(0),
+              writesWouldBlock(0), partialWrites(0), peakPendingWrite(0)
+        {}
+
+        uint64_t bytesRead, bytesWritten;
+        // syscalls
+        uint64_t reads, writes;
+        // reads and writes that got EAGAIN
+        uint64_t readsWouldBlock, writesWouldBlock;
+        // writes the socket only took part of
+        uint64_t partialWrites;
+        // the most pendingWrite() has been
+        unsigned int peakPendingWrite;
+    };
+    const Stats& stats() const { return ioStats; }
+
+    // Flow control. Once high or more bytes are queued writeBlocked() is
+    // emitted and isWriteBlocked() stays true until the queue is down to low
+    // bytes, then writeUnblocked() is emitted. Nothing is ever refused, the
+    // writer is expected to back off while blocked. high 0, the default,
+    // turns it off.
+    void setWatermarks(unsigned int high, unsigned int low);
+    unsigned int highWatermark() const { return highMark; }
+    unsigned int lowWatermark() const { return lowMark; }
+    bool isWriteBlocked() const { return writeIsBlocked; }
+
+    // Limit on the bytes queued by all clients together, on all threads.
+    // While the total is at or over it a client that has anything queued is
+    // write blocked, until it's down to its low watermark and the total is
+    // under the limit or until its queue is empty. 0, the default, means no
+    // limit.
+    static void setWriteBudget(size_t bytes);
+    static size_t writeBudget();
+    static size_t totalPendingWrite();
+
+    // Socket options, set on the socket now if there is one and on the ones
+    // connect() makes from then on. Fields left Unset aren't touched, and
+    // setOptions() only changes the fields that are set. The TCP ones are
+    // skipped for UNIX sockets, the ones the platform doesn't have are
+    // ignored. False if the kernel refused one.
+    struct Options
+    {
+        enum { Unset = -1 };
+        Options()
+            : noDelay(Unset), quickAck(Unset), sendBuffer(Unset), receiveBuffer(Unset), busyPoll(Unset)
+        {}
+
+        // TCP_NODELAY, 1 sends small writes right away instead of holding
+        // them back until what's in flight has been ACKed (Nagle)
+        int noDelay;
+        // TCP_QUICKACK, 1 ACKs right away rather than delaying the ACK in
+        // the hope of sending it with data. Linux drops it now and then, it's
+        // set again after every read
+        int quickAck;
+        // SO_SNDBUF and SO_RCVBUF in bytes
+        int sendBuffer, receiveBuffer;
+        // SO_BUSY_POLL, microseconds to busy poll the device for when a read
+        // would otherwise block
+        int busyPoll;
+    };
+    bool setOptions(const Options& options);
+    const Options& options() const { return socketOptions; }
+    // sets the fields of options that are set on f
+    static bool applyOptions(int f, const Options& options, bool tcp);
+
+    // Stops reading from the socket until resumed. What the peer sends in
+    // the meantime stays in the kernel and eventually stalls the peer
+    void setReadSuspended(bool suspended);
+    bool isReadSuspended() const { return readSuspended; }
 
     String peerName(uint16_t* port = 0) const;
     String peerString() const
@@ -83,20 +223,74 @@ public:
         return writeTo(host, port, reinterpret_cast<const unsigned char*>(&data[0]), data.size());
     }
 
+    // UDP batches. A datagram's bytes and address belong to whoever hands
+    // it out, for readyReadBatch() they're only valid during the emit
+    struct Datagram
+    {
+        const unsigned char* data;
+        unsigned int size;
+        // the sender, or where to send it
+        const HostResolver::Address* address;
+        // the datagram was bigger than a slot and got cut short
+        bool truncated;
+    };
+
+    // Once bound, count datagrams at a time are received with recvmmsg()
+    // into a slab of count slots of datagramSize bytes allocated up front,
+    // and handed out through readyReadBatch() rather than one
+    // readyReadFrom() each. With gro the kernel may coalesce datagrams from
+    // one sender into a slot (UDP_GRO), they're split up again before
+    // delivery, slots should be 64k for that to pay off. count 0 goes
+    // back to readyReadFrom()
+    enum { DefaultDatagramSize = 2048 };
+    bool setReadBatch(unsigned int count, unsigned int datagramSize = DefaultDatagramSize, bool gro = false);
+    unsigned int readBatchSize() const;
+
+    // as many as the socket takes with sendmmsg(), the number sent or -1
+    // on error. Nothing is queued, if the socket buffer is full the rest
+    // is left to the caller
+    int writeTo(const Datagram* datagrams, int count);
+    // data cut into datagrams of segmentSize bytes, the last one may be
+    // shorter, all going to address. Segmented by the kernel, or the
+    // device, with UDP GSO where there is that and sent as a sendmmsg()
+    // batch where not
+    bool writeSegmented(const HostResolver::Address& address, const unsigned char* data, unsigned int size, unsigned int segmentSize);
+
     // UDP Multicast
     bool addMembership(const String& ip);
     bool dropMembership(const String& ip);
     void setMulticastLoop(bool loop);
     void setMulticastTTL(unsigned char ttl);
 
+    // At most this many bytes are read per wakeup before the socket goes
+    // back to the event loop, so one busy peer can't starve the others. 0
+    // reads until the socket is drained.
+    enum { DefaultReadBudget = 1024 * 1024 };
+    void setReadBudget(unsigned int bytes) { maxRead = bytes; }
+    unsigned int readBudget() const { return maxRead; }
+
     const Buffer& buffer() const { return readBuffer; }
     Buffer&& takeBuffer() { return std::move(readBuffer); }
 
+    // One reader can wait for data without a readyRead() connection, see
+    // Rct::readable(). It's called straight from the socket callback, in
+    // place of readyRead() being emitted, with what was read left in
+    // buffer(), or when the client closes. It's cleared before it's called.
+    typedef void (*ReadWaiter)(void* userData);
+    void setReadWaiter(ReadWaiter waiter, void* userData)
+    {
+        readWaiter = waiter;
+        readWaiterData = userData;
+    }
+
     Signal<std::function<void(const SocketClient::SharedPtr&, Buffer&&)> >& readyRead() { return signalReadyRead; }
     Signal<std::function<void(const SocketClient::SharedPtr&, const String&, uint16_t, Buffer&&)> >& readyReadFrom() { return signalReadyReadFrom; }
+    Signal<std::function<void(const SocketClient::SharedPtr&, const Datagram*, int)> >& readyReadBatch() { return signalReadyReadBatch; }
     Signal<std::function<void(const SocketClient::SharedPtr&)> >& connected() { return signalConnected; }
     Signal<std::function<void(const SocketClient::SharedPtr&)> >& disconnected() { return signalDisconnected; }
     Signal<std::function<void(const SocketClient::SharedPtr&, int)> >& bytesWritten() { return signalBytesWritten; }
+    Signal<std::function<void(const SocketClient::SharedPtr&)> >& writeBlocked() { return signalWriteBlocked; }
+    Signal<std::function<void(const SocketClient::SharedPtr&)> >& writeUnblocked() { return signalWriteUnblocked; }
 
     enum Error {
         InitializeError,
@@ -105,7 +299,8 @@ public:
         BindError,
         ReadError,
         WriteError,
-        EventLoopError
+        EventLoopError,
+        TlsError
     };
     Signal<std::function<void(const SocketClient::SharedPtr&, Error)> >& error() { return signalError; }
 
@@ -121,20 +316,121 @@ private:
     unsigned int socketMode;
     WriteMode wMode;
     bool writeWait;
+    bool corked;
+    bool readSuspended;
+    bool writeIsBlocked;
+    unsigned int highMark, lowMark;
+    unsigned int queuedBytes;
+    // of queuedBytes, the ones in strings shared with whoever wrote them,
+    // the segments' own Buffers count themselves
+    int64_t queuedMemory;
+    // how much room to make in readBuffer before reading, adapts to what
+    // the reads bring in
+    enum { MinReadChunk = 4096, MaxReadChunk = 256 * 1024 };
+    unsigned int readChunk, maxRead;
     String address;
     bool blocking;
+    Options socketOptions;
+    Stats ioStats;
 
     Signal<std::function<void(const SocketClient::SharedPtr&, Buffer&&)> > signalReadyRead;
     Signal<std::function<void(const SocketClient::SharedPtr&, const String&, uint16_t, Buffer&&)> > signalReadyReadFrom;
+    Signal<std::function<void(const SocketClient::SharedPtr&, const Datagram*, int)> > signalReadyReadBatch;
     Signal<std::function<void(const SocketClient::SharedPtr&)> >signalConnected, signalDisconnected;
+    Signal<std::function<void(const SocketClient::SharedPtr&)> > signalWriteBlocked, signalWriteUnblocked;
     Signal<std::function<void(const SocketClient::SharedPtr&, Error)> > signalError;
     Signal<std::function<void(const SocketClient::SharedPtr&, int)> > signalBytesWritten;
-    Buffer readBuffer, writeBuffer;
+    Buffer readBuffer;
+    ReadWaiter readWaiter;
+    void* readWaiterData;
+    // either wakes the read waiter or emits readyRead()
+    void deliverRead(const SocketClient::SharedPtr& socketPtr);
+    void wakeReadWaiter();
+    // passed to us over a UNIX socket
+    List<int> receivedFds;
 
+    // pending output, flushed front to back with one sendmsg() per batch,
+    // or one sendfile() for a file segment
+    struct FileSource;
+    struct Descriptors;
+    struct WriteSegment
+    {
+        WriteSegment()
+            : owned(MemoryMonitor::SocketWriteQueues, Buffer::Pooled), offset(0), fileOffset(0), fileSize(0)
+        {
+        }
+
+        const char* data() const
+        {
+            return (shared ? shared->constData() : reinterpret_cast<const char*>(owned.data())) + offset;
+        }
+        unsigned int size() const
+        {
+            if (file)
+                return fileSize - offset;
+            return (shared ? shared->size() : owned.size()) - offset;
+        }
+        // what it holds in memory for queuedMemory, owned counts itself
+        unsigned int memory() const
+        {
+            return shared ? shared->size() : 0;
+        }
+
+        // either a string we only reference or bytes we own, in a chunk
+        // from BufferPool
+        std::shared_ptr<const String> shared;
+        Buffer owned;
+        unsigned int offset;
+        // or fileSize bytes of a file from fileOffset, big files take
+        // several segments
+        std::shared_ptr<FileSource> file;
+        uint64_t fileOffset;
+        unsigned int fileSize;
+        // fds to send with the first byte, writeDescriptors()
+        std::shared_ptr<Descriptors> descriptors;
+    };
+    std::deque<WriteSegment> writeQueue;
+
+    void queueData(const unsigned char *data, unsigned int size);
+    void enqueued(unsigned int size);
+    // the bytes the queue holds in memory went up or down by delta
+    void queuedMemoryChanged(int64_t delta)
+    {
+        queuedMemory += delta;
+        MemoryMonitor::add(MemoryMonitor::SocketWriteQueues, delta);
+    }
+    // after a read or write syscall that returned e, bytes or -1
+    void countRead(int e);
+    void countWrite(int e, size_t wanted);
+    bool queueFile(int file, uint64_t offset, int64_t length);
+    bool readFileChunk();
+    void reset(bool closeSocket);
+    void receiveDescriptors(const msghdr& msg);
+    void dequeued(unsigned int size);
+    void checkWatermarks();
+    unsigned int eventMode() const;
+    bool flushWriteQueue(const void *addr, size_t addrSize, const unsigned char *data, unsigned int size);
     int writeData(const unsigned char *data, int size);
     void socketCallback(int, int);
 
-    friend class Resolver;
+    struct Connector;
+    std::shared_ptr<Connector> connector;
+    void connectNext();
+    void attemptCallback(int f, unsigned int mode);
+    void connectedTo(int f, int family);
+
+    struct ReadBatch;
+    std::unique_ptr<ReadBatch> readBatch;
+    bool readDatagrams();
+
+    struct Tls;
+    std::unique_ptr<Tls> tls;
+    // writes are held back until the TLS handshake is done
+    bool handshaking;
+    void established();
+    bool tlsHandshake();
+    int tlsRead(void* data, int size);
+    int tlsWrite(const void* data, int size);
 };
 
 #endif
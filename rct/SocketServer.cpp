@@ -2,6 +2,7 @@
 #include "EventLoop.h"
 #include "Rct.h"
 #include <rct-config.h>
+#include <algorithm>
 #include <assert.h>
 #include <unistd.h>
 #include <fcntl.h>
@@ -10,6 +11,7 @@
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <netdb.h>
 
 #include "Log.h"
@@ -20,12 +22,31 @@
     } while (VAR == -1 && errno == EINTR)
 
 SocketServer::SocketServer()
-    : fd(-1), isIPv6(false)
+    : fd(-1), isIPv6(false), balance(EventLoopGroup::RoundRobin), handoff(new Handoff(this))
 {}
 
 SocketServer::~SocketServer()
 {
     close();
+    std::unique_lock<std::mutex> lock(handoff->mutex);
+    handoff->server = 0;
+    // announces on other loops are using us, one on this thread is where
+    // we're being destroyed from and stops at its next check
+    const std::thread::id self = std::this_thread::get_id();
+    handoff->announced.wait(lock, [this, self]() {
+            for (const std::thread::id &id : handoff->announcing) {
+                if (id != self)
+                    return false;
+            }
+            return true;
+        });
+    for (auto &it : handoff->accepted) {
+        while (!it.second.empty()) {
+            ::close(it.second.front());
+            it.second.pop();
+        }
+    }
+    handoff->accepted.clear();
 }
 
 void SocketServer::close()
@@ -42,7 +63,7 @@ void SocketServer::close()
     }
 }
 
-bool SocketServer::listen(uint16_t port, Mode mode)
+bool SocketServer::listen(uint16_t port, unsigned int mode)
 {
     close();
 
@@ -73,9 +94,36 @@ bool SocketServer::listen(uint16_t port, Mode mode)
         close();
         return false;
     }
+    if (mode & ReusePort) {
+#ifdef SO_REUSEPORT
+        e = ::setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &flags, sizeof(int));
+#else
+        e = -1;
+#endif
+        if (e == -1) {
+            serverError(this, InitializeError);
+            close();
+            return false;
+        }
+    }
+    if (mode & DeferAccept) {
+#ifdef TCP_DEFER_ACCEPT
+        // seconds to wait for data before accepting anyway
+        int timeout = 1;
+        if (::setsockopt(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &timeout, sizeof(timeout)) == -1)
+            warning() << "Can't set TCP_DEFER_ACCEPT" << Rct::strerror();
+#endif
+    }
 #ifdef HAVE_CLOEXEC
     SocketClient::setFlags(fd, FD_CLOEXEC, F_GETFD, F_SETFD);
 #endif
+    if (clientOpts.receiveBuffer != SocketClient::Options::Unset) {
+        // the window scale is settled in the handshake, before the
+        // accepted socket gets its options
+        SocketClient::Options listenOptions;
+        listenOptions.receiveBuffer = clientOpts.receiveBuffer;
+        SocketClient::applyOptions(fd, listenOptions, true);
+    }
 
     // ### support specific interfaces
     sockaddr_in addr4;
@@ -98,7 +146,18 @@ bool SocketServer::listen(uint16_t port, Mode mode)
         addr4.sin_port = htons(port);
     }
 
-    return commonListen(addr, size);
+    if (!commonListen(addr, size))
+        return false;
+    if (mode & FastOpen) {
+#ifdef TCP_FASTOPEN
+        // the length of the queue of connections with pending fast open
+        // data, it only works once we listen
+        int queue = 256;
+        if (::setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN, &queue, sizeof(queue)) == -1)
+            warning() << "Can't set TCP_FASTOPEN" << Rct::strerror();
+#endif
+    }
+    return true;
 }
 
 bool SocketServer::listen(const Path &p)
@@ -163,46 +222,129 @@ bool SocketServer::commonListen(sockaddr* addr, size_t size)
     return true;
 }
 
-SocketClient::SharedPtr SocketServer::nextConnection()
+void SocketServer::setEventLoopGroup(const EventLoopGroup::SharedPtr& g, EventLoopGroup::Balance b)
 {
-    if (accepted.empty())
-        return 0;
-    const int fd = accepted.front();
-    accepted.pop();
-    return SocketClient::SharedPtr(new SocketClient(fd, path.isEmpty() ? SocketClient::Tcp : SocketClient::Unix));
+    group = g;
+    balance = b;
 }
 
-void SocketServer::socketCallback(int /*fd*/, int mode)
+void SocketServer::handoffConnections(const std::weak_ptr<Handoff>& weak, const std::vector<int>& fds)
 {
-    sockaddr_in client4;
-    sockaddr_in6 client6;
-    sockaddr* client = 0;
-    socklen_t size = 0;
-    if (isIPv6) {
-        size = sizeof(client6);
-        client = reinterpret_cast<sockaddr*>(&client6);
-    } else {
-        size = sizeof(client4);
-        client = reinterpret_cast<sockaddr*>(&client4);
+    EventLoop* loop = EventLoop::eventLoop().get();
+    if (std::shared_ptr<Handoff> handoff = weak.lock()) {
+        bool alive;
+        {
+            std::lock_guard<std::mutex> lock(handoff->mutex);
+            if ((alive = handoff->server)) {
+                std::queue<int>& queue = handoff->accepted[loop];
+                for (int fd : fds)
+                    queue.push(fd);
+                // the server stays until we're done
+                handoff->announcing.push_back(std::this_thread::get_id());
+            }
+        }
+        // not with the mutex held, the slots call nextConnection()
+        if (alive) {
+            announce(handoff, loop, fds.size());
+            return;
+        }
     }
-    int e;
+    // the server is gone
+    for (int fd : fds)
+        ::close(fd);
+}
+
+void SocketServer::announce(const std::shared_ptr<Handoff>& handoff, EventLoop* loop, size_t count)
+{
+    // a slot may destroy the server, it's looked up again after each one
+    SocketServer* server = handoff->server;
+    server->serverNewConnections(server);
+    for (size_t left = count; left > 0; --left) {
+        {
+            std::lock_guard<std::mutex> lock(handoff->mutex);
+            server = handoff->server;
+            if (!server || handoff->accepted[loop].empty())
+                break;
+        }
+        server->serverNewConnection(server);
+    }
+    std::lock_guard<std::mutex> lock(handoff->mutex);
+    auto it = std::find(handoff->announcing.begin(), handoff->announcing.end(), std::this_thread::get_id());
+    assert(it != handoff->announcing.end());
+    handoff->announcing.erase(it);
+    handoff->announced.notify_all();
+}
+
+SocketClient::SharedPtr SocketServer::nextConnection()
+{
+    int fd;
+    {
+        // only what was accepted for this loop
+        std::lock_guard<std::mutex> lock(handoff->mutex);
+        auto it = handoff->accepted.find(EventLoop::eventLoop().get());
+        if (it == handoff->accepted.end() || it->second.empty())
+            return 0;
+        fd = it->second.front();
+        it->second.pop();
+    }
+    unsigned int mode = path.isEmpty() ? SocketClient::Tcp : SocketClient::Unix;
+#ifdef HAVE_ACCEPT4
+    mode |= SocketClient::FlagsSet;
+#endif
+    SocketClient::SharedPtr client(new SocketClient(fd, mode));
+    client->setOptions(clientOpts);
+    if (tls)
+        client->startTls(tls);
+    return client;
+}
 
+void SocketServer::socketCallback(int /*fd*/, int mode)
+{
     if (! ( mode & EventLoop::SocketRead ) )
         return;
 
+    // the whole backlog is taken in one go and handed out in one batch per
+    // loop, rather than one event per connection
+    std::vector<std::pair<EventLoop::SharedPtr, std::vector<int> > > handoffs;
+    std::vector<int> ours;
+    bool failed = false;
     for (;;) {
-        eintrwrap(e, ::accept(fd, client, &size));
+        int e;
+#ifdef HAVE_ACCEPT4
+        eintrwrap(e, ::accept4(fd, 0, 0, SOCK_NONBLOCK | SOCK_CLOEXEC));
+#else
+        eintrwrap(e, ::accept(fd, 0, 0));
+#endif
         if (e == -1) {
-            if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                return;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                failed = true;
+            break;
+        }
+
+        if (group) {
+            if (EventLoop::SharedPtr loop = group->nextLoop(balance)) {
+                auto it = handoffs.begin();
+                while (it != handoffs.end() && it->first != loop)
+                    ++it;
+                if (it == handoffs.end()) {
+                    handoffs.push_back(std::make_pair(loop, std::vector<int>()));
+                    it = handoffs.end() - 1;
+                }
+                it->second.push_back(e);
+                continue;
             }
-            serverError(this, AcceptError);
-            close();
-            return;
         }
+        ours.push_back(e);
+    }
 
-        //EventLoop::eventLoop()->unregisterSocket( fd );
-        accepted.push(e);
-        serverNewConnection(this);
+    for (auto& handoff : handoffs) {
+        handoff.first->callLater(std::bind(&SocketServer::handoffConnections, std::weak_ptr<Handoff>(this->handoff),
+                                           std::move(handoff.second)));
+    }
+    if (!ours.empty())
+        handoffConnections(handoff, ours);
+    if (failed) {
+        serverError(this, AcceptError);
+        close();
     }
 }
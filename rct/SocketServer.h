@@ -1,13 +1,21 @@
 #ifndef TCPSERVER_H
 #define TCPSERVER_H
 
+#include "EventLoopGroup.h"
 #include "SignalSlot.h"
 #include "SocketClient.h"
+#include <condition_variable>
+#include <map>
 #include <memory>
+#include <mutex>
 #include <rct/Path.h>
 #include <queue>
+#include <thread>
+#include <vector>
 
 struct sockaddr;
+class EventLoop;
+class TlsContext;
 
 class SocketServer
 {
@@ -18,30 +26,91 @@ public:
     SocketServer();
     ~SocketServer();
 
-    enum Mode { IPv4, IPv6 };
+    enum Mode {
+        IPv4 = 0x0,
+        IPv6 = 0x1,
+        // SO_REUSEPORT, lets a server per loop listen on the same port
+        ReusePort = 0x2,
+        // TCP_DEFER_ACCEPT, connections are only accepted once the client
+        // has sent something. Ignored where it doesn't exist
+        DeferAccept = 0x4,
+        // TCP_FASTOPEN, clients that have been here before can send data
+        // with the SYN. Ignored where it doesn't exist
+        FastOpen = 0x8
+    };
 
     void close();
-    bool listen(uint16_t port, Mode mode = IPv4); // TCP
+    bool listen(uint16_t port, unsigned int mode = IPv4); // TCP
     bool listen(const Path &path); // UNIX
     bool isListening() const { return fd != -1; }
 
     SocketClient::SharedPtr nextConnection();
 
+    // connections handed out by nextConnection() from now on speak TLS
+    // with context, a server one, see SocketClient::startTls(). Null goes
+    // back to plain connections
+    void setTls(const std::shared_ptr<TlsContext>& context) { tls = context; }
+
+    // options for the connections handed out by nextConnection() from now
+    // on, see SocketClient::setOptions(). A receive buffer should be set
+    // before listen(), the listening socket gets it too so the TCP window
+    // can be as big from the start
+    void setClientOptions(const SocketClient::Options& options) { clientOpts = options; }
+    const SocketClient::Options& clientOptions() const { return clientOpts; }
+
+    // Hand accepted connections to the loops of group. newConnection() is
+    // then emitted on the loop that got the connection and nextConnection()
+    // has to be called from the slot so the SocketClient ends up on that
+    // loop, it only hands out what was accepted for the loop it's called
+    // on. Pass a null group to go back to accepting on our own loop. The
+    // destructor waits for the group's loops to finish announcing, don't
+    // destroy the server from a slot while blocking another loop on it
+    void setEventLoopGroup(const EventLoopGroup::SharedPtr& group,
+                           EventLoopGroup::Balance balance = EventLoopGroup::RoundRobin);
+
+    // Everything accepted in one go is announced with one newConnections(),
+    // its slots are expected to call nextConnection() until it returns
+    // null. Whatever they leave is announced with a newConnection() per
+    // connection, like it always was. Connect to one or the other.
+    Signal<std::function<void(SocketServer*)> >& newConnections() { return serverNewConnections; }
     Signal<std::function<void(SocketServer*)> >& newConnection() { return serverNewConnection; }
 
     enum Error { InitializeError, BindError, ListenError, AcceptError };
     Signal<std::function<void(SocketServer*, Error)> >& error() { return serverError; }
 
 private:
+    // shared with the events carrying accepted fds to the group's loops,
+    // everything in it under mutex
+    struct Handoff
+    {
+        Handoff(SocketServer* s) : server(s) { }
+
+        std::mutex mutex;
+        SocketServer* server;
+        // accepted fds by the loop they're for
+        std::map<EventLoop*, std::queue<int> > accepted;
+        // a thread per announce() in progress, ~SocketServer() waits until
+        // the only ones left are its own
+        std::vector<std::thread::id> announcing;
+        std::condition_variable announced;
+    };
+
     void socketCallback(int fd, int mode);
     bool commonListen(sockaddr* addr, size_t size);
+    // on the loop the fds are for
+    static void handoffConnections(const std::weak_ptr<Handoff>& handoff, const std::vector<int>& fds);
+    static void announce(const std::shared_ptr<Handoff>& handoff, EventLoop* loop, size_t count);
 
 private:
     int fd;
     bool isIPv6;
     Path path;
-    std::queue<int> accepted;
-    Signal<std::function<void(SocketServer*)> > serverNewConnection;
+    EventLoopGroup::SharedPtr group;
+    EventLoopGroup::Balance balance;
+    std::shared_ptr<Handoff> handoff;
+    std::shared_ptr<TlsContext> tls;
+    SocketClient::Options clientOpts;
+    Signal<std::function<void(SocketServer*)> > serverNewConnections, serverNewConnection;
     Signal<std::function<void(SocketServer*, Error)> > serverError;
 };
 
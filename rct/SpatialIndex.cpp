@@ -0,0 +1,456 @@
+#include "SpatialIndex.h"
+#include <algorithm>
+#include <limits>
+#include <math.h>
+#include <queue>
+#include <vector>
+#if defined(__SSE2__)
+#  include <emmintrin.h>
+#endif
+
+static int32_t clamped(int64_t value)
+{
+    return static_cast<int32_t>(std::max<int64_t>(std::min<int64_t>(value, std::numeric_limits<int32_t>::max()),
+                                                  std::numeric_limits<int32_t>::min()));
+}
+
+// minX, minY, maxX, maxY, with negative sizes going the other way
+static void boxFor(const Rect &rect, int32_t *box)
+{
+    const int64_t x1 = static_cast<int64_t>(rect.x) + rect.w;
+    const int64_t y1 = static_cast<int64_t>(rect.y) + rect.h;
+    box[0] = clamped(std::min<int64_t>(rect.x, x1));
+    box[1] = clamped(std::min<int64_t>(rect.y, y1));
+    box[2] = clamped(std::max<int64_t>(rect.x, x1));
+    box[3] = clamped(std::max<int64_t>(rect.y, y1));
+}
+
+// a box that overlaps the ones touching or inside box, so within() can
+// find empty rects on its edges
+static void expanded(const int32_t *box, int32_t *ret)
+{
+    ret[0] = clamped(static_cast<int64_t>(box[0]) - 1);
+    ret[1] = clamped(static_cast<int64_t>(box[1]) - 1);
+    ret[2] = clamped(static_cast<int64_t>(box[2]) + 1);
+    ret[3] = clamped(static_cast<int64_t>(box[3]) + 1);
+}
+
+static inline bool isWithin(const SpatialBoxes &boxes, int idx, const int32_t *box)
+{
+    return boxes.minX[idx] >= box[0] && boxes.minY[idx] >= box[1] && boxes.maxX[idx] <= box[2] && boxes.maxY[idx] <= box[3];
+}
+
+void SpatialBoxes::clear()
+{
+    minX.clear();
+    minY.clear();
+    maxX.clear();
+    maxY.clear();
+}
+
+void SpatialBoxes::append(int32_t x0, int32_t y0, int32_t x1, int32_t y1)
+{
+    minX.append(x0);
+    minY.append(y0);
+    maxX.append(x1);
+    maxY.append(y1);
+}
+
+uint32_t SpatialBoxes::overlaps(int first, int count, const int32_t *query) const
+{
+    assert(count <= 32);
+    uint32_t mask = 0;
+    int i = 0;
+#if defined(__SSE2__)
+    const __m128i qMinX = _mm_set1_epi32(query[0]);
+    const __m128i qMinY = _mm_set1_epi32(query[1]);
+    const __m128i qMaxX = _mm_set1_epi32(query[2]);
+    const __m128i qMaxY = _mm_set1_epi32(query[3]);
+    for (; i + 4 <= count; i += 4) {
+        const int idx = first + i;
+        const __m128i x0 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(minX.data() + idx));
+        const __m128i y0 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(minY.data() + idx));
+        const __m128i x1 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(maxX.data() + idx));
+        const __m128i y1 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(maxY.data() + idx));
+        const __m128i hit = _mm_and_si128(_mm_and_si128(_mm_cmplt_epi32(x0, qMaxX), _mm_cmplt_epi32(qMinX, x1)),
+                                          _mm_and_si128(_mm_cmplt_epi32(y0, qMaxY), _mm_cmplt_epi32(qMinY, y1)));
+        mask |= static_cast<uint32_t>(_mm_movemask_ps(_mm_castsi128_ps(hit))) << i;
+    }
+#endif
+    for (; i < count; ++i) {
+        const int idx = first + i;
+        if (minX[idx] < query[2] && query[0] < maxX[idx] && minY[idx] < query[3] && query[1] < maxY[idx])
+            mask |= 1u << i;
+    }
+    return mask;
+}
+
+int64_t SpatialBoxes::distance(int idx, const Point &point) const
+{
+    int64_t dx = 0, dy = 0;
+    if (point.x < minX[idx]) {
+        dx = static_cast<int64_t>(minX[idx]) - point.x;
+    } else if (point.x > maxX[idx]) {
+        dx = static_cast<int64_t>(point.x) - maxX[idx];
+    }
+    if (point.y < minY[idx]) {
+        dy = static_cast<int64_t>(minY[idx]) - point.y;
+    } else if (point.y > maxY[idx]) {
+        dy = static_cast<int64_t>(point.y) - maxY[idx];
+    }
+    return dx * dx + dy * dy;
+}
+
+void RTree::build(const List<Rect> &rects)
+{
+    clear();
+    const int count = rects.size();
+    if (!count)
+        return;
+
+    SpatialBoxes items;
+    int32_t box[4];
+    for (const Rect &rect : rects) {
+        boxFor(rect, box);
+        items.append(box[0], box[1], box[2], box[3]);
+    }
+
+    // sorted by x into vertical slices of enough rects for sqrt(leaves)
+    // leaves, each slice sorted by y, so leaves are roughly square
+    List<int32_t> order(count);
+    for (int i=0; i<count; ++i)
+        order[i] = i;
+    const int leaves = (count + NodeSize - 1) / NodeSize;
+    const int sliceSize = static_cast<int>(ceil(sqrt(static_cast<double>(leaves)))) * NodeSize;
+    std::sort(order.begin(), order.end(), [&items](int32_t a, int32_t b) {
+            return static_cast<int64_t>(items.minX[a]) + items.maxX[a] < static_cast<int64_t>(items.minX[b]) + items.maxX[b];
+        });
+    for (int i=0; i<count; i += sliceSize) {
+        std::sort(order.begin() + i, order.begin() + std::min(i + sliceSize, count), [&items](int32_t a, int32_t b) {
+                return static_cast<int64_t>(items.minY[a]) + items.maxY[a] < static_cast<int64_t>(items.minY[b]) + items.maxY[b];
+            });
+    }
+
+    mIds = std::move(order);
+    for (int32_t id : mIds)
+        mBoxes.append(items.minX[id], items.minY[id], items.maxX[id], items.maxY[id]);
+
+    // at least one level of nodes, even for one rect
+    mLevels.append(0);
+    int levelStart = 0, levelEnd = count;
+    do {
+        mLevels.append(levelEnd);
+        for (int i=levelStart; i<levelEnd; i += NodeSize) {
+            const int end = std::min<int>(i + NodeSize, levelEnd);
+            int32_t x0 = mBoxes.minX[i], y0 = mBoxes.minY[i], x1 = mBoxes.maxX[i], y1 = mBoxes.maxY[i];
+            for (int j=i + 1; j<end; ++j) {
+                x0 = std::min(x0, mBoxes.minX[j]);
+                y0 = std::min(y0, mBoxes.minY[j]);
+                x1 = std::max(x1, mBoxes.maxX[j]);
+                y1 = std::max(y1, mBoxes.maxY[j]);
+            }
+            mBoxes.append(x0, y0, x1, y1);
+        }
+        levelStart = levelEnd;
+        levelEnd = mBoxes.count();
+    } while (levelEnd - levelStart > 1);
+    mLevels.append(levelEnd);
+}
+
+void RTree::clear()
+{
+    mBoxes.clear();
+    mLevels.clear();
+    mIds.clear();
+}
+
+Rect RTree::bounds() const
+{
+    if (isEmpty())
+        return Rect();
+    const int root = mBoxes.count() - 1;
+    return Rect(mBoxes.minX[root], mBoxes.minY[root], mBoxes.maxX[root] - mBoxes.minX[root], mBoxes.maxY[root] - mBoxes.minY[root]);
+}
+
+List<int> RTree::intersecting(const Rect &rect) const
+{
+    return find(rect, Intersects);
+}
+
+List<int> RTree::containing(const Point &point) const
+{
+    return find(Rect(point.x, point.y, 1, 1), Intersects);
+}
+
+List<int> RTree::within(const Rect &rect) const
+{
+    return find(rect, Within);
+}
+
+List<int> RTree::find(const Rect &rect, Match match) const
+{
+    List<int> ret;
+    if (isEmpty())
+        return ret;
+    int32_t query[4], search[4];
+    boxFor(rect, query);
+    if (match == Within) {
+        expanded(query, search);
+    } else {
+        std::copy(query, query + 4, search);
+    }
+
+    // levels are counted from the rects up, nodes by where they are in
+    // their level
+    const int top = mLevels.size() - 2;
+    if (!mBoxes.overlaps(mLevels[top], 1, search))
+        return ret;
+    List<std::pair<int, int> > stack;
+    stack.append(std::make_pair(top, 0));
+    while (!stack.isEmpty()) {
+        const std::pair<int, int> node = stack.takeLast();
+        const int level = node.first - 1;
+        const int first = mLevels[level] + node.second * NodeSize;
+        uint32_t mask = mBoxes.overlaps(first, std::min<int>(NodeSize, mLevels[level + 1] - first), search);
+        while (mask) {
+            const int i = __builtin_ctz(mask);
+            mask &= mask - 1;
+            if (level) {
+                stack.append(std::make_pair(level, node.second * NodeSize + i));
+            } else if (match == Intersects || isWithin(mBoxes, first + i, query)) {
+                ret.append(mIds[first + i]);
+            }
+        }
+    }
+    return ret;
+}
+
+namespace {
+struct Candidate
+{
+    int64_t distance;
+    int level, index;
+
+    bool operator>(const Candidate &other) const { return distance > other.distance; }
+};
+}
+
+List<int> RTree::nearest(const Point &point, int count) const
+{
+    List<int> ret;
+    if (isEmpty() || count <= 0)
+        return ret;
+    // closest first, nodes are never further than what's in them so a
+    // rect that comes out on top is the next nearest
+    std::priority_queue<Candidate, std::vector<Candidate>, std::greater<Candidate> > queue;
+    const int top = mLevels.size() - 2;
+    queue.push({ mBoxes.distance(mLevels[top], point), top, 0 });
+    while (!queue.empty()) {
+        const Candidate candidate = queue.top();
+        queue.pop();
+        if (!candidate.level) {
+            ret.append(mIds[candidate.index]);
+            if (ret.size() == count)
+                break;
+            continue;
+        }
+        const int level = candidate.level - 1;
+        const int first = mLevels[level] + candidate.index * NodeSize;
+        const int end = std::min<int>(first + NodeSize, mLevels[level + 1]);
+        for (int i=first; i<end; ++i)
+            queue.push({ mBoxes.distance(i, point), level, i - mLevels[level] });
+    }
+    return ret;
+}
+
+void RectGrid::build(const List<Rect> &rects, int cellSize)
+{
+    clear();
+    const int count = rects.size();
+    if (!count)
+        return;
+
+    int32_t box[4];
+    int64_t x0 = std::numeric_limits<int64_t>::max(), y0 = x0;
+    int64_t x1 = std::numeric_limits<int64_t>::min(), y1 = x1;
+    int64_t total = 0;
+    for (const Rect &rect : rects) {
+        boxFor(rect, box);
+        mBoxes.append(box[0], box[1], box[2], box[3]);
+        x0 = std::min<int64_t>(x0, box[0]);
+        y0 = std::min<int64_t>(y0, box[1]);
+        x1 = std::max<int64_t>(x1, box[2]);
+        y1 = std::max<int64_t>(y1, box[3]);
+        total += std::max(box[2] - static_cast<int64_t>(box[0]), box[3] - static_cast<int64_t>(box[1]));
+    }
+
+    // no more than a few cells per rect, however small they are
+    int64_t size = cellSize > 0 ? cellSize : std::max<int64_t>(total / count, 1);
+    const int64_t maxCells = static_cast<int64_t>(count) * 4 + 16;
+    int64_t columns, rows;
+    while (true) {
+        columns = std::max<int64_t>((x1 - x0 + size - 1) / size, 1);
+        rows = std::max<int64_t>((y1 - y0 + size - 1) / size, 1);
+        if (columns * rows <= maxCells)
+            break;
+        size *= 2;
+    }
+    mOriginX = static_cast<int32_t>(x0);
+    mOriginY = static_cast<int32_t>(y0);
+    mCellSize = clamped(size);
+    mColumns = static_cast<int32_t>(columns);
+    mRows = static_cast<int32_t>(rows);
+
+    // counted first so every cell's rects go in one list
+    mCellStart.resize(mColumns * mRows + 1);
+    std::fill(mCellStart.begin(), mCellStart.end(), 0);
+    for (int pass=0; pass<2; ++pass) {
+        for (int i=0; i<count; ++i) {
+            const int cx0 = column(mBoxes.minX[i]), cx1 = column(std::max(mBoxes.maxX[i] - 1, mBoxes.minX[i]));
+            const int cy0 = row(mBoxes.minY[i]), cy1 = row(std::max(mBoxes.maxY[i] - 1, mBoxes.minY[i]));
+            for (int cy=cy0; cy<=cy1; ++cy) {
+                for (int cx=cx0; cx<=cx1; ++cx) {
+                    const int cell = cy * mColumns + cx;
+                    if (!pass) {
+                        ++mCellStart[cell + 1];
+                    } else {
+                        mCellItems[mCellStart[cell]++] = i;
+                    }
+                }
+            }
+        }
+        if (!pass) {
+            for (int cell=0; cell<mColumns * mRows; ++cell)
+                mCellStart[cell + 1] += mCellStart[cell];
+            mCellItems.resize(mCellStart.last());
+        } else {
+            // the second pass moved each start up to the next one's
+            for (int cell=mColumns * mRows; cell>0; --cell)
+                mCellStart[cell] = mCellStart[cell - 1];
+            mCellStart[0] = 0;
+        }
+    }
+}
+
+void RectGrid::clear()
+{
+    mBoxes.clear();
+    mOriginX = mOriginY = mCellSize = mColumns = mRows = 0;
+    mCellStart.clear();
+    mCellItems.clear();
+}
+
+int RectGrid::column(int64_t x) const
+{
+    return static_cast<int>(std::max<int64_t>(std::min<int64_t>((x - mOriginX) / mCellSize, mColumns - 1), 0));
+}
+
+int RectGrid::row(int64_t y) const
+{
+    return static_cast<int>(std::max<int64_t>(std::min<int64_t>((y - mOriginY) / mCellSize, mRows - 1), 0));
+}
+
+List<int> RectGrid::intersecting(const Rect &rect) const
+{
+    return find(rect, Intersects);
+}
+
+List<int> RectGrid::containing(const Point &point) const
+{
+    return find(Rect(point.x, point.y, 1, 1), Intersects);
+}
+
+List<int> RectGrid::within(const Rect &rect) const
+{
+    return find(rect, Within);
+}
+
+List<int> RectGrid::find(const Rect &rect, Match match) const
+{
+    List<int> ret;
+    if (isEmpty())
+        return ret;
+    int32_t query[4];
+    boxFor(rect, query);
+    // empty rects on the far edges are within too
+    const int qx0 = column(query[0]), qy0 = row(query[1]);
+    const int qx1 = column(match == Within ? query[2] : std::max(query[2] - 1, query[0]));
+    const int qy1 = row(match == Within ? query[3] : std::max(query[3] - 1, query[1]));
+    for (int cy=qy0; cy<=qy1; ++cy) {
+        for (int cx=qx0; cx<=qx1; ++cx) {
+            const int cell = cy * mColumns + cx;
+            for (int i=mCellStart[cell]; i<mCellStart[cell + 1]; ++i) {
+                const int idx = mCellItems[i];
+                // a rect is in every cell it touches, only the first of
+                // those the query covers gets to report it
+                if (std::max(column(mBoxes.minX[idx]), qx0) != cx || std::max(row(mBoxes.minY[idx]), qy0) != cy)
+                    continue;
+                if (match == Within ? isWithin(mBoxes, idx, query) : mBoxes.overlaps(idx, 1, query))
+                    ret.append(idx);
+            }
+        }
+    }
+    return ret;
+}
+
+List<int> RectGrid::nearest(const Point &point, int count) const
+{
+    List<int> ret;
+    if (isEmpty() || count <= 0)
+        return ret;
+
+    // the closest count so far, closest first
+    List<std::pair<int64_t, int> > best;
+    auto consider = [&](int cx, int cy) {
+        const int cell = cy * mColumns + cx;
+        for (int i=mCellStart[cell]; i<mCellStart[cell + 1]; ++i) {
+            const int idx = mCellItems[i];
+            const int64_t distance = mBoxes.distance(idx, point);
+            if (best.size() == count && distance >= best.last().first)
+                continue;
+            bool seen = false;
+            for (const std::pair<int64_t, int> &b : best) {
+                if (b.second == idx) {
+                    seen = true;
+                    break;
+                }
+            }
+            if (seen)
+                continue;
+            const std::pair<int64_t, int> entry(distance, idx);
+            best.insert(std::upper_bound(best.begin(), best.end(), entry), entry);
+            if (best.size() > count)
+                best.removeLast();
+        }
+    };
+
+    // rings of cells further and further out from the point's cell, until
+    // nothing outside them can be closer than what's been found
+    const int c0 = column(point.x), r0 = row(point.y);
+    const int maxRing = std::max(std::max(c0, mColumns - 1 - c0), std::max(r0, mRows - 1 - r0));
+    for (int ring=0; ring<=maxRing; ++ring) {
+        for (int cy=std::max(r0 - ring, 0); cy<=std::min(r0 + ring, mRows - 1); ++cy) {
+            if (cy == r0 - ring || cy == r0 + ring) {
+                for (int cx=std::max(c0 - ring, 0); cx<=std::min(c0 + ring, mColumns - 1); ++cx)
+                    consider(cx, cy);
+            } else {
+                if (c0 - ring >= 0)
+                    consider(c0 - ring, cy);
+                if (c0 + ring < mColumns)
+                    consider(c0 + ring, cy);
+            }
+        }
+        if (best.size() == count) {
+            const int64_t left = mOriginX + static_cast<int64_t>(c0 - ring) * mCellSize;
+            const int64_t right = mOriginX + static_cast<int64_t>(c0 + ring + 1) * mCellSize;
+            const int64_t top = mOriginY + static_cast<int64_t>(r0 - ring) * mCellSize;
+            const int64_t bottom = mOriginY + static_cast<int64_t>(r0 + ring + 1) * mCellSize;
+            const int64_t edge = std::min(std::min(point.x - left, right - point.x), std::min(point.y - top, bottom - point.y));
+            if (edge >= 0 && edge * edge >= best.last().first)
+                break;
+        }
+    }
+    for (const std::pair<int64_t, int> &b : best)
+        ret.append(b.second);
+    return ret;
+}
@@ -0,0 +1,155 @@
+#ifndef SpatialIndex_h
+#define SpatialIndex_h
+
+#include <rct/List.h>
+#include <rct/Point.h>
+#include <rct/Rect.h>
+#include <rct/Serializer.h>
+#include <stdint.h>
+
+// Indexes over a list of Rects, built once and queried many times. A
+// Rect's box goes from x, y up to but not including x + w, y + h, and two
+// intersect when each starts before the other ends, on both axes. Queries
+// answer with indexes into the list the index was built from, nearest() in
+// order of distance to a rect's edges.
+//
+// RTree suits most data. RectGrid is cheaper to build and faster to query
+// when there are lots of rects of about the same size spread evenly, but
+// a big rect is listed in every cell it covers.
+
+// A coordinate to a list so a node's children can be tested a few at a
+// time
+struct SpatialBoxes
+{
+    int count() const { return minX.size(); }
+    void clear();
+    void append(int32_t x0, int32_t y0, int32_t x1, int32_t y1);
+
+    // bit i set for each of the count boxes from first that overlap
+    // query, which is minX, minY, maxX, maxY. count is at most 32
+    uint32_t overlaps(int first, int count, const int32_t *query) const;
+    // squared, 0 if it's inside
+    int64_t distance(int idx, const Point &point) const;
+
+    List<int32_t> minX, minY, maxX, maxY;
+};
+
+// A packed R-tree, the rects sorted into leaves of NodeSize by
+// sort-tile-recursive and the levels above stored one after another
+class RTree
+{
+public:
+    enum { NodeSize = 16 };
+
+    RTree() {}
+    explicit RTree(const List<Rect> &rects) { build(rects); }
+
+    void build(const List<Rect> &rects);
+    void clear();
+
+    bool isEmpty() const { return mIds.isEmpty(); }
+    int count() const { return mIds.size(); }
+    // of everything in it
+    Rect bounds() const;
+
+    List<int> intersecting(const Rect &rect) const;
+    List<int> containing(const Point &point) const;
+    List<int> within(const Rect &rect) const;
+    List<int> nearest(const Point &point, int count = 1) const;
+
+private:
+    enum Match { Intersects, Within };
+    List<int> find(const Rect &rect, Match match) const;
+
+    // the rects, then each level of nodes up to the root
+    SpatialBoxes mBoxes;
+    // where each of those levels starts in mBoxes, and where the last ends
+    List<int32_t> mLevels;
+    // what the rects were in the list build() got
+    List<int32_t> mIds;
+
+    friend Serializer &operator<<(Serializer &s, const RTree &tree);
+    friend Deserializer &operator>>(Deserializer &s, RTree &tree);
+};
+
+class RectGrid
+{
+public:
+    RectGrid()
+        : mOriginX(0), mOriginY(0), mCellSize(0), mColumns(0), mRows(0)
+    {}
+    // cellSize 0 picks one from how big the rects are on average
+    explicit RectGrid(const List<Rect> &rects, int cellSize = 0)
+        : mOriginX(0), mOriginY(0), mCellSize(0), mColumns(0), mRows(0)
+    {
+        build(rects, cellSize);
+    }
+
+    void build(const List<Rect> &rects, int cellSize = 0);
+    void clear();
+
+    bool isEmpty() const { return !mBoxes.count(); }
+    int count() const { return mBoxes.count(); }
+    int cellSize() const { return mCellSize; }
+
+    List<int> intersecting(const Rect &rect) const;
+    List<int> containing(const Point &point) const;
+    List<int> within(const Rect &rect) const;
+    List<int> nearest(const Point &point, int count = 1) const;
+
+private:
+    enum Match { Intersects, Within };
+    List<int> find(const Rect &rect, Match match) const;
+    int column(int64_t x) const;
+    int row(int64_t y) const;
+
+    // in the order build() got them
+    SpatialBoxes mBoxes;
+    int32_t mOriginX, mOriginY, mCellSize, mColumns, mRows;
+    // the rects touching cell i are mCellItems from mCellStart[i] to
+    // mCellStart[i + 1], cells go row by row
+    List<int32_t> mCellStart, mCellItems;
+
+    friend Serializer &operator<<(Serializer &s, const RectGrid &grid);
+    friend Deserializer &operator>>(Deserializer &s, RectGrid &grid);
+};
+
+inline Serializer &operator<<(Serializer &s, const SpatialBoxes &boxes)
+{
+    s << boxes.minX << boxes.minY << boxes.maxX << boxes.maxY;
+    return s;
+}
+
+inline Deserializer &operator>>(Deserializer &s, SpatialBoxes &boxes)
+{
+    s >> boxes.minX >> boxes.minY >> boxes.maxX >> boxes.maxY;
+    return s;
+}
+
+inline Serializer &operator<<(Serializer &s, const RTree &tree)
+{
+    s << tree.mBoxes << tree.mLevels << tree.mIds;
+    return s;
+}
+
+inline Deserializer &operator>>(Deserializer &s, RTree &tree)
+{
+    s >> tree.mBoxes >> tree.mLevels >> tree.mIds;
+    return s;
+}
+
+inline Serializer &operator<<(Serializer &s, const RectGrid &grid)
+{
+    s << grid.mBoxes << grid.mOriginX << grid.mOriginY << grid.mCellSize
+      << grid.mColumns << grid.mRows << grid.mCellStart << grid.mCellItems;
+    return s;
+}
+
+inline Deserializer &operator>>(Deserializer &s, RectGrid &grid)
+{
+    s >> grid.mBoxes >> grid.mOriginX >> grid.mOriginY >> grid.mCellSize
+      >> grid.mColumns >> grid.mRows >> grid.mCellStart >> grid.mCellItems;
+    return s;
+}
+
+#endif
@@ -1,4 +1,16 @@
 #include "String.h"
+#include <algorithm>
+#include <cmath>
+#include <ctype.h>
+#if defined(__SSE2__)
+#  include <emmintrin.h>
+#  if defined(__GNUC__) && defined(__x86_64__)
+#    include <immintrin.h>
+#    define RCT_STRING_AVX2
+#  endif
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#  include <arm_neon.h>
+#endif
 #ifdef RCT_HAVE_ZLIB
 #include <zlib.h>
 enum { BufferSize = 1024 * 32 };
@@ -154,3 +166,547 @@ String String::toHex(const void *pAddressIn, int lSize)
     }
     return ret;
 }
+
+// The searches look for the needle's first and last character in a whole
+// vector's worth of positions at a time and only compare the rest where
+// both are there, see http://0x80.pl/articles/simd-strfind.html. Case
+// insensitive, a letter is or'ed with 0x20 before comparing, that folds
+// exactly its two cases together.
+
+static inline bool isLetter(char ch)
+{
+    ch |= 0x20;
+    return ch >= 'a' && ch <= 'z';
+}
+
+static inline char lower(char ch)
+{
+    return ch >= 'A' && ch <= 'Z' ? ch | 0x20 : ch;
+}
+
+// what's or'ed into data before comparing it to ch
+static inline char foldBit(char ch, bool caseInsensitive)
+{
+    return caseInsensitive && isLetter(ch) ? 0x20 : 0;
+}
+
+static inline int countTrailingZeros(uint64_t mask)
+{
+    return __builtin_ctzll(mask);
+}
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+// four bits per byte of a comparison
+static inline uint64_t neonMask(uint8x16_t eq)
+{
+    return vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(eq), 4)), 0);
+}
+#endif
+
+static bool equalsCaseInsensitive(const char *a, const char *b, int size)
+{
+    int i = 0;
+#if defined(__SSE2__)
+    const __m128i offset = _mm_set1_epi8(static_cast<char>(0x80 - 'A'));
+    const __m128i limit = _mm_set1_epi8(static_cast<char>(-128 + 26));
+    const __m128i bit = _mm_set1_epi8(0x20);
+    for (; i + 16 <= size; i += 16) {
+        __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i *>(a + i));
+        __m128i y = _mm_loadu_si128(reinterpret_cast<const __m128i *>(b + i));
+        // 'A' to 'Z' end up the smallest signed values after the offset
+        x = _mm_or_si128(x, _mm_and_si128(_mm_cmpgt_epi8(limit, _mm_add_epi8(x, offset)), bit));
+        y = _mm_or_si128(y, _mm_and_si128(_mm_cmpgt_epi8(limit, _mm_add_epi8(y, offset)), bit));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) != 0xffff)
+            return false;
+    }
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+    const uint8x16_t first = vdupq_n_u8('A');
+    const uint8x16_t range = vdupq_n_u8(25);
+    const uint8x16_t bit = vdupq_n_u8(0x20);
+    for (; i + 16 <= size; i += 16) {
+        uint8x16_t x = vld1q_u8(reinterpret_cast<const uint8_t *>(a + i));
+        uint8x16_t y = vld1q_u8(reinterpret_cast<const uint8_t *>(b + i));
+        x = vorrq_u8(x, vandq_u8(vcleq_u8(vsubq_u8(x, first), range), bit));
+        y = vorrq_u8(y, vandq_u8(vcleq_u8(vsubq_u8(y, first), range), bit));
+        if (neonMask(vceqq_u8(x, y)) != ~0ull)
+            return false;
+    }
+#endif
+    for (; i < size; ++i) {
+        if (lower(a[i]) != lower(b[i]))
+            return false;
+    }
+    return true;
+}
+
+static inline bool equalsRest(const char *a, const char *b, int size, bool caseInsensitive)
+{
+    return caseInsensitive ? equalsCaseInsensitive(a, b, size) : !memcmp(a, b, size);
+}
+
+// ch is a lower case letter
+static int findLetterScalar(const char *data, int from, int size, char ch)
+{
+    for (int i = from; i < size; ++i) {
+        if ((data[i] | 0x20) == ch)
+            return i;
+    }
+    return -1;
+}
+
+static int findStringScalar(const char *data, int from, int size, const char *needle, int needleSize, bool caseInsensitive)
+{
+    const char firstBit = foldBit(needle[0], caseInsensitive), lastBit = foldBit(needle[needleSize - 1], caseInsensitive);
+    const char first = needle[0] | firstBit, last = needle[needleSize - 1] | lastBit;
+    for (int i = from; i + needleSize <= size; ++i) {
+        if ((data[i] | firstBit) == first && (data[i + needleSize - 1] | lastBit) == last
+            && equalsRest(data + i + 1, needle + 1, needleSize - 2, caseInsensitive)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+#if defined(__SSE2__)
+static int findLetterSse2(const char *data, int size, char ch)
+{
+    const __m128i bit = _mm_set1_epi8(0x20);
+    const __m128i c = _mm_set1_epi8(ch);
+    int i = 0;
+    for (; i + 16 <= size; i += 16) {
+        const __m128i x = _mm_or_si128(_mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i)), bit);
+        const int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(x, c));
+        if (mask)
+            return i + countTrailingZeros(mask);
+    }
+    return findLetterScalar(data, i, size, ch);
+}
+
+static int findStringSse2(const char *data, int size, const char *needle, int needleSize, bool caseInsensitive)
+{
+    const char firstBit = foldBit(needle[0], caseInsensitive), lastBit = foldBit(needle[needleSize - 1], caseInsensitive);
+    const __m128i firstOr = _mm_set1_epi8(firstBit), lastOr = _mm_set1_epi8(lastBit);
+    const __m128i first = _mm_set1_epi8(needle[0] | firstBit), last = _mm_set1_epi8(needle[needleSize - 1] | lastBit);
+    int i = 0;
+    for (; i + needleSize - 1 + 16 <= size; i += 16) {
+        const __m128i x = _mm_or_si128(_mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i)), firstOr);
+        const __m128i y = _mm_or_si128(_mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i + needleSize - 1)), lastOr);
+        unsigned int mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(x, first), _mm_cmpeq_epi8(y, last)));
+        while (mask) {
+            const int idx = i + countTrailingZeros(mask);
+            if (equalsRest(data + idx + 1, needle + 1, needleSize - 2, caseInsensitive))
+                return idx;
+            mask &= mask - 1;
+        }
+    }
+    return findStringScalar(data, i, size, needle, needleSize, caseInsensitive);
+}
+#endif
+
+#ifdef RCT_STRING_AVX2
+__attribute__((target("avx2")))
+static int findLetterAvx2(const char *data, int size, char ch)
+{
+    const __m256i bit = _mm256_set1_epi8(0x20);
+    const __m256i c = _mm256_set1_epi8(ch);
+    int i = 0;
+    for (; i + 32 <= size; i += 32) {
+        const __m256i x = _mm256_or_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + i)), bit);
+        const unsigned int mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(x, c));
+        if (mask)
+            return i + countTrailingZeros(mask);
+    }
+    return findLetterScalar(data, i, size, ch);
+}
+
+__attribute__((target("avx2")))
+static int findStringAvx2(const char *data, int size, const char *needle, int needleSize, bool caseInsensitive)
+{
+    const char firstBit = foldBit(needle[0], caseInsensitive), lastBit = foldBit(needle[needleSize - 1], caseInsensitive);
+    const __m256i firstOr = _mm256_set1_epi8(firstBit), lastOr = _mm256_set1_epi8(lastBit);
+    const __m256i first = _mm256_set1_epi8(needle[0] | firstBit), last = _mm256_set1_epi8(needle[needleSize - 1] | lastBit);
+    int i = 0;
+    for (; i + needleSize - 1 + 32 <= size; i += 32) {
+        const __m256i x = _mm256_or_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + i)), firstOr);
+        const __m256i y = _mm256_or_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + i + needleSize - 1)), lastOr);
+        unsigned int mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(x, first), _mm256_cmpeq_epi8(y, last)));
+        while (mask) {
+            const int idx = i + countTrailingZeros(mask);
+            if (equalsRest(data + idx + 1, needle + 1, needleSize - 2, caseInsensitive))
+                return idx;
+            mask &= mask - 1;
+        }
+    }
+    const int ret = findStringSse2(data + i, size - i, needle, needleSize, caseInsensitive);
+    return ret == -1 ? -1 : ret + i;
+}
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+static int findLetterNeon(const char *data, int size, char ch)
+{
+    const uint8x16_t bit = vdupq_n_u8(0x20);
+    const uint8x16_t c = vdupq_n_u8(ch);
+    int i = 0;
+    for (; i + 16 <= size; i += 16) {
+        const uint8x16_t x = vorrq_u8(vld1q_u8(reinterpret_cast<const uint8_t *>(data + i)), bit);
+        const uint64_t mask = neonMask(vceqq_u8(x, c));
+        if (mask)
+            return i + countTrailingZeros(mask) / 4;
+    }
+    return findLetterScalar(data, i, size, ch);
+}
+
+static int findStringNeon(const char *data, int size, const char *needle, int needleSize, bool caseInsensitive)
+{
+    const char firstBit = foldBit(needle[0], caseInsensitive), lastBit = foldBit(needle[needleSize - 1], caseInsensitive);
+    const uint8x16_t firstOr = vdupq_n_u8(firstBit), lastOr = vdupq_n_u8(lastBit);
+    const uint8x16_t first = vdupq_n_u8(needle[0] | firstBit), last = vdupq_n_u8(needle[needleSize - 1] | lastBit);
+    int i = 0;
+    for (; i + needleSize - 1 + 16 <= size; i += 16) {
+        const uint8x16_t x = vorrq_u8(vld1q_u8(reinterpret_cast<const uint8_t *>(data + i)), firstOr);
+        const uint8x16_t y = vorrq_u8(vld1q_u8(reinterpret_cast<const uint8_t *>(data + i + needleSize - 1)), lastOr);
+        uint64_t mask = neonMask(vandq_u8(vceqq_u8(x, first), vceqq_u8(y, last)));
+        while (mask) {
+            const int bit = countTrailingZeros(mask);
+            const int idx = i + bit / 4;
+            if (equalsRest(data + idx + 1, needle + 1, needleSize - 2, caseInsensitive))
+                return idx;
+            mask &= ~(0xfull << (bit & ~3));
+        }
+    }
+    return findStringScalar(data, i, size, needle, needleSize, caseInsensitive);
+}
+#endif
+
+namespace {
+struct Search
+{
+    int (*findLetter)(const char *data, int size, char ch);
+    int (*findString)(const char *data, int size, const char *needle, int needleSize, bool caseInsensitive);
+};
+}
+
+#if !defined(__SSE2__) && !defined(__ARM_NEON) && !defined(__ARM_NEON__)
+static int findLetterDefault(const char *data, int size, char ch)
+{
+    return findLetterScalar(data, 0, size, ch);
+}
+
+static int findStringDefault(const char *data, int size, const char *needle, int needleSize, bool caseInsensitive)
+{
+    return findStringScalar(data, 0, size, needle, needleSize, caseInsensitive);
+}
+#endif
+
+static Search pickSearch()
+{
+#if defined(RCT_STRING_AVX2)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        const Search ret = { findLetterAvx2, findStringAvx2 };
+        return ret;
+    }
+#endif
+#if defined(__SSE2__)
+    const Search ret = { findLetterSse2, findStringSse2 };
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+    const Search ret = { findLetterNeon, findStringNeon };
+#else
+    const Search ret = { findLetterDefault, findStringDefault };
+#endif
+    return ret;
+}
+
+static const Search &search()
+{
+    static const Search ret = pickSearch();
+    return ret;
+}
+
+int String::find(const char *data, int size, char ch, CaseSensitivity cs)
+{
+    if (size <= 0)
+        return -1;
+    if (cs == CaseSensitive || !isLetter(ch)) {
+        const void *ret = memchr(data, ch, size);
+        return ret ? static_cast<const char *>(ret) - data : -1;
+    }
+    return search().findLetter(data, size, ch | 0x20);
+}
+
+int String::find(const char *data, int size, const char *needle, int needleSize, CaseSensitivity cs)
+{
+    if (needleSize <= 0 || needleSize > size)
+        return -1;
+    if (needleSize == 1)
+        return find(data, size, needle[0], cs);
+    return search().findString(data, size, needle, needleSize, cs == CaseInsensitive);
+}
+
+bool String::equals(const char *a, const char *b, int size, CaseSensitivity cs)
+{
+    if (size <= 0)
+        return true;
+    return cs == CaseSensitive ? !memcmp(a, b, size) : equalsCaseInsensitive(a, b, size);
+}
+
+void String::toLower(char *data, int size)
+{
+    int i = 0;
+#if defined(__SSE2__)
+    const __m128i offset = _mm_set1_epi8(static_cast<char>(0x80 - 'A'));
+    const __m128i limit = _mm_set1_epi8(static_cast<char>(-128 + 26));
+    const __m128i bit = _mm_set1_epi8(0x20);
+    for (; i + 16 <= size; i += 16) {
+        __m128i *p = reinterpret_cast<__m128i *>(data + i);
+        const __m128i x = _mm_loadu_si128(p);
+        _mm_storeu_si128(p, _mm_or_si128(x, _mm_and_si128(_mm_cmpgt_epi8(limit, _mm_add_epi8(x, offset)), bit)));
+    }
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+    const uint8x16_t first = vdupq_n_u8('A');
+    const uint8x16_t range = vdupq_n_u8(25);
+    const uint8x16_t bit = vdupq_n_u8(0x20);
+    for (; i + 16 <= size; i += 16) {
+        uint8_t *p = reinterpret_cast<uint8_t *>(data + i);
+        const uint8x16_t x = vld1q_u8(p);
+        vst1q_u8(p, vorrq_u8(x, vandq_u8(vcleq_u8(vsubq_u8(x, first), range), bit)));
+    }
+#endif
+    for (; i < size; ++i)
+        data[i] = lower(data[i]);
+}
+
+static const char sDigitPairs[] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+    "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+// two digits at a time, from the back
+static int decimal(char *buf, uint64_t num)
+{
+    char tmp[24];
+    char *p = tmp + sizeof(tmp);
+    while (num >= 100) {
+        const int pair = static_cast<int>(num % 100) * 2;
+        num /= 100;
+        *--p = sDigitPairs[pair + 1];
+        *--p = sDigitPairs[pair];
+    }
+    if (num >= 10) {
+        *--p = sDigitPairs[num * 2 + 1];
+        *--p = sDigitPairs[num * 2];
+    } else {
+        *--p = static_cast<char>('0' + num);
+    }
+    const int len = tmp + sizeof(tmp) - p;
+    memcpy(buf, p, len);
+    return len;
+}
+
+int String::toChars(char *buf, uint64_t num, int base)
+{
+    if (base == 10)
+        return decimal(buf, num);
+    static const char hex[] = "0123456789abcdef";
+    const int shift = base == 16 ? 4 : 3;
+    const uint64_t mask = base - 1;
+    int len = 1;
+    for (uint64_t n = num >> shift; n; n >>= shift)
+        ++len;
+    for (int i = len - 1; i >= 0; --i) {
+        buf[i] = hex[num & mask];
+        num >>= shift;
+    }
+    return len;
+}
+
+int String::toChars(char *buf, int64_t num, int base)
+{
+    // other bases show the bits, like %llx
+    if (base != 10 || num >= 0)
+        return toChars(buf, static_cast<uint64_t>(num), base);
+    buf[0] = '-';
+    return 1 + decimal(buf + 1, 0 - static_cast<uint64_t>(num));
+}
+
+int String::toChars(char *buf, int size, double num, int prec)
+{
+    // Scaled to an integer that's exact enough, otherwise, or when it's
+    // right between two and snprintf() would round to even on the binary
+    // value, snprintf() does it
+    static const double scales[] = { 1, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9 };
+    if (prec >= 0 && prec < static_cast<int>(sizeof(scales) / sizeof(scales[0])) && size >= 32) {
+        const bool negative = std::signbit(num);
+        const double scaled = (negative ? -num : num) * scales[prec];
+        // small enough for the product to be off by much less than the
+        // margin below, false for nan too
+        if (scaled < 1e9) {
+            const double whole = floor(scaled);
+            const double fraction = scaled - whole;
+            if (fabs(fraction - 0.5) > 1e-6) {
+                const uint64_t value = static_cast<uint64_t>(whole) + (fraction > 0.5 ? 1 : 0);
+                char digits[24];
+                int len = decimal(digits, value);
+                char *p = buf;
+                if (negative)
+                    *p++ = '-';
+                if (!prec) {
+                    memcpy(p, digits, len);
+                    p += len;
+                } else {
+                    // at least one digit before the point
+                    if (len <= prec) {
+                        memmove(digits + prec + 1 - len, digits, len);
+                        memset(digits, '0', prec + 1 - len);
+                        len = prec + 1;
+                    }
+                    memcpy(p, digits, len - prec);
+                    p += len - prec;
+                    *p++ = '.';
+                    memcpy(p, digits + len - prec, prec);
+                    p += prec;
+                }
+                *p = '\0';
+                return p - buf;
+            }
+        }
+    }
+    return snprintf(buf, size, "%.*f", prec, num);
+}
+
+// strtoll() and strtoull() for base 10: leading white space, a sign and
+// digits. false if there were no digits, end is where it stopped
+static bool parseDecimal(const char *p, const char *end, uint64_t &value, bool &negative, bool &overflow, const char *&stop)
+{
+    while (p < end && isspace(static_cast<unsigned char>(*p)))
+        ++p;
+    negative = false;
+    if (p < end && (*p == '-' || *p == '+'))
+        negative = *p++ == '-';
+    const char *digits = p;
+    value = 0;
+    overflow = false;
+    while (p < end && static_cast<unsigned>(*p - '0') < 10) {
+        const unsigned digit = *p - '0';
+        if (value > (UINT64_MAX - digit) / 10) {
+            overflow = true;
+        } else {
+            value = value * 10 + digit;
+        }
+        ++p;
+    }
+    stop = p;
+    return p != digits;
+}
+
+int64_t String::toLongLong(bool *ok, int base) const
+{
+    errno = 0;
+    if (base != 10) {
+        char *end = 0;
+        const int64_t ret = ::strtoll(constData(), &end, base);
+        if (ok)
+            *ok = !errno && !*end;
+        return ret;
+    }
+    const char *data = constData();
+    const char *end = data + size();
+    uint64_t value;
+    bool negative, overflow;
+    const char *stop;
+    if (!parseDecimal(data, end, value, negative, overflow, stop)) {
+        // like strtoll(), nothing parsed stops at the beginning
+        if (ok)
+            *ok = !*data;
+        return 0;
+    }
+    int64_t ret;
+    if (overflow || value > (negative ? static_cast<uint64_t>(INT64_MAX) + 1 : static_cast<uint64_t>(INT64_MAX))) {
+        errno = ERANGE;
+        ret = negative ? INT64_MIN : INT64_MAX;
+    } else {
+        ret = negative ? static_cast<int64_t>(0 - value) : static_cast<int64_t>(value);
+    }
+    if (ok)
+        *ok = !errno && (stop == end || !*stop);
+    return ret;
+}
+
+uint64_t String::toULongLong(bool *ok, int base) const
+{
+    errno = 0;
+    const char *data = constData();
+    const char *end = data + size();
+    uint64_t value;
+    bool negative, overflow;
+    const char *stop;
+    if (base != 10 || !parseDecimal(data, end, value, negative, overflow, stop) || negative) {
+        // strtoull() negates, let it
+        char *e = 0;
+        const uint64_t ret = ::strtoull(data, &e, base);
+        if (ok)
+            *ok = !errno && !*e;
+        return ret;
+    }
+    if (overflow) {
+        errno = ERANGE;
+        value = UINT64_MAX;
+    }
+    if (ok)
+        *ok = !errno && (stop == end || !*stop);
+    return value;
+}
+
+uint32_t String::toULong(bool *ok, int base) const
+{
+    if (sizeof(unsigned long) == sizeof(uint64_t))
+        return static_cast<uint32_t>(toULongLong(ok, base));
+    errno = 0;
+    char *end = 0;
+    const uint32_t ret = ::strtoul(constData(), &end, base);
+    if (ok)
+        *ok = !errno && !*end;
+    return ret;
+}
+
+int32_t String::toLong(bool *ok, int base) const
+{
+    if (sizeof(long) == sizeof(int64_t))
+        return static_cast<int32_t>(toLongLong(ok, base));
+    errno = 0;
+    char *end = 0;
+    const int32_t ret = ::strtol(constData(), &end, base);
+    if (ok)
+        *ok = !errno && !*end;
+    return ret;
+}
+
+String &String::appendFormat(const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    appendFormat(format, args);
+    va_end(args);
+    return *this;
+}
+
+String &String::appendFormat(const char *format, va_list args)
+{
+    va_list copy;
+    va_copy(copy, args);
+    const int old = mString.size();
+    const int room = std::max<int>(mString.capacity() - old, 256);
+    mString.resize(old + room);
+    // the terminating 0 goes where std::string keeps its own
+    const int size = ::vsnprintf(&mString[old], room + 1, format, args);
+    if (size < 0) {
+        mString.resize(old);
+    } else {
+        mString.resize(old + size);
+        if (size > room)
+            ::vsnprintf(&mString[old], size + 1, format, copy);
+    }
+    va_end(copy);
+    return *this;
+}
@@ -15,6 +15,9 @@
 class String
 {
 public:
+    // interned, see StringPool.h
+    class Atom;
+
     enum CaseSensitivity
     {
         CaseSensitive,
@@ -88,15 +91,12 @@ public:
     {
         if (cs == CaseSensitive)
             return mString.find(ch, from);
-        const char *data = mString.c_str();
-        ch = tolower(ch);
-        const int size = mString.size();
-        while (from < size) {
-            if (tolower(data[from]) == ch)
-                return from;
-            ++from;
-        }
-        return -1;
+        if (from < 0)
+            from = 0;
+        if (from >= size())
+            return -1;
+        const int ret = find(constData() + from, size() - from, ch, cs);
+        return ret == -1 ? -1 : ret + from;
     }
 
     bool contains(const String &other, CaseSensitivity cs = CaseSensitive) const
@@ -159,25 +159,22 @@ public:
     {
         if (ba.isEmpty())
             return -1;
-        if (ba.size() == 1)
-            return indexOf(ba.first(), from, cs);
-        if (cs == CaseSensitive)
-            return mString.find(ba.mString, from);
-
-        const String lowered = ba.toLower();
-        const int count = size();
-        int matched = 0;
-
-        for (int i=from; i<count; ++i) {
-            if (lowered.at(matched) != tolower(at(i))) {
-                matched = 0;
-            } else if (++matched == lowered.size()) {
-                return i - matched + 1;
-            }
-        }
-        return -1;
+        if (from < 0)
+            from = 0;
+        if (from >= size())
+            return -1;
+        const int ret = find(constData() + from, size() - from, ba.constData(), ba.size(), cs);
+        return ret == -1 ? -1 : ret + from;
     }
 
+    // Searching and comparing characters, with SSE2, AVX2 or NEON where
+    // the CPU has them, see String.cpp. Case insensitive means ASCII
+    // letters only. -1 if it's not there
+    static int find(const char *data, int size, char ch, CaseSensitivity cs = CaseSensitive);
+    static int find(const char *data, int size, const char *needle, int needleSize, CaseSensitivity cs = CaseSensitive);
+    static bool equals(const char *a, const char *b, int size, CaseSensitivity cs = CaseSensitive);
+    static void toLower(char *data, int size);
+
     char first() const
     {
         return at(0);
@@ -203,8 +200,9 @@ public:
 
     String toLower() const
     {
-        std::string ret = mString;
-        std::transform(ret.begin(), ret.end(), ret.begin(), ::tolower);
+        String ret = *this;
+        if (!ret.isEmpty())
+            toLower(ret.data(), ret.size());
         return ret;
     }
 
@@ -465,11 +463,8 @@ public:
     {
         const int len = str.size();
         const int s = mString.size();
-        if (s >= len) {
-            return (cs == CaseInsensitive
-                    ? !strncasecmp(str.constData(), constData() + s - len, len)
-                    : !strncmp(str.constData(), constData() + s - len, len));
-        }
+        if (s >= len)
+            return equals(str.constData(), constData() + s - len, len, cs);
         return false;
     }
 
@@ -477,11 +472,8 @@ public:
     {
         const int s = mString.size();
         const int len = str.size();
-        if (s >= len) {
-            return (cs == CaseInsensitive
-                    ? !strncasecmp(str.constData(), constData(), len)
-                    : !strncmp(str.constData(), constData(), len));
-        }
+        if (s >= len)
+            return equals(str.constData(), constData(), len, cs);
         return false;
     }
 
@@ -587,42 +579,11 @@ public:
         return ret;
     }
 
-    uint64_t toULongLong(bool *ok = 0, int base = 10) const
-    {
-        errno = 0;
-        char *end = 0;
-        const uint64_t ret = ::strtoull(constData(), &end, base);
-        if (ok)
-            *ok = !errno && !*end;
-        return ret;
-    }
-    int64_t toLongLong(bool *ok = 0, int base = 10) const
-    {
-        errno = 0;
-        char *end = 0;
-        const int64_t ret = ::strtoll(constData(), &end, base);
-        if (ok)
-            *ok = !errno && !*end;
-        return ret;
-    }
-    uint32_t toULong(bool *ok = 0, int base = 10) const
-    {
-        errno = 0;
-        char *end = 0;
-        const uint32_t ret = ::strtoul(constData(), &end, base);
-        if (ok)
-            *ok = !errno && !*end;
-        return ret;
-    }
-    int32_t toLong(bool *ok = 0, int base = 10) const
-    {
-        errno = 0;
-        char *end = 0;
-        const int32_t ret = ::strtol(constData(), &end, base);
-        if (ok)
-            *ok = !errno && !*end;
-        return ret;
-    }
+    // base 10 is parsed here, other bases by strtoull() and friends
+    uint64_t toULongLong(bool *ok = 0, int base = 10) const;
+    int64_t toLongLong(bool *ok = 0, int base = 10) const;
+    uint32_t toULong(bool *ok = 0, int base = 10) const;
+    int32_t toLong(bool *ok = 0, int base = 10) const;
 
     enum TimeFormat {
         DateTime,
@@ -664,59 +625,41 @@ public:
     static String number(uint32_t num, int base = 10) { return String::number(static_cast<int64_t>(num), base); }
     static String number(int64_t num, int base = 10)
     {
-        const char *format = 0;
-        switch (base) {
-        case 10: format = "%lld"; break;
-        case 16: format = "0x%llx"; break;
-        case 8: format = "%llo"; break;
-        case 1: {
-            String ret;
-            while (num) {
-                ret.append(num & 1 ? '1' : '0');
-                num >>= 1;
-            }
-            return ret; }
-        default:
-            assert(0);
-            return String();
-        }
+        if (base == 1)
+            return binary(num);
         char buf[32];
-        const int w = ::snprintf(buf, sizeof(buf), format, num);
-        return String(buf, w);
+        const int w = numberPrefix(buf, base);
+        return String(buf, w + toChars(buf + w, num, base));
     }
 
     static String number(uint64_t num, int base = 10)
     {
-        const char *format = 0;
-        switch (base) {
-        case 10: format = "%llu"; break;
-        case 16: format = "0x%llx"; break;
-        case 8: format = "%llo"; break;
-        case 1: {
-            String ret;
-            while (num) {
-                ret.append(num & 1 ? '1' : '0');
-                num >>= 1;
-            }
-            return ret; }
-        default:
-            assert(0);
-            return String();
-        }
+        if (base == 1)
+            return binary(num);
         char buf[32];
-        const int w = ::snprintf(buf, sizeof(buf), format, num);
-        return String(buf, w);
+        const int w = numberPrefix(buf, base);
+        return String(buf, w + toChars(buf + w, num, base));
     }
 
     static String number(double num, int prec = 2)
     {
-        char format[32];
-        snprintf(format, sizeof(format), "%%.%df", prec);
         char buf[32];
-        const int w = ::snprintf(buf, sizeof(buf), format, num);
-        return String(buf, w);
+        const int w = toChars(buf, sizeof(buf), num, prec);
+        if (w < static_cast<int>(sizeof(buf)))
+            return String(buf, w);
+        String ret(w, '\0');
+        toChars(ret.data(), w + 1, num, prec);
+        return ret;
     }
 
+    // No allocations and no format strings, like std::to_chars. Integers
+    // need 24 bytes in buf, base is 8, 10 or 16 and 16 has no 0x. The
+    // double is formatted as "%.<prec>f" and, like snprintf(), returns
+    // what it would need even when that's more than size
+    static int toChars(char *buf, uint64_t num, int base = 10);
+    static int toChars(char *buf, int64_t num, int base = 10);
+    static int toChars(char *buf, int size, double num, int prec = 2);
+
     static String join(const List<String> &list, char ch)
     {
         return String::join(list, String(&ch, 1));
@@ -739,7 +682,19 @@ public:
         }
         return ret;
     }
+    // Straight into the string, in one go as long as the result fits in
+    // what it has reserved, or 256 more bytes
+#ifdef __GNUC__
+    String &appendFormat(const char *format, ...) __attribute__ ((format (printf, 2, 3)));
+#else
+    String &appendFormat(const char *format, ...);
+#endif
+    String &appendFormat(const char *format, va_list args);
+
     template <int StaticBufSize = 256>
+#ifdef __GNUC__
+    __attribute__ ((format (printf, 1, 2)))
+#endif
     static String format(const char *format, ...)
     {
         va_list args;
@@ -752,25 +707,33 @@ public:
     template <int StaticBufSize = 256>
     static String format(const char *format, va_list args)
     {
-        va_list copy;
-        va_copy(copy, args);
-
-        char buffer[StaticBufSize];
-        char *ch = buffer;
-        int size = ::vsnprintf(buffer, StaticBufSize, format, args);
-        assert(size >= 0);
-        if (size >= StaticBufSize) {
-            ch = reinterpret_cast<char*>(malloc(size + 1));
-            size = vsnprintf(ch, size+1, format, copy);
-        }
-        ch[size] = 0;
-        va_end(copy);
-        const String ret(ch, size);
-        if (ch != buffer)
-            free(ch);
+        String ret;
+        ret.reserve(StaticBufSize);
+        ret.appendFormat(format, args);
         return ret;
     }
 private:
+    static int numberPrefix(char *buf, int base)
+    {
+        assert(base == 8 || base == 10 || base == 16);
+        if (base != 16)
+            return 0;
+        buf[0] = '0';
+        buf[1] = 'x';
+        return 2;
+    }
+    // least significant bit first
+    template <typename T>
+    static String binary(T num)
+    {
+        String ret;
+        while (num) {
+            ret.append(num & 1 ? '1' : '0');
+            num >>= 1;
+        }
+        return ret;
+    }
+
     std::string mString;
 };
 
@@ -0,0 +1,262 @@
+#include "StringPool.h"
+#include <atomic>
+#include <mutex>
+#include <unordered_map>
+#include <stdlib.h>
+#include <string.h>
+
+namespace {
+
+enum {
+    PageBits = 12,
+    PageSize = 1 << PageBits,
+    MaxPages = 1 << 16,
+    Shards = 16,
+    ChunkSize = 64 * 1024
+};
+
+// id - 1 to entry, pages are allocated as needed and never move so lookups
+// don't lock. Entries are written under a shard's mutex before their id is
+// handed out
+template <typename Entry>
+class Entries
+{
+public:
+    Entries()
+        : mCount(0)
+    {
+        for (int i = 0; i < MaxPages; ++i)
+            mPages[i].store(0, std::memory_order_relaxed);
+    }
+
+    uint32_t add(const Entry &entry)
+    {
+        const uint32_t index = mCount.fetch_add(1, std::memory_order_relaxed);
+        const uint32_t page = index >> PageBits;
+        if (page >= MaxPages) {
+            error("StringPool is full");
+            abort();
+        }
+        Entry *entries = mPages[page].load(std::memory_order_acquire);
+        if (!entries) {
+            Entry *created = new Entry[PageSize];
+            if (mPages[page].compare_exchange_strong(entries, created, std::memory_order_acq_rel)) {
+                entries = created;
+            } else {
+                delete[] created;
+            }
+        }
+        entries[index & (PageSize - 1)] = entry;
+        return index + 1;
+    }
+
+    const Entry &at(uint32_t id) const
+    {
+        const uint32_t index = id - 1;
+        return mPages[index >> PageBits].load(std::memory_order_acquire)[index & (PageSize - 1)];
+    }
+
+    size_t count() const { return mCount.load(std::memory_order_relaxed); }
+    size_t memoryUsage() const
+    {
+        return ((count() + PageSize - 1) / PageSize) * PageSize * sizeof(Entry);
+    }
+
+private:
+    std::atomic<uint32_t> mCount;
+    std::atomic<Entry *> mPages[MaxPages];
+};
+
+struct StringEntry
+{
+    const char *data;
+    int size;
+};
+
+struct PathHash
+{
+    size_t operator()(uint64_t key) const { return std::hash<uint64_t>()(key * 0x9e3779b97f4a7c15ull); }
+};
+
+struct Shard
+{
+    Shard()
+        : chunk(0), chunkUsed(ChunkSize), bytes(0)
+    {}
+
+    // strings live here, 0 terminated, chunks are never freed
+    const char *store(const StringView &string)
+    {
+        const size_t size = string.size() + 1;
+        char *ret;
+        if (size > ChunkSize / 4) {
+            ret = new char[size];
+        } else {
+            if (chunkUsed + size > ChunkSize) {
+                chunk = new char[ChunkSize];
+                chunkUsed = 0;
+                bytes += ChunkSize;
+            }
+            ret = chunk + chunkUsed;
+            chunkUsed += size;
+        }
+        memcpy(ret, string.constData(), size - 1);
+        ret[size - 1] = '\0';
+        if (size > ChunkSize / 4)
+            bytes += size;
+        return ret;
+    }
+
+    std::mutex mutex;
+    std::unordered_map<StringView, uint32_t> strings;
+    std::unordered_map<uint64_t, uint32_t, PathHash> paths;
+    char *chunk;
+    size_t chunkUsed, bytes;
+};
+
+struct PathEntry
+{
+    uint32_t parent, name;
+};
+
+struct Pool
+{
+    Entries<StringEntry> strings;
+    Entries<PathEntry> paths;
+    Shard shards[Shards];
+};
+
+// never destroyed, atoms may be used from static destructors and threads
+// still running at exit
+static Pool &pool()
+{
+    static Pool *p = new Pool;
+    return *p;
+}
+
+}
+
+uint32_t StringPool::intern(const StringView &string)
+{
+    if (string.isEmpty())
+        return 0;
+    Pool &p = pool();
+    const size_t hash = std::hash<StringView>()(string);
+    Shard &shard = p.shards[(hash >> 8) % Shards];
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    const auto it = shard.strings.find(string);
+    if (it != shard.strings.end())
+        return it->second;
+    const StringEntry entry = { shard.store(string), string.size() };
+    const uint32_t id = p.strings.add(entry);
+    shard.strings[StringView(entry.data, entry.size)] = id;
+    return id;
+}
+
+StringView StringPool::string(uint32_t id)
+{
+    if (!id)
+        return StringView("", 0);
+    const StringEntry &entry = pool().strings.at(id);
+    return StringView(entry.data, entry.size);
+}
+
+uint32_t StringPool::internPath(uint32_t parent, uint32_t name)
+{
+    if (!name)
+        return parent;
+    Pool &p = pool();
+    const uint64_t key = (static_cast<uint64_t>(parent) << 32) | name;
+    Shard &shard = p.shards[PathHash()(key) % Shards];
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    uint32_t &id = shard.paths[key];
+    if (!id) {
+        const PathEntry entry = { parent, name };
+        id = p.paths.add(entry);
+    }
+    return id;
+}
+
+void StringPool::path(uint32_t id, uint32_t &parent, uint32_t &name)
+{
+    if (!id) {
+        parent = name = 0;
+        return;
+    }
+    const PathEntry &entry = pool().paths.at(id);
+    parent = entry.parent;
+    name = entry.name;
+}
+
+size_t StringPool::stringCount()
+{
+    return pool().strings.count();
+}
+
+size_t StringPool::pathCount()
+{
+    return pool().paths.count();
+}
+
+size_t StringPool::memoryUsage()
+{
+    Pool &p = pool();
+    size_t ret = p.strings.memoryUsage() + p.paths.memoryUsage();
+    for (Shard &shard : p.shards) {
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        ret += shard.bytes;
+        // roughly what a node and its bucket cost
+        ret += (shard.strings.size() + shard.paths.size()) * (sizeof(void *) * 3 + sizeof(uint64_t) + sizeof(uint32_t));
+    }
+    return ret;
+}
+
+Path::Atom::Atom(const Path &path)
+    : mId(0)
+{
+    // one component per '/', with it
+    const char *data = path.constData();
+    const int size = path.size();
+    int start = 0;
+    for (int i = 0; i < size; ++i) {
+        if (data[i] == '/') {
+            mId = StringPool::internPath(mId, StringPool::intern(StringView(data + start, i + 1 - start)));
+            start = i + 1;
+        }
+    }
+    if (start < size)
+        mId = StringPool::internPath(mId, StringPool::intern(StringView(data + start, size - start)));
+}
+
+Path::Atom Path::Atom::parent() const
+{
+    uint32_t parent, name;
+    StringPool::path(mId, parent, name);
+    return fromId(parent);
+}
+
+String::Atom Path::Atom::name() const
+{
+    uint32_t parent, name;
+    StringPool::path(mId, parent, name);
+    return String::Atom::fromId(name);
+}
+
+Path Path::Atom::path() const
+{
+    // leaf first
+    List<StringView> components;
+    int size = 0;
+    for (uint32_t id = mId; id; ) {
+        uint32_t parent, name;
+        StringPool::path(id, parent, name);
+        components.append(StringPool::string(name));
+        size += components.last().size();
+        id = parent;
+    }
+    Path ret;
+    ret.reserve(size);
+    for (int i = components.size() - 1; i >= 0; --i)
+        ret.append(components.at(i).constData(), components.at(i).size());
+    return ret;
+}
@@ -0,0 +1,202 @@
+#ifndef StringPool_h
+#define StringPool_h
+
+#include <rct/Path.h>
+#include <rct/Serializer.h>
+#include <rct/String.h>
+#include <rct/StringView.h>
+#include <functional>
+#include <stdint.h>
+
+// Process wide pool of interned strings, and of paths as a parent path and
+// a name. Everything interned stays for the life of the process, what goes
+// in is meant to be the file names, directories and other strings a
+// program holds on to many copies of. Interning takes a lock, looking up
+// the characters of an atom doesn't.
+class StringPool
+{
+public:
+    // 0 is the empty string
+    static uint32_t intern(const StringView &string);
+    static StringView string(uint32_t id);
+
+    // 0 is the empty path, name is a String::Atom id
+    static uint32_t internPath(uint32_t parent, uint32_t name);
+    static void path(uint32_t id, uint32_t &parent, uint32_t &name);
+
+    static size_t stringCount();
+    static size_t pathCount();
+    // bytes held by the pool
+    static size_t memoryUsage();
+};
+
+// Four bytes instead of a String, equal if they're the same string.
+// Compares equal and hashes by id, sorts by characters
+class String::Atom
+{
+public:
+    Atom()
+        : mId(0)
+    {}
+    Atom(const StringView &string)
+        : mId(StringPool::intern(string))
+    {}
+    Atom(const String &string)
+        : mId(StringPool::intern(string))
+    {}
+    Atom(const char *string)
+        : mId(StringPool::intern(string))
+    {}
+
+    static Atom fromId(uint32_t id)
+    {
+        Atom ret;
+        ret.mId = id;
+        return ret;
+    }
+    uint32_t id() const { return mId; }
+
+    // the pool's characters, 0 terminated
+    StringView view() const { return StringPool::string(mId); }
+    const char *constData() const { return view().constData(); }
+    int size() const { return view().size(); }
+    bool isEmpty() const { return !mId; }
+    String toString() const { return view().toString(); }
+
+    bool operator==(const Atom &other) const { return mId == other.mId; }
+    bool operator!=(const Atom &other) const { return mId != other.mId; }
+    bool operator<(const Atom &other) const { return mId != other.mId && view() < other.view(); }
+    bool operator>(const Atom &other) const { return mId != other.mId && view() > other.view(); }
+
+private:
+    uint32_t mId;
+};
+
+// A path as the atom of its parent directory and a String::Atom for the
+// last component, so every directory is stored once however many paths are
+// under it. Components keep their trailing '/', path() gives back exactly
+// what went in
+class Path::Atom
+{
+public:
+    Atom()
+        : mId(0)
+    {}
+    Atom(const Path &path);
+    Atom(const Atom &parent, const String::Atom &name)
+        : mId(StringPool::internPath(parent.mId, name.id()))
+    {}
+
+    static Atom fromId(uint32_t id)
+    {
+        Atom ret;
+        ret.mId = id;
+        return ret;
+    }
+    uint32_t id() const { return mId; }
+
+    Atom parent() const;
+    String::Atom name() const;
+    Path path() const;
+    bool isEmpty() const { return !mId; }
+
+    bool operator==(const Atom &other) const { return mId == other.mId; }
+    bool operator!=(const Atom &other) const { return mId != other.mId; }
+    // builds both paths
+    bool operator<(const Atom &other) const { return mId != other.mId && path() < other.path(); }
+
+private:
+    uint32_t mId;
+};
+
+namespace std
+{
+template <> struct hash<String::Atom>
+{
+    size_t operator()(const String::Atom &value) const { return value.id(); }
+};
+template <> struct hash<Path::Atom>
+{
+    size_t operator()(const Path::Atom &value) const { return value.id(); }
+};
+}
+
+// ids are the pool's and only mean something in this process, so atoms go
+// out in full the first time, after that as their index in the stream's
+// table
+enum { NewAtom = 0xffffffff };
+
+template <>
+inline Serializer &operator<<(Serializer &s, const String::Atom &atom)
+{
+    FlatHash<uint32_t, uint32_t> &atoms = s.atoms(Serializer::StringAtoms);
+    const auto it = atoms.find(atom.id());
+    if (it != atoms.end())
+        return s << it->second;
+    const uint32_t index = atoms.size();
+    atoms[atom.id()] = index;
+    s << static_cast<uint32_t>(NewAtom) << atom.view();
+    return s;
+}
+
+template <>
+inline Deserializer &operator>>(Deserializer &s, String::Atom &atom)
+{
+    List<uint32_t> &atoms = s.atoms(Serializer::StringAtoms);
+    uint32_t index;
+    s >> index;
+    if (index == NewAtom) {
+        String string;
+        s >> string;
+        atom = string;
+        atoms.append(atom.id());
+    } else if (index < static_cast<uint32_t>(atoms.size())) {
+        atom = String::Atom::fromId(atoms.at(index));
+    } else {
+        error() << "Invalid String::Atom index" << index;
+        atom = String::Atom();
+    }
+    return s;
+}
+
+template <>
+inline Serializer &operator<<(Serializer &s, const Path::Atom &atom)
+{
+    FlatHash<uint32_t, uint32_t> &atoms = s.atoms(Serializer::PathAtoms);
+    // the empty path, where every parent chain ends, is always index 0
+    if (atoms.isEmpty())
+        atoms[0] = 0;
+    const auto it = atoms.find(atom.id());
+    if (it != atoms.end())
+        return s << it->second;
+    s << static_cast<uint32_t>(NewAtom) << atom.parent() << atom.name();
+    // after the parent, that's how the other side numbers them
+    const uint32_t index = atoms.size();
+    atoms[atom.id()] = index;
+    return s;
+}
+
+template <>
+inline Deserializer &operator>>(Deserializer &s, Path::Atom &atom)
+{
+    List<uint32_t> &atoms = s.atoms(Serializer::PathAtoms);
+    if (atoms.isEmpty())
+        atoms.append(0);
+    uint32_t index;
+    s >> index;
+    if (index == NewAtom) {
+        Path::Atom parent;
+        String::Atom name;
+        s >> parent >> name;
+        atom = Path::Atom(parent, name);
+        atoms.append(atom.id());
+    } else if (index < static_cast<uint32_t>(atoms.size())) {
+        atom = Path::Atom::fromId(atoms.at(index));
+    } else {
+        error() << "Invalid Path::Atom index" << index;
+        atom = Path::Atom();
+    }
+    return s;
+}
+
+#endif
@@ -0,0 +1,250 @@
+#ifndef StringView_h
+#define StringView_h
+
+#include <rct/Path.h>
+#include <rct/String.h>
+#include <algorithm>
+#include <functional>
+#include <string.h>
+
+// A slice of somebody else's characters, typically the buffer a Deserializer
+// is reading from. Nothing is copied or owned, whoever hands one out has to
+// keep the storage alive, see Deserializer::storage().
+class StringView
+{
+public:
+    StringView()
+        : mData(0), mSize(0)
+    {}
+    StringView(const char *data, int size = -1)
+        : mData(data), mSize(size == -1 ? (data ? strlen(data) : 0) : size)
+    {}
+    StringView(const String &string)
+        : mData(string.constData()), mSize(string.size())
+    {}
+
+    const char *data() const { return mData; }
+    const char *constData() const { return mData; }
+    int size() const { return mSize; }
+    int length() const { return mSize; }
+    bool isEmpty() const { return !mSize; }
+
+    char at(int i) const { return mData[i]; }
+    char operator[](int i) const { return mData[i]; }
+    const char *begin() const { return mData; }
+    const char *end() const { return mData + mSize; }
+
+    StringView mid(int from, int len = -1) const
+    {
+        if (from >= mSize)
+            return StringView();
+        if (len == -1 || from + len > mSize)
+            len = mSize - from;
+        return StringView(mData + from, len);
+    }
+    StringView left(int len) const { return StringView(mData, std::min(std::max(len, 0), mSize)); }
+    StringView right(int len) const
+    {
+        len = std::min(std::max(len, 0), mSize);
+        return StringView(mData + mSize - len, len);
+    }
+
+    StringView trimmed(const StringView &trim = " \f\n\r\t\v") const
+    {
+        int start = 0, end = mSize;
+        while (start < end && memchr(trim.mData, mData[start], trim.mSize))
+            ++start;
+        while (end > start && memchr(trim.mData, mData[end - 1], trim.mSize))
+            --end;
+        return StringView(mData + start, end - start);
+    }
+
+    int indexOf(char ch, int from = 0, String::CaseSensitivity cs = String::CaseSensitive) const
+    {
+        if (from < 0)
+            from = 0;
+        if (from >= mSize)
+            return -1;
+        const int ret = String::find(mData + from, mSize - from, ch, cs);
+        return ret == -1 ? -1 : ret + from;
+    }
+    int indexOf(const StringView &other, int from = 0, String::CaseSensitivity cs = String::CaseSensitive) const
+    {
+        if (from < 0)
+            from = 0;
+        if (from >= mSize)
+            return -1;
+        const int ret = String::find(mData + from, mSize - from, other.mData, other.mSize, cs);
+        return ret == -1 ? -1 : ret + from;
+    }
+    int lastIndexOf(char ch) const
+    {
+        for (int i = mSize - 1; i >= 0; --i) {
+            if (mData[i] == ch)
+                return i;
+        }
+        return -1;
+    }
+    bool contains(char ch, String::CaseSensitivity cs = String::CaseSensitive) const { return indexOf(ch, 0, cs) != -1; }
+    bool contains(const StringView &other, String::CaseSensitivity cs = String::CaseSensitive) const { return indexOf(other, 0, cs) != -1; }
+
+    bool startsWith(const StringView &other, String::CaseSensitivity cs = String::CaseSensitive) const
+    {
+        return mSize >= other.mSize && String::equals(mData, other.mData, other.mSize, cs);
+    }
+    bool endsWith(const StringView &other, String::CaseSensitivity cs = String::CaseSensitive) const
+    {
+        return mSize >= other.mSize && String::equals(mData + mSize - other.mSize, other.mData, other.mSize, cs);
+    }
+    bool startsWith(char ch) const { return mSize && mData[0] == ch; }
+    bool endsWith(char ch) const { return mSize && mData[mSize - 1] == ch; }
+
+    int compare(const StringView &other) const
+    {
+        const int ret = memcmp(mData, other.mData, std::min(mSize, other.mSize));
+        if (ret)
+            return ret;
+        return mSize - other.mSize;
+    }
+
+    bool operator==(const StringView &other) const { return mSize == other.mSize && !memcmp(mData, other.mData, mSize); }
+    bool operator!=(const StringView &other) const { return !operator==(other); }
+    bool operator<(const StringView &other) const { return compare(other) < 0; }
+    bool operator>(const StringView &other) const { return compare(other) > 0; }
+
+    // Splitting without building anything, same tokens as String::split():
+    //
+    // for (const StringView &token : view.tokens(':'))
+    class Tokens;
+    Tokens tokens(char ch, unsigned int flags = String::NoSplitFlag) const;
+    // separator has to stay around as long as the Tokens do
+    Tokens tokens(const StringView &separator, unsigned int flags = String::NoSplitFlag) const;
+
+    List<StringView> split(char ch, unsigned int flags = String::NoSplitFlag) const;
+    List<StringView> split(const StringView &separator, unsigned int flags = String::NoSplitFlag) const;
+
+    String toString() const { return String(mData, mSize); }
+    Path toPath() const { return Path(mData, mSize); }
+
+private:
+    const char *mData;
+    int mSize;
+};
+
+class StringView::Tokens
+{
+public:
+    class iterator
+    {
+    public:
+        const StringView &operator*() const { return mToken; }
+        const StringView *operator->() const { return &mToken; }
+        iterator &operator++()
+        {
+            advance();
+            return *this;
+        }
+        bool operator==(const iterator &other) const { return mDone == other.mDone && (mDone || mNext == other.mNext); }
+        bool operator!=(const iterator &other) const { return !operator==(other); }
+
+    private:
+        friend class Tokens;
+        iterator(const Tokens *tokens)
+            : mTokens(tokens), mNext(0), mDone(!tokens)
+        {
+            if (tokens)
+                advance();
+        }
+
+        void advance()
+        {
+            const StringView &string = mTokens->mString;
+            for (;;) {
+                if (mNext > string.mSize) {
+                    mDone = true;
+                    return;
+                }
+                const int sepSize = mTokens->mSeparator.mSize ? mTokens->mSeparator.mSize : 1;
+                int end = mTokens->mSeparator.mSize
+                    ? string.indexOf(mTokens->mSeparator, mNext)
+                    : string.indexOf(mTokens->mChar, mNext);
+                const int start = mNext;
+                if (end == -1) {
+                    end = string.mSize;
+                    mNext = string.mSize + 1;
+                } else {
+                    mNext = end + sepSize;
+                }
+                if (end > start || !(mTokens->mFlags & String::SkipEmpty)) {
+                    mToken = StringView(string.mData + start, end - start);
+                    return;
+                }
+            }
+        }
+
+        const Tokens *mTokens;
+        StringView mToken;
+        int mNext;
+        bool mDone;
+    };
+
+    iterator begin() const { return iterator(this); }
+    iterator end() const { return iterator(0); }
+
+private:
+    friend class StringView;
+    Tokens(const StringView &string, char ch, const StringView &separator, unsigned int flags)
+        : mString(string), mChar(ch), mSeparator(separator), mFlags(flags)
+    {}
+
+    StringView mString;
+    char mChar;
+    StringView mSeparator;
+    unsigned int mFlags;
+};
+
+
+inline StringView::Tokens StringView::tokens(char ch, unsigned int flags) const
+{
+    return Tokens(*this, ch, StringView(), flags);
+}
+
+inline StringView::Tokens StringView::tokens(const StringView &separator, unsigned int flags) const
+{
+    return separator.mSize == 1 ? Tokens(*this, separator.mData[0], StringView(), flags) : Tokens(*this, 0, separator, flags);
+}
+
+inline List<StringView> StringView::split(char ch, unsigned int flags) const
+{
+    List<StringView> ret;
+    for (const StringView &token : tokens(ch, flags))
+        ret.append(token);
+    return ret;
+}
+
+inline List<StringView> StringView::split(const StringView &separator, unsigned int flags) const
+{
+    List<StringView> ret;
+    for (const StringView &token : tokens(separator, flags))
+        ret.append(token);
+    return ret;
+}
+
+namespace std
+{
+template <> struct hash<StringView>
+{
+    // FNV-1a, hashing in place
+    size_t operator()(const StringView &value) const
+    {
+        uint64_t h = 14695981039346656037ull;
+        for (int i = 0; i < value.size(); ++i) {
+            h ^= static_cast<unsigned char>(value.at(i));
+            h *= 1099511628211ull;
+        }
+        return static_cast<size_t>(h);
+    }
+};
+}
+
+#endif
@@ -1,6 +1,9 @@
 #include "Thread.h"
 #include "Log.h"
 #include "rct-config.h"
+#ifdef OS_Linux
+#  include <sched.h>
+#endif
 
 Thread::Thread()
     : mAutoDelete(false), mRunning(false), mLoop(EventLoop::eventLoop())
@@ -16,6 +19,9 @@ Thread::~Thread()
 void* Thread::localStart(void* arg)
 {
     Thread* t = static_cast<Thread*>(arg);
+    const String name = t->name();
+    if (!name.isEmpty())
+        setCurrentName(name);
     t->run();
     if (t->isAutoDelete()) {
         if (EventLoop::SharedPtr loop = t->mLoop.lock())
@@ -34,6 +40,52 @@ static inline void initAttr(pthread_attr_t** pattr, pthread_attr_t* attr)
     }
 }
 
+#ifdef OS_Linux
+static inline void cpuSet(const List<int> &cpus, cpu_set_t *set)
+{
+    CPU_ZERO(set);
+    for (int cpu : cpus) {
+        if (cpu >= 0 && cpu < CPU_SETSIZE)
+            CPU_SET(cpu, set);
+    }
+}
+#endif
+
+bool Thread::setCurrentAffinity(const List<int> &cpus)
+{
+#ifdef OS_Linux
+    cpu_set_t set;
+    if (cpus.isEmpty()) {
+        // back to all of them
+        CPU_ZERO(&set);
+        for (int i = 0; i < CPU_SETSIZE; ++i)
+            CPU_SET(i, &set);
+    } else {
+        cpuSet(cpus, &set);
+    }
+    if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0) {
+        error() << "pthread_setaffinity_np failed";
+        return false;
+    }
+    return true;
+#else
+    (void)cpus;
+    return false;
+#endif
+}
+
+bool Thread::setCurrentName(const String &name)
+{
+#if defined(OS_Linux)
+    return !pthread_setname_np(pthread_self(), name.left(15).constData());
+#elif defined(OS_Darwin)
+    return !pthread_setname_np(name.constData());
+#else
+    (void)name;
+    return false;
+#endif
+}
+
 void Thread::start(Priority priority, size_t stackSize)
 {
     pthread_attr_t attr;
@@ -52,6 +104,19 @@ void Thread::start(Priority priority, size_t stackSize)
             error() << "pthread_attr_setstacksize failed";
         }
     }
+#ifdef OS_Linux
+    cpu_set_t set;
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        if (!mAffinity.isEmpty()) {
+            initAttr(&pattr, &attr);
+            cpuSet(mAffinity, &set);
+            if (pthread_attr_setaffinity_np(pattr, sizeof(set), &set) != 0) {
+                error() << "pthread_attr_setaffinity_np failed";
+            }
+        }
+    }
+#endif
     mRunning = true;
     if (pthread_create(&mThread, pattr, localStart, this) != 0) {
         error() << "pthread_create failed";
@@ -2,6 +2,8 @@
 #define THREAD_H
 
 #include "EventLoop.h"
+#include "List.h"
+#include "String.h"
 #include <pthread.h>
 #include <mutex>
 
@@ -29,6 +31,35 @@ public:
 
     pthread_t self() const { return mThread; }
 
+    // The CPUs the thread may run on, for start() from now on. Empty, the
+    // default, leaves it to the system. Only does anything on Linux
+    void setAffinity(const List<int> &cpus)
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mAffinity = cpus;
+    }
+    List<int> affinity() const
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        return mAffinity;
+    }
+    // the same for the calling thread, e.g. one running an EventLoop
+    static bool setCurrentAffinity(const List<int> &cpus);
+
+    // What the thread is called in top, gdb and CpuUsage::threads(), for
+    // start() from now on. Linux keeps 15 characters of it
+    void setName(const String &name)
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mName = name;
+    }
+    String name() const
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        return mName;
+    }
+    static bool setCurrentName(const String &name);
+
 protected:
     virtual void run() = 0;
 
@@ -43,6 +74,8 @@ private:
     pthread_t mThread;
     bool mRunning;
     EventLoop::WeakPtr mLoop;
+    List<int> mAffinity;
+    String mName;
 };
 
 #endif
@@ -0,0 +1,158 @@
+#include "ThreadLocal.h"
+#include <algorithm>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+__thread ThreadLocalBase::Table *ThreadLocalBase::sTable = 0;
+
+namespace {
+
+// Who has which slot, and every thread's table so a ThreadLocal going away
+// can get rid of its values
+struct Registry
+{
+    Registry()
+        : hasKey(false), nextSlot(0)
+    {}
+
+    std::mutex mutex;
+    // only there to be told when a thread exits
+    pthread_key_t key;
+    bool hasKey;
+    int nextSlot;
+    List<int> freeSlots;
+    List<void (*)(void *)> deleters;
+    List<void *> tables;
+};
+
+// never destroyed, threads may exit after static destructors ran
+static Registry &registry()
+{
+    static Registry *r = new Registry;
+    return *r;
+}
+
+struct Value
+{
+    void *data;
+    void (*deleter)(void *);
+};
+
+}
+
+static int allocateSlot(void (*deleter)(void *))
+{
+    Registry &r = registry();
+    std::lock_guard<std::mutex> lock(r.mutex);
+    int slot;
+    if (!r.freeSlots.isEmpty()) {
+        slot = r.freeSlots.takeLast();
+        r.deleters[slot] = deleter;
+    } else {
+        slot = r.nextSlot++;
+        r.deleters.append(deleter);
+    }
+    return slot;
+}
+
+ThreadLocalBase::ThreadLocalBase(void (*deleter)(void *))
+    : mSlot(allocateSlot(deleter)), mDeleter(deleter)
+{
+}
+
+ThreadLocalBase::~ThreadLocalBase()
+{
+    clearAll();
+    Registry &r = registry();
+    std::lock_guard<std::mutex> lock(r.mutex);
+    r.deleters[mSlot] = 0;
+    r.freeSlots.append(mSlot);
+}
+
+void ThreadLocalBase::setData(void *data)
+{
+    Table *table = sTable;
+    if (!table || mSlot >= table->size)
+        table = grow(mSlot + 1);
+    void *old = table->values[mSlot];
+    table->values[mSlot] = data;
+    if (old && old != data)
+        mDeleter(old);
+}
+
+void ThreadLocalBase::clearAll()
+{
+    // deleted outside the lock, destructors may use ThreadLocals too
+    List<void *> values;
+    {
+        Registry &r = registry();
+        std::lock_guard<std::mutex> lock(r.mutex);
+        for (void *t : r.tables) {
+            Table *table = static_cast<Table *>(t);
+            if (mSlot < table->size && table->values[mSlot]) {
+                values.append(table->values[mSlot]);
+                table->values[mSlot] = 0;
+            }
+        }
+    }
+    for (void *value : values)
+        mDeleter(value);
+}
+
+// under the lock since clearAll() may be going through it meanwhile
+ThreadLocalBase::Table *ThreadLocalBase::grow(int size)
+{
+    Registry &r = registry();
+    std::lock_guard<std::mutex> lock(r.mutex);
+    Table *table = sTable;
+    if (!table) {
+        table = new Table;
+        table->size = 0;
+        table->values = 0;
+        r.tables.append(table);
+        if (!r.hasKey) {
+            pthread_key_create(&r.key, destroyTable);
+            r.hasKey = true;
+        }
+        pthread_setspecific(r.key, table);
+        sTable = table;
+    }
+    if (size > table->size) {
+        // room for the ThreadLocals coming after this one too
+        const int newSize = std::max(size, std::max(r.nextSlot, table->size * 2));
+        void **values = new void *[newSize];
+        if (table->size)
+            memcpy(values, table->values, table->size * sizeof(void *));
+        memset(values + table->size, 0, (newSize - table->size) * sizeof(void *));
+        delete[] table->values;
+        table->values = values;
+        table->size = newSize;
+    }
+    return table;
+}
+
+void ThreadLocalBase::destroyTable(void *t)
+{
+    Table *table = static_cast<Table *>(t);
+    List<Value> values;
+    {
+        Registry &r = registry();
+        std::lock_guard<std::mutex> lock(r.mutex);
+        const int idx = r.tables.indexOf(table);
+        if (idx != -1)
+            r.tables.removeAt(idx);
+        for (int i = 0; i < table->size; ++i) {
+            if (table->values[i] && i < r.deleters.size() && r.deleters.at(i)) {
+                const Value value = { table->values[i], r.deleters.at(i) };
+                values.append(value);
+            }
+        }
+    }
+    if (sTable == table)
+        sTable = 0;
+    delete[] table->values;
+    delete table;
+    for (const Value &value : values)
+        value.deleter(value.data);
+}
@@ -1,56 +1,181 @@
 #ifndef THREADLOCAL_H
 #define THREADLOCAL_H
 
-#include <pthread.h>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <rct/List.h>
+
+// Every thread has a table of values, one slot per ThreadLocal, that it
+// gets at through a __thread pointer rather than pthread_getspecific(). Not
+// thread_local, for the sake of GCC 4.7. Values are deleted when their
+// thread exits or the ThreadLocal goes away.
+class ThreadLocalBase
+{
+protected:
+    ThreadLocalBase(void (*deleter)(void *));
+    ~ThreadLocalBase();
+
+    void *data() const
+    {
+        const Table *table = sTable;
+        return table && mSlot < table->size ? table->values[mSlot] : 0;
+    }
+    void setData(void *data);
+    // every thread's value
+    void clearAll();
+
+private:
+    struct Table
+    {
+        int size;
+        void **values;
+    };
+    static Table *grow(int size);
+    static void destroyTable(void *table);
+
+    const int mSlot;
+    void (*const mDeleter)(void *);
+
+    static __thread Table *sTable;
+
+    ThreadLocalBase(const ThreadLocalBase &) = delete;
+    ThreadLocalBase &operator=(const ThreadLocalBase &) = delete;
+};
 
 template<typename T>
-class ThreadLocal
+class ThreadLocal : public ThreadLocalBase
 {
 public:
-    ThreadLocal() { init(); }
-    ThreadLocal(const T& t) { init(); set(t); }
-    ThreadLocal(T* t) { init(); set(t); }
-    ~ThreadLocal() { clear(); }
+    ThreadLocal() : ThreadLocalBase(deleteValue) {}
+    ThreadLocal(const T& t) : ThreadLocalBase(deleteValue) { set(t); }
+    ThreadLocal(T* t) : ThreadLocalBase(deleteValue) { set(t); }
+    ~ThreadLocal() {}
 
-    void clear() { pthread_key_delete(mKey); }
+    void clear() { clearAll(); }
 
-    void set(const T& t) { setData(new T(t)); }
+    // assigned in place if this thread has one already
+    void set(const T& t)
+    {
+        if (T *existing = get()) {
+            *existing = t;
+        } else {
+            setData(new T(t));
+        }
+    }
     // takes ownership
     void set(T* t) { setData(t); }
 
     void remove() { setData(0); }
-    bool has() const { return getData() != 0; }
+    bool has() const { return data() != 0; }
 
-    T* get() { return reinterpret_cast<T*>(getData()); }
-    const T* get() const { return reinterpret_cast<const T*>(getData()); }
+    T* get() { return reinterpret_cast<T*>(data()); }
+    const T* get() const { return reinterpret_cast<const T*>(data()); }
 
-    T* operator->() { return reinterpret_cast<T*>(getData()); }
-    const T* operator->() const { return reinterpret_cast<const T*>(getData()); }
+    // this thread's, default constructed the first time
+    T& local()
+    {
+        if (T *t = get())
+            return *t;
+        T *t = new T;
+        setData(t);
+        return *t;
+    }
+
+    T* operator->() { return get(); }
+    const T* operator->() const { return get(); }
 
     ThreadLocal<T>& operator=(const T& other) { set(other); return *this; }
     ThreadLocal<T>& operator=(const ThreadLocal<T>& other) { set(*other.get()); return *this; }
 
 private:
-    void init()
+    static void deleteValue(void* val)
     {
-        pthread_key_create(&mKey, deleteValue);
+        delete reinterpret_cast<T*>(val);
     }
-    void setData(void* data)
+};
+
+// One T per thread, e.g. a scratch Buffer or String, or counters to add
+// up. local() is about as cheap as ThreadLocal::local(). The cache owns the
+// objects, they stay around after their thread exits until clear() or the
+// cache goes, so forEach() sees what every thread did. Threads keep using
+// theirs while forEach() runs, T has to cope with that, e.g. with atomics,
+// or the threads have to be quiet
+template <typename T>
+class PerThreadCache
+{
+public:
+    PerThreadCache()
+        : mGeneration(0)
+    {}
+
+    T &local()
     {
-        delete reinterpret_cast<T*>(getData());
-        pthread_setspecific(mKey, data);
+        Slot *slot = mLocal.get();
+        if (slot && slot->generation == mGeneration.load(std::memory_order_acquire))
+            return *slot->value;
+        std::shared_ptr<T> t = std::make_shared<T>();
+        unsigned int generation;
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            generation = mGeneration.load(std::memory_order_relaxed);
+            mAll.append(t);
+        }
+        if (!slot) {
+            slot = new Slot;
+            mLocal.set(slot);
+        }
+        // the one from before clear() goes now, on its own thread
+        slot->value = std::move(t);
+        slot->generation = generation;
+        return *slot->value;
     }
-    void* getData() const
+
+    // f(T &) for each thread's, including threads that are gone
+    template <typename F>
+    void forEach(F &&f)
     {
-        return pthread_getspecific(mKey);
+        std::lock_guard<std::mutex> lock(mMutex);
+        for (const std::shared_ptr<T> &t : mAll)
+            f(*t);
     }
-    static void deleteValue(void* val)
+
+    // folds every thread's into init with f(R &, const T &)
+    template <typename R, typename F>
+    R aggregate(R init, F &&f)
     {
-        delete reinterpret_cast<T*>(val);
+        forEach([&init, &f](T &t) { f(init, t); });
+        return init;
+    }
+
+    int size() const
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        return mAll.size();
+    }
+
+    // forgets every thread's, threads get new ones on their next local().
+    // Their slots are left alone, each thread lets go of its old one
+    // itself, so what a thread got from local() stays valid until it calls
+    // local() again
+    void clear()
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mGeneration.fetch_add(1, std::memory_order_release);
+        mAll.clear();
     }
 
 private:
-    pthread_key_t mKey;
+    struct Slot
+    {
+        std::shared_ptr<T> value;
+        // of the cache when value was made
+        unsigned int generation;
+    };
+    ThreadLocal<Slot> mLocal;
+    std::atomic<unsigned int> mGeneration;
+    mutable std::mutex mMutex;
+    List<std::shared_ptr<T> > mAll;
 };
 
 #endif
@@ -1,14 +1,24 @@
 #include "ThreadPool.h"
+#include "CpuUsage.h"
 #include "Thread.h"
 #include "Log.h"
+#include "Path.h"
+#include "Trace.h"
 #include "rct-config.h"
 #include <algorithm>
 #include <assert.h>
+#include <time.h>
+#ifdef __GXX_RTTI
+#   include <cxxabi.h>
+#endif
 #if defined (OS_FreeBSD) || defined (OS_NetBSD) || defined (OS_OpenBSD)
 #   include <sys/types.h>
 #   include <sys/sysctl.h>
 #elif defined (OS_Linux)
 #   include <unistd.h>
+#   include <sched.h>
+#   include <linux/futex.h>
+#   include <sys/syscall.h>
 #elif defined (OS_Darwin)
 #   include <sys/param.h>
 #   include <sys/sysctl.h>
@@ -20,11 +30,180 @@ using std::shared_ptr;
 
 ThreadPool* ThreadPool::sInstance = 0;
 
+// Where an idle WorkStealing worker sleeps until it's handed work, one per
+// thread so waking one doesn't wake the others. Empty, Parked while
+// sleeping, Notified when woken before it got there
+class Parker
+{
+public:
+    Parker()
+        : mState(Empty)
+    {}
+
+    void park()
+    {
+        if (mState.fetch_sub(1, std::memory_order_acquire) == Notified)
+            return;
+#ifdef OS_Linux
+        for (;;) {
+            syscall(SYS_futex, reinterpret_cast<int *>(&mState), FUTEX_WAIT_PRIVATE, Parked, 0, 0, 0);
+            int notified = Notified;
+            if (mState.compare_exchange_strong(notified, Empty, std::memory_order_acquire))
+                return;
+        }
+#else
+        std::unique_lock<std::mutex> lock(mMutex);
+        int notified = Notified;
+        while (!mState.compare_exchange_strong(notified, Empty, std::memory_order_acquire)) {
+            notified = Notified;
+            mCond.wait(lock);
+        }
+#endif
+    }
+
+    void unpark()
+    {
+        if (mState.exchange(Notified, std::memory_order_release) != Parked)
+            return;
+#ifdef OS_Linux
+        syscall(SYS_futex, reinterpret_cast<int *>(&mState), FUTEX_WAKE_PRIVATE, 1, 0, 0, 0);
+#else
+        std::lock_guard<std::mutex> lock(mMutex);
+        mCond.notify_one();
+#endif
+    }
+
+private:
+    enum { Parked = -1, Empty, Notified };
+    std::atomic<int> mState;
+#ifndef OS_Linux
+    std::mutex mMutex;
+    std::condition_variable mCond;
+#endif
+};
+
+// The Chase-Lev deque, with the orderings from Lê et al., "Correct and
+// Efficient Work-Stealing for Weak Memory Models". The owning worker pushes
+// and takes at the bottom, anyone steals from the top. Arrays it grew out
+// of are kept until the deque goes, a thief may still be reading one
+class ThreadPool::WorkQueue
+{
+public:
+    typedef Task *Item;
+
+    WorkQueue()
+        : mTop(0), mBottom(0), mArray(new Array(InitialSize))
+    {}
+
+    ~WorkQueue()
+    {
+        while (Item item = take())
+            item->drop();
+        delete mArray.load(std::memory_order_relaxed);
+        for (Array *array : mRetired)
+            delete array;
+    }
+
+    // owner only
+    void push(Item item)
+    {
+        const int64_t b = mBottom.load(std::memory_order_relaxed);
+        const int64_t t = mTop.load(std::memory_order_acquire);
+        Array *array = mArray.load(std::memory_order_relaxed);
+        if (b - t > array->mask) {
+            Array *bigger = new Array(array->size() * 2);
+            for (int64_t i = t; i < b; ++i)
+                bigger->store(i, array->load(i));
+            mRetired.append(array);
+            mArray.store(bigger, std::memory_order_release);
+            array = bigger;
+        }
+        array->store(b, item);
+        std::atomic_thread_fence(std::memory_order_release);
+        mBottom.store(b + 1, std::memory_order_relaxed);
+    }
+
+    // owner only, newest first
+    Item take()
+    {
+        const int64_t b = mBottom.load(std::memory_order_relaxed) - 1;
+        Array *array = mArray.load(std::memory_order_relaxed);
+        mBottom.store(b, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t t = mTop.load(std::memory_order_relaxed);
+        if (t > b) {
+            mBottom.store(b + 1, std::memory_order_relaxed);
+            return 0;
+        }
+        Item item = array->load(b);
+        if (t == b) {
+            // the last one, a thief may be after it too
+            if (!mTop.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+                item = 0;
+            mBottom.store(b + 1, std::memory_order_relaxed);
+        }
+        return item;
+    }
+
+    // anyone, oldest first. Null with lost set when another thread got to
+    // it first, there may be more
+    Item steal(bool &lost)
+    {
+        int64_t t = mTop.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        const int64_t b = mBottom.load(std::memory_order_acquire);
+        if (t >= b)
+            return 0;
+        Item item = mArray.load(std::memory_order_acquire)->load(t);
+        if (!mTop.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+            lost = true;
+            return 0;
+        }
+        return item;
+    }
+
+    int size() const
+    {
+        const int64_t b = mBottom.load(std::memory_order_relaxed);
+        const int64_t t = mTop.load(std::memory_order_relaxed);
+        return b > t ? static_cast<int>(b - t) : 0;
+    }
+
+private:
+    enum { InitialSize = 64 };
+
+    struct Array
+    {
+        Array(int64_t size)
+            : mask(size - 1), items(new std::atomic<Item>[size])
+        {}
+        ~Array() { delete[] items; }
+
+        int64_t size() const { return mask + 1; }
+        Item load(int64_t i) const { return items[i & mask].load(std::memory_order_relaxed); }
+        void store(int64_t i, Item item) { items[i & mask].store(item, std::memory_order_relaxed); }
+
+        const int64_t mask;
+        std::atomic<Item> *items;
+    };
+
+    // on cache lines of their own, the owner writes one and thieves the
+    // other
+    char mPadding0[64];
+    std::atomic<int64_t> mTop;
+    char mPadding1[64 - sizeof(std::atomic<int64_t>)];
+    std::atomic<int64_t> mBottom;
+    char mPadding2[64 - sizeof(std::atomic<int64_t>)];
+    std::atomic<Array *> mArray;
+    List<Array *> mRetired;
+};
+
 class ThreadPoolThread : public Thread
 {
 public:
-    ThreadPoolThread(ThreadPool* pool);
+    ThreadPoolThread(ThreadPool* pool, int index);
     ThreadPoolThread(const std::shared_ptr<ThreadPool::Job> &job);
+    ThreadPoolThread(ThreadPool::Task *task);
 
     void stop();
 
@@ -32,25 +211,75 @@ protected:
     virtual void run() override;
 
 private:
+    void runShared();
+    void runStealing();
+    ThreadPool::Task *findTask();
+    ThreadPool::Task *steal();
+    void execute(ThreadPool::Task *task);
+
     std::shared_ptr<ThreadPool::Job> mJob;
+    ThreadPool::Task *mTask;
     ThreadPool* mPool;
-    bool mStopped;
+    std::atomic<bool> mStopped;
+    const int mIndex;
+    ThreadPool::WorkQueue *mQueue;
+    const int mNode;
+    Parker mParker;
+    unsigned int mRandom;
+    // with cpu accounting on, mBusySince is when the job that's running
+    // started, 0 between jobs
+    std::mutex mAccountingMutex;
+    ThreadPool::Accounting mAccounting;
+    std::atomic<uint64_t> mBusySince;
+
+    friend class ThreadPool;
 };
 
-ThreadPoolThread::ThreadPoolThread(ThreadPool* pool)
-    : mPool(pool), mStopped(false)
+// the worker running on this thread, if any
+static __thread ThreadPoolThread *currentWorker = 0;
+
+ThreadPoolThread::ThreadPoolThread(ThreadPool* pool, int index)
+    : mTask(0), mPool(pool), mStopped(false), mIndex(index), mQueue(0),
+      mNode(pool->mNodes.size() > 1 ? index % pool->mNodes.size() : 0), mRandom(index + 1), mBusySince(0)
 {
     setAutoDelete(false);
+    setName("ThreadPool");
+    mAccounting.since = Rct::monoNs();
+    if (pool->mPlacement == ThreadPool::PinToNodes && !pool->mNodes.isEmpty())
+        setAffinity(pool->mNodes.at(mNode));
+    if (pool->mScheduling == ThreadPool::WorkStealing && index < ThreadPool::MaxWorkQueues) {
+        mQueue = pool->mWorkQueues[index].load(std::memory_order_relaxed);
+        if (!mQueue) {
+            mQueue = new ThreadPool::WorkQueue;
+            pool->mWorkQueueNodes[index] = mNode;
+            pool->mWorkQueues[index].store(mQueue, std::memory_order_release);
+            if (pool->mWorkQueueCount.load(std::memory_order_relaxed) <= index)
+                pool->mWorkQueueCount.store(index + 1, std::memory_order_release);
+        }
+    }
 }
 
 ThreadPoolThread::ThreadPoolThread(const std::shared_ptr<ThreadPool::Job> &job)
-    : mJob(job), mPool(0), mStopped(false)
+    : mJob(job), mTask(0), mPool(0), mStopped(false), mIndex(-1), mQueue(0), mNode(0), mRandom(0), mBusySince(0)
+{
+    setAutoDelete(false);
+    setName("ThreadPoolJob");
+}
+
+ThreadPoolThread::ThreadPoolThread(ThreadPool::Task *task)
+    : mTask(task), mPool(0), mStopped(false), mIndex(-1), mQueue(0), mNode(0), mRandom(0), mBusySince(0)
 {
     setAutoDelete(false);
+    setName("ThreadPoolJob");
 }
 
 void ThreadPoolThread::stop()
 {
+    if (mPool->mScheduling == ThreadPool::WorkStealing) {
+        mStopped.store(true);
+        mParker.unpark();
+        return;
+    }
     std::lock_guard<std::mutex> lock(mPool->mMutex);
     mStopped = true;
     mPool->mCond.notify_all();
@@ -60,10 +289,72 @@ void ThreadPoolThread::run()
 {
     if (mJob) {
         mJob->mMutex.lock();
-        mJob->run();
+        mJob->mQueued = false;
+        if (mJob->mCancelled) {
+            mJob->mCancelled = false;
+            mJob->mMutex.unlock();
+            return;
+        }
+        mJob->mState = ThreadPool::Job::Running;
+        {
+            TraceScope trace("ThreadPool::Job::run", "threadpool");
+            mJob->run();
+        }
+        mJob->mState = ThreadPool::Job::Finished;
         mJob->mMutex.unlock();
         return;
     }
+    if (mTask) {
+        {
+            TraceScope trace("ThreadPool::Task", "threadpool");
+            mTask->execute();
+        }
+        mTask = 0;
+        return;
+    }
+    if (mPool->mScheduling == ThreadPool::WorkStealing) {
+        runStealing();
+    } else {
+        runShared();
+    }
+}
+
+void ThreadPoolThread::execute(ThreadPool::Task *task)
+{
+    TraceScope trace("ThreadPool::Task", "threadpool");
+    if (!mPool->mAccounting.load(std::memory_order_relaxed)) {
+        task->execute();
+        return;
+    }
+    // the job may be gone once it has run
+#ifdef __GXX_RTTI
+    ThreadPool::Job *job = task->job();
+    const std::type_info *type = job ? &typeid(*job) : &typeid(*task);
+#else
+    const std::type_info *type = 0;
+#endif
+    const uint64_t start = Rct::monoNs();
+    const uint64_t cpu = CpuUsage::threadCpuTimeNs();
+    mBusySince.store(start, std::memory_order_relaxed);
+    task->execute();
+    const uint64_t cpuNs = CpuUsage::threadCpuTimeNs() - cpu;
+    const uint64_t now = Rct::monoNs();
+    std::lock_guard<std::mutex> lock(mAccountingMutex);
+    mBusySince.store(0, std::memory_order_relaxed);
+    // started over while it ran
+    const uint64_t wallNs = now - std::max(start, mAccounting.since);
+    mAccounting.busyNs += wallNs;
+    mAccounting.cpuNs += cpuNs;
+    ++mAccounting.jobs;
+    ThreadPool::JobCpu &jobCpu = mAccounting.types[type];
+    ++jobCpu.jobs;
+    jobCpu.wallNs += wallNs;
+    jobCpu.cpuNs += cpuNs;
+}
+
+void ThreadPoolThread::runShared()
+{
+    currentWorker = this;
     bool first = true;
     for (;;) {
         std::unique_lock<std::mutex> lock(mPool->mMutex);
@@ -72,36 +363,159 @@ void ThreadPoolThread::run()
         } else {
             first = false;
         }
-        while (mPool->mJobs.empty() && !mStopped)
+        while (!mPool->mSharedCount.load(std::memory_order_relaxed) && !mStopped)
             mPool->mCond.wait(lock);
         if (mStopped)
             break;
-        std::deque<std::shared_ptr<ThreadPool::Job> >::iterator item = mPool->mJobs.begin();
-        assert(item != mPool->mJobs.end());
-        std::shared_ptr<ThreadPool::Job> job = *item;
-        mPool->mJobs.erase(item);
-        {
-            std::lock_guard<std::mutex> joblock(job->mMutex);
-            job->mState = ThreadPool::Job::Running;
-        }
+        ThreadPool::Task *task = mPool->takeShared();
+        assert(task);
         ++mPool->mBusyThreads;
         lock.unlock();
-        job->run();
+        execute(task);
+    }
+    currentWorker = 0;
+}
+
+void ThreadPoolThread::runStealing()
+{
+    currentWorker = this;
+    while (!mStopped.load(std::memory_order_relaxed)) {
+        ThreadPool::Task *task = findTask();
+        if (!task) {
+            mPool->park(this);
+            continue;
+        }
+        ++mPool->mBusyThreads;
+        execute(task);
+        --mPool->mBusyThreads;
+    }
+    currentWorker = 0;
+    mPool->unidle(this);
+
+    // what's left on the deque goes to the others, it stays for whoever
+    // gets this index next
+    if (mQueue) {
+        bool moved = false;
         {
-            std::lock_guard<std::mutex> joblock(job->mMutex);
-            job->mState = ThreadPool::Job::Finished;
+            std::lock_guard<std::mutex> lock(mPool->mMutex);
+            while (ThreadPool::Task *task = mQueue->take()) {
+                mPool->enqueue(task);
+                moved = true;
+            }
         }
+        if (moved)
+            mPool->wakeOne();
+    }
+}
+
+// prioritized tasks on the shared queue first, then our own newest, then
+// the shared queue, then the oldest of someone else's
+ThreadPool::Task *ThreadPoolThread::findTask()
+{
+    ThreadPool::Task *task = 0;
+    if (mPool->mPrioritizedCount.load(std::memory_order_relaxed) > 0) {
+        std::lock_guard<std::mutex> lock(mPool->mMutex);
+        task = mPool->takeShared();
+    }
+    if (!task && mQueue)
+        task = mQueue->take();
+    if (!task && mPool->mSharedCount.load(std::memory_order_relaxed) > 0) {
+        std::lock_guard<std::mutex> lock(mPool->mMutex);
+        task = mPool->takeShared();
     }
+    if (!task)
+        task = steal();
+    return task;
 }
 
-ThreadPool::ThreadPool(int concurrentJobs, Thread::Priority priority, size_t threadStackSize)
+ThreadPool::Task *ThreadPoolThread::steal()
+{
+    for (;;) {
+        const int count = mPool->mWorkQueueCount.load(std::memory_order_acquire);
+        if (!count)
+            return 0;
+        // xorshift, so thieves don't all go for the same victim
+        mRandom ^= mRandom << 13;
+        mRandom ^= mRandom >> 17;
+        mRandom ^= mRandom << 5;
+        const int first = mRandom % count;
+        bool lost = false;
+        // our own node first, when there's more than one
+        const int passes = mPool->mNodes.size() > 1 ? 2 : 1;
+        for (int pass = 0; pass < passes; ++pass) {
+            for (int i = 0; i < count; ++i) {
+                const int idx = (first + i) % count;
+                if (idx == mIndex)
+                    continue;
+                ThreadPool::WorkQueue *queue = mPool->mWorkQueues[idx].load(std::memory_order_acquire);
+                if (!queue)
+                    continue;
+                const bool local = mPool->mWorkQueueNodes[idx] == mNode;
+                if (passes > 1 && local != !pass)
+                    continue;
+                if (ThreadPool::Task *task = queue->steal(lost))
+                    return task;
+            }
+        }
+        if (!lost)
+            return 0;
+    }
+}
+
+void ThreadPool::Job::JobTask::execute()
+{
+    // the queue's reference, the job may go away with it
+    const std::shared_ptr<Job> job = std::move(mJob);
+    if (!job)
+        return;
+    {
+        std::lock_guard<std::mutex> joblock(job->mMutex);
+        // from a deque, remove() may have been there
+        job->mQueued = false;
+        if (job->mCancelled) {
+            job->mCancelled = false;
+            return;
+        }
+        job->mState = Running;
+    }
+    {
+        TraceScope trace("ThreadPool::Job::run", "threadpool");
+        job->run();
+    }
+    std::lock_guard<std::mutex> joblock(job->mMutex);
+    job->mState = Finished;
+}
+
+void ThreadPool::Job::JobTask::drop()
+{
+    mJob.reset();
+}
+
+ThreadPool::ThreadPool(int concurrentJobs, Thread::Priority priority, size_t threadStackSize,
+                       Scheduling scheduling, Placement placement)
     : mConcurrentJobs(concurrentJobs), mBusyThreads(0),
-      mPriority(priority), mThreadStackSize(threadStackSize)
+      mPriority(priority), mThreadStackSize(threadStackSize), mScheduling(scheduling),
+      mPlacement(placement), mWorkQueueCount(0), mSharedCount(0), mPrioritizedCount(0), mIdleCount(0),
+      mAccounting(false)
 {
+    for (int i = 0; i < MaxWorkQueues; ++i) {
+        mWorkQueues[i].store(0, std::memory_order_relaxed);
+        mWorkQueueNodes[i] = 0;
+    }
+    if (mPlacement == PinToNodes) {
+        mNodes = numaNodes();
+        for (int node = 0; node < mNodes.size(); ++node) {
+            for (int cpu : mNodes.at(node)) {
+                if (cpu >= mCpuNodes.size())
+                    mCpuNodes.resize(cpu + 1, 0);
+                mCpuNodes[cpu] = node;
+            }
+        }
+    }
     if (!sInstance)
         sInstance = this;
     for (int i = 0; i < mConcurrentJobs; ++i) {
-        mThreads.push_back(new ThreadPoolThread(this));
+        mThreads.push_back(createThread(i));
         mThreads.back()->start(mPriority, mThreadStackSize);
     }
 }
@@ -110,9 +524,7 @@ ThreadPool::~ThreadPool()
 {
     if (sInstance == this)
         sInstance = 0;
-    std::unique_lock<std::mutex> lock(mMutex);
-    mJobs.clear();
-    lock.unlock();
+    clearBackLog();
     for (List<ThreadPoolThread*>::iterator it = mThreads.begin();
          it != mThreads.end(); ++it) {
         ThreadPoolThread* t = *it;
@@ -120,6 +532,13 @@ ThreadPool::~ThreadPool()
         t->join();
         delete t;
     }
+    for (int i = 0; i < MaxWorkQueues; ++i)
+        delete mWorkQueues[i].load(std::memory_order_relaxed);
+}
+
+ThreadPoolThread *ThreadPool::createThread(int index)
+{
+    return new ThreadPoolThread(this, index);
 }
 
 void ThreadPool::setConcurrentJobs(int concurrentJobs)
@@ -129,7 +548,7 @@ void ThreadPool::setConcurrentJobs(int concurrentJobs)
     if (concurrentJobs > mConcurrentJobs) {
         std::lock_guard<std::mutex> lock(mMutex);
         for (int i = mConcurrentJobs; i < concurrentJobs; ++i) {
-            mThreads.push_back(new ThreadPoolThread(this));
+            mThreads.push_back(createThread(i));
             mThreads.back()->start(mPriority, mThreadStackSize);
         }
         mConcurrentJobs = concurrentJobs;
@@ -142,49 +561,231 @@ void ThreadPool::setConcurrentJobs(int concurrentJobs)
             t->stop();
             t->join();
             lock.lock();
+            {
+                std::lock_guard<std::mutex> accountingLock(t->mAccountingMutex);
+                mRetired.add(t->mAccounting);
+                mRetired.retiredNs += Rct::monoNs() - t->mAccounting.since;
+            }
             delete t;
         }
         mConcurrentJobs = concurrentJobs;
     }
 }
 
-bool ThreadPool::jobLessThan(const std::shared_ptr<Job> &l, const std::shared_ptr<Job> &r)
+void ThreadPool::enqueue(Task *task)
 {
-    return static_cast<unsigned>(l->mPriority) > static_cast<unsigned>(r->mPriority);
+    Buckets::iterator bucket = mJobs.find(task->mPriority);
+    if (bucket == mJobs.end())
+        bucket = mJobs.insert(std::make_pair(static_cast<unsigned int>(task->mPriority), Bucket())).first;
+    task->mShared = true;
+    task->mBucket = bucket;
+    task->mNext = 0;
+    task->mPrev = bucket->second.last;
+    if (task->mPrev) {
+        task->mPrev->mNext = task;
+    } else {
+        bucket->second.first = task;
+    }
+    bucket->second.last = task;
+    mSharedCount.fetch_add(1, std::memory_order_relaxed);
+    if (task->mPriority)
+        mPrioritizedCount.fetch_add(1, std::memory_order_relaxed);
 }
 
-void ThreadPool::start(const std::shared_ptr<Job> &job, int priority)
+void ThreadPool::unqueue(Task *task)
 {
-    job->mPriority = priority;
+    assert(task->mShared);
+    task->mShared = false;
+    const Buckets::iterator bucket = task->mBucket;
+    if (task->mPrev) {
+        task->mPrev->mNext = task->mNext;
+    } else {
+        bucket->second.first = task->mNext;
+    }
+    if (task->mNext) {
+        task->mNext->mPrev = task->mPrev;
+    } else {
+        bucket->second.last = task->mPrev;
+    }
+    task->mPrev = task->mNext = 0;
+    mSharedCount.fetch_sub(1, std::memory_order_relaxed);
+    if (bucket->first)
+        mPrioritizedCount.fetch_sub(1, std::memory_order_relaxed);
+    if (!bucket->second.first)
+        mJobs.erase(bucket);
+}
+
+ThreadPool::Task *ThreadPool::takeShared()
+{
+    if (mJobs.empty())
+        return 0;
+    Task *task = mJobs.begin()->second.first;
+    unqueue(task);
+    return task;
+}
+
+bool ThreadPool::start(const std::shared_ptr<Job> &job, int priority)
+{
+    {
+        // there's one task per job, it can only be queued once
+        std::lock_guard<std::mutex> joblock(job->mMutex);
+        if (job->mQueued && job->mCancelled) {
+            // removed from a deque but still on it, it runs after all
+            job->mCancelled = false;
+            return true;
+        }
+        if (job->mQueued || job->mState == Job::Running) {
+            assert(0 && "ThreadPool::start() of a job that's already started");
+            return false;
+        }
+        job->mQueued = true;
+    }
     if (priority == Guaranteed) {
         ThreadPoolThread *t = new ThreadPoolThread(job);
         t->start(mPriority, mThreadStackSize);
+        return true;
+    }
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        job->mTask.mJob = job;
+    }
+    schedule(&job->mTask, priority);
+    return true;
+}
+
+void ThreadPool::schedule(Task *task, int priority)
+{
+    if (priority == Guaranteed) {
+        ThreadPoolThread *t = new ThreadPoolThread(task);
+        t->start(mPriority, mThreadStackSize);
         return;
     }
 
-    std::lock_guard<std::mutex> lock(mMutex);
-    if (mJobs.empty()) {
-        mJobs.push_back(job);
+    if (mScheduling == WorkStealing && !priority && currentWorker
+        && currentWorker->mPool == this && currentWorker->mQueue) {
+        task->mPriority = 0;
+        currentWorker->mQueue->push(task);
+        wakeOne();
+        return;
+    }
+
+    std::unique_lock<std::mutex> lock(mMutex);
+    task->mPriority = priority;
+    enqueue(task);
+    if (mScheduling == WorkStealing) {
+        lock.unlock();
+        wakeOne();
     } else {
-        if (mJobs.at(mJobs.size() - 1)->mPriority >= priority) {
-            mJobs.push_back(job);
-        } else if (mJobs.at(0)->mPriority < priority) {
-            mJobs.push_front(job);
-        } else {
-            mJobs.push_back(job);
-            std::sort(mJobs.begin(), mJobs.end(), jobLessThan);
+        mCond.notify_one();
+    }
+}
+
+// Both sides look after announcing themselves, with a full fence in
+// between, so either the worker sees the task or whoever started it sees
+// the worker idle
+bool ThreadPool::hasWork() const
+{
+    if (mSharedCount.load(std::memory_order_relaxed) > 0)
+        return true;
+    const int count = mWorkQueueCount.load(std::memory_order_acquire);
+    for (int i = 0; i < count; ++i) {
+        const WorkQueue *queue = mWorkQueues[i].load(std::memory_order_acquire);
+        if (queue && queue->size())
+            return true;
+    }
+    return false;
+}
+
+void ThreadPool::wakeOne()
+{
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (!mIdleCount.load(std::memory_order_relaxed))
+        return;
+    const int node = mNodes.size() > 1 ? currentNode() : -1;
+    // a worker leaves the list before it goes away so unparking under the
+    // lock can't touch one that's gone
+    std::lock_guard<std::mutex> lock(mIdleMutex);
+    if (mIdle.isEmpty())
+        return;
+    int idx = mIdle.size() - 1;
+    if (node != -1) {
+        // one on our node if there is one
+        for (int i = idx; i >= 0; --i) {
+            if (mIdle.at(i)->mNode == node) {
+                idx = i;
+                break;
+            }
         }
     }
-    mCond.notify_one();
+    ThreadPoolThread *thread = mIdle.at(idx);
+    mIdle.removeAt(idx);
+    mIdleCount.fetch_sub(1, std::memory_order_relaxed);
+    thread->mParker.unpark();
+}
+
+bool ThreadPool::isWorkerThread() const
+{
+    return currentWorker && currentWorker->mPool == this;
+}
+
+int ThreadPool::currentNode() const
+{
+    if (mScheduling == WorkStealing && currentWorker && currentWorker->mPool == this)
+        return currentWorker->mNode;
+#ifdef OS_Linux
+    const int cpu = sched_getcpu();
+    if (cpu >= 0 && cpu < mCpuNodes.size())
+        return mCpuNodes.at(cpu);
+#endif
+    return -1;
+}
+
+void ThreadPool::park(ThreadPoolThread *thread)
+{
+    {
+        std::lock_guard<std::mutex> lock(mIdleMutex);
+        mIdle.append(thread);
+        mIdleCount.fetch_add(1, std::memory_order_relaxed);
+    }
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (hasWork() || thread->mStopped.load(std::memory_order_relaxed)) {
+        unidle(thread);
+        return;
+    }
+    // whoever wakes us takes us off the list
+    thread->mParker.park();
+}
+
+void ThreadPool::unidle(ThreadPoolThread *thread)
+{
+    std::lock_guard<std::mutex> lock(mIdleMutex);
+    const int idx = mIdle.indexOf(thread);
+    if (idx != -1) {
+        mIdle.removeAt(idx);
+        mIdleCount.fetch_sub(1, std::memory_order_relaxed);
+    }
 }
 
 bool ThreadPool::remove(const std::shared_ptr<Job> &job)
 {
-    std::lock_guard<std::mutex> lock(mMutex);
-    std::deque<std::shared_ptr<Job> >::iterator it = std::find(mJobs.begin(), mJobs.end(), job);
-    if (it == mJobs.end())
+    bool unqueued = false;
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        if (job->mTask.mShared) {
+            unqueue(&job->mTask);
+            job->mTask.mJob.reset();
+            unqueued = true;
+        }
+    }
+    std::lock_guard<std::mutex> joblock(job->mMutex);
+    if (unqueued) {
+        job->mQueued = false;
+        return true;
+    }
+    // on a deque it stays there, whoever takes it drops it
+    if (!job->mQueued || job->mCancelled || job->mState != Job::NotStarted)
         return false;
-    mJobs.erase(it);
+    job->mCancelled = true;
     return true;
 }
 
@@ -250,6 +851,42 @@ int ThreadPool::idealThreadCount()
 #endif
 }
 
+// "0-3,8-11"
+static List<int> parseCpuList(const String &list)
+{
+    List<int> ret;
+    for (const String &range : list.split(',', String::SkipEmpty)) {
+        const int dash = range.indexOf('-');
+        const int first = atoi(range.constData());
+        const int last = dash == -1 ? first : atoi(range.constData() + dash + 1);
+        for (int cpu = first; cpu <= last; ++cpu)
+            ret.append(cpu);
+    }
+    return ret;
+}
+
+List<List<int> > ThreadPool::numaNodes()
+{
+    List<List<int> > ret;
+#ifdef OS_Linux
+    const List<int> nodes = parseCpuList(Path("/sys/devices/system/node/online").readAll().trimmed());
+    for (int node : nodes) {
+        const List<int> cpus = parseCpuList(Path(String::format<64>("/sys/devices/system/node/node%d/cpulist", node)).readAll().trimmed());
+        // memory only nodes have none
+        if (!cpus.isEmpty())
+            ret.append(cpus);
+    }
+#endif
+    if (ret.isEmpty()) {
+        List<int> cpus;
+        const int count = std::max(idealThreadCount(), 1);
+        for (int cpu = 0; cpu < count; ++cpu)
+            cpus.append(cpu);
+        ret.append(cpus);
+    }
+    return ret;
+}
+
 ThreadPool* ThreadPool::instance()
 {
     if (!sInstance)
@@ -258,24 +895,139 @@ ThreadPool* ThreadPool::instance()
 }
 
 ThreadPool::Job::Job()
-    : mPriority(0), mState(NotStarted)
+    : mState(NotStarted), mQueued(false), mCancelled(false)
 {
 }
 
-void ThreadPool::clearBackLog()
+List<std::shared_ptr<ThreadPool::Job> > ThreadPool::clearBackLog()
 {
-    std::lock_guard<std::mutex> lock(mMutex);
-    mJobs.clear();
+    List<Task *> dropped;
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        while (Task *task = takeShared())
+            dropped.append(task);
+    }
+    const int count = mWorkQueueCount.load(std::memory_order_acquire);
+    for (int i = 0; i < count; ++i) {
+        if (WorkQueue *queue = mWorkQueues[i].load(std::memory_order_acquire)) {
+            for (;;) {
+                bool lost = false;
+                if (Task *task = queue->steal(lost)) {
+                    dropped.append(task);
+                } else if (!lost) {
+                    break;
+                }
+            }
+        }
+    }
+
+    List<std::shared_ptr<Job> > ret;
+    for (Task *task : dropped) {
+        if (Job *job = task->job()) {
+            std::lock_guard<std::mutex> joblock(job->mMutex);
+            job->mQueued = false;
+            if (job->mCancelled) {
+                job->mCancelled = false;
+            } else {
+                ret.append(job->mTask.mJob);
+            }
+        }
+        task->drop();
+    }
+    return ret;
 }
 
 int ThreadPool::busyThreads() const
 {
-    std::lock_guard<std::mutex> lock(mMutex);
     return mBusyThreads;
 }
 
-int ThreadPool::backlogSize() const
+void ThreadPool::Accounting::add(const Accounting &other)
+{
+    busyNs += other.busyNs;
+    cpuNs += other.cpuNs;
+    jobs += other.jobs;
+    for (const auto &type : other.types) {
+        JobCpu &jobCpu = types[type.first];
+        jobCpu.jobs += type.second.jobs;
+        jobCpu.wallNs += type.second.wallNs;
+        jobCpu.cpuNs += type.second.cpuNs;
+    }
+}
+
+void ThreadPool::setCpuAccounting(bool on)
 {
     std::lock_guard<std::mutex> lock(mMutex);
-    return mJobs.size();
+    if (on && !mAccounting.load(std::memory_order_relaxed)) {
+        const uint64_t now = Rct::monoNs();
+        mRetired = Accounting();
+        for (ThreadPoolThread *thread : mThreads) {
+            std::lock_guard<std::mutex> accountingLock(thread->mAccountingMutex);
+            thread->mAccounting = Accounting();
+            thread->mAccounting.since = now;
+        }
+    }
+    mAccounting.store(on, std::memory_order_relaxed);
+}
+
+static String jobTypeName(const std::type_info *type)
+{
+    if (!type)
+        return "jobs";
+#ifdef __GXX_RTTI
+    char *demangled = abi::__cxa_demangle(type->name(), 0, 0, 0);
+    if (demangled) {
+        const String ret = demangled;
+        free(demangled);
+        return ret;
+    }
+    return type->name();
+#else
+    return "jobs";
+#endif
+}
+
+ThreadPool::CpuStats ThreadPool::cpuStats() const
+{
+    CpuStats ret;
+    Accounting total;
+    uint64_t capacity;
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        total.add(mRetired);
+        capacity = mRetired.retiredNs;
+        const uint64_t now = Rct::monoNs();
+        for (ThreadPoolThread *thread : mThreads) {
+            std::lock_guard<std::mutex> accountingLock(thread->mAccountingMutex);
+            total.add(thread->mAccounting);
+            const uint64_t since = thread->mAccounting.since;
+            capacity += now - since;
+            // the job that's running counts as busy so far
+            const uint64_t busySince = thread->mBusySince.load(std::memory_order_relaxed);
+            if (busySince)
+                total.busyNs += now - std::max(busySince, since);
+        }
+    }
+    ret.busyNs = total.busyNs;
+    ret.idleNs = capacity > total.busyNs ? capacity - total.busyNs : 0;
+    ret.cpuNs = total.cpuNs;
+    ret.jobs = total.jobs;
+    for (const auto &type : total.types) {
+        JobCpu &jobCpu = ret.jobTypes[jobTypeName(type.first)];
+        jobCpu.jobs += type.second.jobs;
+        jobCpu.wallNs += type.second.wallNs;
+        jobCpu.cpuNs += type.second.cpuNs;
+    }
+    return ret;
+}
+
+int ThreadPool::backlogSize() const
+{
+    int ret = mSharedCount.load(std::memory_order_relaxed);
+    const int count = mWorkQueueCount.load(std::memory_order_acquire);
+    for (int i = 0; i < count; ++i) {
+        if (const WorkQueue *queue = mWorkQueues[i].load(std::memory_order_acquire))
+            ret += queue->size();
+    }
+    return ret;
 }
@@ -2,24 +2,102 @@
 #define ThreadPool_h
 
 #include "List.h"
+#include "Map.h"
 #include "Thread.h"
-#include <deque>
+#include <atomic>
+#include <functional>
+#include <list>
+#include <map>
+#include <typeinfo>
 #include <memory>
 #include <mutex>
 #include <condition_variable>
 
 class ThreadPoolThread;
 
+template <typename R> class Future;
+
 class ThreadPool
 {
 public:
+    class Job;
+    class Task;
+private:
+    // the shared queue, FIFO per priority, highest first. Priorities
+    // compare as unsigned so negative ones go before everything else
+    struct Bucket
+    {
+        Bucket()
+            : first(0), last(0)
+        {}
+
+        Task *first, *last;
+    };
+    typedef std::map<unsigned int, Bucket, std::greater<unsigned int> > Buckets;
+
+public:
+    // What the pool queues and runs, a Job carries one, submit() makes one
+    // that holds the callable and its result
+    class Task
+    {
+    public:
+        Task()
+            : mPriority(0), mShared(false), mPrev(0), mNext(0)
+        {}
+        virtual ~Task() {}
+
+    protected:
+        // the pool doesn't touch the task again after either of these
+        virtual void execute() = 0;
+        // it's never going to run, the backlog was cleared
+        virtual void drop() = 0;
+        virtual Job *job() { return 0; }
+
+    private:
+        int mPriority;
+        // where it is on the shared queue, under the pool's mutex
+        bool mShared;
+        Buckets::iterator mBucket;
+        Task *mPrev, *mNext;
+
+        friend class ThreadPool;
+        friend class ThreadPoolThread;
+    };
+
+    // SharedQueue: every job goes on one queue, in priority order.
+    // WorkStealing: jobs of priority 0 started from inside a job of this
+    // pool go on that worker's own deque, which it takes from newest first
+    // without locking. Workers that run out steal the oldest jobs of the
+    // others. Other jobs go on the shared queue, which is looked at first
+    // while it holds one with a priority. Idle workers sleep on a futex of
+    // their own and are woken one at a time. Guaranteed jobs get a thread
+    // of their own either way.
+    enum Scheduling {
+        SharedQueue,
+        WorkStealing
+    };
+    // Unpinned: workers run wherever the system puts them. PinToNodes:
+    // worker n runs on the CPUs of NUMA node n % nodes. With WorkStealing
+    // workers then steal from, and wake, workers on their own node first,
+    // so what a job starts mostly stays on its node
+    enum Placement {
+        Unpinned,
+        PinToNodes
+    };
     ThreadPool(int concurrentJobs,
                Thread::Priority priority = Thread::Normal,
-               size_t stackSize = 0);
+               size_t stackSize = 0,
+               Scheduling scheduling = SharedQueue,
+               Placement placement = Unpinned);
     ~ThreadPool();
 
+    Scheduling scheduling() const { return mScheduling; }
+    Placement placement() const { return mPlacement; }
+
     void setConcurrentJobs(int concurrentJobs);
-    void clearBackLog();
+    int concurrentJobs() const { return mConcurrentJobs; }
+    // the jobs that hadn't started, highest priority first
+    List<std::shared_ptr<Job> > clearBackLog();
     int backlogSize() const;
 
     class Job
@@ -39,8 +117,25 @@ public:
         std::mutex &mutex() const { return mMutex; }
 
     private:
-        int mPriority;
+        // what the pool queues, holding on to the job meanwhile
+        class JobTask : public Task
+        {
+        protected:
+            virtual void execute() override;
+            virtual void drop() override;
+            virtual Job *job() override { return mJob.get(); }
+
+        private:
+            std::shared_ptr<Job> mJob;
+
+            friend class ThreadPool;
+        };
+
         State mState;
+        // started and not taken off a queue yet, and removed from a
+        // worker's deque while still on it
+        bool mQueued, mCancelled;
+        JobTask mTask;
         mutable std::mutex mMutex;
 
         friend class ThreadPool;
@@ -49,30 +144,125 @@ public:
 
     enum { Guaranteed = -1 };
 
-    void start(const std::shared_ptr<Job> &job, int priority = 0);
+    // false, and an assert, if it's queued or running already. One that
+    // was remove()d but not taken off its deque yet just isn't any more
+    bool start(const std::shared_ptr<Job> &job, int priority = 0);
 
+    // Runs f() like a Job of that priority, f's result comes back through
+    // the Future, see Future.h. The callable lives in the same allocation
+    // as the result, there's no Job, shared_ptr or mutex involved
+    template <typename F>
+    Future<typename std::result_of<typename std::decay<F>::type()>::type> submit(F &&f, int priority = 0);
+
+    // O(1), false if it already started or was never started here
     bool remove(const std::shared_ptr<Job> &job);
 
     static int idealThreadCount();
+    // The CPUs of each NUMA node, from sysfs on Linux. One node with every
+    // CPU elsewhere
+    static List<List<int> > numaNodes();
     static ThreadPool* instance();
 
     int busyThreads() const;
+    // called from one of this pool's workers, where waiting for other jobs
+    // can deadlock once they all do it
+    bool isWorkerThread() const;
+
+    // Where the workers' time goes, to size setConcurrentJobs() by. Off
+    // by default, with it on each job costs a couple of clock reads more.
+    // Turning it on starts from zero. The threads of Guaranteed jobs
+    // aren't counted
+    void setCpuAccounting(bool on);
+    bool cpuAccounting() const { return mAccounting.load(std::memory_order_relaxed); }
+    struct JobCpu
+    {
+        JobCpu()
+            : jobs(0), wallNs(0), cpuNs(0)
+        {}
+
+        uint64_t jobs, wallNs, cpuNs;
+    };
+    struct CpuStats
+    {
+        CpuStats()
+            : busyNs(0), idleNs(0), cpuNs(0), jobs(0)
+        {}
+
+        // summed over the workers. Busy is running jobs, the CPU time of
+        // those is cpuNs, the rest they spent blocked
+        uint64_t busyNs, idleNs, cpuNs, jobs;
+        float busyRatio() const { return busyNs + idleNs ? static_cast<float>(busyNs) / (busyNs + idleNs) : 0; }
+        // by the type of the Job, or of the callable for submit()
+        Map<String, JobCpu> jobTypes;
+    };
+    CpuStats cpuStats() const;
+
 private:
-    static bool jobLessThan(const std::shared_ptr<Job> &l, const std::shared_ptr<Job> &r);
+    class WorkQueue;
+    ThreadPoolThread *createThread(int index);
+    void schedule(Task *task, int priority);
+    // need mMutex
+    void enqueue(Task *task);
+    void unqueue(Task *task);
+    Task *takeShared();
+    bool hasWork() const;
+    void wakeOne();
+    int currentNode() const;
+    void park(ThreadPoolThread *thread);
+    void unidle(ThreadPoolThread *thread);
 
 private:
     int mConcurrentJobs;
     mutable std::mutex mMutex;
     std::condition_variable mCond;
-    std::deque<std::shared_ptr<Job> > mJobs;
+    Buckets mJobs;
     List<ThreadPoolThread*> mThreads;
-    int mBusyThreads;
+    std::atomic<int> mBusyThreads;
     const Thread::Priority mPriority;
     const size_t mThreadStackSize;
+    const Scheduling mScheduling;
+    const Placement mPlacement;
+    // with PinToNodes, and the node of each CPU
+    List<List<int> > mNodes;
+    List<int> mCpuNodes;
+
+    // WorkStealing. The deques by worker index, kept when a worker goes
+    // away so thieves never see one freed. Workers past MaxWorkQueues
+    // only use the shared queue
+    enum { MaxWorkQueues = 256 };
+    std::atomic<WorkQueue *> mWorkQueues[MaxWorkQueues];
+    // set before the deque is
+    int mWorkQueueNodes[MaxWorkQueues];
+    std::atomic<int> mWorkQueueCount;
+    // of mJobs, to look without locking
+    std::atomic<int> mSharedCount, mPrioritizedCount;
+    // parked workers, most recently parked last
+    std::mutex mIdleMutex;
+    List<ThreadPoolThread*> mIdle;
+    std::atomic<int> mIdleCount;
+
+    // what a worker counts with cpu accounting on, under its mutex. Those
+    // of workers that went away are added to mRetired, under mMutex
+    struct Accounting
+    {
+        Accounting()
+            : since(0), busyNs(0), cpuNs(0), jobs(0), retiredNs(0)
+        {}
+        void add(const Accounting &other);
+
+        uint64_t since, busyNs, cpuNs, jobs;
+        // in mRetired, how long those workers were counted for
+        uint64_t retiredNs;
+        std::map<const std::type_info *, JobCpu> types;
+    };
+    std::atomic<bool> mAccounting;
+    Accounting mRetired;
 
     static ThreadPool* sInstance;
 
     friend class ThreadPoolThread;
 };
 
+#include "Future.h"
+
 #endif
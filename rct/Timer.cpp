@@ -1,13 +1,14 @@
 #include "Timer.h"
 #include "EventLoop.h"
+#include "Rct.h"
 
 Timer::Timer()
-    : timerId(0)
+    : timerId(0), timerFlags(0), deadline(0)
 {
 }
 
 Timer::Timer(int interval, int flags)
-    : timerId(0)
+    : timerId(0), timerFlags(0), deadline(0)
 {
     restart(interval, flags);
 }
@@ -18,12 +19,26 @@ Timer::~Timer()
 }
 
 void Timer::restart(int interval, int flags, const std::shared_ptr<EventLoop> &l)
+{
+    deadline = 0;
+    start(interval, flags, l);
+}
+
+void Timer::debounce(int interval, const std::shared_ptr<EventLoop> &l)
+{
+    const bool pending = timerId && deadline;
+    deadline = Rct::monoMs() + interval;
+    if (!pending)
+        start(interval, SingleShot, l);
+}
+
+void Timer::start(int interval, int flags, const std::shared_ptr<EventLoop> &l)
 {
     EventLoop::SharedPtr loop = l ? l : EventLoop::eventLoop();
     if (loop) {
-        // ### this is a bit inefficient, should revisit
-        if (timerId)
-            loop->unregisterTimer(timerId);
+        timerFlags = flags;
+        if (timerId && loop->restartTimer(timerId, interval, flags))
+            return;
         timerId = loop->registerTimer(std::bind(&Timer::timerFired, this, std::placeholders::_1),
                                       interval, flags);
     }
@@ -31,6 +46,7 @@ void Timer::restart(int interval, int flags, const std::shared_ptr<EventLoop> &l
 
 void Timer::stop()
 {
+    deadline = 0;
     if (timerId) {
         if (EventLoop::SharedPtr loop = EventLoop::eventLoop()) {
             loop->unregisterTimer(timerId);
@@ -41,5 +57,16 @@ void Timer::stop()
 
 void Timer::timerFired(int /*id*/)
 {
+    if (timerFlags & SingleShot)
+        timerId = 0;
+    if (deadline) {
+        const uint64_t now = Rct::monoMs();
+        if (now < deadline) {
+            // debounced again since we were started, wait for the rest
+            start(static_cast<int>(deadline - now), SingleShot, std::shared_ptr<EventLoop>());
+            return;
+        }
+        deadline = 0;
+    }
     signalTimeout(this);
 }
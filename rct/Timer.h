@@ -3,12 +3,19 @@
 
 #include "SignalSlot.h"
 #include <memory>
+#include <stdint.h>
 
 class EventLoop;
 class Timer
 {
 public:
-    enum { SingleShot = 0x1 };
+    enum {
+        SingleShot = 0x1,
+        // the timer may fire up to an eighth of its interval late so it
+        // can share a wakeup with other timers, and restarting it within
+        // that window doesn't touch the event loop
+        Coalesce = 0x2
+    };
 
     Timer();
     Timer(int interval, int flags = 0);
@@ -16,6 +23,11 @@ public:
 
     void restart(int interval, int flags = 0, const std::shared_ptr<EventLoop> &eventLoop = std::shared_ptr<EventLoop>());
     void stop();
+    // fire once, interval ms after the last call. Calls while the timer is
+    // pending only move the deadline, the event loop is only involved when
+    // the timer goes off early and has to wait for the rest. Must be
+    // called on the thread of the timer's event loop.
+    void debounce(int interval, const std::shared_ptr<EventLoop> &eventLoop = std::shared_ptr<EventLoop>());
 
     Signal<std::function<void(Timer*)> >& timeout() { return signalTimeout; }
 
@@ -23,10 +35,14 @@ public:
     int id() const { return timerId; }
 
 private:
+    void start(int interval, int flags, const std::shared_ptr<EventLoop> &eventLoop);
     void timerFired(int id);
 
 private:
     int timerId;
+    unsigned int timerFlags;
+    // when a debounced timer is due, 0 if it isn't debounced
+    uint64_t deadline;
     Signal<std::function<void(Timer*)> > signalTimeout;
 };
 
@@ -0,0 +1,166 @@
+#include "TlsContext.h"
+#include "Log.h"
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#include <openssl/x509v3.h>
+
+static int sessionKeyIndex()
+{
+    static const int index = SSL_get_ex_new_index(0, 0, 0, 0, 0);
+    return index;
+}
+
+static int onNewSession(SSL *ssl, SSL_SESSION *session)
+{
+    TlsContext *context = static_cast<TlsContext *>(SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl)));
+    const String *key = static_cast<const String *>(SSL_get_ex_data(ssl, sessionKeyIndex()));
+    if (!context || !key || key->isEmpty())
+        return 0;
+    // ours now
+    context->storeSession(*key, session);
+    return 1;
+}
+
+TlsContext::SharedPtr TlsContext::create(Mode mode)
+{
+    SharedPtr ret(new TlsContext(mode));
+    if (!ret->mContext)
+        return SharedPtr();
+    return ret;
+}
+
+TlsContext::TlsContext(Mode mode)
+    : mMode(mode), mContext(SSL_CTX_new(mode == Client ? TLS_client_method() : TLS_server_method()))
+{
+    if (!mContext) {
+        error() << "Couldn't create TLS context" << lastError();
+        return;
+    }
+    SSL_CTX_set_min_proto_version(mContext, TLS1_3_VERSION);
+    // SocketClient hands the same buffer back after a partial write, but
+    // it may have moved in the queue
+    SSL_CTX_set_mode(mContext, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+    if (mode == Client) {
+        SSL_CTX_set_verify(mContext, SSL_VERIFY_PEER, 0);
+        SSL_CTX_set_default_verify_paths(mContext);
+        // sessions come in after the handshake in TLS 1.3, SocketClient
+        // picks them up with a new session callback
+        SSL_CTX_set_session_cache_mode(mContext, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+        SSL_CTX_set_app_data(mContext, this);
+        SSL_CTX_sess_set_new_cb(mContext, onNewSession);
+    } else {
+        static const unsigned char id[] = "rct";
+        SSL_CTX_set_session_id_context(mContext, id, sizeof(id) - 1);
+    }
+    setKernelTls(true);
+}
+
+TlsContext::~TlsContext()
+{
+    clearSessions();
+    if (mContext)
+        SSL_CTX_free(mContext);
+}
+
+bool TlsContext::setCertificate(const Path &certificate, const Path &privateKey)
+{
+    if (SSL_CTX_use_certificate_chain_file(mContext, certificate.constData()) != 1
+        || SSL_CTX_use_PrivateKey_file(mContext, privateKey.constData(), SSL_FILETYPE_PEM) != 1
+        || SSL_CTX_check_private_key(mContext) != 1) {
+        error() << "Couldn't load TLS certificate" << certificate << lastError();
+        return false;
+    }
+    return true;
+}
+
+bool TlsContext::setVerify(bool verify, const Path &caFile)
+{
+    if (!caFile.isEmpty() && SSL_CTX_load_verify_locations(mContext, caFile.constData(), 0) != 1) {
+        error() << "Couldn't load TLS CA file" << caFile << lastError();
+        return false;
+    }
+    int mode = SSL_VERIFY_NONE;
+    if (verify)
+        mode = mMode == Client ? SSL_VERIFY_PEER : SSL_VERIFY_PEER | SSL_VERIFY_FAIL_IF_NO_PEER_CERT;
+    SSL_CTX_set_verify(mContext, mode, 0);
+    return true;
+}
+
+void TlsContext::setKernelTls(bool on)
+{
+#ifdef SSL_OP_ENABLE_KTLS
+    if (on) {
+        SSL_CTX_set_options(mContext, SSL_OP_ENABLE_KTLS);
+    } else {
+        SSL_CTX_clear_options(mContext, SSL_OP_ENABLE_KTLS);
+    }
+#else
+    (void)on;
+#endif
+}
+
+ssl_st *TlsContext::createConnection(int fd, const String &serverName, const String *sessionKey)
+{
+    SSL *ssl = SSL_new(mContext);
+    if (!ssl || SSL_set_fd(ssl, fd) != 1) {
+        error() << "Couldn't create TLS connection" << lastError();
+        if (ssl)
+            SSL_free(ssl);
+        return 0;
+    }
+    if (mMode == Server) {
+        SSL_set_accept_state(ssl);
+        return ssl;
+    }
+    SSL_set_connect_state(ssl);
+    // the name or address the certificate has to be for, names are sent
+    // as SNI too
+    if (!serverName.isEmpty() && X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(ssl), serverName.constData()) != 1) {
+        SSL_set_tlsext_host_name(ssl, serverName.constData());
+        SSL_set1_host(ssl, serverName.constData());
+    }
+    if (sessionKey) {
+        SSL_set_ex_data(ssl, sessionKeyIndex(), const_cast<String *>(sessionKey));
+        if (SSL_SESSION *session = takeSession(*sessionKey)) {
+            SSL_set_session(ssl, session);
+            SSL_SESSION_free(session);
+        }
+    }
+    return ssl;
+}
+
+ssl_session_st *TlsContext::takeSession(const String &key)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mSessions.take(key);
+}
+
+void TlsContext::storeSession(const String &key, ssl_session_st *session)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    ssl_session_st *&slot = mSessions[key];
+    if (slot)
+        SSL_SESSION_free(slot);
+    slot = session;
+}
+
+void TlsContext::clearSessions()
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    for (const auto &session : mSessions)
+        SSL_SESSION_free(session.second);
+    mSessions.clear();
+}
+
+String TlsContext::lastError()
+{
+    String ret;
+    while (const unsigned long e = ERR_get_error()) {
+        char buf[256];
+        ERR_error_string_n(e, buf, sizeof(buf));
+        if (!ret.isEmpty())
+            ret += ", ";
+        ret += buf;
+    }
+    return ret;
+}
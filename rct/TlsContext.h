@@ -0,0 +1,67 @@
+#ifndef TLSCONTEXT_H
+#define TLSCONTEXT_H
+
+#include <rct/Hash.h>
+#include <rct/Path.h>
+#include <rct/String.h>
+#include <memory>
+#include <mutex>
+
+struct ssl_ctx_st;
+struct ssl_session_st;
+struct ssl_st;
+
+// Certificates, verification and session cache for TLS on SocketClient and
+// SocketServer, see SocketClient::startTls(). Only TLS 1.3 is spoken. One
+// context is typically shared by every connection of a kind, it's safe to
+// use from several threads.
+class TlsContext
+{
+public:
+    typedef std::shared_ptr<TlsContext> SharedPtr;
+
+    enum Mode { Client, Server };
+    static SharedPtr create(Mode mode);
+    ~TlsContext();
+
+    Mode mode() const { return mMode; }
+
+    // PEM files. Servers need one, clients only for client certificates
+    bool setCertificate(const Path &certificate, const Path &privateKey);
+    // Verify the other side's certificate against caFile, or the system's
+    // store with no caFile. Clients verify by default, servers don't ask
+    // for certificates unless told to
+    bool setVerify(bool verify, const Path &caFile = Path());
+
+    // Let the kernel do the record encryption (kTLS) where OpenSSL and the
+    // kernel can, writes then go straight to the socket again. On by
+    // default
+    void setKernelTls(bool on);
+
+    // A connection on fd, for the client side with the session stored for
+    // sessionKey if there is one and new sessions stored for it. sessionKey
+    // has to stay around as long as the connection does
+    ssl_st *createConnection(int fd, const String &serverName, const String *sessionKey);
+
+    // Client sessions for resumption. Servers resume with session tickets
+    // of their own. A session is taken for one connection only, TLS 1.3
+    // tickets aren't supposed to be used twice
+    ssl_session_st *takeSession(const String &key);
+    void storeSession(const String &key, ssl_session_st *session);
+    void clearSessions();
+
+    // what OpenSSL last complained about on this thread
+    static String lastError();
+
+    ssl_ctx_st *context() const { return mContext; }
+
+private:
+    TlsContext(Mode mode);
+
+    const Mode mMode;
+    ssl_ctx_st *mContext;
+    std::mutex mMutex;
+    Hash<String, ssl_session_st *> mSessions;
+};
+
+#endif
@@ -0,0 +1,260 @@
+#include "Trace.h"
+#include "rct-config.h"
+#include "JSONWriter.h"
+#include "Log.h"
+#include <algorithm>
+#include <mutex>
+#include <pthread.h>
+#include <unistd.h>
+#include <vector>
+#ifdef OS_Linux
+#include <sys/syscall.h>
+#endif
+
+std::atomic<bool> Trace::sEnabled;
+
+namespace {
+struct Event
+{
+    const char *name, *category;
+    // duration for complete events, the id for async ones
+    uint64_t ts, arg;
+    char phase;
+};
+
+struct ThreadBuffer
+{
+    ThreadBuffer()
+        : next(0), tid(0), exited(false)
+    {}
+
+    std::mutex mutex;
+    // a ring once it's full, next is where the oldest one is
+    std::vector<Event> events;
+    size_t next;
+    uint64_t tid;
+    String name;
+    bool exited;
+};
+
+std::mutex sMutex;
+std::vector<ThreadBuffer *> sBuffers;
+std::atomic<size_t> sCapacity(Trace::DefaultEventsPerThread);
+pthread_key_t sKey;
+__thread ThreadBuffer *tBuffer = 0;
+}
+
+static void threadExited(void *data)
+{
+    // the events stay until clear()
+    ThreadBuffer *buffer = static_cast<ThreadBuffer *>(data);
+    std::lock_guard<std::mutex> lock(sMutex);
+    buffer->exited = true;
+    // anything recorded from here on gets a buffer of its own
+    tBuffer = 0;
+}
+
+static uint64_t currentTid()
+{
+#if defined(OS_Linux)
+    return syscall(SYS_gettid);
+#elif defined(OS_Darwin)
+    uint64_t tid = 0;
+    pthread_threadid_np(0, &tid);
+    return tid;
+#else
+    static std::atomic<uint64_t> counter;
+    return ++counter;
+#endif
+}
+
+static ThreadBuffer *threadBuffer()
+{
+    if (tBuffer)
+        return tBuffer;
+
+    static std::once_flag once;
+    std::call_once(once, []() { pthread_key_create(&sKey, threadExited); });
+
+    ThreadBuffer *buffer = new ThreadBuffer;
+    buffer->tid = currentTid();
+#if defined(OS_Linux) || defined(OS_Darwin)
+    char name[64];
+    if (!pthread_getname_np(pthread_self(), name, sizeof(name)))
+        buffer->name = name;
+#endif
+    if (buffer->name.isEmpty())
+        buffer->name = String::format<32>("Thread %llu", static_cast<unsigned long long>(buffer->tid));
+    pthread_setspecific(sKey, buffer);
+    {
+        std::lock_guard<std::mutex> lock(sMutex);
+        sBuffers.push_back(buffer);
+    }
+    tBuffer = buffer;
+    return buffer;
+}
+
+static void record(const char *name, const char *category, uint64_t ts, uint64_t arg, char phase)
+{
+    ThreadBuffer *buffer = threadBuffer();
+    const Event event = { name, category, ts, arg, phase };
+    const size_t capacity = sCapacity.load(std::memory_order_relaxed);
+    // only export takes it from another thread
+    std::lock_guard<std::mutex> lock(buffer->mutex);
+    if (buffer->events.size() < capacity) {
+        buffer->events.push_back(event);
+    } else {
+        if (buffer->next >= capacity)
+            buffer->next = 0;
+        buffer->events[buffer->next++] = event;
+    }
+}
+
+void Trace::start(int eventsPerThread)
+{
+    if (eventsPerThread <= 0) {
+        error("Trace::start: %d events per thread is too few", eventsPerThread);
+        return;
+    }
+    if (static_cast<size_t>(eventsPerThread) != sCapacity.load())
+        clear();
+    sCapacity.store(eventsPerThread);
+    sEnabled.store(true);
+}
+
+void Trace::stop()
+{
+    sEnabled.store(false);
+}
+
+void Trace::clear()
+{
+    std::lock_guard<std::mutex> lock(sMutex);
+    auto it = sBuffers.begin();
+    while (it != sBuffers.end()) {
+        ThreadBuffer *buffer = *it;
+        if (buffer->exited) {
+            delete buffer;
+            it = sBuffers.erase(it);
+        } else {
+            std::lock_guard<std::mutex> bufferLock(buffer->mutex);
+            std::vector<Event>().swap(buffer->events);
+            buffer->next = 0;
+            ++it;
+        }
+    }
+}
+
+void Trace::complete(const char *name, const char *category, uint64_t startNs, uint64_t endNs)
+{
+    record(name, category, startNs, endNs - startNs, 'X');
+}
+
+void Trace::instant(const char *name, const char *category)
+{
+    if (isEnabled())
+        record(name, category, nowNs(), 0, 'i');
+}
+
+void Trace::asyncBegin(const char *name, const char *category, uint64_t id)
+{
+    if (isEnabled())
+        record(name, category, nowNs(), id, 'b');
+}
+
+void Trace::asyncEnd(const char *name, const char *category, uint64_t id)
+{
+    if (isEnabled())
+        record(name, category, nowNs(), id, 'e');
+}
+
+// trace event times are in microseconds, the fraction keeps the rest
+static void writeMicroseconds(JSONWriter &writer, uint64_t ns)
+{
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%llu.%03u", static_cast<unsigned long long>(ns / 1000),
+             static_cast<unsigned int>(ns % 1000));
+    writer.writeRaw(buf);
+}
+
+String Trace::toJSON()
+{
+    String ret;
+    JSONWriter writer(ret);
+    writer.beginObject();
+    writer.key("traceEvents");
+    writer.beginArray();
+    const int64_t pid = getpid();
+    std::vector<Event> events;
+    std::lock_guard<std::mutex> lock(sMutex);
+    for (ThreadBuffer *buffer : sBuffers) {
+        {
+            std::lock_guard<std::mutex> bufferLock(buffer->mutex);
+            // oldest first
+            const auto oldest = buffer->events.begin() + std::min(buffer->next, buffer->events.size());
+            events.assign(oldest, buffer->events.end());
+            events.insert(events.end(), buffer->events.begin(), oldest);
+        }
+        if (events.empty())
+            continue;
+
+        writer.beginObject();
+        writer.key("name");
+        writer.writeString("thread_name");
+        writer.key("ph");
+        writer.writeString("M");
+        writer.key("pid");
+        writer.writeInteger(pid);
+        writer.key("tid");
+        writer.writeInteger(buffer->tid);
+        writer.key("args");
+        writer.beginObject();
+        writer.key("name");
+        writer.writeString(buffer->name);
+        writer.endObject();
+        writer.endObject();
+
+        for (const Event &event : events) {
+            const char phase[] = { event.phase, '\0' };
+            writer.beginObject();
+            writer.key("name");
+            writer.writeString(event.name);
+            writer.key("cat");
+            writer.writeString(event.category);
+            writer.key("ph");
+            writer.writeString(phase);
+            writer.key("pid");
+            writer.writeInteger(pid);
+            writer.key("tid");
+            writer.writeInteger(buffer->tid);
+            writer.key("ts");
+            writeMicroseconds(writer, event.ts);
+            switch (event.phase) {
+            case 'X':
+                writer.key("dur");
+                writeMicroseconds(writer, event.arg);
+                break;
+            case 'i':
+                // just the thread's track
+                writer.key("s");
+                writer.writeString("t");
+                break;
+            case 'b':
+            case 'e':
+                writer.key("id");
+                writer.writeString(String::format<32>("0x%llx", static_cast<unsigned long long>(event.arg)));
+                break;
+            }
+            writer.endObject();
+        }
+    }
+    writer.endArray();
+    writer.endObject();
+    writer.flush();
+    return ret;
+}
+
+bool Trace::write(const Path &path)
+{
+    return Path::write(path, toJSON());
+}
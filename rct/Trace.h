@@ -0,0 +1,73 @@
+#ifndef Trace_h
+#define Trace_h
+
+#include <rct/Path.h>
+#include <rct/Rct.h>
+#include <rct/String.h>
+#include <atomic>
+#include <stdint.h>
+
+// Spans of what the process did, on which thread and for how many
+// nanoseconds, written out as Chrome's trace event JSON for
+// chrome://tracing or ui.perfetto.dev. Tracing is off until start(),
+// until then a TraceScope costs a relaxed load.
+//
+// Each thread records into a buffer of its own, a ring that keeps the
+// newest eventsPerThread events, so a long run keeps what led up to the
+// moment it's exported. The buffers outlive their threads until clear().
+//
+// Names and categories aren't copied, they have to be string literals or
+// live as long as the trace does.
+class Trace
+{
+public:
+    enum { DefaultEventsPerThread = 64 * 1024 };
+    static void start(int eventsPerThread = DefaultEventsPerThread);
+    // stops recording, what was recorded is still there to export
+    static void stop();
+    static void clear();
+    static bool isEnabled() { return sEnabled.load(std::memory_order_relaxed); }
+
+    static uint64_t nowNs() { return Rct::monoNs(); }
+
+    // a span from start to end, what TraceScope records
+    static void complete(const char *name, const char *category, uint64_t startNs, uint64_t endNs);
+    static void instant(const char *name, const char *category = "rct");
+    // Spans that may start and end on different threads, matched by name,
+    // category and id
+    static void asyncBegin(const char *name, const char *category, uint64_t id);
+    static void asyncEnd(const char *name, const char *category, uint64_t id);
+
+    // {"traceEvents":[...]}, with the threads' names
+    static String toJSON();
+    static bool write(const Path &path);
+
+private:
+    Trace();
+
+    static std::atomic<bool> sEnabled;
+};
+
+class TraceScope
+{
+public:
+    TraceScope(const char *name, const char *category = "rct")
+        : mName(Trace::isEnabled() ? name : 0), mCategory(category),
+          mStart(mName ? Trace::nowNs() : 0)
+    {
+    }
+    ~TraceScope()
+    {
+        if (mName)
+            Trace::complete(mName, mCategory, mStart, Trace::nowNs());
+    }
+
+    TraceScope(const TraceScope &) = delete;
+    TraceScope &operator=(const TraceScope &) = delete;
+
+private:
+    const char *mName, *mCategory;
+    const uint64_t mStart;
+};
+
+#endif
@@ -1,26 +1,32 @@
 #include "Value.h"
-#include "../cJSON/cJSON.h"
+#include "JSONParser.h"
+#include "JSONWriter.h"
+#include <climits>
+#include <cstddef>
 
 void Value::clear()
 {
-    switch (mType) {
-    case Type_String:
-        stringPtr()->~String();
-        break;
-    case Type_Map:
-        mapPtr()->~Map<String, Value>();
-        break;
-    case Type_List:
-        listPtr()->~List<Value>();
-        break;
-    case Type_Custom:
-        customPtr()->~shared_ptr<Custom>();
-        break;
-    default:
-        break;
+    if (!mArena) {
+        switch (mType) {
+        case Type_String:
+            stringPtr()->~String();
+            break;
+        case Type_Map:
+            delete mData.map;
+            break;
+        case Type_List:
+            listPtr()->~List<Value>();
+            break;
+        case Type_Custom:
+            customPtr()->~shared_ptr<Custom>();
+            break;
+        default:
+            break;
+        }
     }
 
     mType = Type_Invalid;
+    mArena = false;
 }
 
 void Value::copy(const Value &other)
@@ -32,7 +38,7 @@ void Value::copy(const Value &other)
         new (mData.stringBuf) String(*other.stringPtr());
         break;
     case Type_Map:
-        new (mData.mapBuf) Map<String, Value>(*other.mapPtr());
+        mData.map = new Map<String, Value>(*other.mapPtr());
         break;
     case Type_List:
         new (mData.listBuf) List<Value>(*other.listPtr());
@@ -46,93 +52,208 @@ void Value::copy(const Value &other)
     }
 }
 
-static Value fromCJSON(const cJSON *object)
+void Value::move(Value &other)
 {
-    assert(object);
-    switch (object->type) {
-    case cJSON_False:
-        return Value(false);
-    case cJSON_True:
-        return Value(true);
-    case cJSON_NULL:
-        break;
-    case cJSON_Number:
-        if (object->valueint == object->valuedouble)
-            return Value(object->valueint);
-        return Value(object->valuedouble);
-    case cJSON_String:
-        return Value(String(object->valuestring));
-    case cJSON_Array: {
-        List<Value> values;
-        for (const cJSON *child = object->child; child; child = child->next) {
-            values.append(fromCJSON(child));
+    assert(isNull());
+    mType = other.mType;
+    mArena = other.mArena;
+    if (mArena) {
+        mData.payload = other.mData.payload;
+    } else {
+        switch (mType) {
+        case Type_String:
+            new (mData.stringBuf) String(std::move(*other.stringPtr()));
+            other.stringPtr()->~String();
+            break;
+        case Type_List:
+            new (mData.listBuf) List<Value>(std::move(*other.listPtr()));
+            other.listPtr()->~List<Value>();
+            break;
+        case Type_Custom:
+            new (mData.customBuf) std::shared_ptr<Custom>(std::move(*other.customPtr()));
+            other.customPtr()->~shared_ptr<Custom>();
+            break;
+        default:
+            // maps are a pointer
+            memcpy(&mData, &other.mData, sizeof(mData));
+            break;
         }
-        return values; }
-    case cJSON_Object: {
-        Map<String, Value> values;
-        for (const cJSON *child = object->child; child; child = child->next)
-            values[child->string] = fromCJSON(child);
-        return values; }
     }
-    return Value();
+    other.mType = Type_Invalid;
+    other.mArena = false;
 }
 
-Value Value::fromJSON(const char *json, bool *ok)
+Value::Arena::Arena(size_t chunkSize)
+    : mChunkSize(chunkSize), mChunkUsed(chunkSize), mUsed(0)
 {
-    cJSON *obj = cJSON_Parse(json);
-    if (!obj) {
-        if (ok)
-            *ok = false;
-        return Value();
+}
+
+Value::Arena::~Arena()
+{
+    clear();
+}
+
+void Value::Arena::clear()
+{
+    // last first, a payload never refers to one created after it but
+    // whatever it holds is borrowed anyway
+    for (size_t i = mPayloads.size(); i > 0; --i)
+        mPayloads[i - 1].second(mPayloads[i - 1].first);
+    mPayloads.clear();
+    for (char *chunk : mChunks)
+        free(chunk);
+    mChunks.clear();
+    mChunkUsed = mChunkSize;
+    mUsed = 0;
+}
+
+void *Value::Arena::allocate(size_t size)
+{
+    size = (size + alignof(std::max_align_t) - 1) & ~(alignof(std::max_align_t) - 1);
+    mUsed += size;
+    if (size > mChunkSize) {
+        // too big for a chunk, give it its own
+        char *chunk = static_cast<char*>(malloc(size));
+        if (mChunks.isEmpty()) {
+            mChunks.append(chunk);
+        } else {
+            mChunks.insert(mChunks.end() - 1, chunk);
+        }
+        return chunk;
     }
+    if (mChunkUsed + size > mChunkSize) {
+        mChunks.append(static_cast<char*>(malloc(mChunkSize)));
+        mChunkUsed = 0;
+    }
+    void *ret = mChunks.back() + mChunkUsed;
+    mChunkUsed += size;
+    return ret;
+}
 
-    const Value ret = ::fromCJSON(obj);
-    if (ok)
-        *ok = true;
-    cJSON_Delete(obj);
+Value Value::Arena::borrow(Type type, void *payload)
+{
+    Value ret(type);
+    ret.mArena = true;
+    ret.mData.payload = payload;
     return ret;
 }
 
-cJSON *Value::toCJSON(const Value &value)
+Value Value::Arena::map()
 {
-    switch (value.type()) {
-    case Value::Type_Boolean: return value.toBool() ? cJSON_CreateTrue() : cJSON_CreateFalse();
-    case Value::Type_Integer: return cJSON_CreateNumber(value.toInteger());
-    case Value::Type_Double: return cJSON_CreateNumber(value.toDouble());
-    case Value::Type_String: return cJSON_CreateString(value.toString().constData());
-    case Value::Type_List: {
-        cJSON *array = cJSON_CreateArray();
-        for (const auto &v : *value.listPtr())
-            cJSON_AddItemToArray(array, toCJSON(v));
-        return array; }
-    case Value::Type_Map: {
-        cJSON *object = cJSON_CreateObject();
-        for (const auto &v : *value.mapPtr())
-            cJSON_AddItemToObject(object, v.first.constData(), v.second.toCJSON(v.second));
-        return object; }
-    case Value::Type_Invalid:
-        break;
-    case Value::Type_Undefined:
-        break;
-    case Value::Type_Custom:
-        if (std::shared_ptr<Value::Custom> custom = value.toCustom()) {
-            cJSON *ret = cJSON_CreateString(custom->toString().constData());
-            if (ret) {
-                ret->type = cJSON_RawString;
-                return ret;
-            }
+    void *payload = new (allocate(sizeof(Map<String, Value>))) Map<String, Value>;
+    mPayloads.append(std::make_pair(payload, &destroy<Map<String, Value> >));
+    return borrow(Type_Map, payload);
+}
+
+Value Value::Arena::list(int reserve)
+{
+    List<Value> *payload = new (allocate(sizeof(List<Value>))) List<Value>;
+    if (reserve > 0)
+        payload->reserve(reserve);
+    mPayloads.append(std::make_pair(static_cast<void*>(payload), &destroy<List<Value> >));
+    return borrow(Type_List, payload);
+}
+
+Value Value::Arena::string(const char *str, int len)
+{
+    if (len == -1)
+        len = strlen(str);
+    void *payload = new (allocate(sizeof(String))) String(str, len);
+    mPayloads.append(std::make_pair(payload, &destroy<String>));
+    return borrow(Type_String, payload);
+}
+
+namespace {
+class ValueBuilder : public JSONParser::Handler
+{
+public:
+    ValueBuilder(Value::Arena *arena)
+        : mArena(arena)
+    {}
+
+    virtual bool onNull() override { add(Value()); return true; }
+    virtual bool onBoolean(bool value) override { add(Value(value)); return true; }
+    virtual bool onInteger(int64_t value) override { add(Value(value)); return true; }
+    virtual bool onDouble(double value) override
+    {
+        // like cJSON did, 2.0 is the integer 2
+        if (value >= INT_MIN && value <= INT_MAX && value == static_cast<int>(value)) {
+            add(Value(static_cast<int>(value)));
+        } else {
+            add(Value(value));
         }
-        break;
+        return true;
+    }
+    virtual bool onString(const StringView &value) override
+    {
+        add(mArena ? mArena->string(value.constData(), value.size()) : Value(value.constData(), value.size()));
+        return true;
+    }
+    virtual bool onObjectStart() override
+    {
+        mStack.append(add(mArena ? mArena->map() : Value(Map<String, Value>())));
+        return true;
     }
-    return cJSON_CreateNull();
+    virtual bool onKey(const StringView &key) override
+    {
+        mKey.assign(key.constData(), key.size());
+        return true;
+    }
+    virtual bool onObjectEnd() override { mStack.pop_back(); return true; }
+    virtual bool onArrayStart() override
+    {
+        mStack.append(add(mArena ? mArena->list() : Value(List<Value>())));
+        return true;
+    }
+    virtual bool onArrayEnd() override { mStack.pop_back(); return true; }
+
+    Value root;
+private:
+    // where it ended up, nothing is added to a container while we hold
+    // on to one of its children so the pointers stay valid
+    Value *add(Value &&value)
+    {
+        if (mStack.isEmpty()) {
+            root = std::move(value);
+            return &root;
+        }
+        Value *parent = mStack.back();
+        if (parent->isMap()) {
+            Value &ret = parent->mapRef()[mKey];
+            ret = std::move(value);
+            return &ret;
+        }
+        List<Value> &list = parent->listRef();
+        list.append(std::move(value));
+        return &list.back();
+    }
+
+    Value::Arena *mArena;
+    List<Value*> mStack;
+    String mKey;
+};
+}
+
+Value Value::fromJSON(const char *json, int size, bool *ok, Arena *arena)
+{
+    ValueBuilder builder(arena);
+    const bool success = JSONParser::parse(json, size, &builder) == JSONParser::Success;
+    if (ok)
+        *ok = success;
+    if (!success)
+        return Value();
+    return std::move(builder.root);
 }
 
 String Value::toJSON(bool pretty) const
 {
-    cJSON *json = toCJSON(*this);
-    char *formatted = (pretty ? cJSON_Print(json) : cJSON_PrintUnformatted(json));
-    cJSON_Delete(json);
-    const String ret = formatted;
-    free(formatted);
+    String ret;
+    toJSON(ret, pretty);
     return ret;
 }
+
+void Value::toJSON(String &out, bool pretty) const
+{
+    JSONWriter writer(out, pretty ? JSONWriter::Pretty : JSONWriter::None);
+    writer.write(*this);
+}
@@ -8,19 +8,20 @@
 #include <rct/List.h>
 #include <math.h>
 
-struct cJSON;
 class Value
 {
 public:
     struct Custom;
-    inline Value() : mType(Type_Invalid) {}
-    inline Value(int i) : mType(Type_Integer) { mData.integer = i; }
-    inline Value(int64_t i) : mType(Type_Integer) { mData.int64 = i; }
-    inline Value(uint64_t i) : mType(Type_Integer) { mData.uint64 = i; }
-    inline Value(double d) : mType(Type_Double) { mData.dbl = d; }
-    inline Value(bool b) : mType(Type_Boolean) { mData.boolean = b; }
-    inline Value(const std::shared_ptr<Custom> &custom) : mType(Type_Custom) { new (mData.customBuf) std::shared_ptr<Custom>(custom); }
-    inline Value(const String &string) : mType(Type_String) { new (mData.stringBuf) String(string); }
+    class Arena;
+    inline Value() : mType(Type_Invalid), mArena(false) {}
+    inline Value(int i) : mType(Type_Integer), mArena(false) { mData.int64 = i; }
+    inline Value(int64_t i) : mType(Type_Integer), mArena(false) { mData.int64 = i; }
+    inline Value(uint64_t i) : mType(Type_Integer), mArena(false) { mData.uint64 = i; }
+    inline Value(double d) : mType(Type_Double), mArena(false) { mData.dbl = d; }
+    inline Value(bool b) : mType(Type_Boolean), mArena(false) { mData.boolean = b; }
+    inline Value(const std::shared_ptr<Custom> &custom) : mType(Type_Custom), mArena(false) { new (mData.customBuf) std::shared_ptr<Custom>(custom); }
+    inline Value(const String &string) : mType(Type_String), mArena(false) { new (mData.stringBuf) String(string); }
+    inline Value(String &&string) : mType(Type_String), mArena(false) { new (mData.stringBuf) String(std::move(string)); }
 
     struct Custom : std::enable_shared_from_this<Custom>
     {
@@ -33,16 +34,17 @@ public:
 
         const int type;
     };
-    inline Value(const char *str, int len = -1) : mType(Type_String)
+    inline Value(const char *str, int len = -1) : mType(Type_String), mArena(false)
     {
         if (len == -1)
             len = strlen(str);
         new (mData.stringBuf) String(str, len);
     }
-    inline Value(const Value &other) : mType(Type_Invalid) { copy(other); }
-    inline Value(const Map<String, Value> &map) : mType(Type_Map) { new (mData.mapBuf) Map<String, Value>(map); }
+    inline Value(const Value &other) : mType(Type_Invalid), mArena(false) { copy(other); }
+    inline Value(const Map<String, Value> &map) : mType(Type_Map), mArena(false) { mData.map = new Map<String, Value>(map); }
+    inline Value(Map<String, Value> &&map) : mType(Type_Map), mArena(false) { mData.map = new Map<String, Value>(std::move(map)); }
     template <typename T> inline Value(const List<T> &list)
-        : mType(Type_List)
+        : mType(Type_List), mArena(false)
     {
         new (mData.listBuf) List<Value>(list.size());
         int i = 0;
@@ -51,12 +53,13 @@ public:
         for (const T &t : list)
             (*l)[i++] = t;
     }
-    inline Value(const List<Value> &list) : mType(Type_List) { new (mData.listBuf) List<Value>(list); }
-    Value(Value &&other);
+    inline Value(const List<Value> &list) : mType(Type_List), mArena(false) { new (mData.listBuf) List<Value>(list); }
+    inline Value(List<Value> &&list) : mType(Type_List), mArena(false) { new (mData.listBuf) List<Value>(std::move(list)); }
+    inline Value(Value &&other) : mType(Type_Invalid), mArena(false) { move(other); }
     ~Value() { clear(); }
 
     inline Value &operator=(const Value &other) { clear(); copy(other); return *this; }
-    Value & operator=(Value&& other);
+    Value &operator=(Value &&other);
 
     inline bool isNull() const { return mType == Type_Invalid; }
     inline bool isValid() const { return mType != Type_Invalid; }
@@ -95,6 +98,13 @@ public:
     template <typename T>
     inline List<T> toList() const;
     inline List<Value> toList() const;
+    // No copy. The const versions give an empty container for a Value of
+    // another type, the others turn an invalid Value into an empty one
+    inline const String &stringRef() const;
+    inline const Map<String, Value> &mapRef() const;
+    inline Map<String, Value> &mapRef();
+    inline const List<Value> &listRef() const;
+    inline List<Value> &listRef();
     Map<String, Value>::const_iterator begin() const;
     Map<String, Value>::const_iterator end() const;
     List<Value>::const_iterator listBegin() const;
@@ -107,6 +117,7 @@ public:
     const Value &operator[](int idx) const;
     Value &operator[](int idx);
     void push_back(const Value &value);
+    void push_back(Value &&value);
     const Value &operator[](const String &key) const;
     Value &operator[](const String &key);
     inline Value value(int idx, const Value &defaultValue = Value()) const;
@@ -117,52 +128,106 @@ public:
     inline Value convert(Type type, bool *ok) const;
     template <typename T> static Value create(const T &t) { return Value(t); }
     void clear();
-    static Value fromJSON(const String &json, bool *ok = 0) { return fromJSON(json.constData(), ok); }
-    static Value fromJSON(const char *json, bool *ok = 0);
+    static Value fromJSON(const String &json, bool *ok = 0) { return fromJSON(json.constData(), json.size(), ok); }
+    static Value fromJSON(const char *json, bool *ok = 0) { return fromJSON(json, strlen(json), ok); }
+    // maps, lists and strings come from arena if there is one
+    static Value fromJSON(const char *json, int size, bool *ok = 0, Arena *arena = 0);
     String toJSON(bool pretty = false) const;
+    // appends to out, see JSONWriter for writing anywhere else
+    void toJSON(String &out, bool pretty = false) const;
+    // the compact binary form, see BinaryValue.h. toBinary() appends.
+    // operator<<() and operator>>() keep to the tagged form they've always
+    // written, Binary(value) in a Serializer or Deserializer is this one
+    // with a uint32_t size in front. Both ends have to use the same
+    void toBinary(String &out) const;
+    void toBinary(Serializer &serializer) const;
+    static Value fromBinary(const char *data, int size, bool *ok = 0);
+    static Value fromBinary(Deserializer &deserializer, bool *ok = 0);
+    struct Binary
+    {
+        explicit Binary(Value &v) : value(&v), constValue(&v) {}
+        explicit Binary(const Value &v) : value(0), constValue(&v) {}
+
+        // null for one that can only be written
+        Value *value;
+        const Value *constValue;
+    };
     static Value undefined() { return Value(Type_Undefined); }
 private:
-    explicit Value(Type type) : mType(type) {}
+    explicit Value(Type type) : mType(type), mArena(false) {}
 
-    static cJSON *toCJSON(const Value &value);
     void copy(const Value &other);
-    String *stringPtr() { return reinterpret_cast<String*>(mData.stringBuf); }
-    const String *stringPtr() const { return reinterpret_cast<const String*>(mData.stringBuf); }
-    Map<String, Value> *mapPtr() { return reinterpret_cast<Map<String, Value>*>(mData.mapBuf); }
-    const Map<String, Value> *mapPtr() const { return reinterpret_cast<const Map<String, Value>*>(mData.mapBuf); }
-    List<Value> *listPtr() { return reinterpret_cast<List<Value>*>(mData.listBuf); }
-    const List<Value> *listPtr() const { return reinterpret_cast<const List<Value>*>(mData.listBuf); }
+    void move(Value &other);
+    String *stringPtr() { return mArena ? static_cast<String*>(mData.payload) : reinterpret_cast<String*>(mData.stringBuf); }
+    const String *stringPtr() const { return mArena ? static_cast<const String*>(mData.payload) : reinterpret_cast<const String*>(mData.stringBuf); }
+    Map<String, Value> *mapPtr() { return mData.map; }
+    const Map<String, Value> *mapPtr() const { return mData.map; }
+    List<Value> *listPtr() { return mArena ? static_cast<List<Value>*>(mData.payload) : reinterpret_cast<List<Value>*>(mData.listBuf); }
+    const List<Value> *listPtr() const { return mArena ? static_cast<const List<Value>*>(mData.payload) : reinterpret_cast<const List<Value>*>(mData.listBuf); }
     std::shared_ptr<Custom> *customPtr() { return reinterpret_cast<std::shared_ptr<Custom>*>(mData.customBuf); }
     const std::shared_ptr<Custom> *customPtr() const { return reinterpret_cast<const std::shared_ptr<Custom>*>(mData.customBuf); }
 
     Type mType;
+    // the string, map or list belongs to an Arena, we only point at it
+    bool mArena;
     union {
-        int integer;
+        // integers of all sizes
         int64_t int64;
         uint64_t uint64;
         double dbl;
         bool boolean;
         char stringBuf[sizeof(String)];
-        char mapBuf[sizeof(Map<String, Value>)];
         char listBuf[sizeof(List<Value>)];
         char customBuf[sizeof(std::shared_ptr<Custom>)];
+        // a std::map is twice the size of everything else, keeping it out
+        // of line makes every Value smaller and moving a map a pointer copy
+        Map<String, Value> *map;
+        void *payload;
     } mData;
 };
 
-inline Value::Value(Value &&other)
-    : mType(Type_Invalid)
+// Builds Values whose strings, maps and lists live in chunks owned by the
+// arena. Dropping or overwriting such a Value doesn't touch its payload,
+// everything is torn down together when the arena is cleared or
+// destroyed, so a big tree doesn't get walked once per owner. Copying an
+// arena Value gives an ordinary, owned deep copy. Moving one doesn't, it
+// must not outlive the arena.
+class Value::Arena
 {
-    copy(other);
-    memset(&other.mData, '\0', sizeof(mData));
-    other.mType = Type_Invalid;
-}
+public:
+    explicit Arena(size_t chunkSize = 64 * 1024);
+    ~Arena();
+
+    Value map();
+    Value list(int reserve = 0);
+    Value string(const char *str, int len = -1);
+    Value string(const String &str) { return string(str.constData(), str.size()); }
+
+    void clear();
+    // bytes taken from the chunks
+    size_t memoryUsage() const { return mUsed; }
+private:
+    Arena(const Arena &) = delete;
+    Arena &operator=(const Arena &) = delete;
+
+    void *allocate(size_t size);
+    template <typename T> static void destroy(void *t) { static_cast<T*>(t)->~T(); }
+    static Value borrow(Type type, void *payload);
+
+    const size_t mChunkSize;
+    List<char*> mChunks;
+    size_t mChunkUsed, mUsed;
+    List<std::pair<void*, void (*)(void*)> > mPayloads;
+};
 
 inline Value &Value::operator=(Value &&other)
 {
-    clear();
-    copy(other);
-    memset(&other.mData, '\0', sizeof(mData));
-    other.mType = Type_Invalid;
+    if (this != &other) {
+        // other may be part of our own tree
+        Value tmp(std::move(other));
+        clear();
+        move(tmp);
+    }
     return *this;
 }
 
@@ -187,7 +252,7 @@ template <> inline int Value::convert<int>(bool *ok) const
     if (ok)
         *ok = true;
     switch (mType) {
-    case Type_Integer: return mData.integer;
+    case Type_Integer: return static_cast<int>(mData.int64);
     case Type_Double: return static_cast<int>(round(mData.dbl));
     case Type_Boolean: return mData.boolean;
     case Type_String: {
@@ -283,7 +348,7 @@ template <> inline bool Value::convert<bool>(bool *ok) const
         *ok = true;
 
     switch (mType) {
-    case Type_Integer: return mData.integer;
+    case Type_Integer: return mData.int64;
     case Type_Double: return mData.dbl;
     case Type_Boolean: return mData.boolean;
     case Type_String: {
@@ -313,7 +378,7 @@ template <> inline double Value::convert<double>(bool *ok) const
         *ok = true;
 
     switch (mType) {
-    case Type_Integer: return mData.integer;
+    case Type_Integer: return mData.int64;
     case Type_Double: return mData.dbl;
     case Type_Boolean: return mData.boolean;
     case Type_String: {
@@ -340,7 +405,7 @@ template <> inline String Value::convert<String>(bool *ok) const
         *ok = true;
 
     switch (mType) {
-    case Type_Integer: return String::number(mData.integer);
+    case Type_Integer: return String::number(mData.int64);
     case Type_Double: return String::number(mData.dbl);
     case Type_Boolean: return mData.boolean ? "true" : "false";
     case Type_String: return *stringPtr();
@@ -523,17 +588,59 @@ inline const Value &Value::operator[](int idx) const
 }
 
 inline Value &Value::operator[](int idx)
+{
+    return listRef()[idx];
+}
+
+inline void Value::push_back(const Value &value)
+{
+    listRef().push_back(value);
+}
+
+inline void Value::push_back(Value &&value)
+{
+    listRef().push_back(std::move(value));
+}
+
+inline const String &Value::stringRef() const
+{
+    if (mType != Type_String) {
+        const static String empty;
+        return empty;
+    }
+    return *stringPtr();
+}
+
+inline const Map<String, Value> &Value::mapRef() const
+{
+    if (mType != Type_Map) {
+        const static Map<String, Value> empty;
+        return empty;
+    }
+    return *mapPtr();
+}
+
+inline Map<String, Value> &Value::mapRef()
 {
     if (mType == Type_Invalid) {
-        new (mData.listBuf) List<Value>;
-        mType = Type_List;
+        mData.map = new Map<String, Value>;
+        mType = Type_Map;
     } else {
-        assert(mType == Type_List);
+        assert(mType == Type_Map);
     }
-    return (*listPtr())[idx];
+    return *mapPtr();
 }
 
-inline void Value::push_back(const Value &value)
+inline const List<Value> &Value::listRef() const
+{
+    if (mType != Type_List) {
+        const static List<Value> empty;
+        return empty;
+    }
+    return *listPtr();
+}
+
+inline List<Value> &Value::listRef()
 {
     if (mType == Type_Invalid) {
         new (mData.listBuf) List<Value>;
@@ -541,7 +648,7 @@ inline void Value::push_back(const Value &value)
     } else {
         assert(mType == Type_List);
     }
-    listPtr()->push_back(value);
+    return *listPtr();
 }
 
 inline const Value &Value::operator[](const String &key) const
@@ -552,13 +659,7 @@ inline const Value &Value::operator[](const String &key) const
 
 inline Value &Value::operator[](const String &key)
 {
-    if (mType == Type_Invalid) {
-        new (mData.mapBuf) Map<String, Value>;
-        mType = Type_Map;
-    } else {
-        assert(mType == Type_Map);
-    }
-    return (*mapPtr())[key];
+    return mapRef()[key];
 }
 template <typename T>
 inline T Value::operator[](int idx) const
@@ -594,8 +695,8 @@ inline Log operator<<(Log log, const Value &value)
                 l << "Custom(0)";
             }
             break; }
-        case Value::Type_List: l << value.toList(); break;
-        case Value::Type_Map: l << value.toMap(); break;
+        case Value::Type_List: l << value.listRef(); break;
+        case Value::Type_Map: l << value.mapRef(); break;
         }
     }
     log << String::format<128>("Value(%s: %s)", Value::typeToString(value.type()),
@@ -610,9 +711,9 @@ inline Serializer& operator<<(Serializer& serializer, const Value& value)
     case Value::Type_Integer: serializer << value.toInteger(); break;
     case Value::Type_Double: serializer << value.toDouble(); break;
     case Value::Type_Boolean: serializer << value.toBool(); break;
-    case Value::Type_String: serializer << value.toString(); break;
-    case Value::Type_Map: serializer << value.toMap(); break;
-    case Value::Type_List: serializer << value.toList(); break;
+    case Value::Type_String: serializer << value.stringRef(); break;
+    case Value::Type_Map: serializer << value.mapRef(); break;
+    case Value::Type_List: serializer << value.listRef(); break;
     case Value::Type_Custom: error() << "Trying to serialize pointer"; break;
     case Value::Type_Invalid: break;
     case Value::Type_Undefined: break;
@@ -629,9 +730,9 @@ inline Deserializer& operator>>(Deserializer& deserializer, Value& value)
     case Value::Type_Integer: { int v; deserializer >> v; value = v; break; }
     case Value::Type_Double: { double v; deserializer >> v; value = v; break; }
     case Value::Type_Boolean: { bool v; deserializer >> v; value = v; break; }
-    case Value::Type_String: { String v; deserializer >> v; value = v; break; }
-    case Value::Type_Map: { Map<String, Value> v; deserializer >> v; value = v; break; }
-    case Value::Type_List: { List<Value> v; deserializer >> v; value = v; break; }
+    case Value::Type_String: { String v; deserializer >> v; value = std::move(v); break; }
+    case Value::Type_Map: { Map<String, Value> v; deserializer >> v; value = std::move(v); break; }
+    case Value::Type_List: { List<Value> v; deserializer >> v; value = std::move(v); break; }
     case Value::Type_Custom: value.clear(); error() << "Trying to deserialize pointer"; break;
     case Value::Type_Invalid: value.clear(); break;
     case Value::Type_Undefined: value = Value::undefined(); break;
@@ -639,4 +740,23 @@ inline Deserializer& operator>>(Deserializer& deserializer, Value& value)
     return deserializer;
 }
 
+inline Serializer& operator<<(Serializer& serializer, const Value::Binary& binary)
+{
+    if (binary.constValue->type() == Value::Type_Custom)
+        error() << "Trying to serialize pointer";
+    binary.constValue->toBinary(serializer);
+    return serializer;
+}
+
+// by value so it takes Binary(value) as it is
+inline Deserializer& operator>>(Deserializer& deserializer, Value::Binary binary)
+{
+    assert(binary.value);
+    bool ok;
+    *binary.value = Value::fromBinary(deserializer, &ok);
+    if (!ok)
+        error() << "Invalid Value in deserializer";
+    return deserializer;
+}
+
 #endif
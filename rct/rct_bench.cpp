@@ -0,0 +1,407 @@
+#include <rct/Connection.h>
+#include <rct/EventLoop.h>
+#include <rct/Future.h>
+#include <rct/Log.h>
+#include <rct/Message.h>
+#include <rct/Path.h>
+#include <rct/Rct.h>
+#include <rct/Serializer.h>
+#include <rct/SocketServer.h>
+#include <rct/StopWatch.h>
+#include <rct/String.h>
+#include <rct/ThreadPool.h>
+#include <rct/Timer.h>
+#include <rct/Value.h>
+#include <atomic>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <thread>
+#include <unistd.h>
+
+// Microbenchmarks of the paths everything else sits on. Every benchmark
+// reports how many operations it did and how long they took, the whole run
+// goes to stdout as one JSON object so runs can be compared across
+// releases:
+//
+//   rct_bench [--scale=<factor>] [--list] [name...]
+
+static double sScale = 1.0;
+
+static int64_t scaled(int64_t iterations)
+{
+    const int64_t ret = static_cast<int64_t>(iterations * sScale);
+    return ret > 0 ? ret : 1;
+}
+
+static Value result(int64_t operations, unsigned long long us)
+{
+    Value ret;
+    ret["operations"] = operations;
+    ret["us"] = static_cast<uint64_t>(us);
+    ret["opsPerSec"] = us ? operations * 1000000.0 / us : 0.0;
+    ret["nsPerOp"] = operations ? us * 1000.0 / operations : 0.0;
+    return ret;
+}
+
+class BenchMessage : public Message
+{
+public:
+    enum { MessageId = 100 };
+
+    BenchMessage(const String &payload = String(), int sequence = 0)
+        : Message(MessageId), mPayload(payload), mSequence(sequence)
+    {}
+
+    const String &payload() const { return mPayload; }
+    int sequence() const { return mSequence; }
+
+    virtual int encodedSize() const override { return mPayload.size() + sizeof(int) * 2; }
+    virtual void encode(Serializer &serializer) const override { serializer << mPayload << mSequence; }
+    virtual void decode(Deserializer &deserializer) override { deserializer >> mPayload >> mSequence; }
+private:
+    String mPayload;
+    int mSequence;
+};
+
+// a loop running on a thread of its own
+class LoopThread
+{
+public:
+    LoopThread()
+        : mLoop(std::make_shared<EventLoop>()), mReady(false)
+    {
+        mThread = std::thread([this]() {
+                mLoop->init(EventLoop::None);
+                mReady.store(true);
+                mLoop->exec();
+            });
+        while (!mReady.load())
+            std::this_thread::yield();
+    }
+    ~LoopThread()
+    {
+        mLoop->quit();
+        mThread.join();
+    }
+
+    const EventLoop::SharedPtr &loop() const { return mLoop; }
+private:
+    EventLoop::SharedPtr mLoop;
+    std::atomic<bool> mReady;
+    std::thread mThread;
+};
+
+static Value benchPost()
+{
+    const int64_t count = scaled(1000000);
+    LoopThread thread;
+    std::atomic<int64_t> done(0);
+    StopWatch watch(StopWatch::Microsecond);
+    for (int64_t i = 0; i < count; ++i)
+        thread.loop()->callLater([&done]() { done.fetch_add(1, std::memory_order_relaxed); });
+    while (done.load(std::memory_order_relaxed) < count)
+        std::this_thread::yield();
+    return result(count, watch.elapsed());
+}
+
+static Value benchTimers()
+{
+    const int64_t count = scaled(1000000);
+    enum { Batch = 1000 };
+    EventLoop::SharedPtr loop = EventLoop::eventLoop();
+    int ids[Batch];
+    StopWatch watch(StopWatch::Microsecond);
+    for (int64_t i = 0; i < count; i += Batch) {
+        const int batch = static_cast<int>(std::min<int64_t>(Batch, count - i));
+        for (int j = 0; j < batch; ++j)
+            ids[j] = loop->registerTimer([](int) {}, 1000 + j, Timer::SingleShot);
+        for (int j = 0; j < batch; ++j)
+            loop->unregisterTimer(ids[j]);
+    }
+    return result(count, watch.elapsed());
+}
+
+// ping-pong of one message between two connections on this thread's loop
+static Value roundTrip(SocketServer &server, const std::function<bool(const std::shared_ptr<Connection> &)> &connect)
+{
+    const int count = static_cast<int>(scaled(20000));
+    EventLoop::SharedPtr loop = EventLoop::eventLoop();
+    List<std::shared_ptr<Connection> > accepted;
+    server.newConnection().connect([&accepted](SocketServer *s) {
+            while (SocketClient::SharedPtr client = s->nextConnection()) {
+                std::shared_ptr<Connection> conn = Connection::create(client);
+                conn->newMessage().connect([](const std::shared_ptr<Message> &message, const std::shared_ptr<Connection> &c) {
+                        c->send(*message);
+                    });
+                accepted.append(conn);
+            }
+        });
+
+    std::shared_ptr<Connection> client = Connection::create();
+    const BenchMessage ping(String(64, 'x'));
+    int received = 0;
+    StopWatch watch(StopWatch::Microsecond);
+    const auto connectedKey = client->connected().connect([&](const std::shared_ptr<Connection> &c) {
+            watch.start();
+            c->send(ping);
+        });
+    const auto messageKey = client->newMessage().connect([&](const std::shared_ptr<Message> &, const std::shared_ptr<Connection> &c) {
+            if (++received == count) {
+                loop->quit();
+            } else {
+                c->send(ping);
+            }
+        });
+    const auto disconnectedKey = client->disconnected().connect([&loop](const std::shared_ptr<Connection> &) { loop->quit(); });
+    if (connect(client))
+        loop->exec(60000);
+    const unsigned long long us = watch.elapsed();
+    // the client may well outlive this, nothing may call back in here
+    client->connected().disconnect(connectedKey);
+    client->newMessage().disconnect(messageKey);
+    client->disconnected().disconnect(disconnectedKey);
+    if (client->isConnected())
+        client->close();
+    for (const std::shared_ptr<Connection> &conn : accepted)
+        conn->close();
+    if (received != count)
+        return Value();
+    return result(received, us);
+}
+
+static Value benchUnixRoundTrip()
+{
+    const Path path = String::format<64>("/tmp/rct_bench.%d.sock", getpid());
+    SocketServer server;
+    if (!server.listen(path))
+        return Value();
+    const Value ret = roundTrip(server, [&path](const std::shared_ptr<Connection> &c) { return c->connectUnix(path); });
+    server.close();
+    Path::rm(path);
+    return ret;
+}
+
+static Value benchTcpRoundTrip()
+{
+    SocketServer server;
+    uint16_t port = 0;
+    for (uint16_t p = 41000; p < 41100 && !port; ++p) {
+        if (server.listen(p))
+            port = p;
+    }
+    if (!port)
+        return Value();
+    return roundTrip(server, [port](const std::shared_ptr<Connection> &c) { return c->connectTcp("127.0.0.1", port); });
+}
+
+static Value benchSerializer()
+{
+    const int64_t count = scaled(2000);
+    List<String> list;
+    Map<String, int> map;
+    for (int i = 0; i < 1000; ++i) {
+        list.append(String::format<32>("list entry number %d", i));
+        map[String::format<32>("key%d", i)] = i;
+    }
+    String encoded;
+    int64_t bytes = 0;
+    StopWatch watch(StopWatch::Microsecond);
+    for (int64_t i = 0; i < count; ++i) {
+        encoded.clear();
+        {
+            Serializer serializer(encoded);
+            serializer << list << map;
+        }
+        Deserializer deserializer(encoded);
+        List<String> l;
+        Map<String, int> m;
+        deserializer >> l >> m;
+        bytes += encoded.size();
+    }
+    Value ret = result(count, watch.elapsed());
+    ret["bytes"] = bytes;
+    return ret;
+}
+
+static Value benchMessageCreate()
+{
+    const int64_t count = scaled(1000000);
+    String frame;
+    {
+        Serializer serializer(frame);
+        const BenchMessage message(String(64, 'x'), 1);
+        serializer << static_cast<int>(0) << static_cast<uint8_t>(BenchMessage::MessageId) << static_cast<uint8_t>(0);
+        message.encode(serializer);
+    }
+    StopWatch watch(StopWatch::Microsecond);
+    for (int64_t i = 0; i < count; ++i) {
+        if (!Message::create(0, frame.constData(), frame.size()))
+            return Value();
+    }
+    return result(count, watch.elapsed());
+}
+
+static Value benchString()
+{
+    const int64_t count = scaled(200);
+    String text;
+    for (int i = 0; i < 50000; ++i) {
+        text += "word";
+        text += String::number(i);
+        text += ',';
+    }
+    const String needle = "word49999";
+    int64_t found = 0;
+    StopWatch watch(StopWatch::Microsecond);
+    for (int64_t i = 0; i < count; ++i) {
+        found += text.split(',').size();
+        found += text.indexOf(needle);
+        found += text.indexOf('\n') == -1;
+    }
+    Value ret = result(count, watch.elapsed());
+    ret["bytes"] = static_cast<int64_t>(text.size()) * count * 3;
+    ret["checksum"] = found;
+    return ret;
+}
+
+static Value benchJSON()
+{
+    const int64_t count = scaled(2000);
+    List<Value> entries;
+    for (int i = 0; i < 200; ++i) {
+        Value entry;
+        entry["name"] = String::format<32>("entry %d", i);
+        entry["index"] = i;
+        entry["ratio"] = i / 3.0;
+        entry["enabled"] = (i % 2) == 0;
+        entry["tags"] = List<String>() << "one" << "two" << "three";
+        entries.append(entry);
+    }
+    Value root;
+    root["entries"] = entries;
+    const String json = root.toJSON();
+    int64_t bytes = 0;
+    StopWatch watch(StopWatch::Microsecond);
+    for (int64_t i = 0; i < count; ++i) {
+        bool ok;
+        const Value value = Value::fromJSON(json, &ok);
+        if (!ok)
+            return Value();
+        bytes += value.toJSON().size();
+    }
+    Value ret = result(count, watch.elapsed());
+    ret["bytes"] = bytes * 2;
+    return ret;
+}
+
+static Value benchThreadPool()
+{
+    const int64_t count = scaled(200000);
+    ThreadPool pool(ThreadPool::idealThreadCount());
+    std::atomic<int64_t> done(0);
+    StopWatch watch(StopWatch::Microsecond);
+    List<Future<void> > futures;
+    futures.reserve(count);
+    for (int64_t i = 0; i < count; ++i)
+        futures.append(pool.submit([&done]() { done.fetch_add(1, std::memory_order_relaxed); }));
+    for (const Future<void> &future : futures)
+        future.wait();
+    Value ret = result(count, watch.elapsed());
+    ret["threads"] = pool.concurrentJobs();
+    return ret;
+}
+
+static Path::VisitResult countVisit(const Path &path, void *userData)
+{
+    ++*static_cast<int64_t *>(userData);
+    return path.isDir() ? Path::Recurse : Path::Continue;
+}
+
+static Value benchVisit()
+{
+    const int64_t count = scaled(50);
+    char dir[] = "/tmp/rct_bench.XXXXXX";
+    if (!mkdtemp(dir))
+        return Value();
+    const Path root = Path(dir).ensureTrailingSlash();
+    for (int i = 0; i < 10; ++i) {
+        for (int j = 0; j < 10; ++j) {
+            const Path sub = root + String::format<32>("%d/%d/", i, j);
+            Path::mkdir(sub, Path::Recursive);
+            for (int k = 0; k < 20; ++k)
+                Path(sub + String::format<16>("file%d.cpp", k)).touch();
+        }
+    }
+    int64_t entries = 0;
+    StopWatch watch(StopWatch::Microsecond);
+    for (int64_t i = 0; i < count; ++i)
+        root.visit(countVisit, &entries);
+    const unsigned long long us = watch.elapsed();
+    Path::rmdir(root);
+    return result(entries, us);
+}
+
+static const struct {
+    const char *name;
+    Value (*run)();
+} benchmarks[] = {
+    { "eventloop.post", benchPost },
+    { "eventloop.timers", benchTimers },
+    { "connection.unix", benchUnixRoundTrip },
+    { "connection.tcp", benchTcpRoundTrip },
+    { "serializer", benchSerializer },
+    { "message.create", benchMessageCreate },
+    { "string.split", benchString },
+    { "value.json", benchJSON },
+    { "threadpool.submit", benchThreadPool },
+    { "path.visit", benchVisit }
+};
+
+int main(int argc, char **argv)
+{
+    List<String> names;
+    for (int i = 1; i < argc; ++i) {
+        if (!strncmp(argv[i], "--scale=", 8)) {
+            sScale = atof(argv[i] + 8);
+            if (sScale <= 0) {
+                fprintf(stderr, "Invalid scale %s\n", argv[i] + 8);
+                return 1;
+            }
+        } else if (!strcmp(argv[i], "--list")) {
+            for (const auto &benchmark : benchmarks)
+                printf("%s\n", benchmark.name);
+            return 0;
+        } else {
+            names.append(argv[i]);
+        }
+    }
+
+    initLogging("rct_bench", LogStderr, Error);
+    Message::registerMessage<BenchMessage>();
+    EventLoop::SharedPtr loop = std::make_shared<EventLoop>();
+    loop->init(EventLoop::MainEventLoop);
+
+    Value results;
+    bool failed = false;
+    for (const auto &benchmark : benchmarks) {
+        if (!names.isEmpty() && !names.contains(benchmark.name))
+            continue;
+        const Value value = benchmark.run();
+        if (value.isNull()) {
+            error("%s failed", benchmark.name);
+            failed = true;
+        }
+        results[benchmark.name] = value;
+    }
+
+    Value out;
+    out["scale"] = sScale;
+    out["cpus"] = ThreadPool::idealThreadCount();
+    out["time"] = static_cast<int64_t>(time(0));
+    out["results"] = results;
+    printf("%s\n", out.toJSON(true).constData());
+
+    cleanupLogging();
+    return failed ? 1 : 0;
+}
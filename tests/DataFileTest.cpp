@@ -0,0 +1,106 @@
+#include <rct/DataFile.h>
+#include <rct/Future.h>
+#include <rct/Path.h>
+#include <rct/ThreadPool.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "Test.h"
+
+// Writing to the unnamed section after it had ended, or reading a file
+// without one, used to assert or dereference null
+int main()
+{
+    const char *tmp = getenv("TMPDIR");
+    String dir = String(tmp && *tmp ? tmp : "/tmp") + "/rct-datafile-XXXXXX";
+    CHECK(mkdtemp(dir.data()));
+    const Path path = dir + "/file";
+
+    {
+        // the usual, unnamed first and a named section after
+        DataFile file(path, 1);
+        CHECK(file.open(DataFile::Write));
+        file << 1 << String("one");
+        CHECK(file.beginSection("named"));
+        file << 2;
+        file.endSection();
+        CHECK(file.flush());
+    }
+    {
+        DataFile file(path, 1);
+        CHECK(file.open(DataFile::Read));
+        int number = 0;
+        String string;
+        file >> number >> string;
+        CHECK(number == 1 && string == "one");
+        std::unique_ptr<Deserializer> named = file.section("named");
+        CHECK(named);
+        *named >> number;
+        CHECK(number == 2);
+    }
+    {
+        // the unnamed section can't be picked up again
+        DataFile file(path, 1);
+        CHECK(file.open(DataFile::Write));
+        file << 1;
+        CHECK(file.beginSection("named"));
+        file << 2;
+        file.endSection();
+        file << 3;
+        CHECK(!file.error().isEmpty());
+        CHECK(!file.flush());
+    }
+    {
+        // what's there is still the first file
+        DataFile file(path, 1);
+        CHECK(file.open(DataFile::Read));
+        int number = 0;
+        file >> number;
+        CHECK(number == 1);
+    }
+    {
+        DataFile file(path, 1);
+        CHECK(file.open(DataFile::Write));
+        CHECK(file.beginSection("named"));
+        file << 2;
+        CHECK(file.flush());
+    }
+    {
+        DataFile file(path, 1);
+        CHECK(file.open(DataFile::Read));
+        CHECK(!file.hasSection(String()));
+        int number = 42;
+        file >> number;
+        CHECK(number == 42);
+        CHECK(!file.error().isEmpty());
+    }
+    if (Compression::isSupported(Compression::Zlib)) {
+        // compressed files written from every worker of the pool at once
+        // used to wait for compression jobs none of them would get to
+        alarm(60);
+        ThreadPool *pool = ThreadPool::instance();
+        pool->setConcurrentJobs(2);
+        List<Future<bool> > jobs;
+        for (int i=0; i<pool->concurrentJobs(); ++i) {
+            const Path file = dir + String::format<16>("/pool%d", i);
+            jobs.append(pool->submit([file]() {
+                        DataFile data(file, 1);
+                        if (!data.open(DataFile::Write))
+                            return false;
+                        data.setCompression(Compression::Zlib);
+                        const String block(DataFile::BlockSize, 'x');
+                        for (int b=0; b<12; ++b)
+                            data << block;
+                        const bool ok = data.flush();
+                        Path::rm(file);
+                        return ok;
+                    }));
+        }
+        for (const Future<bool> &job : jobs)
+            CHECK(job.get());
+        alarm(0);
+    }
+
+    Path::rm(path);
+    Path::rmdir(dir);
+    return 0;
+}
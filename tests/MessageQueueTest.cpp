@@ -0,0 +1,34 @@
+#include <rct/EventLoop.h>
+#include <rct/MessageQueue.h>
+#include <rct/Timer.h>
+#include <unistd.h>
+#include "Test.h"
+
+// More than MaxBatch messages waiting when the loop first looked used to
+// leave the rest in the queue, nothing woke the loop for them again
+int main()
+{
+    EventLoop::SharedPtr loop = std::make_shared<EventLoop>();
+    loop->init(EventLoop::MainEventLoop);
+
+    enum { Count = MessageQueue::MaxBatch * 3 };
+    const String name = String::format<64>("/rct-mq-test-%d", getpid());
+    MessageQueue receiver(name, MessageQueue::Posix, MessageQueue::Create, MessageQueue::Receive, Count, 16);
+    if (!receiver.isValid()) {
+        // queues this long need more than the system allows us
+        printf("skipped, can't create a queue of %d messages\n", Count);
+        return 0;
+    }
+    int received = 0;
+    receiver.dataAvailable().connect([&received](const Buffer &) { ++received; });
+
+    MessageQueue sender(name, MessageQueue::Posix, MessageQueue::None, MessageQueue::SendOnly);
+    CHECK(sender.isValid());
+    for (int i=0; i<Count; ++i)
+        CHECK(sender.send(String::number(i)));
+
+    loop->registerTimer([loop](int) { loop->quit(); }, 500, Timer::SingleShot);
+    loop->exec();
+    CHECK(received == Count);
+    return 0;
+}
@@ -0,0 +1,63 @@
+#include <rct/Hash.h>
+#include <rct/Path.h>
+#include <rct/PathWalker.h>
+#include <rct/ThreadPool.h>
+#include <stdlib.h>
+#include "Test.h"
+
+// A released directory used to be queued both by the walking thread and
+// by the worker that listed it when they raced, parallel walks then
+// delivered it twice or lost what was under it. Walks the same tree many
+// times and compares with a serial walk.
+
+static void makeTree(const Path &dir, int depth)
+{
+    for (int i = 0; i < 3; ++i)
+        Path::write(dir + String::format<32>("file%d", i), "x");
+    if (!depth)
+        return;
+    for (int i = 0; i < 4; ++i) {
+        const Path sub = dir + String::format<32>("dir%d/", i);
+        Path::mkdir(sub);
+        makeTree(sub, depth - 1);
+    }
+}
+
+static Hash<Path, int> walk(const Path &root, unsigned int flags, ThreadPool *pool)
+{
+    Hash<Path, int> ret;
+    PathWalker walker(root, flags);
+    walker.setThreadPool(pool);
+    CHECK(walker.walk([&ret](const PathWalker::Entry &entry) {
+                ++ret[entry.path];
+                return Path::Recurse;
+            }));
+    return ret;
+}
+
+int main()
+{
+    const char *tmp = getenv("TMPDIR");
+    String dir = String(tmp && *tmp ? tmp : "/tmp") + "/rct-pathwalker-XXXXXX";
+    CHECK(mkdtemp(dir.data()));
+    const Path root = Path(dir).ensureTrailingSlash();
+    makeTree(root, 3);
+
+    ThreadPool pool(4);
+    const Hash<Path, int> expected = walk(root, PathWalker::None, &pool);
+    CHECK(expected.size() == 4 + 16 + 64 + 3 * (1 + 4 + 16 + 64));
+    for (int i = 0; i < 4000; ++i) {
+        const unsigned int flags = PathWalker::Parallel | (i % 4 ? 0 : PathWalker::Ordered);
+        const Hash<Path, int> found = walk(root, flags, &pool);
+        if (found != expected) {
+            fprintf(stderr, "walk %d found %d, expected %d\n", i, found.size(), expected.size());
+            for (const auto &it : found) {
+                if (it.second != 1)
+                    fprintf(stderr, "  %s delivered %d times\n", it.first.constData(), it.second);
+            }
+        }
+        CHECK(found == expected);
+    }
+    Path::rmdir(root);
+    return 0;
+}
@@ -0,0 +1,27 @@
+#include <rct/EventLoop.h>
+#include <rct/ProcessPool.h>
+#include <rct/Timer.h>
+#include "Test.h"
+
+// destroying a started pool used to call shared_from_this() from the
+// destructor and abort
+int main()
+{
+    EventLoop::SharedPtr loop = std::make_shared<EventLoop>();
+    loop->init(EventLoop::MainEventLoop);
+
+    ProcessPool::SharedPtr pool = ProcessPool::create("/bin/sleep", List<String>() << "10");
+    pool->setSize(2);
+    CHECK(pool->start());
+    CHECK(pool->isRunning());
+    loop->registerTimer([loop](int) { loop->quit(); }, 200, Timer::SingleShot);
+    loop->exec();
+
+    CHECK(pool->workerCount() == 2);
+    pool.reset();
+
+    // the workers were killed, they're reaped from here
+    loop->registerTimer([loop](int) { loop->quit(); }, 200, Timer::SingleShot);
+    loop->exec();
+    return 0;
+}
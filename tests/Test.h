@@ -0,0 +1,17 @@
+#ifndef Test_h
+#define Test_h
+
+#include <stdio.h>
+#include <stdlib.h>
+
+// Regression tests are plain executables run by ctest, a failed check
+// prints where it was and the test exits with 1
+#define CHECK(cond)                                                     \
+    do {                                                                \
+        if (!(cond)) {                                                  \
+            fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+            exit(1);                                                    \
+        }                                                               \
+    } while (0)
+
+#endif